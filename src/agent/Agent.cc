@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <wchar.h>
 
 #include <algorithm>
 #include <string>
@@ -35,23 +36,124 @@
 #include "../include/winpty_constants.h"
 
 #include "../shared/AgentMsg.h"
+#include "../shared/AgentMsgCodec.h"
 #include "../shared/Buffer.h"
 #include "../shared/DebugClient.h"
 #include "../shared/GenRandom.h"
+#include "../shared/OsModule.h"
+#include "../shared/SharedMemoryRing.h"
 #include "../shared/StringBuilder.h"
 #include "../shared/StringUtil.h"
+#include "../shared/TimeMeasurement.h"
 #include "../shared/WindowsVersion.h"
 #include "../shared/WinptyAssert.h"
 
+#include "ConsoleApiStats.h"
+#include "ConsoleEventHook.h"
 #include "ConsoleFont.h"
 #include "ConsoleInput.h"
+#include "CpuCycles.h"
+#include "EtwTrace.h"
+#include "InputThread.h"
 #include "NamedPipe.h"
+#include "PseudoConsole.h"
 #include "Scraper.h"
+#include "ScrollbackHistory.h"
+#include "SessionRecorder.h"
 #include "Terminal.h"
 #include "Win32ConsoleBuffer.h"
+#include "WorkerThread.h"
+
+// Older MinGW headers lack the Vista background processing mode.
+#ifndef PROCESS_MODE_BACKGROUND_BEGIN
+#define PROCESS_MODE_BACKGROUND_BEGIN   0x00100000
+#define PROCESS_MODE_BACKGROUND_END     0x00200000
+#endif
 
 namespace {
 
+// The safety-net poll interval used when scraping is driven by console
+// WinEvents.  It backs off toward the idle interval while nothing happens, so
+// a parked session wakes up roughly once every two seconds.  Any console
+// event or terminal input restores the shorter interval.
+const int kEventDrivenPollIntervalMs = 250;
+const int kEventDrivenIdlePollIntervalMs = 2000;
+
+// When scraping is driven by console WinEvents, scrape at most this often.
+// A program writing continuously generates a steady stream of events.
+const int kEventDrivenMinScrapeIntervalMs = 10;
+
+// The scrape policy of WINPTY_PRIORITY_BACKGROUND.  Polls are spaced out,
+// event-driven scrapes are rate-limited more tightly, and the window is
+// repainted at most a few times a second.
+const int kBackgroundPollIntervalMs = 250;
+const int kBackgroundIdlePollIntervalMs = 2000;
+const int kBackgroundMinScrapeIntervalMs = 250;
+const int kBackgroundMaxFrameRate = 4;
+
+// The shortest poll interval of WINPTY_PRIORITY_FOREGROUND.
+const int kForegroundPollIntervalMs = 5;
+
+// With WINPTY_FLAG_LOW_LATENCY, the poll and scrape interval while input is
+// arriving, and how long after the last input the regular schedule returns.
+const int kLowLatencyPollIntervalMs = 1;
+const DWORD kLowLatencyIdleMs = 2000;
+
+// After input is written to the console, poll at these delays (in
+// milliseconds) to pick up its echo sooner than the regular interval would.
+const int kInputScrapeBurstMs[] = { 1, 3, 8 };
+
+// Freeze and unfreeze cycles timed per method at startup.
+const int kFreezeTimingRounds = 4;
+
+// The poll interval of a paused session.  With PauseMode::TrackHistory,
+// event-driven scrapes are limited to the same cadence.
+const int kPausedPollIntervalMs = 1000;
+const int kPausedIdlePollIntervalMs = 4000;
+
+// The number of overlapped writes kept in flight on CONOUT and CONERR, so
+// the pipe stays busy while the agent is scraping.
+const int kDataPipeWriteDepth = 4;
+
+// The data pipes' kernel buffer sizes with automatic sizing.
+const int kAutoOutPipeBufferSize = 64 * 1024;
+const int kAutoInPipeBufferSize = 4096;
+
+// A scrape that scrolled many lines is encoded in slices, with the pipes
+// serviced in between, so a burst of output doesn't hold up input and
+// control requests.  Each slice's pipe write proceeds while the next slice
+// is encoded.  The first slice is small, so the first bytes go out soon
+// after the capture, and each later slice doubles, up to the maximum (per
+// scraper).
+const size_t kFirstScrapeSliceBytes = 4 * 1024;
+const size_t kMaxScrapeSliceBytes = 64 * 1024;
+
+// The size of the WINPTY_FLAG_SHM_OUTPUT ring.
+const uint32_t kShmOutputCapacity = 1024 * 1024;
+
+// When this much output is waiting for the client, stop scraping until the
+// backlog drops to the low-water mark.  The scrape after that sends the
+// console's latest state, so the intermediate states never build up.
+const size_t kOutputHighWaterBytes = 256 * 1024;
+const size_t kOutputLowWaterBytes = 64 * 1024;
+
+// A CONOUT subscriber doesn't hold up the scrapes.  Once it falls this far
+// behind, its pipe is closed instead.
+const size_t kMaxSubscriberBacklogBytes = 16 * 1024 * 1024;
+
+// While CONIN input is held back for the console (see ConsoleInput), poll
+// at least this often to feed it.
+const int kHeldInputPollMs = 5;
+
+// When the console event hook reports title changes, the title is still
+// re-read this often, in case a change raised no event.
+const int kTitleFallbackIntervalMs = 1000;
+
+// The reply buffer starts big enough for every fixed-size reply, and is
+// replaced after a reply larger than kMaxRetainedReplyBytes.
+const size_t kReplyBufferReserve = 4096;
+const size_t kMaxRetainedReplyBytes = 256 * 1024;
+
 static BOOL WINAPI consoleCtrlHandler(DWORD dwCtrlType)
 {
     if (dwCtrlType == CTRL_C_EVENT) {
@@ -116,12 +218,88 @@ static void detectNewWindows10Console(
     console.setNewW10(isNewW10);
 }
 
+// The cheapest of a few freeze and unfreeze cycles, in microseconds.
+static int64_t timeFreezeCycle(Win32Console &console)
+{
+    int64_t best = INT64_MAX;
+    for (int i = 0; i < kFreezeTimingRounds; ++i) {
+        TimeMeasurement timer;
+        console.setFrozen(true);
+        console.setFrozen(false);
+        best = std::min(best, timer.elapsedUs());
+    }
+    return best;
+}
+
+// Mark freezes the console without moving the cursor on the new Windows 10
+// console, but some builds move the cursor back to where it was when the
+// Mark ended, undoing any move the program made in the meantime.
+static bool markKeepsCursorMoves(Win32Console &console,
+                                 Win32ConsoleBuffer &buffer)
+{
+    const SmallRect window = buffer.windowRect();
+    const Coord before(window.Left, window.Top);
+    const Coord moved(window.Left + 1, window.Top);
+    buffer.setCursorPosition(before);
+    console.setFreezeUsesMark(true);
+    console.setFrozen(true);
+    const bool stayed = buffer.cursorPosition() == before;
+    buffer.setCursorPosition(moved);
+    console.setFrozen(false);
+    console.setFreezeUsesMark(false);
+    const bool kept = buffer.cursorPosition() == moved;
+    buffer.setCursorPosition(Coord(0, 0));
+    return stayed && kept;
+}
+
+// Time each way of freezing the console supported by this build, and use the
+// cheapest.  Where reads without freezing are safe (the new Windows 10
+// console), scrapes also start unfrozen, as long as the extra buffer info
+// query that validates them costs less than a freeze.  Returns the cost of a
+// freeze and unfreeze with the chosen method.
+static int64_t chooseFreezeStrategy(Win32Console &console,
+                                    Win32ConsoleBuffer &buffer)
+{
+    ASSERT(!console.frozen());
+    int64_t cost = timeFreezeCycle(console);
+    const int64_t selectAllCost = cost;
+    int64_t markCost = -1;
+    if (console.isNewW10() && !hasDebugFlag("freeze_select_all") &&
+            markKeepsCursorMoves(console, buffer)) {
+        console.setFreezeUsesMark(true);
+        markCost = timeFreezeCycle(console);
+        if (markCost < cost) {
+            cost = markCost;
+        } else {
+            console.setFreezeUsesMark(false);
+        }
+    }
+
+    int64_t validateCost = INT64_MAX;
+    for (int i = 0; i < kFreezeTimingRounds; ++i) {
+        TimeMeasurement timer;
+        buffer.bufferInfo();
+        validateCost = std::min(validateCost, timer.elapsedUs());
+    }
+    console.setOptimisticReads(console.isNewW10() && validateCost < cost);
+
+    trace("Freeze strategy: SelectAll=%lldus Mark=%lldus validate=%lldus"
+          " -> %s%s",
+          static_cast<long long>(selectAllCost),
+          static_cast<long long>(markCost),
+          static_cast<long long>(validateCost),
+          console.freezeUsesMark() ? "Mark" : "SelectAll",
+          console.optimisticReads() ? ", optimistic reads" : "");
+    return cost;
+}
+
 static inline WriteBuffer newPacket() {
     WriteBuffer packet;
     packet.putRawValue<uint64_t>(0); // Reserve space for size.
     return packet;
 }
 
+
 static HANDLE duplicateHandle(HANDLE h) {
     HANDLE ret = nullptr;
     if (!DuplicateHandle(
@@ -141,76 +319,192 @@ static int64_t int64FromHandle(HANDLE h) {
     return static_cast<int64_t>(reinterpret_cast<intptr_t>(h));
 }
 
+static std::wstring newDataPipeName(const wchar_t *kind) {
+    return (WStringBuilder(128)
+                << L"\\\\.\\pipe\\winpty-"
+                << kind << L'-'
+                << GenRandom::sharedUniqueName()).str_moved();
+}
+
 } // anonymous namespace
 
 Agent::Agent(LPCWSTR controlPipeName,
              uint64_t agentFlags,
              int mouseMode,
              int initialCols,
-             int initialRows) :
+             int initialRows,
+             int minPollIntervalMs,
+             int maxPollIntervalMs,
+             uint64_t historyLimitBytes,
+             int maxFrameRate,
+             int bufferLineCount,
+             int syncMarkerMargin,
+             int maxConsoleWidth,
+             int outPipeBufferSize,
+             int inPipeBufferSize,
+             int coalesceDelayUs,
+             int coalesceBytes,
+             int schedulingClass,
+             uint64_t affinityMask,
+             uint64_t creditBytes,
+             uint64_t creditFrames,
+             int idleTrimMs) :
     m_useConerr((agentFlags & WINPTY_FLAG_CONERR) != 0),
     m_plainMode((agentFlags & WINPTY_FLAG_PLAIN_OUTPUT) != 0),
-    m_mouseMode(mouseMode)
+    m_cellOutput((agentFlags & WINPTY_FLAG_CELL_OUTPUT) != 0),
+    m_mouseMode(mouseMode),
+    m_maxFrameRate(maxFrameRate),
+    m_outPipeBufferSize(outPipeBufferSize),
+    m_inPipeBufferSize(inPipeBufferSize),
+    m_coalesceDelayUs(coalesceDelayUs),
+    m_coalesceBytes(coalesceBytes),
+    m_schedulingClass(schedulingClass),
+    m_affinityMask(affinityMask),
+    m_byteCredits(creditBytes != 0),
+    m_frameCredits(creditFrames != 0),
+    m_creditBytes(static_cast<int64_t>(creditBytes)),
+    m_creditFrames(static_cast<int64_t>(creditFrames)),
+    m_idleTrimMs(idleTrimMs),
+    m_lastActivityTick(GetTickCount())
 {
     trace("Agent::Agent entered");
+    etwRegister();
+    applyAffinity();
 
     ASSERT(initialCols >= 1 && initialRows >= 1);
-    initialCols = std::min(initialCols, MAX_CONSOLE_WIDTH);
-    initialRows = std::min(initialRows, MAX_CONSOLE_HEIGHT);
+    ASSERT(minPollIntervalMs >= 1 && minPollIntervalMs <= maxPollIntervalMs);
+    ASSERT(maxFrameRate >= 0);
+    ASSERT(outPipeBufferSize >= 0 && inPipeBufferSize >= 0);
+    ASSERT(coalesceDelayUs >= 0 && coalesceBytes >= 1);
+    ScrapeGeometry geometry;
+    geometry.bufferLineCount = bufferLineCount;
+    geometry.syncMarkerMargin = syncMarkerMargin;
+    geometry.maxWidth = maxConsoleWidth;
+    m_maxCols = geometry.maxWidth;
+    m_maxRows = geometry.maxHeight();
+    initialCols = std::min(initialCols, m_maxCols);
+    initialRows = std::min(initialRows, m_maxRows);
 
     const bool outputColor =
         !m_plainMode || (agentFlags & WINPTY_FLAG_COLOR_ESCAPES);
+    const bool synchronizedOutput =
+        (agentFlags & WINPTY_FLAG_SYNCHRONIZED_OUTPUT) != 0;
+    const bool repeatEscapes =
+        (agentFlags & WINPTY_FLAG_REPEAT_ESCAPES) != 0;
+    const bool utf16Output = (agentFlags & WINPTY_FLAG_UTF16_OUTPUT) != 0;
+    const bool framedOutput = (agentFlags & WINPTY_FLAG_FRAMED_OUTPUT) != 0;
+    const bool frameStamps = (agentFlags & WINPTY_FLAG_FRAME_STAMPS) != 0;
+    const bool damageRecords =
+        (agentFlags & WINPTY_FLAG_DAMAGE_RECORDS) != 0;
+    m_inputAcks = m_cellOutput && (agentFlags & WINPTY_FLAG_INPUT_ACKS) != 0;
     const Coord initialSize(initialCols, initialRows);
 
-    auto primaryBuffer = openPrimaryBuffer();
+    // Durations of the startup phases, indexed by WINPTY_STARTUP_xxx.  Only
+    // the agent's phases are filled in here.
+    int64_t startupTimesUs[WINPTY_STARTUP_PHASE_COUNT] = {};
+    TimeMeasurement startupTimer;
+
+    // Connect first, so winpty.dll can verify our PID, and queue an early
+    // spawn, while we set up the console.
+    m_controlPipe = &connectToControlPipe(controlPipeName);
+    startupTimesUs[WINPTY_STARTUP_AGENT_CONNECT_PIPE] = startupTimer.lapUs();
+
+    Win32ConsoleBuffer &buffer = primaryBuffer();
     if (m_useConerr) {
         m_errorBuffer = Win32ConsoleBuffer::createErrorBuffer();
+        m_errorBuffer->cacheInfoWhileFrozen(m_console);
     }
 
-    detectNewWindows10Console(m_console, *primaryBuffer);
+    detectNewWindows10Console(m_console, buffer);
+    m_freezeCostUs = chooseFreezeStrategy(m_console, buffer);
+    startupTimesUs[WINPTY_STARTUP_AGENT_OPEN_CONSOLE] = startupTimer.lapUs();
 
-    m_controlPipe = &connectToControlPipe(controlPipeName);
-    m_coninPipe = &createDataServerPipe(false, L"conin");
-    m_conoutPipe = &createDataServerPipe(true, L"conout");
+    if ((agentFlags & WINPTY_FLAG_CONPTY) && !m_useConerr) {
+        createPseudoConsole(initialSize);
+    }
+    if (agentFlags & WINPTY_FLAG_SHM_OUTPUT) {
+        m_conoutPipe = createSharedMemoryPipe(L"conout");
+    }
+    if (m_conoutPipe == nullptr) {
+        m_conoutPipe = &createDataServerPipe(true, L"conout");
+    }
     if (m_useConerr) {
         m_conerrPipe = &createDataServerPipe(true, L"conerr");
     }
-
-    // Send an initial response packet to winpty.dll containing pipe names.
-    {
-        auto setupPacket = newPacket();
-        setupPacket.putWString(m_coninPipe->name());
-        setupPacket.putWString(m_conoutPipe->name());
-        if (m_useConerr) {
-            setupPacket.putWString(m_conerrPipe->name());
+    if (agentFlags & WINPTY_FLAG_COMPRESS_OUTPUT) {
+        m_conoutPipe->setCompressOutput();
+        if (m_conerrPipe != nullptr) {
+            m_conerrPipe->setCompressOutput();
         }
-        writePacket(setupPacket);
     }
 
-    std::unique_ptr<Terminal> primaryTerminal;
-    primaryTerminal.reset(new Terminal(*m_conoutPipe,
-                                       m_plainMode,
-                                       outputColor));
-    m_primaryScraper.reset(new Scraper(m_console,
-                                       *primaryBuffer,
-                                       std::move(primaryTerminal),
-                                       initialSize));
-    if (m_useConerr) {
-        std::unique_ptr<Terminal> errorTerminal;
-        errorTerminal.reset(new Terminal(*m_conerrPipe,
-                                         m_plainMode,
-                                         outputColor));
-        m_errorScraper.reset(new Scraper(m_console,
-                                         *m_errorBuffer,
-                                         std::move(errorTerminal),
-                                         initialSize));
+    // Creating the scrapers sets the font and sizes the buffers, the slow
+    // part of the startup, which waits on conhost.  Do it on a worker while
+    // this thread creates the remaining pipes and sets up the input; the
+    // scrapers use nothing those steps touch.  The pipe objects themselves
+    // are the event loop's, so they stay on this thread.
+    const auto createScrapers = [&]() {
+        std::unique_ptr<Terminal> primaryTerminal;
+        primaryTerminal.reset(new Terminal(*m_conoutPipe,
+                                           m_plainMode,
+                                           outputColor,
+                                           synchronizedOutput,
+                                           m_cellOutput));
+        primaryTerminal->setRepeatEscapes(repeatEscapes);
+        primaryTerminal->setOutputEncoding(utf16Output, framedOutput);
+        primaryTerminal->setInputAcks(m_inputAcks);
+        primaryTerminal->setFrameStamps(frameStamps);
+        primaryTerminal->setDamageRecords(damageRecords);
+        if (historyLimitBytes > 0) {
+            m_history.reset(new ScrollbackHistory(
+                static_cast<size_t>(std::min<uint64_t>(historyLimitBytes,
+                                                       SIZE_MAX)),
+                geometry.bufferLineCount));
+            primaryTerminal->setHistory(m_history.get());
+        }
+        m_primaryScraper.reset(new Scraper(m_console,
+                                           buffer,
+                                           std::move(primaryTerminal),
+                                           initialSize,
+                                           geometry,
+                                           startupTimesUs));
+        if (m_useConerr) {
+            std::unique_ptr<Terminal> errorTerminal;
+            errorTerminal.reset(new Terminal(*m_conerrPipe,
+                                             m_plainMode,
+                                             outputColor,
+                                             synchronizedOutput,
+                                             m_cellOutput));
+            errorTerminal->setRepeatEscapes(repeatEscapes);
+            errorTerminal->setOutputEncoding(utf16Output, framedOutput);
+            errorTerminal->setFrameStamps(frameStamps);
+            errorTerminal->setDamageRecords(damageRecords);
+            m_errorScraper.reset(new Scraper(m_console,
+                                             *m_errorBuffer,
+                                             std::move(errorTerminal),
+                                             initialSize,
+                                             geometry,
+                                             startupTimesUs));
+        }
+    };
+    std::unique_ptr<WorkerThread> startupWorker;
+    if (!hasDebugFlag("serial_startup")) {
+        startupWorker.reset(new WorkerThread);
+        startupWorker->post(createScrapers);
+    } else {
+        createScrapers();
     }
 
-    m_console.setTitle(m_currentTitle);
-
     const HANDLE conin = GetStdHandle(STD_INPUT_HANDLE);
-    m_consoleInput.reset(
-        new ConsoleInput(conin, m_mouseMode, *this, m_console));
+    if (m_pseudoConsole || hasDebugFlag("main_thread_input")) {
+        m_coninPipe = &createDataServerPipe(false, L"conin");
+        m_consoleInput.reset(
+            new ConsoleInput(conin, m_mouseMode, *this, m_console));
+    } else {
+        m_inputThread.reset(new InputThread(*this, newDataPipeName(L"conin"),
+                                            dataPipeInBufferSize(),
+                                            conin, m_mouseMode, m_console));
+    }
 
     // Setup Ctrl-C handling.  First restore default handling of Ctrl-C.  This
     // attribute is inherited by child processes.  Then register a custom
@@ -218,17 +512,76 @@ Agent::Agent(LPCWSTR controlPipeName,
     // agent calls GenerateConsoleCtrlEvent.
     SetConsoleCtrlHandler(NULL, FALSE);
     SetConsoleCtrlHandler(consoleCtrlHandler, TRUE);
+    startupTimesUs[WINPTY_STARTUP_AGENT_CREATE_PIPES] = startupTimer.lapUs();
+
+    if (startupWorker) {
+        startupWorker->wait();
+        startupWorker.reset();
+    }
+    if (m_useConerr) {
+        if (!hasDebugFlag("eager_conerr")) {
+            m_errorScraper->startDormant(*m_errorBuffer);
+        }
+        if (!hasDebugFlag("serial_scrape")) {
+            m_scrapeWorker.reset(new WorkerThread);
+        }
+    }
 
-    setPollInterval(25);
+    m_console.setTitle(m_currentTitle);
+
+    if ((agentFlags & WINPTY_FLAG_EVENT_DRIVEN_SCRAPE) && !m_pseudoConsole) {
+        m_consoleEventHook.reset(new ConsoleEventHook(m_console.hwnd(), *this));
+        if (!m_consoleEventHook->valid()) {
+            trace("Console event hook unavailable -- falling back to polling");
+            m_consoleEventHook.reset();
+        }
+    }
+    setLowPowerIdle((agentFlags & WINPTY_FLAG_LOW_POWER_IDLE) != 0);
+    m_lowLatency = (agentFlags & WINPTY_FLAG_LOW_LATENCY) != 0 &&
+        !m_pseudoConsole;
+    if (m_consoleEventHook) {
+        setPumpWindowMessages(true);
+        m_minPollIntervalMs = kEventDrivenPollIntervalMs;
+        m_maxPollIntervalMs = kEventDrivenIdlePollIntervalMs;
+    } else {
+        m_minPollIntervalMs = minPollIntervalMs;
+        m_maxPollIntervalMs = maxPollIntervalMs;
+    }
+    applyPriority(WINPTY_PRIORITY_NORMAL);
+
+    // The font and resize phases overlapped the pipe phase, so only the
+    // part of the wait beyond them counts here.
+    startupTimesUs[WINPTY_STARTUP_AGENT_OTHER] = std::max<int64_t>(0,
+        startupTimer.lapUs() -
+        startupTimesUs[WINPTY_STARTUP_AGENT_SET_FONT] -
+        startupTimesUs[WINPTY_STARTUP_AGENT_RESIZE_BUFFER]);
+
+    // Send an initial response packet to winpty.dll containing pipe names
+    // and the agent's startup timings.  It is sent last so that winpty_open
+    // returns with the agent fully initialized, and the timings are complete.
+    {
+        auto setupPacket = newPacket();
+        setupPacket.putWString(m_inputThread ? m_inputThread->pipeName()
+                                             : m_coninPipe->name());
+        setupPacket.putWString(m_conoutPipe->name());
+        if (m_useConerr) {
+            setupPacket.putWString(m_conerrPipe->name());
+        }
+        setupPacket.putInt32(WINPTY_STARTUP_PHASE_COUNT);
+        for (int i = 0; i < WINPTY_STARTUP_PHASE_COUNT; ++i) {
+            setupPacket.putInt64(startupTimesUs[i]);
+        }
+        setupPacket.putInt32(m_conoutPipe->compressesOutput());
+        writePacket(setupPacket);
+    }
 }
 
 Agent::~Agent()
 {
     trace("Agent::~Agent entered");
+    setLowLatencyActive(false);
     agentShutdown();
-    if (m_childProcess != NULL) {
-        CloseHandle(m_childProcess);
-    }
+    releaseChildProcess();
 }
 
 // Write a "Device Status Report" command to the terminal.  The terminal will
@@ -237,8 +590,8 @@ Agent::~Agent()
 // bytes before it are complete keypresses.
 void Agent::sendDsr()
 {
-    if (!m_plainMode && !m_conoutPipe->isClosed()) {
-        m_conoutPipe->write("\x1B[6n");
+    if (!m_plainMode && !m_cellOutput && !m_conoutPipe->isClosed()) {
+        m_primaryScraper->terminal().sendDsr();
     }
 }
 
@@ -253,28 +606,102 @@ NamedPipe &Agent::connectToControlPipe(LPCWSTR pipeName)
 // Returns a new server named pipe.  It has not yet been connected.
 NamedPipe &Agent::createDataServerPipe(bool write, const wchar_t *kind)
 {
-    const auto name =
-        (WStringBuilder(128)
-            << L"\\\\.\\pipe\\winpty-"
-            << kind << L'-'
-            << GenRandom().uniqueName()).str_moved();
     NamedPipe &pipe = createNamedPipe();
+    openDataServerPipe(pipe, write, kind);
+    return pipe;
+}
+
+int Agent::dataPipeOutBufferSize() const
+{
+    return m_outPipeBufferSize != 0 ? m_outPipeBufferSize
+                                    : kAutoOutPipeBufferSize;
+}
+
+int Agent::dataPipeInBufferSize() const
+{
+    return m_inPipeBufferSize != 0 ? m_inPipeBufferSize
+                                   : kAutoInPipeBufferSize;
+}
+
+// Opens a closed pipe object as a server pipe with a new name.
+void Agent::openDataServerPipe(NamedPipe &pipe, bool write,
+                               const wchar_t *kind)
+{
+    const auto name = newDataPipeName(kind);
+    if (write) {
+        pipe.setIoDepth(1, kDataPipeWriteDepth);
+        pipe.setAutoGrowWrites(m_outPipeBufferSize == 0);
+        pipe.setWriteCoalescing(m_coalesceDelayUs, m_coalesceBytes);
+    }
     pipe.openServerPipe(
         name.c_str(),
         write ? NamedPipe::OpenMode::Writing
               : NamedPipe::OpenMode::Reading,
-        write ? 8192 : 0,
-        write ? 0 : 256);
+        write ? dataPipeOutBufferSize() : 0,
+        write ? 0 : dataPipeInBufferSize());
     if (!write) {
         pipe.setReadBufferSize(64 * 1024);
     }
-    return pipe;
+}
+
+// Returns a pipe that writes to a new shared memory ring, or nullptr if the
+// ring can't be created.
+NamedPipe *Agent::createSharedMemoryPipe(const wchar_t *kind)
+{
+    NamedPipe &pipe = createNamedPipe();
+    if (!openSharedMemoryPipe(pipe, kind)) {
+        return nullptr;
+    }
+    return &pipe;
+}
+
+bool Agent::openSharedMemoryPipe(NamedPipe &pipe, const wchar_t *kind)
+{
+    const auto name =
+        (WStringBuilder(128)
+            << SharedMemoryRing::namePrefix()
+            << kind << L'-'
+            << GenRandom::sharedUniqueName()).str_moved();
+    auto ring = SharedMemoryRing::create(name, kShmOutputCapacity);
+    if (!ring) {
+        trace("Shared memory output unavailable -- using a named pipe");
+        return false;
+    }
+    pipe.openSharedMemoryRing(std::move(ring));
+    return true;
+}
+
+// Replaces a data pipe with a new one of the same kind, discarding whatever
+// the old client left unread or unsent.  The NamedPipe object is reused, so
+// the Terminal writing to it, and any completion packets still queued for it,
+// stay valid.
+void Agent::reopenDataPipe(NamedPipe &pipe, bool write, const wchar_t *kind)
+{
+    const bool wasRing = pipe.usesSharedMemoryRing();
+    pipe.closePipe();
+    if (write) {
+        pipe.discardOutput();
+    } else {
+        pipe.discard(pipe.bytesAvailable());
+    }
+    if (!wasRing || !openSharedMemoryPipe(pipe, kind)) {
+        openDataServerPipe(pipe, write, kind);
+    }
 }
 
 void Agent::onPipeIo(NamedPipe &namedPipe)
 {
     if (&namedPipe == m_conoutPipe || &namedPipe == m_conerrPipe) {
+        if (m_outputCongested && !isOutputCongested()) {
+            // Catch up now that the client is reading again.
+            requestPoll();
+        }
+        if (m_pseudoConsole) {
+            forwardPseudoConsoleOutput();
+        }
         autoClosePipesForShutdown();
+    } else if (&namedPipe == m_ptyOutputPipe) {
+        forwardPseudoConsoleOutput();
     } else if (&namedPipe == m_coninPipe) {
         pollConinPipe();
     } else if (&namedPipe == m_controlPipe) {
@@ -289,29 +716,69 @@ void Agent::pollControlPipe()
         shutdown();
         return;
     }
-
-    while (true) {
+    m_console.probe().beginTick();
+
+    // Find every complete packet first, so that a run of consecutive SetSize
+    // packets (e.g. from a GUI window drag) can be collapsed into its last
+    // element.  Each packet is still answered, in order.
+    //
+    // The packets are decoded in place.  Discarding them from the input
+    // queue leaves the bytes where they are, and the handlers only queue
+    // writes, so the queue doesn't change until the next read completes.
+    const char *const data = m_controlPipe->peekData();
+    const size_t avail = m_controlPipe->bytesAvailable();
+    size_t consumed = 0;
+    m_controlPackets.clear();
+    while (avail - consumed >= sizeof(uint64_t)) {
         uint64_t packetSize = 0;
-        const auto amt1 =
-            m_controlPipe->peek(&packetSize, sizeof(packetSize));
-        if (amt1 < sizeof(packetSize)) {
-            break;
-        }
+        memcpy(&packetSize, &data[consumed], sizeof(packetSize));
         ASSERT(packetSize >= sizeof(packetSize) && packetSize <= SIZE_MAX);
-        if (m_controlPipe->bytesAvailable() < packetSize) {
+        if (avail - consumed < packetSize) {
             if (m_controlPipe->readBufferSize() < packetSize) {
                 m_controlPipe->setReadBufferSize(packetSize);
             }
             break;
         }
-        std::vector<char> packetData;
-        packetData.resize(packetSize);
-        const auto amt2 = m_controlPipe->read(packetData.data(), packetSize);
-        ASSERT(amt2 == packetSize);
+        // The type is a tagged value, like the rest of the packet, so it's
+        // decoded rather than copied out.  A malformed packet fails again in
+        // the loop below.
+        int32_t type = -1;
         try {
-            ReadBuffer buffer(std::move(packetData));
+            ReadBuffer header(&data[consumed], packetSize);
+            header.getRawValue<uint64_t>();
+            type = header.getInt32();
+        } catch (const ReadBuffer::DecodeError&) {
+        }
+        m_controlPackets.push_back(ControlPacket { consumed, packetSize, type });
+        consumed += packetSize;
+    }
+
+    m_controlPipe->discard(consumed);
+
+    const auto &packets = m_controlPackets;
+    for (size_t i = 0; i < packets.size(); ++i) {
+        try {
+            ReadBuffer buffer(&data[packets[i].offset], packets[i].size);
             buffer.getRawValue<uint64_t>(); // Discard the size.
-            handlePacket(buffer);
+            if (packets[i].type == AgentMsg::SetSize &&
+                    i + 1 < packets.size() &&
+                    packets[i + 1].type == AgentMsg::SetSize) {
+                // A later SetSize supersedes this one.  Validate it and
+                // send the reply, but skip the resize itself.
+                buffer.getInt32(); // Discard the type.
+                const int64_t requestId = buffer.getInt64();
+                SetSizeMsg msg;
+                getAgentMsg(buffer, msg);
+                auto &reply = newReplyPacket(requestId);
+                writePacket(reply);
+                continue;
+            }
+            TimeMeasurement timer;
+            {
+                CycleScope cycles(m_cpuCycles[WINPTY_COST_CONTROL]);
+                handlePacket(buffer);
+            }
+            m_controlPacketHistogram.record(timer.elapsedUs());
         } catch (const ReadBuffer::DecodeError&) {
             ASSERT(false && "Decode error");
         }
@@ -321,26 +788,82 @@ void Agent::pollControlPipe()
 void Agent::handlePacket(ReadBuffer &packet)
 {
     const int type = packet.getInt32();
+    const int64_t requestId = packet.getInt64();
     switch (type) {
     case AgentMsg::StartProcess:
-        handleStartProcessPacket(packet);
+        handleStartProcessPacket(packet, requestId);
         break;
     case AgentMsg::SetSize:
-        // TODO: I think it might make sense to collapse consecutive SetSize
-        // messages.  i.e. The terminal process can probably generate SetSize
-        // messages faster than they can be processed, and some GUIs might
-        // generate a flood of them, so if we can read multiple SetSize packets
-        // at once, we can ignore the early ones.
-        handleSetSizePacket(packet);
+        // Runs of consecutive SetSize packets are collapsed in
+        // pollControlPipe.
+        handleSetSizePacket(packet, requestId);
         break;
     case AgentMsg::GetConsoleProcessList:
-        handleGetConsoleProcessListPacket(packet);
+        handleGetConsoleProcessListPacket(packet, requestId);
+        break;
+    case AgentMsg::GetStats:
+        handleGetStatsPacket(packet, requestId);
+        break;
+    case AgentMsg::GetHistograms:
+        handleGetHistogramsPacket(packet, requestId);
+        break;
+    case AgentMsg::GetConsoleApiStats:
+        handleGetConsoleApiStatsPacket(packet, requestId);
+        break;
+    case AgentMsg::GetHistory:
+        handleGetHistoryPacket(packet, requestId);
+        break;
+    case AgentMsg::Reattach:
+        handleReattachPacket(packet, requestId);
+        break;
+    case AgentMsg::WaitProcessListChange:
+        handleWaitProcessListChangePacket(packet, requestId);
+        break;
+    case AgentMsg::SetPriority:
+        handleSetPriorityPacket(packet, requestId);
+        break;
+    case AgentMsg::SetPaused:
+        handleSetPausedPacket(packet, requestId);
+        break;
+    case AgentMsg::SetScheduling:
+        handleSetSchedulingPacket(packet, requestId);
+        break;
+    case AgentMsg::GrantOutputCredits:
+        handleGrantOutputCreditsPacket(packet, requestId);
+        break;
+    case AgentMsg::GetScreen:
+        handleGetScreenPacket(packet, requestId);
+        break;
+    case AgentMsg::AddOutputSubscriber:
+        handleAddOutputSubscriberPacket(packet, requestId);
+        break;
+    case AgentMsg::StartRecording:
+        handleStartRecordingPacket(packet, requestId);
         break;
     default:
         trace("Unrecognized message, id:%d", type);
     }
 }
 
+// Every reply echoes the request ID of the packet it answers, so that
+// libwinpty can match pipelined requests to their replies.  Each reply is
+// written before the next packet is handled, so they share one buffer.
+WriteBuffer &Agent::newReplyPacket(int64_t requestId)
+{
+    if (!m_replyBuffer ||
+            m_replyBuffer->buf().capacity() > kMaxRetainedReplyBytes) {
+        // Don't hold on to the storage of an unusually large reply (e.g.
+        // a scrollback history dump).
+        m_replyBuffer.reset(new WriteBuffer);
+        m_replyBuffer->reserve(kReplyBufferReserve);
+    }
+    WriteBuffer &packet = *m_replyBuffer;
+    packet.clear();
+    packet.putRawValue<uint64_t>(0); // Reserve space for size.
+    packet.putInt64(requestId);
+    return packet;
+}
+
 void Agent::writePacket(WriteBuffer &packet)
 {
     const auto &bytes = packet.buf();
@@ -348,34 +871,38 @@ void Agent::writePacket(WriteBuffer &packet)
     m_controlPipe->write(bytes.data(), bytes.size());
 }
 
-void Agent::handleStartProcessPacket(ReadBuffer &packet)
+void Agent::handleStartProcessPacket(ReadBuffer &packet, int64_t requestId)
 {
     ASSERT(m_childProcess == nullptr);
     ASSERT(!m_closingOutputPipes);
 
+    // Each string is decoded straight into the NUL-terminated buffer
+    // CreateProcess takes.  The environment block arrives with its own
+    // terminators; the extra NUL is harmless.
+    TimeMeasurement timer;
     const uint64_t spawnFlags = packet.getInt64();
     const bool wantProcessHandle = packet.getInt32() != 0;
     const bool wantThreadHandle = packet.getInt32() != 0;
-    const auto program = packet.getWString();
-    const auto cmdline = packet.getWString();
-    const auto cwd = packet.getWString();
-    const auto env = packet.getWString();
-    const auto desktop = packet.getWString();
+    std::vector<wchar_t> program, cmdline, cwd, env, desktop;
+    packet.getWStringWithNul(program);
+    packet.getWStringWithNul(cmdline);
+    packet.getWStringWithNul(cwd);
+    packet.getWStringWithNul(env);
+    packet.getWStringWithNul(desktop);
     packet.assertEof();
 
-    auto cmdlineV = vectorWithNulFromString(cmdline);
-    auto desktopV = vectorWithNulFromString(desktop);
-    auto envV = vectorFromString(env);
-
-    LPCWSTR programArg = program.empty() ? nullptr : program.c_str();
-    LPWSTR cmdlineArg = cmdline.empty() ? nullptr : cmdlineV.data();
-    LPCWSTR cwdArg = cwd.empty() ? nullptr : cwd.c_str();
-    LPWSTR envArg = env.empty() ? nullptr : envV.data();
+    const auto argOrNull = [](std::vector<wchar_t> &str) {
+        return str.size() > 1 ? str.data() : nullptr;
+    };
+    LPCWSTR programArg = argOrNull(program);
+    LPWSTR cmdlineArg = argOrNull(cmdline);
+    LPCWSTR cwdArg = argOrNull(cwd);
+    LPWSTR envArg = argOrNull(env);
 
     STARTUPINFOW sui = {};
     PROCESS_INFORMATION pi = {};
     sui.cb = sizeof(sui);
-    sui.lpDesktop = desktop.empty() ? nullptr : desktopV.data();
+    sui.lpDesktop = argOrNull(desktop);
     BOOL inheritHandles = FALSE;
     if (m_useConerr) {
         inheritHandles = TRUE;
@@ -385,56 +912,305 @@ void Agent::handleStartProcessPacket(ReadBuffer &packet)
         sui.hStdError = m_errorBuffer->conout();
     }
 
-    const BOOL success =
-        CreateProcessW(programArg, cmdlineArg, nullptr, nullptr,
-                       /*bInheritHandles=*/inheritHandles,
-                       /*dwCreationFlags=*/CREATE_UNICODE_ENVIRONMENT,
-                       envArg, cwdArg, &sui, &pi);
+    const int64_t decodeUs = timer.lapUs();
+    const BOOL success = m_pseudoConsole
+        ? m_pseudoConsole->createProcess(programArg, cmdlineArg, cwdArg,
+                                         envArg, sui.lpDesktop, pi)
+        : CreateProcessW(programArg, cmdlineArg, nullptr, nullptr,
+                         /*bInheritHandles=*/inheritHandles,
+                         /*dwCreationFlags=*/CREATE_UNICODE_ENVIRONMENT,
+                         envArg, cwdArg, &sui, &pi);
     const int lastError = success ? 0 : GetLastError();
+    const int64_t createUs = timer.lapUs();
 
     trace("CreateProcess: %s %u",
           (success ? "success" : "fail"),
           static_cast<unsigned int>(pi.dwProcessId));
 
-    auto reply = newPacket();
+    auto &reply = newReplyPacket(requestId);
     if (success) {
         int64_t replyProcess = 0;
         int64_t replyThread = 0;
         if (wantProcessHandle) {
             replyProcess = int64FromHandle(duplicateHandle(pi.hProcess));
         }
+        // The agent doesn't keep the thread handle, so libwinpty takes the
+        // original rather than a duplicate.
         if (wantThreadHandle) {
-            replyThread = int64FromHandle(duplicateHandle(pi.hThread));
+            replyThread = int64FromHandle(pi.hThread);
+        } else {
+            CloseHandle(pi.hThread);
         }
-        CloseHandle(pi.hThread);
+        const int64_t handlesUs = timer.lapUs();
         m_childProcess = pi.hProcess;
         m_autoShutdown = (spawnFlags & WINPTY_SPAWN_FLAG_AUTO_SHUTDOWN) != 0;
         m_exitAfterShutdown = (spawnFlags & WINPTY_SPAWN_FLAG_EXIT_AFTER_SHUTDOWN) != 0;
+        if (m_autoShutdown) {
+            watchChildProcess();
+        }
+        invalidateInputFlags();
         reply.putInt32(static_cast<int32_t>(StartProcessResult::ProcessCreated));
         reply.putInt64(replyProcess);
         reply.putInt64(replyThread);
+        reply.putInt64(decodeUs);
+        reply.putInt64(createUs);
+        reply.putInt64(handlesUs);
     } else {
         reply.putInt32(static_cast<int32_t>(StartProcessResult::CreateProcessFailed));
         reply.putInt32(lastError);
+        reply.putInt64(decodeUs);
+        reply.putInt64(createUs);
+        reply.putInt64(0);
+    }
+    writePacket(reply);
+}
+
+void Agent::handleSetSizePacket(ReadBuffer &packet, int64_t requestId)
+{
+    SetSizeMsg msg;
+    getAgentMsg(packet, msg);
+    resizeWindow(msg.cols, msg.rows);
+    auto &reply = newReplyPacket(requestId);
+    writePacket(reply);
+}
+
+void Agent::handleSetPriorityPacket(ReadBuffer &packet, int64_t requestId)
+{
+    SetPriorityMsg msg;
+    getAgentMsg(packet, msg);
+    if (msg.level != m_priority) {
+        applyPriority(msg.level);
+        // Let a session brought to the foreground catch up at once, rather
+        // than at the end of a background poll interval.
+        requestPoll();
+    }
+    auto &reply = newReplyPacket(requestId);
+    writePacket(reply);
+}
+
+// Sets the poll interval, the scrape rate limit, the repaint cap, and the
+// process priority for a WINPTY_PRIORITY_xxx level.  With the console event
+// hook, the configured interval is the safety-net poll, and foreground
+// scrapes are already driven by the events.
+void Agent::applyPriority(int level)
+{
+    int minPollMs = m_minPollIntervalMs;
+    int maxPollMs = m_maxPollIntervalMs;
+    int minScrapeMs = m_consoleEventHook ? kEventDrivenMinScrapeIntervalMs : 0;
+    int frameRate = m_maxFrameRate;
+    DWORD priorityClass = NORMAL_PRIORITY_CLASS;
+    if (level == WINPTY_PRIORITY_BACKGROUND) {
+        minPollMs = std::max(minPollMs, kBackgroundPollIntervalMs);
+        maxPollMs = std::max(maxPollMs, kBackgroundIdlePollIntervalMs);
+        minScrapeMs = std::max(minScrapeMs, kBackgroundMinScrapeIntervalMs);
+        frameRate = frameRate == 0
+            ? kBackgroundMaxFrameRate
+            : std::min(frameRate, kBackgroundMaxFrameRate);
+        priorityClass = BELOW_NORMAL_PRIORITY_CLASS;
+    } else if (level == WINPTY_PRIORITY_FOREGROUND) {
+        if (!m_consoleEventHook) {
+            minPollMs = std::min(minPollMs, kForegroundPollIntervalMs);
+        }
+    } else if (level != WINPTY_PRIORITY_NORMAL) {
+        trace("Unrecognized priority level %d -- using normal", level);
+        level = WINPTY_PRIORITY_NORMAL;
+    }
+    if (m_lowLatencyActive && level != WINPTY_PRIORITY_BACKGROUND &&
+            m_pauseMode == PauseMode::Running) {
+        minPollMs = kLowLatencyPollIntervalMs;
+        maxPollMs = kLowLatencyPollIntervalMs;
+        minScrapeMs = 0;
+    }
+    if (m_pauseMode != PauseMode::Running) {
+        minPollMs = std::max(minPollMs, kPausedPollIntervalMs);
+        maxPollMs = std::max(maxPollMs, kPausedIdlePollIntervalMs);
+        minScrapeMs = std::max(minScrapeMs, kPausedPollIntervalMs);
+        priorityClass = BELOW_NORMAL_PRIORITY_CLASS;
     }
+    trace("Session priority %d: poll %d-%d ms, frame rate %d",
+          level, minPollMs, maxPollMs, frameRate);
+    m_priority = level;
+    m_minScrapeIntervalMs = minScrapeMs;
+    setPollInterval(minPollMs, maxPollMs);
+    m_primaryScraper->setMaxFrameRate(frameRate);
+    if (m_errorScraper) {
+        m_errorScraper->setMaxFrameRate(frameRate);
+    }
+    applyProcessPriority(priorityClass);
+}
+
+void Agent::handleSetSchedulingPacket(ReadBuffer &packet, int64_t requestId)
+{
+    SetSchedulingMsg msg;
+    getAgentMsg(packet, msg);
+    if (msg.affinityMask != m_affinityMask) {
+        m_affinityMask = msg.affinityMask;
+        applyAffinity();
+    }
+    if (msg.schedulingClass != m_schedulingClass) {
+        m_schedulingClass = msg.schedulingClass;
+        applyPriority(m_priority);
+    }
+    auto &reply = newReplyPacket(requestId);
     writePacket(reply);
 }
 
-void Agent::handleSetSizePacket(ReadBuffer &packet)
+// The scheduling class adjusts the CPU priority the session priority chose.
+// Background processing mode also lowers the I/O and memory priorities, and
+// replaces the priority class while it lasts.  Windows only lets a process
+// enter or leave the mode itself.
+void Agent::applyProcessPriority(DWORD priorityClass)
+{
+    if (m_schedulingClass < WINPTY_SCHEDULING_DEFAULT ||
+            m_schedulingClass > WINPTY_SCHEDULING_BATCH) {
+        trace("Unrecognized scheduling class %d -- using the default",
+              m_schedulingClass);
+        m_schedulingClass = WINPTY_SCHEDULING_DEFAULT;
+    }
+    const bool background = m_schedulingClass == WINPTY_SCHEDULING_BATCH;
+    if (background != m_backgroundMode) {
+        if (!SetPriorityClass(GetCurrentProcess(),
+                              background ? PROCESS_MODE_BACKGROUND_BEGIN
+                                         : PROCESS_MODE_BACKGROUND_END)) {
+            trace("SetPriorityClass(background=%d) failed: %u",
+                  static_cast<int>(background),
+                  static_cast<unsigned>(GetLastError()));
+        } else {
+            m_backgroundMode = background;
+        }
+    }
+    if (m_backgroundMode) {
+        return;
+    }
+    if (m_schedulingClass == WINPTY_SCHEDULING_INTERACTIVE &&
+            priorityClass == NORMAL_PRIORITY_CLASS) {
+        priorityClass = ABOVE_NORMAL_PRIORITY_CLASS;
+    }
+    if (!SetPriorityClass(GetCurrentProcess(), priorityClass)) {
+        trace("SetPriorityClass failed: %u",
+              static_cast<unsigned>(GetLastError()));
+    }
+}
+
+// Processors the system doesn't have are dropped from the mask.  A mask of
+// 0, or one naming none of them, allows every processor.
+void Agent::applyAffinity()
+{
+    DWORD_PTR processMask = 0;
+    DWORD_PTR systemMask = 0;
+    if (!GetProcessAffinityMask(GetCurrentProcess(),
+                                &processMask, &systemMask)) {
+        trace("GetProcessAffinityMask failed: %u",
+              static_cast<unsigned>(GetLastError()));
+        return;
+    }
+    DWORD_PTR mask = static_cast<DWORD_PTR>(m_affinityMask) & systemMask;
+    if (mask == 0) {
+        if (m_affinityMask != 0) {
+            trace("Affinity mask 0x%llx names no processor -- ignoring it",
+                  static_cast<unsigned long long>(m_affinityMask));
+        }
+        mask = systemMask;
+    }
+    if (mask == processMask) {
+        return;
+    }
+    trace("Processor affinity 0x%llx",
+          static_cast<unsigned long long>(mask));
+    if (!SetProcessAffinityMask(GetCurrentProcess(), mask)) {
+        trace("SetProcessAffinityMask failed: %u",
+              static_cast<unsigned>(GetLastError()));
+    }
+}
+
+void Agent::handleSetPausedPacket(ReadBuffer &packet, int64_t requestId)
+{
+    SetPausedMsg msg;
+    getAgentMsg(packet, msg);
+    const int32_t mode = msg.mode;
+    if (mode >= static_cast<int32_t>(PauseMode::Running) &&
+            mode <= static_cast<int32_t>(PauseMode::Stopped)) {
+        setPauseMode(static_cast<PauseMode>(mode));
+    } else {
+        trace("Unrecognized pause mode %d", static_cast<int>(mode));
+    }
+    auto &reply = newReplyPacket(requestId);
+    writePacket(reply);
+}
+
+// A paused session holds back its window repaints.  With TrackHistory, it
+// still scrapes at a low cadence, so the lines scrolling into the history
+// are sent, and resuming sends the held repaint.  Stopped skips the scrapes,
+// so resuming can't tell what scrolled past, and repaints from scratch.
+void Agent::setPauseMode(PauseMode mode)
+{
+    if (mode == m_pauseMode) {
+        return;
+    }
+    trace("Pause mode %d -> %d",
+          static_cast<int>(m_pauseMode), static_cast<int>(mode));
+    const bool hold = mode != PauseMode::Running;
+    for (Scraper *scraper : { m_primaryScraper.get(), m_errorScraper.get() }) {
+        if (scraper == nullptr) {
+            continue;
+        }
+        scraper->setHoldFrames(hold);
+        if (mode == PauseMode::Stopped) {
+            // Consumed by the first scrape after the pause.
+            scraper->repaintOnNextScrape();
+        }
+    }
+    m_pauseMode = mode;
+    applyPriority(m_priority);
+    if (!hold) {
+        requestPoll();
+    }
+}
+
+void Agent::handleGetConsoleProcessListPacket(ReadBuffer &packet, int64_t requestId)
 {
-    const int cols = packet.getInt32();
-    const int rows = packet.getInt32();
     packet.assertEof();
-    resizeWindow(cols, rows);
-    auto reply = newPacket();
+    consoleProcessList();
+    auto &reply = newReplyPacket(requestId);
+    putProcessList(reply);
     writePacket(reply);
 }
 
-void Agent::handleGetConsoleProcessListPacket(ReadBuffer &packet)
+// Replies once the process list differs from the given generation, which is
+// immediately unless the client already has the current list.  Replies to
+// these requests can therefore arrive out of request order.
+void Agent::handleWaitProcessListChangePacket(ReadBuffer &packet, int64_t requestId)
 {
+    const uint64_t knownGeneration = packet.getInt64();
     packet.assertEof();
+    consoleProcessList();
+    if (knownGeneration != m_processListGeneration) {
+        auto &reply = newReplyPacket(requestId);
+        reply.putInt64(m_processListGeneration);
+        putProcessList(reply);
+        writePacket(reply);
+    } else {
+        m_processListWaiters.push_back(requestId);
+    }
+}
 
-    auto processList = std::vector<DWORD>(64);
+const std::vector<DWORD> &Agent::consoleProcessList()
+{
+    if (!m_consoleEventHook || !m_processListValid) {
+        updateProcessList();
+    }
+    return m_processList;
+}
+
+// Re-reads the process list, and if it changed, starts a new generation and
+// answers the waiting requests.
+void Agent::updateProcessList()
+{
+    // The list rarely changes, so read it into scratch memory and copy it
+    // only when it did.
+    std::vector<DWORD, ArenaAllocator<DWORD>> processList(
+        std::max<size_t>(m_processList.size(), 64), 0,
+        ArenaAllocator<DWORD>(tickArena()));
     auto processCount = GetConsoleProcessList(&processList[0], processList.size());
 
     // The process list can change while we're trying to read it
@@ -448,67 +1224,759 @@ void Agent::handleGetConsoleProcessListPacket(ReadBuffer &packet)
     if (processCount == 0) {
         trace("GetConsoleProcessList failed");
     }
+    processList.resize(processCount);
+    m_processListValid = true;
+    if (processList.size() == m_processList.size() &&
+            std::equal(processList.begin(), processList.end(),
+                       m_processList.begin())) {
+        return;
+    }
+    m_processList.assign(processList.begin(), processList.end());
+    ++m_processListGeneration;
+
+    std::vector<int64_t> waiters;
+    waiters.swap(m_processListWaiters);
+    for (const int64_t requestId : waiters) {
+        auto &reply = newReplyPacket(requestId);
+        reply.putInt64(m_processListGeneration);
+        putProcessList(reply);
+        writePacket(reply);
+    }
+}
 
-    auto reply = newPacket();
-    reply.putInt32(processCount);
-    for (DWORD i = 0; i < processCount; i++) {
-        reply.putInt32(processList[i]);
+// Appends the list last read by consoleProcessList or updateProcessList.
+// Re-reading it here could answer the waiters, which would reuse the buffer
+// the caller's reply is in.
+void Agent::putProcessList(WriteBuffer &reply)
+{
+    reply.putInt32(m_processList.size());
+    for (const DWORD pid : m_processList) {
+        reply.putInt32(pid);
+    }
+}
+
+// Replies with the newest lines of the scrollback history.  Without a
+// history, the reply has no lines.
+void Agent::handleGetHistoryPacket(ReadBuffer &packet, int64_t requestId)
+{
+    const uint64_t maxLines = packet.getInt64();
+    packet.assertEof();
+    auto &reply = newReplyPacket(requestId);
+    if (m_history) {
+        m_history->appendReply(reply, maxLines);
+    } else {
+        reply.putInt64(0);
+        reply.putInt32(0);
     }
     writePacket(reply);
 }
 
-void Agent::pollConinPipe()
+// Replies with the text and colors of the console window, read now rather
+// than taken from the last frame sent, and the cursor position within the
+// window.  With a pseudoconsole, there's no window to read, and the reply is
+// an empty screen.
+void Agent::handleGetScreenPacket(ReadBuffer &packet, int64_t requestId)
 {
-    const std::string newData = m_coninPipe->readAllToString();
-    if (hasDebugFlag("input_separated_bytes")) {
-        // This debug flag is intended to help with testing incomplete escape
-        // sequences and multibyte UTF-8 encodings.  (I wonder if the normal
-        // code path ought to advance a state machine one byte at a time.)
-        for (size_t i = 0; i < newData.size(); ++i) {
-            m_consoleInput->writeInput(newData.substr(i, 1));
+    packet.assertEof();
+    if (m_pseudoConsole) {
+        auto &reply = newReplyPacket(requestId);
+        for (int i = 0; i < 6; ++i) {
+            reply.putInt32(0);
         }
+        writePacket(reply);
+        return;
+    }
+
+    LargeConsoleReadBuffer readBuffer;
+    ConsoleScreenBufferInfo info;
+    bool cursorVisible = false;
+    {
+        Win32Console::FreezeGuard guard(m_console, m_console.frozen());
+        m_primaryScraper->readWindow(primaryBuffer(), readBuffer, info,
+                                     cursorVisible);
+    }
+
+    const SmallRect window = info.windowRect();
+    const Coord cursor = info.cursorPosition();
+    auto &reply = newReplyPacket(requestId);
+    reply.putInt32(window.width());
+    reply.putInt32(window.height());
+    reply.putInt32(cursor.X - window.left());
+    reply.putInt32(cursor.Y - window.top());
+    reply.putInt32(cursorVisible);
+    reply.putInt32(window.height());
+    std::string text;
+    std::vector<std::pair<uint32_t, uint16_t>> runs;
+    for (int line = window.top(); line <= window.Bottom; ++line) {
+        Terminal::encodeLineText(readBuffer.lineData(line), window.width(),
+                                 text, runs);
+        reply.putInt32(static_cast<int32_t>(text.size()));
+        reply.putRawData(text.data(), text.size());
+        reply.putInt32(static_cast<int32_t>(runs.size()));
+        for (const auto &run : runs) {
+            reply.putInt32(static_cast<int32_t>(run.first));
+            reply.putInt32(run.second);
+        }
+    }
+    writePacket(reply);
+}
+
+// Moves the session to freshly named data pipes, for a client that lost (or
+// never had) the original ones, and replies with the new names.  The new
+// CONOUT starts with a single frame repainting the whole window, plus the
+// title and mouse mode, so the client doesn't need the output it missed.
+void Agent::handleReattachPacket(ReadBuffer &packet, int64_t requestId)
+{
+    packet.assertEof();
+    trace("Reattaching the data pipes");
+
+    if (m_inputThread) {
+        // The input thread owns CONIN, so replace the thread.  Its counters
+        // restart from zero.
+        m_retiredConinBytes += m_inputThread->bytesRead();
+        m_retiredInputRecords += m_inputThread->recordsWritten();
+        m_retiredInputLatency.add(m_inputThread->inputLatency());
+        m_cpuCycles[WINPTY_COST_INPUT] += m_inputThread->cpuCycles();
+        m_retiredInputLoopStats.add(m_inputThread->sharedLoopStats());
+        m_retiredConinWakeups += m_inputThread->pipeWakeups();
+        m_inputThread.reset();
+        m_inputThread.reset(new InputThread(*this, newDataPipeName(L"conin"),
+                                            dataPipeInBufferSize(),
+                                            GetStdHandle(STD_INPUT_HANDLE),
+                                            m_mouseMode, m_console));
     } else {
-        m_consoleInput->writeInput(newData);
+        reopenDataPipe(*m_coninPipe, false, L"conin");
     }
+    reopenDataPipe(*m_conoutPipe, true, L"conout");
+    if (m_conerrPipe != nullptr) {
+        reopenDataPipe(*m_conerrPipe, true, L"conerr");
+    }
+
+    if (!m_pseudoConsole) {
+        finishScrapeOutput();
+        m_primaryScraper->reattachTerminal();
+        if (m_errorScraper) {
+            m_errorScraper->reattachTerminal();
+        }
+        m_primaryScraper->terminal().setTitle(m_currentTitle);
+        scrapeBuffers();
+    }
+
+    auto &reply = newReplyPacket(requestId);
+    reply.putWString(m_inputThread ? m_inputThread->pipeName()
+                                   : m_coninPipe->name());
+    reply.putWString(m_conoutPipe->name());
+    if (m_useConerr) {
+        reply.putWString(m_conerrPipe->name());
+    }
+    writePacket(reply);
+}
+
+// Opens another CONOUT pipe fed the primary terminal's encoded output, and
+// replies with its name.  A repaint of the window and the title bring the
+// subscriber up to date; the other readers see the repaint, too.  With a
+// pseudoconsole, the output is only forwarded, and the reply is empty.
+void Agent::handleAddOutputSubscriberPacket(ReadBuffer &packet,
+                                            int64_t requestId)
+{
+    packet.assertEof();
+    std::wstring pipeName;
+    if (!m_pseudoConsole) {
+        NamedPipe &pipe = createDataServerPipe(true, L"conout-sub");
+        pipeName = pipe.name();
+        trace("Adding CONOUT subscriber %s", utf8FromWide(pipeName).c_str());
+        Terminal &terminal = m_primaryScraper->terminal();
+        terminal.addSubscriber(pipe);
+        terminal.setTitle(m_currentTitle);
+        m_primaryScraper->repaintOnNextScrape();
+        requestPoll();
+    }
+    auto &reply = newReplyPacket(requestId);
+    reply.putWString(pipeName);
+    writePacket(reply);
+}
+
+// Starts recording the output sent to CONOUT, and replies whether the file
+// was created.  libwinpty sends this during winpty_open, before any output.
+// asciicast can't hold cell records.
+void Agent::handleStartRecordingPacket(ReadBuffer &packet, int64_t requestId)
+{
+    const std::wstring path = packet.getWString();
+    const int format = packet.getInt32();
+    packet.assertEof();
+    const bool formatOk =
+        format == WINPTY_RECORDING_BINARY ||
+        (format == WINPTY_RECORDING_ASCIICAST && !m_cellOutput);
+    if (!m_recorder && formatOk) {
+        const Coord size = m_pseudoConsole
+            ? m_pseudoConsole->size()
+            : m_primaryScraper->ptySize();
+        m_recorder = SessionRecorder::create(path, format, size.X, size.Y);
+        if (m_recorder && !m_pseudoConsole) {
+            m_primaryScraper->terminal().setRecorder(m_recorder.get());
+        }
+    } else {
+        trace("Rejecting the recording request: format=%d", format);
+    }
+    auto &reply = newReplyPacket(requestId);
+    reply.putInt32(m_recorder ? 1 : 0);
+    writePacket(reply);
+}
+
+// Forgets the subscribers whose client went away and closes the ones too far
+// behind.
+void Agent::pruneOutputSubscribers()
+{
+    Terminal &terminal = m_primaryScraper->terminal();
+    if (terminal.subscribers().empty()) {
+        return;
+    }
+    const std::vector<NamedPipe*> subscribers = terminal.subscribers();
+    for (NamedPipe *pipe : subscribers) {
+        if (!pipe->isClosed() &&
+                pipe->bytesToSend() > kMaxSubscriberBacklogBytes) {
+            trace("CONOUT subscriber fell behind -- closing it");
+            pipe->closePipe();
+        }
+        if (pipe->isClosed()) {
+            terminal.removeSubscriber(*pipe);
+        }
+    }
+}
+
+// Replies with the runtime counters, indexed by WINPTY_STAT_xxx.
+void Agent::handleGetStatsPacket(ReadBuffer &packet, int64_t requestId)
+{
+    packet.assertEof();
+
+    uint64_t stats[WINPTY_STAT_COUNT] = {};
+    stats[WINPTY_STAT_SCRAPES] = m_scrapeCount;
+    stats[WINPTY_STAT_SCRAPES_CHANGED] = m_changedScrapeCount;
+    stats[WINPTY_STAT_SCRAPE_TIME_US] = m_scrapeTimeUs;
+    for (Scraper *scraper : { m_primaryScraper.get(), m_errorScraper.get() }) {
+        if (scraper != nullptr) {
+            stats[WINPTY_STAT_CELLS_READ] += scraper->cellsRead();
+            stats[WINPTY_STAT_LINES_SENT] +=
+                scraper->terminal().sendLineCount();
+            stats[WINPTY_STAT_RESYNCS] += scraper->resyncCount();
+            stats[WINPTY_STAT_OPTIMISTIC_RETRIES] +=
+                scraper->optimisticRetries();
+        }
+    }
+    stats[WINPTY_STAT_CONIN_BYTES] = m_retiredConinBytes + (m_inputThread
+        ? m_inputThread->bytesRead() : m_coninPipe->bytesRead());
+    stats[WINPTY_STAT_CONOUT_BYTES] = m_conoutPipe->bytesWritten();
+    if (m_conerrPipe != nullptr) {
+        stats[WINPTY_STAT_CONERR_BYTES] = m_conerrPipe->bytesWritten();
+    }
+    stats[WINPTY_STAT_CONTROL_BYTES] = m_controlPipe->bytesWritten();
+    stats[WINPTY_STAT_INPUT_RECORDS] = m_retiredInputRecords +
+        (m_inputThread ? m_inputThread->recordsWritten()
+                       : m_consoleInput->recordsWritten());
+    stats[WINPTY_STAT_FREEZE_METHOD] = m_console.freezeUsesMark()
+        ? WINPTY_FREEZE_METHOD_MARK : WINPTY_FREEZE_METHOD_SELECT_ALL;
+    stats[WINPTY_STAT_FREEZE_COST_US] = m_freezeCostUs;
+    stats[WINPTY_STAT_OPTIMISTIC_SCRAPE] = m_console.optimisticReads();
+    for (int i = 0; i < WINPTY_COST_COUNT; ++i) {
+        stats[WINPTY_STAT_CPU_CAPTURE_CYCLES + i] = m_cpuCycles[i];
+    }
+    if (m_inputThread) {
+        stats[WINPTY_STAT_CPU_INPUT_CYCLES] += m_inputThread->cpuCycles();
+    }
+    stats[WINPTY_STAT_CPU_TOTAL_CYCLES] = processCycles();
+
+    EventLoopStats loops = loopStats();
+    loops.add(m_retiredInputLoopStats);
+    uint64_t coninWakeups = m_retiredConinWakeups;
+    if (m_inputThread) {
+        loops.add(m_inputThread->sharedLoopStats());
+        coninWakeups += m_inputThread->pipeWakeups();
+    } else {
+        coninWakeups += m_coninPipe->wakeups();
+    }
+    stats[WINPTY_STAT_LOOP_ITERATIONS] = loops.iterations;
+    stats[WINPTY_STAT_WAKEUPS] = loops.wakeups;
+    stats[WINPTY_STAT_WAKEUPS_CONTROL] = m_controlPipe->wakeups();
+    stats[WINPTY_STAT_WAKEUPS_CONIN] = coninWakeups;
+    stats[WINPTY_STAT_WAKEUPS_CONOUT] = m_conoutPipe->wakeups();
+    if (m_conerrPipe != nullptr) {
+        stats[WINPTY_STAT_WAKEUPS_CONERR] = m_conerrPipe->wakeups();
+    }
+    stats[WINPTY_STAT_WAKEUPS_TIMEOUT] = loops.timeoutWakeups;
+    stats[WINPTY_STAT_WAKEUPS_OTHER] = loops.otherWakeups;
+    stats[WINPTY_STAT_WAKEUPS_SPURIOUS] = loops.spuriousWakeups;
+    stats[WINPTY_STAT_LOOP_BLOCKED_US] = loops.blockedUs;
+    stats[WINPTY_STAT_LOOP_RUNNING_US] = loops.runningUs;
+
+    auto &reply = newReplyPacket(requestId);
+    reply.putInt32(WINPTY_STAT_COUNT);
+    for (int i = 0; i < WINPTY_STAT_COUNT; ++i) {
+        reply.putInt64(static_cast<int64_t>(stats[i]));
+    }
+    writePacket(reply);
+}
+
+// Replies with the latency histograms, indexed by WINPTY_HISTOGRAM_xxx.
+void Agent::handleGetHistogramsPacket(ReadBuffer &packet, int64_t requestId)
+{
+    packet.assertEof();
+
+    LatencyHistogram inputLatency;
+    inputLatency.add(m_retiredInputLatency);
+    if (m_inputThread) {
+        inputLatency.add(m_inputThread->inputLatency());
+    } else if (m_consoleInput) {
+        inputLatency.add(m_consoleInput->inputLatency());
+    }
+    const LatencyHistogram *histograms[WINPTY_HISTOGRAM_COUNT] = {};
+    histograms[WINPTY_HISTOGRAM_SCRAPE_CAPTURE] = &m_captureHistogram;
+    histograms[WINPTY_HISTOGRAM_SCRAPE_ENCODE] = &m_encodeHistogram;
+    histograms[WINPTY_HISTOGRAM_FREEZE] = &m_console.freezeHistogram();
+    histograms[WINPTY_HISTOGRAM_INPUT_LATENCY] = &inputLatency;
+    histograms[WINPTY_HISTOGRAM_CONTROL_PACKET] = &m_controlPacketHistogram;
+
+    auto &reply = newReplyPacket(requestId);
+    reply.putInt32(WINPTY_HISTOGRAM_COUNT);
+    reply.putInt32(LatencyHistogram::kBuckets);
+    for (const LatencyHistogram *histogram : histograms) {
+        for (int i = 0; i < LatencyHistogram::kBuckets; ++i) {
+            reply.putInt64(histogram->count(i));
+        }
+    }
+    writePacket(reply);
+}
+
+// Replies with the console API counters, one row per WINPTY_CONSOLE_API_xxx
+// kind.
+void Agent::handleGetConsoleApiStatsPacket(ReadBuffer &packet,
+                                           int64_t requestId)
+{
+    packet.assertEof();
+
+    uint64_t table[WINPTY_CONSOLE_API_COUNT * WINPTY_CONSOLE_API_COLUMNS];
+    consoleApiStats(table);
+
+    auto &reply = newReplyPacket(requestId);
+    reply.putInt32(WINPTY_CONSOLE_API_COUNT);
+    reply.putInt32(WINPTY_CONSOLE_API_COLUMNS);
+    for (uint64_t value : table) {
+        reply.putInt64(static_cast<int64_t>(value));
+    }
+    writePacket(reply);
+}
+
+void Agent::pollConinPipe()
+{
+    // Decode the input in place in the pipe's queue.
+    const size_t size = m_coninPipe->bytesAvailable();
+    if (size == 0) {
+        return;
+    }
+    if (m_ptyInputPipe != nullptr) {
+        // The pseudoconsole decodes terminal input itself.
+        m_ptyInputPipe->write(m_coninPipe->peekData(), size);
+    } else if (m_consoleInput->inputBacklogFull()) {
+        // Leave the input in the pipe, which stops reading once it fills,
+        // until the poll has drained the backlog.
+        return;
+    } else {
+        // The console will probably echo the input, so scrape soon.
+        notePollActivity();
+        CycleScope cycles(m_cpuCycles[WINPTY_COST_INPUT]);
+        m_consoleInput->writePipeInput(m_coninPipe->peekData(), size);
+        noteInputWritten();
+    }
+    m_coninPipe->discard(size);
+}
+
+// The CONIN bytes written to the console so far, counted like
+// WINPTY_STAT_CONIN_BYTES.
+uint64_t Agent::coninBytesWritten()
+{
+    return m_retiredConinBytes + (m_inputThread
+        ? m_inputThread->bytesWritten()
+        : m_coninPipe->bytesRead() - m_consoleInput->pendingInputBytes());
+}
+
+// Scrape in a quick burst after input, so its echo goes out within a few
+// milliseconds.  With the console event hook, the echo's own event already
+// triggers a scrape.
+void Agent::noteInputWritten()
+{
+    if (m_lowLatency) {
+        m_lastInputTick = GetTickCount();
+        setLowLatencyActive(true);
+    }
+    if (m_consoleEventHook || m_pauseMode != PauseMode::Running) {
+        return;
+    }
+    requestPollBurst(kInputScrapeBurstMs,
+                     sizeof(kInputScrapeBurstMs) /
+                         sizeof(kInputScrapeBurstMs[0]));
+}
+
+// The 1 ms schedule needs a 1 ms system timer, or the loop's waits would
+// still round up to the default tick of about 15 ms.  The resolution is a
+// system-wide setting, so it is only held while the session is busy.
+void Agent::setLowLatencyActive(bool active)
+{
+    if (active == m_lowLatencyActive) {
+        return;
+    }
+    typedef UINT WINAPI TimePeriodFunc(UINT);
+    static OsModule winmm(L"winmm.dll");
+    static const auto beginPeriod = reinterpret_cast<TimePeriodFunc*>(
+        winmm.proc("timeBeginPeriod"));
+    static const auto endPeriod = reinterpret_cast<TimePeriodFunc*>(
+        winmm.proc("timeEndPeriod"));
+    if (beginPeriod == nullptr || endPeriod == nullptr) {
+        return;
+    }
+    trace("Low-latency schedule %s", active ? "started" : "ended");
+    m_lowLatencyActive = active;
+    if (active) {
+        beginPeriod(1);
+    } else {
+        endPeriod(1);
+    }
+    applyPriority(m_priority);
+}
+
+// The input thread wakes the main loop when input arrives and when the
+// ConsoleInput pipeline wants a DSR sent.  The child exit wait wakes it when
+// the child process exits.
+void Agent::onWake()
+{
+    if (m_childExitSignaled != 0) {
+        // Run the final scrape now.  The flag is cleared when the poll
+        // consumes the exit.
+        requestPoll();
+    }
+    if (!m_inputThread) {
+        return;
+    }
+    if (m_inputThread->takeInputActivity()) {
+        notePollActivity();
+        noteInputWritten();
+    }
+    if (m_inputThread->takeDsrRequest()) {
+        sendDsr();
+    }
+}
+
+// Register a thread pool wait on the child process, so that its exit is
+// noticed immediately instead of at the next poll.  If the registration
+// fails, childProcessExited checks the handle on each poll instead.
+void Agent::watchChildProcess()
+{
+    ASSERT(m_childProcess != nullptr && m_childExitWait == nullptr);
+    if (hasDebugFlag("no_child_exit_wait")) {
+        return;
+    }
+    const BOOL success = RegisterWaitForSingleObject(
+        &m_childExitWait, m_childProcess, childExitCallback, this,
+        INFINITE, WT_EXECUTEONLYONCE);
+    if (!success) {
+        trace("RegisterWaitForSingleObject failed: %u",
+            static_cast<unsigned>(GetLastError()));
+        m_childExitWait = nullptr;
+    }
+}
+
+VOID CALLBACK Agent::childExitCallback(PVOID param, BOOLEAN timedOut)
+{
+    Agent &agent = *static_cast<Agent*>(param);
+    InterlockedExchange(&agent.m_childExitSignaled, 1);
+    agent.wake();
+}
+
+void Agent::releaseChildProcess()
+{
+    if (m_childExitWait != nullptr) {
+        // Waits for a running callback to finish.
+        UnregisterWaitEx(m_childExitWait, INVALID_HANDLE_VALUE);
+        m_childExitWait = nullptr;
+    }
+    if (m_childProcess != nullptr) {
+        CloseHandle(m_childProcess);
+        m_childProcess = nullptr;
+    }
+    m_childExitSignaled = 0;
+}
+
+bool Agent::childProcessExited()
+{
+    if (m_childProcess == nullptr) {
+        return false;
+    }
+    if (m_childExitWait != nullptr) {
+        return m_childExitSignaled != 0;
+    }
+    return WaitForSingleObject(m_childProcess, 0) == WAIT_OBJECT_0;
+}
+
+void Agent::invalidateInputFlags()
+{
+    if (m_inputThread) {
+        m_inputThread->invalidateInputFlags();
+    } else {
+        m_consoleInput->invalidateInputFlags();
+    }
+}
+
+void Agent::setMouseWindowRect(const SmallRect &rect)
+{
+    if (m_inputThread) {
+        m_inputThread->setMouseWindowRect(rect);
+    } else {
+        m_consoleInput->setMouseWindowRect(rect);
+    }
+}
+
+// The number of bytes queued for the terminal.  Output is only flushed from
+// the event loop, so a change across a scrape means it generated output.
+size_t Agent::pendingOutputSize()
+{
+    size_t ret = m_conoutPipe->bytesToSend();
+    if (m_conerrPipe != nullptr) {
+        ret += m_conerrPipe->bytesToSend();
+    }
+    return ret;
+}
+
+void Agent::handleGrantOutputCreditsPacket(ReadBuffer &packet,
+                                           int64_t requestId)
+{
+    GrantOutputCreditsMsg msg;
+    getAgentMsg(packet, msg);
+    const int64_t bytes = static_cast<int64_t>(msg.bytes);
+    const int64_t frames = static_cast<int64_t>(msg.frames);
+    ASSERT(bytes >= 0 && frames >= 0);
+    if (m_byteCredits) {
+        m_creditBytes += bytes;
+    }
+    if (m_frameCredits) {
+        m_creditFrames += frames;
+    }
+    if (m_creditStalled && !outputCreditExhausted()) {
+        trace("Output credit granted -- resuming scrapes");
+        m_creditStalled = false;
+        requestPoll();
+    }
+    auto &reply = newReplyPacket(requestId);
+    writePacket(reply);
+}
+
+// Charges the terminal output since the last call to the byte balance, and
+// returns whether either balance has run out.
+bool Agent::outputCreditExhausted()
+{
+    if (!m_byteCredits && !m_frameCredits) {
+        return false;
+    }
+    const uint64_t queued = terminalBytesQueued();
+    m_creditBytes -= static_cast<int64_t>(queued - m_creditBytesCounted);
+    m_creditBytesCounted = queued;
+    const bool exhausted = (m_byteCredits && m_creditBytes <= 0) ||
+                           (m_frameCredits && m_creditFrames <= 0);
+    if (exhausted && !m_creditStalled) {
+        trace("Output credit exhausted (%lld bytes, %lld frames) -- "
+              "deferring scrapes",
+              static_cast<long long>(m_creditBytes),
+              static_cast<long long>(m_creditFrames));
+        m_creditStalled = true;
+    }
+    return exhausted;
+}
+
+bool Agent::isOutputCongested()
+{
+    const size_t pending = pendingOutputSize();
+    if (!m_outputCongested && pending >= kOutputHighWaterBytes) {
+        trace("Output pipe congested (%u bytes pending) -- deferring scrapes",
+              static_cast<unsigned int>(pending));
+        m_outputCongested = true;
+    } else if (m_outputCongested && pending <= kOutputLowWaterBytes) {
+        trace("Output pipe drained (%u bytes pending)",
+              static_cast<unsigned int>(pending));
+        m_outputCongested = false;
+    }
+    return m_outputCongested;
 }
 
 void Agent::onPollTimeout()
 {
-    m_consoleInput->updateInputFlags();
-    const bool enableMouseMode = m_consoleInput->shouldActivateTerminalMouse();
+    m_console.probe().beginTick();
+    if (m_recorder) {
+        m_recorder->service();
+    }
+    if (m_pseudoConsole) {
+        pollPseudoConsole();
+        return;
+    }
 
-    // Give the ConsoleInput object a chance to flush input from an incomplete
-    // escape sequence (e.g. pressing ESC).
-    m_consoleInput->flushIncompleteEscapeCode();
+    if (m_lowLatencyActive &&
+            GetTickCount() - m_lastInputTick >= kLowLatencyIdleMs) {
+        setLowLatencyActive(false);
+    }
+    pruneOutputSubscribers();
+
+    // A process attaching or detaching invalidates the process list, and the
+    // new process may set a different input mode or code page.
+    const bool processListChanged =
+        m_consoleEventHook && m_consoleEventHook->takeProcessListChange();
+    if (processListChanged) {
+        invalidateInputFlags();
+        m_console.probe().invalidate();
+    }
+
+    bool enableMouseMode = false;
+    if (m_inputThread) {
+        // The input thread refreshes the input mode itself.
+        enableMouseMode = m_inputThread->shouldActivateTerminalMouse();
+    } else {
+        m_consoleInput->refreshInputFlags();
+        enableMouseMode = m_consoleInput->shouldActivateTerminalMouse();
+
+        // Give the ConsoleInput object a chance to flush input from an
+        // incomplete escape sequence (e.g. pressing ESC).
+        m_consoleInput->flushIncompleteEscapeCode();
+
+        // Feed the console the input held back while its queue was full.
+        if (m_consoleInput->hasHeldInput()) {
+            m_consoleInput->drainHeldInput();
+            pollConinPipe();
+            if (m_consoleInput->hasHeldInput()) {
+                requestPoll(kHeldInputPollMs);
+            }
+        }
+    }
 
     const bool shouldScrapeContent = !m_closingOutputPipes;
 
     // Check if the child process has exited.
-    if (m_autoShutdown &&
-            m_childProcess != nullptr &&
-            WaitForSingleObject(m_childProcess, 0) == WAIT_OBJECT_0) {
-        CloseHandle(m_childProcess);
-        m_childProcess = nullptr;
+    if (m_autoShutdown && childProcessExited()) {
+        releaseChildProcess();
 
         // Close the data socket to signal to the client that the child
         // process has exited.  If there's any data left to send, send it
         // before closing the socket.
         m_closingOutputPipes = true;
     }
+    if (m_closingOutputPipes) {
+        // The child's final output is sent even from a paused session.
+        setPauseMode(PauseMode::Running);
+    }
 
     // Scrape for output *after* the above exit-check to ensure that we collect
     // the child process's final output.
-    if (shouldScrapeContent) {
+    if (shouldScrapeContent &&
+            (m_pauseMode != PauseMode::Stopped || m_scrapeOutputPending)) {
+        const size_t outputBefore = pendingOutputSize();
         syncConsoleTitle();
-        scrapeBuffers();
+        // Don't defer the final scrape after the child exits.
+        if ((isOutputCongested() || outputCreditExhausted()) &&
+                !m_closingOutputPipes) {
+            // Skip this scrape.  A completed write will request a poll once
+            // the backlog drains, as will a credit grant.
+        } else if (m_scrapeOutputPending && !m_closingOutputPipes) {
+            continueScrapeOutput(m_scrapeSliceBytes);
+        } else if (shouldScrapeNow()) {
+            scrapeBuffers();
+        }
+        if (pendingOutputSize() != outputBefore) {
+            notePollActivity();
+        }
+    }
+
+    // Without the event hook, there's no notice of process list changes, so
+    // a waiting client is answered from a re-read on each poll.
+    if (m_consoleEventHook) {
+        if (processListChanged) {
+            m_processListValid = false;
+            if (!m_processListWaiters.empty()) {
+                updateProcessList();
+            }
+        }
+    } else if (!m_processListWaiters.empty()) {
+        updateProcessList();
     }
 
     // We must ensure that we disable mouse mode before closing the CONOUT
-    // pipe, so update the mouse mode here.
+    // pipe, so update the mouse mode here.  Likewise, leave the terminal on
+    // its main screen.
     m_primaryScraper->terminal().enableMouseMode(
         enableMouseMode && !m_closingOutputPipes);
+    if (m_closingOutputPipes) {
+        m_primaryScraper->terminal().leaveAlternateScreen(false);
+    }
 
+    discardDetachedOutput();
     autoClosePipesForShutdown();
+    trimIdleMemory();
+}
+
+// After m_idleTrimMs without input or output, free what the agent can
+// rebuild: the scrapers' read buffers and saved cells, the Terminals'
+// caches, and the idle pipe buffers.  Then return the pages to the system.
+// Work resumes as usual on the next activity, reallocating as it goes.
+void Agent::trimIdleMemory()
+{
+    if (m_idleTrimMs <= 0) {
+        return;
+    }
+    uint64_t mark = coninBytesWritten() +
+        m_primaryScraper->terminal().bytesQueued();
+    if (m_errorScraper) {
+        mark += m_errorScraper->terminal().bytesQueued();
+    }
+    const DWORD now = GetTickCount();
+    if (mark != m_activityMark) {
+        m_activityMark = mark;
+        m_lastActivityTick = now;
+        m_memoryTrimmed = false;
+        return;
+    }
+    if (m_memoryTrimmed || m_closingOutputPipes || m_scrapeOutputPending ||
+            static_cast<int>(now - m_lastActivityTick) < m_idleTrimMs) {
+        return;
+    }
+    m_memoryTrimmed = true;
+    m_primaryScraper->releaseIdleMemory();
+    if (m_errorScraper) {
+        m_errorScraper->releaseIdleMemory();
+    }
+    if (m_consoleInput) {
+        m_consoleInput->releaseMemory();
+    }
+    for (NamedPipe *pipe : { m_controlPipe, m_coninPipe, m_conoutPipe,
+                             m_conerrPipe }) {
+        if (pipe != nullptr) {
+            pipe->releaseIdleMemory();
+        }
+    }
+    for (NamedPipe *pipe : m_primaryScraper->terminal().subscribers()) {
+        pipe->releaseIdleMemory();
+    }
+    SetProcessWorkingSetSize(GetCurrentProcess(),
+                             static_cast<SIZE_T>(-1),
+                             static_cast<SIZE_T>(-1));
+    trace("Idle for %d ms: trimmed the agent's memory", m_idleTrimMs);
+}
+
+// Once a client disconnects from an output pipe, nothing reads the pipe until
+// a reattach replaces it, and that repaints the whole screen.  Drop the
+// output in between rather than let it pile up and congest the scrapes.
+void Agent::discardDetachedOutput()
+{
+    if (m_closingOutputPipes) {
+        return;
+    }
+    for (NamedPipe *pipe : { m_conoutPipe, m_conerrPipe }) {
+        if (pipe != nullptr && pipe->isClosed() && pipe->bytesToSend() > 0) {
+            pipe->discardOutput();
+        }
+    }
 }
 
 void Agent::autoClosePipesForShutdown()
@@ -537,32 +2005,56 @@ void Agent::autoClosePipesForShutdown()
     }
 }
 
-std::unique_ptr<Win32ConsoleBuffer> Agent::openPrimaryBuffer()
+// CONOUT$ opens the screen buffer that is active at the time, so the handle
+// stays good until the console reports a layout change, which includes a
+// program activating another buffer.  Without the event hook, there is no such
+// notice, so the buffer is reopened for every use.
+Win32ConsoleBuffer &Agent::primaryBuffer()
 {
     // If we're using a separate buffer for stderr, and a program were to
     // activate the stderr buffer, then we could accidentally scrape the same
     // buffer twice.  That probably shouldn't happen in ordinary use, but it
     // can be avoided anyway by using the original console screen buffer in
     // that mode.
-    if (!m_useConerr) {
-        return Win32ConsoleBuffer::openConout();
-    } else {
-        return Win32ConsoleBuffer::openStdout();
+    if (m_useConerr) {
+        if (!m_primaryBuffer) {
+            m_primaryBuffer = Win32ConsoleBuffer::openStdout();
+        }
+    } else if (!m_primaryBuffer || !m_consoleEventHook ||
+               m_consoleEventHook->takeLayoutChange()) {
+        m_primaryBuffer.reset();
+        m_primaryBuffer = Win32ConsoleBuffer::openConout();
     }
+    m_primaryBuffer->cacheInfoWhileFrozen(m_console);
+    return *m_primaryBuffer;
 }
 
 void Agent::resizeWindow(int cols, int rows)
 {
     ASSERT(cols >= 1 && rows >= 1);
-    cols = std::min(cols, MAX_CONSOLE_WIDTH);
-    rows = std::min(rows, MAX_CONSOLE_HEIGHT);
+    cols = std::min(cols, m_maxCols);
+    rows = std::min(rows, m_maxRows);
+
+    if (m_recorder) {
+        m_recorder->recordResize(cols, rows);
+    }
+    if (m_pseudoConsole) {
+        m_pseudoConsole->resize(Coord(cols, rows));
+        return;
+    }
 
+    finishScrapeOutput();
+    if (m_consoleEventHook) {
+        // Let a resize that keeps the buffer read only the changed rows.
+        m_primaryScraper->setDirtyRegionHint(
+            m_consoleEventHook->takeDirtyRegion());
+    }
     Win32Console::FreezeGuard guard(m_console, m_console.frozen());
     const Coord newSize(cols, rows);
     ConsoleScreenBufferInfo info;
-    auto primaryBuffer = openPrimaryBuffer();
-    m_primaryScraper->resizeWindow(*primaryBuffer, newSize, info);
-    m_consoleInput->setMouseWindowRect(info.windowRect());
+    Win32ConsoleBuffer &buffer = primaryBuffer();
+    m_primaryScraper->resizeWindow(buffer, newSize, info);
+    setMouseWindowRect(info.windowRect());
     if (m_errorScraper) {
         m_errorScraper->resizeWindow(*m_errorBuffer, newSize, info);
     }
@@ -582,29 +2074,218 @@ void Agent::resizeWindow(int cols, int rows)
     // harmless.  See https://github.com/rprichard/winpty/issues/110.
     INPUT_RECORD sizeEvent {};
     sizeEvent.EventType = WINDOW_BUFFER_SIZE_EVENT;
-    sizeEvent.Event.WindowBufferSizeEvent.dwSize = primaryBuffer->bufferSize();
+    sizeEvent.Event.WindowBufferSizeEvent.dwSize = buffer.bufferSize();
     DWORD actual {};
+    ConsoleApiScope call(WINPTY_CONSOLE_API_WRITE_INPUT, 1);
     WriteConsoleInputW(GetStdHandle(STD_INPUT_HANDLE), &sizeEvent, 1, &actual);
 }
 
+// In event-driven mode, a poll is requested as soon as the console reports a
+// change.  Rate-limit the resulting scrapes, deferring the poll rather than
+// dropping it.  Polls without a pending event are the safety net, so they
+// always scrape.
+bool Agent::shouldScrapeNow()
+{
+    if (!m_consoleEventHook || !m_consoleEventHook->hasPendingEvents()) {
+        return true;
+    }
+    const int sinceLastScrape = GetTickCount() - m_lastScrapeTick;
+    if (sinceLastScrape < m_minScrapeIntervalMs) {
+        requestPoll(m_minScrapeIntervalMs - sinceLastScrape);
+        return false;
+    }
+    return true;
+}
+
+uint64_t Agent::terminalBytesQueued()
+{
+    uint64_t ret = m_primaryScraper->terminal().bytesQueued();
+    if (m_errorScraper) {
+        ret += m_errorScraper->terminal().bytesQueued();
+    }
+    return ret;
+}
+
 void Agent::scrapeBuffers()
 {
-    Win32Console::FreezeGuard guard(m_console, m_console.frozen());
-    ConsoleScreenBufferInfo info;
-    m_primaryScraper->scrapeBuffer(*openPrimaryBuffer(), info);
-    m_consoleInput->setMouseWindowRect(info.windowRect());
+    finishScrapeOutput();
+    TimeMeasurement timer;
+    m_scrapeBytesBefore = terminalBytesQueued();
+    if (m_consoleEventHook) {
+        m_primaryScraper->setDirtyRegionHint(
+            m_consoleEventHook->takeDirtyRegion());
+    }
+    {
+        // Only the console reads need the console frozen.  While it is
+        // frozen, the child blocks on its console writes.
+        CycleScope cycles(m_cpuCycles[WINPTY_COST_CAPTURE]);
+        Win32Console::FreezeGuard guard(m_console, m_console.frozen());
+        ConsoleScreenBufferInfo info;
+        if (m_inputAcks) {
+            m_primaryScraper->setInputWritten(coninBytesWritten());
+        }
+        m_primaryScraper->captureBuffer(primaryBuffer(), info);
+        setMouseWindowRect(info.windowRect());
+        if (m_errorScraper) {
+            m_errorScraper->captureBuffer(*m_errorBuffer, info);
+        }
+    }
+    // Console events from here on describe changes after the capture.
+    if (m_consoleEventHook) {
+        m_consoleEventHook->discardPendingEvents();
+    }
+    const int64_t captureUs = timer.elapsedUs();
+    m_scrapeTimeUs += captureUs;
+    m_captureHistogram.record(captureUs);
+    m_scrapeEncodeUs = 0;
+    m_scrapeSliceBytes = kFirstScrapeSliceBytes;
+    continueScrapeOutput(m_closingOutputPipes ? 0 : m_scrapeSliceBytes);
+}
+
+// Encodes the next slice of the captured output, or all of it if byteBudget
+// is 0.  Until the last slice, the next poll continues it instead of
+// scraping again.
+void Agent::continueScrapeOutput(size_t byteBudget)
+{
+    TimeMeasurement timer;
+    bool done = true;
+    if (m_scrapeWorker) {
+        // The scrapers share nothing once their buffers are captured, so
+        // encode CONERR on the worker while this thread encodes CONOUT.
+        Scraper &errorScraper = *m_errorScraper;
+        bool errorDone = true;
+        uint64_t errorCycles = 0;
+        m_scrapeWorker->post(
+                [&errorScraper, &errorDone, &errorCycles, byteBudget]() {
+            CycleScope cycles(errorCycles);
+            errorDone = errorScraper.flushOutput(byteBudget);
+        });
+        {
+            CycleScope cycles(m_cpuCycles[WINPTY_COST_ENCODE]);
+            done = m_primaryScraper->flushOutput(byteBudget);
+        }
+        m_scrapeWorker->wait();
+        m_cpuCycles[WINPTY_COST_ENCODE] += errorCycles;
+        done = done && errorDone;
+    } else {
+        CycleScope cycles(m_cpuCycles[WINPTY_COST_ENCODE]);
+        done = m_primaryScraper->flushOutput(byteBudget);
+        if (m_errorScraper) {
+            done = m_errorScraper->flushOutput(byteBudget) && done;
+        }
+    }
+    const int64_t encodeUs = timer.elapsedUs();
+    m_scrapeTimeUs += encodeUs;
+    m_scrapeEncodeUs += encodeUs;
+    m_scrapeOutputPending = !done;
+    if (!done) {
+        m_scrapeSliceBytes = std::min(m_scrapeSliceBytes * 2,
+                                      kMaxScrapeSliceBytes);
+        requestPoll(0);
+        return;
+    }
+    m_encodeHistogram.record(m_scrapeEncodeUs);
+    // Write coalescing doesn't hold the end of a scrape.
+    m_conoutPipe->flushWrites();
+    if (m_conerrPipe != nullptr) {
+        m_conerrPipe->flushWrites();
+    }
+    m_lastScrapeTick = GetTickCount();
+    // If the frame rate cap skipped a repaint, scrape again when it's due,
+    // so the final state shows up even if the output stops.
+    int deferredDelayMs = m_primaryScraper->deferredFrameDelayMs();
     if (m_errorScraper) {
-        m_errorScraper->scrapeBuffer(*m_errorBuffer, info);
+        const int errorDelayMs = m_errorScraper->deferredFrameDelayMs();
+        if (deferredDelayMs == -1 ||
+                (errorDelayMs != -1 && errorDelayMs < deferredDelayMs)) {
+            deferredDelayMs = errorDelayMs;
+        }
+    }
+    if (deferredDelayMs != -1) {
+        requestPoll(deferredDelayMs);
+    }
+    ++m_scrapeCount;
+    if (terminalBytesQueued() != m_scrapeBytesBefore) {
+        ++m_changedScrapeCount;
+        if (m_frameCredits) {
+            --m_creditFrames;
+        }
+    }
+}
+
+// Scraper operations other than flushOutput need the last scrape's output
+// finished.
+void Agent::finishScrapeOutput()
+{
+    if (m_scrapeOutputPending) {
+        continueScrapeOutput(0);
     }
 }
 
 void Agent::syncConsoleTitle()
 {
-    std::wstring newTitle = m_console.title();
-    if (newTitle != m_currentTitle) {
-        std::string command = std::string("\x1b]0;") +
-                utf8FromWide(newTitle) + "\x07";
-        m_conoutPipe->write(command.c_str());
-        m_currentTitle = newTitle;
+    if (m_consoleEventHook && m_consoleEventHook->tracksTitle()) {
+        const DWORD now = GetTickCount();
+        if (!m_consoleEventHook->takeTitleChange() &&
+                static_cast<int>(now - m_lastTitleCheckTick) <
+                    kTitleFallbackIntervalMs) {
+            return;
+        }
+        m_lastTitleCheckTick = now;
+    }
+    // Compare in place, so an unchanged title doesn't allocate.
+    size_t length = 0;
+    const wchar_t *const newTitle = m_console.readTitle(length);
+    if (length != m_currentTitle.size() ||
+            wmemcmp(newTitle, m_currentTitle.data(), length) != 0) {
+        m_currentTitle.assign(newTitle, length);
+        m_primaryScraper->terminal().setTitle(m_currentTitle);
+    }
+}
+
+// Tries to host the child in a pseudoconsole.  If that fails, the agent
+// scrapes its own console as usual.
+void Agent::createPseudoConsole(Coord size)
+{
+    NamedPipe &input = createDataServerPipe(true, L"conpty-in");
+    NamedPipe &output = createDataServerPipe(false, L"conpty-out");
+    m_pseudoConsole = PseudoConsole::create(
+        size, input.name().c_str(), output.name().c_str());
+    if (!m_pseudoConsole) {
+        trace("Pseudoconsole unavailable -- scraping the console instead");
+        input.closePipe();
+        output.closePipe();
+        return;
     }
+    m_ptyInputPipe = &input;
+    m_ptyOutputPipe = &output;
+}
+
+// Copies the pseudoconsole's output to CONOUT.  While CONOUT is congested,
+// the output stays queued, and once the queue fills, the pseudoconsole pipe
+// stops being read, which eventually blocks the child's console writes.
+void Agent::forwardPseudoConsoleOutput()
+{
+    NamedPipe &source = *m_ptyOutputPipe;
+    const size_t size = source.bytesAvailable();
+    if (size > 0 && !isOutputCongested()) {
+        m_conoutPipe->write(source.peekData(), size);
+        if (m_recorder) {
+            m_recorder->recordOutput(source.peekData(), size);
+        }
+        source.discard(size);
+    }
+}
+
+// The pseudoconsole's output arrives through onPipeIo, so a poll only needs
+// to notice the child's exit.
+void Agent::pollPseudoConsole()
+{
+    if (m_autoShutdown && childProcessExited()) {
+        releaseChildProcess();
+        m_closingOutputPipes = true;
+    }
+    forwardPseudoConsoleOutput();
+    discardDetachedOutput();
+    autoClosePipesForShutdown();
 }
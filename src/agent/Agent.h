@@ -26,17 +26,29 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
+#include "Coord.h"
 #include "DsrSender.h"
+#include "../include/winpty_constants.h"
+#include "../shared/AgentMsg.h"
+#include "../shared/LatencyHistogram.h"
 #include "EventLoop.h"
+#include "SmallRect.h"
 #include "Win32Console.h"
 
+class ConsoleEventHook;
 class ConsoleInput;
+class InputThread;
 class NamedPipe;
+class PseudoConsole;
 class ReadBuffer;
 class Scraper;
+class ScrollbackHistory;
+class SessionRecorder;
 class WriteBuffer;
 class Win32ConsoleBuffer;
+class WorkerThread;
 
 class Agent : public EventLoop, public DsrSender
 {
@@ -45,51 +57,228 @@ public:
           uint64_t agentFlags,
           int mouseMode,
           int initialCols,
-          int initialRows);
+          int initialRows,
+          int minPollIntervalMs,
+          int maxPollIntervalMs,
+          uint64_t historyLimitBytes,
+          int maxFrameRate,
+          int bufferLineCount,
+          int syncMarkerMargin,
+          int maxConsoleWidth,
+          int outPipeBufferSize,
+          int inPipeBufferSize,
+          int coalesceDelayUs,
+          int coalesceBytes,
+          int schedulingClass,
+          uint64_t affinityMask,
+          uint64_t creditBytes,
+          uint64_t creditFrames,
+          int idleTrimMs);
     virtual ~Agent();
     void sendDsr() override;
 
 private:
     NamedPipe &connectToControlPipe(LPCWSTR pipeName);
     NamedPipe &createDataServerPipe(bool write, const wchar_t *kind);
+    void openDataServerPipe(NamedPipe &pipe, bool write, const wchar_t *kind);
+    NamedPipe *createSharedMemoryPipe(const wchar_t *kind);
+    bool openSharedMemoryPipe(NamedPipe &pipe, const wchar_t *kind);
+    void reopenDataPipe(NamedPipe &pipe, bool write, const wchar_t *kind);
+    int dataPipeOutBufferSize() const;
+    int dataPipeInBufferSize() const;
 
 private:
     void pollControlPipe();
     void handlePacket(ReadBuffer &packet);
+    WriteBuffer &newReplyPacket(int64_t requestId);
     void writePacket(WriteBuffer &packet);
-    void handleStartProcessPacket(ReadBuffer &packet);
-    void handleSetSizePacket(ReadBuffer &packet);
-    void handleGetConsoleProcessListPacket(ReadBuffer &packet);
+    void handleStartProcessPacket(ReadBuffer &packet, int64_t requestId);
+    void handleSetSizePacket(ReadBuffer &packet, int64_t requestId);
+    void handleGetConsoleProcessListPacket(ReadBuffer &packet, int64_t requestId);
+    void handleWaitProcessListChangePacket(ReadBuffer &packet, int64_t requestId);
+    const std::vector<DWORD> &consoleProcessList();
+    void updateProcessList();
+    void putProcessList(WriteBuffer &reply);
+    void handleGetStatsPacket(ReadBuffer &packet, int64_t requestId);
+    void handleGetHistogramsPacket(ReadBuffer &packet, int64_t requestId);
+    void handleGetConsoleApiStatsPacket(ReadBuffer &packet,
+                                        int64_t requestId);
+    void handleGetHistoryPacket(ReadBuffer &packet, int64_t requestId);
+    void handleGetScreenPacket(ReadBuffer &packet, int64_t requestId);
+    void handleReattachPacket(ReadBuffer &packet, int64_t requestId);
+    void handleAddOutputSubscriberPacket(ReadBuffer &packet,
+                                         int64_t requestId);
+    void pruneOutputSubscribers();
+    void trimIdleMemory();
+    void handleStartRecordingPacket(ReadBuffer &packet, int64_t requestId);
+    void handleSetPriorityPacket(ReadBuffer &packet, int64_t requestId);
+    void applyPriority(int level);
+    void handleSetSchedulingPacket(ReadBuffer &packet, int64_t requestId);
+    void applyProcessPriority(DWORD priorityClass);
+    void applyAffinity();
+    void handleGrantOutputCreditsPacket(ReadBuffer &packet,
+                                        int64_t requestId);
+    bool outputCreditExhausted();
+    void handleSetPausedPacket(ReadBuffer &packet, int64_t requestId);
+    void setPauseMode(PauseMode mode);
+    uint64_t terminalBytesQueued();
     void pollConinPipe();
+    void noteInputWritten();
+    void setLowLatencyActive(bool active);
+    uint64_t coninBytesWritten();
+    size_t pendingOutputSize();
+    bool isOutputCongested();
 
 protected:
     virtual void onPollTimeout() override;
     virtual void onPipeIo(NamedPipe &namedPipe) override;
+    virtual void onWake() override;
 
 private:
+    void setMouseWindowRect(const SmallRect &rect);
+    void invalidateInputFlags();
     void autoClosePipesForShutdown();
-    std::unique_ptr<Win32ConsoleBuffer> openPrimaryBuffer();
+    void discardDetachedOutput();
+    Win32ConsoleBuffer &primaryBuffer();
     void resizeWindow(int cols, int rows);
+    bool shouldScrapeNow();
     void scrapeBuffers();
+    void continueScrapeOutput(size_t byteBudget);
+    void finishScrapeOutput();
     void syncConsoleTitle();
+    void createPseudoConsole(Coord size);
+    void forwardPseudoConsoleOutput();
+    void pollPseudoConsole();
+    void watchChildProcess();
+    void releaseChildProcess();
+    bool childProcessExited();
+    static VOID CALLBACK childExitCallback(PVOID param, BOOLEAN timedOut);
 
 private:
     const bool m_useConerr;
     const bool m_plainMode;
+    const bool m_cellOutput;
+    bool m_inputAcks = false;
     const int m_mouseMode;
+    int m_maxCols = 0;
+    int m_maxRows = 0;
     Win32Console m_console;
+    // The primary Terminal refers to the history, so it's declared first.
+    // Declared before the scrapers, whose Terminal writes to it.
+    std::unique_ptr<SessionRecorder> m_recorder;
+    std::unique_ptr<ScrollbackHistory> m_history;
     std::unique_ptr<Scraper> m_primaryScraper;
     std::unique_ptr<Scraper> m_errorScraper;
     std::unique_ptr<Win32ConsoleBuffer> m_errorBuffer;
+    // The buffer the primary scraper reads, kept open between scrapes (see
+    // primaryBuffer).
+    std::unique_ptr<Win32ConsoleBuffer> m_primaryBuffer;
+    // Encodes the error scraper's output alongside the primary scraper's.
+    std::unique_ptr<WorkerThread> m_scrapeWorker;
     NamedPipe *m_controlPipe = nullptr;
+    // The complete packets found by pollControlPipe, as spans of the control
+    // pipe's input queue, and the buffer each reply is built in.  Both are
+    // reused, so steady control traffic doesn't allocate.
+    struct ControlPacket {
+        size_t offset;
+        size_t size;
+        int32_t type;
+    };
+    std::vector<ControlPacket> m_controlPackets;
+    std::unique_ptr<WriteBuffer> m_replyBuffer;
+    // The console process list.  With the console event hook, it's re-read
+    // only after a process attaches or detaches; otherwise, on every use.
+    // The generation counts the changes seen, and the waiters are the
+    // WaitProcessListChange requests to answer at the next change.
+    std::vector<DWORD> m_processList;
+    bool m_processListValid = false;
+    uint64_t m_processListGeneration = 1;
+    std::vector<int64_t> m_processListWaiters;
     NamedPipe *m_coninPipe = nullptr;
     NamedPipe *m_conoutPipe = nullptr;
     NamedPipe *m_conerrPipe = nullptr;
+    // With a pseudoconsole, the child's console isn't scraped.  Its output
+    // pipe is copied to CONOUT, and CONIN feeds its input pipe.
+    std::unique_ptr<PseudoConsole> m_pseudoConsole;
+    NamedPipe *m_ptyInputPipe = nullptr;
+    NamedPipe *m_ptyOutputPipe = nullptr;
     bool m_autoShutdown = false;
     bool m_exitAfterShutdown = false;
     bool m_closingOutputPipes = false;
+    // Input is handled by exactly one of these.
     std::unique_ptr<ConsoleInput> m_consoleInput;
+    std::unique_ptr<InputThread> m_inputThread;
+    std::unique_ptr<ConsoleEventHook> m_consoleEventHook;
+    DWORD m_lastScrapeTick = 0;
+    // The configured scrape policy, which winpty_set_priority adjusts.
+    int m_minPollIntervalMs = 0;
+    int m_maxPollIntervalMs = 0;
+    int m_maxFrameRate = 0;
+    int m_minScrapeIntervalMs = 0;
+    int m_priority = 0;
+    // The WINPTY_SCHEDULING_xxx class, the processor affinity (0 for all),
+    // and whether the process is in background processing mode.
+    int m_schedulingClass = WINPTY_SCHEDULING_DEFAULT;
+    uint64_t m_affinityMask = 0;
+    bool m_backgroundMode = false;
+    // With WINPTY_FLAG_LOW_LATENCY, whether input has arrived recently
+    // enough for the 1 ms schedule, and when the last of it did.
+    bool m_lowLatency = false;
+    bool m_lowLatencyActive = false;
+    DWORD m_lastInputTick = 0;
+    // The output the client still accepts (see
+    // winpty_config_set_output_credits), for each kind of credit enabled.
+    // The byte balance is charged up to m_creditBytesCounted terminal bytes.
+    bool m_byteCredits = false;
+    bool m_frameCredits = false;
+    int64_t m_creditBytes = 0;
+    int64_t m_creditFrames = 0;
+    uint64_t m_creditBytesCounted = 0;
+    bool m_creditStalled = false;
+    // With winpty_config_set_idle_trim, the idle time before the agent frees
+    // its caches and buffers, the input and output counts at the last sign
+    // of activity, and when that was.
+    int m_idleTrimMs = 0;
+    uint64_t m_activityMark = 0;
+    DWORD m_lastActivityTick = 0;
+    bool m_memoryTrimmed = false;
+    int64_t m_freezeCostUs = 0;
+    // The data pipes' kernel buffer sizes, or 0 for automatic sizing.
+    int m_outPipeBufferSize = 0;
+    int m_inPipeBufferSize = 0;
+    // The output pipes' write coalescing policy (see NamedPipe).
+    int m_coalesceDelayUs = 0;
+    int m_coalesceBytes = 0;
+    PauseMode m_pauseMode = PauseMode::Running;
+    uint64_t m_scrapeCount = 0;
+    uint64_t m_changedScrapeCount = 0;
+    uint64_t m_scrapeTimeUs = 0;
+    // The WINPTY_HISTOGRAM_xxx histograms the main thread records.
+    LatencyHistogram m_captureHistogram;
+    LatencyHistogram m_encodeHistogram;
+    LatencyHistogram m_controlPacketHistogram;
+    // CPU cycles by activity, indexed by WINPTY_COST_xxx.  The input thread
+    // reports its own; these hold the input cycles of the main thread and of
+    // input threads that have exited.
+    uint64_t m_cpuCycles[WINPTY_COST_COUNT] = {};
+    // A scrape whose output is still being encoded in slices.
+    bool m_scrapeOutputPending = false;
+    int64_t m_scrapeEncodeUs = 0;
+    size_t m_scrapeSliceBytes = 0;
+    uint64_t m_scrapeBytesBefore = 0;
+    // Input counters of the input threads replaced by a reattach.
+    uint64_t m_retiredConinBytes = 0;
+    uint64_t m_retiredInputRecords = 0;
+    EventLoopStats m_retiredInputLoopStats;
+    uint64_t m_retiredConinWakeups = 0;
+    LatencyHistogram m_retiredInputLatency;
+    bool m_outputCongested = false;
     HANDLE m_childProcess = nullptr;
+    // A thread pool wait on m_childProcess.  Its callback sets
+    // m_childExitSignaled and wakes the loop, so the final scrape doesn't
+    // wait for the next poll.
+    HANDLE m_childExitWait = nullptr;
+    volatile LONG m_childExitSignaled = 0;
 
     // If the title is initialized to the empty string, then cmd.exe will
     // sometimes print this error:
@@ -98,6 +287,7 @@ private:
     // example.  Using a title of a single space character avoids the problem.
     // See https://github.com/rprichard/winpty/issues/74.
     std::wstring m_currentTitle = L" ";
+    DWORD m_lastTitleCheckTick = 0;
 };
 
 #endif // AGENT_H
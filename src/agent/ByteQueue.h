@@ -0,0 +1,103 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef BYTE_QUEUE_H
+#define BYTE_QUEUE_H
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "../shared/WinptyAssert.h"
+
+// A FIFO of bytes whose content is always one contiguous span, so callers can
+// parse it in place.  Consuming from the front just advances an offset.  The
+// live bytes are moved to the front only when the back runs out of room and
+// at least half the buffer has been consumed, so appending and consuming are
+// both amortized O(1) per byte.
+class ByteQueue {
+public:
+    bool empty() const { return m_begin == m_end; }
+    size_t size() const { return m_end - m_begin; }
+    const char *data() const { return m_buf.data() + m_begin; }
+    size_t capacity() const { return m_buf.capacity(); }
+
+    void append(const void *data, size_t size) {
+        memcpy(reserve(size), data, size);
+        commit(size);
+    }
+
+    // Returns space for `size` bytes at the back of the queue.  The caller
+    // fills some of it and then calls commit.  The pointer is invalidated by
+    // any other non-const call.
+    char *reserve(size_t size) {
+        if (m_buf.size() - m_end < size) {
+            const size_t live = m_end - m_begin;
+            if (m_begin >= live && m_buf.size() - live >= size) {
+                memmove(&m_buf[0], &m_buf[m_begin], live);
+            } else {
+                std::vector<char> newBuf(std::max(m_buf.size() * 2,
+                                                  live + size));
+                if (live > 0) {
+                    memcpy(&newBuf[0], &m_buf[m_begin], live);
+                }
+                m_buf.swap(newBuf);
+            }
+            m_begin = 0;
+            m_end = live;
+        }
+        return m_buf.data() + m_end;
+    }
+
+    void commit(size_t size) {
+        ASSERT(size <= m_buf.size() - m_end);
+        m_end += size;
+    }
+
+    void consume(size_t size) {
+        ASSERT(size <= this->size());
+        m_begin += size;
+        if (m_begin == m_end) {
+            m_begin = 0;
+            m_end = 0;
+        }
+    }
+
+    void clear() {
+        m_begin = 0;
+        m_end = 0;
+    }
+
+    // Frees the buffer if the queue is empty.
+    void releaseIfEmpty() {
+        if (empty()) {
+            std::vector<char>().swap(m_buf);
+            clear();
+        }
+    }
+
+private:
+    std::vector<char> m_buf;
+    size_t m_begin = 0;
+    size_t m_end = 0;
+};
+
+#endif // BYTE_QUEUE_H
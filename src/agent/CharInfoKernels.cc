@@ -0,0 +1,309 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "CharInfoKernels.h"
+
+#include <windows.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../shared/DebugClient.h"
+
+// The vector kernels use per-function target attributes, so the rest of the
+// agent can still be compiled for a baseline x86 CPU.  GCC needs 4.9 or later
+// to use the intrinsics headers that way.
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#define WINPTY_CHAR_INFO_SIMD 1
+#define WINPTY_TARGET_SSE2
+#define WINPTY_TARGET_AVX2
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+        (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define WINPTY_CHAR_INFO_SIMD 1
+#define WINPTY_TARGET_SSE2 __attribute__((target("sse2")))
+#define WINPTY_TARGET_AVX2 __attribute__((target("avx2")))
+#include <cpuid.h>
+#include <immintrin.h>
+#else
+#define WINPTY_CHAR_INFO_SIMD 0
+#endif
+
+namespace {
+
+static_assert(sizeof(CHAR_INFO) == sizeof(uint32_t),
+    "CHAR_INFO is expected to be 4 bytes");
+
+// A CHAR_INFO cell viewed as one 32-bit unit: the UTF-16 character in the low
+// half and the attributes in the high half.
+static inline uint32_t packedCell(wchar_t ch, WORD attributes)
+{
+    return static_cast<uint16_t>(ch) |
+        (static_cast<uint32_t>(attributes) << 16);
+}
+
+static bool isRunBlankScalar(const CHAR_INFO *cells, int count,
+                             uint32_t blank)
+{
+    for (int i = 0; i < count; ++i) {
+        uint32_t cell;
+        memcpy(&cell, &cells[i], sizeof(cell));
+        if (cell != blank) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void maskAttributesScalar(CHAR_INFO *cells, size_t count, WORD mask)
+{
+    for (size_t i = 0; i < count; ++i) {
+        cells[i].Attributes &= mask;
+    }
+}
+
+// The copy kernels accept characters in (low, 0x7F): 0x20 excludes spaces,
+// and 0x1F includes them.
+static inline bool isPlainAsciiCell(uint32_t cell, uint32_t attributes,
+                                    uint32_t low)
+{
+    const uint32_t ch = cell & 0xFFFF;
+    return (cell & 0xFFFF0000) == attributes && ch > low && ch < 0x7F;
+}
+
+static int copyAsciiRunScalar(const CHAR_INFO *cells, int count,
+                              uint32_t attributes, uint32_t low, char *out)
+{
+    int i = 0;
+    for (; i < count; ++i) {
+        uint32_t cell;
+        memcpy(&cell, &cells[i], sizeof(cell));
+        if (!isPlainAsciiCell(cell, attributes, low)) {
+            break;
+        }
+        out[i] = static_cast<char>(cell);
+    }
+    return i;
+}
+
+#if WINPTY_CHAR_INFO_SIMD
+
+// Checks 8 cells at a time and narrows them to bytes with two packs.
+WINPTY_TARGET_SSE2
+static int copyAsciiRunSse2(const CHAR_INFO *cells, int count,
+                            uint32_t attributes, uint32_t lowChar, char *out)
+{
+    const __m128i charMask = _mm_set1_epi32(0xFFFF);
+    const __m128i attrMask = _mm_set1_epi32(0xFFFF0000);
+    const __m128i attrs = _mm_set1_epi32(attributes);
+    const __m128i low = _mm_set1_epi32(lowChar);
+    const __m128i high = _mm_set1_epi32(0x7F);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m128i a = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(cells + i));
+        const __m128i b = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(cells + i + 4));
+        const __m128i ca = _mm_and_si128(a, charMask);
+        const __m128i cb = _mm_and_si128(b, charMask);
+        const __m128i okA = _mm_and_si128(
+            _mm_cmpeq_epi32(_mm_and_si128(a, attrMask), attrs),
+            _mm_and_si128(_mm_cmpgt_epi32(ca, low), _mm_cmplt_epi32(ca, high)));
+        const __m128i okB = _mm_and_si128(
+            _mm_cmpeq_epi32(_mm_and_si128(b, attrMask), attrs),
+            _mm_and_si128(_mm_cmpgt_epi32(cb, low), _mm_cmplt_epi32(cb, high)));
+        if (_mm_movemask_epi8(_mm_and_si128(okA, okB)) != 0xFFFF) {
+            break;
+        }
+        const __m128i words = _mm_packs_epi32(ca, cb);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i),
+                         _mm_packus_epi16(words, words));
+    }
+    return i + copyAsciiRunScalar(cells + i, count - i, attributes, lowChar,
+                                  out + i);
+}
+
+WINPTY_TARGET_SSE2
+static bool isRunBlankSse2(const CHAR_INFO *cells, int count, uint32_t blank)
+{
+    const __m128i pattern = _mm_set1_epi32(blank);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i v = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(cells + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, pattern)) != 0xFFFF) {
+            return false;
+        }
+    }
+    return isRunBlankScalar(cells + i, count - i, blank);
+}
+
+WINPTY_TARGET_SSE2
+static void maskAttributesSse2(CHAR_INFO *cells, size_t count, WORD mask)
+{
+    const __m128i pattern = _mm_set1_epi32(packedCell(0xFFFF, mask));
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i *const p = reinterpret_cast<__m128i*>(cells + i);
+        _mm_storeu_si128(p, _mm_and_si128(_mm_loadu_si128(p), pattern));
+    }
+    maskAttributesScalar(cells + i, count - i, mask);
+}
+
+WINPTY_TARGET_AVX2
+static bool isRunBlankAvx2(const CHAR_INFO *cells, int count, uint32_t blank)
+{
+    const __m256i pattern = _mm256_set1_epi32(blank);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i v = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(cells + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(v, pattern)) != -1) {
+            return false;
+        }
+    }
+    return isRunBlankScalar(cells + i, count - i, blank);
+}
+
+WINPTY_TARGET_AVX2
+static void maskAttributesAvx2(CHAR_INFO *cells, size_t count, WORD mask)
+{
+    const __m256i pattern = _mm256_set1_epi32(packedCell(0xFFFF, mask));
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i *const p = reinterpret_cast<__m256i*>(cells + i);
+        _mm256_storeu_si256(p, _mm256_and_si256(_mm256_loadu_si256(p), pattern));
+    }
+    maskAttributesScalar(cells + i, count - i, mask);
+}
+
+static void cpuidQuery(int leaf, uint32_t (&regs)[4])
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, leaf, 0);
+    for (int i = 0; i < 4; ++i) {
+        regs[i] = info[i];
+    }
+#else
+    __cpuid_count(leaf, 0, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// AVX2 also requires the OS to save the YMM registers on context switches.
+static bool osSavesYmmState()
+{
+#if defined(_MSC_VER)
+    return (_xgetbv(0) & 6) == 6;
+#else
+    uint32_t eax, edx;
+    // xgetbv, encoded for assemblers that lack the mnemonic.
+    __asm__ volatile (".byte 0x0f, 0x01, 0xd0"
+                      : "=a" (eax), "=d" (edx) : "c" (0));
+    return (eax & 6) == 6;
+#endif
+}
+
+#endif // WINPTY_CHAR_INFO_SIMD
+
+struct Kernels {
+    const char *name;
+    bool (*isRunBlank)(const CHAR_INFO *cells, int count, uint32_t blank);
+    void (*maskAttributes)(CHAR_INFO *cells, size_t count, WORD mask);
+    int (*copyAsciiRun)(const CHAR_INFO *cells, int count,
+                        uint32_t attributes, uint32_t low, char *out);
+};
+
+static Kernels selectKernels()
+{
+    const Kernels scalar = {
+        "scalar", isRunBlankScalar, maskAttributesScalar, copyAsciiRunScalar
+    };
+    if (hasDebugFlag("scalar_char_info")) {
+        return scalar;
+    }
+#if WINPTY_CHAR_INFO_SIMD
+    uint32_t regs[4] = {};
+    cpuidQuery(0, regs);
+    const uint32_t maxLeaf = regs[0];
+    if (maxLeaf < 1) {
+        return scalar;
+    }
+    cpuidQuery(1, regs);
+    const bool hasSse2 = (regs[3] & (1u << 26)) != 0;
+    const bool hasOsxsave = (regs[2] & (1u << 27)) != 0;
+    const bool hasAvx = (regs[2] & (1u << 28)) != 0;
+    bool hasAvx2 = false;
+    if (maxLeaf >= 7 && hasOsxsave && hasAvx && osSavesYmmState()) {
+        cpuidQuery(7, regs);
+        hasAvx2 = (regs[1] & (1u << 5)) != 0;
+    }
+    if (hasAvx2) {
+        // Narrowing to bytes doesn't gain much from AVX2's in-lane packs.
+        const Kernels avx2 = {
+            "AVX2", isRunBlankAvx2, maskAttributesAvx2, copyAsciiRunSse2
+        };
+        return avx2;
+    }
+    if (hasSse2) {
+        const Kernels sse2 = {
+            "SSE2", isRunBlankSse2, maskAttributesSse2, copyAsciiRunSse2
+        };
+        return sse2;
+    }
+#endif
+    return scalar;
+}
+
+static const Kernels &kernels()
+{
+    static const Kernels ret = [] {
+        const Kernels k = selectKernels();
+        trace("CHAR_INFO kernels: %s", k.name);
+        return k;
+    }();
+    return ret;
+}
+
+} // anonymous namespace
+
+bool isCharInfoRunBlank(const CHAR_INFO *cells, int count, WORD attributes)
+{
+    return kernels().isRunBlank(cells, count, packedCell(L' ', attributes));
+}
+
+void maskCharInfoAttributes(CHAR_INFO *cells, size_t count, WORD mask)
+{
+    kernels().maskAttributes(cells, count, mask);
+}
+
+int copyAsciiCharInfoRun(const CHAR_INFO *cells, int count, WORD attributes,
+                         char *out)
+{
+    return kernels().copyAsciiRun(cells, count,
+                                  packedCell(0, attributes), 0x20, out);
+}
+
+int copyPrintableCharInfoRun(const CHAR_INFO *cells, int count,
+                             WORD attributes, char *out)
+{
+    return kernels().copyAsciiRun(cells, count,
+                                  packedCell(0, attributes), 0x1F, out);
+}
@@ -0,0 +1,49 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_CHAR_INFO_KERNELS_H
+#define AGENT_CHAR_INFO_KERNELS_H
+
+#include <windows.h>
+
+// Bulk operations over runs of CHAR_INFO cells.  These loops run over every
+// scraped cell, so they use SSE2 or AVX2 when the CPU supports it (detected
+// once, at first use), with scalar fallbacks.  Setting the
+// "scalar_char_info" debug flag forces the scalar versions.
+
+// Returns true if every cell is a space with the given attributes.
+bool isCharInfoRunBlank(const CHAR_INFO *cells, int count, WORD attributes);
+
+// ANDs the attributes of every cell with the given mask.
+void maskCharInfoAttributes(CHAR_INFO *cells, size_t count, WORD mask);
+
+// Copies the leading run of cells that hold printable, non-space ASCII with
+// the given attributes to `out`, one byte per cell.  Returns the run
+// length.  `out` must have room for `count` bytes.
+int copyAsciiCharInfoRun(const CHAR_INFO *cells, int count, WORD attributes,
+                         char *out);
+
+// Like copyAsciiCharInfoRun, but spaces are included in the run.  A return
+// value of `count` means that every cell is printable ASCII with the given
+// attributes.
+int copyPrintableCharInfoRun(const CHAR_INFO *cells, int count,
+                             WORD attributes, char *out);
+
+#endif // AGENT_CHAR_INFO_KERNELS_H
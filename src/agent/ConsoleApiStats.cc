@@ -0,0 +1,99 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+#include "ConsoleApiStats.h"
+
+#include <string.h>
+
+#include "../shared/Mutex.h"
+#include "../shared/WinptyAssert.h"
+
+#include "EtwTrace.h"
+
+namespace {
+
+struct ApiCounters {
+    uint64_t calls;
+    uint64_t cells;
+    uint64_t ticks;
+};
+
+// The input thread writes input records while the scraper reads the
+// buffer, so the counters take a lock.  It's uncontended nearly always, and
+// cheap next to the round trip it measures.
+Mutex g_consoleApiMutex;
+ApiCounters g_consoleApiCounters[WINPTY_CONSOLE_API_COUNT];
+
+uint64_t performanceFrequency()
+{
+    static const uint64_t freq = []() -> uint64_t {
+        LARGE_INTEGER value = {};
+        QueryPerformanceFrequency(&value);
+        return value.QuadPart > 0 ? value.QuadPart : 1;
+    }();
+    return freq;
+}
+
+// Splits the division so a large tick count doesn't overflow.
+int64_t ticksToUs(uint64_t ticks)
+{
+    const uint64_t freq = performanceFrequency();
+    return static_cast<int64_t>(ticks / freq * 1000000 +
+                                ticks % freq * 1000000 / freq);
+}
+
+} // anonymous namespace
+
+ConsoleApiScope::ConsoleApiScope(int api, int64_t cells) :
+    m_api(api), m_cells(cells)
+{
+    ASSERT(api >= 0 && api < WINPTY_CONSOLE_API_COUNT);
+    QueryPerformanceCounter(&m_start);
+}
+
+ConsoleApiScope::~ConsoleApiScope()
+{
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+    const uint64_t ticks = end.QuadPart - m_start.QuadPart;
+    {
+        LockGuard<Mutex> lock(g_consoleApiMutex);
+        ApiCounters &counters = g_consoleApiCounters[m_api];
+        ++counters.calls;
+        counters.cells += m_cells;
+        counters.ticks += ticks;
+    }
+    ETW_EVENT("ConsoleApi",
+              {"api", m_api}, {"cells", m_cells}, {"us", ticksToUs(ticks)});
+}
+
+void consoleApiStats(uint64_t *out)
+{
+    ApiCounters copy[WINPTY_CONSOLE_API_COUNT];
+    {
+        LockGuard<Mutex> lock(g_consoleApiMutex);
+        memcpy(copy, g_consoleApiCounters, sizeof(copy));
+    }
+    for (int i = 0; i < WINPTY_CONSOLE_API_COUNT; ++i) {
+        uint64_t *row = &out[i * WINPTY_CONSOLE_API_COLUMNS];
+        row[WINPTY_CONSOLE_API_CALLS] = copy[i].calls;
+        row[WINPTY_CONSOLE_API_CELLS] = copy[i].cells;
+        row[WINPTY_CONSOLE_API_US] = ticksToUs(copy[i].ticks);
+    }
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+#ifndef AGENT_CONSOLE_API_STATS_H
+#define AGENT_CONSOLE_API_STATS_H
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "../include/winpty_constants.h"
+
+// Counts the console API calls the agent makes, by WINPTY_CONSOLE_API_xxx
+// kind: the calls, the cells (or input records) they transferred, and the
+// time they took, measured with QueryPerformanceCounter.  Most calls are
+// conhost round trips, so the table shows which of them dominate on a given
+// Windows build.  The counters are process-wide and any thread may add to
+// them.  While the ETW provider is enabled, each call is also written as a
+// ConsoleApi event.
+class ConsoleApiScope {
+public:
+    explicit ConsoleApiScope(int api, int64_t cells=0);
+    ~ConsoleApiScope();
+
+    // For calls that learn the cell count only once they return.
+    void setCells(int64_t cells) { m_cells = cells; }
+
+    ConsoleApiScope(const ConsoleApiScope &other) = delete;
+    ConsoleApiScope &operator=(const ConsoleApiScope &other) = delete;
+
+private:
+    const int m_api;
+    int64_t m_cells;
+    LARGE_INTEGER m_start;
+};
+
+// Copies the counters, indexed [api * WINPTY_CONSOLE_API_COLUMNS + column].
+void consoleApiStats(uint64_t *out);
+
+#endif // AGENT_CONSOLE_API_STATS_H
@@ -0,0 +1,88 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_CONSOLE_BUFFER_H
+#define AGENT_CONSOLE_BUFFER_H
+
+#include <windows.h>
+
+#include <string.h>
+
+#include "Coord.h"
+#include "SmallRect.h"
+
+class ConsoleScreenBufferInfo : public CONSOLE_SCREEN_BUFFER_INFO {
+public:
+    ConsoleScreenBufferInfo()
+    {
+        memset(this, 0, sizeof(*this));
+    }
+
+    Coord bufferSize() const        { return dwSize;    }
+    SmallRect windowRect() const    { return srWindow;  }
+    Coord cursorPosition() const    { return dwCursorPosition; }
+};
+
+// The screen buffer operations the scraper uses.  Win32ConsoleBuffer
+// implements them on a real console.  MemoryConsoleBuffer keeps the cells in
+// memory, which lets the scraper and terminal run offline, without conhost.
+class ConsoleBuffer {
+public:
+    static const int kDefaultAttributes = 7;
+
+    virtual ~ConsoleBuffer() {}
+
+    // Blank the cells of `rect` with the default attributes.
+    virtual void clearRect(const SmallRect &rect) = 0;
+    void clearLines(int row, int count, const ConsoleScreenBufferInfo &info) {
+        clearRect(SmallRect(0, row, info.bufferSize().X, count));
+    }
+    void clearAllLines(const ConsoleScreenBufferInfo &info) {
+        clearLines(0, info.bufferSize().Y, info);
+    }
+
+    // Buffer and window sizes.
+    virtual ConsoleScreenBufferInfo bufferInfo() = 0;
+    Coord bufferSize() { return bufferInfo().bufferSize(); }
+    SmallRect windowRect() { return bufferInfo().windowRect(); }
+    virtual bool resizeBufferRange(const Coord &initialSize,
+                                   Coord &finalSize) = 0;
+    bool resizeBufferRange(const Coord &initialSize) {
+        Coord dummy;
+        return resizeBufferRange(initialSize, dummy);
+    }
+    virtual void moveWindow(const SmallRect &rect) = 0;
+    virtual Coord largestWindowSize() = 0;
+    virtual void setSmallFont(int columns, bool isNewW10) = 0;
+    virtual DWORD outputMode() = 0;
+
+    // Cursor.
+    Coord cursorPosition() { return bufferInfo().cursorPosition(); }
+    virtual void setCursorPosition(const Coord &point) = 0;
+
+    // Screen content.  A read fails if the console can't allocate room for
+    // it, which happens for large reads before Windows 8.
+    virtual bool read(const SmallRect &rect, CHAR_INFO *data) = 0;
+    virtual void write(const SmallRect &rect, const CHAR_INFO *data) = 0;
+
+    virtual void setTextAttribute(WORD attributes) = 0;
+};
+
+#endif // AGENT_CONSOLE_BUFFER_H
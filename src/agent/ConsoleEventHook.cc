@@ -0,0 +1,212 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "ConsoleEventHook.h"
+
+#include <windows.h>
+
+#include <algorithm>
+
+#include "../shared/DebugClient.h"
+#include "../shared/WinptyAssert.h"
+
+#include "EventLoop.h"
+
+// Older MinGW headers lack the console WinEvent constants.
+#ifndef EVENT_CONSOLE_CARET
+#define EVENT_CONSOLE_CARET             0x4001
+#define EVENT_CONSOLE_UPDATE_REGION     0x4002
+#define EVENT_CONSOLE_UPDATE_SIMPLE     0x4003
+#define EVENT_CONSOLE_UPDATE_SCROLL     0x4004
+#endif
+#ifndef EVENT_CONSOLE_LAYOUT
+#define EVENT_CONSOLE_LAYOUT            0x4005
+#endif
+#ifndef EVENT_CONSOLE_START_APPLICATION
+#define EVENT_CONSOLE_START_APPLICATION 0x4006
+#define EVENT_CONSOLE_END_APPLICATION   0x4007
+#endif
+
+namespace {
+
+// WINEVENTPROC has no context parameter, and the agent only ever watches its
+// own console, so the active hook is kept in a global.
+ConsoleEventHook *g_activeHook = nullptr;
+
+} // anonymous namespace
+
+ConsoleEventHook::ConsoleEventHook(HWND consoleWindow, EventLoop &eventLoop) :
+    m_consoleWindow(consoleWindow),
+    m_eventLoop(eventLoop)
+{
+    ASSERT(g_activeHook == nullptr);
+    g_activeHook = this;
+    m_hook = SetWinEventHook(
+        EVENT_CONSOLE_CARET, EVENT_CONSOLE_END_APPLICATION,
+        nullptr, winEventProc, 0, 0,
+        WINEVENT_OUTOFCONTEXT);
+    if (m_hook == nullptr) {
+        trace("SetWinEventHook failed: error %u",
+            static_cast<unsigned int>(GetLastError()));
+        g_activeHook = nullptr;
+        return;
+    }
+    // The name change event is far outside the console event range, so it
+    // needs a hook of its own.  Without it, the agent polls the title.
+    m_nameHook = SetWinEventHook(
+        EVENT_OBJECT_NAMECHANGE, EVENT_OBJECT_NAMECHANGE,
+        nullptr, winEventProc, 0, 0,
+        WINEVENT_OUTOFCONTEXT);
+    if (m_nameHook == nullptr) {
+        trace("SetWinEventHook(EVENT_OBJECT_NAMECHANGE) failed: error %u",
+            static_cast<unsigned int>(GetLastError()));
+    }
+}
+
+ConsoleEventHook::~ConsoleEventHook()
+{
+    if (m_nameHook != nullptr) {
+        UnhookWinEvent(m_nameHook);
+    }
+    if (m_hook != nullptr) {
+        UnhookWinEvent(m_hook);
+        g_activeHook = nullptr;
+    }
+}
+
+ConsoleEventHook::DirtyRegion ConsoleEventHook::takeDirtyRegion()
+{
+    const DirtyRegion ret = m_dirty;
+    m_dirty = DirtyRegion();
+    m_pending = false;
+    return ret;
+}
+
+// Drop events that have already been queued.  The agent calls this right after
+// scraping, because freezing the console and writing the sync marker generate
+// console events of their own, and reacting to them would make the agent
+// scrape in a loop.  While the console is frozen, programs can't write to it,
+// so real output is rarely discarded this way, and the safety-net poll picks
+// up anything that is.
+void ConsoleEventHook::discardPendingEvents()
+{
+    // Setting m_pending suppresses the poll requests onEvent would otherwise
+    // make while the queue drains.
+    m_pending = true;
+    m_eventLoop.pumpWindowMessages();
+    takeDirtyRegion();
+}
+
+// Returns whether a process has attached or detached since the last call.
+bool ConsoleEventHook::takeProcessListChange()
+{
+    const bool ret = m_processListChanged;
+    m_processListChanged = false;
+    return ret;
+}
+
+bool ConsoleEventHook::takeLayoutChange()
+{
+    const bool ret = m_layoutChanged;
+    m_layoutChanged = false;
+    return ret;
+}
+
+// Returns whether the console title has changed since the last call.
+bool ConsoleEventHook::takeTitleChange()
+{
+    const bool ret = m_titleChanged;
+    m_titleChanged = false;
+    return ret;
+}
+
+void CALLBACK ConsoleEventHook::winEventProc(
+        HWINEVENTHOOK hook, DWORD event, HWND hwnd,
+        LONG idObject, LONG idChild, DWORD eventThread, DWORD eventTime)
+{
+    ConsoleEventHook *const self = g_activeHook;
+    if (self == nullptr ||
+            (hook != self->m_hook && hook != self->m_nameHook) ||
+            hwnd != self->m_consoleWindow) {
+        return;
+    }
+    self->onEvent(event, idObject, idChild);
+}
+
+void ConsoleEventHook::onEvent(DWORD event, LONG idObject, LONG idChild)
+{
+    switch (event) {
+    case EVENT_CONSOLE_UPDATE_REGION:
+        // idObject and idChild are the upper-left and lower-right corners of
+        // the updated region, packed as (X, Y) coordinates.
+        markRowsDirty(HIWORD(idObject), HIWORD(idChild),
+                      std::max(LOWORD(idObject), LOWORD(idChild)));
+        break;
+    case EVENT_CONSOLE_UPDATE_SIMPLE:
+        // idObject is the coordinate of a single updated character.
+        markRowsDirty(HIWORD(idObject), HIWORD(idObject), LOWORD(idObject));
+        break;
+    case EVENT_CONSOLE_UPDATE_SCROLL:
+        m_dirty.scrolled = true;
+        break;
+    case EVENT_CONSOLE_CARET:
+        m_dirty.caretMoved = true;
+        break;
+    case EVENT_CONSOLE_LAYOUT:
+        m_dirty.layoutChanged = true;
+        m_layoutChanged = true;
+        break;
+    case EVENT_CONSOLE_START_APPLICATION:
+    case EVENT_CONSOLE_END_APPLICATION:
+        // This doesn't need a scrape, but the next poll reports the change.
+        m_processListChanged = true;
+        m_eventLoop.requestPoll();
+        return;
+    case EVENT_OBJECT_NAMECHANGE:
+        if (idObject == OBJID_WINDOW && idChild == CHILDID_SELF) {
+            m_titleChanged = true;
+            m_eventLoop.requestPoll();
+        }
+        return;
+    default:
+        return;
+    }
+    if (!m_pending) {
+        m_pending = true;
+        m_eventLoop.requestPoll();
+    }
+}
+
+void ConsoleEventHook::markRowsDirty(int top, int bottom, int right)
+{
+    if (top > bottom) {
+        std::swap(top, bottom);
+    }
+    if (!m_dirty.updated) {
+        m_dirty.updated = true;
+        m_dirty.top = top;
+        m_dirty.bottom = bottom;
+        m_dirty.right = right;
+    } else {
+        m_dirty.top = std::min(m_dirty.top, top);
+        m_dirty.bottom = std::max(m_dirty.bottom, bottom);
+        m_dirty.right = std::max(m_dirty.right, right);
+    }
+}
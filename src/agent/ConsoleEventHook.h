@@ -0,0 +1,90 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_CONSOLE_EVENT_HOOK_H
+#define AGENT_CONSOLE_EVENT_HOOK_H
+
+#include <windows.h>
+
+class EventLoop;
+
+// Watches the console window for the WinEvent notifications the console
+// raises when its content changes (EVENT_CONSOLE_UPDATE_REGION,
+// EVENT_CONSOLE_UPDATE_SIMPLE, EVENT_CONSOLE_UPDATE_SCROLL,
+// EVENT_CONSOLE_CARET, and EVENT_CONSOLE_LAYOUT), so that the agent can
+// scrape when something has actually happened instead of polling at a fixed
+// interval.  It also notes
+// when a process attaches to or detaches from the console
+// (EVENT_CONSOLE_START_APPLICATION and EVENT_CONSOLE_END_APPLICATION), and
+// when the window's title changes (EVENT_OBJECT_NAMECHANGE).
+//
+// The hook is out-of-context, so its callback runs on the thread that
+// installed it, from inside a message retrieval function.  The EventLoop must
+// therefore pump window messages (see EventLoop::setPumpWindowMessages).  Each
+// event accumulates into a dirty region and requests an early poll.
+class ConsoleEventHook {
+public:
+    struct DirtyRegion {
+        bool updated = false;       // Content changed within [top, bottom].
+        bool scrolled = false;      // The buffer scrolled; rows are unknown.
+        bool caretMoved = false;
+        bool layoutChanged = false; // E.g. another screen buffer activated.
+        int top = -1;               // Inclusive buffer row range.
+        int bottom = -1;
+        int right = -1;             // The rightmost updated column.
+    };
+
+    ConsoleEventHook(HWND consoleWindow, EventLoop &eventLoop);
+    ~ConsoleEventHook();
+    bool valid() const { return m_hook != nullptr; }
+    bool hasPendingEvents() const { return m_pending; }
+    DirtyRegion takeDirtyRegion();
+    void discardPendingEvents();
+    bool takeProcessListChange();
+    // Returns whether the console's layout, e.g. its active screen buffer,
+    // has changed since the last call.  Unlike the dirty region, this isn't
+    // cleared by discardPendingEvents.
+    bool takeLayoutChange();
+    bool tracksTitle() const { return m_nameHook != nullptr; }
+    bool takeTitleChange();
+
+    ConsoleEventHook(const ConsoleEventHook &other) = delete;
+    ConsoleEventHook &operator=(const ConsoleEventHook &other) = delete;
+
+private:
+    static void CALLBACK winEventProc(HWINEVENTHOOK hook, DWORD event,
+                                      HWND hwnd, LONG idObject, LONG idChild,
+                                      DWORD eventThread, DWORD eventTime);
+    void onEvent(DWORD event, LONG idObject, LONG idChild);
+    void markRowsDirty(int top, int bottom, int right);
+
+private:
+    HWND m_consoleWindow = nullptr;
+    EventLoop &m_eventLoop;
+    HWINEVENTHOOK m_hook = nullptr;
+    HWINEVENTHOOK m_nameHook = nullptr;
+    bool m_pending = false;
+    DirtyRegion m_dirty;
+    bool m_processListChanged = false;
+    bool m_layoutChanged = false;
+    bool m_titleChanged = false;
+};
+
+#endif // AGENT_CONSOLE_EVENT_HOOK_H
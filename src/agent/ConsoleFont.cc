@@ -33,6 +33,7 @@
 
 #include "../shared/DebugClient.h"
 #include "../shared/OsModule.h"
+#include "../shared/StringBuilder.h"
 #include "../shared/StringUtil.h"
 #include "../shared/WindowsVersion.h"
 #include "../shared/WinptyAssert.h"
@@ -361,6 +362,99 @@ private:
     SetCurrentConsoleFontEx_t *m_SetCurrentConsoleFontEx;
 };
 
+// Probing for a usable font is one of the slower parts of agent startup, so
+// the outcome is remembered per user, keyed on everything that affects it.
+// A cached choice is still verified before it's trusted.
+const wchar_t kFontCacheKey[] = L"Software\\winpty\\FontCache";
+
+// Identifies the installed Windows build, including its update revision,
+// so that an OS update invalidates the cache.  GetVersionEx is no good here,
+// because it reports 6.2 on unmanifested Windows 10 executables.
+static std::wstring windowsBuildString() {
+    WStringBuilder sb(32);
+    HKEY key = nullptr;
+    if (RegOpenKeyExW(HKEY_LOCAL_MACHINE,
+            L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion",
+            0, KEY_QUERY_VALUE, &key) != ERROR_SUCCESS) {
+        return L"unknown";
+    }
+    wchar_t build[32] = {};
+    DWORD size = sizeof(build) - sizeof(wchar_t);
+    DWORD type = 0;
+    if (RegQueryValueExW(key, L"CurrentBuildNumber", nullptr, &type,
+                reinterpret_cast<BYTE*>(build), &size) == ERROR_SUCCESS &&
+            type == REG_SZ) {
+        sb << build;
+    } else {
+        sb << L"unknown";
+    }
+    DWORD ubr = 0;
+    size = sizeof(ubr);
+    if (RegQueryValueExW(key, L"UBR", nullptr, &type,
+                reinterpret_cast<BYTE*>(&ubr), &size) == ERROR_SUCCESS &&
+            type == REG_DWORD) {
+        sb << L'.' << ubr;
+    }
+    RegCloseKey(key);
+    return sb.str_moved();
+}
+
+static std::wstring fontCacheValueName(const wchar_t *api, int codePage,
+                                       int columns, bool isNewW10) {
+    WStringBuilder sb(64);
+    sb << api << L"-cp" << codePage << L"-cols" << columns
+       << L"-build" << windowsBuildString()
+       << (isNewW10 ? L"-newW10" : L"");
+    return sb.str_moved();
+}
+
+static bool readFontCache(const std::wstring &name, DWORD &value) {
+    if (hasDebugFlag("no_font_cache")) {
+        return false;
+    }
+    HKEY key = nullptr;
+    if (RegOpenKeyExW(HKEY_CURRENT_USER, kFontCacheKey, 0, KEY_QUERY_VALUE,
+            &key) != ERROR_SUCCESS) {
+        return false;
+    }
+    DWORD type = 0;
+    DWORD size = sizeof(value);
+    const bool ret = RegQueryValueExW(key, name.c_str(), nullptr, &type,
+                        reinterpret_cast<BYTE*>(&value), &size)
+                            == ERROR_SUCCESS &&
+                     type == REG_DWORD;
+    RegCloseKey(key);
+    return ret;
+}
+
+static void writeFontCache(const std::wstring &name, DWORD value) {
+    if (hasDebugFlag("no_font_cache")) {
+        return;
+    }
+    HKEY key = nullptr;
+    if (RegCreateKeyExW(HKEY_CURRENT_USER, kFontCacheKey, 0, nullptr, 0,
+            KEY_SET_VALUE, nullptr, &key, nullptr) != ERROR_SUCCESS) {
+        trace("writeFontCache: RegCreateKeyExW failed");
+        return;
+    }
+    if (RegSetValueExW(key, name.c_str(), 0, REG_DWORD,
+            reinterpret_cast<const BYTE*>(&value),
+            sizeof(value)) != ERROR_SUCCESS) {
+        trace("writeFontCache: RegSetValueExW failed");
+    }
+    RegCloseKey(key);
+}
+
+static void eraseFontCache(const std::wstring &name) {
+    HKEY key = nullptr;
+    if (RegOpenKeyExW(HKEY_CURRENT_USER, kFontCacheKey, 0, KEY_SET_VALUE,
+            &key) != ERROR_SUCCESS) {
+        return;
+    }
+    RegDeleteValueW(key, name.c_str());
+    RegCloseKey(key);
+}
+
 static std::vector<std::pair<DWORD, COORD> > readFontTable(
         XPFontAPI &api, HANDLE conout, DWORD maxCount) {
     std::vector<std::pair<DWORD, COORD> > ret;
@@ -599,20 +693,44 @@ static Font selectSmallFont(int codePage, int columns, bool isNewW10) {
     return Font { faceName, fontFamily, table[bestIndex].size };
 }
 
+// The cached choice for the Vista API: which code page's font was accepted.
+enum VistaFontChoice : DWORD {
+    kVistaFontCodePage = 0,
+    kVistaFontFallback = 1,
+};
+
 static void setSmallFontVista(VistaFontAPI &api, HANDLE conout,
                               int columns, bool isNewW10) {
     int codePage = GetConsoleOutputCP();
+    const bool isCJK = codePage == 932 || codePage == 936 ||
+                       codePage == 949 || codePage == 950;
+    const auto cacheName =
+        fontCacheValueName(L"vista", codePage, columns, isNewW10);
+    DWORD cached = 0;
+    if (readFontCache(cacheName, cached) &&
+            (cached == kVistaFontCodePage ||
+                (cached == kVistaFontFallback && isCJK))) {
+        const auto font = selectSmallFont(
+            cached == kVistaFontFallback ? 0 : codePage, columns, isNewW10);
+        if (setFontVista(api, conout, font)) {
+            trace("setSmallFontVista: cached font was successful");
+            return;
+        }
+        trace("setSmallFontVista: cached font failed -- probing");
+        eraseFontCache(cacheName);
+    }
     const auto font = selectSmallFont(codePage, columns, isNewW10);
     if (setFontVista(api, conout, font)) {
         trace("setSmallFontVista: success");
+        writeFontCache(cacheName, kVistaFontCodePage);
         return;
     }
-    if (codePage == 932 || codePage == 936 ||
-            codePage == 949 || codePage == 950) {
+    if (isCJK) {
         trace("setSmallFontVista: falling back to default codepage font instead");
         const auto fontFB = selectSmallFont(0, columns, isNewW10);
         if (setFontVista(api, conout, fontFB)) {
             trace("setSmallFontVista: fallback was successful");
+            writeFontCache(cacheName, kVistaFontFallback);
             return;
         }
     }
@@ -628,7 +746,41 @@ struct FontSizeComparator {
     }
 };
 
+static bool setFontXP(UndocumentedXPFontAPI &api, HANDLE conout,
+                      DWORD fontIndex) {
+    trace("setSmallFontXP: setting font to %u",
+        static_cast<unsigned>(fontIndex));
+    if (!api.SetConsoleFont()(conout, fontIndex)) {
+        trace("setSmallFontXP: SetConsoleFont call failed");
+        return false;
+    }
+    AGENT_CONSOLE_FONT_INFO info;
+    if (!api.GetCurrentConsoleFont()(conout, FALSE, &info)) {
+        trace("setSmallFontXP: GetCurrentConsoleFont call failed");
+        return false;
+    }
+    if (info.nFont != fontIndex) {
+        trace("setSmallFontXP: font was not set");
+        dumpXPFont(api, conout, "setSmallFontXP: post-call font: ");
+        return false;
+    }
+    return true;
+}
+
 static void setSmallFontXP(UndocumentedXPFontAPI &api, HANDLE conout) {
+    // The XP font table doesn't depend on the column count.
+    const auto cacheName =
+        fontCacheValueName(L"xp", GetConsoleOutputCP(), 0, false);
+    DWORD cached = 0;
+    if (readFontCache(cacheName, cached)) {
+        if (setFontXP(api, conout, cached)) {
+            trace("setSmallFontXP: cached font was successful");
+            return;
+        }
+        trace("setSmallFontXP: cached font failed -- probing");
+        eraseFontCache(cacheName);
+    }
+
     // Read the console font table and sort it from smallest to largest.
     const DWORD fontCount = api.GetNumberOfConsoleFonts()();
     trace("setSmallFontXP: number of console fonts: %u",
@@ -641,23 +793,11 @@ static void setSmallFontXP(UndocumentedXPFontAPI &api, HANDLE conout) {
         if (table[i].second.X < 4) {
             continue;
         }
-        trace("setSmallFontXP: setting font to %u",
-            static_cast<unsigned>(table[i].first));
-        if (!api.SetConsoleFont()(conout, table[i].first)) {
-            trace("setSmallFontXP: SetConsoleFont call failed");
-            continue;
-        }
-        AGENT_CONSOLE_FONT_INFO info;
-        if (!api.GetCurrentConsoleFont()(conout, FALSE, &info)) {
-            trace("setSmallFontXP: GetCurrentConsoleFont call failed");
-            return;
-        }
-        if (info.nFont != table[i].first) {
-            trace("setSmallFontXP: font was not set");
-            dumpXPFont(api, conout, "setSmallFontXP: post-call font: ");
+        if (!setFontXP(api, conout, table[i].first)) {
             continue;
         }
         trace("setSmallFontXP: success");
+        writeFontCache(cacheName, table[i].first);
         return;
     }
     trace("setSmallFontXP: failure");
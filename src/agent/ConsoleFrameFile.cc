@@ -0,0 +1,291 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "ConsoleFrameFile.h"
+
+#include <string.h>
+
+namespace {
+
+// The fixed part of a frame payload: the scrape number and thirteen 16-bit
+// values.
+const size_t kFrameHeaderSize = 4 + 13 * 2;
+
+// Unchanged cells shorter than this don't end a delta run, because a new
+// run header costs as much as two cells.
+const size_t kMinDeltaGap = 3;
+
+uint16_t getU16(const char *p) {
+    return static_cast<uint16_t>(
+        static_cast<uint8_t>(p[0]) | (static_cast<uint8_t>(p[1]) << 8));
+}
+
+int16_t getI16(const char *p) {
+    return static_cast<int16_t>(getU16(p));
+}
+
+uint32_t getU32(const char *p) {
+    return getU16(p) | (static_cast<uint32_t>(getU16(p + 2)) << 16);
+}
+
+void putU16(std::string &out, uint16_t value) {
+    out.push_back(static_cast<char>(value & 0xFF));
+    out.push_back(static_cast<char>(value >> 8));
+}
+
+void putU32(std::string &out, uint32_t value) {
+    putU16(out, static_cast<uint16_t>(value & 0xFFFF));
+    putU16(out, static_cast<uint16_t>(value >> 16));
+}
+
+void putCells(std::string &out, const CHAR_INFO *cells, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        putU16(out, cells[i].Char.UnicodeChar);
+        putU16(out, cells[i].Attributes);
+    }
+}
+
+bool sameCell(const CHAR_INFO &a, const CHAR_INFO &b) {
+    return a.Char.UnicodeChar == b.Char.UnicodeChar &&
+           a.Attributes == b.Attributes;
+}
+
+void decodeCells(const char *p, size_t count, CHAR_INFO *cells) {
+    for (size_t i = 0; i < count; ++i, p += 4) {
+        cells[i].Char.UnicodeChar = getU16(p);
+        cells[i].Attributes = getU16(p + 2);
+    }
+}
+
+} // anonymous namespace
+
+void appendConsoleFrameHeader(std::string &out) {
+    out.append(kConsoleFrameMagic, sizeof(kConsoleFrameMagic));
+    putU32(out, kConsoleFrameVersion);
+}
+
+void appendConsoleFrame(std::string &out, const ConsoleFrame &frame,
+                        const ConsoleFrame *prev) {
+    const bool delta = prev != nullptr &&
+                       prev->cells.size() == frame.cells.size();
+    putU32(out, static_cast<uint32_t>(delta ? ConsoleFrameRecord::DeltaFrame
+                                            : ConsoleFrameRecord::KeyFrame));
+    const size_t sizeOffset = out.size();
+    putU32(out, 0);
+
+    putU32(out, frame.scrape);
+    const ConsoleScreenBufferInfo &info = frame.info;
+    putU16(out, info.dwSize.X);
+    putU16(out, info.dwSize.Y);
+    putU16(out, info.srWindow.Left);
+    putU16(out, info.srWindow.Top);
+    putU16(out, info.srWindow.Right);
+    putU16(out, info.srWindow.Bottom);
+    putU16(out, info.dwCursorPosition.X);
+    putU16(out, info.dwCursorPosition.Y);
+    putU16(out, info.wAttributes);
+    putU16(out, frame.rect.Left);
+    putU16(out, frame.rect.Top);
+    putU16(out, frame.rect.Right);
+    putU16(out, frame.rect.Bottom);
+
+    const CHAR_INFO *cells = frame.cells.data();
+    const size_t count = frame.cells.size();
+    if (!delta) {
+        putCells(out, cells, count);
+    } else {
+        const CHAR_INFO *prevCells = prev->cells.data();
+        size_t pos = 0;
+        while (true) {
+            const size_t skipStart = pos;
+            while (pos < count && sameCell(cells[pos], prevCells[pos])) {
+                ++pos;
+            }
+            if (pos == count) {
+                break;
+            }
+            const size_t runStart = pos;
+            size_t runEnd = pos;
+            while (pos < count) {
+                if (!sameCell(cells[pos], prevCells[pos])) {
+                    runEnd = ++pos;
+                } else if (pos - runEnd >= kMinDeltaGap) {
+                    break;
+                } else {
+                    ++pos;
+                }
+            }
+            putU32(out, static_cast<uint32_t>(runStart - skipStart));
+            putU32(out, static_cast<uint32_t>(runEnd - runStart));
+            putCells(out, cells + runStart, runEnd - runStart);
+            pos = runEnd;
+        }
+    }
+
+    const uint32_t payloadSize =
+        static_cast<uint32_t>(out.size() - sizeOffset - 4);
+    std::string sizeBytes;
+    putU32(sizeBytes, payloadSize);
+    out.replace(sizeOffset, 4, sizeBytes);
+}
+
+bool ConsoleFrameReader::open(const char *path) {
+    close();
+    m_error.clear();
+    m_prevCells.clear();
+    m_file = fopen(path, "rb");
+    if (m_file == nullptr) {
+        return fail("cannot open file");
+    }
+    char header[8];
+    if (fread(header, 1, sizeof(header), m_file) != sizeof(header) ||
+            memcmp(header, kConsoleFrameMagic, 4) != 0) {
+        return fail("not a console frame file");
+    }
+    if (getU32(header + 4) != kConsoleFrameVersion) {
+        return fail("unsupported console frame file version");
+    }
+    return true;
+}
+
+bool ConsoleFrameReader::next(ConsoleFrame &frame) {
+    if (m_file == nullptr) {
+        return false;
+    }
+    while (true) {
+        char recordHeader[8];
+        const size_t actual =
+            fread(recordHeader, 1, sizeof(recordHeader), m_file);
+        if (actual == 0 && feof(m_file)) {
+            return false;
+        } else if (actual != sizeof(recordHeader)) {
+            return fail("truncated record header");
+        }
+        const uint32_t type = getU32(recordHeader);
+        const uint32_t size = getU32(recordHeader + 4);
+        m_payload.resize(size);
+        if (size > 0 && fread(&m_payload[0], 1, size, m_file) != size) {
+            return fail("truncated record");
+        }
+        bool ok = false;
+        if (type == static_cast<uint32_t>(ConsoleFrameRecord::KeyFrame)) {
+            ok = decodeKeyFrame(m_payload, frame);
+        } else if (type == static_cast<uint32_t>(
+                ConsoleFrameRecord::DeltaFrame)) {
+            ok = decodeDeltaFrame(m_payload, frame);
+        } else {
+            continue;
+        }
+        if (ok) {
+            m_prevCells = frame.cells;
+        }
+        return ok;
+    }
+}
+
+bool ConsoleFrameReader::decodeHeader(const std::vector<char> &payload,
+                                      ConsoleFrame &frame) {
+    if (payload.size() < kFrameHeaderSize) {
+        return fail("truncated frame");
+    }
+    const char *p = payload.data();
+    frame.scrape = getU32(p);
+    ConsoleScreenBufferInfo &info = frame.info;
+    info = ConsoleScreenBufferInfo();
+    info.dwSize.X               = getI16(p + 4);
+    info.dwSize.Y               = getI16(p + 6);
+    info.srWindow.Left          = getI16(p + 8);
+    info.srWindow.Top           = getI16(p + 10);
+    info.srWindow.Right         = getI16(p + 12);
+    info.srWindow.Bottom        = getI16(p + 14);
+    info.dwCursorPosition.X     = getI16(p + 16);
+    info.dwCursorPosition.Y     = getI16(p + 18);
+    info.wAttributes            = getU16(p + 20);
+    info.dwMaximumWindowSize.X  = info.srWindow.Right - info.srWindow.Left + 1;
+    info.dwMaximumWindowSize.Y  = info.srWindow.Bottom - info.srWindow.Top + 1;
+    frame.rect.Left             = getI16(p + 22);
+    frame.rect.Top              = getI16(p + 24);
+    frame.rect.Right            = getI16(p + 26);
+    frame.rect.Bottom           = getI16(p + 28);
+    if (info.dwSize.X < 1 || info.dwSize.Y < 1 ||
+            frame.rect.width() < 1 || frame.rect.height() < 1) {
+        return fail("invalid frame geometry");
+    }
+    return true;
+}
+
+bool ConsoleFrameReader::decodeKeyFrame(const std::vector<char> &payload,
+                                        ConsoleFrame &frame) {
+    if (!decodeHeader(payload, frame)) {
+        return false;
+    }
+    const size_t count = frame.rect.width() * frame.rect.height();
+    if (payload.size() != kFrameHeaderSize + count * 4) {
+        return fail("key frame size does not match its rectangle");
+    }
+    frame.cells.resize(count);
+    decodeCells(payload.data() + kFrameHeaderSize, count, frame.cells.data());
+    return true;
+}
+
+bool ConsoleFrameReader::decodeDeltaFrame(const std::vector<char> &payload,
+                                          ConsoleFrame &frame) {
+    if (!decodeHeader(payload, frame)) {
+        return false;
+    }
+    const size_t count = frame.rect.width() * frame.rect.height();
+    if (m_prevCells.size() != count) {
+        return fail("delta frame does not match the previous frame");
+    }
+    frame.cells = m_prevCells;
+    const char *p = payload.data() + kFrameHeaderSize;
+    const char *const end = payload.data() + payload.size();
+    size_t pos = 0;
+    while (p != end) {
+        if (end - p < 8) {
+            return fail("truncated delta run");
+        }
+        const size_t skip = getU32(p);
+        const size_t run = getU32(p + 4);
+        p += 8;
+        if (skip > count - pos || run > count - pos - skip ||
+                static_cast<size_t>(end - p) < run * 4) {
+            return fail("delta run out of range");
+        }
+        pos += skip;
+        decodeCells(p, run, &frame.cells[pos]);
+        pos += run;
+        p += run * 4;
+    }
+    return true;
+}
+
+bool ConsoleFrameReader::fail(const char *what) {
+    m_error = what;
+    close();
+    return false;
+}
+
+void ConsoleFrameReader::close() {
+    if (m_file != nullptr) {
+        fclose(m_file);
+        m_file = nullptr;
+    }
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_CONSOLE_FRAME_FILE_H
+#define AGENT_CONSOLE_FRAME_FILE_H
+
+#include <windows.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "ConsoleBuffer.h"
+#include "SmallRect.h"
+
+// One console read as the agent saw it: the screen buffer info, and the
+// cells of the rectangle that was read, in row-major order.  A scrape can
+// read more than once; its reads share a scrape number.
+struct ConsoleFrame {
+    uint32_t scrape = 0;
+    ConsoleScreenBufferInfo info;
+    SmallRect rect;
+    std::vector<CHAR_INFO> cells;
+};
+
+// A recorded frame file is a header followed by records:
+//
+//   header:  "WPCF", uint32 version
+//   record:  uint32 type, uint32 payload size, payload
+//
+// A key frame payload is the uint32 scrape number, the buffer size, window
+// rect, cursor position and attributes from the screen buffer info, then the
+// read rectangle, then its cells.  Coordinates are int16 and each cell is a uint16 character and
+// a uint16 attribute.  All values are little-endian.  Readers skip record
+// types they don't know.
+//
+// A delta frame has the same header, but its cells are given relative to
+// the previous frame, which must have the same number of cells.  They are a
+// sequence of runs, each a uint32 count of unchanged cells to skip, a uint32
+// count of cells that follow, and those cells.
+const char kConsoleFrameMagic[4] = { 'W', 'P', 'C', 'F' };
+const uint32_t kConsoleFrameVersion = 1;
+
+enum class ConsoleFrameRecord : uint32_t {
+    KeyFrame = 1,
+    DeltaFrame = 2,
+};
+
+// Appends the file header to `out`.
+void appendConsoleFrameHeader(std::string &out);
+
+// Appends a record for `frame` to `out`.  When `prev` is non-null and has
+// the same number of cells, the record is a delta frame against it.
+void appendConsoleFrame(std::string &out, const ConsoleFrame &frame,
+                        const ConsoleFrame *prev);
+
+class ConsoleFrameReader {
+public:
+    ConsoleFrameReader() {}
+    ~ConsoleFrameReader() { close(); }
+    bool open(const char *path);
+    // Reads the next frame.  Returns false at the end of the file or on an
+    // error, in which case error() is non-empty.
+    bool next(ConsoleFrame &frame);
+    const std::string &error() const { return m_error; }
+    void close();
+
+    ConsoleFrameReader(const ConsoleFrameReader &other) = delete;
+    ConsoleFrameReader &operator=(const ConsoleFrameReader &other) = delete;
+
+private:
+    bool fail(const char *what);
+    bool decodeHeader(const std::vector<char> &payload, ConsoleFrame &frame);
+    bool decodeKeyFrame(const std::vector<char> &payload, ConsoleFrame &frame);
+    bool decodeDeltaFrame(const std::vector<char> &payload,
+                          ConsoleFrame &frame);
+
+    FILE *m_file = nullptr;
+    std::string m_error;
+    std::vector<char> m_payload;
+    std::vector<CHAR_INFO> m_prevCells;
+};
+
+#endif // AGENT_CONSOLE_FRAME_FILE_H
@@ -0,0 +1,194 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "ConsoleFrameRecorder.h"
+
+#include <string.h>
+
+#include <utility>
+
+#include "../shared/DebugClient.h"
+#include "../shared/StringUtil.h"
+#include "../shared/WinptyAssert.h"
+#include "../shared/winpty_snprintf.h"
+
+#include "LargeConsoleRead.h"
+
+namespace {
+
+// Frames beyond this many are dropped while the writer catches up, rather
+// than letting a slow disk grow the agent's memory.
+const size_t kMaxQueuedFrames = 64;
+
+// The writer flushes the encoded frames once they reach this size, and
+// whenever the queue is empty.
+const size_t kWriteChunkSize = 256 * 1024;
+
+} // anonymous namespace
+
+std::unique_ptr<ConsoleFrameRecorder> ConsoleFrameRecorder::createIfEnabled()
+{
+    static int s_recorderCount = 0;
+    if (!hasDebugFlag("record_frames")) {
+        return nullptr;
+    }
+    wchar_t dir[MAX_PATH];
+    const DWORD dirLen = GetTempPathW(MAX_PATH, dir);
+    if (dirLen == 0 || dirLen >= MAX_PATH) {
+        trace("record_frames: GetTempPathW failed");
+        return nullptr;
+    }
+    char name[64];
+    winpty_snprintf(name, "winpty-frames-%u-%d.wpcf",
+                    static_cast<unsigned>(GetCurrentProcessId()),
+                    s_recorderCount++);
+    std::wstring path(dir, dirLen);
+    path.append(name, name + strlen(name));
+
+    OwnedHandle file(CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+                                 NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL,
+                                 NULL));
+    if (file.get() == INVALID_HANDLE_VALUE) {
+        file.release();
+        trace("record_frames: cannot create %s", utf8FromWide(path).c_str());
+        return nullptr;
+    }
+    OwnedHandle wakeEvent(CreateEventW(NULL, FALSE, FALSE, NULL));
+    ASSERT(wakeEvent.get() != nullptr && "CreateEventW failed");
+    std::unique_ptr<ConsoleFrameRecorder> ret(
+        new ConsoleFrameRecorder(file.release(), wakeEvent.release()));
+    const HANDLE thread =
+        CreateThread(NULL, 0, writerThreadProc, ret.get(), 0, NULL);
+    if (thread == NULL) {
+        trace("record_frames: CreateThread failed");
+        return nullptr;
+    }
+    ret->m_thread = OwnedHandle(thread);
+    trace("record_frames: recording console reads to %s",
+          utf8FromWide(path).c_str());
+    return ret;
+}
+
+ConsoleFrameRecorder::ConsoleFrameRecorder(HANDLE file, HANDLE wakeEvent) :
+    m_file(file), m_wakeEvent(wakeEvent)
+{
+    appendConsoleFrameHeader(m_encoded);
+}
+
+ConsoleFrameRecorder::~ConsoleFrameRecorder()
+{
+    if (m_thread.get() != nullptr) {
+        {
+            LockGuard<Mutex> lock(m_mutex);
+            m_exiting = true;
+        }
+        SetEvent(m_wakeEvent.get());
+        WaitForSingleObject(m_thread.get(), INFINITE);
+    }
+    trace("record_frames: wrote %llu bytes, dropped %llu frames",
+          static_cast<unsigned long long>(m_bytesWritten),
+          static_cast<unsigned long long>(m_droppedFrames));
+}
+
+void ConsoleFrameRecorder::record(const ConsoleScreenBufferInfo &info,
+                                  const LargeConsoleReadBuffer &buffer)
+{
+    const SmallRect &rect = buffer.rect();
+    const CHAR_INFO *cells = buffer.lineData(rect.Top);
+    const size_t count = rect.width() * rect.height();
+    {
+        LockGuard<Mutex> lock(m_mutex);
+        if (m_queue.size() >= kMaxQueuedFrames) {
+            ++m_droppedFrames;
+            return;
+        }
+        ConsoleFrame frame;
+        if (!m_spare.empty()) {
+            frame = std::move(m_spare.back());
+            m_spare.pop_back();
+        }
+        frame.scrape = m_scrape;
+        frame.info = info;
+        frame.rect = rect;
+        frame.cells.assign(cells, cells + count);
+        m_queue.push_back(std::move(frame));
+    }
+    SetEvent(m_wakeEvent.get());
+}
+
+DWORD WINAPI ConsoleFrameRecorder::writerThreadProc(LPVOID param)
+{
+    static_cast<ConsoleFrameRecorder*>(param)->writerThread();
+    return 0;
+}
+
+void ConsoleFrameRecorder::writerThread()
+{
+    while (true) {
+        bool exiting = false;
+        {
+            LockGuard<Mutex> lock(m_mutex);
+            m_batch.swap(m_queue);
+            exiting = m_exiting;
+        }
+        for (auto &frame : m_batch) {
+            appendConsoleFrame(m_encoded, frame,
+                               m_havePrevFrame ? &m_prevFrame : nullptr);
+            // Keep this frame for the next delta, and recycle the old one.
+            std::swap(m_prevFrame, frame);
+            m_havePrevFrame = true;
+            if (m_encoded.size() >= kWriteChunkSize) {
+                writeEncoded();
+            }
+        }
+        writeEncoded();
+        {
+            LockGuard<Mutex> lock(m_mutex);
+            for (auto &frame : m_batch) {
+                if (m_spare.size() < kMaxQueuedFrames) {
+                    m_spare.push_back(std::move(frame));
+                }
+            }
+        }
+        m_batch.clear();
+        if (exiting) {
+            break;
+        }
+        WaitForSingleObject(m_wakeEvent.get(), INFINITE);
+    }
+}
+
+void ConsoleFrameRecorder::writeEncoded()
+{
+    // Once a write fails, later delta frames can't be decoded, so stop.
+    size_t written = 0;
+    while (!m_writeFailed && written < m_encoded.size()) {
+        DWORD actual = 0;
+        if (!WriteFile(m_file.get(), m_encoded.data() + written,
+                       m_encoded.size() - written, &actual, NULL) ||
+                actual == 0) {
+            trace("record_frames: WriteFile failed, stopping the recording");
+            m_writeFailed = true;
+        }
+        written += actual;
+    }
+    m_bytesWritten += written;
+    m_encoded.clear();
+}
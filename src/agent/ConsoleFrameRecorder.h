@@ -0,0 +1,85 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_CONSOLE_FRAME_RECORDER_H
+#define AGENT_CONSOLE_FRAME_RECORDER_H
+
+#include <windows.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../shared/Mutex.h"
+#include "../shared/OwnedHandle.h"
+
+#include "ConsoleFrameFile.h"
+
+class LargeConsoleReadBuffer;
+
+// Records every console read to a frame file for offline replay.  Enabled
+// with the record_frames debug flag.  The scraper thread only copies each
+// frame into a recycled slot; a background thread delta-encodes the frames
+// and writes them, so recording adds little to the scrape time.
+class ConsoleFrameRecorder {
+public:
+    // Returns null unless the flag is set and the file could be created.
+    // The file is %TEMP%\winpty-frames-<pid>-<n>.wpcf, where n counts the
+    // recorders the process has created.
+    static std::unique_ptr<ConsoleFrameRecorder> createIfEnabled();
+    ~ConsoleFrameRecorder();
+
+    // Starts a new scrape number for the reads that follow.
+    void beginScrape() { ++m_scrape; }
+    void record(const ConsoleScreenBufferInfo &info,
+                const LargeConsoleReadBuffer &buffer);
+
+    ConsoleFrameRecorder(const ConsoleFrameRecorder &other) = delete;
+    ConsoleFrameRecorder &operator=(const ConsoleFrameRecorder &other) = delete;
+
+private:
+    ConsoleFrameRecorder(HANDLE file, HANDLE wakeEvent);
+    static DWORD WINAPI writerThreadProc(LPVOID param);
+    void writerThread();
+    void writeEncoded();
+
+    OwnedHandle m_file;
+    OwnedHandle m_wakeEvent;
+    OwnedHandle m_thread;
+    uint32_t m_scrape = 0;
+
+    // Guarded by m_mutex.
+    Mutex m_mutex;
+    std::vector<ConsoleFrame> m_queue;
+    std::vector<ConsoleFrame> m_spare;
+    bool m_exiting = false;
+    uint64_t m_droppedFrames = 0;
+
+    // Used only by the writer thread.
+    std::vector<ConsoleFrame> m_batch;
+    ConsoleFrame m_prevFrame;
+    bool m_havePrevFrame = false;
+    std::string m_encoded;
+    uint64_t m_bytesWritten = 0;
+    bool m_writeFailed = false;
+};
+
+#endif // AGENT_CONSOLE_FRAME_RECORDER_H
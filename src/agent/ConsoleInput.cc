@@ -20,6 +20,7 @@
 
 #include "ConsoleInput.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -31,11 +32,14 @@
 #include "../shared/DebugClient.h"
 #include "../shared/StringBuilder.h"
 #include "../shared/UnixCtrlChars.h"
+#include "../shared/WindowsVersion.h"
 
+#include "ConsoleApiStats.h"
 #include "ConsoleInputReencoding.h"
 #include "DebugShowInput.h"
 #include "DefaultInputMap.h"
 #include "DsrSender.h"
+#include "EtwTrace.h"
 #include "UnicodeEncoding.h"
 #include "Win32Console.h"
 
@@ -66,6 +70,37 @@ std::string MouseRecord::toString() const {
 
 const unsigned int kIncompleteEscapeTimeoutMs = 1000u;
 
+// The input mode is re-read after input is written and when a process
+// attaches, and otherwise at most this often.
+const int kInputFlagsRefreshMs = 500;
+
+const char kPasteStartMarker[] = "\x1B[200~";
+const char kPasteEndMarker[] = "\x1B[201~";
+
+// Before Windows 8, console API calls are marshalled through a fixed-size
+// CSRSS shared buffer, and a WriteConsoleInputW call with too many records
+// fails.  Split large writes (e.g. a pasted script) into chunks.
+const size_t kMaxInputRecordsPerWriteLegacy = 1024;
+const size_t kMaxInputRecordsPerWrite = 16384;
+
+// CONIN writes are paced so the console's input queue holds about this many
+// records at most; the rest wait in the agent.  Otherwise, a multi-megabyte
+// paste swells conhost's memory, and keys typed after it wait behind it.
+const DWORD kMaxConsoleInputBacklog = 4096;
+
+// Up to this many records are written between checks of the console's
+// queue length, so typing doesn't pay for a GetNumberOfConsoleInputEvents
+// call per key.
+const size_t kUnpacedInputRecords = 256;
+
+// The agent's own backlog stops growing here: the CONIN pipe isn't read
+// until it drains.
+const size_t kMaxHeldInputRecords = 256 * 1024;
+
+// While input is held, an input burst this short made only of control
+// characters (e.g. ^C in raw mode, ^Z, ESC) goes ahead of it.
+const size_t kMaxPriorityInputBytes = 4;
+
 #define CHECK(cond)                                 \
         do {                                        \
             if (!(cond)) { return 0; }              \
@@ -121,6 +156,22 @@ static int matchDsr(const char *input, int inputSize)
     return pch - input + 1;
 }
 
+// Match one of the bracketed paste markers (ESC [ 200 ~ or ESC [ 201 ~).
+// Returns:
+// 0   no match
+// >0  match, returns length of match
+// -1  incomplete match
+static int matchPasteMarker(const char *input, int inputSize,
+                            const char *marker)
+{
+    const int markerLen = static_cast<int>(strlen(marker));
+    const int len = std::min(inputSize, markerLen);
+    if (memcmp(input, marker, len) != 0) {
+        return 0;
+    }
+    return len == markerLen ? markerLen : -1;
+}
+
 static int matchMouseDefault(const char *input, int inputSize,
                              MouseRecord &out)
 {
@@ -190,6 +241,30 @@ static int matchMouseRecord(const char *input, int inputSize, MouseRecord &out)
 #undef ADVANCE
 #undef SCAN_INT
 
+// A key-down record carrying one UTF-16 code unit and no key, as the console
+// itself delivers VT input.
+static bool isControlInput(const char *input, size_t inputSize)
+{
+    for (size_t i = 0; i < inputSize; ++i) {
+        const unsigned char ch = input[i];
+        if (ch >= 0x20 || ch == '\t' || ch == '\n' || ch == '\r') {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline void appendVtInputUnit(std::vector<INPUT_RECORD> &records,
+                                     wchar_t unit)
+{
+    INPUT_RECORD ir = {};
+    ir.EventType = KEY_EVENT;
+    ir.Event.KeyEvent.bKeyDown = TRUE;
+    ir.Event.KeyEvent.wRepeatCount = 1;
+    ir.Event.KeyEvent.uChar.UnicodeChar = unit;
+    records.push_back(ir);
+}
+
 } // anonymous namespace
 
 ConsoleInput::ConsoleInput(HANDLE conin, int mouseMode, DsrSender &dsrSender,
@@ -199,7 +274,7 @@ ConsoleInput::ConsoleInput(HANDLE conin, int mouseMode, DsrSender &dsrSender,
     m_mouseMode(mouseMode),
     m_dsrSender(dsrSender)
 {
-    addDefaultEntriesToInputMap(m_inputMap);
+    loadDefaultInputMap(m_inputMap);
     if (hasDebugFlag("dump_input_map")) {
         m_inputMap.dumpInputMap();
     }
@@ -234,43 +309,64 @@ ConsoleInput::ConsoleInput(HANDLE conin, int mouseMode, DsrSender &dsrSender,
     updateInputFlags(true);
 }
 
-void ConsoleInput::writeInput(const std::string &input)
+// Writes input bytes read from the CONIN pipe.
+void ConsoleInput::writePipeInput(const char *input, size_t inputSize)
 {
-    if (input.size() == 0) {
+    if (hasDebugFlag("input_separated_bytes")) {
+        // This debug flag is intended to help with testing incomplete escape
+        // sequences and multibyte UTF-8 encodings.  (I wonder if the normal
+        // code path ought to advance a state machine one byte at a time.)
+        for (size_t i = 0; i < inputSize; ++i) {
+            writeInput(&input[i], 1);
+        }
+    } else {
+        writeInput(input, inputSize);
+    }
+}
+
+void ConsoleInput::writeInput(const char *input, size_t inputSize)
+{
+    if (inputSize == 0) {
         return;
     }
 
-    if (isTracingEnabled()) {
-        static bool debugInput = hasDebugFlag("input");
-        if (debugInput) {
-            std::string dumpString;
-            for (size_t i = 0; i < input.size(); ++i) {
-                const char ch = input[i];
-                const char ctrl = decodeUnixCtrlChar(ch);
-                if (ctrl != '\0') {
-                    dumpString += '^';
-                    dumpString += ctrl;
-                } else {
-                    dumpString += ch;
-                }
+    if (isTraceCategoryOn(TraceCategory::Input)) {
+        std::string dumpString;
+        for (size_t i = 0; i < inputSize; ++i) {
+            const char ch = input[i];
+            const char ctrl = decodeUnixCtrlChar(ch);
+            if (ctrl != '\0') {
+                dumpString += '^';
+                dumpString += ctrl;
+            } else {
+                dumpString += ch;
             }
-            dumpString += " (";
-            for (size_t i = 0; i < input.size(); ++i) {
-                if (i > 0) {
-                    dumpString += ' ';
-                }
-                const unsigned char uch = input[i];
-                char buf[32];
-                winpty_snprintf(buf, "%02X", uch);
-                dumpString += buf;
+        }
+        dumpString += " (";
+        for (size_t i = 0; i < inputSize; ++i) {
+            if (i > 0) {
+                dumpString += ' ';
             }
-            dumpString += ')';
-            trace("input chars: %s", dumpString.c_str());
+            const unsigned char uch = input[i];
+            char buf[32];
+            winpty_snprintf(buf, "%02X", uch);
+            dumpString += buf;
         }
+        dumpString += ')';
+        trace("input chars: %s", dumpString.c_str());
     }
 
-    m_byteQueue.append(input);
+    if (m_byteQueue.empty()) {
+        m_inputTimer = TimeMeasurement();
+    }
+    m_byteQueue.append(input, inputSize);
+    m_priorityInput = hasHeldInput() && !m_inBracketedPaste &&
+        inputSize <= kMaxPriorityInputBytes &&
+        isControlInput(input, inputSize);
     doWrite(false);
+    m_priorityInput = false;
+    // The program reading the input may change the input mode in response.
+    m_inputFlagsStale = true;
     if (!m_byteQueue.empty() && !m_dsrSent) {
         trace("send DSR");
         m_dsrSender.sendDsr();
@@ -288,9 +384,21 @@ void ConsoleInput::flushIncompleteEscapeCode()
     }
 }
 
+// Re-reads the input mode if it was invalidated or hasn't been read recently.
+void ConsoleInput::refreshInputFlags()
+{
+    if (m_inputFlagsStale ||
+            static_cast<int>(GetTickCount() - m_inputFlagsTick) >=
+                kInputFlagsRefreshMs) {
+        updateInputFlags();
+    }
+}
+
 void ConsoleInput::updateInputFlags(bool forceTrace)
 {
     const DWORD mode = inputConsoleMode();
+    m_inputFlagsStale = false;
+    m_inputFlagsTick = GetTickCount();
     const bool newFlagEE = (mode & ENABLE_EXTENDED_FLAGS) != 0;
     const bool newFlagMI = (mode & ENABLE_MOUSE_INPUT) != 0;
     const bool newFlagQE = (mode & ENABLE_QUICK_EDIT_MODE) != 0;
@@ -333,17 +441,71 @@ bool ConsoleInput::shouldActivateTerminalMouse()
 
 void ConsoleInput::doWrite(bool isEof)
 {
-    const char *data = m_byteQueue.c_str();
-    std::vector<INPUT_RECORD> records;
+    // The per-keypress trace and the escape-input reencoding both live in
+    // appendKeyPress, so bypass the cached ASCII records when either is on.
+    const bool debugInput = isTraceCategoryOn(TraceCategory::Input);
+    const bool useCachedRecords = !debugInput && !m_escapeInputEnabled;
+    static const bool vtPassthroughEnabled =
+        !hasDebugFlag("no_vt_passthrough");
+    const bool vtPassthrough = vtPassthroughEnabled && m_escapeInputEnabled;
+    checkKeyboardLayout();
+
+    const char *data = m_byteQueue.data();
+    const size_t size = m_byteQueue.size();
+    m_records.clear();
     size_t idx = 0;
-    while (idx < m_byteQueue.size()) {
-        int charSize = scanInput(records, &data[idx], m_byteQueue.size() - idx, isEof);
+    while (idx < size) {
+        if (m_inBracketedPaste) {
+            idx += scanPasteInput(m_records, &data[idx], size - idx, isEof);
+            if (m_inBracketedPaste) {
+                // Either the queue is consumed, or it ends with an
+                // incomplete end marker or UTF-8 character.
+                break;
+            }
+            continue;
+        }
+        if (useCachedRecords) {
+            idx += appendTextRun(m_records, &data[idx], size - idx);
+            if (idx == size) {
+                break;
+            }
+        } else if (vtPassthrough) {
+            idx += appendVtPassthroughRun(m_records, &data[idx], size - idx,
+                                          isEof);
+            if (idx == size) {
+                break;
+            }
+            if (data[idx] != '\x1B' && data[idx] != '\x03') {
+                // An incomplete UTF-8 character.
+                break;
+            }
+        }
+        if (data[idx] == '\x1B' && !m_escapeInputEnabled) {
+            // A console program in VT input mode decodes the paste markers
+            // itself, so only recognize them otherwise.
+            const int markerLen = matchPasteMarker(
+                &data[idx], size - idx, kPasteStartMarker);
+            if (markerLen > 0) {
+                if (debugInput) {
+                    trace("bracketed paste start");
+                }
+                m_inBracketedPaste = true;
+                idx += markerLen;
+                continue;
+            } else if (markerLen == -1 && !isEof) {
+                trace("Incomplete bracketed paste marker");
+                break;
+            }
+        }
+        int charSize = scanInput(m_records, &data[idx], size - idx, isEof);
         if (charSize == -1)
             break;
         idx += charSize;
     }
-    m_byteQueue.erase(0, idx);
-    flushInputRecords(records);
+    // Usually the whole queue is consumed.  Otherwise, only an incomplete
+    // escape sequence or UTF-8 character remains.
+    m_byteQueue.consume(idx);
+    flushInputRecords(m_records);
 }
 
 void ConsoleInput::flushInputRecords(std::vector<INPUT_RECORD> &records)
@@ -351,13 +513,338 @@ void ConsoleInput::flushInputRecords(std::vector<INPUT_RECORD> &records)
     if (records.size() == 0) {
         return;
     }
-    DWORD actual = 0;
-    if (!WriteConsoleInputW(m_conin, records.data(), records.size(), &actual)) {
-        trace("WriteConsoleInputW failed");
+    if (m_discardRecords) {
+        m_recordsWritten += records.size();
+        records.clear();
+        return;
+    }
+    const uint64_t writtenBefore = m_recordsWritten;
+    size_t count = records.size();
+    if (!m_priorityInput) {
+        drainHeldInput();
+        count = m_heldRecords.empty()
+            ? std::min(count, consoleInputRoom(count))
+            : 0;
+        if (count < records.size()) {
+            m_heldRecords.append(&records[count],
+                (records.size() - count) * sizeof(INPUT_RECORD));
+        }
+    }
+    writeConsoleRecords(records.data(), count);
+    if (m_recordsWritten > writtenBefore) {
+        m_inputLatency.record(m_inputTimer.elapsedUs());
     }
     records.clear();
 }
 
+void ConsoleInput::drainHeldInput()
+{
+    if (m_heldRecords.empty()) {
+        return;
+    }
+    const size_t held = heldRecordCount();
+    const size_t count = std::min(held, consoleInputRoom(held));
+    if (count == 0) {
+        return;
+    }
+    writeConsoleRecords(
+        reinterpret_cast<const INPUT_RECORD*>(m_heldRecords.data()), count);
+    m_heldRecords.consume(count * sizeof(INPUT_RECORD));
+}
+
+void ConsoleInput::releaseMemory()
+{
+    std::vector<INPUT_RECORD>().swap(m_records);
+    m_textRecords.clear();
+    m_byteQueue.releaseIfEmpty();
+    m_heldRecords.releaseIfEmpty();
+}
+
+bool ConsoleInput::inputBacklogFull() const
+{
+    return heldRecordCount() >= kMaxHeldInputRecords;
+}
+
+// Returns how many of `wanted` records the console's input queue has room
+// for.  If the queue length can't be read, nothing is held back.
+size_t ConsoleInput::consoleInputRoom(size_t wanted)
+{
+    if (m_recordsSinceCount + wanted <= kUnpacedInputRecords) {
+        return wanted;
+    }
+    DWORD pending = 0;
+    if (!GetNumberOfConsoleInputEvents(m_conin, &pending)) {
+        return wanted;
+    }
+    m_recordsSinceCount = 0;
+    return pending >= kMaxConsoleInputBacklog
+        ? 0
+        : kMaxConsoleInputBacklog - pending;
+}
+
+// Writes the records to CONIN.  After a failure, the rest are dropped.
+void ConsoleInput::writeConsoleRecords(const INPUT_RECORD *records,
+                                       size_t count)
+{
+    if (count == 0) {
+        return;
+    }
+    static const size_t maxPerWrite = isAtLeastWindows8()
+        ? kMaxInputRecordsPerWrite
+        : kMaxInputRecordsPerWriteLegacy;
+    size_t written = 0;
+    while (written < count) {
+        const DWORD chunk = static_cast<DWORD>(
+            std::min(count - written, maxPerWrite));
+        DWORD actual = 0;
+        ConsoleApiScope call(WINPTY_CONSOLE_API_WRITE_INPUT);
+        if (!WriteConsoleInputW(m_conin, &records[written], chunk, &actual)) {
+            trace("WriteConsoleInputW failed");
+            break;
+        }
+        if (actual == 0) {
+            trace("WriteConsoleInputW wrote no records");
+            break;
+        }
+        call.setCells(actual);
+        written += actual;
+    }
+    m_recordsWritten += written;
+    m_recordsSinceCount += written;
+    ETW_EVENT("InputWrite", {"records", static_cast<int64_t>(written)});
+}
+
+// The cached records embed the VkKeyScan and MapVirtualKey results for
+// the agent's keyboard layout.
+void ConsoleInput::checkKeyboardLayout()
+{
+    const HKL layout = GetKeyboardLayout(0);
+    if (layout != m_asciiRecordsLayout) {
+        for (auto &cached : m_asciiRecords) {
+            cached.clear();
+        }
+        for (auto &cached : m_asciiPasteRecords) {
+            cached.clear();
+        }
+        m_textRecords.clear();
+        m_asciiRecordsLayout = layout;
+    }
+}
+
+// Appends the records for a run of printable text: ASCII and complete,
+// valid UTF-8 characters.  These bytes never start a DSR reply, a mouse
+// report, or (in the default map) an InputMap entry, so the general
+// scanInput path always produces the same records for them.  Large pastes
+// are mostly such runs.  Returns the number of bytes consumed; control
+// characters, escapes, and anything invalid or incomplete are left to
+// scanInput.
+size_t ConsoleInput::appendTextRun(std::vector<INPUT_RECORD> &records,
+                                   const char *input,
+                                   size_t inputSize)
+{
+    size_t i = 0;
+    while (i < inputSize) {
+        const unsigned char ch = input[i];
+        int charLen = 1;
+        if (ch >= 0x80) {
+            charLen = utf8CharLength(ch);
+            if (charLen == 0 ||
+                    static_cast<size_t>(charLen) > inputSize - i) {
+                break;
+            }
+        } else if (ch < 0x20 || ch > 0x7E) {
+            break;
+        }
+        const auto *cached = cachedTextRecords(&input[i], charLen);
+        if (cached == nullptr) {
+            break;
+        }
+        records.insert(records.end(), cached->begin(), cached->end());
+        i += charLen;
+    }
+    return i;
+}
+
+// Returns the key records for one printable character, generating them on
+// first use, or nullptr if scanInput must handle the character.
+const std::vector<INPUT_RECORD> *
+ConsoleInput::cachedTextRecords(const char *input, int charLen)
+{
+    // The non-ASCII cache is bounded, because a paste of CJK text can hold
+    // tens of thousands of distinct characters.
+    const size_t kMaxCachedTextRecords = 4096;
+
+    std::vector<INPUT_RECORD> *cached = nullptr;
+    if (charLen == 1) {
+        cached = &m_asciiRecords[static_cast<unsigned char>(input[0])];
+        if (!cached->empty()) {
+            return cached;
+        }
+    } else {
+        const uint32_t codePoint = decodeUtf8(input);
+        if (codePoint == static_cast<uint32_t>(-1)) {
+            // Let scanInput trace and discard it.
+            return nullptr;
+        }
+        auto it = m_textRecords.find(codePoint);
+        if (it != m_textRecords.end()) {
+            // An empty entry records a character left to scanInput.
+            return it->second.empty() ? nullptr : &it->second;
+        }
+        if (m_textRecords.size() >= kMaxCachedTextRecords) {
+            m_textRecords.clear();
+        }
+        cached = &m_textRecords[codePoint];
+    }
+
+    InputMap::Key match;
+    bool incomplete = false;
+    if (m_inputMap.lookupKey(input, charLen, match, incomplete) > 0 ||
+            incomplete) {
+        // A custom map entry -- let scanInput handle it.
+        return nullptr;
+    }
+    appendUtf8Char(*cached, input, charLen, false);
+    return cached->empty() ? nullptr : cached;
+}
+
+// In VT input mode, the console program decodes the terminal's input itself,
+// so there is no point in decoding it into keypresses only for
+// reencodeEscapedKeyPress to turn them back into characters.  Instead, text
+// and control characters go to CONIN as they arrive, one key-down record per
+// UTF-16 code unit, with no InputMap lookup.  Escapes and Ctrl-C stop the run
+// and are left to scanInput, which strips DSR replies, decodes mouse reports,
+// sends cursor keys through the console window (see appendKeyPress), and
+// signals Ctrl-C in processed mode.  Returns the number of bytes consumed.
+// At the end of the queue, an incomplete UTF-8 character is left for the
+// next write.
+size_t ConsoleInput::appendVtPassthroughRun(std::vector<INPUT_RECORD> &records,
+                                            const char *input,
+                                            size_t inputSize,
+                                            bool isEof)
+{
+    size_t i = 0;
+    while (i < inputSize) {
+        const unsigned char ch = input[i];
+        if (ch == 0x1B || ch == 0x03) {
+            break;
+        }
+        if (ch < 0x80) {
+            appendVtInputUnit(records, ch);
+            ++i;
+            continue;
+        }
+        const int len = utf8CharLength(ch);
+        if (len == 0) {
+            ++i;
+            continue;
+        }
+        if (static_cast<size_t>(len) > inputSize - i) {
+            if (!isEof) {
+                break;
+            }
+            ++i;
+            continue;
+        }
+        wchar_t units[2];
+        const int unitCount = encodeUtf16(units, decodeUtf8(&input[i]));
+        for (int j = 0; j < unitCount; ++j) {
+            appendVtInputUnit(records, units[j]);
+        }
+        i += len;
+    }
+    return i;
+}
+
+// Appends the records for text between the bracketed paste markers, up to
+// and including the end marker, and returns the number of bytes consumed.
+// Pasted text is not a sequence of keystrokes, so there is no InputMap
+// lookup, no Ctrl-C signal, and no modifier key records: each character is
+// one key-down and one key-up record.  At the end of the queue, an
+// incomplete end marker or UTF-8 character is left for the next write.
+size_t ConsoleInput::scanPasteInput(std::vector<INPUT_RECORD> &records,
+                                    const char *input,
+                                    size_t inputSize,
+                                    bool isEof)
+{
+    const bool debugInput = isTraceCategoryOn(TraceCategory::Input);
+    size_t i = 0;
+    while (i < inputSize) {
+        const int remaining = static_cast<int>(
+            std::min<size_t>(inputSize - i, INT_MAX));
+        if (input[i] == '\x1B') {
+            const int markerLen = matchPasteMarker(
+                &input[i], remaining, kPasteEndMarker);
+            if (markerLen > 0) {
+                if (debugInput) {
+                    trace("bracketed paste end");
+                }
+                m_inBracketedPaste = false;
+                return i + markerLen;
+            } else if (markerLen == -1 && !isEof) {
+                return i;
+            }
+        }
+        const unsigned char ch = input[i];
+        if (ch < 0x80) {
+            auto &cached = m_asciiPasteRecords[ch];
+            if (cached.empty()) {
+                appendPasteChar(cached, ch);
+            }
+            records.insert(records.end(), cached.begin(), cached.end());
+            ++i;
+            continue;
+        }
+        const int len = utf8CharLength(ch);
+        if (len == 0) {
+            ++i;
+            continue;
+        }
+        if (len > remaining) {
+            if (!isEof) {
+                return i;
+            }
+            ++i;
+            continue;
+        }
+        const uint32_t codePoint = decodeUtf8(&input[i]);
+        if (codePoint != static_cast<uint32_t>(-1)) {
+            appendPasteChar(records, codePoint);
+        }
+        i += len;
+    }
+    return i;
+}
+
+void ConsoleInput::appendPasteChar(std::vector<INPUT_RECORD> &records,
+                                   uint32_t codePoint)
+{
+    uint16_t virtualKey = 0;
+    uint16_t keyState = 0;
+    if (codePoint == '\r' || codePoint == '\n') {
+        virtualKey = VK_RETURN;
+        codePoint = '\r';
+    } else if (codePoint == '\t') {
+        virtualKey = VK_TAB;
+    } else if (codePoint >= 0x20 && codePoint <= 0xFFFF) {
+        const short charScan = VkKeyScan(codePoint);
+        if (charScan != -1) {
+            virtualKey = charScan & 0xFF;
+            if (charScan & 0x100) {
+                keyState |= SHIFT_PRESSED;
+            }
+            if (charScan & 0x200) {
+                keyState |= LEFT_CTRL_PRESSED;
+            }
+            if (charScan & 0x400) {
+                keyState |= RIGHT_ALT_PRESSED;
+            }
+        }
+    }
+    appendCPInputRecords(records, TRUE, virtualKey, codePoint, keyState);
+    appendCPInputRecords(records, FALSE, virtualKey, codePoint, keyState);
+}
+
 // This behavior isn't strictly correct, because the keypresses (probably?)
 // adopt the keyboard state (e.g. Ctrl/Alt/Shift modifiers) of the current
 // window station's keyboard, which has no necessary relationship to the winpty
@@ -469,7 +956,7 @@ int ConsoleInput::scanInput(std::vector<INPUT_RECORD> &records,
     // A UTF-8 character.
     const int len = utf8CharLength(input[0]);
     if (len == 0) {
-        static bool debugInput = isTracingEnabled() && hasDebugFlag("input");
+        const bool debugInput = isTraceCategoryOn(TraceCategory::Input);
         if (debugInput) {
             trace("Discarding invalid input byte: %02X",
                 static_cast<unsigned char>(input[0]));
@@ -495,11 +982,8 @@ int ConsoleInput::scanMouseInput(std::vector<INPUT_RECORD> &records,
         return len;
     }
 
-    if (isTracingEnabled()) {
-        static bool debugInput = hasDebugFlag("input");
-        if (debugInput) {
-            trace("mouse input: %s", record.toString().c_str());
-        }
+    if (isTraceCategoryOn(TraceCategory::Input)) {
+        trace("mouse input: %s", record.toString().c_str());
     }
 
     const int button = record.flags & 0x03;
@@ -585,13 +1069,27 @@ int ConsoleInput::scanMouseInput(std::vector<INPUT_RECORD> &records,
     mer.dwButtonState |= m_mouseButtonState;
 
     if (m_mouseInputEnabled && !m_quickEditEnabled) {
-        if (isTracingEnabled()) {
-            static bool debugInput = hasDebugFlag("input");
-            if (debugInput) {
-                trace("mouse event: %s", mouseEventToString(mer).c_str());
-            }
+        if (isTraceCategoryOn(TraceCategory::Input)) {
+            trace("mouse event: %s", mouseEventToString(mer).c_str());
         }
 
+        // With any-motion mouse tracking, the terminal reports every cell the
+        // mouse crosses.  A move that directly follows another move with the
+        // same buttons and modifiers replaces it, so that a burst of them
+        // reaches the console as one event.  Clicks, releases, and wheel
+        // events are never merged, and they keep their order.
+        static const bool coalesceMoves = !hasDebugFlag("no_mouse_coalescing");
+        if (coalesceMoves && mer.dwEventFlags == MOUSE_MOVED &&
+                !records.empty() &&
+                records.back().EventType == MOUSE_EVENT) {
+            MOUSE_EVENT_RECORD &prev = records.back().Event.MouseEvent;
+            if (prev.dwEventFlags == MOUSE_MOVED &&
+                    prev.dwButtonState == mer.dwButtonState &&
+                    prev.dwControlKeyState == mer.dwControlKeyState) {
+                prev.dwMousePosition = mer.dwMousePosition;
+                return len;
+            }
+        }
         records.push_back(newRecord);
     }
 
@@ -605,7 +1103,7 @@ void ConsoleInput::appendUtf8Char(std::vector<INPUT_RECORD> &records,
 {
     const uint32_t codePoint = decodeUtf8(charBuffer);
     if (codePoint == static_cast<uint32_t>(-1)) {
-        static bool debugInput = isTracingEnabled() && hasDebugFlag("input");
+        const bool debugInput = isTraceCategoryOn(TraceCategory::Input);
         if (debugInput) {
             StringBuilder error(64);
             error << "Discarding invalid UTF-8 sequence:";
@@ -672,13 +1170,10 @@ void ConsoleInput::appendKeyPress(std::vector<INPUT_RECORD> &records,
     const bool enhanced = (winKeyState & ENHANCED_KEY) != 0;
     bool hasDebugInput = false;
 
-    if (isTracingEnabled()) {
-        static bool debugInput = hasDebugFlag("input");
-        if (debugInput) {
-            hasDebugInput = true;
-            InputMap::Key key = { virtualKey, winCodePointDn, winKeyState };
-            trace("keypress: %s", key.toString().c_str());
-        }
+    if (isTraceCategoryOn(TraceCategory::Input)) {
+        hasDebugInput = true;
+        InputMap::Key key = { virtualKey, winCodePointDn, winKeyState };
+        trace("keypress: %s", key.toString().c_str());
     }
 
     if (m_escapeInputEnabled &&
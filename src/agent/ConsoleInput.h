@@ -26,11 +26,15 @@
 
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "ByteQueue.h"
 #include "Coord.h"
 #include "InputMap.h"
 #include "SmallRect.h"
+#include "../shared/LatencyHistogram.h"
+#include "../shared/TimeMeasurement.h"
 
 class Win32Console;
 class DsrSender;
@@ -40,15 +44,60 @@ class ConsoleInput
 public:
     ConsoleInput(HANDLE conin, int mouseMode, DsrSender &dsrSender,
                  Win32Console &console);
-    void writeInput(const std::string &input);
+    void writePipeInput(const char *input, size_t inputSize);
+    void writeInput(const char *input, size_t inputSize);
     void flushIncompleteEscapeCode();
     void setMouseWindowRect(SmallRect val) { m_mouseWindowRect = val; }
     void updateInputFlags(bool forceTrace=false);
+    void refreshInputFlags();
+    void invalidateInputFlags() { m_inputFlagsStale = true; }
     bool shouldActivateTerminalMouse();
+    uint64_t recordsWritten() const { return m_recordsWritten; }
+    // The input bytes held back, e.g. the start of an escape sequence.
+    size_t pendingInputBytes() const { return m_byteQueue.size(); }
+    // Writes the records held back while the console's input queue was
+    // full, as far as it has room.  Call it periodically while
+    // hasHeldInput().
+    void drainHeldInput();
+    bool hasHeldInput() const { return !m_heldRecords.empty(); }
+    // Once this many records are held, stop reading input, so the client's
+    // writes block until the program catches up.
+    bool inputBacklogFull() const;
+    // Frees the empty queues and the record caches, e.g. while the session
+    // is idle.
+    void releaseMemory();
+    // The time from receiving input to writing its records.  Another thread
+    // may read it.
+    const LatencyHistogram &inputLatency() const { return m_inputLatency; }
+    // Count the generated records, but drop them instead of writing them to
+    // CONIN.  For the offline decode benchmark.
+    void setDiscardRecords(bool discard) { m_discardRecords = discard; }
 
 private:
     void doWrite(bool isEof);
     void flushInputRecords(std::vector<INPUT_RECORD> &records);
+    size_t consoleInputRoom(size_t wanted);
+    void writeConsoleRecords(const INPUT_RECORD *records, size_t count);
+    size_t heldRecordCount() const
+    {
+        return m_heldRecords.size() / sizeof(INPUT_RECORD);
+    }
+    void checkKeyboardLayout();
+    size_t appendTextRun(std::vector<INPUT_RECORD> &records,
+                         const char *input,
+                         size_t inputSize);
+    const std::vector<INPUT_RECORD> *cachedTextRecords(const char *input,
+                                                       int charLen);
+    size_t appendVtPassthroughRun(std::vector<INPUT_RECORD> &records,
+                                  const char *input,
+                                  size_t inputSize,
+                                  bool isEof);
+    size_t scanPasteInput(std::vector<INPUT_RECORD> &records,
+                          const char *input,
+                          size_t inputSize,
+                          bool isEof);
+    void appendPasteChar(std::vector<INPUT_RECORD> &records,
+                         uint32_t codePoint);
     int scanInput(std::vector<INPUT_RECORD> &records,
                   const char *input,
                   int inputSize,
@@ -89,7 +138,24 @@ private:
     int m_mouseMode = 0;
     DsrSender &m_dsrSender;
     bool m_dsrSent = false;
-    std::string m_byteQueue;
+    bool m_inBracketedPaste = false;
+    // The unconsumed input bytes, and the records generated from them.  Both
+    // keep their capacity, so steady input doesn't allocate.
+    ByteQueue m_byteQueue;
+    std::vector<INPUT_RECORD> m_records;
+    // The records waiting for room in the console's input queue, in order.
+    // Control keys typed meanwhile (m_priorityInput) skip ahead of them.
+    ByteQueue m_heldRecords;
+    bool m_priorityInput = false;
+    // Records written since the console's queue length was last read.
+    size_t m_recordsSinceCount = 0;
+    // The key records for each printable character, generated on first use
+    // and discarded when the keyboard layout changes.  ASCII has a table;
+    // other characters share a bounded map.
+    std::vector<INPUT_RECORD> m_asciiRecords[128];
+    std::unordered_map<uint32_t, std::vector<INPUT_RECORD>> m_textRecords;
+    std::vector<INPUT_RECORD> m_asciiPasteRecords[128];
+    HKL m_asciiRecordsLayout = nullptr;
     InputMap m_inputMap;
     DWORD m_lastWriteTick = 0;
     DWORD m_mouseButtonState = 0;
@@ -103,7 +169,14 @@ private:
     bool m_mouseInputEnabled = false;
     bool m_quickEditEnabled = false;
     bool m_escapeInputEnabled = false;
+    bool m_inputFlagsStale = true;
+    DWORD m_inputFlagsTick = 0;
     SmallRect m_mouseWindowRect;
+    uint64_t m_recordsWritten = 0;
+    bool m_discardRecords = false;
+    // Started when input arrives with none held back.
+    TimeMeasurement m_inputTimer;
+    LatencyHistogram m_inputLatency;
 };
 
 #endif // CONSOLEINPUT_H
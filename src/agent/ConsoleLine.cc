@@ -28,10 +28,15 @@
 
 #include "ConsoleLine.h"
 
+#include <string.h>
+
 #include <algorithm>
+#include <memory>
 
 #include "../shared/WinptyAssert.h"
 
+#include "CharInfoKernels.h"
+
 static CHAR_INFO blankChar(WORD attributes)
 {
     // N.B.: As long as we write to UnicodeChar rather than AsciiChar, there
@@ -43,15 +48,10 @@ static CHAR_INFO blankChar(WORD attributes)
     return ret;
 }
 
-static bool isLineBlank(const CHAR_INFO *line, int length, WORD attributes)
+static inline bool isLineBlank(const CHAR_INFO *line, int length,
+                               WORD attributes)
 {
-    for (int col = 0; col < length; ++col) {
-        if (line[col].Attributes != attributes ||
-                line[col].Char.UnicodeChar != L' ') {
-            return false;
-        }
-    }
-    return true;
+    return isCharInfoRunBlank(line, length, attributes);
 }
 
 static inline bool areLinesEqual(
@@ -62,14 +62,76 @@ static inline bool areLinesEqual(
     return memcmp(line1, line2, sizeof(CHAR_INFO) * length) == 0;
 }
 
-ConsoleLine::ConsoleLine() : m_prevLength(0)
+ConsoleLine::ConsoleLine() : m_prevLength(0), m_prevHash(hashLine(nullptr, 0))
 {
 }
 
 void ConsoleLine::reset()
 {
     m_prevLength = 0;
-    m_prevData.clear();
+    m_prevHash = hashLine(nullptr, 0);
+    m_dataSize = 0;
+    m_released = false;
+}
+
+void ConsoleLine::releaseCells()
+{
+    m_data = nullptr;
+    m_dataSize = 0;
+    m_capacity = 0;
+    m_ownedData.reset();
+    m_released = m_prevLength > 0;
+}
+
+// Points the line at new storage, carrying over the cells it already has.
+void ConsoleLine::setStorage(CHAR_INFO *const storage, const int capacity)
+{
+    ASSERT(capacity >= m_dataSize);
+    if (m_dataSize > 0) {
+        memcpy(storage, m_data, sizeof(CHAR_INFO) * m_dataSize);
+    }
+    m_data = storage;
+    m_capacity = capacity;
+    m_ownedData.reset();
+}
+
+// Makes room for `length` cells.  Saved cells past the line's length are
+// still compared by detectChangeAndSetLine, so they're preserved.
+void ConsoleLine::reserve(const int length)
+{
+    if (length <= m_capacity) {
+        return;
+    }
+    std::unique_ptr<CHAR_INFO[]> storage(new CHAR_INFO[length]);
+    setStorage(storage.get(), length);
+    m_ownedData = std::move(storage);
+}
+
+// A 64-bit FNV-1a hash over the cells of a line, taking each 4-byte CHAR_INFO
+// as one unit.  Comparing hashes lets the scraper rule out most unchanged
+// lines without touching the saved line content.  (Equal hashes still need a
+// full comparison.)
+uint64_t ConsoleLine::hashLine(const CHAR_INFO *const line, const int length)
+{
+    static_assert(sizeof(CHAR_INFO) == sizeof(uint32_t),
+        "CHAR_INFO is expected to be 4 bytes");
+    uint64_t hash = 14695981039346656037ull;
+    for (int col = 0; col < length; ++col) {
+        uint32_t cell;
+        memcpy(&cell, &line[col], sizeof(cell));
+        hash ^= cell;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Returns true if the saved line is exactly the given line, whose hash is
+// `hash`.
+bool ConsoleLine::matches(const CHAR_INFO *const line, const int length,
+                          const uint64_t hash) const
+{
+    return length == m_prevLength && hash == m_prevHash &&
+        (m_released || areLinesEqual(m_data, line, length));
 }
 
 // Determines whether the given line is sufficiently different from the
@@ -79,12 +141,24 @@ void ConsoleLine::reset()
 bool ConsoleLine::detectChangeAndSetLine(const CHAR_INFO *const line, const int newLength)
 {
     ASSERT(newLength >= 1);
-    ASSERT(m_prevLength <= static_cast<int>(m_prevData.size()));
+    ASSERT(m_released || m_prevLength <= m_dataSize);
+
+    if (m_released) {
+        // Only the hash is left.  A line whose length changed is reported
+        // as changed, even if the difference was only blanks.
+        const uint64_t newHash = hashLine(line, newLength);
+        const bool equalLines =
+            newLength == m_prevLength && newHash == m_prevHash;
+        setLine(line, newLength, newHash);
+        return !equalLines;
+    }
 
     if (newLength == m_prevLength) {
-        bool equalLines = areLinesEqual(m_prevData.data(), line, newLength);
+        const uint64_t newHash = hashLine(line, newLength);
+        const bool equalLines = newHash == m_prevHash &&
+            areLinesEqual(m_data, line, newLength);
         if (!equalLines) {
-            setLine(line, newLength);
+            setLine(line, newLength, newHash);
         }
         return !equalLines;
     } else {
@@ -94,7 +168,7 @@ bool ConsoleLine::detectChangeAndSetLine(const CHAR_INFO *const line, const int
         }
 
         ASSERT(m_prevLength >= 1);
-        const WORD prevBlank = m_prevData[m_prevLength - 1].Attributes;
+        const WORD prevBlank = m_data[m_prevLength - 1].Attributes;
         const WORD newBlank = line[newLength - 1].Attributes;
 
         bool equalLines = false;
@@ -102,8 +176,8 @@ bool ConsoleLine::detectChangeAndSetLine(const CHAR_INFO *const line, const int
             // The line has become shorter.  The lines are equal if the common
             // part is equal, and if the newly truncated characters were blank.
             equalLines =
-                areLinesEqual(m_prevData.data(), line, newLength) &&
-                isLineBlank(m_prevData.data() + newLength,
+                areLinesEqual(m_data, line, newLength) &&
+                isLineBlank(m_data + newLength,
                             m_prevLength - newLength,
                             newBlank);
         } else {
@@ -122,9 +196,9 @@ bool ConsoleLine::detectChangeAndSetLine(const CHAR_INFO *const line, const int
             //
             ASSERT(newLength > m_prevLength);
             equalLines =
-                areLinesEqual(m_prevData.data(), line, m_prevLength) &&
-                isLineBlank(m_prevData.data() + m_prevLength,
-                            std::min<int>(m_prevData.size(), newLength) - m_prevLength,
+                areLinesEqual(m_data, line, m_prevLength) &&
+                isLineBlank(m_data + m_prevLength,
+                            std::min<int>(m_dataSize, newLength) - m_prevLength,
                             prevBlank) &&
                 isLineBlank(line + m_prevLength,
                             newLength - m_prevLength,
@@ -137,16 +211,117 @@ bool ConsoleLine::detectChangeAndSetLine(const CHAR_INFO *const line, const int
 
 void ConsoleLine::setLine(const CHAR_INFO *const line, const int newLength)
 {
-    if (static_cast<int>(m_prevData.size()) < newLength) {
-        m_prevData.resize(newLength);
+    setLine(line, newLength, hashLine(line, newLength));
+}
+
+void ConsoleLine::setLine(const CHAR_INFO *const line, const int newLength,
+                          const uint64_t newHash)
+{
+    if (m_dataSize < newLength) {
+        reserve(newLength);
+        m_dataSize = newLength;
     }
-    memcpy(m_prevData.data(), line, sizeof(CHAR_INFO) * newLength);
+    memcpy(m_data, line, sizeof(CHAR_INFO) * newLength);
     m_prevLength = newLength;
+    m_prevHash = newHash;
+    m_released = false;
 }
 
 void ConsoleLine::blank(WORD attributes)
 {
-    m_prevData.resize(1);
-    m_prevData[0] = blankChar(attributes);
+    m_released = false;
+    reserve(1);
+    m_data[0] = blankChar(attributes);
+    m_dataSize = 1;
     m_prevLength = 1;
+    m_prevHash = hashLine(m_data, 1);
+}
+
+void ConsoleLineArena::resize(const int lineCount)
+{
+    m_chunks.clear();
+    m_chunks.resize((lineCount + kChunkLines - 1) / kChunkLines);
+    m_allocatedLines = 0;
+    m_width = 0;
+}
+
+void ConsoleLineArena::allocateChunk(Chunk &chunk)
+{
+    chunk.lines.reset(new ConsoleLine[kChunkLines]);
+    m_allocatedLines += kChunkLines;
+    if (m_width > 0) {
+        chunk.cells.reset(new CHAR_INFO[kChunkLines * m_width]);
+        for (size_t i = 0; i < kChunkLines; ++i) {
+            chunk.lines[i].setStorage(&chunk.cells[i * m_width], m_width);
+        }
+    }
+}
+
+void ConsoleLineArena::reserveWidth(const int width)
+{
+    if (width <= m_width) {
+        return;
+    }
+    // Lines keep their saved cells across the move, so a width change
+    // doesn't look like a content change.
+    for (Chunk &chunk : m_chunks) {
+        if (!chunk.lines) {
+            continue;
+        }
+        std::unique_ptr<CHAR_INFO[]> cells(
+            new CHAR_INFO[kChunkLines * width]);
+        for (size_t i = 0; i < kChunkLines; ++i) {
+            ConsoleLine &line = chunk.lines[i];
+            if (line.m_dataSize <= width) {
+                line.setStorage(&cells[i * width], width);
+            }
+        }
+        chunk.cells = std::move(cells);
+    }
+    m_width = width;
+}
+
+size_t ConsoleLineArena::heapBytes() const
+{
+    size_t ret = m_chunks.capacity() * sizeof(Chunk);
+    for (const Chunk &chunk : m_chunks) {
+        if (!chunk.lines) {
+            continue;
+        }
+        ret += kChunkLines * sizeof(ConsoleLine);
+        if (chunk.cells) {
+            ret += kChunkLines * m_width * sizeof(CHAR_INFO);
+        }
+        for (size_t i = 0; i < kChunkLines; ++i) {
+            if (chunk.lines[i].m_ownedData) {
+                ret += chunk.lines[i].m_capacity * sizeof(CHAR_INFO);
+            }
+        }
+    }
+    return ret;
+}
+
+void ConsoleLineArena::releaseCells()
+{
+    for (Chunk &chunk : m_chunks) {
+        if (!chunk.lines) {
+            continue;
+        }
+        for (size_t i = 0; i < kChunkLines; ++i) {
+            chunk.lines[i].releaseCells();
+        }
+        chunk.cells.reset();
+    }
+    m_width = 0;
+}
+
+void ConsoleLineArena::resetLines()
+{
+    for (Chunk &chunk : m_chunks) {
+        if (chunk.lines) {
+            for (size_t i = 0; i < kChunkLines; ++i) {
+                chunk.lines[i].reset();
+            }
+        }
+    }
 }
@@ -22,7 +22,9 @@
 #define CONSOLE_LINE_H
 
 #include <windows.h>
+#include <stdint.h>
 
+#include <memory>
 #include <vector>
 
 class ConsoleLine
@@ -32,10 +34,73 @@ public:
     void reset();
     bool detectChangeAndSetLine(const CHAR_INFO *line, int newLength);
     void setLine(const CHAR_INFO *line, int newLength);
+    void setLine(const CHAR_INFO *line, int newLength, uint64_t newHash);
+    bool matches(const CHAR_INFO *line, int length, uint64_t hash) const;
     void blank(WORD attributes);
+    int length() const { return m_prevLength; }
+    // After releaseCells, data() is null until the line is set again.
+    const CHAR_INFO *data() const { return m_released ? nullptr : m_data; }
+    bool hasCells() const { return !m_released; }
+    uint64_t hash() const { return m_prevHash; }
+    static uint64_t hashLine(const CHAR_INFO *line, int length);
 private:
+    friend class ConsoleLineArena;
+    void setStorage(CHAR_INFO *storage, int capacity);
+    void reserve(int length);
+    void releaseCells();
     int m_prevLength;
-    std::vector<CHAR_INFO> m_prevData;
+    uint64_t m_prevHash;
+    // Set when the cells were freed to save memory.  The length and hash
+    // remain, and stand in for the cells in comparisons.
+    bool m_released = false;
+    // The saved cells live in a ConsoleLineArena slab, or in m_ownedData
+    // once the line outgrows its slot.  m_dataSize counts the cells written
+    // since the last reset, which can exceed the line's length after it
+    // shrinks.
+    CHAR_INFO *m_data = nullptr;
+    int m_dataSize = 0;
+    int m_capacity = 0;
+    std::unique_ptr<CHAR_INFO[]> m_ownedData;
+};
+
+// A fixed number of lines whose cells are carved out of shared slabs, with
+// a slot of `width` cells per line, so saving a line never allocates once the
+// slots are wide enough for the console.  Lines are allocated in chunks the
+// first time one of them is used, so a console that never scrolls far holds
+// only the lines it has shown.
+class ConsoleLineArena
+{
+public:
+    void resize(int lineCount);
+    // Widens every line's slot to at least `width` cells.
+    void reserveWidth(int width);
+    ConsoleLine &operator[](size_t i) {
+        Chunk &chunk = m_chunks[i / kChunkLines];
+        if (!chunk.lines) {
+            allocateChunk(chunk);
+        }
+        return chunk.lines[i % kChunkLines];
+    }
+    // Resets every line that has been allocated.
+    void resetLines();
+    // Frees the saved cells of every line, e.g. while the console is idle,
+    // keeping each line's length and hash.  An unchanged line still compares
+    // equal, by its hash alone, and the slots come back with reserveWidth.
+    void releaseCells();
+    size_t allocatedLineCount() const { return m_allocatedLines; }
+    // The heap memory held by the lines, their slabs, and any lines that
+    // outgrew their slots.
+    size_t heapBytes() const;
+private:
+    static const size_t kChunkLines = 64;
+    struct Chunk {
+        std::unique_ptr<ConsoleLine[]> lines;
+        std::unique_ptr<CHAR_INFO[]> cells;
+    };
+    void allocateChunk(Chunk &chunk);
+    std::vector<Chunk> m_chunks;
+    size_t m_allocatedLines = 0;
+    int m_width = 0;
 };
 
 #endif // CONSOLE_LINE_H
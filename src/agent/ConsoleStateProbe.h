@@ -0,0 +1,140 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_CONSOLE_STATE_PROBE_H
+#define AGENT_CONSOLE_STATE_PROBE_H
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "../shared/DebugClient.h"
+
+// The agent's polls are its ticks.  Console state read during a tick is
+// reused for the rest of it.
+struct ProbeClock {
+    uint32_t tick = 0;
+    DWORD nowMs = 0;
+};
+
+// One item of console state, re-read at its own cadence: once per tick with
+// an interval of 0, otherwise once the interval has passed.  Consumers
+// compare generations to learn of a change without comparing values.
+template <typename T>
+class ProbedValue {
+public:
+    explicit ProbedValue(int intervalMs) : m_intervalMs(intervalMs) {}
+
+    bool due(const ProbeClock &clock) const {
+        if (!m_valid) {
+            return true;
+        }
+        if (m_intervalMs == 0) {
+            return clock.tick != m_tick;
+        }
+        return static_cast<int>(clock.nowMs - m_readMs) >= m_intervalMs;
+    }
+
+    // Stores a fresh reading, and returns whether it changed the value.
+    bool update(const ProbeClock &clock, const T &value) {
+        const bool changed = !m_valid || !(value == m_value);
+        m_valid = true;
+        m_tick = clock.tick;
+        m_readMs = clock.nowMs;
+        if (changed) {
+            m_value = value;
+            ++m_generation;
+        }
+        return changed;
+    }
+
+    const T &value() const { return m_value; }
+    uint32_t generation() const { return m_generation; }
+    void invalidate() { m_valid = false; }
+
+private:
+    const int m_intervalMs;
+    bool m_valid = false;
+    uint32_t m_tick = 0;
+    DWORD m_readMs = 0;
+    uint32_t m_generation = 0;
+    T m_value = T();
+};
+
+// The console state that both scrapers read on every scrape, gathered once
+// per tick and shared.  (The input mode and the title each have a single
+// reader, which already refreshes them at its own cadence.)  The agent
+// calls beginTick at the start of each poll and control packet batch.
+// Main thread only.
+class ConsoleStateProbe {
+public:
+    void beginTick() {
+        ++m_clock.tick;
+        m_clock.nowMs = GetTickCount();
+    }
+    const ProbeClock &clock() const { return m_clock; }
+
+    // Whether the active screen buffer's cursor is visible.  Read every
+    // tick.
+    bool cursorVisible() {
+        if (m_cursorVisible.due(m_clock)) {
+            bool visible = true;
+            CONSOLE_CURSOR_INFO info = {};
+            if (!GetConsoleCursorInfo(GetStdHandle(STD_OUTPUT_HANDLE),
+                                      &info)) {
+                trace("GetConsoleCursorInfo failed");
+            } else {
+                visible = info.bVisible != 0;
+            }
+            m_cursorVisible.update(m_clock, visible);
+        }
+        return m_cursorVisible.value();
+    }
+
+    // The output code page.  A program rarely changes it, so it's re-read
+    // every kCodePageIntervalMs.
+    UINT outputCodePage() {
+        if (m_outputCodePage.due(m_clock)) {
+            m_outputCodePage.update(m_clock, GetConsoleOutputCP());
+        }
+        return m_outputCodePage.value();
+    }
+    uint32_t outputCodePageGeneration() {
+        outputCodePage();
+        return m_outputCodePage.generation();
+    }
+
+    // Forces every item to be read again, e.g. after the agent changed the
+    // console itself.
+    void invalidate() {
+        m_cursorVisible.invalidate();
+        m_outputCodePage.invalidate();
+    }
+
+    // The interval of the items that don't change with every write.
+    static const int kCodePageIntervalMs = 250;
+    static const int kOutputModeIntervalMs = 250;
+
+private:
+    ProbeClock m_clock;
+    ProbedValue<bool> m_cursorVisible { 0 };
+    ProbedValue<UINT> m_outputCodePage { kCodePageIntervalMs };
+};
+
+#endif // AGENT_CONSOLE_STATE_PROBE_H
@@ -0,0 +1,71 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "CpuCycles.h"
+
+namespace {
+
+typedef BOOL WINAPI QueryCycleTime_t(HANDLE, PULONG64);
+
+struct CycleApi {
+    QueryCycleTime_t *queryThread = nullptr;
+    QueryCycleTime_t *queryProcess = nullptr;
+
+    CycleApi() {
+        // kernel32 is always loaded, so the module handle stays valid.
+        const HMODULE kernel32 = GetModuleHandleW(L"kernel32.dll");
+        if (kernel32 != nullptr) {
+            queryThread = reinterpret_cast<QueryCycleTime_t*>(
+                GetProcAddress(kernel32, "QueryThreadCycleTime"));
+            queryProcess = reinterpret_cast<QueryCycleTime_t*>(
+                GetProcAddress(kernel32, "QueryProcessCycleTime"));
+        }
+    }
+};
+
+const CycleApi &cycleApi() {
+    static const CycleApi api;
+    return api;
+}
+
+uint64_t queryCycles(QueryCycleTime_t *query, HANDLE handle) {
+    ULONG64 cycles = 0;
+    if (query == nullptr || !query(handle, &cycles)) {
+        return 0;
+    }
+    return cycles;
+}
+
+} // anonymous namespace
+
+uint64_t threadCycles(HANDLE thread)
+{
+    return queryCycles(cycleApi().queryThread, thread);
+}
+
+uint64_t currentThreadCycles()
+{
+    return threadCycles(GetCurrentThread());
+}
+
+uint64_t processCycles()
+{
+    return queryCycles(cycleApi().queryProcess, GetCurrentProcess());
+}
@@ -0,0 +1,53 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_CPU_CYCLES_H
+#define AGENT_CPU_CYCLES_H
+
+#include <windows.h>
+#include <stdint.h>
+
+// The CPU cycles a thread, or the whole process, has used so far, from
+// QueryThreadCycleTime and QueryProcessCycleTime.  Cycle counts don't
+// convert to time, but they do compare across activities, and unlike
+// GetThreadTimes, they don't miss work shorter than a clock tick.  Before
+// Vista, the functions are missing and every count is 0.
+uint64_t threadCycles(HANDLE thread);
+uint64_t currentThreadCycles();
+uint64_t processCycles();
+
+// Adds the cycles the calling thread used during the scope to a counter.
+class CycleScope {
+public:
+    explicit CycleScope(uint64_t &total) :
+        m_total(total), m_start(currentThreadCycles())
+    {
+    }
+    ~CycleScope() { m_total += currentThreadCycles() - m_start; }
+
+    CycleScope(const CycleScope &other) = delete;
+    CycleScope &operator=(const CycleScope &other) = delete;
+
+private:
+    uint64_t &m_total;
+    const uint64_t m_start;
+};
+
+#endif // AGENT_CPU_CYCLES_H
@@ -25,4 +25,9 @@ class InputMap;
 
 void addDefaultEntriesToInputMap(InputMap &inputMap);
 
+// Loads the default entries, compiled.  When the build generated the
+// compiled tables, the map uses them in place, so agents share the pages
+// instead of each building its own copy.
+void loadDefaultInputMap(InputMap &inputMap);
+
 #endif // DEFAULT_INPUT_MAP_H
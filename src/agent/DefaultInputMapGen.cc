@@ -0,0 +1,50 @@
+// Copyright (c) 2015 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+// Generates build/gen/GenDefaultInputMap.h, the default InputMap compiled
+// into constant tables for loadDefaultInputMap.
+
+#include <stdio.h>
+
+#include "DefaultInputMap.h"
+#include "InputMap.h"
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s OUTPUT-HEADER\n", argv[0]);
+        return 1;
+    }
+    InputMap inputMap;
+    addDefaultEntriesToInputMap(inputMap);
+    inputMap.compile();
+
+    FILE *out = fopen(argv[1], "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error: could not open %s\n", argv[1]);
+        return 1;
+    }
+    fprintf(out, "// Generated by winpty-gen-input-map.exe.  Do not edit.\n\n");
+    inputMap.writeCompiledTables(out, "kGenDefaultInputMap");
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error: could not write %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+// Copyright (c) 2015 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "DefaultInputMap.h"
+
+#include <stdint.h>
+
+#include "InputMap.h"
+
+#ifdef WINPTY_GEN_INPUT_MAP
+#include "GenDefaultInputMap.h"
+#endif
+
+// Kept apart from DefaultInputMap.cc, because winpty-gen-input-map.exe
+// links that file to generate the tables included here.
+void loadDefaultInputMap(InputMap &inputMap) {
+#ifdef WINPTY_GEN_INPUT_MAP
+    inputMap.setCompiledTables(
+        kGenDefaultInputMapStates,
+        sizeof(kGenDefaultInputMapStates) /
+            sizeof(kGenDefaultInputMapStates[0]),
+        kGenDefaultInputMapTransitions,
+        sizeof(kGenDefaultInputMapTransitions) /
+            sizeof(kGenDefaultInputMapTransitions[0]));
+#else
+    addDefaultEntriesToInputMap(inputMap);
+    inputMap.compile();
+#endif
+}
@@ -0,0 +1,119 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_ESCAPE_BUILDER_H
+#define AGENT_ESCAPE_BUILDER_H
+
+// Formats short escape sequences in place, with no format string, strlen, or
+// heap.  Numbers are written forward from a table of digit pairs, so nothing
+// is built backwards and copied afterward.  The parts are given in order:
+//
+//     EscapeBuilder esc;
+//     esc.csi().num(column + 1).ch('G');
+//     write(esc.data(), esc.size());
+//
+// formatDecimal and appendDecimal follow StringBuilder.h's decOfInt, for the
+// unsigned values escape sequences take.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "../shared/WinptyAssert.h"
+
+// The longest output of formatDecimal.
+const size_t kMaxDecimalDigits = 10;
+
+inline size_t decimalDigits(uint32_t n)
+{
+    size_t ret = 1;
+    for (; n >= 10000; n /= 10000) {
+        ret += 4;
+    }
+    if (n >= 1000) { return ret + 3; }
+    if (n >= 100) { return ret + 2; }
+    if (n >= 10) { return ret + 1; }
+    return ret;
+}
+
+// Writes n in decimal at out, without a NUL, and returns the length.
+inline size_t formatDecimal(char *out, uint32_t n)
+{
+    static const char kDigitPairs[] =
+        "00010203040506070809101112131415161718192021222324"
+        "25262728293031323334353637383940414243444546474849"
+        "50515253545556575859606162636465666768697071727374"
+        "75767778798081828384858687888990919293949596979899";
+    const size_t len = decimalDigits(n);
+    char *p = out + len;
+    while (n >= 100) {
+        const uint32_t pair = (n % 100) * 2;
+        n /= 100;
+        *(--p) = kDigitPairs[pair + 1];
+        *(--p) = kDigitPairs[pair];
+    }
+    if (n >= 10) {
+        *(--p) = kDigitPairs[n * 2 + 1];
+        *(--p) = kDigitPairs[n * 2];
+    } else {
+        *(--p) = static_cast<char>('0' + n);
+    }
+    return len;
+}
+
+inline void appendDecimal(std::string &out, uint32_t n)
+{
+    char buffer[kMaxDecimalDigits];
+    out.append(buffer, formatDecimal(buffer, n));
+}
+
+class EscapeBuilder {
+public:
+    EscapeBuilder &ch(char c) {
+        reserve(1);
+        m_buffer[m_size++] = c;
+        return *this;
+    }
+    // Appends a string literal; its length is known at compile time.
+    template <size_t N>
+    EscapeBuilder &lit(const char (&text)[N]) {
+        reserve(N - 1);
+        memcpy(&m_buffer[m_size], text, N - 1);
+        m_size += N - 1;
+        return *this;
+    }
+    EscapeBuilder &csi() { return lit("\x1b["); }
+    EscapeBuilder &num(uint32_t n) {
+        reserve(kMaxDecimalDigits);
+        m_size += formatDecimal(&m_buffer[m_size], n);
+        return *this;
+    }
+    const char *data() const { return m_buffer; }
+    size_t size() const { return m_size; }
+
+private:
+    enum { kCapacity = 64 };
+    void reserve(size_t count) { ASSERT(m_size + count <= kCapacity); }
+    char m_buffer[kCapacity];
+    size_t m_size = 0;
+};
+
+#endif // AGENT_ESCAPE_BUILDER_H
@@ -0,0 +1,196 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "EtwTrace.h"
+
+#include <windows.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "../shared/DebugClient.h"
+#include "../shared/OsModule.h"
+
+volatile bool g_etwEnabled = false;
+
+namespace {
+
+// {8d2a6b6e-3f71-4c0a-9a4e-5b1f7c3d42a9}
+const GUID kProviderGuid = {
+    0x8d2a6b6e, 0x3f71, 0x4c0a,
+    { 0x9a, 0x4e, 0x5b, 0x1f, 0x7c, 0x3d, 0x42, 0xa9 }
+};
+
+const char kProviderName[] = "winpty.agent";
+
+// Constants from evntprov.h and TraceLoggingProvider.h.  The MinGW headers
+// lack the TraceLogging parts, so the structures are declared here too.
+const UCHAR kChannelTraceLogging = 11;
+const UCHAR kLevelVerbose = 5;
+const ULONG kDataDescriptorEventMetadata = 1;
+const ULONG kDataDescriptorProviderMetadata = 2;
+const int kEventProviderSetTraits = 2;
+const UCHAR kTlgInINT64 = 9;
+
+struct EtwEventDescriptor {
+    USHORT Id;
+    UCHAR Version;
+    UCHAR Channel;
+    UCHAR Level;
+    UCHAR Opcode;
+    USHORT Task;
+    ULONGLONG Keyword;
+};
+
+struct EtwEventDataDescriptor {
+    ULONGLONG Ptr;
+    ULONG Size;
+    ULONG Reserved;     // The descriptor type, on Windows 10
+};
+
+typedef VOID WINAPI EtwEnableCallback_t(
+    const GUID *SourceId,
+    ULONG IsEnabled,
+    UCHAR Level,
+    ULONGLONG MatchAnyKeyword,
+    ULONGLONG MatchAllKeyword,
+    PVOID FilterData,
+    PVOID CallbackContext);
+
+typedef ULONG WINAPI EventRegister_t(
+    const GUID *ProviderId,
+    EtwEnableCallback_t *EnableCallback,
+    PVOID CallbackContext,
+    ULONGLONG *RegHandle);
+
+typedef ULONG WINAPI EventWrite_t(
+    ULONGLONG RegHandle,
+    const EtwEventDescriptor *EventDescriptor,
+    ULONG UserDataCount,
+    EtwEventDataDescriptor *UserData);
+
+typedef ULONG WINAPI EventSetInformation_t(
+    ULONGLONG RegHandle,
+    int InformationClass,
+    PVOID EventInformation,
+    ULONG InformationLength);
+
+EventWrite_t *g_eventWrite = nullptr;
+ULONGLONG g_regHandle = 0;
+
+// The provider traits: [UINT16 size][name NUL].
+std::vector<char> g_providerMetadata;
+
+VOID WINAPI enableCallback(const GUID*, ULONG isEnabled, UCHAR, ULONGLONG,
+                           ULONGLONG, PVOID, PVOID) {
+    g_etwEnabled = (isEnabled != 0);
+}
+
+void setMetadataSize(std::vector<char> &out) {
+    const uint16_t size = static_cast<uint16_t>(out.size());
+    memcpy(&out[0], &size, sizeof(size));
+}
+
+EtwEventDataDescriptor dataDescriptor(const void *data, size_t size,
+                                      ULONG type=0) {
+    EtwEventDataDescriptor ret = {};
+    ret.Ptr = reinterpret_cast<ULONGLONG>(data);
+    ret.Size = static_cast<ULONG>(size);
+    ret.Reserved = type;
+    return ret;
+}
+
+} // anonymous namespace
+
+void etwRegister() {
+    if (g_eventWrite != nullptr) {
+        return;
+    }
+    static OsModule advapi32(L"advapi32.dll");
+    const auto pEventRegister = reinterpret_cast<EventRegister_t*>(
+        advapi32.proc("EventRegister"));
+    const auto pEventWrite = reinterpret_cast<EventWrite_t*>(
+        advapi32.proc("EventWrite"));
+    if (pEventRegister == nullptr || pEventWrite == nullptr) {
+        trace("ETW is unavailable");
+        return;
+    }
+
+    g_providerMetadata.assign(2, '\0');
+    g_providerMetadata.insert(g_providerMetadata.end(),
+                              kProviderName,
+                              kProviderName + sizeof(kProviderName));
+    setMetadataSize(g_providerMetadata);
+
+    g_eventWrite = pEventWrite;
+    if (pEventRegister(&kProviderGuid, enableCallback, nullptr,
+                       &g_regHandle) != ERROR_SUCCESS) {
+        trace("EventRegister failed");
+        g_eventWrite = nullptr;
+        return;
+    }
+
+    // Windows 8 and up accept the provider name as a trait.  Windows 10
+    // also reads it from each event's provider metadata descriptor.
+    const auto pEventSetInformation =
+        reinterpret_cast<EventSetInformation_t*>(
+            GetProcAddress(advapi32.handle(), "EventSetInformation"));
+    if (pEventSetInformation != nullptr) {
+        pEventSetInformation(g_regHandle, kEventProviderSetTraits,
+                             g_providerMetadata.data(),
+                             g_providerMetadata.size());
+    }
+}
+
+// Every field is an INT64.  The event metadata is
+// [UINT16 size][UINT8 tags][event name NUL]{[field name NUL][UINT8 type]}*.
+void etwWriteEvent(const char *eventName,
+                   std::initializer_list<EtwField> fields) {
+    if (g_eventWrite == nullptr) {
+        return;
+    }
+    std::vector<char> metadata(2, '\0');
+    metadata.push_back('\0');
+    metadata.insert(metadata.end(), eventName,
+                    eventName + strlen(eventName) + 1);
+    for (const auto &field : fields) {
+        metadata.insert(metadata.end(), field.name,
+                        field.name + strlen(field.name) + 1);
+        metadata.push_back(static_cast<char>(kTlgInINT64));
+    }
+    setMetadataSize(metadata);
+
+    std::vector<EtwEventDataDescriptor> data;
+    data.reserve(2 + fields.size());
+    data.push_back(dataDescriptor(g_providerMetadata.data(),
+                                  g_providerMetadata.size(),
+                                  kDataDescriptorProviderMetadata));
+    data.push_back(dataDescriptor(metadata.data(), metadata.size(),
+                                  kDataDescriptorEventMetadata));
+    for (const auto &field : fields) {
+        data.push_back(dataDescriptor(&field.value, sizeof(field.value)));
+    }
+
+    EtwEventDescriptor desc = {};
+    desc.Channel = kChannelTraceLogging;
+    desc.Level = kLevelVerbose;
+    g_eventWrite(g_regHandle, &desc, data.size(), data.data());
+}
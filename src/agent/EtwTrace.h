@@ -0,0 +1,54 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_ETW_TRACE_H
+#define AGENT_ETW_TRACE_H
+
+#include <stdint.h>
+
+#include <initializer_list>
+
+// A TraceLogging-compatible ETW provider named "winpty.agent", with GUID
+// {8d2a6b6e-3f71-4c0a-9a4e-5b1f7c3d42a9}, for profiling the agent next to
+// conhost in WPA.  Events are self-describing, so their fields are decoded
+// without a manifest.  While no session has enabled the provider, an event
+// costs a single branch, and its arguments are not evaluated.
+//
+// The ETW APIs are loaded dynamically because they are missing on XP.
+
+struct EtwField {
+    const char *name;
+    int64_t value;
+};
+
+extern volatile bool g_etwEnabled;
+
+void etwRegister();
+void etwWriteEvent(const char *eventName,
+                   std::initializer_list<EtwField> fields);
+
+#define ETW_EVENT(eventName, ...)                               \
+    do {                                                        \
+        if (g_etwEnabled) {                                     \
+            etwWriteEvent((eventName), { __VA_ARGS__ });        \
+        }                                                       \
+    } while (false)
+
+#endif // AGENT_ETW_TRACE_H
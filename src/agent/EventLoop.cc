@@ -24,8 +24,59 @@
 
 #include "NamedPipe.h"
 #include "../shared/DebugClient.h"
+#include "../shared/OsModule.h"
+#include "../shared/TimeMeasurement.h"
 #include "../shared/WinptyAssert.h"
 
+namespace {
+
+// In low-power idle mode, an idle poll may be late by up to this fraction of
+// the poll interval, and by at most kMaxIdleToleranceMs.
+const int kIdleToleranceDivisor = 2;
+const int kMaxIdleToleranceMs = 1000;
+
+// SetWaitableTimerEx is new in Windows 7.  The REASON_CONTEXT argument is
+// always null here.
+typedef BOOL WINAPI SetWaitableTimerEx_t(
+    HANDLE hTimer,
+    const LARGE_INTEGER *lpDueTime,
+    LONG lPeriod,
+    PTIMERAPCROUTINE pfnCompletionRoutine,
+    LPVOID lpArgToCompletionRoutine,
+    void *WakeContext,
+    ULONG TolerableDelay);
+
+SetWaitableTimerEx_t *setWaitableTimerExProc() {
+    static OsModule kernel32(L"kernel32.dll");
+    static SetWaitableTimerEx_t *const proc =
+        reinterpret_cast<SetWaitableTimerEx_t*>(
+            kernel32.proc("SetWaitableTimerEx"));
+    return proc;
+}
+
+} // anonymous namespace
+
+// The pipes' overlapped I/O is associated with an I/O completion port, so the
+// loop can sleep on the port and then service only the pipes that completed
+// something or were given new work.  When the loop must also wake for window
+// messages, or if the port can't be created, it falls back to waiting on each
+// pipe's event handle instead (which is limited to MAXIMUM_WAIT_OBJECTS).
+EventLoop::EventLoop()
+{
+    if (!hasDebugFlag("no_iocp")) {
+        HANDLE port = CreateIoCompletionPort(
+            INVALID_HANDLE_VALUE, nullptr, 0, 1);
+        if (port == nullptr) {
+            trace("CreateIoCompletionPort failed: error %u",
+                static_cast<unsigned int>(GetLastError()));
+        } else {
+            m_completionPort = OwnedHandle(port);
+        }
+    }
+    m_wakeEvent = OwnedHandle(CreateEventW(nullptr, FALSE, FALSE, nullptr));
+    ASSERT(m_wakeEvent.get() != nullptr);
+}
+
 EventLoop::~EventLoop() {
     for (NamedPipe *pipe : m_pipes) {
         delete pipe;
@@ -33,64 +84,386 @@ EventLoop::~EventLoop() {
     m_pipes.clear();
 }
 
+// Attempt to make progress with the pipes.  Returns true if any pipe did
+// something.  With a completion port, only pipes flagged as needing service
+// are visited.
+bool EventLoop::servicePipes(std::vector<HANDLE> *waitHandles)
+{
+    const bool usePort =
+        m_completionPort.get() != nullptr && !m_pumpWindowMessages;
+    bool didSomething = false;
+    m_heldOutputMs = -1;
+    waitHandles->clear();
+    m_waitHandleOwners.clear();
+    for (size_t i = 0; i < m_pipes.size(); ++i) {
+        NamedPipe &pipe = *m_pipes[i];
+        if (usePort && !pipe.m_serviceNeeded) {
+            continue;
+        }
+        pipe.m_serviceNeeded = false;
+        if (pipe.serviceIo(waitHandles)) {
+            onPipeIo(pipe);
+            didSomething = true;
+        }
+        m_waitHandleOwners.resize(waitHandles->size(), &pipe);
+        const int heldMs = pipe.heldOutputDelayMs();
+        if (heldMs != -1) {
+            // Come back for the held output when it's due.
+            pipe.m_serviceNeeded = true;
+            if (m_heldOutputMs == -1 || heldMs < m_heldOutputMs) {
+                m_heldOutputMs = heldMs;
+            }
+        }
+    }
+    if (usePort) {
+        // The pipes are waited on through the port instead.
+        waitHandles->clear();
+        m_waitHandleOwners.clear();
+    } else {
+        waitHandles->push_back(m_wakeEvent.get());
+        m_waitHandleOwners.push_back(nullptr);
+    }
+    return didSomething;
+}
+
+// Wait for at least one completion packet (or the timeout), then flag the
+// pipes that received packets.
+void EventLoop::waitForCompletions(DWORD timeout)
+{
+    DWORD actual = 0;
+    ULONG_PTR key = 0;
+    OVERLAPPED *over = nullptr;
+    bool woken = false;
+    while (GetQueuedCompletionStatus(m_completionPort.get(),
+                                     &actual, &key, &over, timeout) ||
+            over != nullptr) {
+        // A failed I/O still dequeues a packet; the pipe sees the error when
+        // it's serviced.  Key 0 is a wake() packet.
+        NamedPipe *const pipe = reinterpret_cast<NamedPipe*>(key);
+        if (pipe != nullptr) {
+            pipe->m_serviceNeeded = true;
+        }
+        if (!woken) {
+            // The first packet ended the wait; the rest were dequeued along
+            // with it.
+            noteWakeup(pipe, false);
+            woken = true;
+        }
+        over = nullptr;
+        timeout = 0;
+    }
+    if (!woken) {
+        noteWakeup(nullptr, true);
+    }
+}
+
+void EventLoop::noteWakeup(NamedPipe *pipe, bool timedOut)
+{
+    ++m_loopStats.wakeups;
+    if (timedOut) {
+        ++m_loopStats.timeoutWakeups;
+    } else if (pipe != nullptr) {
+        ++pipe->m_wakeups;
+    } else {
+        ++m_loopStats.otherWakeups;
+    }
+}
+
+// While the loop waits on event handles, discard the port's packets so they
+// don't accumulate.  The event handles carry the same information.
+void EventLoop::drainCompletions()
+{
+    if (m_completionPort.get() == nullptr) {
+        return;
+    }
+    DWORD actual = 0;
+    ULONG_PTR key = 0;
+    OVERLAPPED *over = nullptr;
+    while (GetQueuedCompletionStatus(m_completionPort.get(),
+                                     &actual, &key, &over, 0) ||
+            over != nullptr) {
+        over = nullptr;
+    }
+}
+
 // Enter the event loop.  Runs until the I/O or timeout handler calls exit().
 void EventLoop::run()
 {
     std::vector<HANDLE> waitHandles;
     DWORD lastTime = GetTickCount();
+    TimeMeasurement loopTimer;
+    bool woken = false;
     while (!m_exiting) {
         bool didSomething = false;
+        ++m_loopStats.iterations;
+        m_tickArena.reset();
 
-        // Attempt to make progress with the pipes.
-        waitHandles.clear();
-        for (size_t i = 0; i < m_pipes.size(); ++i) {
-            if (m_pipes[i]->serviceIo(&waitHandles)) {
-                onPipeIo(*m_pipes[i]);
-                didSomething = true;
-            }
+        // Dispatch window messages first.  Out-of-context WinEvent hook
+        // callbacks run from within PeekMessage, and they may request a poll.
+        if (m_pumpWindowMessages) {
+            pumpWindowMessages();
         }
 
-        // Call the timeout if enough time has elapsed.
-        if (m_pollInterval > 0) {
-            int elapsed = GetTickCount() - lastTime;
-            if (elapsed >= m_pollInterval) {
+        if (InterlockedExchange(&m_wakePending, 0) != 0) {
+            onWake();
+            didSomething = true;
+        }
+
+        if (servicePipes(&waitHandles)) {
+            didSomething = true;
+        }
+
+        // Call the timeout if enough time has elapsed, or if an early poll
+        // was requested and is now due.
+        if (m_pollInterval > 0 || m_pollRequested) {
+            const DWORD now = GetTickCount();
+            const bool requestDue = m_pollRequested &&
+                static_cast<int>(now - m_pollRequestTick) >= 0;
+            const bool intervalDue = m_pollInterval > 0 &&
+                static_cast<int>(now - lastTime) >= m_pollInterval;
+            if (requestDue || intervalDue) {
+                const bool burstPoll = requestDue && m_burstPollRequested;
+                m_pollRequested = false;
+                m_burstPollRequested = false;
+                m_pollActivity = false;
                 onPollTimeout();
+                m_pollIdle = !m_pollActivity;
+                scheduleBurstPoll();
+                if (!m_pollActivity && !burstPoll) {
+                    // Back off while polls keep finding nothing to do.
+                    m_pollInterval = std::min(m_pollInterval * 2,
+                                              m_maxPollInterval);
+                }
                 lastTime = GetTickCount();
                 didSomething = true;
             }
         }
 
-        if (didSomething)
+        if (didSomething) {
+            woken = false;
             continue;
+        }
+        if (woken) {
+            ++m_loopStats.spuriousWakeups;
+        }
 
-        // If there's nothing to do, wait.
+        // If there's nothing to do, wait.  Only the regular poll of an idle
+        // loop is coalesced; a requested poll stays on time.
         DWORD timeout = INFINITE;
-        if (m_pollInterval > 0)
+        bool idleWait = false;
+        if (m_pollInterval > 0) {
             timeout = std::max(0, (int)(lastTime + m_pollInterval - GetTickCount()));
-        if (waitHandles.size() == 0) {
-            ASSERT(timeout != INFINITE);
-            if (timeout > 0)
-                Sleep(timeout);
+            idleWait = m_lowPowerIdle && m_pollIdle;
+        }
+        if (m_pollRequested) {
+            const DWORD untilRequest =
+                std::max(0, (int)(m_pollRequestTick - GetTickCount()));
+            if (untilRequest < timeout) {
+                idleWait = false;
+            }
+            timeout = std::min(timeout, untilRequest);
+        }
+        if (m_heldOutputMs != -1 &&
+                static_cast<DWORD>(m_heldOutputMs) < timeout) {
+            idleWait = false;
+            timeout = m_heldOutputMs;
+        }
+        int toleranceMs = 0;
+        if (idleWait && timeout > 0) {
+            timeout = coalescedTimeout(timeout, toleranceMs);
+        }
+        if (m_completionPort.get() == nullptr || m_pumpWindowMessages) {
+            // Waiting on handles, the idle timer lets the system coalesce
+            // the wakeup with other timers too.
+            if (toleranceMs > 0 && armIdleTimer(timeout, toleranceMs)) {
+                waitHandles.push_back(m_idleTimer.get());
+                m_waitHandleOwners.push_back(nullptr);
+                timeout = INFINITE;
+            } else if (m_idleTimerArmed) {
+                CancelWaitableTimer(m_idleTimer.get());
+                m_idleTimerArmed = false;
+            }
+        }
+        m_loopStats.runningUs += loopTimer.lapUs();
+        if (m_completionPort.get() != nullptr && !m_pumpWindowMessages) {
+            waitForCompletions(timeout);
         } else {
-            DWORD result = WaitForMultipleObjects(waitHandles.size(),
-                                                  waitHandles.data(),
-                                                  FALSE,
-                                                  timeout);
+            DWORD result = WAIT_FAILED;
+            if (m_pumpWindowMessages) {
+                drainCompletions();
+                result = MsgWaitForMultipleObjects(waitHandles.size(),
+                                                   waitHandles.data(),
+                                                   FALSE,
+                                                   timeout,
+                                                   QS_ALLINPUT);
+            } else {
+                result = WaitForMultipleObjects(waitHandles.size(),
+                                                waitHandles.data(),
+                                                FALSE,
+                                                timeout);
+            }
             ASSERT(result != WAIT_FAILED);
+            const size_t index = result - WAIT_OBJECT_0;
+            if (result == WAIT_TIMEOUT ||
+                    (index < waitHandles.size() &&
+                        waitHandles[index] == m_idleTimer.get())) {
+                noteWakeup(nullptr, true);
+            } else {
+                // A message (index == size) counts as another cause.
+                noteWakeup(index < m_waitHandleOwners.size()
+                               ? m_waitHandleOwners[index] : nullptr,
+                           false);
+            }
+        }
+        m_loopStats.blockedUs += loopTimer.lapUs();
+        woken = true;
+    }
+}
+
+// Ask the event loop to call onPollTimeout after delayMs milliseconds, even if
+// the regular poll interval hasn't elapsed yet.  If a request is already
+// pending, the earlier of the two deadlines wins.
+void EventLoop::requestPoll(int delayMs)
+{
+    const DWORD tick = GetTickCount() + std::max(0, delayMs);
+    if (!m_pollRequested || static_cast<int>(tick - m_pollRequestTick) < 0) {
+        m_pollRequestTick = tick;
+    }
+    m_pollRequested = true;
+}
+
+// Poll at each of the given delays from now, in increasing order, on top
+// of the regular interval.  This catches e.g. the echo of input soon after
+// it's written, without raising the poll rate.  A burst poll that finds
+// nothing doesn't lengthen the interval, and a new burst replaces what's
+// left of the previous one.
+void EventLoop::requestPollBurst(const int *delaysMs, size_t count)
+{
+    const DWORD now = GetTickCount();
+    m_pollBurst.clear();
+    for (size_t i = 0; i < count; ++i) {
+        m_pollBurst.push_back(now + std::max(0, delaysMs[i]));
+    }
+    m_pollBurstNext = 0;
+    m_burstPollRequested = false;
+    scheduleBurstPoll();
+}
+
+// Stretch the wait for an idle poll so it ends on a multiple of a
+// power-of-two number of ticks no larger than the tolerance.  Agents polling
+// at the same interval then wake on the same ticks, letting the CPU stay in
+// a deep idle state between them.
+DWORD EventLoop::coalescedTimeout(DWORD timeout, int &toleranceMs)
+{
+    toleranceMs = std::min(m_pollInterval / kIdleToleranceDivisor,
+                           kMaxIdleToleranceMs);
+    DWORD grid = 1;
+    while (static_cast<int>(grid * 2) <= toleranceMs) {
+        grid *= 2;
+    }
+    const DWORD deadline = GetTickCount() + timeout;
+    const DWORD aligned = (deadline + grid - 1) & ~(grid - 1);
+    return timeout + (aligned - deadline);
+}
+
+// Arm the idle timer to fire after timeout milliseconds, letting the system
+// delay it by up to toleranceMs.  Returns false without SetWaitableTimerEx.
+bool EventLoop::armIdleTimer(DWORD timeout, int toleranceMs)
+{
+    SetWaitableTimerEx_t *const setWaitableTimerEx = setWaitableTimerExProc();
+    if (setWaitableTimerEx == nullptr) {
+        return false;
+    }
+    if (m_idleTimer.get() == nullptr) {
+        m_idleTimer = OwnedHandle(CreateWaitableTimerW(nullptr, FALSE, nullptr));
+        if (m_idleTimer.get() == nullptr) {
+            trace("CreateWaitableTimerW failed: error %u",
+                static_cast<unsigned int>(GetLastError()));
+            m_lowPowerIdle = false;
+            return false;
         }
     }
+    // A negative due time is relative, in 100-nanosecond units.
+    LARGE_INTEGER dueTime;
+    dueTime.QuadPart = -static_cast<LONGLONG>(timeout) * 10000;
+    if (!setWaitableTimerEx(m_idleTimer.get(), &dueTime, 0, nullptr, nullptr,
+                            nullptr, toleranceMs)) {
+        trace("SetWaitableTimerEx failed: error %u",
+            static_cast<unsigned int>(GetLastError()));
+        return false;
+    }
+    m_idleTimerArmed = true;
+    return true;
+}
+
+// Request the next poll of the burst.  Deadlines that have already passed
+// are covered by the poll just made.
+void EventLoop::scheduleBurstPoll()
+{
+    const DWORD now = GetTickCount();
+    while (m_pollBurstNext < m_pollBurst.size() &&
+            static_cast<int>(m_pollBurst[m_pollBurstNext] - now) <= 0) {
+        ++m_pollBurstNext;
+    }
+    if (m_pollBurstNext == m_pollBurst.size() || m_burstPollRequested) {
+        return;
+    }
+    requestPoll(m_pollBurst[m_pollBurstNext++] - now);
+    m_burstPollRequested = true;
+}
+
+void EventLoop::wake()
+{
+    if (InterlockedExchange(&m_wakePending, 1) != 0) {
+        // The loop hasn't consumed the previous wakeup yet.
+        return;
+    }
+    if (m_completionPort.get() != nullptr) {
+        PostQueuedCompletionStatus(m_completionPort.get(), 0, 0, nullptr);
+    }
+    SetEvent(m_wakeEvent.get());
+}
+
+void EventLoop::pumpWindowMessages()
+{
+    MSG msg;
+    while (PeekMessageW(&msg, nullptr, 0, 0, PM_REMOVE)) {
+        TranslateMessage(&msg);
+        DispatchMessageW(&msg);
+    }
 }
 
 NamedPipe &EventLoop::createNamedPipe()
 {
     NamedPipe *ret = new NamedPipe();
+    ret->m_completionPort = m_completionPort.get();
     m_pipes.push_back(ret);
     return *ret;
 }
 
 void EventLoop::setPollInterval(int ms)
 {
-    m_pollInterval = ms;
+    setPollInterval(ms, ms);
+}
+
+// Poll adaptively: every minMs milliseconds after activity, doubling the
+// interval after each idle poll until it reaches maxMs.  With minMs == maxMs,
+// the interval is fixed.
+void EventLoop::setPollInterval(int minMs, int maxMs)
+{
+    ASSERT(minMs >= 0 && minMs <= maxMs);
+    m_minPollInterval = minMs;
+    m_maxPollInterval = maxMs;
+    m_pollInterval = minMs;
+}
+
+// Report that the console or terminal is active (e.g. the scraper found new
+// output, or input arrived), so the next poll should happen soon.
+void EventLoop::notePollActivity()
+{
+    m_pollActivity = true;
+    m_pollIdle = false;
+    m_pollInterval = m_minPollInterval;
 }
 
 void EventLoop::shutdown()
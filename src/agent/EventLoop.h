@@ -21,27 +21,110 @@
 #ifndef EVENTLOOP_H
 #define EVENTLOOP_H
 
+#include <windows.h>
+#include <stdint.h>
+
 #include <vector>
 
+#include "../shared/OwnedHandle.h"
+#include "SimplePool.h"
+
 class NamedPipe;
 
+// What the loop spent its time on.  A wakeup is a wait that returned.  Each
+// is charged to one cause: the first pipe whose I/O completed (counted by the
+// pipe, see NamedPipe::wakeups), the poll timeout, or anything else (another
+// thread's wake() or a window message).  A spurious wakeup is one after which
+// the loop found nothing to do and waited again.
+struct EventLoopStats {
+    uint64_t iterations = 0;
+    uint64_t wakeups = 0;
+    uint64_t timeoutWakeups = 0;
+    uint64_t otherWakeups = 0;
+    uint64_t spuriousWakeups = 0;
+    uint64_t blockedUs = 0;
+    uint64_t runningUs = 0;
+
+    void add(const EventLoopStats &other) {
+        iterations += other.iterations;
+        wakeups += other.wakeups;
+        timeoutWakeups += other.timeoutWakeups;
+        otherWakeups += other.otherWakeups;
+        spuriousWakeups += other.spuriousWakeups;
+        blockedUs += other.blockedUs;
+        runningUs += other.runningUs;
+    }
+};
+
 class EventLoop
 {
 public:
+    EventLoop();
     virtual ~EventLoop();
     void run();
+    void requestPoll(int delayMs=0);
+    void requestPollBurst(const int *delaysMs, size_t count);
+    void pumpWindowMessages();
+    // Unlike the rest of the class, this may be called from any thread.  It
+    // makes the loop's thread call onWake soon, interrupting its wait.
+    void wake();
+    // Only the loop's thread may read these while the loop runs.
+    const EventLoopStats &loopStats() const { return m_loopStats; }
 
 protected:
     NamedPipe &createNamedPipe();
     void setPollInterval(int ms);
+    void setPollInterval(int minMs, int maxMs);
+    void notePollActivity();
+    void setPumpWindowMessages(bool pump) { m_pumpWindowMessages = pump; }
+    // Let the regular poll slip a little while polls find nothing to do, so
+    // the wakeups of many agents line up.
+    void setLowPowerIdle(bool enable) { m_lowPowerIdle = enable; }
     void shutdown();
+    // Scratch memory for the current iteration.  The loop resets it before
+    // each iteration, so nothing allocated here may outlive the callback.
+    BumpArena &tickArena() { return m_tickArena; }
     virtual void onPollTimeout()                    {}
     virtual void onPipeIo(NamedPipe &namedPipe)     {}
+    virtual void onWake()                           {}
+
+private:
+    bool servicePipes(std::vector<HANDLE> *waitHandles);
+    void waitForCompletions(DWORD timeout);
+    void drainCompletions();
+    void scheduleBurstPoll();
+    DWORD coalescedTimeout(DWORD timeout, int &toleranceMs);
+    bool armIdleTimer(DWORD timeout, int toleranceMs);
+    void noteWakeup(NamedPipe *pipe, bool timedOut);
 
 private:
     bool m_exiting = false;
+    BumpArena m_tickArena;
+    OwnedHandle m_completionPort;
     std::vector<NamedPipe*> m_pipes;
     int m_pollInterval = 0;
+    int m_minPollInterval = 0;
+    int m_maxPollInterval = 0;
+    bool m_pollActivity = false;
+    bool m_pollIdle = false;
+    bool m_lowPowerIdle = false;
+    OwnedHandle m_idleTimer;
+    bool m_idleTimerArmed = false;
+    bool m_pumpWindowMessages = false;
+    bool m_pollRequested = false;
+    DWORD m_pollRequestTick = 0;
+    // The deadlines of the current poll burst, and the next one to request.
+    std::vector<DWORD> m_pollBurst;
+    size_t m_pollBurstNext = 0;
+    bool m_burstPollRequested = false;
+    // The soonest a pipe's held output is due, or -1.
+    int m_heldOutputMs = -1;
+    volatile LONG m_wakePending = 0;
+    OwnedHandle m_wakeEvent;
+    // The pipe that added each handle of the last servicePipes call, or
+    // nullptr for the loop's own handles.
+    std::vector<NamedPipe*> m_waitHandleOwners;
+    EventLoopStats m_loopStats;
 };
 
 #endif // EVENTLOOP_H
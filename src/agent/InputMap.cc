@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "DebugShowInput.h"
 #include "SimplePool.h"
 #include "../shared/DebugClient.h"
@@ -139,6 +141,7 @@ std::string InputMap::Key::toString() const {
 
 void InputMap::set(const char *encoding, int encodingLen, const Key &key) {
     ASSERT(encodingLen > 0);
+    ASSERT(!m_compiled && "InputMap::set called after compile");
     setHelper(m_root, encoding, encodingLen, key);
 }
 
@@ -185,9 +188,148 @@ InputMap::Node &InputMap::getOrCreateChild(Node &node, unsigned char ch) {
     return *ret;
 }
 
+// Replace the trie with one flat transition table, so that a lookup touches
+// one state and one transition per input byte rather than chasing node and
+// branch pointers.  The map is immutable afterward.
+void InputMap::compile() {
+    ASSERT(!m_compiled);
+
+    // Number the nodes breadth-first so that related states stay close.
+    std::vector<const Node*> nodes;
+    nodes.push_back(&m_root);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        for (int ch = 0; ch < 256; ++ch) {
+            const Node *child = getChild(*nodes[i], ch);
+            if (child != NULL) {
+                nodes.push_back(child);
+            }
+        }
+    }
+    if (nodes.size() > 0xFFFF) {
+        trace("InputMap::compile: too many states (%u), using the trie",
+            static_cast<unsigned int>(nodes.size()));
+        return;
+    }
+
+    m_states.resize(nodes.size());
+    m_transitions.clear();
+    uint32_t nextState = 1;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const Node &node = *nodes[i];
+        CompiledState &state = m_states[i];
+        state.key = node.key;
+        state.base = static_cast<uint32_t>(m_transitions.size());
+        state.lo = 1;
+        state.hi = 0;
+        state.hasChildren = node.childCount > 0;
+        if (!state.hasChildren) {
+            continue;
+        }
+        int lo = 256;
+        int hi = -1;
+        for (int ch = 0; ch < 256; ++ch) {
+            if (getChild(node, ch) != NULL) {
+                lo = std::min(lo, ch);
+                hi = std::max(hi, ch);
+            }
+        }
+        state.lo = static_cast<uint8_t>(lo);
+        state.hi = static_cast<uint8_t>(hi);
+        m_transitions.resize(state.base + (hi - lo + 1));
+        // The BFS above visited children in byte order, so they received
+        // consecutive state numbers.
+        for (int ch = lo; ch <= hi; ++ch) {
+            if (getChild(node, ch) != NULL) {
+                m_transitions[state.base + (ch - lo)] =
+                    static_cast<uint16_t>(nextState++);
+            }
+        }
+    }
+    ASSERT(nextState == nodes.size());
+
+    m_compiled = true;
+    m_stateTable = m_states.data();
+    m_stateCount = m_states.size();
+    m_transitionTable = m_transitions.data();
+    m_transitionCount = m_transitions.size();
+    m_root = Node();
+    m_nodePool.clear();
+    m_branchPool.clear();
+}
+
+void InputMap::setCompiledTables(const CompiledState *states,
+                                 size_t stateCount,
+                                 const uint16_t *transitions,
+                                 size_t transitionCount) {
+    ASSERT(!m_compiled);
+    ASSERT(stateCount > 0 && stateCount <= 0x10000);
+    m_compiled = true;
+    m_stateTable = states;
+    m_stateCount = stateCount;
+    m_transitionTable = transitions;
+    m_transitionCount = transitionCount;
+    m_root = Node();
+    m_nodePool.clear();
+    m_branchPool.clear();
+}
+
+void InputMap::writeCompiledTables(FILE *out, const char *prefix) const {
+    ASSERT(m_compiled);
+    fprintf(out, "static const InputMap::CompiledState %sStates[] = {\n",
+        prefix);
+    for (size_t i = 0; i < m_stateCount; ++i) {
+        const CompiledState &state = m_stateTable[i];
+        fprintf(out, "    { { 0x%x, 0x%x, 0x%x }, %u, %u, %u, %s },\n",
+            state.key.virtualKey,
+            static_cast<unsigned int>(state.key.unicodeChar),
+            state.key.keyState,
+            static_cast<unsigned int>(state.base),
+            state.lo, state.hi,
+            state.hasChildren ? "true" : "false");
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "static const uint16_t %sTransitions[] = {", prefix);
+    for (size_t i = 0; i < m_transitionCount; ++i) {
+        fprintf(out, "%s%u,", i % 12 == 0 ? "\n   " : "",
+            m_transitionTable[i]);
+    }
+    fprintf(out, "\n};\n");
+}
+
 // Find the longest matching key and node.
 int InputMap::lookupKey(const char *input, int inputSize,
                         Key &keyOut, bool &incompleteOut) const {
+    if (!m_compiled) {
+        return lookupKeyInTrie(input, inputSize, keyOut, incompleteOut);
+    }
+    keyOut = kKeyZero;
+    incompleteOut = false;
+
+    uint32_t stateIndex = 0;
+    int longestMatchLen = 0;
+
+    for (int i = 0; i < inputSize; ++i) {
+        const CompiledState &state = m_stateTable[stateIndex];
+        const unsigned char ch = input[i];
+        if (ch < state.lo || ch > state.hi) {
+            return longestMatchLen;
+        }
+        stateIndex = m_transitionTable[state.base + (ch - state.lo)];
+        if (stateIndex == 0) {
+            return longestMatchLen;
+        }
+        const Key &key = m_stateTable[stateIndex].key;
+        if (key.virtualKey != 0 || key.unicodeChar != 0) {
+            longestMatchLen = i + 1;
+            keyOut = key;
+        }
+    }
+    incompleteOut = m_stateTable[stateIndex].hasChildren;
+    return longestMatchLen;
+}
+
+int InputMap::lookupKeyInTrie(const char *input, int inputSize,
+                              Key &keyOut, bool &incompleteOut) const {
     keyOut = kKeyZero;
     incompleteOut = false;
 
@@ -213,7 +355,49 @@ int InputMap::lookupKey(const char *input, int inputSize,
 
 void InputMap::dumpInputMap() const {
     std::string encoding;
-    dumpInputMapHelper(m_root, encoding);
+    if (m_compiled) {
+        trace("InputMap: %u states, %u transitions",
+            static_cast<unsigned int>(m_stateCount),
+            static_cast<unsigned int>(m_transitionCount));
+        dumpCompiledHelper(0, encoding);
+    } else {
+        dumpInputMapHelper(m_root, encoding);
+    }
+}
+
+static void appendEncodingByte(std::string &encoding, int ch) {
+    if (!encoding.empty()) {
+        encoding.push_back(' ');
+    }
+    char ctrlChar = decodeUnixCtrlChar(ch);
+    if (ctrlChar != '\0') {
+        encoding.push_back('^');
+        encoding.push_back(static_cast<char>(ctrlChar));
+    } else if (ch == ' ') {
+        encoding.append("' '");
+    } else {
+        encoding.push_back(static_cast<char>(ch));
+    }
+}
+
+void InputMap::dumpCompiledHelper(
+        uint32_t stateIndex, std::string &encoding) const {
+    const CompiledState &state = m_stateTable[stateIndex];
+    if (state.key.virtualKey != 0 || state.key.unicodeChar != 0) {
+        trace("%s -> %s",
+            encoding.c_str(),
+            state.key.toString().c_str());
+    }
+    for (int ch = state.lo; ch <= state.hi; ++ch) {
+        const uint32_t child =
+            m_transitionTable[state.base + (ch - state.lo)];
+        if (child != 0) {
+            size_t oldSize = encoding.size();
+            appendEncodingByte(encoding, ch);
+            dumpCompiledHelper(child, encoding);
+            encoding.resize(oldSize);
+        }
+    }
 }
 
 void InputMap::dumpInputMapHelper(
@@ -227,18 +411,7 @@ void InputMap::dumpInputMapHelper(
         const Node *child = getChild(node, i);
         if (child != NULL) {
             size_t oldSize = encoding.size();
-            if (!encoding.empty()) {
-                encoding.push_back(' ');
-            }
-            char ctrlChar = decodeUnixCtrlChar(i);
-            if (ctrlChar != '\0') {
-                encoding.push_back('^');
-                encoding.push_back(static_cast<char>(ctrlChar));
-            } else if (i == ' ') {
-                encoding.append("' '");
-            } else {
-                encoding.push_back(static_cast<char>(i));
-            }
+            appendEncodingByte(encoding, i);
             dumpInputMapHelper(*child, encoding);
             encoding.resize(oldSize);
         }
@@ -22,10 +22,12 @@
 #define INPUT_MAP_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <string>
+#include <vector>
 
 #include "SimplePool.h"
 #include "../shared/WinptyAssert.h"
@@ -40,6 +42,18 @@ public:
         std::string toString() const;
     };
 
+    // The compiled form of the trie.  Each state's transitions are a dense
+    // run of the transition table covering the byte range [lo, hi].  A
+    // transition of 0 means "no child", because the root (state 0) is never
+    // a target.
+    struct CompiledState {
+        Key key;
+        uint32_t base;
+        uint8_t lo;
+        uint8_t hi;
+        bool hasChildren;
+    };
+
 private:
     struct Node;
 
@@ -77,11 +91,36 @@ private:
     SimplePool<Node, 256> m_nodePool;
     SimplePool<Branch, 8> m_branchPool;
     Node m_root;
+    bool m_compiled = false;
+    // The compiled tables, either m_states and m_transitions or tables built
+    // into the binary.
+    const CompiledState *m_stateTable = nullptr;
+    size_t m_stateCount = 0;
+    const uint16_t *m_transitionTable = nullptr;
+    size_t m_transitionCount = 0;
+    std::vector<CompiledState> m_states;
+    std::vector<uint16_t> m_transitions;
 
 public:
     void set(const char *encoding, int encodingLen, const Key &key);
+    void compile();
+    // Uses tables an earlier compile() wrote with writeCompiledTables, e.g.
+    // ones built into the binary as constant data.  The tables aren't
+    // copied, so they must outlive the map.
+    void setCompiledTables(const CompiledState *states, size_t stateCount,
+                           const uint16_t *transitions,
+                           size_t transitionCount);
+    // Writes the compiled tables as C++ array definitions named
+    // <prefix>States and <prefix>Transitions.
+    void writeCompiledTables(FILE *out, const char *prefix) const;
     int lookupKey(const char *input, int inputSize,
                   Key &keyOut, bool &incompleteOut) const;
+    // The heap memory held by the trie's pools and the compiled tables.
+    size_t heapBytes() const {
+        return m_nodePool.heapBytes() + m_branchPool.heapBytes() +
+            m_states.capacity() * sizeof(CompiledState) +
+            m_transitions.capacity() * sizeof(uint16_t);
+    }
     void dumpInputMap() const;
 
 private:
@@ -104,7 +143,10 @@ private:
 
     void setHelper(Node &node, const char *encoding, int encodingLen, const Key &key);
     Node &getOrCreateChild(Node &node, unsigned char ch);
+    int lookupKeyInTrie(const char *input, int inputSize,
+                        Key &keyOut, bool &incompleteOut) const;
     void dumpInputMapHelper(const Node &node, std::string &encoding) const;
+    void dumpCompiledHelper(uint32_t state, std::string &encoding) const;
 };
 
 const InputMap::Key kKeyZero = { 0, 0, 0 };
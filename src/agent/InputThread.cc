@@ -0,0 +1,235 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "InputThread.h"
+
+#include "ConsoleInput.h"
+#include "CpuCycles.h"
+#include "NamedPipe.h"
+#include "../shared/WinptyAssert.h"
+
+namespace {
+
+// ConsoleInput refreshes the console's input mode and times out incomplete
+// escape sequences.  Poll quickly while input is arriving.
+const int kMinPollIntervalMs = 25;
+const int kMaxPollIntervalMs = 250;
+
+// While input is held back for the console, poll at least this often.
+const int kHeldInputPollMs = 5;
+
+} // anonymous namespace
+
+InputThread::InputThread(EventLoop &mainLoop,
+                         const std::wstring &pipeName,
+                         int pipeBufferSize,
+                         HANDLE conin,
+                         int mouseMode,
+                         Win32Console &console) :
+    m_mainLoop(mainLoop),
+    m_pipeName(pipeName)
+{
+    m_pipe = &createNamedPipe();
+    m_pipe->openServerPipe(
+        m_pipeName.c_str(), NamedPipe::OpenMode::Reading, 0, pipeBufferSize);
+    m_pipe->setReadBufferSize(64 * 1024);
+    m_consoleInput.reset(new ConsoleInput(conin, mouseMode, *this, console));
+    setPollInterval(kMinPollIntervalMs, kMaxPollIntervalMs);
+
+    // Everything above happens-before the thread starts.
+    m_thread = OwnedHandle(
+        CreateThread(nullptr, 0, threadProc, this, 0, nullptr));
+    ASSERT(m_thread.get() != nullptr && "CreateThread failed");
+}
+
+InputThread::~InputThread()
+{
+    InterlockedExchange(&m_stopRequested, 1);
+    wake();
+    WaitForSingleObject(m_thread.get(), INFINITE);
+}
+
+DWORD WINAPI InputThread::threadProc(LPVOID param)
+{
+    static_cast<InputThread*>(param)->run();
+    return 0;
+}
+
+void InputThread::setMouseWindowRect(const SmallRect &rect)
+{
+    LockGuard<Mutex> lock(m_mutex);
+    m_mouseWindowRect = rect;
+    m_mouseRectChanged = true;
+}
+
+bool InputThread::shouldActivateTerminalMouse()
+{
+    LockGuard<Mutex> lock(m_mutex);
+    return m_terminalMouse;
+}
+
+void InputThread::invalidateInputFlags()
+{
+    InterlockedExchange(&m_inputFlagsStale, 1);
+    wake();
+}
+
+bool InputThread::takeDsrRequest()
+{
+    LockGuard<Mutex> lock(m_mutex);
+    const bool ret = m_dsrRequested;
+    m_dsrRequested = false;
+    return ret;
+}
+
+bool InputThread::takeInputActivity()
+{
+    LockGuard<Mutex> lock(m_mutex);
+    const bool ret = m_inputActivity;
+    m_inputActivity = false;
+    return ret;
+}
+
+uint64_t InputThread::bytesRead()
+{
+    LockGuard<Mutex> lock(m_mutex);
+    return m_bytesRead;
+}
+
+uint64_t InputThread::bytesWritten()
+{
+    LockGuard<Mutex> lock(m_mutex);
+    return m_bytesWritten;
+}
+
+uint64_t InputThread::recordsWritten()
+{
+    LockGuard<Mutex> lock(m_mutex);
+    return m_recordsWritten;
+}
+
+const LatencyHistogram &InputThread::inputLatency()
+{
+    return m_consoleInput->inputLatency();
+}
+
+uint64_t InputThread::cpuCycles()
+{
+    return threadCycles(m_thread.get());
+}
+
+EventLoopStats InputThread::sharedLoopStats()
+{
+    LockGuard<Mutex> lock(m_mutex);
+    return m_sharedLoopStats;
+}
+
+uint64_t InputThread::pipeWakeups()
+{
+    LockGuard<Mutex> lock(m_mutex);
+    return m_pipeWakeups;
+}
+
+// Mouse events are translated relative to the console window, which the
+// main thread finds while scraping.
+void InputThread::applyMouseWindowRect()
+{
+    LockGuard<Mutex> lock(m_mutex);
+    if (m_mouseRectChanged) {
+        m_consoleInput->setMouseWindowRect(m_mouseWindowRect);
+        m_mouseRectChanged = false;
+    }
+}
+
+void InputThread::onPipeIo(NamedPipe &namedPipe)
+{
+    ASSERT(&namedPipe == m_pipe);
+    // Decode the input in place in the pipe's queue.
+    const size_t size = m_pipe->bytesAvailable();
+    if (size == 0 || m_consoleInput->inputBacklogFull()) {
+        // A full backlog leaves the input in the pipe until onPollTimeout
+        // drains it.
+        return;
+    }
+    notePollActivity();
+    applyMouseWindowRect();
+    m_consoleInput->writePipeInput(m_pipe->peekData(), size);
+    m_pipe->discard(size);
+    {
+        LockGuard<Mutex> lock(m_mutex);
+        m_bytesRead = m_pipe->bytesRead();
+        m_bytesWritten =
+            m_bytesRead - m_consoleInput->pendingInputBytes();
+        m_recordsWritten = m_consoleInput->recordsWritten();
+        m_inputActivity = true;
+        m_sharedLoopStats = loopStats();
+        m_pipeWakeups = m_pipe->wakeups();
+    }
+    // The console will probably echo the input, so the main loop should
+    // scrape soon.
+    m_mainLoop.wake();
+}
+
+void InputThread::onPollTimeout()
+{
+    if (InterlockedExchange(&m_inputFlagsStale, 0) != 0) {
+        m_consoleInput->invalidateInputFlags();
+    }
+    m_consoleInput->refreshInputFlags();
+    const bool terminalMouse = m_consoleInput->shouldActivateTerminalMouse();
+    applyMouseWindowRect();
+    m_consoleInput->flushIncompleteEscapeCode();
+    if (m_consoleInput->hasHeldInput()) {
+        m_consoleInput->drainHeldInput();
+        onPipeIo(*m_pipe);
+        if (m_consoleInput->hasHeldInput()) {
+            requestPoll(kHeldInputPollMs);
+        }
+    }
+    {
+        LockGuard<Mutex> lock(m_mutex);
+        m_terminalMouse = terminalMouse;
+        m_bytesWritten =
+            m_bytesRead - m_consoleInput->pendingInputBytes();
+        m_recordsWritten = m_consoleInput->recordsWritten();
+        m_sharedLoopStats = loopStats();
+        m_pipeWakeups = m_pipe->wakeups();
+    }
+}
+
+void InputThread::onWake()
+{
+    if (m_stopRequested) {
+        shutdown();
+    }
+    if (m_inputFlagsStale != 0) {
+        requestPoll();
+    }
+}
+
+// Only the main thread writes to CONOUT, so pass the request along.
+void InputThread::sendDsr()
+{
+    {
+        LockGuard<Mutex> lock(m_mutex);
+        m_dsrRequested = true;
+    }
+    m_mainLoop.wake();
+}
@@ -0,0 +1,111 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_INPUT_THREAD_H
+#define AGENT_INPUT_THREAD_H
+
+#include <windows.h>
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "DsrSender.h"
+#include "EventLoop.h"
+#include "SmallRect.h"
+#include "../shared/LatencyHistogram.h"
+#include "../shared/Mutex.h"
+#include "../shared/OwnedHandle.h"
+
+class ConsoleInput;
+class NamedPipe;
+class Win32Console;
+
+// Services the CONIN pipe and the ConsoleInput pipeline on its own thread and
+// event loop, so that keystrokes reach the console even while the agent's
+// main thread is scraping.  The main thread only talks to it through the
+// public methods, which are thread-safe.
+class InputThread : public EventLoop, public DsrSender
+{
+public:
+    InputThread(EventLoop &mainLoop,
+                const std::wstring &pipeName,
+                int pipeBufferSize,
+                HANDLE conin,
+                int mouseMode,
+                Win32Console &console);
+    ~InputThread();
+    const std::wstring &pipeName() const { return m_pipeName; }
+    void setMouseWindowRect(const SmallRect &rect);
+    bool shouldActivateTerminalMouse();
+    // Makes the thread re-read the console input mode soon.
+    void invalidateInputFlags();
+    // Each returns whether the event happened since the last call.  The main
+    // loop checks them when it's woken.
+    bool takeDsrRequest();
+    bool takeInputActivity();
+    uint64_t bytesRead();
+    // The bytes read, less those ConsoleInput is holding back.
+    uint64_t bytesWritten();
+    uint64_t recordsWritten();
+    // Safe to read from any thread.
+    const LatencyHistogram &inputLatency();
+    // The CPU cycles the thread has used.  All of its work is input.
+    uint64_t cpuCycles();
+    // The thread's event loop counters, and the wakeups its CONIN pipe
+    // caused, as of its last input or poll.
+    EventLoopStats sharedLoopStats();
+    uint64_t pipeWakeups();
+
+protected:
+    void onPollTimeout() override;
+    void onPipeIo(NamedPipe &namedPipe) override;
+    void onWake() override;
+    void sendDsr() override;
+
+private:
+    static DWORD WINAPI threadProc(LPVOID param);
+    void applyMouseWindowRect();
+
+private:
+    EventLoop &m_mainLoop;
+    const std::wstring m_pipeName;
+    NamedPipe *m_pipe = nullptr;
+    std::unique_ptr<ConsoleInput> m_consoleInput;
+    OwnedHandle m_thread;
+    volatile LONG m_stopRequested = 0;
+    volatile LONG m_inputFlagsStale = 0;
+
+    // State shared with the main thread.
+    Mutex m_mutex;
+    bool m_mouseRectChanged = false;
+    SmallRect m_mouseWindowRect;
+    bool m_terminalMouse = false;
+    bool m_dsrRequested = false;
+    bool m_inputActivity = false;
+    uint64_t m_bytesRead = 0;
+    uint64_t m_bytesWritten = 0;
+    uint64_t m_recordsWritten = 0;
+    EventLoopStats m_sharedLoopStats;
+    uint64_t m_pipeWakeups = 0;
+};
+
+#endif // AGENT_INPUT_THREAD_H
@@ -22,17 +22,157 @@
 
 #include <stdlib.h>
 
+#include <algorithm>
+
 #include "../shared/WindowsVersion.h"
+#include "CharInfoKernels.h"
+#include "ConsoleBuffer.h"
 #include "Scraper.h"
-#include "Win32ConsoleBuffer.h"
 
 LargeConsoleReadBuffer::LargeConsoleReadBuffer() :
-    m_rect(0, 0, 0, 0), m_rectWidth(0)
+    m_rect(0, 0, 0, 0), m_rectWidth(0), m_prevRect(0, 0, 0, 0)
+{
+}
+
+void LargeConsoleReadBuffer::setSnapshotMode(bool enable)
 {
+    if (enable == m_snapshotMode) {
+        return;
+    }
+    m_snapshotMode = enable;
+    // Each mode sizes its buffer differently.
+    releaseMemory();
+}
+
+void LargeConsoleReadBuffer::releaseMemory()
+{
+    m_rect = SmallRect(0, 0, 0, 0);
+    m_rectWidth = 0;
+    m_frameCapacity = 0;
+    m_frameOffset = 0;
+    m_prevOffset = 0;
+    discardPreviousFrame();
+    m_dropCurrentFrame = false;
+    std::vector<CHAR_INFO>().swap(m_data);
+    m_recentMaxCount = 0;
+    m_readsSinceCheck = 0;
+}
+
+// Make room for a frame of `count` cells at m_frameOffset.  In snapshot mode,
+// the current frame becomes the previous frame first.
+void LargeConsoleReadBuffer::prepareFrame(size_t count)
+{
+    if (!m_snapshotMode) {
+        if (m_data.size() < count) {
+            m_data.resize(count);
+            m_recentMaxCount = count;
+            m_readsSinceCheck = 0;
+            return;
+        }
+        // A spike (e.g. a full read of the scrollback) shouldn't pin its
+        // buffer for the life of the agent.  Outside snapshot mode, nothing
+        // is kept between reads, so the buffer can be replaced freely.
+        m_recentMaxCount = std::max(m_recentMaxCount, count);
+        if (++m_readsSinceCheck >= kShrinkCheckReads) {
+            if (m_data.size() > kShrinkMinCells &&
+                    m_recentMaxCount * 4 <= m_data.size()) {
+                std::vector<CHAR_INFO>(m_recentMaxCount * 2).swap(m_data);
+            }
+            m_recentMaxCount = 0;
+            m_readsSinceCheck = 0;
+        }
+        return;
+    }
+    if (m_dropCurrentFrame) {
+        // Overwrite the current frame in place.
+        m_dropCurrentFrame = false;
+    } else {
+        m_prevRect = m_rect;
+        m_prevRectWidth = m_rectWidth;
+        m_prevOffset = m_frameOffset;
+        m_frameOffset = m_frameOffset == 0 ? m_frameCapacity : 0;
+    }
+    if (count > m_frameCapacity) {
+        // Grow the slab, moving the previous frame to the first slot.
+        const size_t prevCount = m_prevRectWidth * m_prevRect.height();
+        std::vector<CHAR_INFO> data(count * 2);
+        std::copy(m_data.begin() + m_prevOffset,
+                  m_data.begin() + m_prevOffset + prevCount,
+                  data.begin());
+        m_data.swap(data);
+        m_frameCapacity = count;
+        m_prevOffset = 0;
+        m_frameOffset = count;
+    }
+}
+
+namespace {
+
+// Before Windows 8, ReadConsoleOutputW fails if the console can't allocate a
+// buffer for the whole read, and the limit depends on the console's heap.  A
+// read of MAX_CONSOLE_WIDTH cells has always worked, so chunked reads start
+// there.  Until a larger read fails, the chunk size doubles whenever a read
+// needs more chunks than that; after a failure, it stays at the last size
+// that worked.  A later failure (e.g. when the heap is fragmented) halves it
+// again and retries the chunk.
+struct ChunkedReadLimit {
+    int maxCells = MAX_CONSOLE_WIDTH;
+    bool probing = true;
+};
+
+ChunkedReadLimit g_readLimit;
+
+} // anonymous namespace
+
+// Reads readArea into data, which has room for it.
+static void readIntoFrame(ConsoleBuffer &buffer, const SmallRect &readArea,
+                          CHAR_INFO *data)
+{
+    static const bool useLargeReads = isAtLeastWindows8();
+    if (useLargeReads) {
+        buffer.read(readArea, data);
+        return;
+    }
+    ChunkedReadLimit &limit = g_readLimit;
+    const int width = readArea.width();
+    int curLine = readArea.Top;
+    while (curLine <= readArea.Bottom) {
+        const int remaining = readArea.Bottom + 1 - curLine;
+        int lines = std::max(1, limit.maxCells / width);
+        bool probe = false;
+        if (limit.probing && lines < remaining) {
+            lines = std::min(remaining, std::max(1, limit.maxCells * 2 / width));
+            probe = true;
+        }
+        const SmallRect subReadArea(
+            readArea.Left, curLine, width, std::min(lines, remaining));
+        if (!buffer.read(subReadArea,
+                         data + (curLine - readArea.Top) * width)) {
+            if (probe) {
+                limit.probing = false;
+                TRACE_CAT(Scrape,
+                          "Chunked console reads: limit is %d cells",
+                          limit.maxCells);
+                continue;
+            }
+            if (limit.maxCells > MAX_CONSOLE_WIDTH) {
+                limit.maxCells = std::max(MAX_CONSOLE_WIDTH,
+                                          limit.maxCells / 2);
+                TRACE_CAT(Scrape,
+                          "Chunked console reads: read failed, limit "
+                          "lowered to %d cells", limit.maxCells);
+                continue;
+            }
+        } else if (probe) {
+            limit.maxCells = std::max(limit.maxCells,
+                                      subReadArea.height() * width);
+        }
+        curLine = subReadArea.Bottom + 1;
+    }
 }
 
 void largeConsoleRead(LargeConsoleReadBuffer &out,
-                      Win32ConsoleBuffer &buffer,
+                      ConsoleBuffer &buffer,
                       const SmallRect &readArea,
                       WORD attributesMask) {
     ASSERT(readArea.Left >= 0 &&
@@ -41,31 +181,103 @@ void largeConsoleRead(LargeConsoleReadBuffer &out,
            readArea.Bottom >= readArea.Top &&
            readArea.width() <= MAX_CONSOLE_WIDTH);
     const size_t count = readArea.width() * readArea.height();
-    if (out.m_data.size() < count) {
-        out.m_data.resize(count);
-    }
+    out.prepareFrame(count);
+    out.m_cellsRead += count;
     out.m_rect = readArea;
     out.m_rectWidth = readArea.width();
 
-    static const bool useLargeReads = isAtLeastWindows8();
-    if (useLargeReads) {
-        buffer.read(readArea, out.m_data.data());
-    } else {
-        const int maxReadLines = std::max(1, MAX_CONSOLE_WIDTH / readArea.width());
-        int curLine = readArea.Top;
-        while (curLine <= readArea.Bottom) {
-            const SmallRect subReadArea(
-                readArea.Left,
-                curLine,
-                readArea.width(),
-                std::min(maxReadLines, readArea.Bottom + 1 - curLine));
-            buffer.read(subReadArea, out.lineDataMut(curLine));
-            curLine = subReadArea.Bottom + 1;
-        }
+    readIntoFrame(buffer, readArea, &out.m_data[out.m_frameOffset]);
+    if (attributesMask != static_cast<WORD>(~0)) {
+        maskCharInfoAttributes(&out.m_data[out.m_frameOffset], count,
+                               attributesMask);
+    }
+}
+
+// Like largeConsoleRead, but reads only the first readColumns columns of
+// readArea from the console, and sets the other columns to `fill`, e.g.
+// when the caller knows they're blank.
+void largeConsoleReadColumns(LargeConsoleReadBuffer &out,
+                             ConsoleBuffer &buffer,
+                             const SmallRect &readArea,
+                             WORD attributesMask,
+                             int readColumns,
+                             const CHAR_INFO &fill) {
+    const int width = readArea.width();
+    if (readColumns >= width) {
+        largeConsoleRead(out, buffer, readArea, attributesMask);
+        return;
     }
+    ASSERT(readColumns >= 1 &&
+           readArea.Left >= 0 &&
+           readArea.Top >= 0 &&
+           readArea.Bottom >= readArea.Top &&
+           width <= MAX_CONSOLE_WIDTH);
+    const int height = readArea.height();
+    const size_t count = width * height;
+    out.prepareFrame(count);
+    out.m_cellsRead += readColumns * height;
+    out.m_rect = readArea;
+    out.m_rectWidth = width;
+
+    // Read the narrow rows packed together, then spread them out to the full
+    // width, last row first, so no row is overwritten before it moves.  Only
+    // the cells read need masking; the fill is masked once.
+    CHAR_INFO *const data = &out.m_data[out.m_frameOffset];
+    readIntoFrame(buffer,
+                  SmallRect(readArea.Left, readArea.Top, readColumns, height),
+                  data);
+    CHAR_INFO maskedFill = fill;
     if (attributesMask != static_cast<WORD>(~0)) {
-        for (size_t i = 0; i < count; ++i) {
-            out.m_data[i].Attributes &= attributesMask;
+        maskCharInfoAttributes(data, readColumns * height, attributesMask);
+        maskedFill.Attributes &= attributesMask;
+    }
+    for (int row = height - 1; row >= 0; --row) {
+        CHAR_INFO *const dst = data + row * width;
+        if (row > 0) {
+            std::copy_backward(data + row * readColumns,
+                               data + (row + 1) * readColumns,
+                               dst + readColumns);
         }
+        std::fill(dst + readColumns, dst + width, maskedFill);
+    }
+}
+
+// In snapshot mode, reads a new frame of the same area as the last one, but
+// only reads the rows [firstRow, stopRow) from the console.  The other rows
+// are copied from the last frame, so they must not have changed.  Returns
+// false, without reading anything, if the last frame covered a different
+// area.
+bool largeConsoleReadRows(LargeConsoleReadBuffer &out,
+                          ConsoleBuffer &buffer,
+                          const SmallRect &readArea,
+                          int firstRow, int stopRow,
+                          WORD attributesMask) {
+    if (!out.m_snapshotMode || out.m_rectWidth == 0 ||
+            out.m_rect != readArea) {
+        return false;
+    }
+    firstRow = std::max<int>(firstRow, readArea.Top);
+    stopRow = std::min<int>(stopRow, readArea.Bottom + 1);
+    const int width = readArea.width();
+    const size_t count = width * readArea.height();
+    const bool inPlace = out.m_dropCurrentFrame;
+    out.prepareFrame(count);
+    if (!inPlace) {
+        std::copy(out.m_data.begin() + out.m_prevOffset,
+                  out.m_data.begin() + out.m_prevOffset + count,
+                  out.m_data.begin() + out.m_frameOffset);
+    }
+    if (firstRow >= stopRow) {
+        return true;
+    }
+    const SmallRect rowArea(readArea.Left, firstRow, width,
+                            stopRow - firstRow);
+    CHAR_INFO *const rows = out.lineDataMut(firstRow);
+    const size_t rowCount = width * rowArea.height();
+    out.m_cellsRead += rowCount;
+    readIntoFrame(buffer, rowArea, rows);
+    if (attributesMask != static_cast<WORD>(~0)) {
+        maskCharInfoAttributes(rows, rowCount, attributesMask);
     }
+    return true;
 }
@@ -22,6 +22,7 @@
 #define LARGE_CONSOLE_READ_H
 
 #include <windows.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <vector>
@@ -30,39 +31,97 @@
 #include "../shared/DebugClient.h"
 #include "../shared/WinptyAssert.h"
 
-class Win32ConsoleBuffer;
+class ConsoleBuffer;
 
+// Holds the result of a largeConsoleRead call.  In snapshot mode, the buffer
+// also keeps the frame from the previous read, in the same allocation, so the
+// caller can diff the two frames without keeping its own copy of each line.
 class LargeConsoleReadBuffer {
 public:
     LargeConsoleReadBuffer();
     const SmallRect &rect() const { return m_rect; }
     const CHAR_INFO *lineData(int line) const {
         validateLineNumber(line);
-        return &m_data[(line - m_rect.Top) * m_rectWidth];
+        return &m_data[m_frameOffset + (line - m_rect.Top) * m_rectWidth];
+    }
+
+    void setSnapshotMode(bool enable);
+    // Frees the cells, forgetting the current and previous frames.
+    void releaseMemory();
+    void discardPreviousFrame() { m_prevRectWidth = 0; }
+    // The caller didn't send the current frame, so the next read replaces it
+    // and keeps diffing against the previous frame.
+    void dropCurrentFrame() { m_dropCurrentFrame = true; }
+    const SmallRect &previousRect() const { return m_prevRect; }
+    // The total number of cells read into this buffer.
+    uint64_t cellsRead() const { return m_cellsRead; }
+    size_t heapBytes() const { return m_data.capacity() * sizeof(CHAR_INFO); }
+
+    // Returns the given line of the previous frame, or nullptr if the
+    // previous read didn't cover exactly the same columns and that line.
+    const CHAR_INFO *previousLineData(int line, int left, int width) const {
+        if (m_prevRectWidth == 0 ||
+                m_prevRect.Left != left || m_prevRectWidth != width ||
+                line < m_prevRect.Top || line > m_prevRect.Bottom) {
+            return nullptr;
+        }
+        return &m_data[m_prevOffset + (line - m_prevRect.Top) * m_prevRectWidth];
     }
 
 private:
     CHAR_INFO *lineDataMut(int line) {
         validateLineNumber(line);
-        return &m_data[(line - m_rect.Top) * m_rectWidth];
+        return &m_data[m_frameOffset + (line - m_rect.Top) * m_rectWidth];
     }
 
     void validateLineNumber(int line) const {
         if (line < m_rect.Top || line > m_rect.Bottom) {
             trace("Fatal error: LargeConsoleReadBuffer: invalid line %d for "
                   "read rect %s", line, m_rect.toString().c_str());
+            traceFlush();
             abort();
         }
     }
 
+    void prepareFrame(size_t count);
+
     SmallRect m_rect;
     int m_rectWidth;
     std::vector<CHAR_INFO> m_data;
 
+    // In snapshot mode, m_data holds two frames of m_frameCapacity cells, and
+    // the current and previous frames swap places on each read.
+    bool m_snapshotMode = false;
+    size_t m_frameCapacity = 0;
+    size_t m_frameOffset = 0;
+    size_t m_prevOffset = 0;
+    SmallRect m_prevRect;
+    int m_prevRectWidth = 0;
+    bool m_dropCurrentFrame = false;
+    uint64_t m_cellsRead = 0;
+
+    // Outside snapshot mode, the buffer shrinks once the reads over a
+    // stretch of kShrinkCheckReads reads need a quarter of it or less.
+    static const size_t kShrinkCheckReads = 64;
+    static const size_t kShrinkMinCells = 64 * 1024;
+    size_t m_recentMaxCount = 0;
+    size_t m_readsSinceCheck = 0;
+
     friend void largeConsoleRead(LargeConsoleReadBuffer &out,
-                                 Win32ConsoleBuffer &buffer,
+                                 ConsoleBuffer &buffer,
                                  const SmallRect &readArea,
                                  WORD attributesMask);
+    friend void largeConsoleReadColumns(LargeConsoleReadBuffer &out,
+                                        ConsoleBuffer &buffer,
+                                        const SmallRect &readArea,
+                                        WORD attributesMask,
+                                        int readColumns,
+                                        const CHAR_INFO &fill);
+    friend bool largeConsoleReadRows(LargeConsoleReadBuffer &out,
+                                     ConsoleBuffer &buffer,
+                                     const SmallRect &readArea,
+                                     int firstRow, int stopRow,
+                                     WORD attributesMask);
 };
 
 #endif // LARGE_CONSOLE_READ_H
@@ -0,0 +1,174 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "MemoryConsoleBuffer.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "ConsoleFrameFile.h"
+
+namespace {
+
+CHAR_INFO blankCell(WORD attributes) {
+    CHAR_INFO ret = {};
+    ret.Char.UnicodeChar = L' ';
+    ret.Attributes = attributes;
+    return ret;
+}
+
+} // anonymous namespace
+
+MemoryConsoleBuffer::MemoryConsoleBuffer() : m_largestWindow(0x7fff, 0x7fff)
+{
+    m_info.wAttributes = kDefaultAttributes;
+    resizeBufferRange(Coord(80, 25));
+    moveWindow(SmallRect(0, 0, 80, 25));
+}
+
+void MemoryConsoleBuffer::clearRect(const SmallRect &rect) {
+    const int first = std::max<int>(0, rect.Top);
+    const int last = std::min<int>(m_info.dwSize.Y, rect.Bottom + 1);
+    const int left = std::max<int>(0, rect.Left);
+    const int right = std::min<int>(m_info.dwSize.X, rect.Right + 1);
+    if (left >= right) {
+        return;
+    }
+    for (int row = first; row < last; ++row) {
+        std::fill(line(row) + left, line(row) + right,
+                  blankCell(kDefaultAttributes));
+    }
+}
+
+bool MemoryConsoleBuffer::resizeBufferRange(const Coord &initialSize,
+                                            Coord &finalSize) {
+    if (initialSize.X < 1 || initialSize.Y < 1) {
+        return false;
+    }
+    const Coord oldSize = m_info.dwSize;
+    if (oldSize == initialSize) {
+        finalSize = initialSize;
+        return true;
+    }
+    std::vector<CHAR_INFO> cells(initialSize.X * initialSize.Y,
+                                 blankCell(m_info.wAttributes));
+    const int copyWidth = std::min(oldSize.X, initialSize.X);
+    const int copyRows = std::min(oldSize.Y, initialSize.Y);
+    for (int y = 0; y < copyRows; ++y) {
+        memcpy(&cells[y * initialSize.X], line(y),
+               copyWidth * sizeof(CHAR_INFO));
+    }
+    m_cells.swap(cells);
+    m_info.dwSize = initialSize;
+
+    // Keep the window and cursor inside the buffer.  The real console
+    // refuses to shrink the buffer below the window instead.
+    moveWindow(m_info.srWindow);
+    setCursorPosition(m_info.dwCursorPosition);
+    finalSize = initialSize;
+    return true;
+}
+
+void MemoryConsoleBuffer::moveWindow(const SmallRect &rect) {
+    const Coord size = m_info.dwSize;
+    const SHORT width = std::max<SHORT>(1, std::min(rect.width(), size.X));
+    const SHORT height = std::max<SHORT>(1, std::min(rect.height(), size.Y));
+    const SHORT left = std::max<SHORT>(0, std::min<SHORT>(rect.Left,
+                                                          size.X - width));
+    const SHORT top = std::max<SHORT>(0, std::min<SHORT>(rect.Top,
+                                                         size.Y - height));
+    m_info.srWindow = SmallRect(left, top, width, height);
+    m_info.dwMaximumWindowSize = Coord(width, height);
+}
+
+void MemoryConsoleBuffer::setCursorPosition(const Coord &point) {
+    m_info.dwCursorPosition = Coord(
+        std::max<SHORT>(0, std::min<SHORT>(point.X, m_info.dwSize.X - 1)),
+        std::max<SHORT>(0, std::min<SHORT>(point.Y, m_info.dwSize.Y - 1)));
+}
+
+bool MemoryConsoleBuffer::read(const SmallRect &rect, CHAR_INFO *data) {
+    const CHAR_INFO blank = blankCell(kDefaultAttributes);
+    for (int y = rect.Top; y <= rect.Bottom; ++y) {
+        for (int x = rect.Left; x <= rect.Right; ++x) {
+            *data++ = (y < m_info.dwSize.Y && x < m_info.dwSize.X)
+                ? line(y)[x] : blank;
+        }
+    }
+    return true;
+}
+
+void MemoryConsoleBuffer::write(const SmallRect &rect, const CHAR_INFO *data) {
+    for (int y = rect.Top; y <= rect.Bottom; ++y) {
+        for (int x = rect.Left; x <= rect.Right; ++x, ++data) {
+            if (y >= 0 && y < m_info.dwSize.Y && x >= 0 && x < m_info.dwSize.X) {
+                line(y)[x] = *data;
+            }
+        }
+    }
+}
+
+void MemoryConsoleBuffer::writeText(const wchar_t *text, size_t length) {
+    COORD &cursor = m_info.dwCursorPosition;
+    for (size_t i = 0; i < length; ++i) {
+        const wchar_t ch = text[i];
+        if (ch == L'\r') {
+            cursor.X = 0;
+        } else if (ch == L'\n') {
+            cursor.X = 0;
+            lineFeed();
+        } else {
+            CHAR_INFO &cell = line(cursor.Y)[cursor.X];
+            cell.Char.UnicodeChar = ch;
+            cell.Attributes = m_info.wAttributes;
+            if (++cursor.X == m_info.dwSize.X) {
+                cursor.X = 0;
+                lineFeed();
+            }
+        }
+    }
+}
+
+void MemoryConsoleBuffer::lineFeed() {
+    COORD &cursor = m_info.dwCursorPosition;
+    SMALL_RECT &window = m_info.srWindow;
+    if (cursor.Y + 1 < m_info.dwSize.Y) {
+        cursor.Y++;
+    } else {
+        // The buffer is full, so its content scrolls up by a line.
+        const int width = m_info.dwSize.X;
+        memmove(line(0), line(1),
+                (m_info.dwSize.Y - 1) * width * sizeof(CHAR_INFO));
+        std::fill(line(cursor.Y), line(cursor.Y) + width,
+                  blankCell(m_info.wAttributes));
+    }
+    if (cursor.Y > window.Bottom) {
+        const SHORT delta = cursor.Y - window.Bottom;
+        window.Top += delta;
+        window.Bottom += delta;
+    }
+}
+
+void MemoryConsoleBuffer::applyFrame(const ConsoleFrame &frame) {
+    resizeBufferRange(frame.info.dwSize);
+    m_info = frame.info;
+    write(frame.rect, frame.cells.data());
+}
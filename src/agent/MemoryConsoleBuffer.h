@@ -0,0 +1,80 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_MEMORY_CONSOLE_BUFFER_H
+#define AGENT_MEMORY_CONSOLE_BUFFER_H
+
+#include <windows.h>
+
+#include <vector>
+
+#include "ConsoleBuffer.h"
+#include "Coord.h"
+#include "SmallRect.h"
+
+struct ConsoleFrame;
+
+// A console screen buffer held in memory.  It behaves enough like conhost
+// for the scraper: the window follows the cursor down, and once the cursor
+// reaches the bottom of the buffer, the whole buffer scrolls up.  Content
+// comes either from the console-like write calls below or from recorded
+// frames.
+class MemoryConsoleBuffer : public ConsoleBuffer {
+public:
+    MemoryConsoleBuffer();
+
+    virtual void clearRect(const SmallRect &rect) override;
+    virtual ConsoleScreenBufferInfo bufferInfo() override { return m_info; }
+    using ConsoleBuffer::resizeBufferRange;
+    virtual bool resizeBufferRange(const Coord &initialSize,
+                                   Coord &finalSize) override;
+    virtual void moveWindow(const SmallRect &rect) override;
+    virtual Coord largestWindowSize() override { return m_largestWindow; }
+    virtual void setSmallFont(int columns, bool isNewW10) override {}
+    virtual DWORD outputMode() override { return m_outputMode; }
+    virtual void setCursorPosition(const Coord &point) override;
+    virtual bool read(const SmallRect &rect, CHAR_INFO *data) override;
+    virtual void write(const SmallRect &rect, const CHAR_INFO *data) override;
+    virtual void setTextAttribute(WORD attributes) override {
+        m_info.wAttributes = attributes;
+    }
+
+    void setOutputMode(DWORD mode) { m_outputMode = mode; }
+
+    // Writes text at the cursor in the current attributes, like WriteConsoleW
+    // with processed output: '\r' and '\n' move the cursor, and long lines
+    // wrap.
+    void writeText(const wchar_t *text, size_t length);
+
+    // Replaces the buffer geometry, cursor, and the frame's cells with the
+    // recorded ones.
+    void applyFrame(const ConsoleFrame &frame);
+
+private:
+    CHAR_INFO *line(int row) { return &m_cells[row * m_info.dwSize.X]; }
+    void lineFeed();
+
+    ConsoleScreenBufferInfo m_info;
+    std::vector<CHAR_INFO> m_cells;
+    Coord m_largestWindow;
+    DWORD m_outputMode = 0;
+};
+
+#endif // AGENT_MEMORY_CONSOLE_BUFFER_H
@@ -22,6 +22,7 @@
 
 #include <algorithm>
 
+#include "EtwTrace.h"
 #include "EventLoop.h"
 #include "NamedPipe.h"
 #include "../shared/DebugClient.h"
@@ -36,6 +37,10 @@ bool NamedPipe::serviceIo(std::vector<HANDLE> *waitHandles)
     const auto kError = ServiceResult::Error;
     const auto kProgress = ServiceResult::Progress;
     const auto kNoProgress = ServiceResult::NoProgress;
+    compressPendingOutput();
+    if (m_ring) {
+        return serviceRing(waitHandles);
+    }
     if (m_handle == NULL) {
         return false;
     }
@@ -56,7 +61,7 @@ bool NamedPipe::serviceIo(std::vector<HANDLE> *waitHandles)
                 "Pended ConnectNamedPipe call failed");
             waitHandles->push_back(m_connectEvent.get());
         } else {
-            TRACE("Server pipe [%s] connected",
+            TRACE_CAT(Pipe, "Server pipe [%s] connected",
                 utf8FromWide(m_name).c_str());
             m_connectEvent.dispose();
             startPipeWorkers();
@@ -69,11 +74,11 @@ bool NamedPipe::serviceIo(std::vector<HANDLE> *waitHandles)
         closePipe();
         return true;
     }
-    if (m_inputWorker && m_inputWorker->getWaitEvent() != nullptr) {
-        waitHandles->push_back(m_inputWorker->getWaitEvent());
+    if (m_inputWorker) {
+        m_inputWorker->addWaitEvents(waitHandles);
     }
-    if (m_outputWorker && m_outputWorker->getWaitEvent() != nullptr) {
-        waitHandles->push_back(m_outputWorker->getWaitEvent());
+    if (m_outputWorker) {
+        m_outputWorker->addWaitEvents(waitHandles);
     }
     return justConnected
         || readProgress == kProgress
@@ -87,59 +92,96 @@ static OwnedHandle createEvent() {
     return OwnedHandle(ret);
 }
 
-NamedPipe::IoWorker::IoWorker(NamedPipe &namedPipe) :
-    m_namedPipe(namedPipe),
-    m_event(createEvent())
+NamedPipe::IoWorker::IoWorker(NamedPipe &namedPipe, int depth) :
+    m_namedPipe(namedPipe)
 {
+    resizeSlots(depth, kIoSize);
+}
+
+// The slots' OVERLAPPED structures must not move while their I/O is pending,
+// so this requires an idle worker.
+void NamedPipe::IoWorker::resizeSlots(int depth, DWORD ioSize)
+{
+    ASSERT(depth >= 1 && m_pendingCount == 0);
+    const bool newBuffers = ioSize != m_ioSize;
+    m_slots.resize(depth);
+    m_head = 0;
+    m_ioSize = ioSize;
+    for (Slot &slot : m_slots) {
+        if (slot.event.get() == nullptr) {
+            slot.event = createEvent();
+        }
+        if (newBuffers || slot.buffer == nullptr) {
+            slot.buffer.reset(new char[ioSize]);
+        }
+    }
 }
 
 NamedPipe::ServiceResult NamedPipe::IoWorker::service()
 {
     ServiceResult progress = ServiceResult::NoProgress;
-    if (m_pending) {
-        DWORD actual = 0;
-        BOOL ret = GetOverlappedResult(m_namedPipe.m_handle, &m_over, &actual, FALSE);
-        if (!ret) {
-            if (GetLastError() == ERROR_IO_INCOMPLETE) {
-                // There is a pending I/O.
-                return progress;
-            } else {
-                // Pipe error.
-                return ServiceResult::Error;
+    while (true) {
+        // Retire finished I/Os, oldest first, so that data is delivered in
+        // order.
+        while (m_pendingCount > 0) {
+            Slot &slot = m_slots[m_head];
+            DWORD actual = 0;
+            BOOL ret = GetOverlappedResult(m_namedPipe.m_handle, &slot.over,
+                                           &actual, FALSE);
+            if (!ret) {
+                if (GetLastError() == ERROR_IO_INCOMPLETE) {
+                    // There is a pending I/O.
+                    break;
+                } else {
+                    // Pipe error.
+                    return ServiceResult::Error;
+                }
             }
+            ResetEvent(slot.event.get());
+            completeIo(slot, actual);
+            slot.size = 0;
+            m_head = (m_head + 1) % m_slots.size();
+            --m_pendingCount;
+            progress = ServiceResult::Progress;
         }
-        ResetEvent(m_event.get());
-        m_pending = false;
-        completeIo(actual);
-        m_currentIoSize = 0;
-        progress = ServiceResult::Progress;
-    }
-    DWORD nextSize = 0;
-    bool isRead = false;
-    while (shouldIssueIo(&nextSize, &isRead)) {
-        m_currentIoSize = nextSize;
-        DWORD actual = 0;
-        memset(&m_over, 0, sizeof(m_over));
-        m_over.hEvent = m_event.get();
-        BOOL ret = isRead
-                ? ReadFile(m_namedPipe.m_handle, m_buffer, nextSize, &actual, &m_over)
-                : WriteFile(m_namedPipe.m_handle, m_buffer, nextSize, &actual, &m_over);
-        if (!ret) {
-            if (GetLastError() == ERROR_IO_PENDING) {
-                // There is a pending I/O.
-                m_pending = true;
-                return progress;
-            } else {
+        beforeIssue();
+
+        // Fill the free slots.  An I/O that completes immediately is retired
+        // by the loop above, on the next pass.
+        bool completedImmediately = false;
+        while (m_pendingCount < m_slots.size()) {
+            Slot &slot =
+                m_slots[(m_head + m_pendingCount) % m_slots.size()];
+            if (slot.buffer == nullptr) {
+                slot.buffer.reset(new char[m_ioSize]);
+            }
+            DWORD nextSize = 0;
+            bool isRead = false;
+            if (!shouldIssueIo(slot.buffer.get(), &nextSize, &isRead)) {
+                break;
+            }
+            slot.size = nextSize;
+            DWORD actual = 0;
+            memset(&slot.over, 0, sizeof(slot.over));
+            slot.over.hEvent = slot.event.get();
+            BOOL ret = isRead
+                    ? ReadFile(m_namedPipe.m_handle, slot.buffer.get(),
+                               nextSize, &actual, &slot.over)
+                    : WriteFile(m_namedPipe.m_handle, slot.buffer.get(),
+                                nextSize, &actual, &slot.over);
+            if (!ret && GetLastError() != ERROR_IO_PENDING) {
                 // Pipe error.
                 return ServiceResult::Error;
             }
+            ++m_pendingCount;
+            if (ret) {
+                completedImmediately = true;
+            }
+        }
+        if (!completedImmediately) {
+            return progress;
         }
-        ResetEvent(m_event.get());
-        completeIo(actual);
-        m_currentIoSize = 0;
-        progress = ServiceResult::Progress;
     }
-    return progress;
 }
 
 // This function is called after CancelIo has returned.  We need to block until
@@ -147,50 +189,70 @@ NamedPipe::ServiceResult NamedPipe::IoWorker::service()
 // https://blogs.msdn.microsoft.com/oldnewthing/20110202-00/?p=11613
 void NamedPipe::IoWorker::waitForCanceledIo()
 {
-    if (m_pending) {
+    while (m_pendingCount > 0) {
         DWORD actual = 0;
-        GetOverlappedResult(m_namedPipe.m_handle, &m_over, &actual, TRUE);
-        m_pending = false;
+        GetOverlappedResult(m_namedPipe.m_handle, &m_slots[m_head].over,
+                            &actual, TRUE);
+        m_head = (m_head + 1) % m_slots.size();
+        --m_pendingCount;
     }
 }
 
-HANDLE NamedPipe::IoWorker::getWaitEvent()
+// The slots with I/O in flight keep their buffers.
+void NamedPipe::IoWorker::releaseIdleBuffers()
 {
-    return m_pending ? m_event.get() : NULL;
+    for (size_t i = m_pendingCount; i < m_slots.size(); ++i) {
+        m_slots[(m_head + i) % m_slots.size()].buffer.reset();
+    }
 }
 
-void NamedPipe::InputWorker::completeIo(DWORD size)
+// The oldest pending I/O is the one that must finish next, so it's the only
+// one worth waiting on.
+void NamedPipe::IoWorker::addWaitEvents(std::vector<HANDLE> *waitHandles)
 {
-    m_namedPipe.m_inQueue.append(m_buffer, size);
+    if (m_pendingCount > 0) {
+        waitHandles->push_back(m_slots[m_head].event.get());
+    }
 }
 
-bool NamedPipe::InputWorker::shouldIssueIo(DWORD *size, bool *isRead)
+void NamedPipe::InputWorker::completeIo(const Slot &slot, DWORD size)
+{
+    m_namedPipe.m_inQueue.append(slot.buffer.get(), size);
+    m_namedPipe.m_bytesRead += size;
+    ETW_EVENT("PipeRead", {"bytes", size});
+}
+
+bool NamedPipe::InputWorker::shouldIssueIo(char *buffer, DWORD *size,
+                                           bool *isRead)
 {
     *isRead = true;
     ASSERT(!m_namedPipe.isConnecting());
     if (m_namedPipe.isClosed()) {
         return false;
     } else if (m_namedPipe.m_inQueue.size() < m_namedPipe.readBufferSize()) {
-        *size = kIoSize;
+        *size = m_ioSize;
         return true;
     } else {
         return false;
     }
 }
 
-void NamedPipe::OutputWorker::completeIo(DWORD size)
+void NamedPipe::OutputWorker::completeIo(const Slot &slot, DWORD size)
 {
-    ASSERT(size == m_currentIoSize);
+    ASSERT(size == slot.size);
+    m_namedPipe.m_bytesWritten += size;
+    ETW_EVENT("PipeWrite", {"bytes", size});
 }
 
-bool NamedPipe::OutputWorker::shouldIssueIo(DWORD *size, bool *isRead)
+bool NamedPipe::OutputWorker::shouldIssueIo(char *buffer, DWORD *size,
+                                            bool *isRead)
 {
     *isRead = false;
-    if (!m_namedPipe.m_outQueue.empty()) {
+    if (!m_namedPipe.m_outQueue.empty() && m_namedPipe.shouldSendOutput()) {
         auto &out = m_namedPipe.m_outQueue;
-        const DWORD writeSize = std::min<size_t>(out.size(), kIoSize);
-        std::copy(&out[0], &out[writeSize], m_buffer);
-        out.erase(0, writeSize);
+        const DWORD writeSize = std::min<size_t>(out.size(), m_ioSize);
+        memcpy(buffer, out.data(), writeSize);
+        out.consume(writeSize);
         *size = writeSize;
         return true;
     } else {
@@ -198,9 +260,45 @@ bool NamedPipe::OutputWorker::shouldIssueIo(DWORD *size, bool *isRead)
     }
 }
 
+// With auto-grow, count the passes that find every write still in flight
+// and at least another full write queued.  Once that has persisted for
+// kBacklogPasses passes, double the depth and the write size, the next time
+// the worker is idle.  The worker never shrinks; a pipe that fell behind once
+// is likely to again.
+void NamedPipe::OutputWorker::beforeIssue()
+{
+    if (!m_autoGrow) {
+        return;
+    }
+    const size_t queued = m_namedPipe.m_outQueue.size();
+    if (queued == 0) {
+        m_backlogPasses = 0;
+    } else if (m_pendingCount == m_slots.size() && queued >= m_ioSize) {
+        m_backlogPasses = std::min<int>(m_backlogPasses + 1, kBacklogPasses);
+    }
+    if (m_backlogPasses < kBacklogPasses || m_pendingCount != 0) {
+        return;
+    }
+    const int depth = std::min<int>(m_slots.size() * 2, kMaxAutoDepth);
+    const DWORD ioSize = std::min<DWORD>(m_ioSize * 2, kMaxAutoIoSize);
+    m_backlogPasses = 0;
+    if (depth == static_cast<int>(m_slots.size()) && ioSize == m_ioSize) {
+        m_autoGrow = false;
+        return;
+    }
+    TRACE_CAT(Pipe, "Pipe [%s] backlogged: %d writes of %u bytes",
+        utf8FromWide(m_namedPipe.m_name).c_str(), depth,
+        static_cast<unsigned>(ioSize));
+    resizeSlots(depth, ioSize);
+}
+
 DWORD NamedPipe::OutputWorker::getPendingIoSize()
 {
-    return m_pending ? m_currentIoSize : 0;
+    DWORD ret = 0;
+    for (size_t i = 0; i < m_pendingCount; ++i) {
+        ret += m_slots[(m_head + i) % m_slots.size()].size;
+    }
+    return ret;
 }
 
 void NamedPipe::openServerPipe(LPCWSTR pipeName, OpenMode::t openMode,
@@ -226,12 +324,13 @@ void NamedPipe::openServerPipe(LPCWSTR pipeName, OpenMode::t openMode,
         /*nInBufferSize=*/inBufferSize,
         /*nDefaultTimeOut=*/30000,
         &sa);
-    TRACE("opened server pipe [%s], handle == %p",
+    TRACE_CAT(Pipe, "opened server pipe [%s], handle == %p",
         utf8FromWide(pipeName).c_str(), handle);
     ASSERT(handle != INVALID_HANDLE_VALUE && "Could not open server pipe");
     m_name = pipeName;
     m_handle = handle;
     m_openMode = openMode;
+    associateWithCompletionPort();
 
     // Start an asynchronous connection attempt.
     m_connectEvent = createEvent();
@@ -243,7 +342,8 @@ void NamedPipe::openServerPipe(LPCWSTR pipeName, OpenMode::t openMode,
         success = TRUE;
     }
     if (success) {
-        TRACE("Server pipe [%s] connected", utf8FromWide(pipeName).c_str());
+        TRACE_CAT(Pipe, "Server pipe [%s] connected",
+            utf8FromWide(pipeName).c_str());
         m_connectEvent.dispose();
         startPipeWorkers();
     } else if (err != ERROR_IO_PENDING) {
@@ -263,39 +363,258 @@ void NamedPipe::connectToServer(LPCWSTR pipeName, OpenMode::t openMode)
         OPEN_EXISTING,
         SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION | FILE_FLAG_OVERLAPPED,
         NULL);
-    TRACE("connected to [%s], handle == %p",
+    TRACE_CAT(Pipe, "connected to [%s], handle == %p",
         utf8FromWide(pipeName).c_str(), handle);
     ASSERT(handle != INVALID_HANDLE_VALUE && "Could not connect to pipe");
     m_name = pipeName;
     m_handle = handle;
     m_openMode = openMode;
+    associateWithCompletionPort();
     startPipeWorkers();
 }
 
+// Route the pipe's I/O completions to the EventLoop's port, if it has one.
+// This must happen before any I/O is issued on the handle.
+void NamedPipe::associateWithCompletionPort()
+{
+    m_serviceNeeded = true;
+    if (m_completionPort == nullptr) {
+        return;
+    }
+    HANDLE ret = CreateIoCompletionPort(
+        m_handle, m_completionPort, reinterpret_cast<ULONG_PTR>(this), 0);
+    ASSERT(ret == m_completionPort && "CreateIoCompletionPort failed");
+}
+
+// Set how many overlapped reads and writes the pipe keeps in flight.  Each
+// one has its own 64KiB buffer.  Call this before opening the pipe.
+void NamedPipe::setIoDepth(int readDepth, int writeDepth)
+{
+    ASSERT(isClosed());
+    ASSERT(readDepth >= 1 && writeDepth >= 1);
+    m_readDepth = readDepth;
+    m_writeDepth = writeDepth;
+}
+
+void NamedPipe::setAutoGrowWrites(bool autoGrow)
+{
+    ASSERT(isClosed());
+    m_autoGrowWrites = autoGrow;
+}
+
 void NamedPipe::startPipeWorkers()
 {
     if (m_openMode & OpenMode::Reading) {
-        m_inputWorker.reset(new InputWorker(*this));
+        m_inputWorker.reset(new InputWorker(*this, m_readDepth));
     }
     if (m_openMode & OpenMode::Writing) {
-        m_outputWorker.reset(new OutputWorker(*this));
+        m_outputWorker.reset(
+            new OutputWorker(*this, m_writeDepth, m_autoGrowWrites));
+    }
+}
+
+void NamedPipe::openMemorySink()
+{
+    ASSERT(isClosed() && m_openMode == OpenMode::None);
+    m_openMode = OpenMode::Writing;
+}
+
+void NamedPipe::openSharedMemoryRing(std::unique_ptr<SharedMemoryRing> ring)
+{
+    // A closed output pipe can be reopened as a ring.
+    ASSERT(isClosed() && (m_openMode & OpenMode::Reading) == 0);
+    m_ring = std::move(ring);
+    m_name = m_ring->name();
+    m_openMode = OpenMode::Writing;
+    m_serviceNeeded = true;
+}
+
+// Copy queued output into the ring.  When it fills up, wait for the client
+// to free some space: via the wait handles when the EventLoop waits on
+// events, and via a thread pool wait that posts to the EventLoop's port
+// otherwise.
+bool NamedPipe::serviceRing(std::vector<HANDLE> *waitHandles)
+{
+    cancelRingWait();
+    bool progress = false;
+    while (!m_outQueue.empty()) {
+        const size_t amount =
+            m_ring->write(m_outQueue.data(), m_outQueue.size());
+        if (amount > 0) {
+            m_outQueue.consume(amount);
+            m_bytesWritten += amount;
+            progress = true;
+            continue;
+        }
+        if (!m_ring->armSpaceWait()) {
+            continue;
+        }
+        waitHandles->push_back(m_ring->spaceEvent());
+        if (m_completionPort != nullptr) {
+            const BOOL success = RegisterWaitForSingleObject(
+                &m_ringWait, m_ring->spaceEvent(), ringSpaceCallback, this,
+                INFINITE, WT_EXECUTEONLYONCE);
+            if (!success) {
+                trace("RegisterWaitForSingleObject failed: %u",
+                    static_cast<unsigned>(GetLastError()));
+                m_ringWait = nullptr;
+            }
+        }
+        break;
+    }
+    return progress;
+}
+
+VOID CALLBACK NamedPipe::ringSpaceCallback(PVOID param, BOOLEAN timedOut)
+{
+    NamedPipe &pipe = *static_cast<NamedPipe*>(param);
+    PostQueuedCompletionStatus(pipe.m_completionPort, 0,
+                               reinterpret_cast<ULONG_PTR>(&pipe), nullptr);
+}
+
+void NamedPipe::cancelRingWait()
+{
+    if (m_ringWait != nullptr) {
+        // Waits for a running callback to finish.
+        UnregisterWaitEx(m_ringWait, INVALID_HANDLE_VALUE);
+        m_ringWait = nullptr;
+    }
+}
+
+void NamedPipe::setCompressOutput()
+{
+    ASSERT(m_openMode & OpenMode::Writing);
+    m_compressor.reset(new StreamCompression::Compressor);
+}
+
+void NamedPipe::compressPendingOutput()
+{
+    if (m_compressor == nullptr || m_plainQueue.empty()) {
+        return;
+    }
+    m_compressedFrame.clear();
+    m_compressor->compress(m_plainQueue.data(), m_plainQueue.size(),
+                           m_compressedFrame);
+    m_outQueue.append(m_compressedFrame.data(), m_compressedFrame.size());
+    m_plainQueue.clear();
+}
+
+void NamedPipe::discardOutput()
+{
+    ASSERT(m_handle == nullptr && (m_openMode & OpenMode::Writing));
+    m_outQueue.clear();
+    m_plainQueue.clear();
+    if (m_compressor) {
+        // The next client starts with a fresh decompressor.
+        m_compressor.reset(new StreamCompression::Compressor);
     }
 }
 
 size_t NamedPipe::bytesToSend()
 {
     ASSERT(m_openMode & OpenMode::Writing);
-    auto ret = m_outQueue.size();
+    auto ret = m_outQueue.size() + m_plainQueue.size();
     if (m_outputWorker != NULL) {
         ret += m_outputWorker->getPendingIoSize();
     }
     return ret;
 }
 
+size_t NamedPipe::heapBytes() const
+{
+    size_t ret = m_inQueue.capacity() + m_outQueue.capacity() +
+        m_plainQueue.capacity() + m_compressedFrame.capacity();
+    if (m_inputWorker != nullptr) {
+        ret += m_inputWorker->heapBytes();
+    }
+    if (m_outputWorker != nullptr) {
+        ret += m_outputWorker->heapBytes();
+    }
+    return ret;
+}
+
+void NamedPipe::releaseIdleMemory()
+{
+    m_inQueue.releaseIfEmpty();
+    m_outQueue.releaseIfEmpty();
+    m_plainQueue.releaseIfEmpty();
+    if (m_inputWorker != nullptr) {
+        m_inputWorker->releaseIdleBuffers();
+    }
+    if (m_outputWorker != nullptr) {
+        m_outputWorker->releaseIdleBuffers();
+    }
+}
+
+void NamedPipe::setWriteCoalescing(int maxDelayUs, size_t flushBytes)
+{
+    ASSERT(maxDelayUs >= 0);
+    m_coalesceDelayUs = maxDelayUs;
+    m_coalesceBytes = flushBytes;
+}
+
+// Sends the held output on the next service, e.g. at the end of a frame.
+void NamedPipe::flushWrites()
+{
+    if (m_coalesceDelayUs > 0 && !m_outQueue.empty()) {
+        m_flushRequested = true;
+        m_serviceNeeded = true;
+    }
+}
+
+// Whether the output worker may write the queued output now.  With write
+// coalescing, output is held from when it's first queued until it's old
+// enough, big enough, or flushed.
+bool NamedPipe::shouldSendOutput()
+{
+    if (m_coalesceDelayUs == 0) {
+        return true;
+    }
+    if (!m_holdingOutput) {
+        m_holdingOutput = true;
+        m_holdTimer = TimeMeasurement();
+    }
+    if (m_flushRequested || m_outQueue.size() >= m_coalesceBytes ||
+            m_holdTimer.elapsedUs() >= m_coalesceDelayUs) {
+        // This write takes everything that fits, so the next output starts
+        // a new hold.
+        m_holdingOutput = false;
+        m_flushRequested = false;
+        return true;
+    }
+    return false;
+}
+
+// How long held output may still wait, rounded up to whole milliseconds, or
+// -1 if nothing is held.
+int NamedPipe::heldOutputDelayMs()
+{
+    if (!m_holdingOutput || m_outQueue.empty()) {
+        return -1;
+    }
+    const int64_t remainingUs = m_coalesceDelayUs - m_holdTimer.elapsedUs();
+    return std::max<int>(0, static_cast<int>((remainingUs + 999) / 1000));
+}
+
 void NamedPipe::write(const void *data, size_t size)
 {
     ASSERT(m_openMode & OpenMode::Writing);
-    m_outQueue.append(reinterpret_cast<const char*>(data), size);
+    writeQueue().append(data, size);
+    m_serviceNeeded = true;
+}
+
+// Returns space for up to `size` bytes of output, which can be filled in
+// place and then queued with commitWrite.
+char *NamedPipe::reserveWrite(size_t size)
+{
+    ASSERT(m_openMode & OpenMode::Writing);
+    return writeQueue().reserve(size);
+}
+
+void NamedPipe::commitWrite(size_t size)
+{
+    writeQueue().commit(size);
+    m_serviceNeeded = true;
 }
 
 void NamedPipe::write(const char *text)
@@ -313,6 +632,7 @@ void NamedPipe::setReadBufferSize(size_t size)
 {
     ASSERT(m_openMode & OpenMode::Reading);
     m_readBufferSize = size;
+    m_serviceNeeded = true;
 }
 
 size_t NamedPipe::bytesAvailable()
@@ -321,19 +641,34 @@ size_t NamedPipe::bytesAvailable()
     return m_inQueue.size();
 }
 
+// Returns the received data as one contiguous span of bytesAvailable()
+// bytes, which stays valid until the next call that modifies the pipe.
+const char *NamedPipe::peekData()
+{
+    ASSERT(m_openMode & OpenMode::Reading);
+    return m_inQueue.data();
+}
+
+void NamedPipe::discard(size_t size)
+{
+    ASSERT(m_openMode & OpenMode::Reading);
+    m_inQueue.consume(std::min(size, m_inQueue.size()));
+    m_serviceNeeded = true;
+}
+
 size_t NamedPipe::peek(void *data, size_t size)
 {
     ASSERT(m_openMode & OpenMode::Reading);
-    const auto out = reinterpret_cast<char*>(data);
     const size_t ret = std::min(size, m_inQueue.size());
-    std::copy(&m_inQueue[0], &m_inQueue[ret], out);
+    memcpy(data, m_inQueue.data(), ret);
     return ret;
 }
 
 size_t NamedPipe::read(void *data, size_t size)
 {
     size_t ret = peek(data, size);
-    m_inQueue.erase(0, ret);
+    m_inQueue.consume(ret);
+    m_serviceNeeded = true;
     return ret;
 }
 
@@ -341,21 +676,25 @@ std::string NamedPipe::readToString(size_t size)
 {
     ASSERT(m_openMode & OpenMode::Reading);
     size_t retSize = std::min(size, m_inQueue.size());
-    std::string ret = m_inQueue.substr(0, retSize);
-    m_inQueue.erase(0, retSize);
+    std::string ret(m_inQueue.data(), retSize);
+    m_inQueue.consume(retSize);
+    m_serviceNeeded = true;
     return ret;
 }
 
 std::string NamedPipe::readAllToString()
 {
-    ASSERT(m_openMode & OpenMode::Reading);
-    std::string ret = m_inQueue;
-    m_inQueue.clear();
-    return ret;
+    return readToString(m_inQueue.size());
 }
 
 void NamedPipe::closePipe()
 {
+    if (m_ring) {
+        cancelRingWait();
+        m_ring->close();
+        m_ring.reset();
+        return;
+    }
     if (m_handle == NULL) {
         return;
     }
@@ -22,12 +22,18 @@
 #define NAMEDPIPE_H
 
 #include <windows.h>
+#include <stdint.h>
 
 #include <memory>
 #include <string>
 #include <vector>
 
 #include "../shared/OwnedHandle.h"
+#include "../shared/SharedMemoryRing.h"
+#include "../shared/StreamCompression.h"
+#include "../shared/TimeMeasurement.h"
+
+#include "ByteQueue.h"
 
 class EventLoop;
 
@@ -40,47 +46,81 @@ private:
     ~NamedPipe() { closePipe(); }
     bool serviceIo(std::vector<HANDLE> *waitHandles);
     void startPipeWorkers();
+    void associateWithCompletionPort();
+    bool serviceRing(std::vector<HANDLE> *waitHandles);
+    void compressPendingOutput();
+    bool shouldSendOutput();
+    int heldOutputDelayMs();
+    ByteQueue &writeQueue() { return m_compressor ? m_plainQueue : m_outQueue; }
+    static VOID CALLBACK ringSpaceCallback(PVOID param, BOOLEAN timedOut);
+    void cancelRingWait();
 
     enum class ServiceResult { NoProgress, Error, Progress };
 
 private:
+    // Each worker keeps up to `depth` overlapped I/Os in flight, each with its
+    // own buffer, and retires them in the order they were issued.
     class IoWorker
     {
     public:
-        IoWorker(NamedPipe &namedPipe);
+        IoWorker(NamedPipe &namedPipe, int depth);
         virtual ~IoWorker() {}
         ServiceResult service();
         void waitForCanceledIo();
-        HANDLE getWaitEvent();
+        void addWaitEvents(std::vector<HANDLE> *waitHandles);
+        void releaseIdleBuffers();
+        size_t heapBytes() const {
+            size_t ret = m_slots.capacity() * sizeof(Slot);
+            for (const Slot &slot : m_slots) {
+                ret += slot.buffer != nullptr ? m_ioSize : 0;
+            }
+            return ret;
+        }
     protected:
-        NamedPipe &m_namedPipe;
-        bool m_pending = false;
-        DWORD m_currentIoSize = 0;
-        OwnedHandle m_event;
-        OVERLAPPED m_over = {};
         enum { kIoSize = 64 * 1024 };
-        char m_buffer[kIoSize];
-        virtual void completeIo(DWORD size) = 0;
-        virtual bool shouldIssueIo(DWORD *size, bool *isRead) = 0;
+        struct Slot {
+            OwnedHandle event;
+            OVERLAPPED over = {};
+            DWORD size = 0;
+            std::unique_ptr<char[]> buffer;
+        };
+        NamedPipe &m_namedPipe;
+        std::vector<Slot> m_slots;
+        size_t m_head = 0;          // The oldest pending slot
+        size_t m_pendingCount = 0;
+        DWORD m_ioSize = kIoSize;   // The size of each slot's buffer
+        void resizeSlots(int depth, DWORD ioSize);
+        // Called after retiring finished I/Os, before issuing new ones.
+        virtual void beforeIssue() {}
+        virtual void completeIo(const Slot &slot, DWORD size) = 0;
+        virtual bool shouldIssueIo(char *buffer, DWORD *size, bool *isRead) = 0;
     };
 
     class InputWorker : public IoWorker
     {
     public:
-        InputWorker(NamedPipe &namedPipe) : IoWorker(namedPipe) {}
+        InputWorker(NamedPipe &namedPipe, int depth) :
+            IoWorker(namedPipe, depth) {}
     protected:
-        virtual void completeIo(DWORD size) override;
-        virtual bool shouldIssueIo(DWORD *size, bool *isRead) override;
+        virtual void completeIo(const Slot &slot, DWORD size) override;
+        virtual bool shouldIssueIo(char *buffer, DWORD *size, bool *isRead) override;
     };
 
     class OutputWorker : public IoWorker
     {
     public:
-        OutputWorker(NamedPipe &namedPipe) : IoWorker(namedPipe) {}
+        OutputWorker(NamedPipe &namedPipe, int depth, bool autoGrow) :
+            IoWorker(namedPipe, depth), m_autoGrow(autoGrow) {}
         DWORD getPendingIoSize();
     protected:
-        virtual void completeIo(DWORD size) override;
-        virtual bool shouldIssueIo(DWORD *size, bool *isRead) override;
+        virtual void beforeIssue() override;
+        virtual void completeIo(const Slot &slot, DWORD size) override;
+        virtual bool shouldIssueIo(char *buffer, DWORD *size, bool *isRead) override;
+    private:
+        enum { kMaxAutoDepth = 16, kMaxAutoIoSize = 256 * 1024 };
+        enum { kBacklogPasses = 4 };
+        bool m_autoGrow = false;
+        int m_backlogPasses = 0;
     };
 
 public:
@@ -93,33 +133,94 @@ public:
     void openServerPipe(LPCWSTR pipeName, OpenMode::t openMode,
                         int outBufferSize, int inBufferSize);
     void connectToServer(LPCWSTR pipeName, OpenMode::t openMode);
+    // Makes this a write-only pipe with no handle.  Written data stays queued
+    // until discardOutput, so a Terminal can run without a client.
+    void openMemorySink();
+    void discardOutput();
+    // Makes this a write-only pipe that delivers its output through a shared
+    // memory ring instead of a pipe handle.  It's "connected" once the
+    // client attaches to the ring.
+    void openSharedMemoryRing(std::unique_ptr<SharedMemoryRing> ring);
+    void setIoDepth(int readDepth, int writeDepth);
+    // While the output backlog persists, issue more and larger writes than
+    // setIoDepth asked for.
+    void setAutoGrowWrites(bool autoGrow);
+    // Sends the output as StreamCompression frames.  A frame holds the output
+    // written between two EventLoop passes, so frames end at scrape
+    // boundaries.  discardOutput starts a new compressed stream.
+    void setCompressOutput();
+    // Holds small writes for up to maxDelayUs microseconds, so that several
+    // of them go out as one WriteFile, unless flushBytes are queued first
+    // or flushWrites is called.  A maxDelayUs of 0 disables the policy.
+    void setWriteCoalescing(int maxDelayUs, size_t flushBytes);
+    void flushWrites();
+    bool compressesOutput() const { return m_compressor != nullptr; }
     size_t bytesToSend();
     void write(const void *data, size_t size);
     void write(const char *text);
+    char *reserveWrite(size_t size);
+    void commitWrite(size_t size);
     size_t readBufferSize();
     void setReadBufferSize(size_t size);
     size_t bytesAvailable();
+    const char *peekData();
+    void discard(size_t size);
     size_t peek(void *data, size_t size);
     size_t read(void *data, size_t size);
     std::string readToString(size_t size);
     std::string readAllToString();
+    // Bytes transferred through the pipe since it was opened.
+    uint64_t bytesRead() const { return m_bytesRead; }
+    uint64_t bytesWritten() const { return m_bytesWritten; }
+    // The event loop wakeups this pipe's I/O caused.  See EventLoopStats.
+    uint64_t wakeups() const { return m_wakeups; }
+    // The heap memory held by the queues and the I/O buffers.
+    size_t heapBytes() const;
+    // Frees the empty queues and the buffers of the idle I/O slots, e.g.
+    // while the session is idle.  They're reallocated when next needed.
+    void releaseIdleMemory();
     void closePipe();
-    bool isClosed() { return m_handle == nullptr; }
+    bool isClosed() { return m_handle == nullptr && m_ring == nullptr; }
+    bool usesSharedMemoryRing() const { return m_ring != nullptr; }
     bool isConnected() { return !isClosed() && !isConnecting(); }
-    bool isConnecting() { return m_connectEvent.get() != nullptr; }
+    bool isConnecting() {
+        return m_connectEvent.get() != nullptr ||
+            (m_ring != nullptr && !m_ring->consumerAttached());
+    }
 
 private:
     // Input/output buffers
     std::wstring m_name;
+    HANDLE m_completionPort = nullptr;
+    bool m_serviceNeeded = true;
     OVERLAPPED m_connectOver = {};
     OwnedHandle m_connectEvent;
     OpenMode::t m_openMode = OpenMode::None;
     size_t m_readBufferSize = 64 * 1024;
-    std::string m_inQueue;
-    std::string m_outQueue;
+    int m_readDepth = 1;
+    int m_writeDepth = 1;
+    bool m_autoGrowWrites = false;
+    ByteQueue m_inQueue;
+    ByteQueue m_outQueue;
+    // With compression, writes land in m_plainQueue and are compressed into
+    // m_outQueue when the pipe is serviced.
+    std::unique_ptr<StreamCompression::Compressor> m_compressor;
+    ByteQueue m_plainQueue;
+    std::string m_compressedFrame;
+    // Write coalescing.
+    int m_coalesceDelayUs = 0;
+    size_t m_coalesceBytes = 0;
+    bool m_holdingOutput = false;
+    bool m_flushRequested = false;
+    TimeMeasurement m_holdTimer;
+    uint64_t m_bytesRead = 0;
+    uint64_t m_bytesWritten = 0;
+    uint64_t m_wakeups = 0;
     HANDLE m_handle = nullptr;
     std::unique_ptr<InputWorker> m_inputWorker;
     std::unique_ptr<OutputWorker> m_outputWorker;
+    std::unique_ptr<SharedMemoryRing> m_ring;
+    HANDLE m_ringWait = nullptr;
 };
 
 #endif // NAMEDPIPE_H
@@ -0,0 +1,182 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "PseudoConsole.h"
+
+#include <vector>
+
+#include "../shared/DebugClient.h"
+#include "../shared/OsModule.h"
+#include "../shared/OwnedHandle.h"
+#include "../shared/WinptyAssert.h"
+
+namespace {
+
+// These definitions are missing from older SDKs, and with _WIN32_WINNT set
+// for XP, from the newer ones too.
+typedef void *HPCON_t;
+typedef void *ProcThreadAttributeList_t;
+const DWORD_PTR kProcThreadAttributePseudoConsole = 0x00020016;
+const DWORD kExtendedStartupInfoPresent = 0x00080000;
+
+struct StartupInfoEx_t {
+    STARTUPINFOW StartupInfo;
+    ProcThreadAttributeList_t lpAttributeList;
+};
+
+typedef HRESULT WINAPI CreatePseudoConsole_t(
+    COORD size, HANDLE hInput, HANDLE hOutput, DWORD dwFlags, HPCON_t *phPC);
+typedef HRESULT WINAPI ResizePseudoConsole_t(HPCON_t hPC, COORD size);
+typedef VOID WINAPI ClosePseudoConsole_t(HPCON_t hPC);
+typedef BOOL WINAPI InitializeProcThreadAttributeList_t(
+    ProcThreadAttributeList_t lpAttributeList, DWORD dwAttributeCount,
+    DWORD dwFlags, SIZE_T *lpSize);
+typedef BOOL WINAPI UpdateProcThreadAttribute_t(
+    ProcThreadAttributeList_t lpAttributeList, DWORD dwFlags,
+    DWORD_PTR Attribute, PVOID lpValue, SIZE_T cbSize,
+    PVOID lpPreviousValue, SIZE_T *lpReturnSize);
+typedef VOID WINAPI DeleteProcThreadAttributeList_t(
+    ProcThreadAttributeList_t lpAttributeList);
+
+COORD toCoord(Coord size) {
+    COORD ret;
+    ret.X = size.X;
+    ret.Y = size.Y;
+    return ret;
+}
+
+} // anonymous namespace
+
+#define GET_KERNEL32_PROC(name) \
+    p ## name = reinterpret_cast<name ## _t*>(kernel32.proc(#name))
+
+struct PseudoConsole::Api {
+    Api() : kernel32(L"kernel32.dll") {
+        GET_KERNEL32_PROC(CreatePseudoConsole);
+        GET_KERNEL32_PROC(ResizePseudoConsole);
+        GET_KERNEL32_PROC(ClosePseudoConsole);
+        GET_KERNEL32_PROC(InitializeProcThreadAttributeList);
+        GET_KERNEL32_PROC(UpdateProcThreadAttribute);
+        GET_KERNEL32_PROC(DeleteProcThreadAttributeList);
+    }
+    bool valid() const {
+        return pCreatePseudoConsole != nullptr &&
+            pResizePseudoConsole != nullptr &&
+            pClosePseudoConsole != nullptr &&
+            pInitializeProcThreadAttributeList != nullptr &&
+            pUpdateProcThreadAttribute != nullptr &&
+            pDeleteProcThreadAttributeList != nullptr;
+    }
+    OsModule kernel32;
+    CreatePseudoConsole_t *pCreatePseudoConsole;
+    ResizePseudoConsole_t *pResizePseudoConsole;
+    ClosePseudoConsole_t *pClosePseudoConsole;
+    InitializeProcThreadAttributeList_t *pInitializeProcThreadAttributeList;
+    UpdateProcThreadAttribute_t *pUpdateProcThreadAttribute;
+    DeleteProcThreadAttributeList_t *pDeleteProcThreadAttributeList;
+};
+
+#undef GET_KERNEL32_PROC
+
+std::unique_ptr<PseudoConsole> PseudoConsole::create(Coord size,
+                                                     LPCWSTR inputPipeName,
+                                                     LPCWSTR outputPipeName)
+{
+    std::unique_ptr<Api> api(new Api);
+    if (!api->valid()) {
+        trace("CreatePseudoConsole is unavailable");
+        return nullptr;
+    }
+    OwnedHandle input(CreateFileW(inputPipeName, GENERIC_READ, 0, nullptr,
+                                  OPEN_EXISTING, 0, nullptr));
+    OwnedHandle output(CreateFileW(outputPipeName, GENERIC_WRITE, 0, nullptr,
+                                   OPEN_EXISTING, 0, nullptr));
+    if (input.get() == INVALID_HANDLE_VALUE ||
+            output.get() == INVALID_HANDLE_VALUE) {
+        trace("Error opening the pseudoconsole pipes: %u",
+              static_cast<unsigned>(GetLastError()));
+        return nullptr;
+    }
+    HPCON_t hpc = nullptr;
+    const HRESULT hr = api->pCreatePseudoConsole(
+        toCoord(size), input.get(), output.get(), 0, &hpc);
+    if (FAILED(hr)) {
+        trace("CreatePseudoConsole failed: 0x%08x",
+              static_cast<unsigned>(hr));
+        return nullptr;
+    }
+    // The pseudoconsole keeps its own copies of the pipe handles.
+    return std::unique_ptr<PseudoConsole>(
+        new PseudoConsole(std::move(api), hpc, size));
+}
+
+PseudoConsole::PseudoConsole(std::unique_ptr<Api> api, void *hpc,
+                             Coord size) :
+    m_api(std::move(api)), m_hpc(hpc), m_size(size)
+{
+}
+
+PseudoConsole::~PseudoConsole()
+{
+    m_api->pClosePseudoConsole(m_hpc);
+}
+
+void PseudoConsole::resize(Coord size)
+{
+    m_size = size;
+    const HRESULT hr = m_api->pResizePseudoConsole(m_hpc, toCoord(size));
+    if (FAILED(hr)) {
+        trace("ResizePseudoConsole failed: 0x%08x",
+              static_cast<unsigned>(hr));
+    }
+}
+
+BOOL PseudoConsole::createProcess(LPCWSTR program, LPWSTR cmdline,
+                                  LPCWSTR cwd, LPWSTR env, LPWSTR desktop,
+                                  PROCESS_INFORMATION &pi)
+{
+    SIZE_T attrListSize = 0;
+    m_api->pInitializeProcThreadAttributeList(nullptr, 1, 0, &attrListSize);
+    std::vector<char> attrListBuffer(attrListSize);
+    const ProcThreadAttributeList_t attrList = attrListBuffer.data();
+    if (!m_api->pInitializeProcThreadAttributeList(
+            attrList, 1, 0, &attrListSize)) {
+        return FALSE;
+    }
+    BOOL success = m_api->pUpdateProcThreadAttribute(
+        attrList, 0, kProcThreadAttributePseudoConsole,
+        m_hpc, sizeof(m_hpc), nullptr, nullptr);
+    if (success) {
+        StartupInfoEx_t sui = {};
+        sui.StartupInfo.cb = sizeof(sui);
+        sui.StartupInfo.lpDesktop = desktop;
+        sui.lpAttributeList = attrList;
+        success = CreateProcessW(program, cmdline, nullptr, nullptr,
+                                 /*bInheritHandles=*/FALSE,
+                                 /*dwCreationFlags=*/
+                                     CREATE_UNICODE_ENVIRONMENT |
+                                     kExtendedStartupInfoPresent,
+                                 env, cwd, &sui.StartupInfo, &pi);
+    }
+    const DWORD lastError = GetLastError();
+    m_api->pDeleteProcThreadAttributeList(attrList);
+    SetLastError(lastError);
+    return success;
+}
@@ -0,0 +1,59 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_PSEUDO_CONSOLE_H
+#define AGENT_PSEUDO_CONSOLE_H
+
+#include <windows.h>
+
+#include <memory>
+
+#include "Coord.h"
+
+// A Windows 10 pseudoconsole (CreatePseudoConsole).  The OS renders the
+// console of each process started in it as VT output, so the agent only
+// forwards bytes: terminal input goes to the pseudoconsole's input pipe, and
+// its output pipe feeds CONOUT.  The kernel32 APIs are looked up at runtime,
+// because the agent also runs on versions of Windows that lack them.
+class PseudoConsole {
+public:
+    // Creates a pseudoconsole that reads input from the named pipe
+    // inputPipeName and writes output to the named pipe outputPipeName.  The
+    // server ends of both pipes must already be listening.  Returns nullptr
+    // if the API is unavailable or fails.
+    static std::unique_ptr<PseudoConsole> create(Coord size,
+                                                 LPCWSTR inputPipeName,
+                                                 LPCWSTR outputPipeName);
+    ~PseudoConsole();
+    void resize(Coord size);
+    Coord size() const { return m_size; }
+    // CreateProcessW, with the new process attached to this pseudoconsole.
+    BOOL createProcess(LPCWSTR program, LPWSTR cmdline, LPCWSTR cwd,
+                       LPWSTR env, LPWSTR desktop, PROCESS_INFORMATION &pi);
+
+private:
+    struct Api;
+    PseudoConsole(std::unique_ptr<Api> api, void *hpc, Coord size);
+    std::unique_ptr<Api> m_api;
+    void *m_hpc = nullptr;
+    Coord m_size;
+};
+
+#endif // AGENT_PSEUDO_CONSOLE_H
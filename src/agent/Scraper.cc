@@ -23,16 +23,22 @@
 #include <windows.h>
 
 #include <stdint.h>
+#include <string.h>
 
 #include <algorithm>
 #include <utility>
 
+#include "../include/winpty_constants.h"
+
+#include "../shared/DebugClient.h"
+#include "../shared/TimeMeasurement.h"
 #include "../shared/WinptyAssert.h"
 #include "../shared/winpty_snprintf.h"
 
-#include "ConsoleFont.h"
+#include "ConsoleBuffer.h"
+#include "ConsoleFrameRecorder.h"
+#include "EtwTrace.h"
 #include "Win32Console.h"
-#include "Win32ConsoleBuffer.h"
 
 namespace {
 
@@ -42,24 +48,79 @@ T constrained(T min, T val, T max) {
     return std::min(std::max(min, val), max);
 }
 
+// Fingerprint scroll detection needs at least this many lines agreeing on
+// the scroll amount, and the winner must have at least twice as many votes
+// as any other amount.
+const int kMinScrollVotes = 3;
+
+// After this many consecutive failed unfrozen scrapes, the scraper freezes
+// up front for the next 2^N - 1 scrapes.
+const int kMaxOptimisticBackoffShift = 6;
+
+// The incremental read path trusts the console event hook to report every
+// changed row.  Do a full scrape at least this often anyway.
+const DWORD kFullScrapeIntervalMs = 200;
+
+// Scrolling-mode reads skip the columns right of the text, which are known
+// to be blank, and read this many columns past it.  Text that shows up in
+// that margin widens the read at once.  The whole width is read at least
+// this often anyway, and whenever the cursor or a console event is beyond
+// the margin, and when skipping would save fewer columns than the margin.
+const int kReadColumnMargin = 32;
+const DWORD kFullWidthReadIntervalMs = 250;
+
 } // anonymous namespace
 
 Scraper::Scraper(
         Win32Console &console,
-        Win32ConsoleBuffer &buffer,
+        ConsoleBuffer &buffer,
         std::unique_ptr<Terminal> terminal,
-        Coord initialSize) :
+        Coord initialSize,
+        const ScrapeGeometry &geometry,
+        int64_t *startupTimesUs) :
     m_console(console),
     m_terminal(std::move(terminal)),
+    m_bufferLineCount(geometry.bufferLineCount),
+    m_syncMarkerMargin(geometry.syncMarkerMargin),
+    m_maxWidth(geometry.maxWidth),
     m_ptySize(initialSize)
 {
+    ASSERT(m_bufferLineCount <= MAX_BUFFER_LINE_COUNT &&
+           m_syncMarkerMargin >= 0 &&
+           m_bufferLineCount >= SYNC_MARKER_LEN + m_syncMarkerMargin + 2 &&
+           m_maxWidth >= 1 && m_maxWidth <= MAX_CONSOLE_WIDTH);
     m_consoleBuffer = &buffer;
+    m_fingerprintScroll = !hasDebugFlag("sync_marker_scroll");
+    m_scrollRegionOutput = !hasDebugFlag("no_scroll_region");
+    m_plannedResize = !hasDebugFlag("no_planned_resize");
+    m_trimClears = !hasDebugFlag("no_trim_clear");
+    m_frameRecorder = ConsoleFrameRecorder::createIfEnabled();
 
     resetConsoleTracking(Terminal::OmitClear, buffer.windowRect().top());
 
-    m_bufferData.resize(BUFFER_LINE_COUNT);
+    m_bufferData.resize(m_bufferLineCount);
+    m_syncColumn.resize(m_bufferLineCount);
+
+    initBufferGeometry(buffer, initialSize, startupTimesUs);
+
+    // For the sake of the color translation heuristic, set the console color
+    // to LtGray-on-Black.
+    buffer.setTextAttribute(ConsoleBuffer::kDefaultAttributes);
+    buffer.clearAllLines(m_consoleBuffer->bufferInfo());
 
-    // Setup the initial screen buffer and window size.
+    m_consoleBuffer = nullptr;
+}
+
+Scraper::~Scraper()
+{
+}
+
+// Sizes a screen buffer that has nothing in it yet: at startup, and on a
+// resize while the scraper is dormant.
+void Scraper::initBufferGeometry(ConsoleBuffer &buffer, Coord size,
+                                 int64_t *startupTimesUs)
+{
+    // Setup the screen buffer and window size from scratch.
     //
     // Use SetConsoleWindowInfo to shrink the console window as much as
     // possible -- to a 1x1 cell at the top-left.  This call always succeeds.
@@ -71,63 +132,440 @@ Scraper::Scraper(
     // While the small font intends to support large buffers, a user could
     // still hit a limit imposed by their monitor width, so cap the new window
     // size to GetLargestConsoleWindowSize().
-    setSmallFont(buffer.conout(), initialSize.X, m_console.isNewW10());
+    TimeMeasurement timer;
+    buffer.setSmallFont(size.X, m_console.isNewW10());
+    m_smallFontColumns = size.X;
+    const int64_t fontUs = timer.lapUs();
     buffer.moveWindow(SmallRect(0, 0, 1, 1));
-    buffer.resizeBufferRange(Coord(initialSize.X, BUFFER_LINE_COUNT));
-    const auto largest = GetLargestConsoleWindowSize(buffer.conout());
+    buffer.resizeBufferRange(Coord(size.X, m_bufferLineCount));
+    const auto largest = buffer.largestWindowSize();
+    m_largestWindowSize = largest;
     buffer.moveWindow(SmallRect(
         0, 0,
-        std::min(initialSize.X, largest.X),
-        std::min(initialSize.Y, largest.Y)));
+        std::min(size.X, largest.X),
+        std::min(size.Y, largest.Y)));
     buffer.setCursorPosition(Coord(0, 0));
-
-    // For the sake of the color translation heuristic, set the console color
-    // to LtGray-on-Black.
-    buffer.setTextAttribute(Win32ConsoleBuffer::kDefaultAttributes);
-    buffer.clearAllLines(m_consoleBuffer->bufferInfo());
-
-    m_consoleBuffer = nullptr;
-}
-
-Scraper::~Scraper()
-{
+    const int64_t resizeUs = timer.lapUs();
+    if (startupTimesUs != nullptr) {
+        startupTimesUs[WINPTY_STARTUP_AGENT_SET_FONT] += fontUs;
+        startupTimesUs[WINPTY_STARTUP_AGENT_RESIZE_BUFFER] += resizeUs;
+    }
 }
 
 // Whether or not the agent is frozen on entry, it will be frozen on exit.
-void Scraper::resizeWindow(Win32ConsoleBuffer &buffer,
+void Scraper::resizeWindow(ConsoleBuffer &buffer,
                            Coord newSize,
                            ConsoleScreenBufferInfo &finalInfoOut)
 {
+    ETW_EVENT("Resize", {"cols", newSize.X}, {"rows", newSize.Y});
     m_consoleBuffer = &buffer;
     m_ptySize = newSize;
+    if (m_dormant) {
+        m_console.setFrozen(true);
+        const ConsoleScreenBufferInfo info = buffer.bufferInfo();
+        if (!changedSinceDormant(info)) {
+            // The buffer is still blank, so size it the way the constructor
+            // did, without reading it or repainting the terminal.
+            initBufferGeometry(buffer, newSize, nullptr);
+            m_dormantInfo = buffer.bufferInfo();
+            finalInfoOut = m_dormantInfo;
+            m_consoleBuffer = nullptr;
+            return;
+        }
+        wake(info);
+    }
     syncConsoleContentAndSize(true, finalInfoOut);
     m_consoleBuffer = nullptr;
 }
 
+// Until the buffer leaves the state it's in now, skip reading it: scrapes
+// compare only its cursor and geometry, and the sync marker column isn't
+// allocated.  For the CONERR buffer, which many programs never write.
+void Scraper::startDormant(ConsoleBuffer &buffer)
+{
+    ASSERT(!m_deferOutput);
+    m_dormant = true;
+    m_dormantInfo = buffer.bufferInfo();
+    std::vector<CHAR_INFO>().swap(m_syncColumn);
+}
+
+// Writing text moves the cursor, and scrolling moves the window; a program
+// that resizes the buffer changes its size.  Anything that writes cells
+// without touching any of them goes unnoticed until one of them changes.
+bool Scraper::changedSinceDormant(const ConsoleScreenBufferInfo &info)
+{
+    return info.cursorPosition() != m_dormantInfo.cursorPosition() ||
+        info.windowRect() != m_dormantInfo.windowRect() ||
+        info.bufferSize() != m_dormantInfo.bufferSize();
+}
+
+void Scraper::wake(const ConsoleScreenBufferInfo &info)
+{
+    TRACE_CAT(Scrape, "Dormant buffer changed; starting to scrape it");
+    m_dormant = false;
+    m_syncColumn.resize(m_bufferLineCount);
+    resetConsoleTracking(Terminal::OmitClear, info.windowRect().top());
+}
+
+// Supply the console changes seen since the last scrape.  The next
+// scrapeBuffer call may use them to read only the changed rows.
+void Scraper::setDirtyRegionHint(const ConsoleEventHook::DirtyRegion &dirty)
+{
+    m_dirtyHint = dirty;
+    m_hasDirtyHint = true;
+}
+
+// The window is read with the same attribute mask as a scrape, but into the
+// caller's buffer, because the incremental read paths expect m_readBuffer to
+// hold the previous scrape.  This function may freeze the agent, but it will
+// not unfreeze it.
+void Scraper::readWindow(ConsoleBuffer &buffer,
+                         LargeConsoleReadBuffer &out,
+                         ConsoleScreenBufferInfo &infoOut,
+                         bool &cursorVisibleOut)
+{
+    m_consoleBuffer = &buffer;
+    m_console.setFrozen(true);
+    infoOut = buffer.bufferInfo();
+    cursorVisibleOut = m_console.probe().cursorVisible();
+    largeConsoleRead(out, buffer, infoOut.windowRect(), attributesMask());
+    m_consoleBuffer = nullptr;
+}
+
 // This function may freeze the agent, but it will not unfreeze it.
-void Scraper::scrapeBuffer(Win32ConsoleBuffer &buffer,
+void Scraper::scrapeBuffer(ConsoleBuffer &buffer,
                            ConsoleScreenBufferInfo &finalInfoOut)
 {
+    captureBuffer(buffer, finalInfoOut);
+    flushOutput();
+}
+
+// The capture half of scrapeBuffer: everything that touches the console.
+// It reads the console into m_readBuffer and updates the scrolling state, but
+// leaves the line diffing and escape encoding for flushOutput, which doesn't
+// need the console frozen.  This function may freeze the agent, but it will
+// not unfreeze it.
+void Scraper::captureBuffer(ConsoleBuffer &buffer,
+                            ConsoleScreenBufferInfo &finalInfoOut)
+{
+    ASSERT(!m_deferOutput);
+    if (m_dormant) {
+        const ConsoleScreenBufferInfo info = buffer.bufferInfo();
+        if (!changedSinceDormant(info)) {
+            // Nothing has been written, so there is nothing to read or send.
+            m_hasDirtyHint = false;
+            finalInfoOut = info;
+            return;
+        }
+        wake(info);
+    }
+    m_linesBeforeScrape = m_terminal->sendLineCount();
+    m_capturedInputWritten = m_inputWritten;
+    ETW_EVENT("ScrapeBegin");
     m_consoleBuffer = &buffer;
+    m_deferOutput = true;
     syncConsoleContentAndSize(false, finalInfoOut);
     m_consoleBuffer = nullptr;
 }
 
-void Scraper::resetConsoleTracking(
-    Terminal::SendClearFlag sendClear, int64_t scrapedLineCount)
+// Encodes and queues the terminal output for the last captureBuffer call.
+// With a byte budget, a capture that scrolled many lines is encoded in
+// slices: this returns false once a slice has queued about byteBudget bytes,
+// and the caller calls it again, e.g. after servicing the pipes, to encode
+// the rest.  Each slice is its own terminal frame.  The capture stays valid
+// in between, because nothing reads the console until the flush finishes.
+// Returns true once everything is queued (or nothing was pending).
+bool Scraper::flushOutput(size_t byteBudget)
+{
+    if (!m_deferOutput) {
+        return true;
+    }
+    if (!emitPendingOutput(byteBudget)) {
+        m_terminal->endFrame();
+        m_terminal->beginFrame();
+        return false;
+    }
+    m_deferOutput = false;
+    endTerminalFrame();
+    if (g_etwEnabled) {
+        const SmallRect &rect = m_readBuffer.rect();
+        ETW_EVENT("ScrapeEnd",
+            {"left", rect.Left}, {"top", rect.Top},
+            {"right", rect.Right}, {"bottom", rect.Bottom},
+            {"linesSent", static_cast<int64_t>(
+                m_terminal->sendLineCount() - m_linesBeforeScrape)});
+    }
+    return true;
+}
+
+// Sends the lines a scrape left pending, and ends the terminal frame.
+void Scraper::finishOutputFrame()
+{
+    emitPendingOutput();
+    endTerminalFrame();
+}
+
+// A capture's frame reflects the input written before it, unless its repaint
+// was put off.
+void Scraper::endTerminalFrame()
+{
+    if (!m_frameDeferred) {
+        m_terminal->sendInputAck(m_capturedInputWritten);
+    }
+    m_terminal->endFrame();
+}
+
+// Returns false if the byte budget ran out before the output was complete;
+// the rest stays pending.
+bool Scraper::emitPendingOutput(size_t byteBudget)
+{
+    const PendingOutput::Kind kind = m_pendingOutput.kind;
+    if (kind == PendingOutput::Kind::None) {
+        return true;
+    }
+    PendingOutput &p = m_pendingOutput;
+    if (p.sliceLine != -1) {
+        // Resume a sliced scrolling frame.
+        if (!emitScrollingSlice(byteBudget)) {
+            return false;
+        }
+        finishPendingOutput(p.deferred);
+        return true;
+    }
+    p.kind = PendingOutput::Kind::None;
+    // A cursor movement is cheap enough to send immediately.
+    const bool defer = p.mayDefer && kind != PendingOutput::Kind::Cursor &&
+        shouldDeferFrame();
+    if (kind == PendingOutput::Kind::Cursor) {
+        if (m_holdFrames) {
+            // The window repaint after the hold positions the cursor.
+            m_frameDeferred = true;
+            return true;
+        }
+        emitCursorOutput(p.info, p.cursorVisible);
+    } else if (kind == PendingOutput::Kind::Direct) {
+        if (defer) {
+            // The next frame is diffed against the last one sent.
+            m_readBuffer.dropCurrentFrame();
+        } else {
+            emitDirectOutput(p.info, p.cursorVisible, p.scrapeRect);
+        }
+    } else if (kind == PendingOutput::Kind::Scrolling) {
+        bool send = true;
+        if (defer) {
+            // Send only the lines that scrolled above the window.  They
+            // won't change again, and the buffer may discard them before the
+            // next scrape.  The window lines are still unsent, so the next
+            // scrape must read them all.
+            const int64_t windowVirtLine =
+                p.info.windowRect().top() + m_scrolledCount;
+            send = p.firstVirtLine < windowVirtLine;
+            p.stopVirtLine = std::min(p.stopVirtLine, windowVirtLine);
+            p.cursorVisible = false;
+            m_incrementalReady = false;
+        }
+        if (send) {
+            p.kind = kind;
+            p.deferred = defer;
+            p.sliceLine = p.firstVirtLine;
+            p.sawModifiedLine = false;
+            if (!emitScrollingSlice(byteBudget)) {
+                return false;
+            }
+        }
+    }
+    finishPendingOutput(defer);
+    return true;
+}
+
+void Scraper::finishPendingOutput(bool deferred)
+{
+    m_pendingOutput.kind = PendingOutput::Kind::None;
+    m_pendingOutput.sliceLine = -1;
+    m_frameDeferred = deferred;
+    if (!deferred) {
+        m_lastFrameTick = GetTickCount();
+    }
+}
+
+// Sends the next slice of the pending scrolling output.  The terminal cursor
+// is hidden before the first slice and positioned after the last.  Returns
+// false if lines remain.
+bool Scraper::emitScrollingSlice(size_t byteBudget)
+{
+    PendingOutput &p = m_pendingOutput;
+    const Coord cursor = p.info.cursorPosition();
+    const bool showTerminalCursor =
+        p.cursorVisible && p.info.windowRect().contains(cursor);
+    const int64_t cursorLine =
+        !showTerminalCursor ? -1 : cursor.Y + m_scrolledCount;
+    const int cursorColumn = !showTerminalCursor ? -1 : cursor.X;
+    if (!showTerminalCursor && p.sliceLine == p.firstVirtLine) {
+        m_terminal->hideTerminalCursor();
+    }
+    p.sliceLine = encodeScrollingLines(p.sliceLine, p.stopVirtLine,
+                                       cursorLine, cursorColumn,
+                                       p.sawModifiedLine, byteBudget);
+    if (p.sliceLine < p.stopVirtLine) {
+        return false;
+    }
+    if (showTerminalCursor) {
+        m_terminal->showTerminalCursor(cursorColumn, cursorLine);
+    }
+    return true;
+}
+
+void Scraper::setPendingOutput(PendingOutput::Kind kind,
+                               const ConsoleScreenBufferInfo &info,
+                               bool consoleCursorVisible)
+{
+    ASSERT(m_pendingOutput.kind == PendingOutput::Kind::None);
+    m_pendingOutput.kind = kind;
+    m_pendingOutput.info = info;
+    m_pendingOutput.cursorVisible = consoleCursorVisible;
+    m_pendingOutput.mayDefer = false;
+}
+
+void Scraper::releaseIdleMemory()
+{
+    if (m_deferOutput || m_frameDeferred ||
+            m_pendingOutput.kind != PendingOutput::Kind::None) {
+        return;
+    }
+    m_readBuffer.releaseMemory();
+    m_incrementalReady = false;
+    m_bufferData.releaseCells();
+    if (m_savedScrolling) {
+        m_savedScrolling->bufferData.releaseCells();
+    }
+    std::vector<std::pair<uint64_t, int>>().swap(m_rowHashIndex);
+    std::vector<int>().swap(m_scrollVotes);
+    m_terminal->releaseMemory();
+}
+
+size_t Scraper::trackingBytes() const
+{
+    return m_syncColumn.capacity() * sizeof(CHAR_INFO) +
+        m_rowHashIndex.capacity() * sizeof(m_rowHashIndex[0]) +
+        m_scrollVotes.capacity() * sizeof(int);
+}
+
+void Scraper::setMaxFrameRate(int framesPerSecond)
+{
+    ASSERT(framesPerSecond >= 0);
+    m_minFrameIntervalMs = framesPerSecond == 0 ? 0 : 1000 / framesPerSecond;
+}
+
+// Whether the frame rate cap skips this scrape's window repaint.
+bool Scraper::shouldDeferFrame()
 {
-    for (ConsoleLine &line : m_bufferData) {
-        line.reset();
+    return m_holdFrames || (m_minFrameIntervalMs > 0 &&
+        static_cast<int>(GetTickCount() - m_lastFrameTick) <
+            m_minFrameIntervalMs);
+}
+
+int Scraper::deferredFrameDelayMs()
+{
+    if (!m_frameDeferred || m_holdFrames) {
+        return -1;
     }
+    const int elapsed = GetTickCount() - m_lastFrameTick;
+    return std::max(0, m_minFrameIntervalMs - elapsed);
+}
+
+void Scraper::resetConsoleTracking(
+    Terminal::SendClearFlag sendClear, int64_t scrapedLineCount,
+    bool countResync)
+{
+    m_bufferData.resetLines();
+    m_usedColumns = -1;
     m_syncRow = -1;
+    m_lastSyncScroll = 0;
     m_scrapedLineCount = scrapedLineCount;
     m_scrolledCount = 0;
     m_maxBufferedLine = -1;
+    m_firstTrackedLine = scrapedLineCount;
     m_dirtyWindowTop = -1;
     m_dirtyLineCount = 0;
+    m_incrementalReady = false;
+    m_readBuffer.discardPreviousFrame();
+    if (sendClear == Terminal::SendClear && countResync) {
+        ++m_resyncCount;
+    }
     m_terminal->reset(sendClear, m_scrapedLineCount);
 }
 
+// Move the terminal to its alternate screen for the direct-mode buffer, if it
+// has one, keeping the scrolling-mode tracking for the return.
+void Scraper::enterDirectMode(const ConsoleScreenBufferInfo &info)
+{
+    static const bool altScreenEnabled = !hasDebugFlag("no_alt_screen");
+    m_savedScrolling.reset();
+    if (altScreenEnabled && m_terminal->enterAlternateScreen()) {
+        std::unique_ptr<ScrollingState> saved(new ScrollingState);
+        std::swap(saved->bufferData, m_bufferData);
+        m_bufferData.resize(m_bufferLineCount);
+        saved->ptySize = m_ptySize;
+        saved->usedColumns = m_usedColumns;
+        saved->syncRow = m_syncRow;
+        memcpy(saved->syncSignature, m_syncSignature,
+               sizeof(m_syncSignature));
+        saved->syncIsContent = m_syncIsContent;
+        saved->scrapedLineCount = m_scrapedLineCount;
+        saved->scrolledCount = m_scrolledCount;
+        saved->maxBufferedLine = m_maxBufferedLine;
+        saved->firstTrackedLine = m_firstTrackedLine;
+        saved->dirtyWindowTop = m_dirtyWindowTop;
+        saved->dirtyLineCount = m_dirtyLineCount;
+        m_savedScrolling = std::move(saved);
+    }
+    resetConsoleTracking(Terminal::SendClear, 0);
+}
+
+// Return to the scrolling-mode buffer.  If the terminal's main screen still
+// matches the saved tracking, pick it up again, and the next scrape diffs
+// against it like any other.  (If the console buffer changed meanwhile, the
+// sync marker search finds that out and resyncs.)  Otherwise, start over.
+void Scraper::leaveDirectMode(const ConsoleScreenBufferInfo &info)
+{
+    const bool restore = m_savedScrolling &&
+        m_terminal->inAlternateScreen() &&
+        m_savedScrolling->ptySize == m_ptySize;
+    m_terminal->leaveAlternateScreen(restore);
+    if (!restore) {
+        m_savedScrolling.reset();
+        resetConsoleTracking(Terminal::SendClear, info.windowRect().top());
+        return;
+    }
+    TRACE_CAT(Scrape, "Restoring the scrolling-mode tracking of line %lld",
+              static_cast<long long>(m_savedScrolling->scrapedLineCount));
+    std::unique_ptr<ScrollingState> saved = std::move(m_savedScrolling);
+    std::swap(saved->bufferData, m_bufferData);
+    m_usedColumns = saved->usedColumns;
+    m_syncRow = saved->syncRow;
+    memcpy(m_syncSignature, saved->syncSignature, sizeof(m_syncSignature));
+    m_syncIsContent = saved->syncIsContent;
+    m_scrapedLineCount = saved->scrapedLineCount;
+    m_scrolledCount = saved->scrolledCount;
+    m_maxBufferedLine = saved->maxBufferedLine;
+    m_firstTrackedLine = saved->firstTrackedLine;
+    m_dirtyWindowTop = saved->dirtyWindowTop;
+    m_dirtyLineCount = saved->dirtyLineCount;
+    m_incrementalReady = false;
+    m_readBuffer.discardPreviousFrame();
+}
+
+// The Terminal's output now goes to a new client, which shows nothing yet.
+// The next scrape forgets everything sent so far and repaints the whole
+// window in one frame.
+void Scraper::reattachTerminal()
+{
+    ASSERT(!m_deferOutput);
+    m_terminal->reattach();
+    m_savedScrolling.reset();
+    m_repaintPending = true;
+}
+
 // Detect window movement.  If the window moves down (presumably as a
 // result of scrolling), then assume that all screen buffer lines down to
 // the bottom of the window are dirty.
@@ -172,23 +610,150 @@ void Scraper::clearBufferLines(
     for (int row = firstRow; row < firstRow + count; ++row) {
         const int64_t bufLine = row + m_scrolledCount;
         m_maxBufferedLine = std::max(m_maxBufferedLine, bufLine);
-        m_bufferData[bufLine % BUFFER_LINE_COUNT].blank(
-            Win32ConsoleBuffer::kDefaultAttributes);
+        m_bufferData[bufLine % m_bufferLineCount].blank(
+            ConsoleBuffer::kDefaultAttributes);
+    }
+    if (firstRow + m_scrolledCount <= m_firstTrackedLine &&
+            firstRow + count + m_scrolledCount >= m_firstTrackedLine) {
+        m_firstTrackedLine = firstRow + m_scrolledCount;
     }
 }
 
+// The number of leading cells that aren't default blanks.
+static int usedCellCount(const CHAR_INFO *line, int width)
+{
+    while (width > 0 &&
+            line[width - 1].Char.UnicodeChar == L' ' &&
+            line[width - 1].Attributes == ConsoleBuffer::kDefaultAttributes) {
+        --width;
+    }
+    return width;
+}
+
+// The part of rows [firstRow, firstRow + count), all above the window, that
+// may hold anything but default blanks, for clearing them.  Lines above the
+// window only change by scrolling, so a line's saved copy, from when it left
+// the window, says what it still holds.  The result is empty if the rows are
+// all blank already.
+SmallRect Scraper::staleRect(int firstRow, int count,
+                             const ConsoleScreenBufferInfo &info)
+{
+    const int width = info.bufferSize().X;
+    if (!m_trimClears || m_directMode) {
+        return SmallRect(0, firstRow, width, count);
+    }
+    int top = -1;
+    int bottom = -1;
+    int columns = 0;
+    for (int row = firstRow; row < firstRow + count; ++row) {
+        const int64_t bufLine = row + m_scrolledCount;
+        int used = width;
+        if (bufLine >= m_firstTrackedLine && bufLine <= m_maxBufferedLine &&
+                m_bufferData[bufLine % m_bufferLineCount].hasCells()) {
+            ConsoleLine &saved = m_bufferData[bufLine % m_bufferLineCount];
+            const int savedUsed = usedCellCount(saved.data(), saved.length());
+            // A line saved at another width may have been rewrapped since.
+            if (saved.length() == width || savedUsed == 0) {
+                used = savedUsed;
+            }
+        }
+        if (m_syncRow != -1 &&
+                row >= m_syncRow && row < m_syncRow + SYNC_MARKER_LEN) {
+            // The marker itself isn't in the saved lines.
+            used = std::max(used, 1);
+        }
+        if (used > 0) {
+            if (top == -1) {
+                top = row;
+            }
+            bottom = row;
+            columns = std::max(columns, used);
+        }
+    }
+    if (top == -1) {
+        return SmallRect(0, firstRow, 0, 0);
+    }
+    return SmallRect(0, top, columns, bottom - top + 1);
+}
+
 static bool cursorInWindow(const ConsoleScreenBufferInfo &info)
 {
     return info.dwCursorPosition.Y >= info.srWindow.Top &&
            info.dwCursorPosition.Y <= info.srWindow.Bottom;
 }
 
-void Scraper::resizeImpl(const ConsoleScreenBufferInfo &origInfo)
+// The console buffer size a resize to m_ptySize should end with.
+Coord Scraper::resizedBufferSize(const ConsoleScreenBufferInfo &info)
+{
+    const Coord bufferSize = info.bufferSize();
+    return Coord(
+        m_ptySize.X,
+        // If there was previously no scrollback (e.g. a full-screen app
+        // in direct mode) and we're reducing the window height, then
+        // reduce the console buffer's height too.
+        (info.windowRect().height() == bufferSize.Y)
+            ? m_ptySize.Y
+            : std::max<int>(m_ptySize.Y, bufferSize.Y));
+}
+
+// A resize that keeps the console buffer and font (e.g. a change in the
+// number of rows in scrolling mode) needs only a single SetConsoleWindowInfo
+// call, and the console can stay frozen throughout.
+bool Scraper::canPlanResize(const ConsoleScreenBufferInfo &info)
+{
+    return m_plannedResize &&
+           m_smallFontColumns == m_ptySize.X &&
+           resizedBufferSize(info) == info.bufferSize();
+}
+
+// The final window rectangle of a resize, given the buffer info just before
+// the window is expanded.
+SmallRect Scraper::resizedWindowRect(const ConsoleScreenBufferInfo &info,
+                                     short visibleCols, short visibleRows)
+{
+    SmallRect finalWindowRect(
+        0,
+        std::min<int>(info.bufferSize().Y - visibleRows,
+                      info.windowRect().Top),
+        visibleCols,
+        visibleRows);
+
+    //
+    // Once a line in the screen buffer is "dirty", it should stay visible
+    // in the console window, so that we continue to update its content in
+    // the terminal.  This code is particularly (only?) necessary on
+    // Windows 10, where making the buffer wider can rewrap lines and move
+    // the console window upward.
+    //
+    if (!m_directMode && m_dirtyLineCount > finalWindowRect.Bottom + 1) {
+        // In theory, we avoid ensureLineIncluded, because, a massive
+        // amount of output could have occurred while the console was
+        // unfrozen, so that the *top* of the window is now below the
+        // dirtiest tracked line.
+        finalWindowRect = SmallRect(
+            0, m_dirtyLineCount - visibleRows,
+            visibleCols, visibleRows);
+    }
+
+    // Highest priority constraint: ensure that the cursor remains visible.
+    if (cursorInWindow(info)) {
+        finalWindowRect = finalWindowRect.ensureLineIncluded(
+            info.cursorPosition().Y);
+    }
+    return finalWindowRect;
+}
+
+void Scraper::resizeImpl(const ConsoleScreenBufferInfo &origInfo,
+                         ConsoleScreenBufferInfo &finalInfoOut)
 {
     ASSERT(m_console.frozen());
+    const bool planned = canPlanResize(origInfo);
+    const bool wasIncrementalReady = m_incrementalReady;
+    m_incrementalReady = false;
+    m_usedColumns = -1;
     const int cols = m_ptySize.X;
     const int rows = m_ptySize.Y;
-    Coord finalBufferSize;
+    const Coord finalBufferSize = resizedBufferSize(origInfo);
 
     {
         //
@@ -202,33 +767,48 @@ void Scraper::resizeImpl(const ConsoleScreenBufferInfo &origInfo)
         // window (e.g. if the window is made taller), but because we blanked
         // the lines in the line buffer, we still don't output them again.
         //
-        const Coord origBufferSize = origInfo.bufferSize();
         const SmallRect origWindowRect = origInfo.windowRect();
 
         if (m_directMode) {
-            for (ConsoleLine &line : m_bufferData) {
-                line.reset();
-            }
+            m_readBuffer.discardPreviousFrame();
         } else {
-            m_consoleBuffer->clearLines(0, origWindowRect.Top, origInfo);
+            m_consoleBuffer->clearRect(
+                staleRect(0, origWindowRect.Top, origInfo));
             clearBufferLines(0, origWindowRect.Top);
             if (m_syncRow != -1) {
                 createSyncMarker(std::min(
                     m_syncRow,
-                    BUFFER_LINE_COUNT - rows
+                    m_bufferLineCount - rows
                                       - SYNC_MARKER_LEN
-                                      - SYNC_MARKER_MARGIN));
+                                      - m_syncMarkerMargin));
             }
         }
 
-        finalBufferSize = Coord(
-            cols,
-            // If there was previously no scrollback (e.g. a full-screen app
-            // in direct mode) and we're reducing the window height, then
-            // reduce the console buffer's height too.
-            (origWindowRect.height() == origBufferSize.Y)
-                ? rows
-                : std::max<int>(rows, origBufferSize.Y));
+        if (planned) {
+            // The buffer and its font stay as they are, so the window can
+            // move straight to its final size, and the buffer info that
+            // follows is known without asking the console again.
+            const short visibleCols =
+                std::min<short>(cols, m_largestWindowSize.X);
+            const short visibleRows =
+                std::min<short>(rows, m_largestWindowSize.Y);
+            const SmallRect finalWindowRect =
+                resizedWindowRect(origInfo, visibleCols, visibleRows);
+            m_consoleBuffer->moveWindow(finalWindowRect);
+            m_dirtyWindowTop = finalWindowRect.Top;
+            finalInfoOut = origInfo;
+            finalInfoOut.srWindow = finalWindowRect;
+            finalInfoOut.dwMaximumWindowSize = m_largestWindowSize;
+            if (wasIncrementalReady && !m_directMode &&
+                    finalWindowRect.Top == origWindowRect.Top) {
+                // The rows newly exposed below the window are blank unless
+                // a console event reports otherwise, so the next scrape can
+                // still read just the changed rows.
+                m_incrementalReady = true;
+                m_lastScrapeWindowRect = finalWindowRect;
+            }
+            return;
+        }
 
         // Reset the console font size.  We need to do this before shrinking
         // the window, because we might need to make the font bigger to permit
@@ -237,13 +817,14 @@ void Scraper::resizeImpl(const ConsoleScreenBufferInfo &origInfo)
         // Windows 10 (10240 build) if the console selection is in progress, so
         // unfreeze it first.
         m_console.setFrozen(false);
-        setSmallFont(m_consoleBuffer->conout(), cols, m_console.isNewW10());
+        m_consoleBuffer->setSmallFont(cols, m_console.isNewW10());
+        m_smallFontColumns = cols;
     }
 
     // We try to make the font small enough so that the entire screen buffer
     // fits on the monitor, but it can't be guaranteed.
-    const auto largest =
-        GetLargestConsoleWindowSize(m_consoleBuffer->conout());
+    const auto largest = m_consoleBuffer->largestWindowSize();
+    m_largestWindowSize = largest;
     const short visibleCols = std::min<short>(cols, largest.X);
     const short visibleRows = std::min<short>(rows, largest.Y);
 
@@ -278,78 +859,101 @@ void Scraper::resizeImpl(const ConsoleScreenBufferInfo &origInfo)
         // Expand the window to its full size.
         m_console.setFrozen(true);
         const ConsoleScreenBufferInfo info = m_consoleBuffer->bufferInfo();
-
-        SmallRect finalWindowRect(
-            0,
-            std::min<int>(info.bufferSize().Y - visibleRows,
-                          info.windowRect().Top),
-            visibleCols,
-            visibleRows);
-
-        //
-        // Once a line in the screen buffer is "dirty", it should stay visible
-        // in the console window, so that we continue to update its content in
-        // the terminal.  This code is particularly (only?) necessary on
-        // Windows 10, where making the buffer wider can rewrap lines and move
-        // the console window upward.
-        //
-        if (!m_directMode && m_dirtyLineCount > finalWindowRect.Bottom + 1) {
-            // In theory, we avoid ensureLineIncluded, because, a massive
-            // amount of output could have occurred while the console was
-            // unfrozen, so that the *top* of the window is now below the
-            // dirtiest tracked line.
-            finalWindowRect = SmallRect(
-                0, m_dirtyLineCount - visibleRows,
-                visibleCols, visibleRows);
-        }
-
-        // Highest priority constraint: ensure that the cursor remains visible.
-        if (cursorInWindow(info)) {
-            finalWindowRect = finalWindowRect.ensureLineIncluded(
-                info.cursorPosition().Y);
-        }
-
+        const SmallRect finalWindowRect =
+            resizedWindowRect(info, visibleCols, visibleRows);
         m_consoleBuffer->moveWindow(finalWindowRect);
         m_dirtyWindowTop = finalWindowRect.Top;
     }
 
     ASSERT(m_console.frozen());
+    finalInfoOut = m_consoleBuffer->bufferInfo();
+}
+
+// Whether the window, buffer size, or cursor changed since `info` was read.
+// A frozen console can't change, so this only queries the console during an
+// unfrozen scrape.
+bool Scraper::consoleMovedDuringRead(const ConsoleScreenBufferInfo &info)
+{
+    if (m_console.frozen()) {
+        return false;
+    }
+    const auto infoCheck = m_consoleBuffer->bufferInfo();
+    return info.bufferSize() != infoCheck.bufferSize() ||
+        info.windowRect() != infoCheck.windowRect() ||
+        info.cursorPosition() != infoCheck.cursorPosition();
+}
+
+// After an unfrozen read fails its validation, freeze the console and read
+// its geometry again for the retry.  If the buffer height now calls for the
+// other mode, keep the old geometry; the next scrape switches modes.
+void Scraper::freezeForRetry(ConsoleScreenBufferInfo &info)
+{
+    m_console.setFrozen(true);
+    ++m_optimisticRetries;
+    const ConsoleScreenBufferInfo fresh = m_consoleBuffer->bufferInfo();
+    if ((fresh.bufferSize().Y != m_bufferLineCount) == m_directMode) {
+        info = fresh;
+    }
 }
 
 void Scraper::syncConsoleContentAndSize(
     bool forceResize,
     ConsoleScreenBufferInfo &finalInfoOut)
 {
+    if (m_frameRecorder) {
+        m_frameRecorder->beginScrape();
+    }
+
     // We'll try to avoid freezing the console by reading large chunks (or
     // all!) of the screen buffer without otherwise attempting to synchronize
-    // with the console application.  We can only do this on Windows 10 and up
-    // because:
+    // with the console application.  The agent only allows this on the new
+    // Windows 10 console (see Win32Console::optimisticReads) because:
     //  - Prior to Windows 8, the size of a ReadConsoleOutputW call was limited
     //    by the ~32KB RPC buffer.
     //  - Prior to Windows 10, an out-of-range read region crashes the caller.
     //    (See misc/WindowsBugCrashReader.cc.)
     //
-    if (!m_console.isNewW10() || forceResize) {
+    // A program writing steadily makes most unfrozen reads fail their
+    // validation, so after a failure, freeze up front for a while, backing
+    // off further with each consecutive failure.
+    bool optimistic = m_console.optimisticReads() && !forceResize;
+    if (optimistic && m_optimisticSkip > 0) {
+        --m_optimisticSkip;
+        optimistic = false;
+    }
+    if (!optimistic) {
         m_console.setFrozen(true);
     }
 
-    const ConsoleScreenBufferInfo info = m_consoleBuffer->bufferInfo();
-    bool cursorVisible = true;
-    CONSOLE_CURSOR_INFO cursorInfo = {};
-    if (!GetConsoleCursorInfo(GetStdHandle(STD_OUTPUT_HANDLE), &cursorInfo)) {
-        trace("GetConsoleCursorInfo failed");
-    } else {
-        cursorVisible = cursorInfo.bVisible != 0;
+    // Send everything this scrape produces as a single write.
+    m_terminal->beginFrame();
+    m_terminal->markFrameCapture();
+
+    ConsoleScreenBufferInfo info = m_consoleBuffer->bufferInfo();
+    ConsoleScreenBufferInfo resizedInfo;
+    const bool cursorVisible = m_console.probe().cursorVisible();
+
+    // The console reports a switch of the active screen buffer, like a
+    // resize, as a layout change.  The rows it names don't describe the new
+    // buffer, so read all of it.
+    if (m_hasDirtyHint && m_dirtyHint.layoutChanged) {
+        m_hasDirtyHint = false;
     }
 
-    // If an app resizes the buffer height, then we enter "direct mode", where
-    // we stop trying to track incremental console changes.
-    const bool newDirectMode = (info.bufferSize().Y != BUFFER_LINE_COUNT);
+    // If an app resizes the buffer height, or activates a buffer of its own,
+    // then we enter "direct mode", where we stop trying to track incremental
+    // console changes.
+    const bool newDirectMode = (info.bufferSize().Y != m_bufferLineCount);
     if (newDirectMode != m_directMode) {
-        trace("Entering %s mode", newDirectMode ? "direct" : "scrolling");
-        resetConsoleTracking(Terminal::SendClear,
-                             newDirectMode ? 0 : info.windowRect().top());
+        TRACE_CAT(Scrape, "Entering %s mode",
+                  newDirectMode ? "direct" : "scrolling");
+        if (newDirectMode) {
+            enterDirectMode(info);
+        } else {
+            leaveDirectMode(info);
+        }
         m_directMode = newDirectMode;
+        m_readBuffer.setSnapshotMode(m_directMode);
 
         // When we switch from direct->scrolling mode, make sure the console is
         // the right size.
@@ -359,31 +963,72 @@ void Scraper::syncConsoleContentAndSize(
         }
     }
 
-    if (m_directMode) {
+    if (m_repaintPending) {
+        // The new line numbering starts at the top of the window.
+        m_repaintPending = false;
+        resetConsoleTracking(Terminal::SendClear,
+                             m_directMode ? 0 : info.windowRect().top(),
+                             false);
+    }
+
+    if (!forceResize && m_hasDirtyHint &&
+            cursorOnlyOutput(info, cursorVisible)) {
+        // Nothing was read.  Only the terminal cursor needs to move.
+    } else if (m_directMode) {
         // In direct-mode, resizing the console redraws the terminal, so do it
         // before scraping.
         if (forceResize) {
-            resizeImpl(info);
+            resizeImpl(info, resizedInfo);
         }
         directScrapeOutput(info, cursorVisible);
+        if (consoleMovedDuringRead(info)) {
+            // Discard the torn frame and read all of it again, frozen.
+            m_pendingOutput.kind = PendingOutput::Kind::None;
+            m_readBuffer.dropCurrentFrame();
+            m_hasDirtyHint = false;
+            freezeForRetry(info);
+            directScrapeOutput(info, cursorVisible);
+        }
+    } else if ((!forceResize || canPlanResize(info)) && m_hasDirtyHint &&
+               incrementalScrapeOutput(info, cursorVisible)) {
+        // Only the cursor row and the rows reported by console events were
+        // read.  A planned resize keeps the rest of the window intact.
     } else {
         if (!m_console.frozen()) {
             if (!scrollingScrapeOutput(info, cursorVisible, true)) {
-                m_console.setFrozen(true);
+                freezeForRetry(info);
             }
         }
         if (m_console.frozen()) {
             scrollingScrapeOutput(info, cursorVisible, false);
         }
-        // In scrolling mode, we want to scrape before resizing, because we'll
-        // erase everything in the console buffer up to the top of the console
-        // window.
-        if (forceResize) {
-            resizeImpl(info);
+    }
+    if (optimistic) {
+        if (!m_console.frozen()) {
+            m_optimisticMisses = 0;
+        } else {
+            m_optimisticMisses = std::min(m_optimisticMisses + 1,
+                                          kMaxOptimisticBackoffShift);
+            m_optimisticSkip = (1 << m_optimisticMisses) - 1;
         }
     }
+    // A resize repaints the terminal, so its frame is always sent.
+    m_pendingOutput.mayDefer = !forceResize;
+
+    // In scrolling mode, we want to scrape before resizing, because we'll
+    // erase everything in the console buffer up to the top of the console
+    // window.  The scraped lines must also be sent first, because resizing
+    // clears saved lines.
+    if (!m_directMode && forceResize) {
+        emitPendingOutput();
+        resizeImpl(info, resizedInfo);
+    }
 
-    finalInfoOut = forceResize ? m_consoleBuffer->bufferInfo() : info;
+    if (!m_deferOutput) {
+        finishOutputFrame();
+    }
+    m_hasDirtyHint = false;
+    finalInfoOut = forceResize ? resizedInfo : info;
 }
 
 // Try to match Windows' behavior w.r.t. to the LVB attribute flags.  In some
@@ -394,6 +1039,100 @@ void Scraper::syncConsoleContentAndSize(
 // [rprichard 2017-01-15] I haven't actually noticed any old programs that need
 // this treatment -- the motivation for this function comes from the MSDN
 // documentation for SetConsoleMode and ENABLE_LVB_GRID_WORLDWIDE.
+// Reads the rectangle into m_readBuffer, and records it along with the
+// buffer info when frame recording is on.
+// The number of columns of a scrolling-mode read that must come from the
+// console; the rest are blank.
+int Scraper::readColumns(const ConsoleScreenBufferInfo &info,
+                         const SmallRect &rect)
+{
+    const int width = rect.width();
+    const int columns = m_usedColumns + kReadColumnMargin;
+    if (m_directMode || rect.Left != 0 || m_usedColumns < 0 ||
+            !m_hasDirtyHint ||
+            columns + kReadColumnMargin > width ||
+            GetTickCount() - m_lastFullWidthReadTick >=
+                kFullWidthReadIntervalMs ||
+            info.cursorPosition().X >= columns ||
+            (m_dirtyHint.updated && m_dirtyHint.right >= columns)) {
+        return width;
+    }
+    return columns;
+}
+
+static inline bool sameCell(const CHAR_INFO &a, const CHAR_INFO &b)
+{
+    return a.Char.UnicodeChar == b.Char.UnicodeChar &&
+        a.Attributes == b.Attributes;
+}
+
+// Finds how many leading columns of m_readBuffer's lines hold anything but
+// the fill cell, looking at the first `columns` columns.
+int Scraper::scanUsedColumns(int columns, const CHAR_INFO &fill)
+{
+    const SmallRect &rect = m_readBuffer.rect();
+    int used = 0;
+    for (int line = rect.Top; line <= rect.Bottom; ++line) {
+        const CHAR_INFO *data = m_readBuffer.lineData(line);
+        for (int x = columns - 1; x >= used; --x) {
+            if (!sameCell(data[x], fill)) {
+                used = x + 1;
+                break;
+            }
+        }
+    }
+    return used;
+}
+
+// After a full-width read, learn the extent of the text.  The lines must all
+// end in the same cell, which is then taken as the blank.
+void Scraper::noteFullWidthRead()
+{
+    const SmallRect &rect = m_readBuffer.rect();
+    const int width = rect.width();
+    m_lastFullWidthReadTick = GetTickCount();
+    m_usedColumns = -1;
+    const CHAR_INFO fill = m_readBuffer.lineData(rect.Top)[width - 1];
+    for (int line = rect.Top + 1; line <= rect.Bottom; ++line) {
+        if (!sameCell(m_readBuffer.lineData(line)[width - 1], fill)) {
+            return;
+        }
+    }
+    m_fillCell = fill;
+    m_usedColumns = scanUsedColumns(width, fill);
+}
+
+void Scraper::readConsole(const ConsoleScreenBufferInfo &info,
+                          const SmallRect &rect)
+{
+    const int columns = readColumns(info, rect);
+    if (columns < rect.width()) {
+        largeConsoleReadColumns(m_readBuffer, *m_consoleBuffer, rect,
+                                attributesMask(), columns, m_fillCell);
+        if (scanUsedColumns(columns, m_fillCell) > m_usedColumns) {
+            // The text reaches into the margin, and maybe beyond it.
+            largeConsoleRead(m_readBuffer, *m_consoleBuffer, rect,
+                             attributesMask());
+            noteFullWidthRead();
+        }
+    } else {
+        largeConsoleRead(m_readBuffer, *m_consoleBuffer, rect,
+                         attributesMask());
+        if (!m_directMode && rect.Left == 0) {
+            noteFullWidthRead();
+        }
+    }
+    if (!m_directMode) {
+        // The scrolling-mode lines are saved at this width.
+        m_bufferData.reserveWidth(m_readBuffer.rect().width());
+    }
+    if (m_frameRecorder) {
+        m_frameRecorder->record(info, m_readBuffer);
+    }
+}
+
+// The mask depends only on the code page and the buffer's output mode, so
+// it's recomputed only when the probe sees one of them change.
 WORD Scraper::attributesMask()
 {
     const auto WINPTY_ENABLE_VIRTUAL_TERMINAL_PROCESSING = 0x4u;
@@ -401,17 +1140,28 @@ WORD Scraper::attributesMask()
     const auto WINPTY_COMMON_LVB_REVERSE_VIDEO           = 0x4000u;
     const auto WINPTY_COMMON_LVB_UNDERSCORE              = 0x8000u;
 
-    const auto cp = GetConsoleOutputCP();
-    const auto isCjk = (cp == 932 || cp == 936 || cp == 949 || cp == 950);
+    ConsoleStateProbe &probe = m_console.probe();
+    const auto cp = probe.outputCodePage();
 
-    const DWORD outputMode = [this]{
-        ASSERT(this->m_consoleBuffer != nullptr);
-        DWORD mode = 0;
-        if (!GetConsoleMode(this->m_consoleBuffer->conout(), &mode)) {
-            mode = 0;
-        }
-        return mode;
-    }();
+    // Each screen buffer has its own mode, so a different buffer is read at
+    // once.
+    ASSERT(m_consoleBuffer != nullptr);
+    if (m_outputModeBuffer != m_consoleBuffer) {
+        m_outputModeBuffer = m_consoleBuffer;
+        m_outputMode.invalidate();
+    }
+    if (m_outputMode.due(probe.clock())) {
+        m_outputMode.update(probe.clock(), m_consoleBuffer->outputMode());
+    }
+    const uint32_t codePageGeneration = probe.outputCodePageGeneration();
+    if (m_maskValid &&
+            m_maskCodePageGeneration == codePageGeneration &&
+            m_maskOutputModeGeneration == m_outputMode.generation()) {
+        return m_attributesMask;
+    }
+
+    const auto isCjk = (cp == 932 || cp == 936 || cp == 949 || cp == 950);
+    const DWORD outputMode = m_outputMode.value();
     const bool hasEnableLvbGridWorldwide =
         (outputMode & WINPTY_ENABLE_LVB_GRID_WORLDWIDE) != 0;
     const bool hasEnableVtProcessing =
@@ -428,6 +1178,14 @@ WORD Scraper::attributesMask()
     WORD mask = ~0;
     if (!isReverseSupported)    { mask &= ~WINPTY_COMMON_LVB_REVERSE_VIDEO; }
     if (!isUnderscoreSupported) { mask &= ~WINPTY_COMMON_LVB_UNDERSCORE; }
+    if (m_maskValid && mask != m_attributesMask) {
+        TRACE_CAT(Scrape, "Attribute mask 0x%04x -> 0x%04x",
+                  m_attributesMask, mask);
+    }
+    m_maskValid = true;
+    m_maskCodePageGeneration = codePageGeneration;
+    m_maskOutputModeGeneration = m_outputMode.generation();
+    m_attributesMask = mask;
     return mask;
 }
 
@@ -439,9 +1197,119 @@ void Scraper::directScrapeOutput(const ConsoleScreenBufferInfo &info,
     const SmallRect scrapeRect(
         windowRect.left(), windowRect.top(),
         std::min<SHORT>(std::min(windowRect.width(), m_ptySize.X),
-                        MAX_CONSOLE_WIDTH),
+                        m_maxWidth),
         std::min<SHORT>(std::min(windowRect.height(), m_ptySize.Y),
-                        BUFFER_LINE_COUNT));
+                        m_bufferLineCount));
+
+    if (!m_hasDirtyHint || !incrementalDirectRead(info, scrapeRect)) {
+        readConsole(info, scrapeRect);
+        m_lastFullScrapeTick = GetTickCount();
+        m_incrementalReady = true;
+        m_lastScrapeWindowRect = windowRect;
+        m_lastScrapeBufferSize = info.bufferSize();
+    }
+    setPendingOutput(PendingOutput::Kind::Direct, info, consoleCursorVisible);
+    m_pendingOutput.scrapeRect = scrapeRect;
+}
+
+// If the console event hook saw only caret movement since the last scrape,
+// and the window and buffer are where that scrape left them, the terminal
+// already shows the console's content, so skip the sync marker check and the
+// window read, and just move the terminal cursor.  Like the incremental
+// reads, this defers to a full scrape periodically.
+bool Scraper::cursorOnlyOutput(const ConsoleScreenBufferInfo &info,
+                               bool consoleCursorVisible)
+{
+    const ConsoleEventHook::DirtyRegion &dirty = m_dirtyHint;
+    if (!dirty.caretMoved || dirty.updated || dirty.scrolled ||
+            !m_incrementalReady ||
+            m_frameDeferred ||
+            GetTickCount() - m_lastFullScrapeTick >= kFullScrapeIntervalMs ||
+            info.bufferSize() != m_lastScrapeBufferSize ||
+            info.windowRect() != m_lastScrapeWindowRect) {
+        return false;
+    }
+    const Coord cursor = info.cursorPosition();
+    if (m_directMode) {
+        if (!m_readBuffer.rect().contains(cursor)) {
+            return false;
+        }
+    } else {
+        // The cursor must be on a line the terminal already has; moving to
+        // a new line goes through the usual scrape.
+        if (!info.windowRect().contains(cursor) ||
+                m_dirtyWindowTop != info.windowRect().top() ||
+                cursor.Y >= m_dirtyLineCount ||
+                cursor.Y + m_scrolledCount > m_maxBufferedLine) {
+            return false;
+        }
+    }
+    setPendingOutput(PendingOutput::Kind::Cursor, info, consoleCursorVisible);
+    m_pendingOutput.scrapeRect = m_readBuffer.rect();
+    return true;
+}
+
+void Scraper::emitCursorOutput(const ConsoleScreenBufferInfo &info,
+                               bool consoleCursorVisible)
+{
+    if (!consoleCursorVisible) {
+        m_terminal->hideTerminalCursor();
+        return;
+    }
+    const Coord cursor = info.cursorPosition();
+    if (m_directMode) {
+        const SmallRect &rect = m_pendingOutput.scrapeRect;
+        m_terminal->showTerminalCursor(cursor.X - rect.Left,
+                                       cursor.Y - rect.Top);
+    } else {
+        m_terminal->showTerminalCursor(cursor.X,
+                                       cursor.Y + m_scrolledCount);
+    }
+}
+
+// In direct mode, read only the rows the console event hook reported as
+// updated, plus the cursor row, and keep the rest of the last frame.  The
+// frame diff in emitDirectOutput then finds just those rows changed.  As in
+// scrolling mode, a full read is forced periodically and whenever the
+// geometry changes or the buffer scrolls.
+bool Scraper::incrementalDirectRead(const ConsoleScreenBufferInfo &info,
+                                    const SmallRect &scrapeRect)
+{
+    ASSERT(m_directMode);
+    const ConsoleEventHook::DirtyRegion &dirty = m_dirtyHint;
+    if (!m_incrementalReady ||
+            dirty.scrolled ||
+            GetTickCount() - m_lastFullScrapeTick >= kFullScrapeIntervalMs ||
+            info.bufferSize() != m_lastScrapeBufferSize ||
+            info.windowRect() != m_lastScrapeWindowRect) {
+        return false;
+    }
+    int firstRow = scrapeRect.Bottom + 1;
+    int stopRow = scrapeRect.Top;
+    const int cursorRow = info.cursorPosition().Y;
+    if (cursorRow >= scrapeRect.Top && cursorRow <= scrapeRect.Bottom) {
+        firstRow = cursorRow;
+        stopRow = cursorRow + 1;
+    }
+    if (dirty.updated) {
+        firstRow = std::min(firstRow, dirty.top);
+        stopRow = std::max(stopRow, dirty.bottom + 1);
+    }
+    if (!largeConsoleReadRows(m_readBuffer, *m_consoleBuffer, scrapeRect,
+                              firstRow, stopRow, attributesMask())) {
+        return false;
+    }
+    if (m_frameRecorder) {
+        m_frameRecorder->record(info, m_readBuffer);
+    }
+    return true;
+}
+
+// Sends the direct-mode frame in m_readBuffer.
+void Scraper::emitDirectOutput(const ConsoleScreenBufferInfo &info,
+                               bool consoleCursorVisible,
+                               const SmallRect &scrapeRect)
+{
     const int w = scrapeRect.width();
     const int h = scrapeRect.height();
 
@@ -455,16 +1323,40 @@ void Scraper::directScrapeOutput(const ConsoleScreenBufferInfo &info,
         m_terminal->hideTerminalCursor();
     }
 
-    largeConsoleRead(m_readBuffer, *m_consoleBuffer, scrapeRect, attributesMask());
+    // If the content shifted vertically, as when a full-screen program
+    // scrolls, scroll the terminal to match and only repaint what's exposed.
+    int scrollTop = 0;
+    int scrollBottom = -1;
+    int scrollDelta = 0;
+    if (m_scrollRegionOutput &&
+            detectDirectModeScroll(scrapeRect,
+                                   scrollTop, scrollBottom, scrollDelta)) {
+        m_terminal->scrollRegion(scrollTop, scrollBottom, scrollDelta);
+    }
 
+    // The read buffer is in snapshot mode, so diff each terminal line against
+    // the previous frame directly.
+    const int prevTop = m_readBuffer.previousRect().top();
     for (int line = 0; line < h; ++line) {
         const CHAR_INFO *const curLine =
             m_readBuffer.lineData(scrapeRect.top() + line);
-        ConsoleLine &bufLine = m_bufferData[line];
-        if (bufLine.detectChangeAndSetLine(curLine, w)) {
+        int prevLineIndex = line;
+        if (line >= scrollTop && line <= scrollBottom) {
+            prevLineIndex = line + scrollDelta;
+            if (prevLineIndex < scrollTop || prevLineIndex > scrollBottom) {
+                // The terminal scrolled a blank line in here.
+                prevLineIndex = -1;
+            }
+        }
+        const CHAR_INFO *const prevLine = prevLineIndex == -1 ? nullptr :
+            m_readBuffer.previousLineData(prevTop + prevLineIndex,
+                                          scrapeRect.Left, w);
+        if (prevLine == nullptr ||
+                memcmp(prevLine, curLine, sizeof(CHAR_INFO) * w) != 0) {
             const int lineCursorColumn =
                 line == cursorLine ? cursorColumn : -1;
-            m_terminal->sendLine(line, curLine, w, lineCursorColumn);
+            m_terminal->sendLine(line, curLine, w, lineCursorColumn,
+                                 prevLine);
         }
     }
 
@@ -473,6 +1365,110 @@ void Scraper::directScrapeOutput(const ConsoleScreenBufferInfo &info,
     }
 }
 
+// Sort m_rowHashIndex for lookup, and mark the rows of duplicated hashes
+// (e.g. blank lines) with -1, so they don't vote.
+void Scraper::sortRowHashIndex()
+{
+    std::sort(m_rowHashIndex.begin(), m_rowHashIndex.end());
+    for (size_t i = 0; i + 1 < m_rowHashIndex.size(); ++i) {
+        if (m_rowHashIndex[i].first == m_rowHashIndex[i + 1].first) {
+            m_rowHashIndex[i].second = -1;
+            m_rowHashIndex[i + 1].second = -1;
+        }
+    }
+}
+
+// Compare the current direct-mode frame against the previous one, looking
+// for a block of lines that moved up or down by the same amount.  On success,
+// the terminal lines [top, bottom] should be scrolled so that terminal line L
+// afterward shows what line L+delta showed before.
+bool Scraper::detectDirectModeScroll(const SmallRect &scrapeRect,
+                                     int &top, int &bottom, int &delta)
+{
+    const int w = scrapeRect.width();
+    const int h = scrapeRect.height();
+    const SmallRect &prevRect = m_readBuffer.previousRect();
+    if (h < kMinScrollVotes ||
+            m_readBuffer.previousLineData(prevRect.Top,
+                                          scrapeRect.Left, w) == nullptr ||
+            prevRect.height() != h) {
+        return false;
+    }
+    const auto prevLine = [&](int line) {
+        return m_readBuffer.previousLineData(prevRect.Top + line,
+                                             scrapeRect.Left, w);
+    };
+    const auto curLine = [&](int line) {
+        return m_readBuffer.lineData(scrapeRect.Top + line);
+    };
+
+    // Index the previous frame's lines by hash, dropping duplicates (e.g.
+    // blank lines), and let each current line with a unique match vote for
+    // how far it moved.
+    m_rowHashIndex.clear();
+    for (int line = 0; line < h; ++line) {
+        m_rowHashIndex.push_back(std::make_pair(
+            ConsoleLine::hashLine(prevLine(line), w), line));
+    }
+    sortRowHashIndex();
+    m_scrollVotes.assign(h * 2, 0);
+    for (int line = 0; line < h; ++line) {
+        const uint64_t hash = ConsoleLine::hashLine(curLine(line), w);
+        const auto it = std::lower_bound(
+            m_rowHashIndex.begin(), m_rowHashIndex.end(),
+            std::make_pair(hash, -1));
+        if (it != m_rowHashIndex.end() && it->first == hash &&
+                it->second != -1 && it->second != line) {
+            ++m_scrollVotes[it->second - line + h];
+        }
+    }
+    int bestDelta = 0;
+    int bestVotes = 0;
+    int runnerUpVotes = 0;
+    for (int i = 0; i < h * 2; ++i) {
+        if (m_scrollVotes[i] > bestVotes) {
+            runnerUpVotes = bestVotes;
+            bestVotes = m_scrollVotes[i];
+            bestDelta = i - h;
+        } else if (m_scrollVotes[i] > runnerUpVotes) {
+            runnerUpVotes = m_scrollVotes[i];
+        }
+    }
+    if (bestVotes < kMinScrollVotes || bestVotes < runnerUpVotes * 2) {
+        return false;
+    }
+
+    // Find the longest run of lines that really did move by bestDelta.
+    int runStart = 0;
+    int runLength = 0;
+    for (int line = 0; line < h;) {
+        const int src = line + bestDelta;
+        if (src < 0 || src >= h ||
+                memcmp(curLine(line), prevLine(src),
+                       sizeof(CHAR_INFO) * w) != 0) {
+            ++line;
+            continue;
+        }
+        const int start = line;
+        while (line < h && line + bestDelta >= 0 && line + bestDelta < h &&
+                memcmp(curLine(line), prevLine(line + bestDelta),
+                       sizeof(CHAR_INFO) * w) == 0) {
+            ++line;
+        }
+        if (line - start > runLength) {
+            runStart = start;
+            runLength = line - start;
+        }
+    }
+    if (runLength < kMinScrollVotes) {
+        return false;
+    }
+    delta = bestDelta;
+    top = std::min(runStart, runStart + delta);
+    bottom = std::max(runStart, runStart + delta) + runLength - 1;
+    return true;
+}
+
 bool Scraper::scrollingScrapeOutput(const ConsoleScreenBufferInfo &info,
                                     bool consoleCursorVisible,
                                     bool tentative)
@@ -480,24 +1476,44 @@ bool Scraper::scrollingScrapeOutput(const ConsoleScreenBufferInfo &info,
     const Coord cursor = info.cursorPosition();
     const SmallRect windowRect = info.windowRect();
 
-    if (m_syncRow != -1) {
-        // If a synchronizing marker was placed into the history, look for it
-        // and adjust the scroll count.
-        const int markerRow = findSyncMarker();
+    // If a synchronizing marker was placed into the history, work out how far
+    // the buffer has scrolled.  When the console is frozen, first try to match
+    // line fingerprints, which avoids reading the marker column.
+    int scrollAmount = -1;
+    if (m_syncRow != -1 && m_fingerprintScroll && !tentative) {
+        scrollAmount = detectScrollByFingerprint(info);
+    }
+    if (scrollAmount > 0) {
+        m_scrolledCount += scrollAmount;
+        m_lastSyncScroll = scrollAmount;
+        // The marker scrolled too.  If it has scrolled off the top of the
+        // buffer, place a new one below.
+        m_syncRow = m_syncRow - scrollAmount >= 1
+            ? m_syncRow - scrollAmount
+            : -1;
+        markEntireWindowDirty(windowRect);
+    } else if (scrollAmount == -1 && m_syncRow != -1) {
+        // Look for the marker and adjust the scroll count.
+        const int markerRow = findSyncMarker(info);
         if (markerRow == -1) {
             if (tentative) {
                 // I *think* it's possible to keep going, but it's simple to
                 // bail out.
                 return false;
             }
-            // Something has happened.  Reset the terminal.
-            trace("Sync marker has disappeared -- resetting the terminal"
-                  " (m_syncCounter=%u)",
-                  m_syncCounter);
-            resetConsoleTracking(Terminal::SendClear, windowRect.top());
+            // Something has happened.  Re-anchor the lines the terminal
+            // shows if they can be found, otherwise reset the terminal.
+            if (!recoverConsoleTracking(info)) {
+                TRACE_CAT(Scrape,
+                          "Sync marker has disappeared -- resetting the "
+                          "terminal (m_syncCounter=%u)",
+                          m_syncCounter);
+                resetConsoleTracking(Terminal::SendClear, windowRect.top());
+            }
         } else if (markerRow != m_syncRow) {
             ASSERT(markerRow < m_syncRow);
             m_scrolledCount += (m_syncRow - markerRow);
+            m_lastSyncScroll = m_syncRow - markerRow;
             m_syncRow = markerRow;
             // If the buffer has scrolled, then the entire window is dirty.
             markEntireWindowDirty(windowRect);
@@ -507,9 +1523,22 @@ bool Scraper::scrollingScrapeOutput(const ConsoleScreenBufferInfo &info,
     // Creating a new sync row requires clearing part of the console buffer, so
     // avoid doing it if there's already a sync row that's good enough.
     const int newSyncRow =
-        static_cast<int>(windowRect.top()) - SYNC_MARKER_LEN - SYNC_MARKER_MARGIN;
-    const bool shouldCreateSyncRow =
-        newSyncRow >= m_syncRow + SYNC_MARKER_LEN + SYNC_MARKER_MARGIN;
+        static_cast<int>(windowRect.top()) - SYNC_MARKER_LEN -
+        m_syncMarkerMargin;
+    bool shouldCreateSyncRow =
+        newSyncRow >= m_syncRow + SYNC_MARKER_LEN + m_syncMarkerMargin;
+    if (shouldCreateSyncRow && m_syncRow >= m_syncMarkerMargin) {
+        // The old marker still has room above it, so a new one would only
+        // buy headroom.  Fingerprinting usually tracks the scroll count on
+        // its own, so keep the old marker until it approaches the top of the
+        // buffer.  Otherwise, wait until the window stops moving, rather
+        // than writing into the console on every scrape of heavy output.
+        const bool windowSettled =
+            windowRect.top() == m_lastScrapeWindowRect.top();
+        if (m_fingerprintScroll || !windowSettled) {
+            shouldCreateSyncRow = false;
+        }
+    }
     if (tentative && shouldCreateSyncRow) {
         // It's difficult even in principle to put down a new marker if the
         // console can scroll an arbitrarily amount while we're writing.
@@ -534,10 +1563,13 @@ bool Scraper::scrollingScrapeOutput(const ConsoleScreenBufferInfo &info,
             // The window has moved upward.  This is generally not expected to
             // happen, but the CMD/PowerShell CLS command will move the window
             // to the top as part of clearing everything else in the console.
-            trace("Window moved upward -- resetting the terminal"
-                  " (m_syncCounter=%u)",
-                  m_syncCounter);
-            resetConsoleTracking(Terminal::SendClear, windowRect.top());
+            if (!recoverConsoleTracking(info)) {
+                TRACE_CAT(Scrape,
+                          "Window moved upward -- resetting the terminal"
+                          " (m_syncCounter=%u)",
+                          m_syncCounter);
+                resetConsoleTracking(Terminal::SendClear, windowRect.top());
+            }
         }
     }
     m_dirtyWindowTop = windowRect.top();
@@ -562,13 +1594,18 @@ bool Scraper::scrollingScrapeOutput(const ConsoleScreenBufferInfo &info,
     const int stopReadLine = std::max(windowRect.top() + windowRect.height(),
                                       m_dirtyLineCount);
     ASSERT(firstReadLine >= 0 && stopReadLine > firstReadLine);
-    largeConsoleRead(m_readBuffer,
-                     *m_consoleBuffer,
-                     SmallRect(0, firstReadLine,
-                               std::min<SHORT>(info.bufferSize().X,
-                                               MAX_CONSOLE_WIDTH),
-                               stopReadLine - firstReadLine),
-                     attributesMask());
+    const SmallRect readRect(0, firstReadLine,
+                             std::min<SHORT>(info.bufferSize().X,
+                                             m_maxWidth),
+                             stopReadLine - firstReadLine);
+    // Fingerprint scroll detection may have already read everything needed.
+    const SmallRect &prevReadRect = m_readBuffer.rect();
+    if (scrollAmount == -1 ||
+            prevReadRect.Left != readRect.Left ||
+            prevReadRect.Right != readRect.Right ||
+            !prevReadRect.contains(readRect)) {
+        readConsole(info, readRect);
+    }
 
     // If we're scraping the buffer without freezing it, we have to query the
     // buffer position data separately from the buffer content, so the two
@@ -576,25 +1613,25 @@ bool Scraper::scrollingScrapeOutput(const ConsoleScreenBufferInfo &info,
     // scrape operation and restart it frozen.  (We may have updated the
     // dirty-line high-water-mark, but that should be OK.)
     if (tentative) {
-        const auto infoCheck = m_consoleBuffer->bufferInfo();
-        if (info.bufferSize() != infoCheck.bufferSize() ||
-                info.windowRect() != infoCheck.windowRect() ||
-                info.cursorPosition() != infoCheck.cursorPosition()) {
+        if (consoleMovedDuringRead(info)) {
             return false;
         }
-        if (m_syncRow != -1 && m_syncRow != findSyncMarker()) {
+        if (m_syncRow != -1 && m_syncRow != findSyncMarker(info)) {
             return false;
         }
     }
 
     if (shouldCreateSyncRow) {
         ASSERT(!tentative);
-        createSyncMarker(newSyncRow);
+        if (!tryContentSyncAnchor(newSyncRow, info)) {
+            createSyncMarker(newSyncRow);
+        }
     }
 
     // At this point, we're finished interacting (reading or writing) the
     // console, and we just need to convert our collected data into terminal
-    // output.
+    // output.  That part is left pending, so it can run after the console is
+    // unfrozen.
 
     scanForDirtyLines(windowRect);
 
@@ -606,22 +1643,141 @@ bool Scraper::scrollingScrapeOutput(const ConsoleScreenBufferInfo &info,
         std::min(m_dirtyLineCount, windowRect.top() + windowRect.height()) +
             m_scrolledCount;
 
-    const bool showTerminalCursor =
-        consoleCursorVisible && windowRect.contains(cursor);
-    const int64_t cursorLine = !showTerminalCursor ? -1 : cursor.Y + m_scrolledCount;
-    const int cursorColumn = !showTerminalCursor ? -1 : cursor.X;
+    setPendingOutput(PendingOutput::Kind::Scrolling, info,
+                     consoleCursorVisible);
+    m_pendingOutput.firstVirtLine = firstVirtLine;
+    m_pendingOutput.stopVirtLine = stopVirtLine;
 
-    if (!showTerminalCursor) {
-        m_terminal->hideTerminalCursor();
+    m_scrapedLineCount = windowRect.top() + m_scrolledCount;
+    m_lastFullScrapeTick = GetTickCount();
+    m_incrementalReady = true;
+    m_lastScrapeWindowRect = windowRect;
+    m_lastScrapeBufferSize = info.bufferSize();
+
+    return true;
+}
+
+// Read only the rows that can have changed since the last scrape: the cursor
+// row and any rows the console event hook reported as updated.  This handles
+// progress-bar style output with a small read instead of a read of the whole
+// window.  It only applies while the window and buffer geometry are unchanged
+// and nothing has scrolled; otherwise, it returns false and the caller does a
+// full scrape.  A full scrape is also forced periodically, to reconcile any
+// changes the event hook missed.
+bool Scraper::incrementalScrapeOutput(const ConsoleScreenBufferInfo &info,
+                                      bool consoleCursorVisible)
+{
+    ASSERT(!m_directMode);
+    const Coord cursor = info.cursorPosition();
+    const SmallRect windowRect = info.windowRect();
+    const ConsoleEventHook::DirtyRegion &dirty = m_dirtyHint;
+
+    if (!m_incrementalReady ||
+            dirty.scrolled ||
+            GetTickCount() - m_lastFullScrapeTick >= kFullScrapeIntervalMs ||
+            info.bufferSize() != m_lastScrapeBufferSize ||
+            windowRect != m_lastScrapeWindowRect ||
+            !windowRect.contains(cursor) ||
+            m_dirtyWindowTop != windowRect.top() ||
+            m_scrapedLineCount != windowRect.top() + m_scrolledCount) {
+        return false;
+    }
+
+    // Lines the full scrape would have sent, in screen-buffer coordinates.
+    // Rows at or below the dirty line count are blank unless an event says
+    // otherwise, and we need scanForDirtyLines to handle that case.
+    const int dirtyLineCount = std::max<int>(m_dirtyLineCount, cursor.Y + 1);
+    const int windowBottom = windowRect.top() + windowRect.height();
+    int firstRow = cursor.Y;
+    if (dirtyLineCount > m_dirtyLineCount) {
+        firstRow = std::min(firstRow, m_dirtyLineCount);
+    }
+    if (dirty.updated) {
+        if (dirty.top < windowRect.top() || dirty.bottom >= dirtyLineCount) {
+            return false;
+        }
+        firstRow = std::min(firstRow, dirty.top);
+    }
+    const int stopRow = std::min(dirtyLineCount, windowBottom);
+    ASSERT(firstRow >= windowRect.top() && stopRow > firstRow);
+
+    readConsole(info, SmallRect(0, firstRow,
+                                std::min<SHORT>(info.bufferSize().X,
+                                                m_maxWidth),
+                                stopRow - firstRow));
+
+    // As with a tentative scrape, make sure the console didn't move while we
+    // were reading it.
+    if (consoleMovedDuringRead(info)) {
+        return false;
     }
 
-    bool sawModifiedLine = false;
+    m_dirtyLineCount = dirtyLineCount;
+    setPendingOutput(PendingOutput::Kind::Scrolling, info,
+                     consoleCursorVisible);
+    m_pendingOutput.firstVirtLine = firstRow + m_scrolledCount;
+    m_pendingOutput.stopVirtLine = stopRow + m_scrolledCount;
+    return true;
+}
 
+// Send the lines in [firstVirtLine, stopVirtLine) that differ from what was
+// last sent, and everything after the first such line.  The lines must
+// already be in m_readBuffer.  sawModifiedLine carries over between slices.
+// With a byte budget, stops once about that many bytes were queued, and
+// returns the first line not sent; otherwise returns stopVirtLine.
+int64_t Scraper::encodeScrollingLines(int64_t firstVirtLine,
+                                      int64_t stopVirtLine,
+                                      int64_t cursorLine,
+                                      int cursorColumn,
+                                      bool &sawModifiedLine,
+                                      size_t byteBudget)
+{
+    const uint64_t stopBytes = m_terminal->bytesQueued() + byteBudget;
     const int w = m_readBuffer.rect().width();
+    // Keep a block of new lines within about one slice, too.
+    const int64_t maxBlockLines = byteBudget == 0 ? stopVirtLine :
+        std::max<int64_t>(1, byteBudget / std::max(1, w));
     for (int64_t line = firstVirtLine; line < stopVirtLine; ++line) {
+        if (byteBudget != 0 && line > firstVirtLine &&
+                m_terminal->bytesQueued() >= stopBytes) {
+            return line;
+        }
         const CHAR_INFO *curLine =
             m_readBuffer.lineData(line - m_scrolledCount);
-        ConsoleLine &bufLine = m_bufferData[line % BUFFER_LINE_COUNT];
+        ConsoleLine &bufLine = m_bufferData[line % m_bufferLineCount];
+        const int lineCursorColumn =
+            line == cursorLine ? cursorColumn : -1;
+        if (line <= m_maxBufferedLine && bufLine.length() == w) {
+            // The terminal shows the saved line, so let it send only the
+            // changed cells.
+            const uint64_t hash = ConsoleLine::hashLine(curLine, w);
+            if (sawModifiedLine || !bufLine.matches(curLine, w, hash)) {
+                sawModifiedLine = true;
+                m_terminal->sendLine(line, curLine, w, lineCursorColumn,
+                                     bufLine.data());
+                bufLine.setLine(curLine, w, hash);
+            }
+            continue;
+        }
+        if (line > m_maxBufferedLine && line != cursorLine) {
+            // New lines, as when a log scrolls quickly, go out as one block.
+            // The read buffer stores them contiguously.
+            int64_t stopLine = line + 1;
+            while (stopLine < stopVirtLine && stopLine != cursorLine &&
+                    stopLine - line < maxBlockLines) {
+                ++stopLine;
+            }
+            for (int64_t i = line; i < stopLine; ++i) {
+                m_bufferData[i % m_bufferLineCount].setLine(
+                    m_readBuffer.lineData(i - m_scrolledCount), w);
+            }
+            m_terminal->sendLines(line, curLine,
+                                  static_cast<int>(stopLine - line), w);
+            m_maxBufferedLine = stopLine - 1;
+            sawModifiedLine = true;
+            line = stopLine - 1;
+            continue;
+        }
         if (line > m_maxBufferedLine) {
             m_maxBufferedLine = line;
             sawModifiedLine = true;
@@ -632,18 +1788,173 @@ bool Scraper::scrollingScrapeOutput(const ConsoleScreenBufferInfo &info,
             sawModifiedLine = bufLine.detectChangeAndSetLine(curLine, w);
         }
         if (sawModifiedLine) {
-            const int lineCursorColumn =
-                line == cursorLine ? cursorColumn : -1;
             m_terminal->sendLine(line, curLine, w, lineCursorColumn);
         }
     }
+    return stopVirtLine;
+}
 
-    m_scrapedLineCount = windowRect.top() + m_scrolledCount;
+// Estimate how many lines the buffer has scrolled since the last scrape by
+// matching the hashes of the lines now in the window against the hashes
+// saved in m_bufferData.  Each distinctive line votes for the shift that
+// would explain its new position.  Returns -1 if the result is ambiguous
+// (e.g. a mostly blank or repetitive window, or a scroll of an entire window
+// or more), in which case the caller falls back to the sync marker.
+//
+// This function reads the window (and the line above it) into m_readBuffer.
+int Scraper::detectScrollByFingerprint(const ConsoleScreenBufferInfo &info)
+{
+    ASSERT(m_console.frozen() && !m_directMode);
+    const SmallRect windowRect = info.windowRect();
+    const int width = std::min<SHORT>(info.bufferSize().X, m_maxWidth);
+    const int top = windowRect.top();
+    const int height = windowRect.height();
+    const int readTop = std::max(0, top - 1);
+    readConsole(info, SmallRect(0, readTop, width, top + height - readTop));
+
+    // Index the current window lines by hash, dropping duplicated hashes.
+    m_rowHashIndex.clear();
+    for (int row = top; row < top + height; ++row) {
+        m_rowHashIndex.push_back(std::make_pair(
+            ConsoleLine::hashLine(m_readBuffer.lineData(row), width), row));
+    }
+    sortRowHashIndex();
+
+    // Each saved line from the previous window whose hash appears exactly
+    // once in the current window votes for a shift.  The buffer only scrolls
+    // upward, so lines move to smaller row numbers.
+    m_scrollVotes.assign(height, 0);
+    const int64_t firstLine = std::max<int64_t>(
+        top + m_scrolledCount,
+        m_maxBufferedLine - m_bufferLineCount + 1);
+    const int64_t stopLine = std::min<int64_t>(
+        top + height + m_scrolledCount, m_maxBufferedLine + 1);
+    for (int64_t line = firstLine; line < stopLine; ++line) {
+        const ConsoleLine &saved = m_bufferData[line % m_bufferLineCount];
+        if (saved.length() != width) {
+            continue;
+        }
+        const auto it = std::lower_bound(
+            m_rowHashIndex.begin(), m_rowHashIndex.end(),
+            std::make_pair(saved.hash(), -1));
+        if (it == m_rowHashIndex.end() || it->first != saved.hash() ||
+                it->second == -1) {
+            continue;
+        }
+        const int64_t shift = (line - m_scrolledCount) - it->second;
+        if (shift >= 0 && shift < height) {
+            ++m_scrollVotes[shift];
+        }
+    }
 
-    if (showTerminalCursor) {
-        m_terminal->showTerminalCursor(cursorColumn, cursorLine);
+    int best = -1;
+    int bestVotes = 0;
+    int runnerUpVotes = 0;
+    for (int shift = 0; shift < height; ++shift) {
+        const int votes = m_scrollVotes[shift];
+        if (votes > bestVotes) {
+            runnerUpVotes = bestVotes;
+            bestVotes = votes;
+            best = shift;
+        } else if (votes > runnerUpVotes) {
+            runnerUpVotes = votes;
+        }
+    }
+    if (bestVotes < kMinScrollVotes || bestVotes < runnerUpVotes * 2) {
+        return -1;
     }
+    return best;
+}
 
+// After the scraper loses track of the buffer (e.g. the sync marker is
+// overwritten, or the window jumps), look for the lines the terminal still
+// shows in the current window.  Each saved line whose hash appears exactly
+// once in the window votes for the scroll count that would put it there.  If
+// one count wins clearly, the line state is kept, and encodeScrollingLines
+// repaints only the lines that differ.  Returns false if nothing matches well
+// enough, in which case the caller resets the terminal.
+//
+// This function reads the window into m_readBuffer.
+bool Scraper::recoverConsoleTracking(const ConsoleScreenBufferInfo &info)
+{
+    ASSERT(m_console.frozen() && !m_directMode);
+    if (m_maxBufferedLine < m_scrapedLineCount) {
+        return false;
+    }
+    const SmallRect windowRect = info.windowRect();
+    const int width = std::min<SHORT>(info.bufferSize().X, m_maxWidth);
+    const int top = windowRect.top();
+    const int height = windowRect.height();
+    readConsole(info, SmallRect(0, top, width, height));
+
+    m_rowHashIndex.clear();
+    for (int row = top; row < top + height; ++row) {
+        m_rowHashIndex.push_back(std::make_pair(
+            ConsoleLine::hashLine(m_readBuffer.lineData(row), width), row));
+    }
+    sortRowHashIndex();
+
+    // Only the lines on the terminal's screen can be repainted in place.  A
+    // vote for scroll count S is stored at index S - minScroll.
+    const int64_t firstLine = std::max<int64_t>(
+        m_scrapedLineCount, m_maxBufferedLine - m_bufferLineCount + 1);
+    const int64_t stopLine = m_maxBufferedLine + 1;
+    const int64_t minScroll = firstLine - (top + height - 1);
+    m_scrollVotes.assign(
+        static_cast<size_t>(stopLine - firstLine + height - 1), 0);
+    for (int64_t line = firstLine; line < stopLine; ++line) {
+        const ConsoleLine &saved = m_bufferData[line % m_bufferLineCount];
+        if (saved.length() != width) {
+            continue;
+        }
+        const auto it = std::lower_bound(
+            m_rowHashIndex.begin(), m_rowHashIndex.end(),
+            std::make_pair(saved.hash(), -1));
+        if (it == m_rowHashIndex.end() || it->first != saved.hash() ||
+                it->second == -1) {
+            continue;
+        }
+        ++m_scrollVotes[static_cast<size_t>(line - it->second - minScroll)];
+    }
+
+    int best = -1;
+    int bestVotes = 0;
+    int runnerUpVotes = 0;
+    for (size_t i = 0; i < m_scrollVotes.size(); ++i) {
+        const int votes = m_scrollVotes[i];
+        if (votes > bestVotes) {
+            runnerUpVotes = bestVotes;
+            bestVotes = votes;
+            best = static_cast<int>(i);
+        } else if (votes > runnerUpVotes) {
+            runnerUpVotes = votes;
+        }
+    }
+    if (bestVotes < kMinScrollVotes || bestVotes < runnerUpVotes * 2) {
+        return false;
+    }
+    // The window can't start above the lines already sent, and the lines
+    // between them and the window must still be in the buffer.
+    const int64_t scrolledCount = minScroll + best;
+    if (scrolledCount < 0 ||
+            top + scrolledCount < m_scrapedLineCount ||
+            m_scrapedLineCount - scrolledCount < 0) {
+        return false;
+    }
+
+    TRACE_CAT(Scrape,
+              "Scraper: lost sync -- re-anchored %d lines "
+              "(scrolled %lld -> %lld)",
+              bestVotes,
+              static_cast<long long>(m_scrolledCount),
+              static_cast<long long>(scrolledCount));
+    m_scrolledCount = scrolledCount;
+    m_syncRow = -1;
+    m_dirtyWindowTop = -1;
+    m_dirtyLineCount = 0;
+    markEntireWindowDirty(windowRect);
+    m_incrementalReady = false;
+    m_readBuffer.discardPreviousFrame();
     return true;
 }
 
@@ -659,25 +1970,70 @@ void Scraper::syncMarkerText(CHAR_INFO (&output)[SYNC_MARKER_LEN])
     }
 }
 
-int Scraper::findSyncMarker()
+// The marker is compared by its text, as the console may recolor it.
+// Content is compared by its attributes too, which it has been seen with.
+bool Scraper::matchesSyncSignature(const CHAR_INFO *cells) const
+{
+    for (int j = 0; j < SYNC_MARKER_LEN; ++j) {
+        if (cells[j].Char.UnicodeChar !=
+                    m_syncSignature[j].Char.UnicodeChar ||
+                (m_syncIsContent &&
+                    cells[j].Attributes != m_syncSignature[j].Attributes)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// The marker only moves up, by however far the buffer scrolled.  A written
+// marker is searched for first in a band reaching above its last row by
+// twice the last scroll plus a window height, which is a few dozen cells in
+// steady state rather than the whole column, and the full column is read
+// only if the band misses it.  The full search takes the lowest match at or
+// above m_syncRow, so a match in the band is the same answer.  A content
+// anchor can recur below itself, though, and a second match anywhere makes
+// it ambiguous, so it always needs the full column.
+int Scraper::findSyncMarker(const ConsoleScreenBufferInfo &info)
 {
     ASSERT(m_syncRow >= 0);
-    CHAR_INFO marker[SYNC_MARKER_LEN];
-    CHAR_INFO column[BUFFER_LINE_COUNT];
-    syncMarkerText(marker);
+    static const bool kBoundedSearch = !hasDebugFlag("full_sync_search");
+    CHAR_INFO *const column = m_syncColumn.data();
+    if (kBoundedSearch && !m_syncIsContent) {
+        const int band = 2 * m_lastSyncScroll + info.windowRect().height();
+        const int top = std::max(0, m_syncRow - band);
+        if (top > 0) {
+            m_consoleBuffer->read(
+                SmallRect(0, top, 1, m_syncRow + SYNC_MARKER_LEN - top),
+                column + top);
+            for (int i = m_syncRow; i >= top; --i) {
+                if (matchesSyncSignature(column + i)) {
+                    return i;
+                }
+            }
+            TRACE_CAT(Scrape, "Sync marker not within %d rows of row %d -- "
+                      "searching the whole column", band, m_syncRow);
+        }
+    }
     SmallRect rect(0, 0, 1, m_syncRow + SYNC_MARKER_LEN);
     m_consoleBuffer->read(rect, column);
-    int i;
-    for (i = m_syncRow; i >= 0; --i) {
-        int j;
-        for (j = 0; j < SYNC_MARKER_LEN; ++j) {
-            if (column[i + j].Char.UnicodeChar != marker[j].Char.UnicodeChar)
-                break;
+    int found = -1;
+    for (int i = m_syncRow; i >= 0; --i) {
+        if (!matchesSyncSignature(column + i)) {
+            continue;
         }
-        if (j == SYNC_MARKER_LEN)
+        if (!m_syncIsContent) {
             return i;
+        }
+        // Output written since the anchor was chosen can repeat it.  A
+        // second match means the scroll count can't be trusted.
+        if (found != -1) {
+            TRACE_CAT(Scrape, "Content sync anchor is ambiguous (rows %d, %d)",
+                      found, i);
+            return -1;
+        }
+        found = i;
     }
-    return -1;
+    return found;
 }
 
 void Scraper::createSyncMarker(int row)
@@ -686,14 +2042,78 @@ void Scraper::createSyncMarker(int row)
 
     // Clear the lines around the marker to ensure that Windows 10's rewrapping
     // does not affect the marker.
-    m_consoleBuffer->clearLines(row - 1, SYNC_MARKER_LEN + 1,
-                                m_consoleBuffer->bufferInfo());
+    const ConsoleScreenBufferInfo info = m_consoleBuffer->bufferInfo();
+    // Only the rows above the window have saved copies to go by.
+    const int clearCount = std::max(0, std::min(
+        SYNC_MARKER_LEN + 1, info.windowRect().top() - (row - 1)));
+    m_consoleBuffer->clearRect(staleRect(row - 1, clearCount, info));
+    if (clearCount < SYNC_MARKER_LEN + 1) {
+        m_consoleBuffer->clearLines(row - 1 + clearCount,
+                                    SYNC_MARKER_LEN + 1 - clearCount, info);
+    }
 
     // Write a new marker.
     m_syncCounter++;
-    CHAR_INFO marker[SYNC_MARKER_LEN];
-    syncMarkerText(marker);
+    syncMarkerText(m_syncSignature);
+    m_syncIsContent = false;
     m_syncRow = row;
     SmallRect markerRect(0, m_syncRow, 1, SYNC_MARKER_LEN);
-    m_consoleBuffer->write(markerRect, marker);
+    m_consoleBuffer->write(markerRect, m_syncSignature);
+}
+
+// Anchors the scroll tracking on the content already in column 0 of rows
+// [row, row + SYNC_MARKER_LEN), if it's varied enough and appears nowhere
+// else in the buffer down to the window's bottom, so no marker has to be
+// written (and no lines of the user's history cleared for it).  Returns
+// false, changing nothing, otherwise.
+bool Scraper::tryContentSyncAnchor(int row,
+                                   const ConsoleScreenBufferInfo &info)
+{
+    static const bool enabled = !hasDebugFlag("no_content_sync_anchor");
+    // Blank or repetitive output (e.g. a run of log lines with the same
+    // prefix) would likely recur below, so require this many distinct cells.
+    const int kMinDistinctCells = 6;
+    if (!enabled) {
+        return false;
+    }
+    const SmallRect windowRect = info.windowRect();
+    const int stopRow = std::min<int>(windowRect.top() + windowRect.height(),
+                                      m_syncColumn.size());
+    ASSERT(row >= 1 && row + SYNC_MARKER_LEN <= stopRow);
+    CHAR_INFO *const column = m_syncColumn.data();
+    m_consoleBuffer->read(SmallRect(0, 0, 1, stopRow), column);
+    const auto sameCell = [](const CHAR_INFO &a, const CHAR_INFO &b) {
+        return a.Char.UnicodeChar == b.Char.UnicodeChar &&
+            a.Attributes == b.Attributes;
+    };
+    const CHAR_INFO *const anchor = column + row;
+    int distinct = 0;
+    for (int i = 0; i < SYNC_MARKER_LEN; ++i) {
+        int j = 0;
+        while (j < i && !sameCell(anchor[i], anchor[j])) {
+            ++j;
+        }
+        distinct += (j == i);
+    }
+    if (distinct < kMinDistinctCells) {
+        return false;
+    }
+    for (int i = 0; i + SYNC_MARKER_LEN <= stopRow; ++i) {
+        if (i == row) {
+            continue;
+        }
+        int j = 0;
+        while (j < SYNC_MARKER_LEN && sameCell(column[i + j], anchor[j])) {
+            ++j;
+        }
+        if (j == SYNC_MARKER_LEN) {
+            return false;
+        }
+    }
+    memcpy(m_syncSignature, anchor, sizeof(m_syncSignature));
+    m_syncIsContent = true;
+    m_syncRow = row;
+    TRACE_CAT(Scrape, "Anchored the scroll tracking on content at row %d",
+              row);
+    return true;
 }
@@ -25,79 +25,318 @@
 
 #include <stdint.h>
 
+#include <algorithm>
 #include <memory>
+#include <utility>
 #include <vector>
 
+#include "ConsoleBuffer.h"
+#include "ConsoleEventHook.h"
 #include "ConsoleLine.h"
+#include "ConsoleStateProbe.h"
 #include "Coord.h"
 #include "LargeConsoleRead.h"
 #include "SmallRect.h"
 #include "Terminal.h"
 
-class ConsoleScreenBufferInfo;
+class ConsoleBuffer;
+class ConsoleFrameRecorder;
 class Win32Console;
-class Win32ConsoleBuffer;
 
 // We must be able to issue a single ReadConsoleOutputW call of
 // MAX_CONSOLE_WIDTH characters, and a single read of approximately several
-// hundred fewer characters than BUFFER_LINE_COUNT.
+// hundred fewer characters than the buffer line count, which is at most
+// MAX_BUFFER_LINE_COUNT.  A session may choose a smaller width and a
+// different line count and sync marker margin (see ScrapeGeometry); these
+// are the defaults.
 const int BUFFER_LINE_COUNT = 3000;
+const int MAX_BUFFER_LINE_COUNT = 10000;
 const int MAX_CONSOLE_WIDTH = 2500;
 const int MAX_CONSOLE_HEIGHT = 2000;
 const int SYNC_MARKER_LEN = 16;
 const int SYNC_MARKER_MARGIN = 200;
 
+// The per-session sizing of the scraper.  A larger buffer lets more output
+// scroll between scrapes before the scraper must resync, at the cost of
+// memory and of longer sync marker searches.
+struct ScrapeGeometry {
+    int bufferLineCount = BUFFER_LINE_COUNT;
+    int syncMarkerMargin = SYNC_MARKER_MARGIN;
+    int maxWidth = MAX_CONSOLE_WIDTH;
+
+    // The tallest window that still leaves room for a sync marker above it.
+    int maxHeight() const {
+        return std::max(1, std::min(MAX_CONSOLE_HEIGHT,
+            bufferLineCount - SYNC_MARKER_LEN - syncMarkerMargin - 1));
+    }
+};
+
 class Scraper {
 public:
     Scraper(
         Win32Console &console,
-        Win32ConsoleBuffer &buffer,
+        ConsoleBuffer &buffer,
         std::unique_ptr<Terminal> terminal,
-        Coord initialSize);
+        Coord initialSize,
+        const ScrapeGeometry &geometry=ScrapeGeometry(),
+        int64_t *startupTimesUs=nullptr);
     ~Scraper();
-    void resizeWindow(Win32ConsoleBuffer &buffer,
+    void resizeWindow(ConsoleBuffer &buffer,
                       Coord newSize,
                       ConsoleScreenBufferInfo &finalInfoOut);
-    void scrapeBuffer(Win32ConsoleBuffer &buffer,
+    // Skip reading the buffer until something is written to it.
+    void startDormant(ConsoleBuffer &buffer);
+    bool dormant() const { return m_dormant; }
+    void setDirtyRegionHint(const ConsoleEventHook::DirtyRegion &dirty);
+    // Read the window into `out`, leaving the scrape state alone, for a
+    // snapshot of the screen.
+    void readWindow(ConsoleBuffer &buffer,
+                    LargeConsoleReadBuffer &out,
+                    ConsoleScreenBufferInfo &infoOut,
+                    bool &cursorVisibleOut);
+    void scrapeBuffer(ConsoleBuffer &buffer,
                       ConsoleScreenBufferInfo &finalInfoOut);
+    // scrapeBuffer in two steps, so the caller can unfreeze the console
+    // between them.
+    void captureBuffer(ConsoleBuffer &buffer,
+                       ConsoleScreenBufferInfo &finalInfoOut);
+    bool flushOutput(size_t byteBudget=0);
+    void reattachTerminal();
+    // Forget the lines sent so far, and repaint the whole window at the next
+    // scrape, e.g. after scrapes were skipped for a while.
+    void repaintOnNextScrape() { m_repaintPending = true; }
+    // While held, scrapes still send the lines that scroll into the history,
+    // but the window repaint (and cursor) waits until the hold is released.
+    void setHoldFrames(bool hold) { m_holdFrames = hold; }
+    // The CONIN bytes written to the console so far.  The frame of the next
+    // capture acknowledges them, once its repaint is sent.
+    void setInputWritten(uint64_t bytes) { m_inputWritten = bytes; }
     Terminal &terminal() { return *m_terminal; }
+    Coord ptySize() const { return m_ptySize; }
+    uint64_t cellsRead() const { return m_readBuffer.cellsRead(); }
+    // The heap memory held by the saved lines, the read buffer, and the
+    // scroll-tracking tables.
+    size_t bufferDataBytes() const
+    {
+        return m_bufferData.heapBytes() +
+            (m_savedScrolling ? m_savedScrolling->bufferData.heapBytes() : 0);
+    }
+    size_t readBufferBytes() const { return m_readBuffer.heapBytes(); }
+    // Frees the read buffer, the saved lines' cells (keeping their hashes),
+    // and the Terminal's buffers, e.g. while the console is idle.  The next
+    // scrape reads the whole window again.  Does nothing while output is
+    // pending.
+    void releaseIdleMemory();
+    size_t trackingBytes() const;
+    // The number of times the scraper lost track of the console and resent
+    // the whole window.
+    uint64_t resyncCount() const { return m_resyncCount; }
+    // The number of unfrozen reads that failed validation and were redone
+    // with the console frozen.
+    uint64_t optimisticRetries() const { return m_optimisticRetries; }
+    // Send at most this many window repaints per second (0 for no limit).
+    // Lines scrolling into the history are always sent.
+    void setMaxFrameRate(int framesPerSecond);
+    // If the last scrape's repaint was skipped, the delay until the next one
+    // may be sent; otherwise -1.
+    int deferredFrameDelayMs();
 
 private:
+    void initBufferGeometry(ConsoleBuffer &buffer, Coord size,
+                            int64_t *startupTimesUs);
+    bool changedSinceDormant(const ConsoleScreenBufferInfo &info);
+    void wake(const ConsoleScreenBufferInfo &info);
     void resetConsoleTracking(
-        Terminal::SendClearFlag sendClear, int64_t scrapedLineCount);
+        Terminal::SendClearFlag sendClear, int64_t scrapedLineCount,
+        bool countResync=true);
+    void enterDirectMode(const ConsoleScreenBufferInfo &info);
+    void leaveDirectMode(const ConsoleScreenBufferInfo &info);
     void markEntireWindowDirty(const SmallRect &windowRect);
     void scanForDirtyLines(const SmallRect &windowRect);
     void clearBufferLines(int firstRow, int count);
-    void resizeImpl(const ConsoleScreenBufferInfo &origInfo);
+    SmallRect staleRect(int firstRow, int count,
+                        const ConsoleScreenBufferInfo &info);
+    Coord resizedBufferSize(const ConsoleScreenBufferInfo &info);
+    bool canPlanResize(const ConsoleScreenBufferInfo &info);
+    SmallRect resizedWindowRect(const ConsoleScreenBufferInfo &info,
+                                short visibleCols, short visibleRows);
+    void resizeImpl(const ConsoleScreenBufferInfo &origInfo,
+                    ConsoleScreenBufferInfo &finalInfoOut);
     void syncConsoleContentAndSize(bool forceResize,
                                    ConsoleScreenBufferInfo &finalInfoOut);
+    void readConsole(const ConsoleScreenBufferInfo &info,
+                     const SmallRect &rect);
+    int readColumns(const ConsoleScreenBufferInfo &info,
+                    const SmallRect &rect);
+    int scanUsedColumns(int columns, const CHAR_INFO &fill);
+    void noteFullWidthRead();
+    bool consoleMovedDuringRead(const ConsoleScreenBufferInfo &info);
+    void freezeForRetry(ConsoleScreenBufferInfo &info);
     WORD attributesMask();
+    struct PendingOutput {
+        enum class Kind { None, Direct, Scrolling, Cursor };
+        Kind kind = Kind::None;
+        ConsoleScreenBufferInfo info;
+        bool cursorVisible = false;
+        SmallRect scrapeRect;           // Direct, Cursor
+        int64_t firstVirtLine = 0;      // Scrolling
+        int64_t stopVirtLine = 0;       // Scrolling
+        bool mayDefer = false;
+        // A scrolling frame sent in slices: the next line to send, or -1.
+        int64_t sliceLine = -1;
+        bool deferred = false;
+        bool sawModifiedLine = false;
+    };
+    void setPendingOutput(PendingOutput::Kind kind,
+                          const ConsoleScreenBufferInfo &info,
+                          bool consoleCursorVisible);
+    bool emitPendingOutput(size_t byteBudget=0);
+    void finishPendingOutput(bool deferred);
+    bool emitScrollingSlice(size_t byteBudget);
+    bool shouldDeferFrame();
+    void finishOutputFrame();
+    void endTerminalFrame();
     void directScrapeOutput(const ConsoleScreenBufferInfo &info,
                             bool consoleCursorVisible);
+    bool cursorOnlyOutput(const ConsoleScreenBufferInfo &info,
+                          bool consoleCursorVisible);
+    void emitCursorOutput(const ConsoleScreenBufferInfo &info,
+                          bool consoleCursorVisible);
+    bool incrementalDirectRead(const ConsoleScreenBufferInfo &info,
+                               const SmallRect &scrapeRect);
+    void emitDirectOutput(const ConsoleScreenBufferInfo &info,
+                          bool consoleCursorVisible,
+                          const SmallRect &scrapeRect);
+    bool detectDirectModeScroll(const SmallRect &scrapeRect,
+                                int &top, int &bottom, int &delta);
     bool scrollingScrapeOutput(const ConsoleScreenBufferInfo &info,
                                bool consoleCursorVisible,
                                bool tentative);
+    bool incrementalScrapeOutput(const ConsoleScreenBufferInfo &info,
+                                 bool consoleCursorVisible);
+    int64_t encodeScrollingLines(int64_t firstVirtLine,
+                                 int64_t stopVirtLine,
+                                 int64_t cursorLine,
+                                 int cursorColumn,
+                                 bool &sawModifiedLine,
+                                 size_t byteBudget);
+    void sortRowHashIndex();
+    int detectScrollByFingerprint(const ConsoleScreenBufferInfo &info);
+    bool recoverConsoleTracking(const ConsoleScreenBufferInfo &info);
     void syncMarkerText(CHAR_INFO (&output)[SYNC_MARKER_LEN]);
-    int findSyncMarker();
+    bool matchesSyncSignature(const CHAR_INFO *cells) const;
+    int findSyncMarker(const ConsoleScreenBufferInfo &info);
     void createSyncMarker(int row);
+    bool tryContentSyncAnchor(int row, const ConsoleScreenBufferInfo &info);
 
 private:
     Win32Console &m_console;
-    Win32ConsoleBuffer *m_consoleBuffer = nullptr;
+    ConsoleBuffer *m_consoleBuffer = nullptr;
     std::unique_ptr<Terminal> m_terminal;
+    const int m_bufferLineCount;
+    const int m_syncMarkerMargin;
+    const int m_maxWidth;
 
     int m_syncRow = -1;
     unsigned int m_syncCounter = 0;
+    // What findSyncMarker looks for in column 0 at m_syncRow: the marker
+    // text createSyncMarker wrote, or, with m_syncIsContent, console content
+    // that was unique when tryContentSyncAnchor chose it.
+    CHAR_INFO m_syncSignature[SYNC_MARKER_LEN] = {};
+    bool m_syncIsContent = false;
+    // How far the marker moved at the last scrape that saw it move, which
+    // sizes findSyncMarker's first, bounded search.
+    int m_lastSyncScroll = 0;
+    std::vector<CHAR_INFO> m_syncColumn;
+    bool m_fingerprintScroll = false;
+    bool m_scrollRegionOutput = false;
+    std::vector<std::pair<uint64_t, int>> m_rowHashIndex;
+    std::vector<int> m_scrollVotes;
+
+    // While dormant, the buffer as it was when the scraper stopped reading.
+    bool m_dormant = false;
+    ConsoleScreenBufferInfo m_dormantInfo;
 
     bool m_directMode = false;
+    bool m_plannedResize = false;
+    int m_smallFontColumns = -1;
+    Coord m_largestWindowSize;
     Coord m_ptySize;
     int64_t m_scrapedLineCount = 0;
+    uint64_t m_resyncCount = 0;
+    uint64_t m_optimisticRetries = 0;
+    int m_optimisticMisses = 0;
+    int m_optimisticSkip = 0;
+    bool m_repaintPending = false;
     int64_t m_scrolledCount = 0;
     int64_t m_maxBufferedLine = -1;
+    // The first line whose saved copy matches the console, as of the time it
+    // left the window.  Lines above it were never read.
+    int64_t m_firstTrackedLine = 0;
+    bool m_trimClears = false;
     LargeConsoleReadBuffer m_readBuffer;
-    std::vector<ConsoleLine> m_bufferData;
+    std::unique_ptr<ConsoleFrameRecorder> m_frameRecorder;
+    ConsoleLineArena m_bufferData;
     int m_dirtyWindowTop = -1;
     int m_dirtyLineCount = 0;
+
+    // The scrolling-mode tracking, set aside while a full-screen program's
+    // own buffer is active and the terminal shows its alternate screen.  On
+    // the way back, the saved lines are still what the terminal's main
+    // screen shows, so only the lines that differ are resent.
+    struct ScrollingState {
+        ConsoleLineArena bufferData;
+        Coord ptySize;
+        int usedColumns = -1;
+        int syncRow = -1;
+        CHAR_INFO syncSignature[SYNC_MARKER_LEN];
+        bool syncIsContent = false;
+        int64_t scrapedLineCount = 0;
+        int64_t scrolledCount = 0;
+        int64_t maxBufferedLine = -1;
+        int64_t firstTrackedLine = 0;
+        int dirtyWindowTop = -1;
+        int dirtyLineCount = 0;
+    };
+    std::unique_ptr<ScrollingState> m_savedScrolling;
+
+    // The terminal output of a capture, encoded by flushOutput.
+    bool m_deferOutput = false;
+    PendingOutput m_pendingOutput;
+    uint64_t m_linesBeforeScrape = 0;
+    uint64_t m_inputWritten = 0;
+    uint64_t m_capturedInputWritten = 0;
+
+    // The frame rate cap.
+    int m_minFrameIntervalMs = 0;
+    DWORD m_lastFrameTick = 0;
+    bool m_frameDeferred = false;
+    bool m_holdFrames = false;
+
+    // State for the incremental read paths.
+    bool m_hasDirtyHint = false;
+    ConsoleEventHook::DirtyRegion m_dirtyHint;
+    bool m_incrementalReady = false;
+    DWORD m_lastFullScrapeTick = 0;
+    SmallRect m_lastScrapeWindowRect;
+    Coord m_lastScrapeBufferSize;
+
+    // The extent of the text in scrolling mode, for narrower reads: the
+    // number of leading columns that hold anything but m_fillCell, or -1 if
+    // unknown.
+    int m_usedColumns = -1;
+    CHAR_INFO m_fillCell = {};
+    DWORD m_lastFullWidthReadTick = 0;
+
+    // The output mode of the buffer last scraped, for the attribute mask.
+    const ConsoleBuffer *m_outputModeBuffer = nullptr;
+    ProbedValue<DWORD> m_outputMode {
+        ConsoleStateProbe::kOutputModeIntervalMs };
+    // The attribute mask, and the generations of the state it came from.
+    bool m_maskValid = false;
+    uint32_t m_maskCodePageGeneration = 0;
+    uint32_t m_maskOutputModeGeneration = 0;
+    WORD m_attributesMask = static_cast<WORD>(~0);
 };
 
 #endif // AGENT_SCRAPER_H
@@ -0,0 +1,215 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "ScrollbackHistory.h"
+
+#include <algorithm>
+
+#include "../shared/Buffer.h"
+#include "../shared/WinptyAssert.h"
+
+namespace {
+
+// Sealed lines are packed into chunks of about this size, which are the unit
+// of discarding.
+const size_t kChunkBytes = 64 * 1024;
+
+static void appendVarint(std::string &out, uint32_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static uint32_t readVarint(const std::string &in, size_t &pos) {
+    uint32_t ret = 0;
+    for (int shift = 0; pos < in.size(); shift += 7) {
+        const uint8_t byte = static_cast<uint8_t>(in[pos++]);
+        ret |= static_cast<uint32_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+    return ret;
+}
+
+// Returns the position just past the encoded line at `pos`.
+static size_t skipLine(const std::string &in, size_t pos) {
+    const uint32_t textSize = readVarint(in, pos);
+    pos += textSize;
+    const uint32_t runCount = readVarint(in, pos);
+    for (uint32_t i = 0; i < runCount; ++i) {
+        readVarint(in, pos);
+        readVarint(in, pos);
+    }
+    return pos;
+}
+
+static void appendLineReply(WriteBuffer &reply, const std::string &in,
+                            size_t pos) {
+    const uint32_t textSize = readVarint(in, pos);
+    ASSERT(pos + textSize <= in.size());
+    reply.putInt32(static_cast<int32_t>(textSize));
+    reply.putRawData(in.data() + pos, textSize);
+    pos += textSize;
+    const uint32_t runCount = readVarint(in, pos);
+    reply.putInt32(static_cast<int32_t>(runCount));
+    for (uint32_t i = 0; i < runCount; ++i) {
+        reply.putInt32(static_cast<int32_t>(readVarint(in, pos)));
+        reply.putInt32(static_cast<int32_t>(readVarint(in, pos)));
+    }
+}
+
+} // anonymous namespace
+
+ScrollbackHistory::ScrollbackHistory(size_t limitBytes,
+                                     size_t openLineCount) :
+    m_limitBytes(limitBytes),
+    m_openLineCount(openLineCount)
+{
+}
+
+void ScrollbackHistory::reset(int64_t newLine)
+{
+    sealAll();
+    m_tailStart = newLine;
+}
+
+void ScrollbackHistory::putLine(int64_t line, const std::string &text,
+                                const AttributeRuns &runs)
+{
+    if (line < m_tailStart) {
+        // The line was already sealed.
+        return;
+    }
+    if (line - m_tailStart >
+            static_cast<int64_t>(m_tail.size() + m_openLineCount)) {
+        // A jump this far can't be a continuation.  Start over instead of
+        // filling the gap with blank lines.
+        reset(line);
+    }
+
+    std::string &encoded = m_encodeBuffer;
+    encoded.clear();
+    appendVarint(encoded, static_cast<uint32_t>(text.size()));
+    encoded.append(text);
+    appendVarint(encoded, static_cast<uint32_t>(runs.size()));
+    for (const auto &run : runs) {
+        appendVarint(encoded, run.first);
+        appendVarint(encoded, run.second);
+    }
+
+    const size_t index = static_cast<size_t>(line - m_tailStart);
+    while (m_tail.size() <= index) {
+        // A line that was never sent is blank: no text and no runs.
+        m_tail.push_back(std::string(2, '\0'));
+        m_tailBytes += 2;
+    }
+    m_tailBytes -= m_tail[index].size();
+    m_tail[index] = encoded;
+    m_tailBytes += encoded.size();
+
+    // Seal lines once they're too old to be resent, or sooner if the open
+    // lines alone would crowd out the sealed ones.
+    while (m_tail.size() > m_openLineCount ||
+            (m_tail.size() > 1 && m_tailBytes > m_limitBytes / 2)) {
+        sealLine();
+    }
+    trimToLimit();
+}
+
+void ScrollbackHistory::sealLine()
+{
+    ASSERT(!m_tail.empty());
+    if (m_chunks.empty() || m_chunks.back().data.size() >= kChunkBytes) {
+        if (!m_chunks.empty()) {
+            Chunk &full = m_chunks.back();
+            m_chunkBytes -= full.data.capacity();
+            full.data.shrink_to_fit();
+            m_chunkBytes += full.data.capacity();
+        }
+        m_chunks.push_back(Chunk());
+    }
+    Chunk &chunk = m_chunks.back();
+    m_chunkBytes -= chunk.data.capacity();
+    chunk.data.append(m_tail.front());
+    m_chunkBytes += chunk.data.capacity();
+    ++chunk.lineCount;
+    ++m_sealedLines;
+    m_tailBytes -= m_tail.front().size();
+    m_tail.pop_front();
+    ++m_tailStart;
+}
+
+void ScrollbackHistory::sealAll()
+{
+    while (!m_tail.empty()) {
+        sealLine();
+    }
+    trimToLimit();
+}
+
+void ScrollbackHistory::trimToLimit()
+{
+    while (!m_chunks.empty() && memoryUsage() > m_limitBytes) {
+        const Chunk &chunk = m_chunks.front();
+        m_chunkBytes -= chunk.data.capacity();
+        m_sealedLines -= chunk.lineCount;
+        m_droppedLines += chunk.lineCount;
+        m_chunks.pop_front();
+    }
+}
+
+// The reply is [int64 firstLine][int32 lineCount] and then for each line,
+// [int32 textSize][text][int32 runCount][int32 size, int32 attributes]...
+// firstLine counts the lines discarded before it.
+void ScrollbackHistory::appendReply(WriteBuffer &reply,
+                                    uint64_t maxLines) const
+{
+    const uint64_t total = m_sealedLines + m_tail.size();
+    const uint64_t count = std::min<uint64_t>(
+        std::min<uint64_t>(total, maxLines), INT32_MAX);
+    uint64_t skip = total - count;
+    reply.putInt64(static_cast<int64_t>(m_droppedLines + skip));
+    reply.putInt32(static_cast<int32_t>(count));
+    for (const Chunk &chunk : m_chunks) {
+        if (skip >= chunk.lineCount) {
+            skip -= chunk.lineCount;
+            continue;
+        }
+        size_t pos = 0;
+        for (uint64_t i = 0; i < chunk.lineCount; ++i) {
+            if (skip > 0) {
+                --skip;
+            } else {
+                appendLineReply(reply, chunk.data, pos);
+            }
+            pos = skipLine(chunk.data, pos);
+        }
+    }
+    for (const std::string &line : m_tail) {
+        if (skip > 0) {
+            --skip;
+        } else {
+            appendLineReply(reply, line, 0);
+        }
+    }
+}
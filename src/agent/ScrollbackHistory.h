@@ -0,0 +1,79 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_SCROLLBACK_HISTORY_H
+#define AGENT_SCROLLBACK_HISTORY_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+class WriteBuffer;
+
+// An append-only record of the lines sent to the terminal, so that a client
+// attaching later can fetch the scrollback (winpty_get_history).
+//
+// Each line is stored as UTF-8 text plus a run-length encoding of its
+// attributes, with the lengths measured in bytes of text.  The most recent
+// lines stay individually replaceable, because the scraper may still resend
+// them.  Older lines are sealed into chunks, and the oldest chunks are
+// discarded to keep the total under the memory limit.
+class ScrollbackHistory {
+public:
+    typedef std::vector<std::pair<uint32_t, uint16_t>> AttributeRuns;
+
+    // The scraper can resend any line still in the console buffer, so keep
+    // openLineCount (the buffer's line count) lines open.
+    ScrollbackHistory(size_t limitBytes, size_t openLineCount);
+    // The terminal's line numbering restarts at newLine.
+    void reset(int64_t newLine);
+    void putLine(int64_t line, const std::string &text,
+                 const AttributeRuns &runs);
+    // Appends the newest lines (up to maxLines) in the GetHistory reply
+    // format.
+    void appendReply(WriteBuffer &reply, uint64_t maxLines) const;
+    size_t memoryUsage() const { return m_chunkBytes + m_tailBytes; }
+
+private:
+    struct Chunk {
+        uint64_t lineCount = 0;
+        std::string data;
+    };
+    void sealLine();
+    void sealAll();
+    void trimToLimit();
+
+    const size_t m_limitBytes;
+    const size_t m_openLineCount;
+    std::deque<Chunk> m_chunks;
+    size_t m_chunkBytes = 0;
+    uint64_t m_droppedLines = 0;
+    uint64_t m_sealedLines = 0;
+    // Encoded lines for terminal lines [m_tailStart, m_tailStart + size).
+    int64_t m_tailStart = 0;
+    std::deque<std::string> m_tail;
+    size_t m_tailBytes = 0;
+    std::string m_encodeBuffer;
+};
+
+#endif // AGENT_SCROLLBACK_HISTORY_H
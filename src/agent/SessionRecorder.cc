@@ -0,0 +1,254 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "SessionRecorder.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "../include/winpty_constants.h"
+#include "../shared/DebugClient.h"
+#include "../shared/StringUtil.h"
+#include "../shared/WinptyAssert.h"
+#include "../shared/winpty_snprintf.h"
+
+namespace {
+
+// Records beyond this backlog are dropped while the disk catches up, rather
+// than letting it grow the agent's memory.
+const size_t kMaxPendingBytes = 64 * 1024 * 1024;
+
+const char kBinaryMagic[8] = { 'W', 'P', 'T', 'Y', 'R', 'E', 'C', 1 };
+const uint32_t kBinaryRecordOutput = 0;
+const uint32_t kBinaryRecordResize = 1;
+
+// Windows is little-endian, so the fields are copied as-is.
+template <typename T>
+void appendRaw(std::string &out, T value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void appendJsonString(std::string &out, const char *data, size_t size)
+{
+    out.push_back('"');
+    for (size_t i = 0; i < size; ++i) {
+        const unsigned char ch = data[i];
+        if (ch == '"' || ch == '\\') {
+            out.push_back('\\');
+            out.push_back(ch);
+        } else if (ch == '\n') {
+            out.append("\\n");
+        } else if (ch == '\r') {
+            out.append("\\r");
+        } else if (ch < 0x20) {
+            char escape[8];
+            winpty_snprintf(escape, "\\u%04x", ch);
+            out.append(escape);
+        } else {
+            // The terminal only writes whole UTF-8 characters.
+            out.push_back(ch);
+        }
+    }
+    out.push_back('"');
+}
+
+} // anonymous namespace
+
+std::unique_ptr<SessionRecorder> SessionRecorder::create(
+    const std::wstring &path, int format, int cols, int rows)
+{
+    ASSERT(format == WINPTY_RECORDING_ASCIICAST ||
+           format == WINPTY_RECORDING_BINARY);
+    OwnedHandle file(CreateFileW(path.c_str(), GENERIC_WRITE,
+                                 FILE_SHARE_READ, nullptr, CREATE_ALWAYS,
+                                 FILE_FLAG_OVERLAPPED, nullptr));
+    if (file.get() == INVALID_HANDLE_VALUE) {
+        file.release();
+        trace("Could not create the recording file %s: error %u",
+              utf8FromWide(path).c_str(),
+              static_cast<unsigned int>(GetLastError()));
+        return nullptr;
+    }
+    OwnedHandle event(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+    ASSERT(event.get() != nullptr && "CreateEventW failed");
+    std::unique_ptr<SessionRecorder> ret(
+        new SessionRecorder(std::move(file), std::move(event), format));
+    ret->appendHeader(cols, rows);
+    ret->service();
+    return ret;
+}
+
+SessionRecorder::SessionRecorder(OwnedHandle file, OwnedHandle event,
+                                 int format) :
+    m_file(std::move(file)),
+    m_event(std::move(event)),
+    m_format(format)
+{
+}
+
+// Writes out what's left.  This is the only place the agent waits for the
+// disk.
+SessionRecorder::~SessionRecorder()
+{
+    while (!m_failed && (m_writing || !m_pending.empty())) {
+        if (!m_writing || finishWrite(true)) {
+            startWrite();
+        }
+    }
+    if (m_droppedBytes > 0) {
+        trace("Recording dropped %llu bytes of output",
+              static_cast<unsigned long long>(m_droppedBytes));
+    }
+}
+
+void SessionRecorder::appendHeader(int cols, int rows)
+{
+    if (m_format == WINPTY_RECORDING_ASCIICAST) {
+        char header[64];
+        winpty_snprintf(header, "{\"version\": 2, \"width\": %d, "
+                        "\"height\": %d}\n", cols, rows);
+        m_pending.append(header);
+    } else {
+        m_pending.append(kBinaryMagic, sizeof(kBinaryMagic));
+        appendRaw(m_pending, static_cast<uint32_t>(cols));
+        appendRaw(m_pending, static_cast<uint32_t>(rows));
+    }
+}
+
+void SessionRecorder::recordOutput(const char *data, size_t size)
+{
+    if (m_failed || size == 0) {
+        return;
+    }
+    if (m_pending.size() + size > kMaxPendingBytes) {
+        m_droppedBytes += size;
+        return;
+    }
+    if (m_format == WINPTY_RECORDING_ASCIICAST) {
+        appendAsciicastEvent("o", data, size);
+    } else {
+        beginRecord(kBinaryRecordOutput, data, size);
+    }
+    service();
+}
+
+void SessionRecorder::recordResize(int cols, int rows)
+{
+    if (m_failed) {
+        return;
+    }
+    if (m_format == WINPTY_RECORDING_ASCIICAST) {
+        char size[32];
+        const int len = winpty_snprintf(size, "%dx%d", cols, rows);
+        appendAsciicastEvent("r", size, len);
+    } else {
+        const uint32_t payload[2] = {
+            static_cast<uint32_t>(cols), static_cast<uint32_t>(rows)
+        };
+        beginRecord(kBinaryRecordResize,
+                    reinterpret_cast<const char*>(payload), sizeof(payload));
+    }
+    service();
+}
+
+void SessionRecorder::beginRecord(uint32_t type, const char *data,
+                                  size_t size)
+{
+    appendRaw(m_pending, static_cast<uint64_t>(m_clock.elapsedUs()));
+    appendRaw(m_pending, type);
+    appendRaw(m_pending, static_cast<uint32_t>(size));
+    m_pending.append(data, size);
+}
+
+void SessionRecorder::appendAsciicastEvent(const char *code,
+                                           const char *data, size_t size)
+{
+    char prefix[64];
+    winpty_snprintf(prefix, "[%.6f, \"%s\", ", m_clock.elapsed(), code);
+    m_pending.append(prefix);
+    appendJsonString(m_pending, data, size);
+    m_pending.append("]\n");
+}
+
+void SessionRecorder::service()
+{
+    if (m_failed) {
+        return;
+    }
+    if (m_writing && !finishWrite(false)) {
+        return;
+    }
+    if (!m_pending.empty()) {
+        startWrite();
+    }
+}
+
+// Returns whether the write in progress has finished.  A failed write
+// stops the recording.
+bool SessionRecorder::finishWrite(bool wait)
+{
+    ASSERT(m_writing);
+    DWORD written = 0;
+    if (!GetOverlappedResult(m_file.get(), &m_over, &written, wait)) {
+        if (GetLastError() == ERROR_IO_INCOMPLETE) {
+            return false;
+        }
+        trace("Recording write failed: error %u -- stopping the recording",
+              static_cast<unsigned int>(GetLastError()));
+        m_writing = false;
+        m_failed = true;
+        return false;
+    }
+    m_writing = false;
+    m_fileOffset += written;
+    if (written < m_writeBuffer.size()) {
+        // Put the rest back in front of the newer records.
+        m_pending.insert(0, m_writeBuffer, written, std::string::npos);
+    }
+    m_writeBuffer.clear();
+    return true;
+}
+
+void SessionRecorder::startWrite()
+{
+    ASSERT(!m_writing);
+    if (m_pending.empty()) {
+        return;
+    }
+    m_writeBuffer.swap(m_pending);
+    m_over = OVERLAPPED();
+    m_over.Offset = static_cast<DWORD>(m_fileOffset);
+    m_over.OffsetHigh = static_cast<DWORD>(m_fileOffset >> 32);
+    m_over.hEvent = m_event.get();
+    ResetEvent(m_event.get());
+    const DWORD size = static_cast<DWORD>(
+        std::min<size_t>(m_writeBuffer.size(), 0x7fffffff));
+    if (!WriteFile(m_file.get(), m_writeBuffer.data(), size, nullptr,
+                   &m_over) && GetLastError() != ERROR_IO_PENDING) {
+        trace("Recording write failed: error %u -- stopping the recording",
+              static_cast<unsigned int>(GetLastError()));
+        m_failed = true;
+        return;
+    }
+    m_writing = true;
+}
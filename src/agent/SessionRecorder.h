@@ -0,0 +1,75 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_SESSION_RECORDER_H
+#define AGENT_SESSION_RECORDER_H
+
+#include <windows.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "../shared/OwnedHandle.h"
+#include "../shared/TimeMeasurement.h"
+
+// Records the output sent to the client, with the time of each write, in a
+// WINPTY_RECORDING_xxx format.  Records are appended to one buffer while the
+// other is written with a single overlapped WriteFile, so recording never
+// waits for the disk.  service starts the next write once the last one has
+// finished; the event loop calls it, as does every record.
+class SessionRecorder {
+public:
+    // Returns null, having traced why, if the file can't be created.
+    static std::unique_ptr<SessionRecorder> create(const std::wstring &path,
+                                                   int format,
+                                                   int cols, int rows);
+    ~SessionRecorder();
+    void recordOutput(const char *data, size_t size);
+    void recordResize(int cols, int rows);
+    void service();
+
+    SessionRecorder(const SessionRecorder &other) = delete;
+    SessionRecorder &operator=(const SessionRecorder &other) = delete;
+
+private:
+    SessionRecorder(OwnedHandle file, OwnedHandle event, int format);
+    void appendHeader(int cols, int rows);
+    void beginRecord(uint32_t type, const char *data, size_t size);
+    void appendAsciicastEvent(const char *code, const char *data,
+                              size_t size);
+    bool finishWrite(bool wait);
+    void startWrite();
+
+    OwnedHandle m_file;
+    OwnedHandle m_event;
+    const int m_format;
+    TimeMeasurement m_clock;
+    OVERLAPPED m_over = {};
+    bool m_writing = false;
+    bool m_failed = false;
+    uint64_t m_fileOffset = 0;
+    uint64_t m_droppedBytes = 0;
+    // m_writeBuffer belongs to the WriteFile in progress, if any.
+    std::string m_pending;
+    std::string m_writeBuffer;
+};
+
+#endif // AGENT_SESSION_RECORDER_H
@@ -21,6 +21,7 @@
 #ifndef SIMPLE_POOL_H
 #define SIMPLE_POOL_H
 
+#include <stddef.h>
 #include <stdlib.h>
 
 #include <vector>
@@ -33,6 +34,10 @@ public:
     ~SimplePool();
     T *alloc();
     void clear();
+    size_t heapBytes() const {
+        return m_chunks.capacity() * sizeof(Chunk) +
+            m_chunks.size() * chunkSize * sizeof(T);
+    }
 private:
     struct Chunk {
         size_t count;
@@ -72,4 +77,116 @@ T *SimplePool<T, chunkSize>::alloc() {
     return ret;
 }
 
+// A bump allocator for short-lived scratch memory.  alloc hands out memory
+// from the newest chunk and nothing is freed until reset, which releases
+// everything at once.  When a round needed more than one chunk, reset merges
+// them into a single chunk that size, so a steady workload stops calling
+// malloc after the first few rounds.
+class BumpArena {
+public:
+    BumpArena() {}
+    ~BumpArena() { releaseChunks(); }
+    void *alloc(size_t size, size_t align = kDefaultAlign);
+    void reset();
+    size_t heapBytes() const {
+        size_t ret = m_chunks.capacity() * sizeof(Chunk);
+        for (size_t i = 0; i < m_chunks.size(); ++i) {
+            ret += m_chunks[i].size;
+        }
+        return ret;
+    }
+private:
+    BumpArena(const BumpArena &other);
+    BumpArena &operator=(const BumpArena &other);
+    void releaseChunks();
+    enum { kDefaultAlign = 16, kMinChunkSize = 4096 };
+    struct Chunk {
+        char *data;
+        size_t size;
+        size_t used;
+    };
+    std::vector<Chunk> m_chunks;
+};
+
+inline void BumpArena::releaseChunks() {
+    for (size_t i = 0; i < m_chunks.size(); ++i) {
+        free(m_chunks[i].data);
+    }
+    m_chunks.clear();
+}
+
+inline void BumpArena::reset() {
+    if (m_chunks.size() == 1) {
+        m_chunks[0].used = 0;
+        return;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < m_chunks.size(); ++i) {
+        total += m_chunks[i].size;
+    }
+    releaseChunks();
+    if (total > 0) {
+        char *newData = reinterpret_cast<char*>(malloc(total));
+        ASSERT(newData != NULL);
+        Chunk newChunk = { newData, total, 0 };
+        m_chunks.push_back(newChunk);
+    }
+}
+
+// align must be a power of two.  malloc's alignment covers kDefaultAlign.
+inline void *BumpArena::alloc(size_t size, size_t align) {
+    ASSERT(align != 0 && (align & (align - 1)) == 0);
+    if (size == 0) {
+        size = 1;
+    }
+    if (!m_chunks.empty()) {
+        Chunk &chunk = m_chunks.back();
+        const size_t offset = (chunk.used + align - 1) & ~(align - 1);
+        if (offset <= chunk.size && size <= chunk.size - offset) {
+            chunk.used = offset + size;
+            return chunk.data + offset;
+        }
+    }
+    size_t newSize = m_chunks.empty()
+        ? static_cast<size_t>(kMinChunkSize) : m_chunks.back().size * 2;
+    if (newSize < size + align) {
+        newSize = size + align;
+    }
+    char *newData = reinterpret_cast<char*>(malloc(newSize));
+    ASSERT(newData != NULL);
+    Chunk newChunk = { newData, newSize, size };
+    m_chunks.push_back(newChunk);
+    return newData;
+}
+
+// Lets a standard container take its storage from a BumpArena.  deallocate
+// does nothing; the memory comes back when the arena is reset, so the
+// container must be gone by then.
+template <typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    explicit ArenaAllocator(BumpArena &arena) : m_arena(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : m_arena(&other.arena()) {}
+    T *allocate(size_t n) {
+        return reinterpret_cast<T*>(
+            m_arena->alloc(n * sizeof(T), alignof(T)));
+    }
+    void deallocate(T *, size_t) {}
+    BumpArena &arena() const { return *m_arena; }
+private:
+    BumpArena *m_arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+    return &a.arena() == &b.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+    return !(a == b);
+}
+
 #endif // SIMPLE_POOL_H
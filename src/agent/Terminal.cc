@@ -24,13 +24,20 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <string>
 
+#include "CharInfoKernels.h"
+#include "EscapeBuilder.h"
 #include "NamedPipe.h"
+#include "ScrollbackHistory.h"
+#include "SessionRecorder.h"
 #include "UnicodeEncoding.h"
+#include "../include/winpty_constants.h"
 #include "../shared/DebugClient.h"
+#include "../shared/StringBuilder.h"
+#include "../shared/StringUtil.h"
 #include "../shared/WinptyAssert.h"
-#include "../shared/winpty_snprintf.h"
 
 #define CSI "\x1b["
 
@@ -69,19 +76,11 @@ const int SGR_FORE_HI = 90;
 const int SGR_BACK = 40;
 const int SGR_BACK_HI = 100;
 
-namespace {
+// Beyond these, a frame's damage record just says to redraw everything.
+const size_t kMaxDamageRects = 512;
+const size_t kMaxDamageScrolls = 64;
 
-static void outUInt(std::string &out, unsigned int n)
-{
-    char buf[32];
-    char *pbuf = &buf[32];
-    *(--pbuf) = '\0';
-    do {
-        *(--pbuf) = '0' + n % 10;
-        n /= 10;
-    } while (n != 0);
-    out.append(pbuf);
-}
+namespace {
 
 static void outputSetColorSgrParams(std::string &out, bool isFore, int color)
 {
@@ -94,15 +93,181 @@ static void outputSetColorSgrParams(std::string &out, bool isFore, int color)
         // ignore a 3X/4X code if it's followed by a 9X/10X code.  Therefore,
         // output a 3X/4X code as a fallback, then override it.
         const int colorBase = color & ~FLAG_BRIGHT;
-        outUInt(out, sgrBase + colorBase);
+        appendDecimal(out, sgrBase + colorBase);
         out.push_back(';');
-        outUInt(out, sgrBase + (SGR_FORE_HI - SGR_FORE) + colorBase);
+        appendDecimal(out, sgrBase + (SGR_FORE_HI - SGR_FORE) + colorBase);
     } else {
-        outUInt(out, sgrBase + color);
+        appendDecimal(out, sgrBase + color);
+    }
+}
+
+static inline unsigned int fixSpecialCharacters(unsigned int ch)
+{
+    if (ch <= 0x1b) {
+        switch (ch) {
+            // The Windows Console has a popup window (e.g. that appears with
+            // F7) that is sometimes bordered with box-drawing characters.
+            // With the Japanese and Korean system locales (CP932 and CP949),
+            // the UnicodeChar values for the box-drawing characters are 1
+            // through 6.  Detect this and map the values to the correct
+            // Unicode values.
+            //
+            // N.B. In the English locale, the UnicodeChar values are correct,
+            // and they identify single-line characters rather than
+            // double-line.  In the Chinese Simplified and Traditional locales,
+            // the popups use ASCII characters instead.
+            case 1: return 0x2554; // BOX DRAWINGS DOUBLE DOWN AND RIGHT
+            case 2: return 0x2557; // BOX DRAWINGS DOUBLE DOWN AND LEFT
+            case 3: return 0x255A; // BOX DRAWINGS DOUBLE UP AND RIGHT
+            case 4: return 0x255D; // BOX DRAWINGS DOUBLE UP AND LEFT
+            case 5: return 0x2551; // BOX DRAWINGS DOUBLE VERTICAL
+            case 6: return 0x2550; // BOX DRAWINGS DOUBLE HORIZONTAL
+
+            // Convert an escape character to some other character.  This
+            // conversion only applies to console cells containing an escape
+            // character.  In newer versions of Windows 10 (e.g. 10.0.10586),
+            // the non-legacy console recognizes escape sequences in
+            // WriteConsole and interprets them without writing them to the
+            // cells of the screen buffer.  In that case, the conversion here
+            // does not apply.
+            case 0x1b: return '?';
+        }
     }
+    return ch;
 }
 
-static void outputSetColor(std::string &out, int color)
+static inline bool isFullWidthCharacter(const CHAR_INFO *data, int width)
+{
+    if (width < 2) {
+        return false;
+    }
+    return
+        (data[0].Attributes & WINPTY_COMMON_LVB_LEADING_BYTE) &&
+        (data[1].Attributes & WINPTY_COMMON_LVB_TRAILING_BYTE) &&
+        data[0].Char.UnicodeChar == data[1].Char.UnicodeChar;
+}
+
+// Scan to find a single Unicode Scalar Value.  Full-width characters occupy
+// two console cells, and this code also tries to handle UTF-16 surrogate
+// pairs.
+//
+// Windows expands at least some wide characters outside the Basic
+// Multilingual Plane into four cells, such as U+20000:
+//   1. 0xD840, attr=0x107
+//   2. 0xD840, attr=0x207
+//   3. 0xDC00, attr=0x107
+//   4. 0xDC00, attr=0x207
+// Even in the Traditional Chinese locale on Windows 10, this text is rendered
+// as two boxes, but if those boxes are copied-and-pasted, the character is
+// copied correctly.
+static inline void scanUnicodeScalarValue(
+    const CHAR_INFO *data, int width,
+    int &outCellCount, unsigned int &outCharValue)
+{
+    ASSERT(width >= 1);
+
+    const int w1 = isFullWidthCharacter(data, width) ? 2 : 1;
+    const wchar_t c1 = data[0].Char.UnicodeChar;
+
+    if ((c1 & 0xF800) == 0xD800) {
+        // The first cell is either a leading or trailing surrogate pair.
+        if ((c1 & 0xFC00) != 0xD800 ||
+                width <= w1 ||
+                ((data[w1].Char.UnicodeChar & 0xFC00) != 0xDC00)) {
+            // Invalid surrogate pair
+            outCellCount = w1;
+            outCharValue = '?';
+        } else {
+            // Valid surrogate pair
+            outCellCount = w1 + (isFullWidthCharacter(&data[w1], width - w1) ? 2 : 1);
+            outCharValue = decodeSurrogatePair(c1, data[w1].Char.UnicodeChar);
+        }
+    } else {
+        outCellCount = w1;
+        outCharValue = c1;
+    }
+}
+
+// Appends the UTF-8 encoding of the run of cells in [begin, end) that each
+// hold a non-ASCII BMP character, either in one cell or as a full-width
+// lead/trail pair, and that have the given color (or any color, if color is
+// -1).  This covers most CJK text in one tight loop.  Returns the number of
+// cells consumed.  A cell that needs scanUnicodeScalarValue's handling (a
+// surrogate, or a lead or trail cell outside a proper pair) ends the run.
+static int appendNonAsciiRun(std::string &out, const CHAR_INFO *cells,
+                             int begin, int end, int color)
+{
+    const WORD lvbMask =
+        WINPTY_COMMON_LVB_LEADING_BYTE | WINPTY_COMMON_LVB_TRAILING_BYTE;
+    int i = begin;
+    while (i < end) {
+        const CHAR_INFO &cell = cells[i];
+        const unsigned int ch = cell.Char.UnicodeChar;
+        if (ch < 0x80 || (ch & 0xF800) == 0xD800 ||
+                (color != -1 &&
+                    (cell.Attributes & COLOR_ATTRIBUTE_MASK) != color)) {
+            break;
+        }
+        int cellCount = 1;
+        const WORD lvb = cell.Attributes & lvbMask;
+        if (lvb == WINPTY_COMMON_LVB_LEADING_BYTE) {
+            if (i + 2 > end ||
+                    cells[i + 1].Char.UnicodeChar != cell.Char.UnicodeChar ||
+                    !(cells[i + 1].Attributes &
+                        WINPTY_COMMON_LVB_TRAILING_BYTE)) {
+                break;
+            }
+            cellCount = 2;
+        } else if (lvb != 0) {
+            break;
+        }
+        char enc[3];
+        const int enclen = encodeUtf8(enc, ch);
+        out.append(enc, enclen);
+        i += cellCount;
+    }
+    return i - begin;
+}
+
+// Converts UTF-8 to UTF-16LE, writing at most 2 * size bytes to `out`, and
+// returns the byte count.  ASCII, which is nearly all of the output, takes a
+// one-byte step.  Malformed input becomes '?', as in sendLine.
+size_t widenUtf8(const char *in, size_t size, char *out)
+{
+    size_t outSize = 0;
+    for (size_t i = 0; i < size;) {
+        const unsigned char byte = in[i];
+        if (byte < 0x80) {
+            out[outSize++] = byte;
+            out[outSize++] = '\0';
+            ++i;
+            continue;
+        }
+        const int len = utf8CharLength(in[i]);
+        wchar_t units[2] = { L'?', 0 };
+        int unitCount = 1;
+        if (len == 0 || i + len > size) {
+            i += 1;
+        } else {
+            unitCount = encodeUtf16(units, decodeUtf8(&in[i]));
+            if (unitCount == 0) {
+                units[0] = L'?';
+                unitCount = 1;
+            }
+            i += len;
+        }
+        for (int j = 0; j < unitCount; ++j) {
+            out[outSize++] = static_cast<char>(units[j]);
+            out[outSize++] = static_cast<char>(units[j] >> 8);
+        }
+    }
+    return outSize;
+}
+
+} // anonymous namespace
+
+// Compute the SGR rendering of a console color.
+void Terminal::buildSgrState(SgrState &state, int color)
 {
     int fore = 0;
     int back = 0;
@@ -158,7 +323,6 @@ static void outputSetColor(std::string &out, int color)
     //  (B) DkGray => DkGray
     //
 
-    out.append(CSI "0");
     if (back == BLACK) {
         if (fore == LTGRAY) {
             // The "default" foreground color.  Use the terminal's
@@ -168,15 +332,15 @@ static void outputSetColor(std::string &out, int color)
             // the terminal were black-on-white.  Sending Bold is not
             // guaranteed to alter the color, but it will make the text
             // visually distinct, so do that instead.
-            out.append(";1");
+            state.bold = true;
         } else if (fore == DKGRAY) {
             // Set the foreground color to DkGray(90) with a fallback
             // of LtGray(37) for terminals that don't handle the 9X SGR
             // parameters (e.g. Eclipse's TM Terminal as of this
             // writing).
-            out.append(";37;90");
+            state.fore = ";37;90";
         } else {
-            outputSetColorSgrParams(out, true, fore);
+            outputSetColorSgrParams(state.fore, true, fore);
         }
     } else if (back == WHITE) {
         // Set the background color using Invert on the default
@@ -184,181 +348,421 @@ static void outputSetColor(std::string &out, int color)
         // background color.
 
         // Use the terminal's inverted colors.
-        out.append(";7");
+        state.inverse = true;
         if (fore == LTGRAY || fore == BLACK) {
             // We're likely mapping Console White to terminal LtGray or
             // Black.  If they are the Console foreground color, then
             // don't set a terminal foreground color to avoid creating
             // invisible text.
         } else {
-            outputSetColorSgrParams(out, false, fore);
+            outputSetColorSgrParams(state.back, false, fore);
         }
     } else {
         // Set the foreground and background to match exactly that in
         // the Windows console.
-        outputSetColorSgrParams(out, true, fore);
-        outputSetColorSgrParams(out, false, back);
+        outputSetColorSgrParams(state.fore, true, fore);
+        outputSetColorSgrParams(state.back, false, back);
     }
     if (fore == back) {
         // The foreground and background colors are exactly equal, so
         // attempt to hide the text using the Conceal SGR parameter,
         // which some terminals support.
-        out.append(";8");
+        state.conceal = true;
     }
     if (color & WINPTY_COMMON_LVB_UNDERSCORE) {
-        out.append(";4");
+        state.underline = true;
     }
+
+    state.full = CSI "0";
+    if (state.bold)         state.full.append(";1");
+    if (state.inverse)      state.full.append(";7");
+    state.full.append(state.fore);
+    state.full.append(state.back);
+    if (state.conceal)      state.full.append(";8");
+    if (state.underline)    state.full.append(";4");
+    state.full.push_back('m');
+    state.valid = true;
+}
+
+// The masked attribute bits are the low byte plus the two high LVB bits, so
+// they fold into a 10-bit index.
+static inline int sgrCacheIndex(int color)
+{
+    return (color & 0xFF) | ((color & 0xC000) >> 6);
+}
+
+const Terminal::SgrState &Terminal::sgrState(int color)
+{
+    ASSERT((color & ~COLOR_ATTRIBUTE_MASK) == 0);
+    if (m_sgrCache.empty()) {
+        m_sgrCache.resize(1 << 10);
+    }
+    SgrState &state = m_sgrCache[sgrCacheIndex(color)];
+    if (!state.valid) {
+        buildSgrState(state, color);
+    }
+    return state;
+}
+
+// Append the SGR sequence that changes the terminal from console color
+// `fromColor` (or an unknown state, if -1) to `toColor`.  The sequences for
+// each color are cached.  Unless the terminal needs something cleared, only
+// the parameters that differ are sent, without the leading reset.
+void Terminal::appendSetColor(std::string &out, int fromColor, int toColor)
+{
+    static const bool deltaSgr = !hasDebugFlag("full_sgr");
+    const SgrState &next = sgrState(toColor);
+    if (!deltaSgr || fromColor == -1) {
+        out.append(next.full);
+        return;
+    }
+    const SgrState &prev = sgrState(fromColor);
+    const bool needsReset =
+        (prev.bold && !next.bold) ||
+        (prev.inverse && !next.inverse) ||
+        (prev.conceal && !next.conceal) ||
+        (prev.underline && !next.underline) ||
+        (!prev.fore.empty() && next.fore.empty()) ||
+        (!prev.back.empty() && next.back.empty());
+    if (needsReset) {
+        out.append(next.full);
+        return;
+    }
+    const size_t origSize = out.size();
+    out.append(CSI);
+    const size_t paramsStart = out.size();
+    if (next.bold && !prev.bold)            out.append(";1");
+    if (next.inverse && !prev.inverse)      out.append(";7");
+    if (next.fore != prev.fore)             out.append(next.fore);
+    if (next.back != prev.back)             out.append(next.back);
+    if (next.conceal && !prev.conceal)      out.append(";8");
+    if (next.underline && !prev.underline)  out.append(";4");
+    if (out.size() == paramsStart) {
+        // The two colors render identically.
+        out.resize(origSize);
+        return;
+    }
+    // Drop the first parameter's separator.
+    out.erase(paramsStart, 1);
     out.push_back('m');
 }
 
-static inline unsigned int fixSpecialCharacters(unsigned int ch)
+// Collect output until endFrame, then send it as one write, bracketed with
+// DEC synchronized-update markers when they are enabled.
+void Terminal::beginFrame()
 {
-    if (ch <= 0x1b) {
-        switch (ch) {
-            // The Windows Console has a popup window (e.g. that appears with
-            // F7) that is sometimes bordered with box-drawing characters.
-            // With the Japanese and Korean system locales (CP932 and CP949),
-            // the UnicodeChar values for the box-drawing characters are 1
-            // through 6.  Detect this and map the values to the correct
-            // Unicode values.
-            //
-            // N.B. In the English locale, the UnicodeChar values are correct,
-            // and they identify single-line characters rather than
-            // double-line.  In the Chinese Simplified and Traditional locales,
-            // the popups use ASCII characters instead.
-            case 1: return 0x2554; // BOX DRAWINGS DOUBLE DOWN AND RIGHT
-            case 2: return 0x2557; // BOX DRAWINGS DOUBLE DOWN AND LEFT
-            case 3: return 0x255A; // BOX DRAWINGS DOUBLE UP AND RIGHT
-            case 4: return 0x255D; // BOX DRAWINGS DOUBLE UP AND LEFT
-            case 5: return 0x2551; // BOX DRAWINGS DOUBLE VERTICAL
-            case 6: return 0x2550; // BOX DRAWINGS DOUBLE HORIZONTAL
+    ASSERT(!m_inFrame);
+    m_inFrame = true;
+    m_frameBuffer.clear();
+    m_damageFull = false;
+    m_damageRects.clear();
+    m_damageScrolls.clear();
+}
 
-            // Convert an escape character to some other character.  This
-            // conversion only applies to console cells containing an escape
-            // character.  In newer versions of Windows 10 (e.g. 10.0.10586),
-            // the non-legacy console recognizes escape sequences in
-            // WriteConsole and interprets them without writing them to the
-            // cells of the screen buffer.  In that case, the conversion here
-            // does not apply.
-            case 0x1b: return '?';
-        }
+void Terminal::endFrame()
+{
+    ASSERT(m_inFrame);
+    m_inFrame = false;
+    if (m_frameBuffer.empty()) {
+        return;
     }
-    return ch;
+    if (m_damageRecords) {
+        appendDamageRecord();
+    }
+    if (m_frameStamps) {
+        appendFrameStamp();
+    }
+    if (m_synchronizedOutput) {
+        m_frameBuffer.append(CSI "?2026l");
+    }
+    if (m_cellOutput) {
+        beginCellRecord(WINPTY_CELL_RECORD_END_FRAME, 0);
+        m_frameBuffer.append(m_cellRecord);
+    }
+    emit(m_frameBuffer.data(), m_frameBuffer.size());
+    m_frameBuffer.clear();
 }
 
-static inline bool isFullWidthCharacter(const CHAR_INFO *data, int width)
+void Terminal::markFrameCapture()
 {
-    if (width < 2) {
-        return false;
+    if (!m_frameStamps) {
+        return;
     }
-    return
-        (data[0].Attributes & WINPTY_COMMON_LVB_LEADING_BYTE) &&
-        (data[1].Attributes & WINPTY_COMMON_LVB_TRAILING_BYTE) &&
-        data[0].Char.UnicodeChar == data[1].Char.UnicodeChar;
+    static const uint64_t freq = []() {
+        LARGE_INTEGER ret;
+        QueryPerformanceFrequency(&ret);
+        return static_cast<uint64_t>(ret.QuadPart);
+    }();
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    // Split the conversion so the multiplication can't overflow.
+    const uint64_t ticks = now.QuadPart;
+    m_frameCaptureUs = ticks / freq * 1000000 + ticks % freq * 1000000 / freq;
 }
 
-// Scan to find a single Unicode Scalar Value.  Full-width characters occupy
-// two console cells, and this code also tries to handle UTF-16 surrogate
-// pairs.
-//
-// Windows expands at least some wide characters outside the Basic
-// Multilingual Plane into four cells, such as U+20000:
-//   1. 0xD840, attr=0x107
-//   2. 0xD840, attr=0x207
-//   3. 0xDC00, attr=0x107
-//   4. 0xDC00, attr=0x207
-// Even in the Traditional Chinese locale on Windows 10, this text is rendered
-// as two boxes, but if those boxes are copied-and-pasted, the character is
-// copied correctly.
-static inline void scanUnicodeScalarValue(
-    const CHAR_INFO *data, int width,
-    int &outCellCount, unsigned int &outCharValue)
+// Appends the frame's WINPTY_FLAG_FRAME_STAMPS stamp to m_frameBuffer.
+void Terminal::appendFrameStamp()
 {
-    ASSERT(width >= 1);
+    ++m_frameSequence;
+    if (m_cellOutput) {
+        const uint64_t payload[3] = {
+            m_frameSequence, m_frameCaptureUs, m_frameInputBytes
+        };
+        beginCellRecord(WINPTY_CELL_RECORD_FRAME_STAMP, sizeof(payload));
+        appendCellPayload(payload, sizeof(payload));
+        m_frameBuffer.append(m_cellRecord);
+        return;
+    }
+    const auto sequence = decOfInt(m_frameSequence);
+    const auto captureUs = decOfInt(m_frameCaptureUs);
+    const auto inputBytes = decOfInt(m_frameInputBytes);
+    m_frameBuffer.append("\x1b]7701;");
+    m_frameBuffer.append(sequence.data(), sequence.size());
+    m_frameBuffer.push_back(';');
+    m_frameBuffer.append(captureUs.data(), captureUs.size());
+    m_frameBuffer.push_back(';');
+    m_frameBuffer.append(inputBytes.data(), inputBytes.size());
+    m_frameBuffer.push_back('\x07');
+}
 
-    const int w1 = isFullWidthCharacter(data, width) ? 2 : 1;
-    const wchar_t c1 = data[0].Char.UnicodeChar;
+void Terminal::write(const char *data, size_t size)
+{
+    m_bytesQueued += size;
+    if (!m_inFrame) {
+        emit(data, size);
+        return;
+    }
+    if (m_frameBuffer.empty() && m_synchronizedOutput) {
+        m_frameBuffer.append(CSI "?2026h");
+    }
+    m_frameBuffer.append(data, size);
+}
 
-    if ((c1 & 0xF800) == 0xD800) {
-        // The first cell is either a leading or trailing surrogate pair.
-        if ((c1 & 0xFC00) != 0xD800 ||
-                width <= w1 ||
-                ((data[w1].Char.UnicodeChar & 0xFC00) != 0xDC00)) {
-            // Invalid surrogate pair
-            outCellCount = w1;
-            outCharValue = '?';
-        } else {
-            // Valid surrogate pair
-            outCellCount = w1 + (isFullWidthCharacter(&data[w1], width - w1) ? 2 : 1);
-            outCharValue = decodeSurrogatePair(c1, data[w1].Char.UnicodeChar);
-        }
+// Hands finished output to the pipe in the output encoding.  The Terminal
+// always writes whole UTF-8 characters, so each call converts on its own.
+void Terminal::emit(const char *data, size_t size)
+{
+    if (m_recorder != nullptr) {
+        m_recorder->recordOutput(data, size);
+    }
+    if (!m_utf16Output && !m_framedOutput) {
+        m_output.write(data, size);
+        copyToSubscribers(data, size);
+        return;
+    }
+    // UTF-16 never takes more than twice the bytes of UTF-8.
+    const size_t prefixSize = m_framedOutput ? 4 : 0;
+    char *const out = m_output.reserveWrite(
+        prefixSize + (m_utf16Output ? size * 2 : size));
+    size_t payloadSize = size;
+    if (m_utf16Output) {
+        payloadSize = widenUtf8(data, size, out + prefixSize);
     } else {
-        outCellCount = w1;
-        outCharValue = c1;
+        memcpy(out + prefixSize, data, size);
+    }
+    if (m_framedOutput) {
+        const uint32_t frameSize = static_cast<uint32_t>(payloadSize);
+        out[0] = static_cast<char>(frameSize);
+        out[1] = static_cast<char>(frameSize >> 8);
+        out[2] = static_cast<char>(frameSize >> 16);
+        out[3] = static_cast<char>(frameSize >> 24);
     }
+    copyToSubscribers(out, prefixSize + payloadSize);
+    m_output.commitWrite(prefixSize + payloadSize);
 }
 
-} // anonymous namespace
+void Terminal::copyToSubscribers(const char *data, size_t size)
+{
+    for (NamedPipe *pipe : m_subscribers) {
+        if (!pipe->isClosed()) {
+            pipe->write(data, size);
+        }
+    }
+}
+
+// A cell stream starts with the hello record, so a subscriber gets its own.
+// The rest of its state comes from a repaint, which the caller arranges.
+void Terminal::addSubscriber(NamedPipe &pipe)
+{
+    ASSERT(!m_inFrame);
+    m_subscribers.push_back(&pipe);
+    if (m_cellOutput) {
+        beginCellHello();
+        pipe.write(m_cellRecord.data(), m_cellRecord.size());
+    }
+}
+
+void Terminal::removeSubscriber(NamedPipe &pipe)
+{
+    m_subscribers.erase(
+        std::remove(m_subscribers.begin(), m_subscribers.end(), &pipe),
+        m_subscribers.end());
+}
+
+void Terminal::sendDsr()
+{
+    static const char kDsr[] = CSI "6n";
+    emit(kDsr, sizeof(kDsr) - 1);
+}
 
 void Terminal::reset(SendClearFlag sendClearFirst, int64_t newLine)
 {
+    if (m_history != nullptr && !m_alternateScreen) {
+        m_history->reset(newLine);
+    }
+    if (m_cellOutput) {
+        const int64_t line = newLine;
+        const uint32_t clear = sendClearFirst == SendClear;
+        beginCellRecord(WINPTY_CELL_RECORD_RESET,
+                        sizeof(line) + sizeof(clear));
+        appendCellPayload(&line, sizeof(line));
+        appendCellPayload(&clear, sizeof(clear));
+        write(m_cellRecord.data(), m_cellRecord.size());
+        m_damageFull = true;
+        return;
+    }
     if (sendClearFirst == SendClear && !m_plainMode) {
         // 0m   ==> reset SGR parameters
         // 1;1H ==> move cursor to top-left position
         // 2J   ==> clear the entire screen
-        m_output.write(CSI "0m" CSI "1;1H" CSI "2J");
+        write(CSI "0m" CSI "1;1H" CSI "2J");
     }
     m_remoteLine = newLine;
     m_remoteColumn = 0;
     m_lineData.clear();
     m_cursorHidden = false;
     m_remoteColor = -1;
+    m_wrapPending = false;
+    // Even after a clear, the line the terminal cursor starts on isn't
+    // assumed blank.
+    m_freshLine = newLine + 1;
 }
 
-void Terminal::sendLine(int64_t line, const CHAR_INFO *lineData, int width,
-                        int cursorColumn)
+// The output pipe now goes to a new client.  Forget the modes sent to the
+// old one; the caller resets the screen and resends the title.
+void Terminal::reattach()
 {
-    ASSERT(width >= 1);
+    ASSERT(!m_inFrame);
+    m_mouseModeEnabled = false;
+    m_alternateScreen = false;
+    m_sentInputAck = -1;
+    m_wrapPending = false;
+    if (m_cellOutput) {
+        sendCellHello();
+    }
+}
 
-    moveTerminalToLine(line);
+bool Terminal::enterAlternateScreen()
+{
+    if (m_plainMode || m_cellOutput) {
+        return false;
+    }
+    if (!m_alternateScreen) {
+        m_alternateScreen = true;
+        m_mainRemoteLine = m_remoteLine;
+        m_mainFreshLine = m_freshLine;
+        write(CSI "?1049h");
+    }
+    return true;
+}
 
-    // If possible, see if we can append to what we've already output for this
-    // line.
-    if (m_lineDataValid) {
-        ASSERT(m_lineData.size() == static_cast<size_t>(m_remoteColumn));
-        if (m_remoteColumn > 0) {
-            // In normal mode, if m_lineData.size() equals `width`, then we
-            // will have trouble outputing the "erase rest of line" command,
-            // which must be output before reaching the end of the line.  In
-            // plain mode, we don't output that command, so we're OK with a
-            // full line.
-            bool okWidth = false;
-            if (m_plainMode) {
-                okWidth = static_cast<size_t>(width) >= m_lineData.size();
-            } else {
-                okWidth = static_cast<size_t>(width) > m_lineData.size();
-            }
-            if (!okWidth ||
-                    memcmp(m_lineData.data(), lineData,
-                           sizeof(CHAR_INFO) * m_lineData.size()) != 0) {
-                m_lineDataValid = false;
-            }
-        }
+void Terminal::leaveAlternateScreen(bool restoreState)
+{
+    if (!m_alternateScreen) {
+        return;
     }
-    if (!m_lineDataValid) {
-        // We can't reuse, so we must reset this line.
-        hideTerminalCursor();
-        if (m_plainMode) {
-            // We can't backtrack, so repeat this line.
-            m_output.write("\r\n");
-        } else {
-            m_output.write("\r");
-        }
-        m_lineDataValid = true;
-        m_lineData.clear();
+    m_alternateScreen = false;
+    // The terminal restores the row it saved on entry.  The column and the
+    // SGR state aren't relied on: the CR puts the cursor in column 0, and
+    // the next line sends its color in full.
+    write(CSI "?1049l");
+    if (restoreState) {
+        write("\r");
+        m_remoteLine = m_mainRemoteLine;
+        m_freshLine = m_mainFreshLine;
         m_remoteColumn = 0;
+        m_lineData.clear();
+        m_remoteColor = -1;
+    }
+}
+
+void Terminal::sendInputAck(uint64_t bytes)
+{
+    m_frameInputBytes = bytes;
+    if (!m_inputAcks || static_cast<int64_t>(bytes) == m_sentInputAck) {
+        return;
+    }
+    m_sentInputAck = static_cast<int64_t>(bytes);
+    beginCellRecord(WINPTY_CELL_RECORD_INPUT_ACK, sizeof(bytes));
+    appendCellPayload(&bytes, sizeof(bytes));
+    write(m_cellRecord.data(), m_cellRecord.size());
+}
+
+size_t Terminal::heapBytes() const
+{
+    size_t ret = m_lineData.capacity() * sizeof(CHAR_INFO) +
+        m_sgrCache.capacity() * sizeof(SgrState) +
+        m_termLineWorkingBuffer.capacity() +
+        m_termLineFullBuffer.capacity() +
+        m_diffSpans.capacity() * sizeof(m_diffSpans[0]) +
+        m_cellRecord.capacity() +
+        m_historyText.capacity() +
+        m_historyRuns.capacity() * sizeof(m_historyRuns[0]) +
+        m_frameBuffer.capacity() +
+        m_damageRects.capacity() * sizeof(DamageRect) +
+        m_damageScrolls.capacity() * sizeof(DamageScroll);
+    for (const SgrState &state : m_sgrCache) {
+        ret += state.fore.capacity() + state.back.capacity() +
+            state.full.capacity();
+    }
+    return ret;
+}
+
+void Terminal::releaseMemory()
+{
+    ASSERT(!m_inFrame);
+    std::vector<SgrState>().swap(m_sgrCache);
+    std::string().swap(m_termLineWorkingBuffer);
+    std::string().swap(m_termLineFullBuffer);
+    std::vector<std::pair<int, int>>().swap(m_diffSpans);
+    std::string().swap(m_cellRecord);
+    std::string().swap(m_historyText);
+    std::vector<std::pair<uint32_t, uint16_t>>().swap(m_historyRuns);
+    std::string().swap(m_frameBuffer);
+    std::vector<DamageRect>().swap(m_damageRects);
+    std::vector<DamageScroll>().swap(m_damageScrolls);
+}
+
+static inline bool isComplexCell(const CHAR_INFO &cell)
+{
+    return (cell.Attributes & (WINPTY_COMMON_LVB_LEADING_BYTE |
+                               WINPTY_COMMON_LVB_TRAILING_BYTE)) ||
+           (cell.Char.UnicodeChar & 0xF800) == 0xD800;
+}
+
+// The number of cells after lineData[begin], and before `end`, that are
+// identical to it.  Multi-cell characters aren't repeated.
+static int repeatedCellCount(const CHAR_INFO *lineData, int begin, int end)
+{
+    if (isComplexCell(lineData[begin])) {
+        return 0;
+    }
+    int i = begin + 1;
+    while (i < end &&
+            memcmp(&lineData[i], &lineData[begin], sizeof(CHAR_INFO)) == 0) {
+        ++i;
     }
+    return i - begin - 1;
+}
 
+// Send a line of console content to the terminal.  If the caller knows what
+// the terminal currently shows on this line (prevLineData, with the same
+// width), then only the changed spans of cells may be sent instead.
+template <bool kOutputColor, bool kPlainMode, bool kRepeatEscapes>
+void Terminal::encodeLineCells(const CHAR_INFO *lineData, int width,
+                               bool freshLine, bool asciiFastPath,
+                               EncodedLine &out)
+{
     std::string &termLine = m_termLineWorkingBuffer;
     termLine.clear();
     size_t trimmedLineLength = 0;
@@ -367,10 +771,10 @@ void Terminal::sendLine(int64_t line, const CHAR_INFO *lineData, int width,
 
     int cellCount = 1;
     for (int i = m_lineData.size(); i < width; i += cellCount) {
-        if (m_outputColor) {
+        if (kOutputColor) {
             int color = lineData[i].Attributes & COLOR_ATTRIBUTE_MASK;
             if (color != m_remoteColor) {
-                outputSetColor(termLine, color);
+                appendSetColor(termLine, m_remoteColor, color);
                 trimmedLineLength = termLine.size();
                 m_remoteColor = color;
 
@@ -378,9 +782,47 @@ void Terminal::sendLine(int64_t line, const CHAR_INFO *lineData, int width,
                 trimmedCellCount = i;
             }
         }
+        if (asciiFastPath && i + 1 < width &&
+                lineData[i].Char.UnicodeChar > L' ' &&
+                lineData[i].Char.UnicodeChar < 0x7F) {
+            // Copy a run of plain ASCII cells with this cell's attributes in
+            // one step.  The last cell is left to the code below, which
+            // erases the line before writing it.
+            const size_t oldSize = termLine.size();
+            termLine.resize(oldSize + (width - 1 - i));
+            cellCount = copyAsciiCharInfoRun(&lineData[i], width - 1 - i,
+                                             lineData[i].Attributes,
+                                             &termLine[oldSize]);
+            termLine.resize(oldSize + cellCount);
+            if (cellCount > 0) {
+                trimmedLineLength = termLine.size();
+                trimmedCellCount = i + cellCount;
+                continue;
+            }
+        }
+        if (asciiFastPath && i + 1 < width &&
+                lineData[i].Char.UnicodeChar >= 0x80) {
+            // Likewise for non-ASCII text, such as CJK.
+            cellCount = appendNonAsciiRun(termLine, lineData, i, width - 1,
+                                          kOutputColor ? m_remoteColor : -1);
+            if (cellCount > 0) {
+                trimmedLineLength = termLine.size();
+                trimmedCellCount = i + cellCount;
+                continue;
+            }
+        }
         unsigned int ch;
         scanUnicodeScalarValue(&lineData[i], width - i, cellCount, ch);
-        if (ch == ' ') {
+        const int repeated = (kRepeatEscapes && cellCount == 1)
+            ? repeatedCellCount(lineData, i, width) : 0;
+        if (ch == ' ' && repeated > 0 && i + 1 + repeated < width &&
+                hasColoredBackground(m_remoteColor) &&
+                appendErase(termLine, 1 + repeated)) {
+            // The blanks are followed by something, so they're not trimmed.
+            cellCount += repeated;
+            trimmedLineLength = termLine.size();
+            trimmedCellCount = i + cellCount;
+        } else if (ch == ' ') {
             // Tentatively add this space character.  We'll only output it if
             // we see something interesting after it.
             termLine.push_back(' ');
@@ -393,7 +835,7 @@ void Terminal::sendLine(int64_t line, const CHAR_INFO *lineData, int width,
                 // issuing a CSI 0K at that point also erases the last cell in
                 // the line.  Work around this behavior by issuing the erase
                 // one character early in that case.
-                if (!m_plainMode) {
+                if (!kPlainMode && !freshLine) {
                     termLine.append(CSI "0K"); // Erase from cursor to EOL
                 }
                 alreadyErasedLine = true;
@@ -406,12 +848,133 @@ void Terminal::sendLine(int64_t line, const CHAR_INFO *lineData, int width,
                 enclen = 1;
             }
             termLine.append(enc, enclen);
+
+            // Repeat the character, but not into the last cell, which has to
+            // follow the erase above.
+            const int repeatable = std::min(repeated, width - 2 - i);
+            if (repeatable > 0 && appendRepeat(termLine, repeatable, enclen)) {
+                cellCount += repeatable;
+            }
             trimmedLineLength = termLine.size();
 
             // All the cells up to and including this cell will be output.
             trimmedCellCount = i + cellCount;
         }
     }
+    out.trimmedLength = trimmedLineLength;
+    out.trimmedCellCount = trimmedCellCount;
+    out.alreadyErasedLine = alreadyErasedLine;
+}
+
+void Terminal::sendLine(int64_t line, const CHAR_INFO *lineData, int width,
+                        int cursorColumn, const CHAR_INFO *prevLineData)
+{
+    ASSERT(width >= 1);
+    ++m_sendLineCount;
+
+    if (m_history != nullptr && !m_alternateScreen) {
+        recordHistoryLine(line, lineData, width);
+    }
+
+    if (m_cellOutput) {
+        sendCellLine(line, lineData, width, prevLineData);
+        return;
+    }
+
+    // A soft-wrapped line can't use the diff, whose CHA would move the
+    // cursor along the previous line.
+    const bool softWrapped = trySoftWrap(line, lineData);
+    if (!softWrapped) {
+        moveTerminalToLine(line);
+    }
+    const bool freshLine = line >= m_freshLine;
+    m_freshLine = std::max(m_freshLine, line + 1);
+
+    static const bool lineDiffEnabled = !hasDebugFlag("no_line_diff");
+    if (prevLineData != nullptr && lineDiffEnabled && !m_plainMode &&
+            !softWrapped && sendLineDiff(lineData, prevLineData, width)) {
+        return;
+    }
+
+    // If possible, see if we can append to what we've already output for this
+    // line.
+    if (m_lineDataValid) {
+        ASSERT(m_lineData.size() == static_cast<size_t>(m_remoteColumn));
+        if (m_remoteColumn > 0) {
+            // In normal mode, if m_lineData.size() equals `width`, then we
+            // will have trouble outputing the "erase rest of line" command,
+            // which must be output before reaching the end of the line.  In
+            // plain mode, we don't output that command, so we're OK with a
+            // full line.
+            bool okWidth = false;
+            if (m_plainMode) {
+                okWidth = static_cast<size_t>(width) >= m_lineData.size();
+            } else {
+                okWidth = static_cast<size_t>(width) > m_lineData.size();
+            }
+            if (!okWidth ||
+                    memcmp(m_lineData.data(), lineData,
+                           sizeof(CHAR_INFO) * m_lineData.size()) != 0) {
+                m_lineDataValid = false;
+            }
+        }
+    }
+    if (!m_lineDataValid) {
+        // We can't reuse, so we must reset this line.
+        hideTerminalCursor();
+        if (m_plainMode) {
+            // We can't backtrack, so repeat this line.
+            write("\r\n");
+        } else {
+            write("\r");
+        }
+        m_lineDataValid = true;
+        m_lineData.clear();
+        m_remoteColumn = 0;
+    }
+
+    // REP needs to see the runs of repeated cells, so it takes the scalar
+    // path.
+    static const bool asciiFastPathEnabled =
+        !hasDebugFlag("no_ascii_fast_path");
+    const bool asciiFastPath = asciiFastPathEnabled && !m_repeatEscapes;
+
+    if (asciiFastPath && m_lineData.empty() &&
+            sendUniformAsciiLine(lineData, width, cursorColumn, freshLine)) {
+        return;
+    }
+
+    EncodedLine encoded;
+    if (m_plainMode) {
+        // setRepeatEscapes never enables REP in plain mode.
+        if (m_outputColor) {
+            encodeLineCells<true, true, false>(
+                lineData, width, freshLine, asciiFastPath, encoded);
+        } else {
+            encodeLineCells<false, true, false>(
+                lineData, width, freshLine, asciiFastPath, encoded);
+        }
+    } else if (m_repeatEscapes) {
+        if (m_outputColor) {
+            encodeLineCells<true, false, true>(
+                lineData, width, freshLine, asciiFastPath, encoded);
+        } else {
+            encodeLineCells<false, false, true>(
+                lineData, width, freshLine, asciiFastPath, encoded);
+        }
+    } else {
+        if (m_outputColor) {
+            encodeLineCells<true, false, false>(
+                lineData, width, freshLine, asciiFastPath, encoded);
+        } else {
+            encodeLineCells<false, false, false>(
+                lineData, width, freshLine, asciiFastPath, encoded);
+        }
+    }
+    const std::string &termLine = m_termLineWorkingBuffer;
+    const size_t trimmedLineLength = encoded.trimmedLength;
+    const int trimmedCellCount = encoded.trimmedCellCount;
+    const bool alreadyErasedLine = encoded.alreadyErasedLine;
 
     if (cursorColumn != -1 && trimmedCellCount > cursorColumn) {
         // The line content would run past the cursor, so hide it before we
@@ -419,9 +982,12 @@ void Terminal::sendLine(int64_t line, const CHAR_INFO *lineData, int width,
         hideTerminalCursor();
     }
 
-    m_output.write(termLine.data(), trimmedLineLength);
-    if (!alreadyErasedLine && !m_plainMode) {
-        m_output.write(CSI "0K"); // Erase from cursor to EOL
+    write(termLine.data(), trimmedLineLength);
+    // A fresh line is already blank, so it only needs the erase to fill
+    // trailing blanks with a background color.
+    if (!alreadyErasedLine && !m_plainMode &&
+            (!freshLine || hasColoredBackground(m_remoteColor))) {
+        write(CSI "0K"); // Erase from cursor to EOL
     }
 
     ASSERT(trimmedCellCount <= width);
@@ -429,22 +995,345 @@ void Terminal::sendLine(int64_t line, const CHAR_INFO *lineData, int width,
                       &lineData[m_lineData.size()],
                       &lineData[trimmedCellCount]);
     m_remoteColumn = trimmedCellCount;
+    if (alreadyErasedLine) {
+        noteWrapPending();
+    }
+}
+
+void Terminal::noteWrapPending()
+{
+    m_wrapPending = true;
+    m_wrapPendingBytes = m_bytesQueued;
+}
+
+// The console doesn't report which rows wrapped.  A row filled to its last
+// cell, followed by a row starting with a character, is taken to be one
+// line wrapped across both.  If the terminal cursor still waits at the
+// margin after the first row, writing on lets the terminal wrap the text
+// itself instead of sending CRLF.  The wrap is then soft, so the client can
+// reflow the two rows on a resize.  Returns whether the terminal is now on
+// `line`, at its first column, with nothing yet written.
+bool Terminal::trySoftWrap(int64_t line, const CHAR_INFO *lineData)
+{
+    static const bool softWrapEnabled = !hasDebugFlag("no_soft_wrap");
+    if (!softWrapEnabled || !m_wrapPending ||
+            m_wrapPendingBytes != m_bytesQueued ||
+            line != m_remoteLine + 1 ||
+            lineData[0].Char.UnicodeChar == L' ') {
+        return false;
+    }
+    // Like a CRLF at the bottom, the wrap may scroll in a line filled with
+    // the current background.
+    if (hasColoredBackground(m_remoteColor)) {
+        m_freshLine = std::max(m_freshLine, line + 1);
+    }
+    m_wrapPending = false;
+    m_remoteLine = line;
+    m_remoteColumn = 0;
+    m_lineDataValid = true;
+    m_lineData.clear();
+    return true;
+}
+
+// Send `count` consecutive lines, starting at firstLine, whose cells are
+// stored one after another in lineData.  None of them may hold the cursor.
+// This is meant for a block of new lines scrolling past: the cursor is hidden
+// once, the frame buffer grows once, and lines the terminal hasn't shown yet
+// skip the erase.
+void Terminal::sendLines(int64_t firstLine, const CHAR_INFO *lineData,
+                         int count, int width)
+{
+    ASSERT(count >= 0 && width >= 1);
+    if (count == 0) {
+        return;
+    }
+    hideTerminalCursor();
+    if (m_inFrame) {
+        // Most lines encode to about one byte per cell, plus the newline and
+        // a color change or two.
+        m_frameBuffer.reserve(m_frameBuffer.size() +
+                              static_cast<size_t>(count) * (width + 16));
+    }
+    for (int i = 0; i < count; ++i) {
+        sendLine(firstLine + i, lineData + static_cast<size_t>(i) * width,
+                 width, -1);
+    }
+}
+
+// Most lines, as in a build log, are printable ASCII in a single color.  Send
+// such a line, from its first column, with one SGR and one vectorized copy.
+// Returns false, having written nothing, for any other line.  The output
+// matches the general path in sendLine.
+bool Terminal::sendUniformAsciiLine(const CHAR_INFO *lineData, int width,
+                                    int cursorColumn, bool freshLine)
+{
+    const WORD attributes = lineData[0].Attributes;
+    const int color = attributes & COLOR_ATTRIBUTE_MASK;
+    std::string &termLine = m_termLineWorkingBuffer;
+    termLine.clear();
+    if (m_outputColor && color != m_remoteColor) {
+        appendSetColor(termLine, m_remoteColor, color);
+    }
+    const size_t prefixLength = termLine.size();
+    termLine.resize(prefixLength + width);
+    if (copyPrintableCharInfoRun(lineData, width, attributes,
+                                 &termLine[prefixLength]) != width) {
+        return false;
+    }
+    if (m_outputColor) {
+        m_remoteColor = color;
+    }
+
+    // Trailing blanks are left to the erase.
+    int cellCount = width;
+    while (cellCount > 0 && termLine[prefixLength + cellCount - 1] == ' ') {
+        --cellCount;
+    }
+    if (cursorColumn != -1 && cellCount > cursorColumn) {
+        hideTerminalCursor();
+    }
+    if (cellCount == width) {
+        // As in sendLine, erase before the last cell, not after it.
+        if (!m_plainMode && !freshLine) {
+            write(termLine.data(), prefixLength + width - 1);
+            write(CSI "0K");
+            write(&termLine[prefixLength + width - 1], 1);
+        } else {
+            write(termLine.data(), prefixLength + width);
+        }
+        noteWrapPending();
+    } else {
+        write(termLine.data(), prefixLength + cellCount);
+        if (!m_plainMode &&
+                (!freshLine || hasColoredBackground(m_remoteColor))) {
+            write(CSI "0K");
+        }
+    }
+    m_lineData.assign(lineData, lineData + cellCount);
+    m_remoteColumn = cellCount;
+    return true;
+}
+
+// Whether blanks in this color show something other than the terminal's
+// default background.  With color output off, every blank is default.
+bool Terminal::hasColoredBackground(int color)
+{
+    if (!m_outputColor || color == -1) {
+        return false;
+    }
+    const SgrState &state = sgrState(color);
+    return state.inverse || !state.back.empty();
+}
+
+// Append a REP sequence repeating the character just output `count` more
+// times, unless writing the characters out would be as short.  Returns
+// whether anything was appended.
+bool Terminal::appendRepeat(std::string &out, int count, int charSize)
+{
+    EscapeBuilder esc;
+    esc.csi().num(count).ch('b');
+    if (static_cast<int64_t>(count) * charSize <=
+            static_cast<int64_t>(esc.size())) {
+        return false;
+    }
+    out.append(esc.data(), esc.size());
+    return true;
+}
+
+// Append ECH and CUF sequences that blank `count` cells in the current color
+// and move past them, unless writing spaces would be as short.  Returns
+// whether anything was appended.  The cells must not reach the end of the
+// line, where CUF would stop short.
+bool Terminal::appendErase(std::string &out, int count)
+{
+    EscapeBuilder esc;
+    esc.csi().num(count).ch('X').csi().num(count).ch('C');
+    if (static_cast<size_t>(count) <= esc.size()) {
+        return false;
+    }
+    out.append(esc.data(), esc.size());
+    return true;
+}
+
+// Append the cells in [begin, end) to `out`, one character per cell, setting
+// colors along the way.  Returns the final color.
+int Terminal::appendCells(std::string &out, const CHAR_INFO *lineData,
+                          int begin, int end, int color)
+{
+    for (int i = begin; i < end; ++i) {
+        if (m_outputColor) {
+            const int cellColor = lineData[i].Attributes & COLOR_ATTRIBUTE_MASK;
+            if (cellColor != color) {
+                appendSetColor(out, color, cellColor);
+                color = cellColor;
+            }
+        }
+        const unsigned int ch =
+            fixSpecialCharacters(lineData[i].Char.UnicodeChar);
+        const int repeated =
+            m_repeatEscapes ? repeatedCellCount(lineData, i, end) : 0;
+        if (ch == ' ' && repeated > 0 && i + 1 + repeated < end &&
+                hasColoredBackground(color) &&
+                appendErase(out, 1 + repeated)) {
+            i += repeated;
+            continue;
+        }
+        char enc[4];
+        int enclen = encodeUtf8(enc, ch);
+        if (enclen == 0) {
+            enc[0] = '?';
+            enclen = 1;
+        }
+        out.append(enc, enclen);
+        if (repeated > 0 && appendRepeat(out, repeated, enclen)) {
+            i += repeated;
+        }
+    }
+    return color;
+}
+
+// Overwrite only the cells that differ from prevLineData, moving between the
+// changed spans with CHA.  Returns false, having output nothing, if the spans
+// involve full-width or surrogate-pair characters, or if rewriting the whole
+// line would be cheaper.
+bool Terminal::sendLineDiff(const CHAR_INFO *lineData,
+                            const CHAR_INFO *prevLineData,
+                            int width)
+{
+    // Unchanged runs at most this long are rewritten rather than skipped,
+    // because a CHA sequence is about as long.
+    const int kMaxSkippedGap = 4;
+
+    m_diffSpans.clear();
+    for (int col = 0; col < width;) {
+        if (memcmp(&lineData[col], &prevLineData[col], sizeof(CHAR_INFO)) == 0) {
+            ++col;
+            continue;
+        }
+        const int start = col;
+        while (col < width &&
+                memcmp(&lineData[col], &prevLineData[col],
+                       sizeof(CHAR_INFO)) != 0) {
+            ++col;
+        }
+        if (!m_diffSpans.empty() &&
+                start - m_diffSpans.back().second <= kMaxSkippedGap) {
+            m_diffSpans.back().second = col;
+        } else {
+            m_diffSpans.push_back(std::make_pair(start, col));
+        }
+    }
+    if (m_diffSpans.empty()) {
+        return true;
+    }
+
+    // Splitting a multi-cell character would corrupt the terminal's line, so
+    // leave those lines to the full rewrite.
+    for (const auto &span : m_diffSpans) {
+        const int first = std::max(0, span.first - 1);
+        const int last = std::min(width, span.second + 1);
+        for (int i = first; i < last; ++i) {
+            if (isComplexCell(lineData[i]) || isComplexCell(prevLineData[i])) {
+                return false;
+            }
+        }
+    }
+
+    std::string &diff = m_termLineWorkingBuffer;
+    diff.clear();
+    int color = m_remoteColor;
+    int column = m_remoteColumn;
+    for (const auto &span : m_diffSpans) {
+        if (span.first != column) {
+            EscapeBuilder esc;
+            esc.csi().num(span.first + 1).ch('G');
+            diff.append(esc.data(), esc.size());
+        }
+        color = appendCells(diff, lineData, span.first, span.second, color);
+        column = span.second;
+    }
+
+    // Estimate a full rewrite: CR, the line without its trailing blanks,
+    // and an erase-to-EOL.
+    std::string &full = m_termLineFullBuffer;
+    full.clear();
+    appendCells(full, lineData, 0, width, m_remoteColor);
+    size_t fullLength = full.size();
+    while (fullLength > 0 && full[fullLength - 1] == ' ') {
+        --fullLength;
+    }
+    if (diff.size() >= 1 + fullLength + strlen(CSI "0K")) {
+        return false;
+    }
+
+    hideTerminalCursor();
+    write(diff.data(), diff.size());
+    m_remoteColor = color;
+    m_remoteColumn = column;
+    m_lineDataValid = true;
+    m_lineData.assign(lineData, lineData + column);
+    return true;
+}
+
+// Scroll terminal lines [top, bottom] so that line L shows what line L+delta
+// showed before, leaving blank lines in the exposed area.  This is only for
+// direct mode, where the terminal was cleared and homed at line 0, so
+// terminal line N is screen row N+1.
+void Terminal::scrollRegion(int top, int bottom, int delta)
+{
+    ASSERT(top >= 0 && top <= bottom && delta != 0);
+    if (m_cellOutput) {
+        const int32_t payload[3] = { top, bottom, delta };
+        beginCellRecord(WINPTY_CELL_RECORD_SCROLL, sizeof(payload));
+        appendCellPayload(payload, sizeof(payload));
+        write(m_cellRecord.data(), m_cellRecord.size());
+        noteDamageScroll(top, bottom, delta);
+        return;
+    }
+    if (m_plainMode) {
+        return;
+    }
+    hideTerminalCursor();
+    // Reset SGR first, so the exposed lines get the default background.
+    // DECSTBM homes the cursor, and so does resetting the region afterward.
+    EscapeBuilder esc;
+    esc.lit(CSI "0m").csi().num(top + 1).ch(';').num(bottom + 1).ch('r');
+    esc.csi().num(delta > 0 ? delta : -delta).ch(delta > 0 ? 'S' : 'T');
+    esc.lit(CSI "r");
+    write(esc.data(), esc.size());
+    // The scroll can move content onto lines that haven't been sent.
+    m_freshLine = std::max<int64_t>(m_freshLine, bottom + 1);
+    m_remoteLine = 0;
+    m_remoteColumn = 0;
+    m_lineDataValid = true;
+    m_lineData.clear();
+    m_remoteColor = -1;
 }
 
 void Terminal::showTerminalCursor(int column, int64_t line)
 {
+    if (m_cellOutput) {
+        if (m_cursorHidden || line != m_cellCursorLine ||
+                column != m_cellCursorColumn) {
+            m_cursorHidden = false;
+            m_cellCursorLine = line;
+            m_cellCursorColumn = column;
+            sendCellCursor(true);
+        }
+        return;
+    }
     moveTerminalToLine(line);
     if (!m_plainMode) {
         if (m_remoteColumn != column) {
-            char buffer[32];
-            winpty_snprintf(buffer, CSI "%dG", column + 1);
-            m_output.write(buffer);
+            EscapeBuilder esc;
+            esc.csi().num(column + 1).ch('G');
+            write(esc.data(), esc.size());
             m_lineDataValid = (column == 0);
             m_lineData.clear();
             m_remoteColumn = column;
         }
         if (m_cursorHidden) {
-            m_output.write(CSI "?25h");
+            write(CSI "?25h");
             m_cursorHidden = false;
         }
     }
@@ -452,11 +1341,18 @@ void Terminal::showTerminalCursor(int column, int64_t line)
 
 void Terminal::hideTerminalCursor()
 {
+    if (m_cellOutput) {
+        if (!m_cursorHidden) {
+            m_cursorHidden = true;
+            sendCellCursor(false);
+        }
+        return;
+    }
     if (!m_plainMode) {
         if (m_cursorHidden) {
             return;
         }
-        m_output.write(CSI "?25l");
+        write(CSI "?25l");
         m_cursorHidden = true;
     }
 }
@@ -477,20 +1373,25 @@ void Terminal::moveTerminalToLine(int64_t line)
     if (line < m_remoteLine) {
         if (m_plainMode) {
             // We can't backtrack, so instead repeat the lines again.
-            m_output.write("\r\n");
+            write("\r\n");
             m_remoteLine = line;
         } else {
             // Backtrack and overwrite previous lines.
             // CUrsor Up (CUU)
-            char buffer[32];
-            winpty_snprintf(buffer, "\r" CSI "%uA",
-                static_cast<unsigned int>(m_remoteLine - line));
-            m_output.write(buffer);
+            EscapeBuilder esc;
+            esc.lit("\r" CSI).num(static_cast<uint32_t>(m_remoteLine - line));
+            esc.ch('A');
+            write(esc.data(), esc.size());
             m_remoteLine = line;
         }
     } else if (line > m_remoteLine) {
+        if (hasColoredBackground(m_remoteColor)) {
+            // A terminal that scrolls here may fill the new lines with the
+            // current background color, so they're no longer blank.
+            m_freshLine = std::max(m_freshLine, line + 1);
+        }
         while (line > m_remoteLine) {
-            m_output.write("\r\n");
+            write("\r\n");
             m_remoteLine++;
         }
     }
@@ -506,7 +1407,12 @@ void Terminal::enableMouseMode(bool enabled)
         return;
     }
     m_mouseModeEnabled = enabled;
-    if (enabled) {
+    if (m_cellOutput) {
+        const uint32_t payload = enabled;
+        beginCellRecord(WINPTY_CELL_RECORD_MOUSE_MODE, sizeof(payload));
+        appendCellPayload(&payload, sizeof(payload));
+        write(m_cellRecord.data(), m_cellRecord.size());
+    } else if (enabled) {
         // Start by disabling UTF-8 coordinate mode (1005), just in case we
         // have a terminal that does not support 1006/1015 modes, and 1005
         // happens to be enabled.  The UTF-8 coordinates can't be unambiguously
@@ -522,14 +1428,260 @@ void Terminal::enableMouseMode(bool enabled)
         // priority.  On other terminals, 1006 wins because it's listed last.
         //
         // See misc/MouseInputNotes.txt for details.
-        m_output.write(
+        write(
             CSI "?1005l"
             CSI "?1000h" CSI "?1002h" CSI "?1003h" CSI "?1015h" CSI "?1006h");
     } else {
         // Resetting both encoding modes (1006 and 1015) is necessary, but
         // apparently we only need to use reset on one of the 100[023] modes.
         // Doing both doesn't hurt.
-        m_output.write(
+        write(
             CSI "?1006l" CSI "?1015l" CSI "?1003l" CSI "?1002l" CSI "?1000l");
     }
 }
+
+void Terminal::setTitle(const std::wstring &title)
+{
+    if (m_cellOutput) {
+        const size_t size = title.size() * sizeof(wchar_t);
+        beginCellRecord(WINPTY_CELL_RECORD_TITLE, size);
+        appendCellPayload(title.data(), size);
+        write(m_cellRecord.data(), m_cellRecord.size());
+    } else {
+        const std::string command =
+            std::string("\x1b]0;") + utf8FromWide(title) + "\x07";
+        write(command.data(), command.size());
+    }
+}
+
+// Start a cell record in m_cellRecord.  The caller appends exactly
+// payloadSize bytes and then writes the record.  Windows is little-endian,
+// so the fields are copied as-is.
+void Terminal::beginCellRecord(int type, size_t payloadSize)
+{
+    const uint16_t typeAndReserved[2] = { static_cast<uint16_t>(type), 0 };
+    const uint32_t size = static_cast<uint32_t>(payloadSize);
+    m_cellRecord.clear();
+    appendCellPayload(typeAndReserved, sizeof(typeAndReserved));
+    appendCellPayload(&size, sizeof(size));
+}
+
+void Terminal::appendCellPayload(const void *data, size_t size)
+{
+    m_cellRecord.append(static_cast<const char*>(data), size);
+}
+
+void Terminal::sendCellHello()
+{
+    beginCellHello();
+    write(m_cellRecord.data(), m_cellRecord.size());
+}
+
+// Builds the hello record in m_cellRecord.
+void Terminal::beginCellHello()
+{
+    const uint32_t version = 1;
+    beginCellRecord(WINPTY_CELL_RECORD_HELLO, sizeof(version));
+    appendCellPayload(&version, sizeof(version));
+}
+
+// Send the cells from the first to the last one that differ from
+// prevLineData, or the whole line without it.
+void Terminal::sendCellLine(int64_t line, const CHAR_INFO *lineData, int width,
+                            const CHAR_INFO *prevLineData)
+{
+    int begin = 0;
+    int end = width;
+    if (prevLineData != nullptr) {
+        while (begin < width &&
+                memcmp(&lineData[begin], &prevLineData[begin],
+                       sizeof(CHAR_INFO)) == 0) {
+            ++begin;
+        }
+        if (begin == width) {
+            return;
+        }
+        while (memcmp(&lineData[end - 1], &prevLineData[end - 1],
+                      sizeof(CHAR_INFO)) == 0) {
+            --end;
+        }
+    }
+    const uint16_t fields[4] = {
+        static_cast<uint16_t>(width),
+        static_cast<uint16_t>(begin),
+        static_cast<uint16_t>(end - begin),
+        0,
+    };
+    beginCellRecord(WINPTY_CELL_RECORD_LINE,
+                    sizeof(line) + sizeof(fields) + (end - begin) * 4);
+    appendCellPayload(&line, sizeof(line));
+    appendCellPayload(fields, sizeof(fields));
+    for (int i = begin; i < end; ++i) {
+        const uint16_t cell[2] = {
+            static_cast<uint16_t>(
+                fixSpecialCharacters(lineData[i].Char.UnicodeChar)),
+            lineData[i].Attributes,
+        };
+        appendCellPayload(cell, sizeof(cell));
+    }
+    write(m_cellRecord.data(), m_cellRecord.size());
+    noteDamage(line, begin, end);
+}
+
+// Adds cells [column, endColumn) of a line to the frame's damage.  Lines
+// usually arrive in order, so a line next to the last rect joins it.
+void Terminal::noteDamage(int64_t line, int column, int endColumn)
+{
+    if (!m_damageRecords || !m_inFrame || m_damageFull) {
+        return;
+    }
+    if (!m_damageRects.empty()) {
+        DamageRect &last = m_damageRects.back();
+        if (line >= last.firstLine && line <= last.lastLine + 1) {
+            last.lastLine = std::max(last.lastLine, line);
+            last.column = std::min(last.column, column);
+            last.endColumn = std::max(last.endColumn, endColumn);
+            return;
+        }
+    }
+    if (m_damageRects.size() == kMaxDamageRects) {
+        m_damageFull = true;
+        return;
+    }
+    m_damageRects.push_back({ line, line, column, endColumn });
+}
+
+// Records a scroll of grid rows [top, bottom], and moves the parts of the
+// damage rects inside it along with their content.  Cell output scrolls in
+// direct mode, where line N is grid row N.
+void Terminal::noteDamageScroll(int top, int bottom, int delta)
+{
+    if (!m_damageRecords || !m_inFrame || m_damageFull) {
+        return;
+    }
+    if (m_damageScrolls.size() == kMaxDamageScrolls) {
+        m_damageFull = true;
+        return;
+    }
+    m_damageScrolls.push_back({ top, bottom, delta });
+    std::vector<DamageRect> moved;
+    moved.reserve(m_damageRects.size() + 2);
+    for (const DamageRect &rect : m_damageRects) {
+        if (rect.firstLine < top) {
+            moved.push_back(rect);
+            moved.back().lastLine = std::min<int64_t>(rect.lastLine, top - 1);
+        }
+        if (rect.lastLine > bottom) {
+            moved.push_back(rect);
+            moved.back().firstLine =
+                std::max<int64_t>(rect.firstLine, bottom + 1);
+        }
+        // Content scrolled out of the region is gone, and the rows it
+        // exposes are blank, which the scroll itself tells the renderer.
+        const int64_t first =
+            std::max<int64_t>(std::max<int64_t>(rect.firstLine, top) - delta,
+                              top);
+        const int64_t last =
+            std::min<int64_t>(std::min<int64_t>(rect.lastLine, bottom) - delta,
+                              bottom);
+        if (first <= last) {
+            moved.push_back({ first, last, rect.column, rect.endColumn });
+        }
+    }
+    if (moved.size() > kMaxDamageRects) {
+        m_damageFull = true;
+        m_damageRects.clear();
+        return;
+    }
+    m_damageRects.swap(moved);
+}
+
+// Appends the frame's WINPTY_CELL_RECORD_DAMAGE record to m_frameBuffer.
+void Terminal::appendDamageRecord()
+{
+    const uint32_t flags = m_damageFull ? WINPTY_CELL_DAMAGE_FULL : 0;
+    const uint16_t counts[2] = {
+        static_cast<uint16_t>(m_damageFull ? 0 : m_damageScrolls.size()),
+        static_cast<uint16_t>(m_damageFull ? 0 : m_damageRects.size()),
+    };
+    beginCellRecord(WINPTY_CELL_RECORD_DAMAGE,
+                    sizeof(flags) + sizeof(counts) +
+                    counts[0] * sizeof(int32_t) * 3 +
+                    counts[1] * (sizeof(int64_t) * 2 + sizeof(uint16_t) * 2 +
+                                 sizeof(uint32_t)));
+    appendCellPayload(&flags, sizeof(flags));
+    appendCellPayload(counts, sizeof(counts));
+    for (size_t i = 0; i < counts[0]; ++i) {
+        const DamageScroll &scroll = m_damageScrolls[i];
+        const int32_t fields[3] = { scroll.top, scroll.bottom, scroll.delta };
+        appendCellPayload(fields, sizeof(fields));
+    }
+    for (size_t i = 0; i < counts[1]; ++i) {
+        const DamageRect &rect = m_damageRects[i];
+        const uint16_t columns[2] = {
+            static_cast<uint16_t>(rect.column),
+            static_cast<uint16_t>(rect.endColumn),
+        };
+        const uint32_t reserved = 0;
+        appendCellPayload(&rect.firstLine, sizeof(rect.firstLine));
+        appendCellPayload(&rect.lastLine, sizeof(rect.lastLine));
+        appendCellPayload(columns, sizeof(columns));
+        appendCellPayload(&reserved, sizeof(reserved));
+    }
+    m_frameBuffer.append(m_cellRecord);
+}
+
+void Terminal::sendCellCursor(bool visible)
+{
+    const int64_t line = m_cellCursorLine;
+    const int32_t column = m_cellCursorColumn;
+    const uint32_t visibleField = visible;
+    beginCellRecord(WINPTY_CELL_RECORD_CURSOR,
+                    sizeof(line) + sizeof(column) + sizeof(visibleField));
+    appendCellPayload(&line, sizeof(line));
+    appendCellPayload(&column, sizeof(column));
+    appendCellPayload(&visibleField, sizeof(visibleField));
+    write(m_cellRecord.data(), m_cellRecord.size());
+}
+
+void Terminal::encodeLineText(const CHAR_INFO *lineData, int width,
+                              std::string &text,
+                              std::vector<std::pair<uint32_t, uint16_t>> &runs)
+{
+    const int kDefaultColor =
+        FOREGROUND_BLUE | FOREGROUND_GREEN | FOREGROUND_RED;
+    int end = width;
+    while (end > 0 &&
+            lineData[end - 1].Char.UnicodeChar == L' ' &&
+            (lineData[end - 1].Attributes & COLOR_ATTRIBUTE_MASK) ==
+                kDefaultColor) {
+        --end;
+    }
+    text.clear();
+    runs.clear();
+    int cellCount = 1;
+    for (int i = 0; i < end; i += cellCount) {
+        unsigned int ch;
+        scanUnicodeScalarValue(&lineData[i], end - i, cellCount, ch);
+        ch = fixSpecialCharacters(ch);
+        char enc[4];
+        int enclen = encodeUtf8(enc, ch);
+        if (enclen == 0) {
+            enc[0] = '?';
+            enclen = 1;
+        }
+        const uint16_t color = lineData[i].Attributes & COLOR_ATTRIBUTE_MASK;
+        if (runs.empty() || runs.back().second != color) {
+            runs.push_back(std::make_pair(0u, color));
+        }
+        runs.back().first += enclen;
+        text.append(enc, enclen);
+    }
+}
+
+void Terminal::recordHistoryLine(int64_t line, const CHAR_INFO *lineData,
+                                 int width)
+{
+    encodeLineText(lineData, width, m_historyText, m_historyRuns);
+    m_history->putLine(line, m_historyText, m_historyRuns);
+}
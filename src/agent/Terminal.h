@@ -25,29 +25,183 @@
 #include <stdint.h>
 
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "Coord.h"
 
 class NamedPipe;
+class ScrollbackHistory;
+class SessionRecorder;
 
 class Terminal
 {
 public:
-    explicit Terminal(NamedPipe &output, bool plainMode, bool outputColor)
-        : m_output(output), m_plainMode(plainMode), m_outputColor(outputColor)
+    // With cellOutput, the Terminal sends WINPTY_CELL_RECORD_xxx records
+    // instead of VT sequences, and the other modes are ignored.
+    explicit Terminal(NamedPipe &output, bool plainMode, bool outputColor,
+                      bool synchronizedOutput=false, bool cellOutput=false)
+        : m_output(output), m_plainMode(plainMode && !cellOutput),
+          m_outputColor(outputColor),
+          m_synchronizedOutput(synchronizedOutput && !plainMode && !cellOutput),
+          m_cellOutput(cellOutput)
     {
+        if (m_cellOutput) {
+            sendCellHello();
+        }
     }
 
+    void beginFrame();
+    void endFrame();
     enum SendClearFlag { OmitClear, SendClear };
     void reset(SendClearFlag sendClearFirst, int64_t newLine);
+    void reattach();
+    // Switch the terminal to its alternate screen (CSI ?1049h), setting the
+    // main screen's contents and cursor tracking aside.  The caller resets
+    // the tracking afterward, as for a new screen.  Returns false, without
+    // switching, in plain and cell output modes.
+    bool enterAlternateScreen();
+    // Return to the main screen.  With restoreState, the tracking goes back
+    // to what the terminal showed before enterAlternateScreen; otherwise,
+    // the caller resets it.
+    void leaveAlternateScreen(bool restoreState);
+    bool inAlternateScreen() const { return m_alternateScreen; }
     void sendLine(int64_t line, const CHAR_INFO *lineData, int width,
-                  int cursorColumn);
+                  int cursorColumn, const CHAR_INFO *prevLineData=nullptr);
+    void sendLines(int64_t firstLine, const CHAR_INFO *lineData, int count,
+                   int width);
+    void scrollRegion(int top, int bottom, int delta);
     void showTerminalCursor(int column, int64_t line);
     void hideTerminalCursor();
+    void setTitle(const std::wstring &title);
+    // Read-only copies of the output.  A subscriber receives the bytes the
+    // output pipe receives, as encoded for it, from now on.  Closed pipes
+    // are skipped until removeSubscriber.
+    void addSubscriber(NamedPipe &pipe);
+    void removeSubscriber(NamedPipe &pipe);
+    const std::vector<NamedPipe*> &subscribers() const {
+        return m_subscribers;
+    }
+    // Every write is also given to the recorder, as UTF-8, before the output
+    // pipe's encoding.  The recorder must outlive the Terminal, or be unset.
+    void setRecorder(SessionRecorder *recorder) { m_recorder = recorder; }
+    // Send runs of repeated characters with REP (CSI n b), and interior runs
+    // of colored blanks with ECH (CSI n X), for terminals that support them.
+    void setRepeatEscapes(bool enabled)
+    {
+        m_repeatEscapes = enabled && !m_plainMode && !m_cellOutput;
+    }
+    // Send the VT output as UTF-16LE rather than UTF-8, and/or as frames,
+    // each prefixed with its byte count (see WINPTY_FLAG_FRAMED_OUTPUT).
+    // Ignored with cellOutput.  Set before any output is sent.
+    void setOutputEncoding(bool utf16, bool framed)
+    {
+        m_utf16Output = utf16 && !m_cellOutput;
+        m_framedOutput = framed && !m_cellOutput;
+    }
+    // Ask the terminal for its cursor position, ahead of any output held for
+    // the current frame.
+    void sendDsr();
+    // With cellOutput, send WINPTY_CELL_RECORD_INPUT_ACK records.
+    void setInputAcks(bool enabled) { m_inputAcks = enabled && m_cellOutput; }
+    // Acknowledge the CONIN input written up to `bytes`, in the current
+    // frame, if that's news to the client.  The frame stamp reports it, too.
+    void sendInputAck(uint64_t bytes);
+    // End each non-empty frame with a stamp (see WINPTY_FLAG_FRAME_STAMPS).
+    void setFrameStamps(bool enabled)
+    {
+        m_frameStamps = enabled && !m_plainMode;
+    }
+    // With cellOutput, end each non-empty frame with a
+    // WINPTY_CELL_RECORD_DAMAGE record.
+    void setDamageRecords(bool enabled)
+    {
+        m_damageRecords = enabled && m_cellOutput;
+    }
+    // Note that the console is being read for the current frame.
+    void markFrameCapture();
+    // Record every line sent in `history`, which must outlive the Terminal.
+    void setHistory(ScrollbackHistory *history) { m_history = history; }
+    uint64_t sendLineCount() const { return m_sendLineCount; }
+    // Bytes of terminal output generated, excluding frame delimiters.
+    uint64_t bytesQueued() const { return m_bytesQueued; }
+    // The heap memory held by the encoding buffers and caches.
+    size_t heapBytes() const;
+    // Frees the encoding buffers and caches between frames.  They're rebuilt
+    // as the output needs them.
+    void releaseMemory();
+    // Convert a line to UTF-8 text with runs of (byte count, color
+    // attributes), dropping the trailing default-colored blanks.  This is the
+    // form of the lines in the history and in the screen snapshot.
+    static void encodeLineText(const CHAR_INFO *lineData, int width,
+                               std::string &text,
+                               std::vector<std::pair<uint32_t, uint16_t>> &runs);
 
 private:
+    void write(const char *data, size_t size);
+    // For literals; the length is known at compile time.
+    template <size_t N>
+    void write(const char (&text)[N]) { write(text, N - 1); }
+    void emit(const char *data, size_t size);
+    void copyToSubscribers(const char *data, size_t size);
     void moveTerminalToLine(int64_t line);
+    void noteWrapPending();
+    bool trySoftWrap(int64_t line, const CHAR_INFO *lineData);
+    bool sendUniformAsciiLine(const CHAR_INFO *lineData, int width,
+                              int cursorColumn, bool freshLine);
+    bool sendLineDiff(const CHAR_INFO *lineData,
+                      const CHAR_INFO *prevLineData,
+                      int width);
+    // The result of encodeLineCells: the bytes and cells worth sending, and
+    // whether the line's erase was already queued.
+    struct EncodedLine {
+        size_t trimmedLength = 0;
+        int trimmedCellCount = 0;
+        bool alreadyErasedLine = false;
+    };
+    // Encodes cells [m_lineData.size(), width) into m_termLineWorkingBuffer.
+    // sendLine picks the instantiation for the output modes once per line,
+    // so the per-cell loop doesn't test them.
+    template <bool kOutputColor, bool kPlainMode, bool kRepeatEscapes>
+    void encodeLineCells(const CHAR_INFO *lineData, int width,
+                         bool freshLine, bool asciiFastPath,
+                         EncodedLine &out);
+    // The SGR rendering of one console color, split up so that a color
+    // change can send just the parameters that differ.
+    struct SgrState {
+        bool valid = false;
+        bool bold = false;
+        bool inverse = false;
+        bool conceal = false;
+        bool underline = false;
+        std::string fore;   // e.g. ";31", or empty for the default color
+        std::string back;
+        std::string full;   // The complete sequence, starting with CSI 0
+    };
+    static void buildSgrState(SgrState &state, int color);
+    const SgrState &sgrState(int color);
+    void appendSetColor(std::string &out, int fromColor, int toColor);
+    int appendCells(std::string &out, const CHAR_INFO *lineData,
+                    int begin, int end, int color);
+    bool hasColoredBackground(int color);
+    bool appendRepeat(std::string &out, int count, int charSize);
+    bool appendErase(std::string &out, int count);
+
+    // WINPTY_FLAG_CELL_OUTPUT records.
+    void beginCellRecord(int type, size_t payloadSize);
+    void appendCellPayload(const void *data, size_t size);
+    void appendFrameStamp();
+    void sendCellHello();
+    void beginCellHello();
+    void sendCellLine(int64_t line, const CHAR_INFO *lineData, int width,
+                      const CHAR_INFO *prevLineData);
+    void sendCellCursor(bool visible);
+    void noteDamage(int64_t line, int column, int endColumn);
+    void noteDamageScroll(int top, int bottom, int delta);
+    void appendDamageRecord();
+
+    void recordHistoryLine(int64_t line, const CHAR_INFO *lineData,
+                           int width);
 
 public:
     void enableMouseMode(bool enabled);
@@ -55,15 +209,72 @@ public:
 private:
     NamedPipe &m_output;
     int64_t m_remoteLine = 0;
+    // Lines from here down haven't been written since the last reset, so the
+    // terminal shows them blank.
+    int64_t m_freshLine = 1;
     int m_remoteColumn = 0;
     bool m_lineDataValid = true;
     std::vector<CHAR_INFO> m_lineData;
     bool m_cursorHidden = false;
     int m_remoteColor = -1;
+    std::vector<SgrState> m_sgrCache;
     std::string m_termLineWorkingBuffer;
+    std::string m_termLineFullBuffer;
+    std::vector<std::pair<int, int>> m_diffSpans;
     bool m_plainMode = false;
     bool m_outputColor = true;
     bool m_mouseModeEnabled = false;
+    bool m_synchronizedOutput = false;
+    bool m_repeatEscapes = false;
+    bool m_cellOutput = false;
+    bool m_utf16Output = false;
+    bool m_framedOutput = false;
+    bool m_inputAcks = false;
+    // The last input ack sent, or -1 after a reattach.
+    int64_t m_sentInputAck = 0;
+    std::string m_cellRecord;
+    int64_t m_cellCursorLine = 0;
+    int m_cellCursorColumn = 0;
+    ScrollbackHistory *m_history = nullptr;
+    std::string m_historyText;
+    std::vector<std::pair<uint32_t, uint16_t>> m_historyRuns;
+    bool m_inFrame = false;
+    std::string m_frameBuffer;
+    bool m_frameStamps = false;
+    uint64_t m_frameSequence = 0;
+    uint64_t m_frameCaptureUs = 0;
+    uint64_t m_frameInputBytes = 0;
+    // The current frame's WINPTY_CELL_RECORD_DAMAGE contents.
+    struct DamageRect {
+        int64_t firstLine;
+        int64_t lastLine;
+        int column;
+        int endColumn;
+    };
+    struct DamageScroll {
+        int32_t top;
+        int32_t bottom;
+        int32_t delta;
+    };
+    bool m_damageRecords = false;
+    bool m_damageFull = false;
+    std::vector<DamageRect> m_damageRects;
+    std::vector<DamageScroll> m_damageScrolls;
+    // While the alternate screen is shown, its lines aren't kept in the
+    // history, and the main screen's tracking is saved here.
+    bool m_alternateScreen = false;
+    int64_t m_mainRemoteLine = 0;
+    int64_t m_mainFreshLine = 1;
+    uint64_t m_sendLineCount = 0;
+    uint64_t m_bytesQueued = 0;
+    std::vector<NamedPipe*> m_subscribers;
+    SessionRecorder *m_recorder = nullptr;
+    // Set when the last output filled the last cell of m_remoteLine, leaving
+    // the terminal cursor at the margin.  It only holds while nothing else
+    // has been written since, i.e. while m_bytesQueued still equals
+    // m_wrapPendingBytes.
+    bool m_wrapPending = false;
+    uint64_t m_wrapPendingBytes = 0;
 };
 
 #endif // TERMINAL_H
@@ -28,6 +28,9 @@
 #include "../shared/DebugClient.h"
 #include "../shared/WinptyAssert.h"
 
+#include "ConsoleApiStats.h"
+#include "EtwTrace.h"
+
 Win32Console::Win32Console() : m_titleWorkBuf(16)
 {
     // The console window must be non-NULL.  It is used for two purposes:
@@ -40,6 +43,14 @@ Win32Console::Win32Console() : m_titleWorkBuf(16)
 }
 
 std::wstring Win32Console::title()
+{
+    size_t length = 0;
+    const wchar_t *const text = readTitle(length);
+    return std::wstring(text, length);
+}
+
+// Reads the title into a work buffer, which is valid until the next call.
+const wchar_t *Win32Console::readTitle(size_t &lengthOut)
 {
     while (true) {
         // Calling GetConsoleTitleW is tricky, because its behavior changed
@@ -69,6 +80,7 @@ std::wstring Win32Console::title()
         // See misc/*/Test_GetConsoleTitleW.cc for tests demonstrating Windows'
         // behavior.
 
+        ConsoleApiScope call(WINPTY_CONSOLE_API_TITLE);
         DWORD count = GetConsoleTitleW(m_titleWorkBuf.data(),
                                        m_titleWorkBuf.size());
         const size_t needed = (count + 1) * sizeof(wchar_t);
@@ -77,12 +89,14 @@ std::wstring Win32Console::title()
             continue;
         }
         m_titleWorkBuf[count] = L'\0';
+        lengthOut = count;
         return m_titleWorkBuf.data();
     }
 }
 
 void Win32Console::setTitle(const std::wstring &title)
 {
+    ConsoleApiScope call(WINPTY_CONSOLE_API_TITLE);
     if (!SetConsoleTitleW(title.c_str())) {
         trace("SetConsoleTitleW failed");
     }
@@ -97,11 +111,22 @@ void Win32Console::setFrozen(bool frozen) {
         // Enter selection mode by activating either Mark or SelectAll.
         const int command = m_freezeUsesMark ? SC_CONSOLE_MARK
                                              : SC_CONSOLE_SELECT_ALL;
-        SendMessage(m_hwnd, WM_SYSCOMMAND, command, 0);
+        if (m_hwnd != nullptr) {
+            ConsoleApiScope call(WINPTY_CONSOLE_API_OTHER);
+            SendMessage(m_hwnd, WM_SYSCOMMAND, command, 0);
+        }
         m_frozen = true;
+        ++m_freezeCount;
+        m_freezeTimer = TimeMeasurement();
+        ETW_EVENT("Freeze", {"usesMark", m_freezeUsesMark});
     } else {
         // Send Escape to cancel the selection.
-        SendMessage(m_hwnd, WM_CHAR, 27, 0x00010001);
+        if (m_hwnd != nullptr) {
+            ConsoleApiScope call(WINPTY_CONSOLE_API_OTHER);
+            SendMessage(m_hwnd, WM_CHAR, 27, 0x00010001);
+        }
         m_frozen = false;
+        m_freezeHistogram.record(m_freezeTimer.elapsedUs());
+        ETW_EVENT("Unfreeze");
     }
 }
@@ -22,10 +22,16 @@
 #define AGENT_WIN32_CONSOLE_H
 
 #include <windows.h>
+#include <stdint.h>
 
 #include <string>
 #include <vector>
 
+#include "../shared/LatencyHistogram.h"
+#include "../shared/TimeMeasurement.h"
+
+#include "ConsoleStateProbe.h"
+
 class Win32Console
 {
 public:
@@ -46,22 +52,44 @@ public:
     };
 
     Win32Console();
+    // Wraps the given console window.  With a null window, freezing only
+    // tracks the state, which lets the scraper run offline.
+    explicit Win32Console(HWND hwnd) : m_hwnd(hwnd), m_titleWorkBuf(16) {}
 
     HWND hwnd() { return m_hwnd; }
     std::wstring title();
+    const wchar_t *readTitle(size_t &lengthOut);
     void setTitle(const std::wstring &title);
     void setFreezeUsesMark(bool useMark) { m_freezeUsesMark = useMark; }
+    bool freezeUsesMark() { return m_freezeUsesMark; }
     void setNewW10(bool isNewW10) { m_isNewW10 = isNewW10; }
     bool isNewW10() { return m_isNewW10; }
+    // Whether the scraper may read the buffer before freezing the console,
+    // checking afterward that nothing moved.  This needs a console whose
+    // large and out-of-range reads are safe.
+    void setOptimisticReads(bool optimistic) { m_optimisticReads = optimistic; }
+    bool optimisticReads() { return m_optimisticReads; }
     void setFrozen(bool frozen=true);
     bool frozen() { return m_frozen; }
+    // Counts the times the console has been frozen.  Within one frozen span,
+    // the screen buffer can't change except through the agent, so state read
+    // during it stays valid until the count changes.
+    uint32_t freezeCount() { return m_freezeCount; }
+    // How long each frozen span lasted.
+    const LatencyHistogram &freezeHistogram() { return m_freezeHistogram; }
+    ConsoleStateProbe &probe() { return m_probe; }
 
 private:
     HWND m_hwnd = nullptr;
     bool m_frozen = false;
+    uint32_t m_freezeCount = 0;
+    TimeMeasurement m_freezeTimer;
+    LatencyHistogram m_freezeHistogram;
     bool m_freezeUsesMark = false;
     bool m_isNewW10 = false;
+    bool m_optimisticReads = false;
     std::vector<wchar_t> m_titleWorkBuf;
+    ConsoleStateProbe m_probe;
 };
 
 #endif // AGENT_WIN32_CONSOLE_H
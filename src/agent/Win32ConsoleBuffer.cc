@@ -26,6 +26,10 @@
 #include "../shared/StringBuilder.h"
 #include "../shared/WinptyAssert.h"
 
+#include "ConsoleApiStats.h"
+#include "ConsoleFont.h"
+#include "Win32Console.h"
+
 std::unique_ptr<Win32ConsoleBuffer> Win32ConsoleBuffer::openStdout() {
     return std::unique_ptr<Win32ConsoleBuffer>(
         new Win32ConsoleBuffer(GetStdHandle(STD_OUTPUT_HANDLE), false));
@@ -60,48 +64,79 @@ HANDLE Win32ConsoleBuffer::conout() {
     return m_conout;
 }
 
-void Win32ConsoleBuffer::clearLines(
-        int row,
-        int count,
-        const ConsoleScreenBufferInfo &info) {
+static void fillBlankCells(HANDLE conout, Coord start, int count) {
     // TODO: error handling
-    const int width = info.bufferSize().X;
     DWORD actual = 0;
+    ConsoleApiScope call(WINPTY_CONSOLE_API_FILL_OUTPUT, count);
     if (!FillConsoleOutputCharacterW(
-            m_conout, L' ', width * count, Coord(0, row),
-            &actual) || static_cast<int>(actual) != width * count) {
+            conout, L' ', count, start,
+            &actual) || static_cast<int>(actual) != count) {
         trace("FillConsoleOutputCharacterW failed");
     }
     if (!FillConsoleOutputAttribute(
-            m_conout, kDefaultAttributes, width * count, Coord(0, row),
-            &actual) || static_cast<int>(actual) != width * count) {
+            conout, ConsoleBuffer::kDefaultAttributes, count, start,
+            &actual) || static_cast<int>(actual) != count) {
         trace("FillConsoleOutputAttribute failed");
     }
 }
 
-void Win32ConsoleBuffer::clearAllLines(const ConsoleScreenBufferInfo &info) {
-    clearLines(0, info.bufferSize().Y, info);
+// Scrolling the rect entirely out of itself fills it, characters and
+// attributes, in a single call, and only the cells of the rect, where the
+// Fill functions take a call each and write a contiguous run of cells.
+void Win32ConsoleBuffer::clearRect(const SmallRect &rect) {
+    static const bool kScrollClear = !hasDebugFlag("no_scroll_clear");
+    if (rect.width() <= 0 || rect.height() <= 0) {
+        return;
+    }
+    if (kScrollClear) {
+        CHAR_INFO fill = {};
+        fill.Char.UnicodeChar = L' ';
+        fill.Attributes = kDefaultAttributes;
+        const Coord dest(rect.Left, rect.Top - rect.height());
+        ConsoleApiScope call(WINPTY_CONSOLE_API_FILL_OUTPUT,
+                             rect.width() * rect.height());
+        if (ScrollConsoleScreenBufferW(m_conout, &rect, &rect, dest, &fill)) {
+            return;
+        }
+        trace("ScrollConsoleScreenBufferW failed");
+    }
+    const int bufferWidth = bufferInfo().bufferSize().X;
+    if (rect.Left == 0 && rect.width() >= bufferWidth) {
+        fillBlankCells(m_conout, Coord(0, rect.Top),
+                       bufferWidth * rect.height());
+        return;
+    }
+    for (int row = rect.Top; row <= rect.Bottom; ++row) {
+        fillBlankCells(m_conout, Coord(rect.Left, row), rect.width());
+    }
 }
 
 ConsoleScreenBufferInfo Win32ConsoleBuffer::bufferInfo() {
+    const bool frozen = m_infoConsole != nullptr && m_infoConsole->frozen();
+    if (frozen && m_infoCached &&
+            m_infoFreezeCount == m_infoConsole->freezeCount()) {
+        return m_info;
+    }
     // TODO: error handling
     ConsoleScreenBufferInfo info;
+    ConsoleApiScope call(WINPTY_CONSOLE_API_BUFFER_INFO);
     if (!GetConsoleScreenBufferInfo(m_conout, &info)) {
         trace("GetConsoleScreenBufferInfo failed");
+        m_infoCached = false;
+        return info;
+    }
+    m_infoCached = frozen;
+    if (frozen) {
+        m_info = info;
+        m_infoFreezeCount = m_infoConsole->freezeCount();
     }
     return info;
 }
 
-Coord Win32ConsoleBuffer::bufferSize() {
-    return bufferInfo().bufferSize();
-}
-
-SmallRect Win32ConsoleBuffer::windowRect() {
-    return bufferInfo().windowRect();
-}
-
 bool Win32ConsoleBuffer::resizeBufferRange(const Coord &initialSize,
                                            Coord &finalSize) {
+    invalidateInfo();
+    ConsoleApiScope call(WINPTY_CONSOLE_API_SET_BUFFER_SIZE);
     if (SetConsoleScreenBufferSize(m_conout, initialSize)) {
         finalSize = initialSize;
         return true;
@@ -129,6 +164,8 @@ bool Win32ConsoleBuffer::resizeBufferRange(const Coord &initialSize,
 }
 
 void Win32ConsoleBuffer::resizeBuffer(const Coord &size) {
+    invalidateInfo();
+    ConsoleApiScope call(WINPTY_CONSOLE_API_SET_BUFFER_SIZE);
     // TODO: error handling
     if (!SetConsoleScreenBufferSize(m_conout, size)) {
         trace("SetConsoleScreenBufferSize failed: size=(%d,%d)",
@@ -137,28 +174,53 @@ void Win32ConsoleBuffer::resizeBuffer(const Coord &size) {
 }
 
 void Win32ConsoleBuffer::moveWindow(const SmallRect &rect) {
+    invalidateInfo();
+    ConsoleApiScope call(WINPTY_CONSOLE_API_SET_WINDOW);
     // TODO: error handling
     if (!SetConsoleWindowInfo(m_conout, TRUE, &rect)) {
         trace("SetConsoleWindowInfo failed");
     }
 }
 
-Coord Win32ConsoleBuffer::cursorPosition() {
-    return bufferInfo().dwCursorPosition;
+Coord Win32ConsoleBuffer::largestWindowSize() {
+    ConsoleApiScope call(WINPTY_CONSOLE_API_OTHER);
+    return GetLargestConsoleWindowSize(m_conout);
+}
+
+void Win32ConsoleBuffer::setSmallFont(int columns, bool isNewW10) {
+    invalidateInfo();
+    ConsoleApiScope call(WINPTY_CONSOLE_API_FONT);
+    ::setSmallFont(m_conout, columns, isNewW10);
+}
+
+DWORD Win32ConsoleBuffer::outputMode() {
+    DWORD mode = 0;
+    ConsoleApiScope call(WINPTY_CONSOLE_API_OTHER);
+    if (!GetConsoleMode(m_conout, &mode)) {
+        mode = 0;
+    }
+    return mode;
 }
 
 void Win32ConsoleBuffer::setCursorPosition(const Coord &coord) {
+    invalidateInfo();
+    ConsoleApiScope call(WINPTY_CONSOLE_API_SET_CURSOR);
     // TODO: error handling
     if (!SetConsoleCursorPosition(m_conout, coord)) {
         trace("SetConsoleCursorPosition failed");
     }
 }
 
-void Win32ConsoleBuffer::read(const SmallRect &rect, CHAR_INFO *data) {
-    // TODO: error handling
+bool Win32ConsoleBuffer::read(const SmallRect &rect, CHAR_INFO *data) {
     SmallRect tmp(rect);
-    if (!ReadConsoleOutputW(m_conout, data, rect.size(), Coord(), &tmp) &&
-            isTracingEnabled()) {
+    bool ok;
+    {
+        ConsoleApiScope call(WINPTY_CONSOLE_API_READ_OUTPUT,
+                             rect.width() * rect.height());
+        ok = ReadConsoleOutputW(
+            m_conout, data, rect.size(), Coord(), &tmp) != 0;
+    }
+    if (!ok && isTracingEnabled()) {
         StringBuilder sb(256);
         auto outStruct = [&](const SMALL_RECT &sr) {
             sb << "{L=" << sr.Left << ",T=" << sr.Top
@@ -176,17 +238,22 @@ void Win32ConsoleBuffer::read(const SmallRect &rect, CHAR_INFO *data) {
         }
         trace("%s", sb.c_str());
     }
+    return ok;
 }
 
 void Win32ConsoleBuffer::write(const SmallRect &rect, const CHAR_INFO *data) {
     // TODO: error handling
     SmallRect tmp(rect);
+    ConsoleApiScope call(WINPTY_CONSOLE_API_WRITE_OUTPUT,
+                         rect.width() * rect.height());
     if (!WriteConsoleOutputW(m_conout, data, rect.size(), Coord(), &tmp)) {
         trace("WriteConsoleOutput failed");
     }
 }
 
 void Win32ConsoleBuffer::setTextAttribute(WORD attributes) {
+    invalidateInfo();
+    ConsoleApiScope call(WINPTY_CONSOLE_API_SET_CURSOR);
     if (!SetConsoleTextAttribute(m_conout, attributes)) {
         trace("SetConsoleTextAttribute failed");
     }
@@ -22,27 +22,17 @@
 #define AGENT_WIN32_CONSOLE_BUFFER_H
 
 #include <windows.h>
-
-#include <string.h>
+#include <stdint.h>
 
 #include <memory>
 
+#include "ConsoleBuffer.h"
 #include "Coord.h"
 #include "SmallRect.h"
 
-class ConsoleScreenBufferInfo : public CONSOLE_SCREEN_BUFFER_INFO {
-public:
-    ConsoleScreenBufferInfo()
-    {
-        memset(this, 0, sizeof(*this));
-    }
-
-    Coord bufferSize() const        { return dwSize;    }
-    SmallRect windowRect() const    { return srWindow;  }
-    Coord cursorPosition() const    { return dwCursorPosition; }
-};
+class Win32Console;
 
-class Win32ConsoleBuffer {
+class Win32ConsoleBuffer : public ConsoleBuffer {
 private:
     Win32ConsoleBuffer(HANDLE conout, bool owned) :
         m_conout(conout), m_owned(owned)
@@ -50,8 +40,6 @@ private:
     }
 
 public:
-    static const int kDefaultAttributes = 7;
-
     ~Win32ConsoleBuffer() {
         if (m_owned) {
             CloseHandle(m_conout);
@@ -66,34 +54,43 @@ public:
     Win32ConsoleBuffer &operator=(const Win32ConsoleBuffer &other) = delete;
 
     HANDLE conout();
-    void clearLines(int row, int count, const ConsoleScreenBufferInfo &info);
-    void clearAllLines(const ConsoleScreenBufferInfo &info);
+    // While the console is frozen, answer bufferInfo from the first query of
+    // the frozen span.  The buffer's own resize, window, and cursor calls
+    // still invalidate it.
+    void cacheInfoWhileFrozen(Win32Console &console) {
+        m_infoConsole = &console;
+    }
+    virtual void clearRect(const SmallRect &rect) override;
 
     // Buffer and window sizes.
-    ConsoleScreenBufferInfo bufferInfo();
-    Coord bufferSize();
-    SmallRect windowRect();
+    virtual ConsoleScreenBufferInfo bufferInfo() override;
     void resizeBuffer(const Coord &size);
-    bool resizeBufferRange(const Coord &initialSize, Coord &finalSize);
-    bool resizeBufferRange(const Coord &initialSize) {
-        Coord dummy;
-        return resizeBufferRange(initialSize, dummy);
-    }
-    void moveWindow(const SmallRect &rect);
+    using ConsoleBuffer::resizeBufferRange;
+    virtual bool resizeBufferRange(const Coord &initialSize,
+                                   Coord &finalSize) override;
+    virtual void moveWindow(const SmallRect &rect) override;
+    virtual Coord largestWindowSize() override;
+    virtual void setSmallFont(int columns, bool isNewW10) override;
+    virtual DWORD outputMode() override;
 
     // Cursor.
-    Coord cursorPosition();
-    void setCursorPosition(const Coord &point);
+    virtual void setCursorPosition(const Coord &point) override;
 
     // Screen content.
-    void read(const SmallRect &rect, CHAR_INFO *data);
-    void write(const SmallRect &rect, const CHAR_INFO *data);
+    virtual bool read(const SmallRect &rect, CHAR_INFO *data) override;
+    virtual void write(const SmallRect &rect, const CHAR_INFO *data) override;
 
-    void setTextAttribute(WORD attributes);
+    virtual void setTextAttribute(WORD attributes) override;
 
 private:
+    void invalidateInfo() { m_infoCached = false; }
+
     HANDLE m_conout = nullptr;
     bool m_owned = false;
+    Win32Console *m_infoConsole = nullptr;
+    bool m_infoCached = false;
+    uint32_t m_infoFreezeCount = 0;
+    ConsoleScreenBufferInfo m_info;
 };
 
 #endif // AGENT_WIN32_CONSOLE_BUFFER_H
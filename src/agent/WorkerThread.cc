@@ -0,0 +1,83 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "WorkerThread.h"
+
+#include <utility>
+
+#include "../shared/WinptyAssert.h"
+
+WorkerThread::WorkerThread() :
+    m_startEvent(CreateEventW(nullptr, FALSE, FALSE, nullptr)),
+    m_doneEvent(CreateEventW(nullptr, FALSE, FALSE, nullptr))
+{
+    ASSERT(m_startEvent.get() != nullptr && m_doneEvent.get() != nullptr &&
+           "CreateEventW failed");
+    m_thread = OwnedHandle(
+        CreateThread(nullptr, 0, threadProc, this, 0, nullptr));
+    ASSERT(m_thread.get() != nullptr && "CreateThread failed");
+}
+
+WorkerThread::~WorkerThread()
+{
+    if (m_busy) {
+        wait();
+    }
+    m_exiting = true;
+    SetEvent(m_startEvent.get());
+    WaitForSingleObject(m_thread.get(), INFINITE);
+}
+
+void WorkerThread::post(std::function<void()> task)
+{
+    ASSERT(!m_busy);
+    m_task = std::move(task);
+    m_busy = true;
+    SetEvent(m_startEvent.get());
+}
+
+void WorkerThread::wait()
+{
+    ASSERT(m_busy);
+    WaitForSingleObject(m_doneEvent.get(), INFINITE);
+    m_busy = false;
+    m_task = nullptr;
+}
+
+DWORD WINAPI WorkerThread::threadProc(LPVOID param)
+{
+    static_cast<WorkerThread*>(param)->run();
+    return 0;
+}
+
+// The events order the memory accesses: the worker sees everything written
+// before post, and the caller sees everything the task wrote once wait
+// returns.
+void WorkerThread::run()
+{
+    while (true) {
+        WaitForSingleObject(m_startEvent.get(), INFINITE);
+        if (m_exiting) {
+            break;
+        }
+        m_task();
+        SetEvent(m_doneEvent.get());
+    }
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef AGENT_WORKER_THREAD_H
+#define AGENT_WORKER_THREAD_H
+
+#include <windows.h>
+
+#include <functional>
+
+#include "../shared/OwnedHandle.h"
+
+// A thread that runs one task at a time on behalf of the event loop thread.
+// The caller posts a task, does other work, and then waits for the task.
+// Until then, the caller must leave alone the objects the task uses.
+class WorkerThread {
+public:
+    WorkerThread();
+    ~WorkerThread();
+    void post(std::function<void()> task);
+    void wait();
+
+    WorkerThread(const WorkerThread &other) = delete;
+    WorkerThread &operator=(const WorkerThread &other) = delete;
+
+private:
+    static DWORD WINAPI threadProc(LPVOID param);
+    void run();
+
+    OwnedHandle m_startEvent;
+    OwnedHandle m_doneEvent;
+    OwnedHandle m_thread;
+    std::function<void()> m_task;
+    bool m_busy = false;
+    bool m_exiting = false;
+};
+
+#endif // AGENT_WORKER_THREAD_H
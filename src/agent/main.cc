@@ -18,11 +18,13 @@
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
 // IN THE SOFTWARE.
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
 
+#include "../shared/DebugClient.h"
 #include "../shared/StringUtil.h"
 #include "../shared/WindowsVersion.h"
 #include "../shared/WinptyAssert.h"
@@ -33,7 +35,11 @@
 #include "DebugShowInput.h"
 
 const char USAGE[] =
-"Usage: %ls controlPipeName flags mouseMode cols rows\n"
+"Usage: %ls controlPipeName flags mouseMode cols rows minPollMs maxPollMs\n"
+"          historyLimitBytes maxFrameRate bufferLineCount syncMarkerMargin\n"
+"          maxConsoleWidth outPipeBufferSize inPipeBufferSize\n"
+"          coalesceDelayUs coalesceBytes schedulingClass affinityMask\n"
+"          creditBytes creditFrames idleTrimMs\n"
 "Usage: %ls controlPipeName --create-desktop\n"
 "\n"
 "Ordinarily, this program is launched by winpty.dll and is not directly\n"
@@ -55,19 +61,34 @@ static uint64_t winpty_atoi64(const char *str) {
     return strtoll(str, NULL, 10);
 }
 
-int main() {
+// Returns the microseconds since this process was created, or -1 if it isn't
+// known.  The system clock ticks coarsely (often 1-16ms), so this is only
+// useful for spotting slow startups.
+static int64_t microsecondsSinceProcessCreation() {
+    FILETIME creation = {}, exitTime = {}, kernel = {}, user = {};
+    if (!GetProcessTimes(GetCurrentProcess(),
+                         &creation, &exitTime, &kernel, &user)) {
+        return -1;
+    }
+    FILETIME now = {};
+    GetSystemTimeAsFileTime(&now);
+    const auto toUInt64 = [](const FILETIME &ft) {
+        return (static_cast<uint64_t>(ft.dwHighDateTime) << 32) |
+                static_cast<uint64_t>(ft.dwLowDateTime);
+    };
+    return static_cast<int64_t>(toUInt64(now) - toUInt64(creation)) / 10;
+}
+
+// The CRT splits the command line for wmain, so the agent doesn't need
+// CommandLineToArgvW, and with it, the shell32.dll import and its dependency
+// closure, which the loader would otherwise map and initialize before the
+// first instruction here.
+int wmain(int argc, wchar_t *argv[]) {
+    const int64_t usToMain =
+        isTracingEnabled() ? microsecondsSinceProcessCreation() : -1;
     dumpWindowsVersion();
     dumpVersionToTrace();
 
-    // Technically, we should free the CommandLineToArgvW return value using
-    // a single call to LocalFree, but the call will never actually happen in
-    // the normal case.
-    int argc = 0;
-    wchar_t *cmdline = GetCommandLineW();
-    ASSERT(cmdline != nullptr && "GetCommandLineW returned NULL");
-    wchar_t **argv = CommandLineToArgvW(cmdline, &argc);
-    ASSERT(argv != nullptr && "CommandLineToArgvW returned NULL");
-
     if (argc == 2 && !wcscmp(argv[1], L"--version")) {
         dumpVersionToStdout();
         return 0;
@@ -96,7 +117,7 @@ int main() {
         return 0;
     }
 
-    if (argc != 6) {
+    if (argc != 22) {
         fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
         return 1;
     }
@@ -105,7 +126,28 @@ int main() {
                 winpty_atoi64(utf8FromWide(argv[2]).c_str()),
                 atoi(utf8FromWide(argv[3]).c_str()),
                 atoi(utf8FromWide(argv[4]).c_str()),
-                atoi(utf8FromWide(argv[5]).c_str()));
+                atoi(utf8FromWide(argv[5]).c_str()),
+                atoi(utf8FromWide(argv[6]).c_str()),
+                atoi(utf8FromWide(argv[7]).c_str()),
+                winpty_atoi64(utf8FromWide(argv[8]).c_str()),
+                atoi(utf8FromWide(argv[9]).c_str()),
+                atoi(utf8FromWide(argv[10]).c_str()),
+                atoi(utf8FromWide(argv[11]).c_str()),
+                atoi(utf8FromWide(argv[12]).c_str()),
+                atoi(utf8FromWide(argv[13]).c_str()),
+                atoi(utf8FromWide(argv[14]).c_str()),
+                atoi(utf8FromWide(argv[15]).c_str()),
+                atoi(utf8FromWide(argv[16]).c_str()),
+                atoi(utf8FromWide(argv[17]).c_str()),
+                winpty_atoi64(utf8FromWide(argv[18]).c_str()),
+                winpty_atoi64(utf8FromWide(argv[19]).c_str()),
+                winpty_atoi64(utf8FromWide(argv[20]).c_str()),
+                atoi(utf8FromWide(argv[21]).c_str()));
+    if (usToMain >= 0) {
+        trace("Agent startup: %lld us to main, %lld us to constructed agent",
+            static_cast<long long>(usToMain),
+            static_cast<long long>(microsecondsSinceProcessCreation()));
+    }
     agent.run();
 
     // The Agent destructor shouldn't return, but if it does, exit
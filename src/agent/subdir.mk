@@ -25,26 +25,41 @@ $(eval $(call def_mingw_target,agent,-DWINPTY_AGENT_ASSERT))
 AGENT_OBJECTS = \
 	build/agent/agent/Agent.o \
 	build/agent/agent/AgentCreateDesktop.o \
+	build/agent/agent/CharInfoKernels.o \
+	build/agent/agent/ConsoleApiStats.o \
+	build/agent/agent/ConsoleEventHook.o \
 	build/agent/agent/ConsoleFont.o \
+	build/agent/agent/ConsoleFrameFile.o \
+	build/agent/agent/ConsoleFrameRecorder.o \
 	build/agent/agent/ConsoleInput.o \
 	build/agent/agent/ConsoleInputReencoding.o \
 	build/agent/agent/ConsoleLine.o \
+	build/agent/agent/CpuCycles.o \
 	build/agent/agent/DebugShowInput.o \
 	build/agent/agent/DefaultInputMap.o \
+	build/agent/agent/DefaultInputMapImage.o \
+	build/agent/agent/EtwTrace.o \
 	build/agent/agent/EventLoop.o \
 	build/agent/agent/InputMap.o \
+	build/agent/agent/InputThread.o \
 	build/agent/agent/LargeConsoleRead.o \
 	build/agent/agent/NamedPipe.o \
+	build/agent/agent/PseudoConsole.o \
 	build/agent/agent/Scraper.o \
+	build/agent/agent/ScrollbackHistory.o \
+	build/agent/agent/SessionRecorder.o \
 	build/agent/agent/Terminal.o \
 	build/agent/agent/Win32Console.o \
 	build/agent/agent/Win32ConsoleBuffer.o \
+	build/agent/agent/WorkerThread.o \
 	build/agent/agent/main.o \
 	build/agent/shared/BackgroundDesktop.o \
 	build/agent/shared/Buffer.o \
 	build/agent/shared/DebugClient.o \
 	build/agent/shared/GenRandom.o \
 	build/agent/shared/OwnedHandle.o \
+	build/agent/shared/SharedMemoryRing.o \
+	build/agent/shared/StreamCompression.o \
 	build/agent/shared/StringUtil.o \
 	build/agent/shared/WindowsSecurity.o \
 	build/agent/shared/WindowsVersion.o \
@@ -54,8 +69,31 @@ AGENT_OBJECTS = \
 
 build/agent/shared/WinptyVersion.o : build/gen/GenVersion.h
 
-build/winpty-agent.exe : $(AGENT_OBJECTS)
+# The default InputMap is compiled at build time into constant tables, which
+# the agent processes share.
+GEN_INPUT_MAP_OBJECTS = \
+	build/agent/agent/DebugShowInput.o \
+	build/agent/agent/DefaultInputMap.o \
+	build/agent/agent/DefaultInputMapGen.o \
+	build/agent/agent/InputMap.o \
+	build/agent/shared/DebugClient.o \
+	build/agent/shared/WinptyAssert.o
+
+build/winpty-gen-input-map.exe : $(GEN_INPUT_MAP_OBJECTS)
 	$(info Linking $@)
 	@$(MINGW_CXX) $(MINGW_LDFLAGS) -o $@ $^
 
+build/gen/GenDefaultInputMap.h : build/winpty-gen-input-map.exe | $$(@D)/.mkdir
+	$(info Generating $@)
+	@$< $@
+
+build/agent/agent/DefaultInputMapImage.o : build/gen/GenDefaultInputMap.h
+build/agent/agent/DefaultInputMapImage.o : MINGW_CXXFLAGS += -DWINPTY_GEN_INPUT_MAP
+
+# The agent's entry point is wmain.
+build/winpty-agent.exe : $(AGENT_OBJECTS)
+	$(info Linking $@)
+	@$(MINGW_CXX) $(MINGW_LDFLAGS) -municode -o $@ $^
+
 -include $(AGENT_OBJECTS:.o=.d)
+-include build/agent/agent/DefaultInputMapGen.d
@@ -0,0 +1,246 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+// winpty-bench: repeatable libwinpty benchmarks with JSON results.
+//
+// The same executable is the child process inside each session.  It runs
+// the workload named on its command line after the CHILD argument.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "BenchUtil.h"
+#include "DecodeBench.h"
+#include "InputBench.h"
+#include "MemoryBench.h"
+#include "OutputBench.h"
+#include "ResizeBench.h"
+#include "ScaleBench.h"
+#include "ScraperBench.h"
+
+static void usage(const char *program, int code) {
+    printf("Usage: %s [options] [BENCH[:WORKLOAD,...]]...\n"
+           "\n"
+           "Runs benchmarks through libwinpty and prints the results as a JSON\n"
+           "array on stdout.  Progress goes to stderr.\n"
+           "\n"
+           "Benchmarks:\n"
+           "  output     CONOUT throughput and read spacing.  Workloads: spew,\n"
+           "             long_lines, redraw, color, cjk (default: all)\n"
+           "  input      Keystroke and paste echo latency.  Modes: poll25, poll5,\n"
+           "             adaptive, event (default: all)\n"
+           "  scraper    Offline Scraper and Terminal cost per frame, against an\n"
+           "             in-memory console.  Workloads: scroll, color, redraw,\n"
+           "             idle, replay (default: all; replay needs --replay)\n"
+           "  decode     Offline terminal input decoding, with no session.\n"
+           "             Workloads: lookup, keys, ascii, cjk, mouse, paste\n"
+           "             (default: all)\n"
+           "  memory     Offline heap use of the Scraper, Terminal, output pipe\n"
+           "             and InputMap, per console size.  Workloads: scroll,\n"
+           "             color, redraw, idle (default: all)\n"
+           "  resize     winpty_set_size reply and repaint latency over column\n"
+           "             and row sweeps and a resize storm.  Child workloads:\n"
+           "             idle, spew, redraw (default: all)\n"
+           "  scale      CPU, context switches, memory and echo latency with\n"
+           "             many concurrent typing, idle and spew sessions.\n"
+           "             Workloads are session counts (default: 1,10,100,500).\n"
+           "             Not run by default.\n"
+           "\n"
+           "Options:\n"
+           "  --size COLSxROWS   Console size (default: 80x25)\n"
+           "  --sizes LIST       Console sizes for memory, e.g. 80x25,200x60\n"
+           "                     (default: 80x25,120x50,240x100)\n"
+           "  --chars N          Characters written per output run (default: 4000000)\n"
+           "  --keys N           Keystrokes per input run (default: 500)\n"
+           "  --pastes N         Pastes per input run (default: 50)\n"
+           "  --paste-size N     Characters per paste (default: 1000)\n"
+           "  --frames N         Frames per synthetic scraper or memory run\n"
+           "                     (default: 2000)\n"
+           "  --input-bytes N    Bytes of terminal input per decode run (default: 4194304)\n"
+           "  --replay FILE      Recorded console frames for scraper:replay\n"
+           "  --seconds N        Measurement time per scale run (default: 10)\n"
+           "  --metrics FILE     Append scale sessions' metrics to a CSV file\n"
+           "  --repeat N         Runs per workload (default: 1)\n"
+           "  --flags N          winpty_config_new agent flags\n",
+           program);
+    exit(code);
+}
+
+static std::vector<std::string> splitList(const std::string &list) {
+    std::vector<std::string> ret;
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        const size_t comma = std::min(list.find(',', pos), list.size());
+        if (comma > pos) {
+            ret.push_back(list.substr(pos, comma - pos));
+        }
+        pos = comma + 1;
+    }
+    return ret;
+}
+
+static bool parseSize(const std::string &text, std::pair<int, int> &size) {
+    return sscanf(text.c_str(), "%dx%d", &size.first, &size.second) == 2 &&
+        size.first >= 1 && size.second >= 1;
+}
+
+static int childMain(int argc, char *argv[]) {
+    if (argc >= 5 && !strcmp(argv[2], "output")) {
+        return runOutputChild(argv[3], strtoll(argv[4], nullptr, 10));
+    } else if (argc >= 3 && !strcmp(argv[2], "input")) {
+        return runInputChild();
+    } else if (argc >= 4 && !strcmp(argv[2], "resize")) {
+        return runResizeChild(argv[3]);
+    } else if (argc >= 4 && !strcmp(argv[2], "scale")) {
+        return runScaleChild(argv[3]);
+    }
+    return 2;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && !strcmp(argv[1], "CHILD")) {
+        return childMain(argc, argv);
+    }
+
+    BenchOptions options;
+    int64_t outputChars = 4000000;
+    int inputKeys = 500;
+    int inputPastes = 50;
+    int pasteSize = 1000;
+    int scraperFrames = 2000;
+    int64_t decodeBytes = 4 * 1024 * 1024;
+    int scaleSeconds = 10;
+    std::string metricsPath;
+    std::string replayPath;
+    std::vector<std::pair<int, int>> memorySizes;
+    std::vector<std::string> benches;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "-h" || arg == "--help") {
+            usage(argv[0], 0);
+        } else if (arg == "--size" && hasValue) {
+            if (sscanf(argv[++i], "%dx%d", &options.cols, &options.rows) != 2 ||
+                    options.cols < 1 || options.rows < 1) {
+                usage(argv[0], 1);
+            }
+        } else if (arg == "--sizes" && hasValue) {
+            memorySizes.clear();
+            for (const auto &text : splitList(argv[++i])) {
+                std::pair<int, int> size;
+                if (!parseSize(text, size)) {
+                    usage(argv[0], 1);
+                }
+                memorySizes.push_back(size);
+            }
+        } else if (arg == "--chars" && hasValue) {
+            outputChars = strtoll(argv[++i], nullptr, 10);
+        } else if (arg == "--keys" && hasValue) {
+            inputKeys = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--pastes" && hasValue) {
+            inputPastes = std::max(0, atoi(argv[++i]));
+        } else if (arg == "--paste-size" && hasValue) {
+            pasteSize = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--frames" && hasValue) {
+            scraperFrames = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--input-bytes" && hasValue) {
+            decodeBytes = std::max<int64_t>(1, strtoll(argv[++i], nullptr, 10));
+        } else if (arg == "--seconds" && hasValue) {
+            scaleSeconds = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--metrics" && hasValue) {
+            metricsPath = argv[++i];
+        } else if (arg == "--replay" && hasValue) {
+            replayPath = argv[++i];
+        } else if (arg == "--repeat" && hasValue) {
+            options.repeat = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--flags" && hasValue) {
+            options.agentFlags = strtoull(argv[++i], nullptr, 0);
+        } else if (!arg.empty() && arg[0] != '-') {
+            benches.push_back(arg);
+        } else {
+            usage(argv[0], 1);
+        }
+    }
+    if (benches.empty()) {
+        benches.push_back("output");
+        benches.push_back("input");
+        benches.push_back("scraper");
+        benches.push_back("decode");
+        benches.push_back("memory");
+        benches.push_back("resize");
+    }
+    if (memorySizes.empty()) {
+        memorySizes.push_back(std::make_pair(80, 25));
+        memorySizes.push_back(std::make_pair(120, 50));
+        memorySizes.push_back(std::make_pair(240, 100));
+    }
+
+    std::vector<std::string> results;
+    for (const auto &bench : benches) {
+        const size_t colon = bench.find(':');
+        const std::string name = bench.substr(0, colon);
+        const std::vector<std::string> workloads =
+            colon == std::string::npos
+                ? std::vector<std::string>()
+                : splitList(bench.substr(colon + 1));
+        if (name == "output") {
+            runOutputBenches(options,
+                             workloads.empty() ? outputWorkloads() : workloads,
+                             outputChars, results);
+        } else if (name == "input") {
+            runInputBenches(options,
+                            workloads.empty() ? inputModes() : workloads,
+                            inputKeys, inputPastes, pasteSize, results);
+        } else if (name == "scraper") {
+            runScraperBenches(options,
+                              workloads.empty()
+                                  ? scraperWorkloads(!replayPath.empty())
+                                  : workloads,
+                              scraperFrames, replayPath, results);
+        } else if (name == "decode") {
+            runDecodeBenches(options,
+                             workloads.empty() ? decodeWorkloads() : workloads,
+                             decodeBytes, results);
+        } else if (name == "memory") {
+            runMemoryBenches(options,
+                             workloads.empty() ? memoryWorkloads() : workloads,
+                             memorySizes, scraperFrames, results);
+        } else if (name == "resize") {
+            runResizeBenches(options,
+                             workloads.empty() ? resizeWorkloads() : workloads,
+                             results);
+        } else if (name == "scale") {
+            runScaleBenches(options,
+                            workloads.empty() ? scaleWorkloads() : workloads,
+                            scaleSeconds, metricsPath, results);
+        } else {
+            benchFail("unknown benchmark: %s", name.c_str());
+        }
+    }
+    printJsonResults(results);
+    return 0;
+}
@@ -0,0 +1,297 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "BenchUtil.h"
+
+#include <malloc.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <new>
+
+#include "../shared/WinptyException.h"
+#include "../shared/winpty_snprintf.h"
+
+// Count every heap allocation in the process, and the bytes they hold, so
+// the offline benchmarks can report allocations and heap growth.  The
+// session benchmarks don't read the counts.  (libwinpty and the agent have
+// their own allocators.)
+static volatile LONG g_allocationCount = 0;
+static volatile LONG g_liveHeapBytes = 0;
+
+void *operator new(size_t size) {
+    InterlockedIncrement(&g_allocationCount);
+    void *ret = malloc(size == 0 ? 1 : size);
+    if (ret == nullptr) {
+        throw std::bad_alloc();
+    }
+    InterlockedExchangeAdd(&g_liveHeapBytes, static_cast<LONG>(_msize(ret)));
+    return ret;
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *ptr) WINPTY_NOEXCEPT {
+    if (ptr != nullptr) {
+        InterlockedExchangeAdd(&g_liveHeapBytes,
+                               -static_cast<LONG>(_msize(ptr)));
+        free(ptr);
+    }
+}
+
+void operator delete[](void *ptr) WINPTY_NOEXCEPT {
+    operator delete(ptr);
+}
+
+LONG benchAllocationCount() {
+    return g_allocationCount;
+}
+
+LONG benchLiveHeapBytes() {
+    return g_liveHeapBytes;
+}
+
+double benchNowMs() {
+    static const double freq = [] {
+        LARGE_INTEGER ret;
+        QueryPerformanceFrequency(&ret);
+        return static_cast<double>(ret.QuadPart);
+    }();
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return static_cast<double>(now.QuadPart) * 1000.0 / freq;
+}
+
+void benchFail(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    fprintf(stderr, "winpty-bench: error: ");
+    vfprintf(stderr, format, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+static double percentile(const std::vector<double> &sorted, double fraction) {
+    const size_t index = std::min(
+        sorted.size() - 1,
+        static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5));
+    return sorted[index];
+}
+
+LatencyStats computeLatencyStats(std::vector<double> samples) {
+    LatencyStats ret;
+    ret.count = samples.size();
+    if (samples.empty()) {
+        return ret;
+    }
+    std::sort(samples.begin(), samples.end());
+    double sum = 0.0;
+    for (double s : samples) {
+        sum += s;
+    }
+    ret.mean = sum / samples.size();
+    ret.p50 = percentile(samples, 0.50);
+    ret.p90 = percentile(samples, 0.90);
+    ret.p99 = percentile(samples, 0.99);
+    ret.p999 = percentile(samples, 0.999);
+    ret.max = samples.back();
+    return ret;
+}
+
+JsonResult::JsonResult(const char *bench) : m_text("{") {
+    add("bench", bench);
+}
+
+void JsonResult::addName(const char *name) {
+    if (m_text.size() > 1) {
+        m_text += ", ";
+    }
+    m_text += "\"";
+    m_text += name;
+    m_text += "\": ";
+}
+
+void JsonResult::add(const char *name, const std::string &value) {
+    addName(name);
+    m_text += "\"";
+    for (char ch : value) {
+        if (ch == '"' || ch == '\\') {
+            m_text += '\\';
+            m_text += ch;
+        } else if (static_cast<unsigned char>(ch) < 0x20) {
+            char buf[8];
+            winpty_snprintf(buf, "\\u%04x", static_cast<unsigned char>(ch));
+            m_text += buf;
+        } else {
+            m_text += ch;
+        }
+    }
+    m_text += "\"";
+}
+
+void JsonResult::add(const char *name, double value) {
+    addName(name);
+    char buf[64];
+    winpty_snprintf(buf, "%.3f", value);
+    m_text += buf;
+}
+
+void JsonResult::add(const char *name, int64_t value) {
+    addName(name);
+    char buf[32];
+    winpty_snprintf(buf, "%lld", static_cast<long long>(value));
+    m_text += buf;
+}
+
+void JsonResult::add(const char *name, const LatencyStats &stats) {
+    addName(name);
+    char buf[256];
+    winpty_snprintf(buf,
+        "{\"count\": %u, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+        "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f}",
+        static_cast<unsigned>(stats.count), stats.mean, stats.p50,
+        stats.p90, stats.p99, stats.p999, stats.max);
+    m_text += buf;
+}
+
+void printJsonResults(const std::vector<std::string> &results) {
+    printf("[\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        printf("  %s%s\n", results[i].c_str(),
+               i + 1 < results.size() ? "," : "");
+    }
+    printf("]\n");
+    fflush(stdout);
+}
+
+void TerminalTextFilter::feed(const char *data, size_t size,
+                              std::string &textOut) {
+    for (size_t i = 0; i < size; ++i) {
+        const char ch = data[i];
+        switch (m_state) {
+        case State::Text:
+            if (ch == '\x1b') {
+                m_state = State::Escape;
+            } else if (static_cast<unsigned char>(ch) >= 0x20) {
+                textOut.push_back(ch);
+            }
+            break;
+        case State::Escape:
+            m_state = (ch == '[') ? State::Csi :
+                      (ch == ']') ? State::Osc : State::Text;
+            break;
+        case State::Csi:
+            if (ch >= 0x40 && ch <= 0x7e) {
+                m_state = State::Text;
+            }
+            break;
+        case State::Osc:
+            if (ch == '\x07') {
+                m_state = State::Text;
+            } else if (ch == '\x1b') {
+                m_state = State::OscEscape;
+            }
+            break;
+        case State::OscEscape:
+            m_state = (ch == '\\') ? State::Text : State::Osc;
+            break;
+        }
+    }
+}
+
+void BenchSession::open(const BenchOptions &options) {
+    winpty_error_ptr_t err = nullptr;
+    auto cfg = winpty_config_new(options.agentFlags, &err);
+    if (cfg == nullptr) {
+        benchFail("winpty_config_new failed: %ls", winpty_error_msg(err));
+    }
+    winpty_config_set_initial_size(cfg, options.cols, options.rows);
+    if (options.pollMinMs > 0) {
+        winpty_config_set_poll_interval(cfg, options.pollMinMs,
+                                        std::max(options.pollMinMs,
+                                                 options.pollMaxMs));
+    }
+    m_pty = winpty_open(cfg, &err);
+    winpty_config_free(cfg);
+    if (m_pty == nullptr) {
+        benchFail("winpty_open failed: %ls", winpty_error_msg(err));
+    }
+    m_conin = CreateFileW(winpty_conin_name(m_pty), GENERIC_WRITE, 0,
+                          nullptr, OPEN_EXISTING, 0, nullptr);
+    m_conout = CreateFileW(winpty_conout_name(m_pty), GENERIC_READ, 0,
+                           nullptr, OPEN_EXISTING, 0, nullptr);
+    if (m_conin == INVALID_HANDLE_VALUE || m_conout == INVALID_HANDLE_VALUE) {
+        benchFail("could not connect to the CONIN/CONOUT pipes");
+    }
+}
+
+void BenchSession::spawnChild(const std::wstring &args) {
+    wchar_t program[MAX_PATH];
+    GetModuleFileNameW(nullptr, program, MAX_PATH);
+    const std::wstring cmdline =
+        L"\"" + std::wstring(program) + L"\" CHILD " + args;
+    winpty_error_ptr_t err = nullptr;
+    auto spawnCfg = winpty_spawn_config_new(
+        WINPTY_SPAWN_FLAG_AUTO_SHUTDOWN, program, cmdline.c_str(),
+        nullptr, nullptr, &err);
+    if (spawnCfg == nullptr) {
+        benchFail("winpty_spawn_config_new failed: %ls",
+                  winpty_error_msg(err));
+    }
+    const BOOL success = winpty_spawn(
+        m_pty, spawnCfg, &m_process, nullptr, nullptr, &err);
+    winpty_spawn_config_free(spawnCfg);
+    if (!success) {
+        benchFail("winpty_spawn failed: %ls", winpty_error_msg(err));
+    }
+}
+
+DWORD BenchSession::waitForChild() {
+    DWORD exitCode = 0;
+    if (m_process != nullptr) {
+        WaitForSingleObject(m_process, INFINITE);
+        GetExitCodeProcess(m_process, &exitCode);
+    }
+    return exitCode;
+}
+
+void BenchSession::close() {
+    if (m_process != nullptr) {
+        CloseHandle(m_process);
+        m_process = nullptr;
+    }
+    if (m_conin != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_conin);
+        m_conin = INVALID_HANDLE_VALUE;
+    }
+    if (m_conout != INVALID_HANDLE_VALUE) {
+        CloseHandle(m_conout);
+        m_conout = INVALID_HANDLE_VALUE;
+    }
+    if (m_pty != nullptr) {
+        winpty_free(m_pty);
+        m_pty = nullptr;
+    }
+}
@@ -0,0 +1,119 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_BENCH_UTIL_H
+#define WINPTY_BENCH_UTIL_H
+
+#include <windows.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include <winpty.h>
+
+// Milliseconds from an arbitrary starting point, using the performance
+// counter.
+double benchNowMs();
+
+// The number of operator new calls in this process so far, and the bytes
+// held by the blocks they returned that haven't been deleted.
+LONG benchAllocationCount();
+LONG benchLiveHeapBytes();
+
+struct LatencyStats {
+    size_t count = 0;
+    double mean = 0.0;
+    double p50 = 0.0;
+    double p90 = 0.0;
+    double p99 = 0.0;
+    double p999 = 0.0;
+    double max = 0.0;
+};
+
+LatencyStats computeLatencyStats(std::vector<double> samples);
+
+// Accumulates one JSON object per benchmark result and prints them as an
+// array, so runs can be compared by a script.
+class JsonResult {
+public:
+    explicit JsonResult(const char *bench);
+    void add(const char *name, const std::string &value);
+    void add(const char *name, const char *value) {
+        add(name, std::string(value));
+    }
+    void add(const char *name, double value);
+    void add(const char *name, int64_t value);
+    void add(const char *name, const LatencyStats &stats);
+    const std::string &str() const { return m_text; }
+    std::string finish() const { return m_text + "}"; }
+private:
+    void addName(const char *name);
+    std::string m_text;
+};
+
+void printJsonResults(const std::vector<std::string> &results);
+
+// Strips escape sequences from a stream of terminal output, leaving the
+// printable text.  Sequences may be split across calls.
+class TerminalTextFilter {
+public:
+    void feed(const char *data, size_t size, std::string &textOut);
+private:
+    enum class State { Text, Escape, Csi, Osc, OscEscape };
+    State m_state = State::Text;
+};
+
+struct BenchOptions {
+    int cols = 80;
+    int rows = 25;
+    UINT64 agentFlags = 0;
+    // The agent's poll interval bounds, or 0 for the default.
+    int pollMinMs = 0;
+    int pollMaxMs = 0;
+    int repeat = 1;
+};
+
+// An agent with a child process running this executable in CHILD mode.
+class BenchSession {
+public:
+    BenchSession() {}
+    ~BenchSession() { close(); }
+    void open(const BenchOptions &options);
+    // Spawns "<this exe> CHILD <args>" with auto-shutdown.
+    void spawnChild(const std::wstring &args);
+    winpty_t *pty() { return m_pty; }
+    HANDLE conin() { return m_conin; }
+    HANDLE conout() { return m_conout; }
+    HANDLE process() { return m_process; }
+    DWORD waitForChild();
+    void close();
+    BenchSession(const BenchSession &other) = delete;
+    BenchSession &operator=(const BenchSession &other) = delete;
+private:
+    winpty_t *m_pty = nullptr;
+    HANDLE m_conin = INVALID_HANDLE_VALUE;
+    HANDLE m_conout = INVALID_HANDLE_VALUE;
+    HANDLE m_process = nullptr;
+};
+
+[[noreturn]] void benchFail(const char *format, ...);
+
+#endif // WINPTY_BENCH_UTIL_H
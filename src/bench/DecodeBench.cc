@@ -0,0 +1,236 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "DecodeBench.h"
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <iterator>
+#include <string.h>
+
+#include "../agent/ConsoleInput.h"
+#include "../agent/DefaultInputMap.h"
+#include "../agent/DsrSender.h"
+#include "../agent/InputMap.h"
+#include "../agent/Win32Console.h"
+#include "../include/winpty_constants.h"
+#include "../shared/winpty_snprintf.h"
+
+namespace {
+
+const char *const kDecodeWorkloads[] = {
+    "lookup", "keys", "ascii", "cjk", "mouse", "paste",
+};
+
+// Escape sequences from the default input map, as common terminals send
+// them: cursor and editing keys, function keys, and modified variants.
+const char *const kKeySequences[] = {
+    "\x1b[A", "\x1b[B", "\x1b[C", "\x1b[D",
+    "\x1bOA", "\x1bOB", "\x1bOC", "\x1bOD",
+    "\x1b[H", "\x1b[F", "\x1b[1~", "\x1b[4~",
+    "\x1b[2~", "\x1b[3~", "\x1b[5~", "\x1b[6~",
+    "\x1bOP", "\x1bOQ", "\x1bOR", "\x1bOS",
+    "\x1b[15~", "\x1b[17~", "\x1b[18~", "\x1b[19~",
+    "\x1b[20~", "\x1b[21~", "\x1b[23~", "\x1b[24~",
+    "\x1b[1;2A", "\x1b[1;3B", "\x1b[1;5C", "\x1b[1;6D",
+    "\x1b[3;5~", "\x1b[5;3~", "\x1b[15;2~", "\x1b[1;5P",
+    "\x7f", "\x08", "\t", "\r",
+};
+const size_t kKeySequenceCount =
+    sizeof(kKeySequences) / sizeof(kKeySequences[0]);
+
+// Terminal input arrives in pipe reads; feed it in pieces of this size.
+const size_t kChunkSize = 4096;
+
+class NullDsrSender : public DsrSender {
+public:
+    void sendDsr() override {}
+};
+
+void appendUtf8(std::string &out, uint32_t codePoint) {
+    if (codePoint < 0x80) {
+        out.push_back(static_cast<char>(codePoint));
+    } else if (codePoint < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (codePoint >> 6)));
+        out.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    } else {
+        out.push_back(static_cast<char>(0xE0 | (codePoint >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+    }
+}
+
+// Scripted terminal input for one workload, at least `size` bytes long.
+std::string makeInput(const std::string &name, const BenchOptions &options,
+                      int64_t size) {
+    std::string ret;
+    ret.reserve(static_cast<size_t>(size) + 512);
+    int64_t step = 0;
+    while (static_cast<int64_t>(ret.size()) < size) {
+        if (name == "keys") {
+            ret += kKeySequences[step % kKeySequenceCount];
+        } else if (name == "ascii") {
+            const char *const kText =
+                "the quick brown fox jumps over the lazy dog 0123456789\r";
+            ret += kText;
+        } else if (name == "cjk") {
+            appendUtf8(ret, 0x4E00 + static_cast<uint32_t>(step % 0x5000));
+        } else if (name == "mouse") {
+            // Drag across the window with the left button, with a press and
+            // a release at each end.
+            char buf[64];
+            const int x = static_cast<int>(step % options.cols) + 1;
+            const int y = static_cast<int>((step / options.cols) %
+                                           options.rows) + 1;
+            if (x == 1) {
+                winpty_snprintf(buf, "\x1b[<0;%d;%dM", x, y);
+            } else if (x == options.cols) {
+                winpty_snprintf(buf, "\x1b[<0;%d;%dm", x, y);
+            } else {
+                winpty_snprintf(buf, "\x1b[<32;%d;%dM", x, y);
+            }
+            ret += buf;
+        } else if (name == "paste") {
+            ret += "\x1b[200~";
+            for (int line = 0; line < 64; ++line) {
+                ret += "    printf(\"pasted line %d\\n\", line);\r";
+            }
+            ret += "\x1b[201~";
+        }
+        ++step;
+    }
+    return ret;
+}
+
+JsonResult startResult(const char *workload, int64_t bytes,
+                       uint64_t records, double elapsedMs, LONG allocations) {
+    const double seconds = elapsedMs / 1000.0;
+    const double megabytes = static_cast<double>(bytes) / (1024.0 * 1024.0);
+    JsonResult result("decode");
+    result.add("workload", workload);
+    result.add("bytes", bytes);
+    result.add("records", static_cast<int64_t>(records));
+    result.add("elapsed_ms", elapsedMs);
+    result.add("mb_per_sec", seconds > 0.0 ? megabytes / seconds : 0.0);
+    result.add("records_per_sec",
+               seconds > 0.0 ? static_cast<double>(records) / seconds : 0.0);
+    result.add("allocations", static_cast<int64_t>(allocations));
+    result.add("allocations_per_mb",
+               megabytes > 0.0 ? allocations / megabytes : 0.0);
+    return result;
+}
+
+void runLookupBench(int64_t inputBytes, std::vector<std::string> &results) {
+    InputMap inputMap;
+    addDefaultEntriesToInputMap(inputMap);
+    inputMap.compile();
+
+    int64_t bytes = 0;
+    uint64_t matches = 0;
+    const LONG allocationsBefore = benchAllocationCount();
+    const double start = benchNowMs();
+    for (size_t i = 0; bytes < inputBytes; ++i) {
+        const char *const seq = kKeySequences[i % kKeySequenceCount];
+        const int len = static_cast<int>(strlen(seq));
+        InputMap::Key key;
+        bool incomplete = false;
+        if (inputMap.lookupKey(seq, len, key, incomplete) > 0) {
+            ++matches;
+        }
+        bytes += len;
+    }
+    const double elapsedMs = benchNowMs() - start;
+    results.push_back(
+        startResult("lookup", bytes, matches, elapsedMs,
+                    benchAllocationCount() - allocationsBefore).finish());
+}
+
+void runOneDecodeBench(const BenchOptions &options, const std::string &name,
+                       int64_t inputBytes,
+                       std::vector<std::string> &results) {
+    if (name == "lookup") {
+        runLookupBench(inputBytes, results);
+        return;
+    }
+    const std::string input = makeInput(name, options, inputBytes);
+
+    // ConsoleInput reads and sets the input mode of this process's own
+    // console.  Turn on mouse input and turn off QuickEdit, so mouse
+    // sequences become records, and put the mode back afterward.
+    const HANDLE conin = GetStdHandle(STD_INPUT_HANDLE);
+    DWORD origMode = 0;
+    const bool haveMode = GetConsoleMode(conin, &origMode) != 0;
+    Win32Console console(nullptr);
+    NullDsrSender dsrSender;
+    ConsoleInput consoleInput(conin, WINPTY_MOUSE_MODE_FORCE, dsrSender,
+                              console);
+    consoleInput.setDiscardRecords(true);
+    SetConsoleMode(conin, ENABLE_EXTENDED_FLAGS | ENABLE_MOUSE_INPUT |
+                          ENABLE_WINDOW_INPUT);
+    consoleInput.updateInputFlags();
+    consoleInput.setMouseWindowRect(
+        SmallRect(0, 0, options.cols, options.rows));
+
+    const LONG allocationsBefore = benchAllocationCount();
+    const double start = benchNowMs();
+    for (size_t pos = 0; pos < input.size(); pos += kChunkSize) {
+        consoleInput.writeInput(input.data() + pos,
+                                std::min(kChunkSize, input.size() - pos));
+    }
+    const double elapsedMs = benchNowMs() - start;
+    const LONG allocations = benchAllocationCount() - allocationsBefore;
+
+    if (haveMode) {
+        SetConsoleMode(conin, origMode);
+    }
+    results.push_back(
+        startResult(name.c_str(), static_cast<int64_t>(input.size()),
+                    consoleInput.recordsWritten(), elapsedMs,
+                    allocations).finish());
+}
+
+} // anonymous namespace
+
+std::vector<std::string> decodeWorkloads() {
+    return std::vector<std::string>(std::begin(kDecodeWorkloads),
+                                    std::end(kDecodeWorkloads));
+}
+
+void runDecodeBenches(const BenchOptions &options,
+                      const std::vector<std::string> &workloads,
+                      int64_t inputBytes,
+                      std::vector<std::string> &results) {
+    const std::vector<std::string> known = decodeWorkloads();
+    for (const auto &name : workloads) {
+        if (std::find(known.begin(), known.end(), name) == known.end()) {
+            benchFail("unknown decode workload: %s", name.c_str());
+        }
+    }
+    for (const auto &name : workloads) {
+        for (int i = 0; i < options.repeat; ++i) {
+            fprintf(stderr, "decode %s (run %d of %d)\n",
+                    name.c_str(), i + 1, options.repeat);
+            runOneDecodeBench(options, name, inputBytes, results);
+        }
+    }
+}
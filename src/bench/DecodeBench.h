@@ -0,0 +1,45 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_BENCH_DECODE_BENCH_H
+#define WINPTY_BENCH_DECODE_BENCH_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "BenchUtil.h"
+
+// The offline input decoding workloads, in their default order.
+std::vector<std::string> decodeWorkloads();
+
+// Runs the agent's terminal input decoding in-process, with no session: the
+// "lookup" workload calls InputMap::lookupKey on the default key sequences,
+// and the others feed about `inputBytes` bytes of scripted terminal input
+// through ConsoleInput, whose console input records are counted and
+// dropped.  Appends one JSON result per run, with records per second and
+// heap allocations per megabyte of input.
+void runDecodeBenches(const BenchOptions &options,
+                      const std::vector<std::string> &workloads,
+                      int64_t inputBytes,
+                      std::vector<std::string> &results);
+
+#endif // WINPTY_BENCH_DECODE_BENCH_H
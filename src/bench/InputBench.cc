@@ -0,0 +1,224 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "InputBench.h"
+
+#include <windows.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+namespace {
+
+struct InputMode {
+    const char *name;
+    int pollMinMs;
+    int pollMaxMs;
+    UINT64 agentFlags;
+};
+
+const InputMode kInputModes[] = {
+    { "poll25",   25,  25, 0 },
+    { "poll5",     5,   5, 0 },
+    { "adaptive",  1, 100, 0 },
+    { "event",     0,   0, WINPTY_FLAG_EVENT_DRIVEN_SCRAPE },
+};
+
+const InputMode *findInputMode(const std::string &name) {
+    for (const auto &mode : kInputModes) {
+        if (name == mode.name) {
+            return &mode;
+        }
+    }
+    return nullptr;
+}
+
+// The child starts by printing this, and each probe ends with one of the
+// marker characters.  The child echoes every character over column 0, so
+// the screen only ever shows the latest one, and a stale marker cannot be
+// mistaken for the current one even if the agent resends the line.
+const char kReadyChar = '@';
+const char kMarkers[] = "abcdefghijklmnopqrstuvwxyz";
+const char kPasteFiller = '.';
+const char kExitChar = '\x04';      // Ctrl-D
+
+class EchoReader {
+public:
+    explicit EchoReader(HANDLE conout) : m_conout(conout) {}
+    // Reads CONOUT until `ch` is visible.  Returns false on EOF.
+    bool waitFor(char ch) {
+        while (true) {
+            const size_t pos = m_text.find(ch);
+            if (pos != std::string::npos) {
+                m_text.erase(0, pos + 1);
+                return true;
+            }
+            m_text.clear();
+            char buf[4096];
+            DWORD actual = 0;
+            if (!ReadFile(m_conout, buf, sizeof(buf), &actual, nullptr) ||
+                    actual == 0) {
+                return false;
+            }
+            m_filter.feed(buf, actual, m_text);
+        }
+    }
+    void drain() {
+        char buf[4096];
+        DWORD actual = 0;
+        while (ReadFile(m_conout, buf, sizeof(buf), &actual, nullptr) &&
+               actual != 0) {
+        }
+    }
+private:
+    HANDLE m_conout;
+    TerminalTextFilter m_filter;
+    std::string m_text;
+};
+
+void writeConin(HANDLE conin, const std::string &data) {
+    DWORD actual = 0;
+    if (!WriteFile(conin, data.data(), data.size(), &actual, nullptr) ||
+            actual != data.size()) {
+        benchFail("CONIN write failed");
+    }
+}
+
+void runOneInputBench(const BenchOptions &baseOptions,
+                      const InputMode &mode,
+                      int keys, int pastes, int pasteSize,
+                      std::vector<std::string> &results) {
+    BenchOptions options = baseOptions;
+    options.pollMinMs = mode.pollMinMs;
+    options.pollMaxMs = mode.pollMaxMs;
+    options.agentFlags |= mode.agentFlags;
+
+    BenchSession session;
+    session.open(options);
+    session.spawnChild(L"input");
+    EchoReader reader(session.conout());
+    if (!reader.waitFor(kReadyChar)) {
+        benchFail("input child did not start");
+    }
+
+    const int markerCount = sizeof(kMarkers) - 1;
+    std::vector<double> keyLatency;
+    for (int i = 0; i < keys; ++i) {
+        const char marker = kMarkers[i % markerCount];
+        const double start = benchNowMs();
+        writeConin(session.conin(), std::string(1, marker));
+        if (!reader.waitFor(marker)) {
+            benchFail("CONOUT closed during the keystroke test");
+        }
+        keyLatency.push_back(benchNowMs() - start);
+    }
+
+    std::vector<double> pasteLatency;
+    for (int i = 0; i < pastes; ++i) {
+        const char marker = kMarkers[(keys + i) % markerCount];
+        std::string block(std::max(0, pasteSize - 1), kPasteFiller);
+        block.push_back(marker);
+        const double start = benchNowMs();
+        writeConin(session.conin(), block);
+        if (!reader.waitFor(marker)) {
+            benchFail("CONOUT closed during the paste test");
+        }
+        pasteLatency.push_back(benchNowMs() - start);
+    }
+
+    writeConin(session.conin(), std::string(1, kExitChar));
+    reader.drain();
+    session.waitForChild();
+
+    JsonResult result("input");
+    result.add("mode", mode.name);
+    result.add("poll_min_ms", static_cast<int64_t>(mode.pollMinMs));
+    result.add("poll_max_ms", static_cast<int64_t>(mode.pollMaxMs));
+    result.add("agent_flags", static_cast<int64_t>(options.agentFlags));
+    result.add("key_latency_ms", computeLatencyStats(std::move(keyLatency)));
+    result.add("paste_size", static_cast<int64_t>(pasteSize));
+    result.add("paste_latency_ms",
+               computeLatencyStats(std::move(pasteLatency)));
+    results.push_back(result.finish());
+}
+
+} // anonymous namespace
+
+std::vector<std::string> inputModes() {
+    std::vector<std::string> ret;
+    for (const auto &mode : kInputModes) {
+        ret.push_back(mode.name);
+    }
+    return ret;
+}
+
+void runInputBenches(const BenchOptions &options,
+                     const std::vector<std::string> &modes,
+                     int keys, int pastes, int pasteSize,
+                     std::vector<std::string> &results) {
+    for (const auto &name : modes) {
+        const InputMode *mode = findInputMode(name);
+        if (mode == nullptr) {
+            benchFail("unknown input mode: %s", name.c_str());
+        }
+        for (int i = 0; i < options.repeat; ++i) {
+            fprintf(stderr, "input %s (run %d of %d)\n",
+                    name.c_str(), i + 1, options.repeat);
+            runOneInputBench(options, *mode, keys, pastes, pasteSize,
+                             results);
+        }
+    }
+}
+
+int runInputChild() {
+    const HANDLE conin = GetStdHandle(STD_INPUT_HANDLE);
+    const HANDLE conout = GetStdHandle(STD_OUTPUT_HANDLE);
+    SetConsoleMode(conin, 0);
+    const wchar_t ready[] = { L'\r', static_cast<wchar_t>(kReadyChar) };
+    DWORD actual = 0;
+    WriteConsoleW(conout, ready, 2, &actual, nullptr);
+
+    INPUT_RECORD records[256];
+    while (true) {
+        DWORD count = 0;
+        if (!ReadConsoleInputW(conin, records, 256, &count)) {
+            return 1;
+        }
+        // Echo a whole batch at once, as a line editor would.
+        std::wstring echo;
+        for (DWORD i = 0; i < count; ++i) {
+            const INPUT_RECORD &rec = records[i];
+            if (rec.EventType != KEY_EVENT || !rec.Event.KeyEvent.bKeyDown) {
+                continue;
+            }
+            const wchar_t ch = rec.Event.KeyEvent.uChar.UnicodeChar;
+            if (ch == static_cast<wchar_t>(kExitChar)) {
+                return 0;
+            }
+            if (ch >= L' ') {
+                echo.push_back(L'\r');
+                echo.push_back(ch);
+            }
+        }
+        if (!echo.empty()) {
+            WriteConsoleW(conout, echo.data(), echo.size(), &actual, nullptr);
+        }
+    }
+}
@@ -0,0 +1,147 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "MemoryBench.h"
+
+#include <windows.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "ScraperBench.h"
+#include "../agent/DefaultInputMap.h"
+#include "../agent/InputMap.h"
+#include "../agent/MemoryConsoleBuffer.h"
+#include "../agent/NamedPipe.h"
+#include "../agent/Scraper.h"
+#include "../agent/Terminal.h"
+#include "../agent/Win32Console.h"
+
+namespace {
+
+struct ComponentBytes {
+    int64_t bufferData = 0;
+    int64_t readBuffer = 0;
+    int64_t tracking = 0;
+    int64_t pipe = 0;
+    int64_t terminal = 0;
+    int64_t inputMap = 0;
+
+    int64_t total() const {
+        return bufferData + readBuffer + tracking + pipe + terminal + inputMap;
+    }
+};
+
+ComponentBytes measure(const Scraper &scraper, NamedPipe &pipe,
+                       const Terminal &terminal, const InputMap &inputMap) {
+    ComponentBytes ret;
+    ret.bufferData = scraper.bufferDataBytes();
+    ret.readBuffer = scraper.readBufferBytes();
+    ret.tracking = scraper.trackingBytes();
+    ret.pipe = pipe.heapBytes();
+    ret.terminal = terminal.heapBytes();
+    ret.inputMap = inputMap.heapBytes();
+    return ret;
+}
+
+void runOneMemoryBench(const std::string &name, Coord size, int frameCount,
+                       std::vector<std::string> &results) {
+    const LONG heapBefore = benchLiveHeapBytes();
+    const LONG allocationsBefore = benchAllocationCount();
+
+    Win32Console console(nullptr);
+    MemoryConsoleBuffer buffer;
+    OfflineEventLoop loop;
+    NamedPipe &pipe = loop.pipe();
+    InputMap inputMap;
+    loadDefaultInputMap(inputMap);
+    Scraper scraper(console, buffer,
+                    std::unique_ptr<Terminal>(new Terminal(pipe, false, true)),
+                    size);
+
+    ConsoleScreenBufferInfo info;
+    int64_t logLine = 0;
+    int64_t peak = 0;
+    for (int frame = 0; frame < frameCount; ++frame) {
+        // Each frame's output stays queued until the next frame, as it would
+        // while a slow client reads it.
+        pipe.discardOutput();
+        writeSyntheticFrame(buffer, name, frame, logLine);
+        scraper.scrapeBuffer(buffer, info);
+        peak = std::max(peak, measure(scraper, pipe, scraper.terminal(),
+                                      inputMap).total());
+    }
+    const ComponentBytes bytes =
+        measure(scraper, pipe, scraper.terminal(), inputMap);
+    const LONG heapGrowth = benchLiveHeapBytes() - heapBefore;
+    const LONG allocations = benchAllocationCount() - allocationsBefore;
+
+    JsonResult result("memory");
+    result.add("workload", name);
+    result.add("cols", static_cast<int64_t>(size.X));
+    result.add("rows", static_cast<int64_t>(size.Y));
+    result.add("frames", static_cast<int64_t>(frameCount));
+    result.add("buffer_data_bytes", bytes.bufferData);
+    result.add("read_buffer_bytes", bytes.readBuffer);
+    result.add("scroll_tracking_bytes", bytes.tracking);
+    result.add("pipe_bytes", bytes.pipe);
+    result.add("terminal_bytes", bytes.terminal);
+    result.add("input_map_bytes", bytes.inputMap);
+    result.add("component_bytes", bytes.total());
+    result.add("peak_component_bytes", std::max(peak, bytes.total()));
+    result.add("heap_growth_bytes", static_cast<int64_t>(heapGrowth));
+    result.add("allocations", static_cast<int64_t>(allocations));
+    result.add("allocations_per_frame",
+               frameCount > 0
+                   ? static_cast<double>(allocations) / frameCount
+                   : 0.0);
+    results.push_back(result.finish());
+}
+
+} // anonymous namespace
+
+std::vector<std::string> memoryWorkloads() {
+    return scraperWorkloads(false);
+}
+
+void runMemoryBenches(const BenchOptions &options,
+                      const std::vector<std::string> &workloads,
+                      const std::vector<std::pair<int, int>> &sizes,
+                      int frames,
+                      std::vector<std::string> &results) {
+    const std::vector<std::string> known = memoryWorkloads();
+    for (const auto &name : workloads) {
+        if (std::find(known.begin(), known.end(), name) == known.end()) {
+            benchFail("unknown memory workload: %s", name.c_str());
+        }
+    }
+    for (const auto &name : workloads) {
+        for (const auto &size : sizes) {
+            for (int i = 0; i < options.repeat; ++i) {
+                fprintf(stderr, "memory %s %dx%d (run %d of %d)\n",
+                        name.c_str(), size.first, size.second,
+                        i + 1, options.repeat);
+                runOneMemoryBench(name, Coord(size.first, size.second),
+                                  frames, results);
+            }
+        }
+    }
+}
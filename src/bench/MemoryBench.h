@@ -0,0 +1,46 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_BENCH_MEMORY_BENCH_H
+#define WINPTY_BENCH_MEMORY_BENCH_H
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "BenchUtil.h"
+
+// The memory workloads, in their default order: the synthetic scraper
+// workloads.
+std::vector<std::string> memoryWorkloads();
+
+// Runs each workload in-process, as the scraper benchmark does, once per
+// console size in `sizes`, and appends one JSON result per run with the heap
+// bytes held by each agent component afterward (the scraper's saved lines,
+// its read buffer and scroll tracking, the output pipe's queues, the
+// terminal's encoding buffers, and a default InputMap), the peak of their
+// sum, and the process's heap growth and allocation count.
+void runMemoryBenches(const BenchOptions &options,
+                      const std::vector<std::string> &workloads,
+                      const std::vector<std::pair<int, int>> &sizes,
+                      int frames,
+                      std::vector<std::string> &results);
+
+#endif // WINPTY_BENCH_MEMORY_BENCH_H
@@ -0,0 +1,275 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "OutputBench.h"
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+#include "../shared/winpty_snprintf.h"
+
+namespace {
+
+std::string formatInt(long long value) {
+    char buf[32];
+    winpty_snprintf(buf, "%lld", value);
+    return buf;
+}
+
+std::wstring widen(const std::string &ascii) {
+    return std::wstring(ascii.begin(), ascii.end());
+}
+
+class ConsoleWriter {
+public:
+    ConsoleWriter() : m_conout(GetStdHandle(STD_OUTPUT_HANDLE)) {
+        CONSOLE_SCREEN_BUFFER_INFO info = {};
+        GetConsoleScreenBufferInfo(m_conout, &info);
+        m_cols = info.srWindow.Right - info.srWindow.Left + 1;
+        m_rows = info.srWindow.Bottom - info.srWindow.Top + 1;
+    }
+    ~ConsoleWriter() { flush(); }
+    void put(const wchar_t *text, size_t len) {
+        m_buffer.append(text, len);
+        m_written += len;
+        if (m_buffer.size() >= 4096) {
+            flush();
+        }
+    }
+    void put(const std::wstring &text) { put(text.data(), text.size()); }
+    void flush() {
+        size_t done = 0;
+        while (done < m_buffer.size()) {
+            DWORD actual = 0;
+            if (!WriteConsoleW(m_conout, m_buffer.data() + done,
+                               m_buffer.size() - done, &actual, nullptr) ||
+                    actual == 0) {
+                break;
+            }
+            done += actual;
+        }
+        m_buffer.clear();
+    }
+    void setColor(WORD attr) {
+        flush();
+        SetConsoleTextAttribute(m_conout, attr);
+    }
+    void home() {
+        flush();
+        COORD origin = {
+            0, 0
+        };
+        CONSOLE_SCREEN_BUFFER_INFO info = {};
+        GetConsoleScreenBufferInfo(m_conout, &info);
+        origin.Y = info.srWindow.Top;
+        SetConsoleCursorPosition(m_conout, origin);
+    }
+    int64_t written() const { return m_written; }
+    int cols() const { return m_cols; }
+    int rows() const { return m_rows; }
+private:
+    HANDLE m_conout;
+    std::wstring m_buffer;
+    int64_t m_written = 0;
+    int m_cols = 80;
+    int m_rows = 25;
+};
+
+void spewWorkload(ConsoleWriter &out, int64_t chars) {
+    for (long long i = 1; out.written() < chars; ++i) {
+        out.put(widen(formatInt(i)) + L"\n");
+    }
+}
+
+void longLineWorkload(ConsoleWriter &out, int64_t chars) {
+    std::wstring line;
+    for (int i = 0; i < 2000; ++i) {
+        line.push_back(static_cast<wchar_t>(L'a' + i % 26));
+    }
+    line.push_back(L'\n');
+    while (out.written() < chars) {
+        out.put(line);
+    }
+}
+
+// Rewrites the whole window each frame with a different character, so every
+// cell changes.  The last cell is skipped to avoid scrolling.
+void redrawWorkload(ConsoleWriter &out, int64_t chars) {
+    const size_t frameSize =
+        static_cast<size_t>(out.cols()) * out.rows() - 1;
+    for (int frame = 0; out.written() < chars; ++frame) {
+        out.home();
+        out.put(std::wstring(frameSize,
+                             static_cast<wchar_t>(L'A' + frame % 26)));
+    }
+}
+
+void colorWorkload(ConsoleWriter &out, int64_t chars) {
+    static const wchar_t *const kWords[] = {
+        L"alpha ", L"bravo ", L"charlie ", L"delta ", L"echo ",
+        L"foxtrot ", L"golf ", L"hotel ",
+    };
+    const int kWordCount = sizeof(kWords) / sizeof(kWords[0]);
+    for (int i = 0; out.written() < chars; ++i) {
+        out.setColor(static_cast<WORD>(1 + i % 15) | ((i / 15) % 8) << 4);
+        out.put(kWords[i % kWordCount], wcslen(kWords[i % kWordCount]));
+        if (i % 9 == 8) {
+            out.put(L"\n", 1);
+        }
+    }
+    out.setColor(FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE);
+}
+
+// Double-width CJK text mixed with ASCII.
+void cjkWorkload(ConsoleWriter &out, int64_t chars) {
+    const std::wstring line =
+        L"\u6f22\u5b57\u304b\u306a\u4ea4\u3058\u308a text "
+        L"\ud55c\uad6d\uc5b4 \u4e2d\u6587\u6d4b\u8bd5 mixed "
+        L"\u30c6\u30b9\u30c8\u6587\u5b57\u5217\n";
+    while (out.written() < chars) {
+        out.put(line);
+    }
+}
+
+typedef void WorkloadFunc(ConsoleWriter &out, int64_t chars);
+
+struct Workload {
+    const char *name;
+    WorkloadFunc *func;
+};
+
+const Workload kWorkloads[] = {
+    { "spew",       spewWorkload },
+    { "long_lines", longLineWorkload },
+    { "redraw",     redrawWorkload },
+    { "color",      colorWorkload },
+    { "cjk",        cjkWorkload },
+};
+
+const Workload *findWorkload(const std::string &name) {
+    for (const auto &workload : kWorkloads) {
+        if (name == workload.name) {
+            return &workload;
+        }
+    }
+    return nullptr;
+}
+
+} // anonymous namespace
+
+std::vector<std::string> outputWorkloads() {
+    std::vector<std::string> ret;
+    for (const auto &workload : kWorkloads) {
+        ret.push_back(workload.name);
+    }
+    return ret;
+}
+
+int runOutputChild(const std::string &name, int64_t chars) {
+    const Workload *workload = findWorkload(name);
+    if (workload == nullptr) {
+        return 2;
+    }
+    ConsoleWriter out;
+    workload->func(out, chars);
+    return 0;
+}
+
+static void runOneOutputBench(const BenchOptions &options,
+                              const std::string &name,
+                              int64_t chars,
+                              std::vector<std::string> &results) {
+    BenchSession session;
+    session.open(options);
+
+    const double start = benchNowMs();
+    session.spawnChild(L"output " + widen(name) + L" " +
+                       widen(formatInt(chars)));
+
+    // With auto-shutdown, the agent closes CONOUT once the child has exited
+    // and its output has been sent.
+    std::vector<char> buf(64 * 1024);
+    std::vector<double> gaps;
+    int64_t pipeBytes = 0;
+    double firstByte = -1.0;
+    double lastRead = start;
+    while (true) {
+        DWORD actual = 0;
+        if (!ReadFile(session.conout(), buf.data(), buf.size(), &actual,
+                      nullptr) || actual == 0) {
+            break;
+        }
+        const double now = benchNowMs();
+        if (firstByte < 0.0) {
+            firstByte = now - start;
+        } else {
+            gaps.push_back(now - lastRead);
+        }
+        lastRead = now;
+        pipeBytes += actual;
+    }
+    const double elapsed = lastRead - start;
+    const DWORD exitCode = session.waitForChild();
+    if (exitCode != 0) {
+        benchFail("output child for %s exited with %u",
+                  name.c_str(), static_cast<unsigned>(exitCode));
+    }
+
+    UINT64 stats[WINPTY_STAT_COUNT] = {};
+    winpty_get_stats(session.pty(), stats, WINPTY_STAT_COUNT, nullptr);
+
+    JsonResult result("output");
+    result.add("workload", name);
+    result.add("cols", static_cast<int64_t>(options.cols));
+    result.add("rows", static_cast<int64_t>(options.rows));
+    result.add("console_chars", chars);
+    result.add("pipe_bytes", pipeBytes);
+    result.add("elapsed_ms", elapsed);
+    result.add("first_byte_ms", firstByte);
+    result.add("pipe_mb_per_s",
+               elapsed > 0.0 ? pipeBytes / 1e6 / (elapsed / 1000.0) : 0.0);
+    result.add("console_mchars_per_s",
+               elapsed > 0.0 ? chars / 1e6 / (elapsed / 1000.0) : 0.0);
+    result.add("read_gap_ms", computeLatencyStats(std::move(gaps)));
+    result.add("scrapes", static_cast<int64_t>(stats[WINPTY_STAT_SCRAPES]));
+    result.add("lines_sent",
+               static_cast<int64_t>(stats[WINPTY_STAT_LINES_SENT]));
+    result.add("resyncs", static_cast<int64_t>(stats[WINPTY_STAT_RESYNCS]));
+    results.push_back(result.finish());
+}
+
+void runOutputBenches(const BenchOptions &options,
+                      const std::vector<std::string> &workloads,
+                      int64_t chars,
+                      std::vector<std::string> &results) {
+    for (const auto &name : workloads) {
+        if (findWorkload(name) == nullptr) {
+            benchFail("unknown output workload: %s", name.c_str());
+        }
+        for (int i = 0; i < options.repeat; ++i) {
+            fprintf(stderr, "output %s (run %d of %d)\n",
+                    name.c_str(), i + 1, options.repeat);
+            runOneOutputBench(options, name, chars, results);
+        }
+    }
+}
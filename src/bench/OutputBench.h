@@ -0,0 +1,44 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_BENCH_OUTPUT_BENCH_H
+#define WINPTY_BENCH_OUTPUT_BENCH_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "BenchUtil.h"
+
+// The output workloads, in their default order.
+std::vector<std::string> outputWorkloads();
+
+// Runs each workload in a fresh session, writing about `chars` characters to
+// the console, and appends one JSON result per run.
+void runOutputBenches(const BenchOptions &options,
+                      const std::vector<std::string> &workloads,
+                      int64_t chars,
+                      std::vector<std::string> &results);
+
+// The child side: writes the workload's output to the console.
+int runOutputChild(const std::string &workload, int64_t chars);
+
+#endif // WINPTY_BENCH_OUTPUT_BENCH_H
@@ -0,0 +1,364 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "ResizeBench.h"
+
+#include <windows.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "../shared/winpty_snprintf.h"
+
+namespace {
+
+const char *const kResizeWorkloads[] = {
+    "idle", "spew", "redraw",
+};
+
+const char kExitChar = '\x04';      // Ctrl-D
+
+// Resizes per sweep, and the size change of each step.
+const int kSweepSteps = 10;
+const int kColumnStep = 4;
+const int kRowStep = 2;
+const int kStormResizes = 40;
+
+typedef std::pair<int, int> Size;
+
+// The child reports each window size it sees as "{COLS,ROWS,SEQ}", where SEQ
+// counts the sizes it has seen.  A repaint can resend an old report, so only
+// a report with a new sequence number counts.
+class ReportReader {
+public:
+    explicit ReportReader(HANDLE conout) : m_conout(conout) {}
+    // Reads CONOUT until a new report of the given size arrives.  Returns
+    // false on EOF.
+    bool waitFor(const Size &size) {
+        while (true) {
+            while (true) {
+                const size_t pos = m_text.find('{');
+                if (pos == std::string::npos) {
+                    m_text.clear();
+                    break;
+                }
+                const size_t end = m_text.find('}', pos);
+                if (end == std::string::npos) {
+                    m_text.erase(0, pos);
+                    break;
+                }
+                int cols = 0, rows = 0, seq = 0;
+                const bool parsed = sscanf(m_text.c_str() + pos, "{%d,%d,%d}",
+                                           &cols, &rows, &seq) == 3;
+                m_text.erase(0, end + 1);
+                if (parsed && seq > m_lastSeq) {
+                    m_lastSeq = seq;
+                    if (cols == size.first && rows == size.second) {
+                        return true;
+                    }
+                }
+            }
+            char buf[4096];
+            DWORD actual = 0;
+            if (!ReadFile(m_conout, buf, sizeof(buf), &actual, nullptr) ||
+                    actual == 0) {
+                return false;
+            }
+            m_bytes += actual;
+            m_filter.feed(buf, actual, m_text);
+        }
+    }
+    void drain() {
+        char buf[4096];
+        DWORD actual = 0;
+        while (ReadFile(m_conout, buf, sizeof(buf), &actual, nullptr) &&
+               actual != 0) {
+        }
+    }
+    // The CONOUT bytes read so far.
+    int64_t bytes() const { return m_bytes; }
+private:
+    HANDLE m_conout;
+    TerminalTextFilter m_filter;
+    std::string m_text;
+    int m_lastSeq = 0;
+    int64_t m_bytes = 0;
+};
+
+void writeConin(HANDLE conin, const std::string &data) {
+    DWORD actual = 0;
+    if (!WriteFile(conin, data.data(), data.size(), &actual, nullptr) ||
+            actual != data.size()) {
+        benchFail("CONIN write failed");
+    }
+}
+
+void setSize(BenchSession &session, const Size &size) {
+    if (!winpty_set_size(session.pty(), size.first, size.second, nullptr)) {
+        benchFail("winpty_set_size(%d, %d) failed", size.first, size.second);
+    }
+}
+
+// Up in steps, then back down to the starting size.
+std::vector<Size> sweepSizes(const Size &base, bool columns) {
+    std::vector<Size> ret;
+    for (int i = 1; i <= kSweepSteps * 2; ++i) {
+        const int step = i <= kSweepSteps ? i : kSweepSteps * 2 - i;
+        ret.push_back(columns
+            ? Size(base.first + step * kColumnStep, base.second)
+            : Size(base.first, base.second + step * kRowStep));
+    }
+    return ret;
+}
+
+// Alternating column and row changes by even amounts, ending at a size with
+// odd offsets, which no earlier step of the storm used.
+std::vector<Size> stormSizes(const Size &base) {
+    std::vector<Size> ret;
+    for (int i = 0; i < kStormResizes - 1; ++i) {
+        ret.push_back(i % 2 == 0
+            ? Size(base.first + 2 * (i % 5 + 1), base.second)
+            : Size(base.first, base.second + 2 * (i % 4 + 1)));
+    }
+    ret.push_back(Size(base.first + 7, base.second + 3));
+    return ret;
+}
+
+class SweepResult {
+public:
+    SweepResult(BenchSession &session, ReportReader &reader,
+                const std::string &workload, const char *sweep) :
+        m_session(session), m_reader(reader), m_result("resize"),
+        m_bytesBefore(reader.bytes())
+    {
+        winpty_get_stats(session.pty(), m_statsBefore, WINPTY_STAT_COUNT,
+                         nullptr);
+        m_result.add("workload", workload);
+        m_result.add("sweep", sweep);
+    }
+    JsonResult &result() { return m_result; }
+    std::string finish(size_t resizes) {
+        UINT64 stats[WINPTY_STAT_COUNT] = {};
+        winpty_get_stats(m_session.pty(), stats, WINPTY_STAT_COUNT, nullptr);
+        const int64_t bytes = m_reader.bytes() - m_bytesBefore;
+        m_result.add("resizes", static_cast<int64_t>(resizes));
+        m_result.add("bytes", bytes);
+        m_result.add("bytes_per_resize",
+                     resizes > 0 ? static_cast<double>(bytes) / resizes : 0.0);
+        m_result.add("scrapes", static_cast<int64_t>(
+            stats[WINPTY_STAT_SCRAPES] - m_statsBefore[WINPTY_STAT_SCRAPES]));
+        m_result.add("resyncs", static_cast<int64_t>(
+            stats[WINPTY_STAT_RESYNCS] - m_statsBefore[WINPTY_STAT_RESYNCS]));
+        return m_result.finish();
+    }
+private:
+    BenchSession &m_session;
+    ReportReader &m_reader;
+    JsonResult m_result;
+    UINT64 m_statsBefore[WINPTY_STAT_COUNT] = {};
+    int64_t m_bytesBefore = 0;
+};
+
+// Each resize waits for the child's report before the next one.
+void runSweep(BenchSession &session, ReportReader &reader,
+              const std::string &workload, const char *sweep,
+              const std::vector<Size> &sizes,
+              std::vector<std::string> &results) {
+    SweepResult sweepResult(session, reader, workload, sweep);
+    std::vector<double> replyMs;
+    std::vector<double> repaintMs;
+    for (const Size &size : sizes) {
+        const double start = benchNowMs();
+        setSize(session, size);
+        replyMs.push_back(benchNowMs() - start);
+        if (!reader.waitFor(size)) {
+            benchFail("CONOUT closed during the %s sweep", sweep);
+        }
+        repaintMs.push_back(benchNowMs() - start);
+    }
+    sweepResult.result().add("reply_ms",
+                             computeLatencyStats(std::move(replyMs)));
+    sweepResult.result().add("repaint_ms",
+                             computeLatencyStats(std::move(repaintMs)));
+    results.push_back(sweepResult.finish(sizes.size()));
+}
+
+// The resizes go back to back; only the last size's report is awaited.
+void runStorm(BenchSession &session, ReportReader &reader,
+              const std::string &workload, const std::vector<Size> &sizes,
+              std::vector<std::string> &results) {
+    SweepResult sweepResult(session, reader, workload, "storm");
+    std::vector<double> replyMs;
+    const double start = benchNowMs();
+    double lastReply = start;
+    for (const Size &size : sizes) {
+        const double before = benchNowMs();
+        setSize(session, size);
+        lastReply = benchNowMs();
+        replyMs.push_back(lastReply - before);
+    }
+    if (!reader.waitFor(sizes.back())) {
+        benchFail("CONOUT closed during the resize storm");
+    }
+    const double end = benchNowMs();
+    sweepResult.result().add("reply_ms",
+                             computeLatencyStats(std::move(replyMs)));
+    sweepResult.result().add("storm_ms", lastReply - start);
+    sweepResult.result().add("settle_ms", end - lastReply);
+    sweepResult.result().add("total_ms", end - start);
+    results.push_back(sweepResult.finish(sizes.size()));
+}
+
+void runOneResizeBench(const BenchOptions &options,
+                       const std::string &workload,
+                       std::vector<std::string> &results) {
+    BenchSession session;
+    session.open(options);
+    session.spawnChild(L"resize " +
+                       std::wstring(workload.begin(), workload.end()));
+    ReportReader reader(session.conout());
+    const Size base(options.cols, options.rows);
+    if (!reader.waitFor(base)) {
+        benchFail("resize child did not start");
+    }
+
+    runSweep(session, reader, workload, "columns", sweepSizes(base, true),
+             results);
+    runSweep(session, reader, workload, "rows", sweepSizes(base, false),
+             results);
+    runStorm(session, reader, workload, stormSizes(base), results);
+
+    writeConin(session.conin(), std::string(1, kExitChar));
+    reader.drain();
+    session.waitForChild();
+}
+
+void writeAscii(HANDLE conout, const char *text, size_t len) {
+    DWORD actual = 0;
+    WriteConsoleA(conout, text, len, &actual, nullptr);
+}
+
+// Rewrites the whole window, with the size report at the top-left.  The
+// last cell is skipped to avoid scrolling.
+void redrawWindow(HANDLE conout, const SMALL_RECT &window, int seq,
+                  int frame) {
+    const int cols = window.Right - window.Left + 1;
+    const int rows = window.Bottom - window.Top + 1;
+    COORD origin = { window.Left, window.Top };
+    SetConsoleCursorPosition(conout, origin);
+    char report[64];
+    winpty_snprintf(report, "{%d,%d,%d}", cols, rows, seq);
+    std::string text = report;
+    text.resize(static_cast<size_t>(cols) * rows - 1,
+                static_cast<char>('A' + frame % 26));
+    writeAscii(conout, text.data(), text.size());
+}
+
+} // anonymous namespace
+
+std::vector<std::string> resizeWorkloads() {
+    return std::vector<std::string>(std::begin(kResizeWorkloads),
+                                    std::end(kResizeWorkloads));
+}
+
+void runResizeBenches(const BenchOptions &options,
+                      const std::vector<std::string> &workloads,
+                      std::vector<std::string> &results) {
+    const std::vector<std::string> known = resizeWorkloads();
+    for (const auto &name : workloads) {
+        if (std::find(known.begin(), known.end(), name) == known.end()) {
+            benchFail("unknown resize workload: %s", name.c_str());
+        }
+    }
+    for (const auto &name : workloads) {
+        for (int i = 0; i < options.repeat; ++i) {
+            fprintf(stderr, "resize %s (run %d of %d)\n",
+                    name.c_str(), i + 1, options.repeat);
+            runOneResizeBench(options, name, results);
+        }
+    }
+}
+
+int runResizeChild(const std::string &workload) {
+    const bool spew = workload == "spew";
+    const bool redraw = workload == "redraw";
+    if (!spew && !redraw && workload != "idle") {
+        return 2;
+    }
+    const HANDLE conin = GetStdHandle(STD_INPUT_HANDLE);
+    const HANDLE conout = GetStdHandle(STD_OUTPUT_HANDLE);
+    // A buffer size change wakes the wait below.  A change of the window
+    // height alone doesn't, so the size is also polled.
+    SetConsoleMode(conin, ENABLE_WINDOW_INPUT);
+
+    int cols = -1;
+    int rows = -1;
+    int seq = 0;
+    int frame = 0;
+    long long line = 0;
+    while (true) {
+        CONSOLE_SCREEN_BUFFER_INFO info = {};
+        GetConsoleScreenBufferInfo(conout, &info);
+        const int newCols = info.srWindow.Right - info.srWindow.Left + 1;
+        const int newRows = info.srWindow.Bottom - info.srWindow.Top + 1;
+        const bool resized = newCols != cols || newRows != rows;
+        if (resized) {
+            cols = newCols;
+            rows = newRows;
+            ++seq;
+        }
+        if (redraw) {
+            redrawWindow(conout, info.srWindow, seq, frame++);
+        } else if (resized) {
+            char report[64];
+            const int len = winpty_snprintf(report, "\r\n{%d,%d,%d}\r\n",
+                                            cols, rows, seq);
+            writeAscii(conout, report, len);
+        }
+        if (spew) {
+            for (int i = 0; i < 20; ++i) {
+                char text[64];
+                const int len = winpty_snprintf(
+                    text, "spew line %lld ........................\r\n",
+                    ++line);
+                writeAscii(conout, text, len);
+            }
+        }
+        const DWORD timeout = spew ? 0 : redraw ? 16 : 1;
+        if (WaitForSingleObject(conin, timeout) == WAIT_OBJECT_0) {
+            INPUT_RECORD records[64];
+            DWORD count = 0;
+            if (!ReadConsoleInputW(conin, records, 64, &count)) {
+                return 1;
+            }
+            for (DWORD i = 0; i < count; ++i) {
+                const INPUT_RECORD &rec = records[i];
+                if (rec.EventType == KEY_EVENT &&
+                        rec.Event.KeyEvent.bKeyDown &&
+                        rec.Event.KeyEvent.uChar.UnicodeChar ==
+                            static_cast<wchar_t>(kExitChar)) {
+                    return 0;
+                }
+            }
+        }
+    }
+}
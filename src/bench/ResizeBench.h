@@ -0,0 +1,45 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_BENCH_RESIZE_BENCH_H
+#define WINPTY_BENCH_RESIZE_BENCH_H
+
+#include <string>
+#include <vector>
+
+#include "BenchUtil.h"
+
+// The resize child workloads, in their default order.
+std::vector<std::string> resizeWorkloads();
+
+// Measures resizes through winpty_set_size, in a fresh session per child
+// workload: a column sweep, a row sweep, and a storm of back-to-back
+// resizes.  For each resize, it records the time until winpty_set_size
+// returns, the time until CONOUT shows the child's report of the new size,
+// and the CONOUT bytes in between.  Appends one JSON result per sweep.
+void runResizeBenches(const BenchOptions &options,
+                      const std::vector<std::string> &workloads,
+                      std::vector<std::string> &results);
+
+// The child side: reports each window size it sees while idling, spewing
+// lines, or redrawing the window.
+int runResizeChild(const std::string &workload);
+
+#endif // WINPTY_BENCH_RESIZE_BENCH_H
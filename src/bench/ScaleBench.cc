@@ -0,0 +1,579 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "ScaleBench.h"
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <utility>
+
+#include "../shared/winpty_snprintf.h"
+
+namespace {
+
+const char *const kScaleWorkloads[] = {
+    "1", "10", "100", "500",
+};
+
+// Sessions cycle through these children, so every session count has a
+// typing session to measure.
+enum class ChildKind { Typing, Idle, Spew };
+const ChildKind kChildCycle[] = {
+    ChildKind::Typing, ChildKind::Idle, ChildKind::Spew,
+};
+
+// The input child echoes each character over column 0.  Consecutive
+// keystrokes differ, so each one changes the screen.
+const char kMarkers[] = "abcdefghijklmnopqrstuvwxyz";
+const char kExitChar = '\x04';      // Ctrl-D
+
+// Each typing session sends a keystroke this often, once the previous one
+// has echoed, like a fast typist.  A keystroke that doesn't echo in time is
+// counted as a timeout, and typing resumes.
+const int kTypingIntervalMs = 100;
+const int kEchoTimeoutMs = 5000;
+
+// Lets the children and the agents' first scrapes finish before the
+// measurement starts.
+const int kSettleMs = 2000;
+
+// The CONOUT reader threads only move data, so they don't need the default
+// 1 MiB stack reservation, which would add up at 500 sessions.
+const SIZE_T kReaderStackSize = 64 * 1024;
+#ifndef STACK_SIZE_PARAM_IS_A_RESERVATION
+#define STACK_SIZE_PARAM_IS_A_RESERVATION 0x10000
+#endif
+
+// The layouts of ntdll's SYSTEM_PROCESS_INFORMATION and
+// SYSTEM_THREAD_INFORMATION, which the SDK headers only declare in part.
+// Each process record is followed by its thread records.
+struct NtThreadInfo {
+    LARGE_INTEGER KernelTime;
+    LARGE_INTEGER UserTime;
+    LARGE_INTEGER CreateTime;
+    ULONG WaitTime;
+    PVOID StartAddress;
+    HANDLE UniqueProcess;
+    HANDLE UniqueThread;
+    LONG Priority;
+    LONG BasePriority;
+    ULONG ContextSwitches;
+    ULONG ThreadState;
+    ULONG WaitReason;
+};
+
+struct NtProcessInfo {
+    ULONG NextEntryOffset;
+    ULONG NumberOfThreads;
+    LARGE_INTEGER Reserved1[3];
+    LARGE_INTEGER CreateTime;
+    LARGE_INTEGER UserTime;
+    LARGE_INTEGER KernelTime;
+    USHORT ImageNameLength;
+    USHORT ImageNameMaximumLength;
+    PWSTR ImageNameBuffer;
+    LONG BasePriority;
+    HANDLE UniqueProcessId;
+    HANDLE InheritedFromUniqueProcessId;
+    ULONG HandleCount;
+    ULONG SessionId;
+    ULONG_PTR UniqueProcessKey;
+    SIZE_T PeakVirtualSize;
+    SIZE_T VirtualSize;
+    ULONG PageFaultCount;
+    SIZE_T PeakWorkingSetSize;
+    SIZE_T WorkingSetSize;
+    SIZE_T QuotaPeakPagedPoolUsage;
+    SIZE_T QuotaPagedPoolUsage;
+    SIZE_T QuotaPeakNonPagedPoolUsage;
+    SIZE_T QuotaNonPagedPoolUsage;
+    SIZE_T PagefileUsage;
+    SIZE_T PeakPagefileUsage;
+    SIZE_T PrivatePageCount;
+    LARGE_INTEGER IoCounters[6];
+};
+
+// GetProcessId is XP SP1 and up, so older SDK headers omit it.
+DWORD processId(HANDLE process) {
+    typedef DWORD WINAPI GetProcessIdFn(HANDLE);
+    static const auto getProcessId = reinterpret_cast<GetProcessIdFn*>(
+        GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "GetProcessId"));
+    return getProcessId != nullptr ? getProcessId(process) : 0;
+}
+
+typedef LONG NTAPI NtQuerySystemInformationFn(
+    ULONG infoClass, PVOID info, ULONG infoSize, PULONG returnSize);
+
+const ULONG kSystemProcessInformation = 5;
+const LONG kStatusInfoLengthMismatch = static_cast<LONG>(0xC0000004);
+
+struct ProcessCounters {
+    // Kernel plus user time, in 100ns units.
+    int64_t cpuTime = 0;
+    int64_t contextSwitches = 0;
+    int64_t workingSet = 0;
+    int64_t privateBytes = 0;
+};
+
+typedef std::map<DWORD, ProcessCounters> ProcessSnapshot;
+
+// One NtQuerySystemInformation call reads the CPU time, memory, and
+// per-thread context switches of every process at once, which is far
+// cheaper than opening 1000 processes.
+ProcessSnapshot takeProcessSnapshot() {
+    static const auto query = reinterpret_cast<NtQuerySystemInformationFn*>(
+        GetProcAddress(GetModuleHandleW(L"ntdll.dll"),
+                       "NtQuerySystemInformation"));
+    if (query == nullptr) {
+        benchFail("NtQuerySystemInformation is missing");
+    }
+    std::vector<char> buf(1024 * 1024);
+    while (true) {
+        ULONG needed = 0;
+        const LONG status = query(kSystemProcessInformation, buf.data(),
+                                  buf.size(), &needed);
+        if (status == kStatusInfoLengthMismatch) {
+            // The process list can grow before the next call.
+            buf.resize(std::max<size_t>(buf.size() * 2, needed + 65536));
+            continue;
+        }
+        if (status < 0) {
+            benchFail("NtQuerySystemInformation failed: %#lx",
+                      static_cast<unsigned long>(status));
+        }
+        break;
+    }
+    ProcessSnapshot ret;
+    size_t offset = 0;
+    while (true) {
+        const auto proc =
+            reinterpret_cast<const NtProcessInfo*>(&buf[offset]);
+        ProcessCounters &counters = ret[static_cast<DWORD>(
+            reinterpret_cast<ULONG_PTR>(proc->UniqueProcessId))];
+        counters.cpuTime = proc->KernelTime.QuadPart + proc->UserTime.QuadPart;
+        counters.workingSet = proc->WorkingSetSize;
+        counters.privateBytes = proc->PagefileUsage;
+        const auto threads = reinterpret_cast<const NtThreadInfo*>(proc + 1);
+        for (ULONG i = 0; i < proc->NumberOfThreads; ++i) {
+            counters.contextSwitches += threads[i].ContextSwitches;
+        }
+        if (proc->NextEntryOffset == 0) {
+            break;
+        }
+        offset += proc->NextEntryOffset;
+    }
+    return ret;
+}
+
+// The counter changes of a set of processes between two snapshots.  A
+// process missing from either snapshot is skipped.
+ProcessCounters sumDeltas(const ProcessSnapshot &before,
+                          const ProcessSnapshot &after,
+                          const std::vector<DWORD> &pids) {
+    ProcessCounters ret;
+    for (DWORD pid : pids) {
+        const auto b = before.find(pid);
+        const auto a = after.find(pid);
+        if (b == before.end() || a == after.end()) {
+            continue;
+        }
+        ret.cpuTime += a->second.cpuTime - b->second.cpuTime;
+        ret.contextSwitches +=
+            a->second.contextSwitches - b->second.contextSwitches;
+        ret.workingSet += a->second.workingSet;
+        ret.privateBytes += a->second.privateBytes;
+    }
+    return ret;
+}
+
+// A session, and the thread that drains its CONOUT.  For a typing session,
+// the main thread sends keystrokes and the reader thread times their echo,
+// so the two share the keystroke state under the lock.
+struct ScaleSession {
+    ScaleSession() { InitializeCriticalSection(&lock); }
+    ~ScaleSession() { DeleteCriticalSection(&lock); }
+
+    ChildKind kind = ChildKind::Idle;
+    BenchSession session;
+    DWORD agentPid = 0;
+    DWORD childPid = 0;
+    HANDLE reader = nullptr;
+
+    CRITICAL_SECTION lock;
+    int64_t bytes = 0;
+    bool measuring = false;
+    bool outstanding = false;
+    char expected = '\0';
+    double sentMs = 0.0;
+    std::vector<double> echoMs;
+    int timeouts = 0;
+
+    // Touched only by the main thread.
+    int nextMarker = 0;
+    double nextSendMs = 0.0;
+};
+
+class Lock {
+public:
+    explicit Lock(CRITICAL_SECTION &cs) : m_cs(cs) { EnterCriticalSection(&m_cs); }
+    ~Lock() { LeaveCriticalSection(&m_cs); }
+    Lock(const Lock &other) = delete;
+    Lock &operator=(const Lock &other) = delete;
+private:
+    CRITICAL_SECTION &m_cs;
+};
+
+DWORD WINAPI readerThread(void *param) {
+    ScaleSession &s = *static_cast<ScaleSession*>(param);
+    TerminalTextFilter filter;
+    std::string text;
+    char buf[4096];
+    DWORD actual = 0;
+    while (ReadFile(s.session.conout(), buf, sizeof(buf), &actual, nullptr) &&
+           actual != 0) {
+        const double now = benchNowMs();
+        text.clear();
+        if (s.kind == ChildKind::Typing) {
+            filter.feed(buf, actual, text);
+        }
+        Lock lock(s.lock);
+        if (s.measuring) {
+            s.bytes += actual;
+        }
+        if (s.outstanding && text.find(s.expected) != std::string::npos) {
+            s.outstanding = false;
+            if (s.measuring) {
+                s.echoMs.push_back(now - s.sentMs);
+            }
+        }
+    }
+    return 0;
+}
+
+void writeConin(HANDLE conin, char ch) {
+    DWORD actual = 0;
+    if (!WriteFile(conin, &ch, 1, &actual, nullptr) || actual != 1) {
+        benchFail("CONIN write failed");
+    }
+}
+
+// Sends each typing session's next keystroke when it is due.
+void driveTyping(std::vector<std::unique_ptr<ScaleSession>> &sessions,
+                 double now) {
+    for (auto &s : sessions) {
+        if (s->kind != ChildKind::Typing || now < s->nextSendMs) {
+            continue;
+        }
+        char ch = '\0';
+        {
+            Lock lock(s->lock);
+            if (s->outstanding) {
+                if (now - s->sentMs < kEchoTimeoutMs) {
+                    continue;
+                }
+                if (s->measuring) {
+                    ++s->timeouts;
+                }
+            }
+            ch = kMarkers[s->nextMarker];
+            s->nextMarker = (s->nextMarker + 1) % (sizeof(kMarkers) - 1);
+            s->outstanding = true;
+            s->expected = ch;
+            s->sentMs = now;
+        }
+        writeConin(s->session.conin(), ch);
+        s->nextSendMs = now + kTypingIntervalMs;
+    }
+}
+
+// Runs the typing for a while, e.g. to settle or to measure.
+void runFor(std::vector<std::unique_ptr<ScaleSession>> &sessions,
+            double durationMs) {
+    const double end = benchNowMs() + durationMs;
+    while (true) {
+        const double now = benchNowMs();
+        if (now >= end) {
+            break;
+        }
+        driveTyping(sessions, now);
+        Sleep(1);
+    }
+}
+
+void setMeasuring(std::vector<std::unique_ptr<ScaleSession>> &sessions,
+                  bool measuring) {
+    for (auto &s : sessions) {
+        Lock lock(s->lock);
+        s->measuring = measuring;
+    }
+}
+
+// The sums of the agents' winpty_get_stats counters.
+std::vector<UINT64> sumAgentStats(
+        std::vector<std::unique_ptr<ScaleSession>> &sessions) {
+    std::vector<UINT64> ret(WINPTY_STAT_COUNT);
+    for (auto &s : sessions) {
+        UINT64 stats[WINPTY_STAT_COUNT] = {};
+        winpty_get_stats(s->session.pty(), stats, WINPTY_STAT_COUNT, nullptr);
+        for (int i = 0; i < WINPTY_STAT_COUNT; ++i) {
+            ret[i] += stats[i];
+        }
+    }
+    return ret;
+}
+
+// Appends the sessions' metrics to a CSV file, with a header if the file
+// is new.
+void appendSessionMetrics(
+        std::vector<std::unique_ptr<ScaleSession>> &sessions,
+        const std::string &path) {
+    std::vector<winpty_t*> ptys;
+    for (auto &s : sessions) {
+        ptys.push_back(s->session.pty());
+    }
+    FILE *file = fopen(path.c_str(), "ab");
+    if (file == nullptr) {
+        benchFail("could not open %s", path.c_str());
+    }
+    fseek(file, 0, SEEK_END);
+    const int format = ftell(file) == 0
+        ? WINPTY_METRICS_CSV : WINPTY_METRICS_CSV_ROWS;
+    winpty_metrics_t *metrics = winpty_export_metrics(
+        ptys.data(), nullptr, static_cast<int>(ptys.size()), format,
+        nullptr);
+    if (metrics == nullptr) {
+        benchFail("winpty_export_metrics failed");
+    }
+    size_t size = 0;
+    const char *text = winpty_metrics_text(metrics, &size);
+    fwrite(text, 1, size, file);
+    fclose(file);
+    winpty_metrics_free(metrics);
+}
+
+// Jain's fairness index: 1.0 when every session sees the same latency,
+// approaching 1/n when one session sees all of it.
+double fairnessIndex(const std::vector<double> &values) {
+    double sum = 0.0;
+    double sumSquares = 0.0;
+    for (double v : values) {
+        sum += v;
+        sumSquares += v * v;
+    }
+    return sumSquares > 0.0 ? sum * sum / (values.size() * sumSquares) : 1.0;
+}
+
+void runOneScaleBench(const BenchOptions &options, int sessionCount,
+                      int seconds, const std::string &metricsPath,
+                      std::vector<std::string> &results) {
+    std::vector<std::unique_ptr<ScaleSession>> sessions;
+    std::vector<DWORD> agentPids;
+    std::vector<DWORD> childPids;
+    std::vector<double> openMs;
+    int kindCounts[3] = {};
+    for (int i = 0; i < sessionCount; ++i) {
+        std::unique_ptr<ScaleSession> s(new ScaleSession);
+        s->kind = kChildCycle[i % 3];
+        ++kindCounts[static_cast<int>(s->kind)];
+        const double start = benchNowMs();
+        s->session.open(options);
+        openMs.push_back(benchNowMs() - start);
+        s->session.spawnChild(
+            s->kind == ChildKind::Typing ? L"input" :
+            s->kind == ChildKind::Spew ? L"scale spew" : L"scale idle");
+        s->agentPid = processId(winpty_agent_process(s->session.pty()));
+        s->childPid = processId(s->session.process());
+        agentPids.push_back(s->agentPid);
+        childPids.push_back(s->childPid);
+        s->reader = CreateThread(nullptr, kReaderStackSize, readerThread,
+                                 s.get(), STACK_SIZE_PARAM_IS_A_RESERVATION,
+                                 nullptr);
+        if (s->reader == nullptr) {
+            benchFail("CreateThread failed for session %d", i);
+        }
+        // Stagger the typists across the interval.
+        s->nextSendMs = benchNowMs() + kSettleMs +
+            kTypingIntervalMs * static_cast<double>(i) / sessionCount;
+        sessions.push_back(std::move(s));
+    }
+
+    runFor(sessions, kSettleMs);
+    setMeasuring(sessions, true);
+    const std::vector<UINT64> statsBefore = sumAgentStats(sessions);
+    const ProcessSnapshot before = takeProcessSnapshot();
+    const double start = benchNowMs();
+    runFor(sessions, seconds * 1000.0);
+    const ProcessSnapshot after = takeProcessSnapshot();
+    const double elapsedMs = benchNowMs() - start;
+    setMeasuring(sessions, false);
+    const std::vector<UINT64> statsAfter = sumAgentStats(sessions);
+    if (!metricsPath.empty()) {
+        appendSessionMetrics(sessions, metricsPath);
+    }
+    const auto statRate = [&](int stat) {
+        return (statsAfter[stat] - statsBefore[stat]) / (elapsedMs / 1000.0);
+    };
+
+    std::vector<double> echoMs;
+    std::vector<double> sessionMeans;
+    int64_t conoutBytes = 0;
+    int timeouts = 0;
+    for (auto &s : sessions) {
+        Lock lock(s->lock);
+        conoutBytes += s->bytes;
+        timeouts += s->timeouts;
+        if (s->kind != ChildKind::Typing || s->echoMs.empty()) {
+            continue;
+        }
+        double sum = 0.0;
+        for (double ms : s->echoMs) {
+            sum += ms;
+        }
+        sessionMeans.push_back(sum / s->echoMs.size());
+        echoMs.insert(echoMs.end(), s->echoMs.begin(), s->echoMs.end());
+    }
+
+    const double elapsedSec = elapsedMs / 1000.0;
+    const ProcessCounters agents = sumDeltas(before, after, agentPids);
+    const ProcessCounters children = sumDeltas(before, after, childPids);
+    // 100ns units to a percentage of one CPU.
+    const double toCpuPercent = 100.0 / (elapsedMs * 10000.0);
+
+    JsonResult result("scale");
+    result.add("sessions", static_cast<int64_t>(sessionCount));
+    result.add("typing_sessions", static_cast<int64_t>(kindCounts[0]));
+    result.add("idle_sessions", static_cast<int64_t>(kindCounts[1]));
+    result.add("spew_sessions", static_cast<int64_t>(kindCounts[2]));
+    result.add("seconds", elapsedSec);
+    result.add("open_ms", computeLatencyStats(std::move(openMs)));
+    result.add("agent_cpu_percent", agents.cpuTime * toCpuPercent);
+    result.add("agent_cpu_percent_per_session",
+               agents.cpuTime * toCpuPercent / sessionCount);
+    result.add("child_cpu_percent", children.cpuTime * toCpuPercent);
+    result.add("agent_context_switches_per_sec",
+               agents.contextSwitches / elapsedSec);
+    result.add("agent_context_switches_per_sec_per_session",
+               agents.contextSwitches / elapsedSec / sessionCount);
+    result.add("agent_wakeups_per_sec", statRate(WINPTY_STAT_WAKEUPS));
+    result.add("agent_spurious_wakeups_per_sec",
+               statRate(WINPTY_STAT_WAKEUPS_SPURIOUS));
+    result.add("agent_working_set_per_session",
+               static_cast<int64_t>(agents.workingSet / sessionCount));
+    result.add("agent_private_bytes_per_session",
+               static_cast<int64_t>(agents.privateBytes / sessionCount));
+    result.add("conout_bytes_per_sec", conoutBytes / elapsedSec);
+    result.add("echo_ms", computeLatencyStats(std::move(echoMs)));
+    result.add("session_mean_echo_ms", computeLatencyStats(sessionMeans));
+    result.add("echo_fairness", fairnessIndex(sessionMeans));
+    result.add("echo_timeouts", static_cast<int64_t>(timeouts));
+    results.push_back(result.finish());
+
+    // Each child exits on Ctrl-D, its agent shuts down, and the reader sees
+    // EOF.
+    for (auto &s : sessions) {
+        writeConin(s->session.conin(), kExitChar);
+    }
+    for (auto &s : sessions) {
+        WaitForSingleObject(s->reader, INFINITE);
+        CloseHandle(s->reader);
+        s->session.waitForChild();
+        s->session.close();
+    }
+}
+
+bool exitRequested(HANDLE conin, DWORD timeoutMs) {
+    if (WaitForSingleObject(conin, timeoutMs) != WAIT_OBJECT_0) {
+        return false;
+    }
+    INPUT_RECORD records[64];
+    DWORD count = 0;
+    if (!ReadConsoleInputW(conin, records, 64, &count)) {
+        return true;
+    }
+    for (DWORD i = 0; i < count; ++i) {
+        const INPUT_RECORD &rec = records[i];
+        if (rec.EventType == KEY_EVENT && rec.Event.KeyEvent.bKeyDown &&
+                rec.Event.KeyEvent.uChar.UnicodeChar ==
+                    static_cast<wchar_t>(kExitChar)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+} // anonymous namespace
+
+std::vector<std::string> scaleWorkloads() {
+    return std::vector<std::string>(std::begin(kScaleWorkloads),
+                                    std::end(kScaleWorkloads));
+}
+
+void runScaleBenches(const BenchOptions &options,
+                     const std::vector<std::string> &workloads,
+                     int seconds, const std::string &metricsPath,
+                     std::vector<std::string> &results) {
+    std::vector<int> counts;
+    for (const auto &name : workloads) {
+        const int count = atoi(name.c_str());
+        if (count < 1) {
+            benchFail("invalid scale session count: %s", name.c_str());
+        }
+        counts.push_back(count);
+    }
+    for (int count : counts) {
+        for (int i = 0; i < options.repeat; ++i) {
+            fprintf(stderr, "scale %d sessions (run %d of %d)\n",
+                    count, i + 1, options.repeat);
+            runOneScaleBench(options, count, seconds, metricsPath, results);
+        }
+    }
+}
+
+int runScaleChild(const std::string &workload) {
+    const bool spew = workload == "spew";
+    if (!spew && workload != "idle") {
+        return 2;
+    }
+    const HANDLE conin = GetStdHandle(STD_INPUT_HANDLE);
+    const HANDLE conout = GetStdHandle(STD_OUTPUT_HANDLE);
+    SetConsoleMode(conin, 0);
+    long long line = 0;
+    while (true) {
+        if (spew) {
+            for (int i = 0; i < 20; ++i) {
+                char text[64];
+                const int len = winpty_snprintf(
+                    text, "spew line %lld ........................\r\n",
+                    ++line);
+                DWORD actual = 0;
+                WriteConsoleA(conout, text, len, &actual, nullptr);
+            }
+        }
+        if (exitRequested(conin, spew ? 0 : INFINITE)) {
+            return 0;
+        }
+    }
+}
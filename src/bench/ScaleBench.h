@@ -0,0 +1,50 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_BENCH_SCALE_BENCH_H
+#define WINPTY_BENCH_SCALE_BENCH_H
+
+#include <string>
+#include <vector>
+
+#include "BenchUtil.h"
+
+// The default session counts, as workload names.
+std::vector<std::string> scaleWorkloads();
+
+// For each session count N, opens N concurrent sessions whose children
+// cycle through typing, idle and spew workloads, then measures for
+// `seconds`: the agents' and children's CPU time, the agents' context
+// switches and event loop wakeups per second, the agents' working set
+// and private bytes per session, and the keystroke-to-echo latency of each
+// typing session, with a fairness index over the per-session means.
+// Appends one JSON result per session count.  If metricsPath isn't empty,
+// every session's winpty_export_metrics CSV row, taken at the end of the
+// measurement, is appended to that file too.
+void runScaleBenches(const BenchOptions &options,
+                     const std::vector<std::string> &workloads,
+                     int seconds, const std::string &metricsPath,
+                     std::vector<std::string> &results);
+
+// The child side of the idle and spew sessions.  (Typing sessions run the
+// input child.)
+int runScaleChild(const std::string &workload);
+
+#endif // WINPTY_BENCH_SCALE_BENCH_H
@@ -0,0 +1,248 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "ScraperBench.h"
+
+#include <windows.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+#include "../agent/ConsoleFrameFile.h"
+#include "../agent/EventLoop.h"
+#include "../agent/MemoryConsoleBuffer.h"
+#include "../agent/NamedPipe.h"
+#include "../agent/Scraper.h"
+#include "../agent/Terminal.h"
+#include "../agent/Win32Console.h"
+#include "../shared/winpty_snprintf.h"
+
+namespace {
+
+const char *const kSyntheticWorkloads[] = {
+    "scroll", "color", "redraw", "idle",
+};
+
+// Lines of output the scrolling workloads add per frame.
+const int kLinesPerFrame = 4;
+
+void writeAscii(MemoryConsoleBuffer &buffer, const char *text) {
+    std::wstring wide;
+    for (const char *p = text; *p != '\0'; ++p) {
+        wide.push_back(static_cast<unsigned char>(*p));
+    }
+    buffer.writeText(wide.data(), wide.size());
+}
+
+// A log line whose length varies from line to line.
+void writeLogLine(MemoryConsoleBuffer &buffer, int64_t line, bool color) {
+    char text[256];
+    winpty_snprintf(text, "[%08lld] worker %d: processed request ",
+                    static_cast<long long>(line), static_cast<int>(line % 7));
+    if (color) {
+        buffer.setTextAttribute(0x0A);
+    }
+    writeAscii(buffer, text);
+    if (color) {
+        buffer.setTextAttribute(line % 5 == 0 ? 0x0C : 0x07);
+    }
+    const int pad = static_cast<int>((line * 37) % 60);
+    for (int i = 0; i < pad; ++i) {
+        text[i] = static_cast<char>('a' + (line + i) % 26);
+    }
+    text[pad] = '\0';
+    writeAscii(buffer, text);
+    buffer.setTextAttribute(ConsoleBuffer::kDefaultAttributes);
+    writeAscii(buffer, "\n");
+}
+
+// Rewrites the whole window from its top-left corner, like a full-screen
+// program redrawing in place.
+void redrawWindow(MemoryConsoleBuffer &buffer, int frame) {
+    const SmallRect window = buffer.windowRect();
+    buffer.setCursorPosition(Coord(0, window.Top));
+    std::string row;
+    for (int y = 0; y < window.height(); ++y) {
+        row.clear();
+        char cell[32];
+        while (static_cast<int>(row.size()) < window.width() - 1) {
+            winpty_snprintf(cell, "%6d ", frame * 31 + y * 7 +
+                                          static_cast<int>(row.size()));
+            row += cell;
+        }
+        row.resize(window.width() - 1);
+        if (y + 1 < window.height()) {
+            row += "\r\n";
+        }
+        writeAscii(buffer, row.c_str());
+    }
+}
+
+std::vector<ConsoleFrame> loadFrames(const std::string &path) {
+    std::vector<ConsoleFrame> frames;
+    ConsoleFrameReader reader;
+    if (!reader.open(path.c_str())) {
+        benchFail("%s: %s", path.c_str(), reader.error().c_str());
+    }
+    ConsoleFrame frame;
+    while (reader.next(frame)) {
+        frames.push_back(std::move(frame));
+    }
+    if (!reader.error().empty()) {
+        benchFail("%s: %s", path.c_str(), reader.error().c_str());
+    }
+    if (frames.empty()) {
+        benchFail("%s: no frames", path.c_str());
+    }
+    return frames;
+}
+
+} // anonymous namespace
+
+void writeSyntheticFrame(MemoryConsoleBuffer &buffer,
+                         const std::string &workload, int frame,
+                         int64_t &logLine) {
+    if (workload == "scroll" || workload == "color") {
+        for (int i = 0; i < kLinesPerFrame; ++i) {
+            writeLogLine(buffer, logLine++, workload == "color");
+        }
+    } else if (workload == "redraw") {
+        redrawWindow(buffer, frame);
+    }
+}
+
+namespace {
+
+void runOneScraperBench(const BenchOptions &options,
+                        const std::string &name,
+                        int frameCount,
+                        const std::vector<ConsoleFrame> &recorded,
+                        std::vector<std::string> &results) {
+    const bool replay = name == "replay";
+    Coord size(options.cols, options.rows);
+    size_t nextRecorded = 0;
+    if (replay) {
+        // One frame per recorded scrape.  A scrape can read the console
+        // more than once, and those reads share a scrape number.
+        frameCount = 0;
+        for (size_t i = 0; i < recorded.size(); ++i) {
+            if (i == 0 || recorded[i].scrape != recorded[i - 1].scrape) {
+                ++frameCount;
+            }
+        }
+        const SmallRect window = recorded[0].info.srWindow;
+        size = Coord(window.width(), window.height());
+    }
+
+    Win32Console console(nullptr);
+    MemoryConsoleBuffer buffer;
+    OfflineEventLoop loop;
+    NamedPipe &pipe = loop.pipe();
+    Scraper scraper(console, buffer,
+                    std::unique_ptr<Terminal>(new Terminal(pipe, false, true)),
+                    size);
+    pipe.discardOutput();
+
+    std::vector<double> frameNs;
+    frameNs.reserve(frameCount);
+    int64_t bytes = 0;
+    int64_t logLine = 0;
+    const uint64_t linesBefore = scraper.terminal().sendLineCount();
+    const uint64_t cellsBefore = scraper.cellsRead();
+    ConsoleScreenBufferInfo info;
+    for (int frame = 0; frame < frameCount; ++frame) {
+        if (replay) {
+            const uint32_t scrape = recorded[nextRecorded].scrape;
+            while (nextRecorded < recorded.size() &&
+                    recorded[nextRecorded].scrape == scrape) {
+                buffer.applyFrame(recorded[nextRecorded++]);
+            }
+        } else {
+            writeSyntheticFrame(buffer, name, frame, logLine);
+        }
+        const double start = benchNowMs();
+        scraper.scrapeBuffer(buffer, info);
+        frameNs.push_back((benchNowMs() - start) * 1e6);
+        bytes += pipe.bytesToSend();
+        pipe.discardOutput();
+    }
+
+    double totalNs = 0.0;
+    for (double ns : frameNs) {
+        totalNs += ns;
+    }
+    JsonResult result("scraper");
+    result.add("workload", name);
+    result.add("cols", static_cast<int64_t>(size.X));
+    result.add("rows", static_cast<int64_t>(size.Y));
+    result.add("frames", static_cast<int64_t>(frameCount));
+    result.add("ns_per_frame", frameCount > 0 ? totalNs / frameCount : 0.0);
+    result.add("frame_ns", computeLatencyStats(std::move(frameNs)));
+    result.add("bytes", bytes);
+    result.add("bytes_per_frame",
+               frameCount > 0 ? static_cast<double>(bytes) / frameCount : 0.0);
+    result.add("lines_sent", static_cast<int64_t>(
+        scraper.terminal().sendLineCount() - linesBefore));
+    result.add("cells_read", static_cast<int64_t>(
+        scraper.cellsRead() - cellsBefore));
+    result.add("resyncs", static_cast<int64_t>(scraper.resyncCount()));
+    results.push_back(result.finish());
+}
+
+} // anonymous namespace
+
+std::vector<std::string> scraperWorkloads(bool haveReplayFile) {
+    std::vector<std::string> ret(std::begin(kSyntheticWorkloads),
+                                 std::end(kSyntheticWorkloads));
+    if (haveReplayFile) {
+        ret.push_back("replay");
+    }
+    return ret;
+}
+
+void runScraperBenches(const BenchOptions &options,
+                       const std::vector<std::string> &workloads,
+                       int frames,
+                       const std::string &replayPath,
+                       std::vector<std::string> &results) {
+    const std::vector<std::string> known = scraperWorkloads(true);
+    std::vector<ConsoleFrame> recorded;
+    for (const auto &name : workloads) {
+        if (std::find(known.begin(), known.end(), name) == known.end()) {
+            benchFail("unknown scraper workload: %s", name.c_str());
+        }
+        if (name == "replay" && recorded.empty()) {
+            if (replayPath.empty()) {
+                benchFail("the replay workload needs --replay FILE");
+            }
+            recorded = loadFrames(replayPath);
+        }
+    }
+    for (const auto &name : workloads) {
+        for (int i = 0; i < options.repeat; ++i) {
+            fprintf(stderr, "scraper %s (run %d of %d)\n",
+                    name.c_str(), i + 1, options.repeat);
+            runOneScraperBench(options, name, frames, recorded, results);
+        }
+    }
+}
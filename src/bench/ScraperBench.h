@@ -0,0 +1,67 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_BENCH_SCRAPER_BENCH_H
+#define WINPTY_BENCH_SCRAPER_BENCH_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "BenchUtil.h"
+#include "../agent/EventLoop.h"
+#include "../agent/NamedPipe.h"
+
+class MemoryConsoleBuffer;
+
+// Owns the memory sink the terminal writes into.  The scraper is driven
+// directly, so the loop itself never runs.
+class OfflineEventLoop : public EventLoop {
+public:
+    OfflineEventLoop() : m_pipe(createNamedPipe()) {
+        m_pipe.openMemorySink();
+    }
+    NamedPipe &pipe() { return m_pipe; }
+private:
+    NamedPipe &m_pipe;
+};
+
+// Writes one frame of a synthetic workload ("scroll", "color", "redraw", or
+// "idle") into the buffer.  `logLine` numbers the scrolling workloads' lines.
+void writeSyntheticFrame(MemoryConsoleBuffer &buffer,
+                         const std::string &workload, int frame,
+                         int64_t &logLine);
+
+// The offline scraper workloads, in their default order.  "replay" is only
+// included when a frame file is given.
+std::vector<std::string> scraperWorkloads(bool haveReplayFile);
+
+// Runs the agent's Scraper and Terminal in-process against an in-memory
+// console buffer, one scrape per frame, and appends one JSON result per run.
+// The "replay" workload plays back the frames in `replayPath`; the others
+// synthesize `frames` frames.
+void runScraperBenches(const BenchOptions &options,
+                       const std::vector<std::string> &workloads,
+                       int frames,
+                       const std::string &replayPath,
+                       std::vector<std::string> &results);
+
+#endif // WINPTY_BENCH_SCRAPER_BENCH_H
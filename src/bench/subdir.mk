@@ -0,0 +1,73 @@
+# Copyright (c) 2016 Ryan Prichard
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to
+# deal in the Software without restriction, including without limitation the
+# rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+# sell copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+# FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+# IN THE SOFTWARE.
+
+BENCH_PROGRAMS += build/winpty-bench.exe
+
+$(eval $(call def_mingw_target,bench,))
+
+BENCH_OBJECTS = \
+	build/bench/agent/CharInfoKernels.o \
+	build/bench/agent/ConsoleApiStats.o \
+	build/bench/agent/ConsoleFrameFile.o \
+	build/bench/agent/ConsoleFrameRecorder.o \
+	build/bench/agent/ConsoleInput.o \
+	build/bench/agent/ConsoleInputReencoding.o \
+	build/bench/agent/ConsoleLine.o \
+	build/bench/agent/DebugShowInput.o \
+	build/bench/agent/DefaultInputMap.o \
+	build/bench/agent/DefaultInputMapImage.o \
+	build/bench/agent/EtwTrace.o \
+	build/bench/agent/EventLoop.o \
+	build/bench/agent/InputMap.o \
+	build/bench/agent/LargeConsoleRead.o \
+	build/bench/agent/MemoryConsoleBuffer.o \
+	build/bench/agent/NamedPipe.o \
+	build/bench/agent/Scraper.o \
+	build/bench/agent/ScrollbackHistory.o \
+	build/bench/agent/Terminal.o \
+	build/bench/agent/Win32Console.o \
+	build/bench/bench/Bench.o \
+	build/bench/bench/BenchUtil.o \
+	build/bench/bench/DecodeBench.o \
+	build/bench/bench/InputBench.o \
+	build/bench/bench/MemoryBench.o \
+	build/bench/bench/OutputBench.o \
+	build/bench/bench/ResizeBench.o \
+	build/bench/bench/ScaleBench.o \
+	build/bench/bench/ScraperBench.o \
+	build/bench/shared/Buffer.o \
+	build/bench/shared/DebugClient.o \
+	build/bench/shared/OwnedHandle.o \
+	build/bench/shared/SharedMemoryRing.o \
+	build/bench/shared/StreamCompression.o \
+	build/bench/shared/StringUtil.o \
+	build/bench/shared/WindowsSecurity.o \
+	build/bench/shared/WindowsVersion.o \
+	build/bench/shared/WinptyAssert.o \
+	build/bench/shared/WinptyException.o
+
+build/bench/agent/DefaultInputMapImage.o : build/gen/GenDefaultInputMap.h
+build/bench/agent/DefaultInputMapImage.o : MINGW_CXXFLAGS += -DWINPTY_GEN_INPUT_MAP
+
+build/winpty-bench.exe : $(BENCH_OBJECTS) build/winpty.dll
+	$(info Linking $@)
+	@$(MINGW_CXX) $(MINGW_LDFLAGS) -o $@ $^
+
+-include $(BENCH_OBJECTS:.o=.d)
@@ -17,12 +17,19 @@
 // LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
 // FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
 // IN THE SOFTWARE.
-
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include <windows.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
 
+#include "../shared/OwnedHandle.h"
 #include "../shared/WindowsSecurity.h"
 #include "../shared/WinptyException.h"
 
@@ -31,13 +38,27 @@ const wchar_t *kPipeName = L"\\\\.\\pipe\\DebugServer";
 // A message may not be larger than this size.
 const int MSG_SIZE = 4096;
 
+// The number of pipe instances, and therefore of concurrently connected
+// clients.  Each instance needs a wait handle, so this is bounded by
+// MAXIMUM_WAIT_OBJECTS.
+const int kInstanceCount = MAXIMUM_WAIT_OBJECTS;
+
+// Buffered output is written once it reaches this size, or when no client
+// has anything more to say.
+const size_t kOutputFlushSize = 64 * 1024;
+
 static void usage(const char *program, int code) {
-    printf("Usage: %s [--everyone]\n"
+    printf("Usage: %s [--everyone] [--binary FILE]\n"
            "\n"
            "Creates the named pipe %ls and reads messages.  Prints each\n"
            "message to stdout.  By default, only the current user can send messages.\n"
            "Pass --everyone to let anyone send a message.\n"
            "\n"
+           "With --binary, messages are instead appended to FILE as records of\n"
+           "[uint32 size][uint32 pid][uint32 tid][int64 unix-ms][text], where size\n"
+           "counts the text bytes, pid is the pipe client's process ID, and tid is\n"
+           "the thread ID from the message's trace header (or 0).\n"
+           "\n"
            "Use the WINPTY_DEBUG environment variable to enable winpty trace output.\n"
            "(e.g. WINPTY_DEBUG=trace for the default trace output.)  Set WINPTYDBG=1\n"
            "to enable trace with older winpty versions.\n",
@@ -45,12 +66,211 @@ static void usage(const char *program, int code) {
     exit(code);
 }
 
+namespace {
+
+// Each pipe instance cycles through connecting, reading a message, and
+// writing the acknowledgement, with one overlapped operation in flight.
+struct PipeInstance {
+    enum class State { Connecting, Reading, Writing };
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    OwnedHandle event;
+    OVERLAPPED over = {};
+    State state = State::Connecting;
+    DWORD clientPid = 0;
+    char buffer[MSG_SIZE];
+};
+
+class OutputWriter {
+public:
+    explicit OutputWriter(FILE *binaryFile) : m_binaryFile(binaryFile) {}
+    void addMessage(DWORD pid, const char *data, DWORD size);
+    void flush();
+    bool needsFlush() const { return m_buffer.size() >= kOutputFlushSize; }
+
+private:
+    void addRecord(DWORD pid, long long timeMs,
+                   const char *line, size_t size);
+
+    FILE *m_binaryFile;
+    std::string m_buffer;
+};
+
+} // anonymous namespace
+
+// Get the current UTC time as milliseconds from the Unix epoch, like
+// DebugClient.cc.
+static long long unixTimeMillis() {
+    FILETIME fileTime;
+    GetSystemTimeAsFileTime(&fileTime);
+    long long msTime = (((long long)fileTime.dwHighDateTime << 32) +
+                       fileTime.dwLowDateTime) / 10000;
+    return msTime - 134774LL * 24 * 3600 * 1000;
+}
+
+// Finds the thread ID in a "[time module,pNNNN,tNNNN]: " trace header.
+static uint32_t parseTraceThreadId(const char *line, size_t size) {
+    const char *const end = line + size;
+    const char *close = static_cast<const char*>(memchr(line, ']', size));
+    if (close == nullptr) {
+        return 0;
+    }
+    for (const char *p = close; p > line; --p) {
+        if (p[-1] == 't' && p - 2 >= line && p[-2] == ',') {
+            uint32_t tid = 0;
+            for (const char *d = p; d < close && d < end; ++d) {
+                if (*d < '0' || *d > '9') {
+                    return 0;
+                }
+                tid = tid * 10 + (*d - '0');
+            }
+            return tid;
+        }
+    }
+    return 0;
+}
+
+static void appendUint32(std::string &out, uint32_t val) {
+    out.append(reinterpret_cast<const char*>(&val), sizeof(val));
+}
+
+void OutputWriter::addRecord(DWORD pid, long long timeMs,
+                             const char *line, size_t size) {
+    if (m_binaryFile == nullptr) {
+        m_buffer.append(line, size);
+        m_buffer.push_back('\n');
+        return;
+    }
+    const int64_t time64 = timeMs;
+    appendUint32(m_buffer, static_cast<uint32_t>(size));
+    appendUint32(m_buffer, pid);
+    appendUint32(m_buffer, parseTraceThreadId(line, size));
+    m_buffer.append(reinterpret_cast<const char*>(&time64), sizeof(time64));
+    m_buffer.append(line, size);
+}
+
+// A message from a batching client holds several newline-separated lines.
+void OutputWriter::addMessage(DWORD pid, const char *data, DWORD size) {
+    const long long timeMs = unixTimeMillis();
+    const char *const end = data + size;
+    const char *line = data;
+    while (true) {
+        const char *nl = static_cast<const char*>(
+            memchr(line, '\n', end - line));
+        if (nl == nullptr) {
+            addRecord(pid, timeMs, line, end - line);
+            break;
+        }
+        addRecord(pid, timeMs, line, nl - line);
+        line = nl + 1;
+    }
+}
+
+void OutputWriter::flush() {
+    if (m_buffer.empty()) {
+        return;
+    }
+    FILE *out = (m_binaryFile != nullptr) ? m_binaryFile : stdout;
+    fwrite(m_buffer.data(), 1, m_buffer.size(), out);
+    fflush(out);
+    m_buffer.clear();
+}
+
+static void startConnect(PipeInstance &inst) {
+    inst.state = PipeInstance::State::Connecting;
+    inst.clientPid = 0;
+    inst.over = {};
+    inst.over.hEvent = inst.event.get();
+    if (ConnectNamedPipe(inst.pipe, &inst.over)) {
+        // An overlapped ConnectNamedPipe should return FALSE.
+        SetEvent(inst.event.get());
+        return;
+    }
+    const DWORD lastError = GetLastError();
+    if (lastError == ERROR_PIPE_CONNECTED) {
+        SetEvent(inst.event.get());
+    } else if (lastError != ERROR_IO_PENDING) {
+        fprintf(stderr, "error: ConnectNamedPipe failed: error %u\n",
+            static_cast<unsigned>(lastError));
+        fflush(stderr);
+        exit(1);
+    }
+}
+
+static void disconnect(PipeInstance &inst) {
+    DisconnectNamedPipe(inst.pipe);
+    startConnect(inst);
+}
+
+static void startRead(PipeInstance &inst) {
+    inst.state = PipeInstance::State::Reading;
+    inst.over = {};
+    inst.over.hEvent = inst.event.get();
+    if (!ReadFile(inst.pipe, inst.buffer, MSG_SIZE, nullptr, &inst.over) &&
+            GetLastError() != ERROR_IO_PENDING) {
+        disconnect(inst);
+    }
+}
+
+static void startWriteAck(PipeInstance &inst) {
+    inst.state = PipeInstance::State::Writing;
+    inst.over = {};
+    inst.over.hEvent = inst.event.get();
+    // "OKP" tells DebugClient it may send more messages without waiting for
+    // each acknowledgement.  Older clients ignore the reply's content.
+    if (!WriteFile(inst.pipe, "OKP", 3, nullptr, &inst.over) &&
+            GetLastError() != ERROR_IO_PENDING) {
+        disconnect(inst);
+    }
+}
+
+static void servicePipe(PipeInstance &inst, OutputWriter &output) {
+    DWORD actual = 0;
+    const BOOL success =
+        GetOverlappedResult(inst.pipe, &inst.over, &actual, FALSE);
+    switch (inst.state) {
+    case PipeInstance::State::Connecting: {
+        const auto client = getNamedPipeClientProcessId(inst.pipe);
+        if (std::get<0>(client) == GetNamedPipeClientProcessId_Result::Success) {
+            inst.clientPid = std::get<1>(client);
+        }
+        startRead(inst);
+        break;
+    }
+    case PipeInstance::State::Reading:
+        if (!success) {
+            const DWORD lastError = GetLastError();
+            if (lastError != ERROR_BROKEN_PIPE &&
+                    lastError != ERROR_PIPE_NOT_CONNECTED) {
+                fprintf(stderr, "error: ReadFile on pipe failed\n");
+                fflush(stderr);
+            }
+            disconnect(inst);
+            break;
+        }
+        output.addMessage(inst.clientPid, inst.buffer, actual);
+        startWriteAck(inst);
+        break;
+    case PipeInstance::State::Writing:
+        if (!success) {
+            disconnect(inst);
+        } else {
+            // A client may send any number of messages before
+            // disconnecting.
+            startRead(inst);
+        }
+        break;
+    }
+}
+
 int main(int argc, char *argv[]) {
     bool everyone = false;
+    const char *binaryPath = nullptr;
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "--everyone") {
             everyone = true;
+        } else if (arg == "--binary" && i + 1 < argc) {
+            binaryPath = argv[++i];
         } else if (arg == "-h" || arg == "--help") {
             usage(argv[0], 0);
         } else {
@@ -74,44 +294,67 @@ int main(int argc, char *argv[]) {
         psa = &sa;
     }
 
-    HANDLE serverPipe = CreateNamedPipeW(
-        kPipeName,
-        /*dwOpenMode=*/PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
-        /*dwPipeMode=*/PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE |
-            rejectRemoteClientsPipeFlag(),
-        /*nMaxInstances=*/1,
-        /*nOutBufferSize=*/MSG_SIZE,
-        /*nInBufferSize=*/MSG_SIZE,
-        /*nDefaultTimeOut=*/10 * 1000,
-        psa);
-
-    if (serverPipe == INVALID_HANDLE_VALUE) {
-        fprintf(stderr, "error: could not create %ls pipe: error %u\n",
-            kPipeName, static_cast<unsigned>(GetLastError()));
-        exit(1);
+    FILE *binaryFile = nullptr;
+    if (binaryPath != nullptr) {
+        binaryFile = fopen(binaryPath, "ab");
+        if (binaryFile == nullptr) {
+            fprintf(stderr, "error: could not open %s\n", binaryPath);
+            exit(1);
+        }
     }
+    OutputWriter output(binaryFile);
 
-    char msgBuffer[MSG_SIZE + 1];
+    std::vector<std::unique_ptr<PipeInstance>> instances;
+    std::vector<HANDLE> waitHandles;
+    for (int i = 0; i < kInstanceCount; ++i) {
+        std::unique_ptr<PipeInstance> inst(new PipeInstance);
+        inst->pipe = CreateNamedPipeW(
+            kPipeName,
+            /*dwOpenMode=*/PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED |
+                (i == 0 ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+            /*dwPipeMode=*/PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE |
+                rejectRemoteClientsPipeFlag(),
+            /*nMaxInstances=*/kInstanceCount,
+            /*nOutBufferSize=*/MSG_SIZE,
+            /*nInBufferSize=*/MSG_SIZE,
+            /*nDefaultTimeOut=*/10 * 1000,
+            psa);
+        if (inst->pipe == INVALID_HANDLE_VALUE) {
+            fprintf(stderr, "error: could not create %ls pipe: error %u\n",
+                kPipeName, static_cast<unsigned>(GetLastError()));
+            exit(1);
+        }
+        inst->event = OwnedHandle(CreateEventW(nullptr, TRUE, FALSE, nullptr));
+        startConnect(*inst);
+        waitHandles.push_back(inst->event.get());
+        instances.push_back(std::move(inst));
+    }
 
     while (true) {
-        if (!ConnectNamedPipe(serverPipe, nullptr)) {
-            fprintf(stderr, "error: ConnectNamedPipe failed\n");
+        // Poll first, and only flush the buffered output once every client
+        // is idle or the buffer is large.
+        DWORD ret = WaitForMultipleObjects(
+            waitHandles.size(), waitHandles.data(), FALSE, 0);
+        if (ret == WAIT_TIMEOUT) {
+            output.flush();
+            ret = WaitForMultipleObjects(
+                waitHandles.size(), waitHandles.data(), FALSE, INFINITE);
+        }
+        if (ret >= WAIT_OBJECT_0 + waitHandles.size()) {
+            fprintf(stderr, "error: WaitForMultipleObjects failed\n");
             fflush(stderr);
             exit(1);
         }
-        DWORD bytesRead = 0;
-        if (!ReadFile(serverPipe, msgBuffer, MSG_SIZE, &bytesRead, nullptr)) {
-            fprintf(stderr, "error: ReadFile on pipe failed\n");
-            fflush(stderr);
-            DisconnectNamedPipe(serverPipe);
-            continue;
+        // WaitForMultipleObjects favors the lowest index, so service every
+        // ready instance for fairness.
+        for (size_t i = ret - WAIT_OBJECT_0; i < instances.size(); ++i) {
+            if (WaitForSingleObject(waitHandles[i], 0) == WAIT_OBJECT_0) {
+                ResetEvent(waitHandles[i]);
+                servicePipe(*instances[i], output);
+            }
+        }
+        if (output.needsFlush()) {
+            output.flush();
         }
-        msgBuffer[bytesRead] = '\n';
-        fwrite(msgBuffer, 1, bytesRead + 1, stdout);
-        fflush(stdout);
-
-        DWORD bytesWritten = 0;
-        WriteFile(serverPipe, "OK", 2, &bytesWritten, nullptr);
-        DisconnectNamedPipe(serverPipe);
     }
 }
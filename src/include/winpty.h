@@ -106,12 +106,128 @@ winpty_config_set_mouse_mode(winpty_config_t *cfg, int mouseMode);
 WINPTY_API void
 winpty_config_set_agent_timeout(winpty_config_t *cfg, DWORD timeoutMs);
 
+/* Bounds, in milliseconds, on how often the agent polls the console.  The
+ * agent polls every minMs milliseconds after it sees console output or
+ * terminal input, then doubles the interval after each poll that finds
+ * nothing new, up to maxMs.  Requires 1 <= minMs <= maxMs.  The default is a
+ * fixed 25 ms interval (minMs == maxMs == 25). */
+WINPTY_API void
+winpty_config_set_poll_interval(winpty_config_t *cfg, int minMs, int maxMs);
+
+/* Keep a history of the lines written to CONOUT, using at most limitBytes
+ * of agent memory, for winpty_get_history.  The oldest lines are discarded
+ * first.  The default limit is 0, which disables the history. */
+WINPTY_API void
+winpty_config_set_history_limit(winpty_config_t *cfg, UINT64 limitBytes);
+
+/* Under sustained output, repaint the terminal's window at most
+ * framesPerSecond times per second, skipping the intermediate states.  Lines
+ * that scroll off the top of the console window are still sent as they
+ * occur.  The default is 0, which disables the limit. */
+WINPTY_API void
+winpty_config_set_max_frame_rate(winpty_config_t *cfg, int framesPerSecond);
+
+/* Start the agent from the given winpty-agent.exe instead of the one in the
+ * DLL's directory.  The path isn't checked beforehand; if it's wrong,
+ * winpty_open fails with WINPTY_ERROR_AGENT_CREATION_FAILED.  NULL or an
+ * empty string restores the default.  The default location is looked up once
+ * per process. */
+WINPTY_API void
+winpty_config_set_agent_path(winpty_config_t *cfg, LPCWSTR path);
+
+/* Size the agent's scraper.  In its usual mode, the agent keeps the console
+ * screen buffer bufferLines tall and tracks scrolling with a marker written
+ * syncMarkerMargin lines above the window.  When more than about that much
+ * output scrolls between two polls, the agent loses its place and resends
+ * the whole window, so a taller buffer suits sessions with heavy output,
+ * while a shorter one reduces memory use and console reads.  The window is
+ * at most maxCols columns wide and at most 2000 rows tall, and also leaves
+ * room for the marker above it.  Requires bufferLines <= 10000,
+ * syncMarkerMargin >= 0, bufferLines - syncMarkerMargin >= 100, and
+ * 1 <= maxCols <= 2500.  The defaults are 3000, 200, and 2500. */
+WINPTY_API void
+winpty_config_set_scrape_geometry(winpty_config_t *cfg, int bufferLines,
+                                  int syncMarkerMargin, int maxCols);
+
+/* Size the kernel buffers of the data pipes: outputBytes for CONOUT and
+ * CONERR, and inputBytes for CONIN.  A larger output buffer lets the agent
+ * write more at once before it waits for the client to read.  0 selects an
+ * automatic size; for the output pipes, the agent then also issues more and
+ * larger writes while the client falls behind.  Each size must be between 0
+ * and 1048576.  The defaults are 8192 and 256.  Shared memory output
+ * (WINPTY_FLAG_SHM_OUTPUT) doesn't use the CONOUT setting. */
+WINPTY_API void
+winpty_config_set_pipe_buffers(winpty_config_t *cfg, int outputBytes,
+                               int inputBytes);
+
+/* Coalesce small writes to the CONOUT and CONERR pipes.  Output is held for
+ * up to maxDelayUs microseconds, or until flushBytes bytes are queued, so
+ * that e.g. an echoed character and the cursor movements around it reach
+ * the client as one read.  The output of a scrape is sent as soon as the
+ * scrape finishes, so the delay applies to the output between scrapes and
+ * to the slices of a large one.  Requires 0 <= maxDelayUs <= 1000000 and
+ * flushBytes >= 1.  The default maxDelayUs of 0 disables coalescing.
+ * Shared memory output (WINPTY_FLAG_SHM_OUTPUT) isn't coalesced. */
+WINPTY_API void
+winpty_config_set_output_coalescing(winpty_config_t *cfg, int maxDelayUs,
+                                    int flushBytes);
+
+/* Set how the operating system schedules the agent: schedulingClass is one
+ * of the WINPTY_SCHEDULING_xxx constants, and a nonzero affinityMask pins
+ * the agent to those processors (bit N is processor N).  Processors the
+ * system lacks are ignored; a mask naming none of them leaves the affinity
+ * alone.  The agent starts at the class's CPU priority.  The default is
+ * WINPTY_SCHEDULING_DEFAULT with no affinity mask.  winpty_set_agent_scheduling
+ * changes both later. */
+WINPTY_API void
+winpty_config_set_agent_scheduling(winpty_config_t *cfg, int schedulingClass,
+                                   UINT64 affinityMask);
+
+/* Enable credit-based output flow control, for a client that can't rely on
+ * the pipe buffer to push back (e.g. one relaying output to a slow remote
+ * consumer).  The agent starts with initialBytes bytes and initialFrames
+ * frames of credit; each scrape that produces output uses one frame and its
+ * bytes.  Once either balance runs out, the agent stops scraping, so the
+ * intermediate states are skipped rather than queued, until the client
+ * grants more with winpty_grant_output_credits.  A scrape in progress
+ * finishes, so the output can overshoot the balance by one frame.  A zero
+ * leaves that kind of credit unlimited; the default is 0 and 0, which
+ * disables flow control.  Pseudoconsole output (WINPTY_FLAG_CONPTY) isn't
+ * limited. */
+WINPTY_API void
+winpty_config_set_output_credits(winpty_config_t *cfg, UINT64 initialBytes,
+                                 UINT64 initialFrames);
+
+/* For hosts with many parked sessions: once a session has had no input or
+ * output for idleMs milliseconds, the agent frees the memory it can rebuild
+ * (its console read buffers, the saved copy of the console's lines, its
+ * encoding caches, and idle pipe buffers) and trims its working set.  The
+ * next activity reallocates them as needed; its first scrape reads the
+ * whole window again.  The saved lines keep their hashes, so an unchanged
+ * console isn't resent.  The default, 0, disables trimming.  Pseudoconsole
+ * sessions (WINPTY_FLAG_CONPTY) aren't trimmed. */
+WINPTY_API void
+winpty_config_set_idle_trim(winpty_config_t *cfg, int idleMs);
+
+/* Record the session's output to a file, in one of the WINPTY_RECORDING_xxx
+ * formats, with the time of each write and each resize.  The agent writes
+ * the file in the background and never waits for it; if the disk falls far
+ * behind, output is left out of the recording rather than delayed.  The file
+ * is replaced if it exists.  winpty_open fails if the agent can't create
+ * it.  WINPTY_RECORDING_ASCIICAST can't record cell output
+ * (WINPTY_FLAG_CELL_OUTPUT).  Sessions from winpty_open_many and pools aren't
+ * recorded.  A NULL or empty path, the default, disables recording. */
+WINPTY_API void
+winpty_config_set_recording(winpty_config_t *cfg, LPCWSTR path, int format);
+
 
 
 /*****************************************************************************
  * Start the agent. */
 
-/* The winpty_t object is thread-safe. */
+/* The winpty_t object is thread-safe.  Calls from several threads don't wait
+ * for each other's agent replies: e.g. winpty_get_console_process_list isn't
+ * held up by a winpty_set_size that waits for a slow resize. */
 typedef struct winpty_s winpty_t;
 
 /* Starts the agent.  Returns NULL on error.  This process will connect to the
@@ -121,10 +237,66 @@ WINPTY_API winpty_t *
 winpty_open(const winpty_config_t *cfg,
             winpty_error_ptr_t *err /*OPTIONAL*/);
 
+/* Starts count agents with the same configuration, as winpty_open does, and
+ * stores them in out[0] through out[count - 1].  The agents start
+ * concurrently, so opening many sessions takes about as long as opening the
+ * slowest one, rather than the sum.  The agent timeout applies to the whole
+ * call.  Returns TRUE once every session is ready.  On error, returns FALSE,
+ * frees any sessions already started, and leaves out unchanged.  The
+ * sessions' startup phases overlap, so their WINPTY_STARTUP_TOTAL times
+ * include waiting for the other agents. */
+WINPTY_API BOOL
+winpty_open_many(const winpty_config_t *cfg, int count, winpty_t **out,
+                 winpty_error_ptr_t *err /*OPTIONAL*/);
+
 /* A handle to the agent process.  This value is valid for the lifetime of the
  * winpty_t object.  Do not close it. */
 WINPTY_API HANDLE winpty_agent_process(winpty_t *wp);
 
+/* Gets how long each phase of winpty_open took, in microseconds.  The array
+ * is indexed by the WINPTY_STARTUP_xxx constants.  Copies up to phaseCount
+ * entries into phaseTimes and returns WINPTY_STARTUP_PHASE_COUNT, or 0 on
+ * error.  The times are recorded when the agent starts, so for an agent
+ * taken from a pool, they describe the pool's earlier start.  A phase that
+ * did not run (e.g. no background desktop was needed) reports zero. */
+WINPTY_API int
+winpty_get_startup_stats(winpty_t *wp, UINT64 *phaseTimes, int phaseCount,
+                         winpty_error_ptr_t *err /*OPTIONAL*/);
+
+
+
+/*****************************************************************************
+ * Pool of pre-started agents. */
+
+/* A pool keeps up to `size` agents started and connected, with their
+ * consoles (and background desktops) already set up, so that
+ * winpty_open_from_pool returns without the cost of agent startup.  A
+ * background thread starts a replacement each time an agent is handed out.
+ *
+ * Pooled agents are opened with a copy of cfg, so they all share its flags,
+ * mouse mode, poll interval, and initial size.  Use winpty_set_size to
+ * change a pooled agent's size.  Idle agents consume the same resources as
+ * open sessions, including their console polling.
+ *
+ * The winpty_pool_t object is thread-safe. */
+typedef struct winpty_pool_s winpty_pool_t;
+
+WINPTY_API winpty_pool_t *
+winpty_pool_new(const winpty_config_t *cfg, int size,
+                winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Returns an idle agent from the pool, or if none is ready, starts one the
+ * way winpty_open does.  The returned winpty_t is independent of the pool and
+ * is freed with winpty_free. */
+WINPTY_API winpty_t *
+winpty_open_from_pool(winpty_pool_t *pool,
+                      winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Stops the refill thread and frees the idle agents.  If the thread is
+ * starting an agent, this call waits for it, which may take up to the
+ * agent timeout.  Agents already handed out are unaffected. */
+WINPTY_API void winpty_pool_free(winpty_pool_t *pool);
+
 
 
 /*****************************************************************************
@@ -144,6 +316,85 @@ WINPTY_API LPCWSTR winpty_conin_name(winpty_t *wp);
 WINPTY_API LPCWSTR winpty_conout_name(winpty_t *wp);
 WINPTY_API LPCWSTR winpty_conerr_name(winpty_t *wp);
 
+/* With WINPTY_FLAG_SHM_OUTPUT, CONOUT is a ring buffer in shared memory, and
+ * winpty_conout_name returns the name of its section rather than a pipe.
+ * winpty_conout_shm attaches to the ring and returns it; later calls return
+ * the same object, which is freed with the winpty_t object.  It fails if the
+ * flag wasn't given or the agent fell back to a named pipe.
+ *
+ * The ring has a single consumer: use one thread at a time. */
+typedef struct winpty_shm_s winpty_shm_t;
+
+WINPTY_API winpty_shm_t *
+winpty_conout_shm(winpty_t *wp, winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Returns the number of bytes that can be read in place at *data, without
+ * copying.  The bytes stay in the ring until winpty_shm_consume. */
+WINPTY_API size_t winpty_shm_peek(winpty_shm_t *shm, const char **data);
+WINPTY_API void winpty_shm_consume(winpty_shm_t *shm, size_t size);
+
+/* Waits until output is readable or the stream has ended.  Returns FALSE on
+ * timeout. */
+WINPTY_API BOOL winpty_shm_wait(winpty_shm_t *shm, DWORD timeoutMs);
+
+/* Returns TRUE once the agent has closed CONOUT and every byte has been
+ * consumed. */
+WINPTY_API BOOL winpty_shm_eof(winpty_shm_t *shm);
+
+/* With WINPTY_FLAG_COMPRESS_OUTPUT, returns TRUE, and CONOUT and CONERR carry
+ * compressed frames rather than plain output.  Decode each stream with its
+ * own winpty_decoder_t, on this machine or at the far end of a relay. */
+WINPTY_API BOOL winpty_output_compressed(winpty_t *wp);
+
+typedef struct winpty_decoder_s winpty_decoder_t;
+
+WINPTY_API winpty_decoder_t *
+winpty_decoder_new(winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Decodes size bytes read from a compressed stream, which may end anywhere
+ * in a frame.  Sets *output and *outputSize to the output decoded so far;
+ * the buffer stays valid until the next call or winpty_decoder_free.  Returns
+ * FALSE if the stream is corrupt. */
+WINPTY_API BOOL
+winpty_decoder_feed(winpty_decoder_t *dec, const void *data, size_t size,
+                    const char **output, size_t *outputSize,
+                    winpty_error_ptr_t *err /*OPTIONAL*/);
+
+WINPTY_API void winpty_decoder_free(winpty_decoder_t *dec);
+
+/* Reads CONOUT on a thread of its own and hands the output to callback in
+ * chunks, so a client needn't write its own read loop.  It keeps bufferCount
+ * overlapped reads of bufferSize bytes queued on the pipe (0 for either
+ * picks a default), and each chunk holds everything that has arrived since
+ * the previous one.  With WINPTY_FLAG_SHM_OUTPUT, the reader consumes the
+ * shared memory ring instead, and with WINPTY_FLAG_COMPRESS_OUTPUT, it
+ * decodes the stream, so the callback sees the same output either way.
+ *
+ * With WINPTY_FLAG_FRAMED_OUTPUT or WINPTY_FLAG_CELL_OUTPUT, every chunk
+ * ends at a frame boundary: it holds whole length-prefixed frames, or the
+ * records up to and including an END_FRAME.  Other streams have no frame
+ * markers, and a chunk ends wherever the reads did.
+ *
+ * The callback runs on the reader's thread.  At the end of the stream, it
+ * is called once more with a size of 0.  The reader is CONOUT's client:
+ * don't also connect to the pipe or use winpty_conout_shm.  Free the reader
+ * before calling winpty_reattach or winpty_free. */
+typedef struct winpty_output_reader_s winpty_output_reader_t;
+
+typedef void (*winpty_output_callback_t)(const char *data, size_t size,
+                                         void *user_data);
+
+WINPTY_API winpty_output_reader_t *
+winpty_output_reader_new(winpty_t *wp,
+                         winpty_output_callback_t callback,
+                         void *user_data /*OPTIONAL*/,
+                         DWORD bufferSize, int bufferCount,
+                         winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Stops the reader and waits for its thread, which may be running the
+ * callback.  Don't call it from the callback. */
+WINPTY_API void winpty_output_reader_free(winpty_output_reader_t *reader);
+
 
 
 /*****************************************************************************
@@ -208,6 +459,37 @@ winpty_spawn(winpty_t *wp,
              DWORD *create_process_error /*OPTIONAL*/,
              winpty_error_ptr_t *err /*OPTIONAL*/);
 
+/*
+ * Opens a session and spawns its process, as winpty_open followed by
+ * winpty_spawn, but without waiting for the open to finish before sending
+ * the spawn.  The agent starts the process as soon as it has initialized,
+ * while winpty_open's handshake completes, which saves a round trip for a
+ * short-lived command.
+ *
+ * Returns the new session, or NULL on failure.  The output parameters are
+ * as for winpty_spawn.  If the agent's CreateProcess call failed, the
+ * session is closed, *create_process_error is set, and the
+ * WINPTY_ERROR_SPAWN_CREATE_PROCESS_FAILED error is returned.  The spawn
+ * stats' WINPTY_SPAWN_ROUND_TRIP covers the whole call.
+ */
+WINPTY_API winpty_t *
+winpty_open_and_spawn(const winpty_config_t *cfg,
+                      const winpty_spawn_config_t *spawn_cfg,
+                      HANDLE *process_handle /*OPTIONAL*/,
+                      HANDLE *thread_handle /*OPTIONAL*/,
+                      DWORD *create_process_error /*OPTIONAL*/,
+                      winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Gets how long each phase of the last spawn took, in microseconds.  The
+ * array is indexed by the WINPTY_SPAWN_xxx constants.  Copies up to
+ * phaseCount entries into phaseTimes and returns WINPTY_SPAWN_PHASE_COUNT,
+ * or 0 on error.  Before any spawn, every phase reports zero.  For
+ * winpty_spawn_async, WINPTY_SPAWN_ROUND_TRIP and WINPTY_SPAWN_TOTAL are
+ * zero, because the reply may be read by another call. */
+WINPTY_API int
+winpty_get_spawn_stats(winpty_t *wp, UINT64 *phaseTimes, int phaseCount,
+                       winpty_error_ptr_t *err /*OPTIONAL*/);
+
 
 
 /*****************************************************************************
@@ -218,11 +500,333 @@ WINPTY_API BOOL
 winpty_set_size(winpty_t *wp, int cols, int rows,
                 winpty_error_ptr_t *err /*OPTIONAL*/);
 
+/* Sets the session's scrape policy to one of the WINPTY_PRIORITY_xxx levels,
+ * e.g. as a front end switches between tabs.  The change takes effect at
+ * once; in particular, raising the priority scrapes the console right away,
+ * rather than after the slower background interval. */
+WINPTY_API BOOL
+winpty_set_priority(winpty_t *wp, int level,
+                    winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Adds to the output credit balances set up by
+ * winpty_config_set_output_credits, e.g. once the consumer has taken the
+ * output it was sent.  Each grant is an agent round trip, so grant in large
+ * steps, such as half the initial balance at a time.  A kind of credit that
+ * wasn't enabled ignores its grant. */
+WINPTY_API BOOL
+winpty_grant_output_credits(winpty_t *wp, UINT64 bytes, UINT64 frames,
+                            winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Changes the agent's scheduling class and processor affinity, as
+ * winpty_config_set_agent_scheduling configures them, e.g. when a session
+ * turns from interactive use to a batch job.  An affinityMask of 0 lets the
+ * agent run on every processor again. */
+WINPTY_API BOOL
+winpty_set_agent_scheduling(winpty_t *wp, int schedulingClass,
+                            UINT64 affinityMask,
+                            winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Pauses the scraping of a hidden session, making it nearly free to keep.
+ * With keepHistory, the agent still scrapes about once a second, but sends
+ * only the lines that scroll into the history, so the scrollback stays
+ * complete.  Without it, the agent stops scraping altogether.  The agent
+ * still detects the child's exit; its final output is sent as usual.
+ *
+ * winpty_resume sends a single frame that brings the terminal up to date
+ * with the current window.  After a pause without keepHistory, the frame
+ * clears the terminal and repaints the window, and the output scrolled
+ * off during the pause is lost. */
+WINPTY_API BOOL
+winpty_pause(winpty_t *wp, BOOL keepHistory,
+             winpty_error_ptr_t *err /*OPTIONAL*/);
+
+WINPTY_API BOOL
+winpty_resume(winpty_t *wp, winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Moves the session to new CONIN, CONOUT, and CONERR pipes, e.g. after the
+ * client reading CONOUT went away, and makes winpty_conxxx_name return the
+ * new names.  The strings those functions returned before are freed.  A
+ * client that connects to the new CONOUT first receives a single frame
+ * repainting the current window, title, and mouse mode, not the output it
+ * missed; see winpty_get_history for that.  Output produced while no client
+ * was connected is discarded.  With WINPTY_FLAG_SHM_OUTPUT, the
+ * winpty_shm_t from winpty_conout_shm is freed too. */
+WINPTY_API BOOL
+winpty_reattach(winpty_t *wp, winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Adds a read-only copy of CONOUT, e.g. for a viewer or a recorder next to
+ * the main client, and returns the name of its pipe.  The copy carries the
+ * same bytes as CONOUT, in its encoding but never compressed, from a repaint
+ * of the current window and the title onward; the agent sends that repaint
+ * to every CONOUT reader.  The string is freed with the winpty_t.
+ *
+ * A subscriber that stops reading doesn't slow the session down.  Its pipe
+ * is closed once it falls about 16 MiB behind, as it is when its client
+ * disconnects.  Subscribers are unavailable with a pseudoconsole, where the
+ * output isn't encoded by the agent. */
+WINPTY_API LPCWSTR
+winpty_add_output_subscriber(winpty_t *wp,
+                             winpty_error_ptr_t *err /*OPTIONAL*/);
+
 /* Gets a list of processes attached to the console. */
 WINPTY_API int
 winpty_get_console_process_list(winpty_t *wp, int *processList, const int processCount,
                                 winpty_error_ptr_t *err /*OPTIONAL*/);
 
+/* Gets the agent's runtime counters, indexed by the WINPTY_STAT_xxx
+ * constants.  The counters are cumulative since the agent started.  Copies
+ * up to statCount entries into stats and returns WINPTY_STAT_COUNT, or 0 on
+ * error.  The counters are cheap to maintain, unlike tracing, so they are
+ * always available. */
+WINPTY_API int
+winpty_get_stats(winpty_t *wp, UINT64 *stats, int statCount,
+                 winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Gathers the CPU cost counters (WINPTY_STAT_CPU_xxx) of sessionCount
+ * sessions, e.g. to find the sessions worth throttling.  Row i of report,
+ * the WINPTY_COST_COUNT entries starting at report[i * WINPTY_COST_COUNT],
+ * holds session i's counters, indexed by the WINPTY_COST_xxx constants, and
+ * row sessionCount holds their sums.  reportSize must be at least
+ * (sessionCount + 1) * WINPTY_COST_COUNT.  Returns the index of the session
+ * with the largest WINPTY_COST_TOTAL, or -1 on error or with no sessions.
+ * The counters are cumulative, so a caller comparing recent costs subtracts
+ * an earlier report. */
+WINPTY_API int
+winpty_get_cost_report(winpty_t *const *sessions, int sessionCount,
+                       UINT64 *report, int reportSize,
+                       winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Gets the agent's latency histograms, indexed by the WINPTY_HISTOGRAM_xxx
+ * constants: the count for bucket b of histogram h is at
+ * counts[h * WINPTY_HISTOGRAM_BUCKETS + b].  Like the stats, they are
+ * cumulative and always available.  Copies up to countSize entries into
+ * counts and returns WINPTY_HISTOGRAM_COUNT * WINPTY_HISTOGRAM_BUCKETS, or 0
+ * on error. */
+WINPTY_API int
+winpty_get_histograms(winpty_t *wp, UINT64 *counts, int countSize,
+                      winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* The smallest duration, in microseconds, that the histogram bucket counts.
+ * The bucket counts durations up to the next bucket's value. */
+WINPTY_API UINT64
+winpty_histogram_bucket_value(int bucket);
+
+/* Estimates a percentile (e.g. 99.0) of one histogram's
+ * WINPTY_HISTOGRAM_BUCKETS counts: the upper end of the bucket holding it,
+ * in microseconds.  Returns 0 for an empty histogram. */
+WINPTY_API UINT64
+winpty_histogram_percentile(const UINT64 *buckets, double percentile);
+
+/* Polls sessionCount sessions and formats their counters, histograms and
+ * console API counters for a monitoring system, in a WINPTY_METRICS_xxx
+ * format.  Each session is labeled with labels[i], or with its index if
+ * labels is NULL.  A session whose agent doesn't answer is reported as
+ * down (winpty_session_up 0, or an up column of 0 and empty fields) and
+ * doesn't fail the export.  Returns NULL on error.
+ *
+ * In the Prometheus format, counters are named winpty_<stat>_total after
+ * the WINPTY_STAT_xxx constants, with a session label.  The histograms
+ * have a bucket per power of two; their _sum is estimated from the bucket
+ * lower bounds.  The CSV columns are the time in milliseconds since 1970,
+ * the session, whether it is up, the stats, each histogram's 50th and 99th
+ * percentiles, and the console API counters. */
+typedef struct winpty_metrics_s winpty_metrics_t;
+
+WINPTY_API winpty_metrics_t *
+winpty_export_metrics(winpty_t *const *sessions,
+                      const LPCWSTR *labels /*OPTIONAL*/,
+                      int sessionCount, int format,
+                      winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* The UTF-8 text, without a NUL terminator; its size is stored in *size. */
+WINPTY_API const char *
+winpty_metrics_text(winpty_metrics_t *metrics, size_t *size);
+
+WINPTY_API void winpty_metrics_free(winpty_metrics_t *metrics);
+
+/* Gets the agent's console API counters, indexed by the
+ * WINPTY_CONSOLE_API_xxx constants: the value for column c of kind k is at
+ * table[k * WINPTY_CONSOLE_API_COLUMNS + c].  They are cumulative, so a
+ * caller profiling one workload subtracts an earlier table.  Copies up to
+ * tableSize entries into table and returns
+ * WINPTY_CONSOLE_API_COUNT * WINPTY_CONSOLE_API_COLUMNS, or 0 on error. */
+WINPTY_API int
+winpty_get_console_api_stats(winpty_t *wp, UINT64 *table, int tableSize,
+                             winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* A copy of the newest lines of the agent's CONOUT history (see
+ * winpty_config_set_history_limit), e.g. to fill the scrollback of a client
+ * that attaches after the output started.  Returns NULL on error.  Without
+ * a history, the copy has no lines.  Free it with winpty_history_free. */
+typedef struct winpty_history_s winpty_history_t;
+
+WINPTY_API winpty_history_t *
+winpty_get_history(winpty_t *wp, UINT64 maxLines,
+                   winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* The number of the first line in the copy, counting from the first line
+ * the agent recorded.  Lines before it were discarded or not requested. */
+WINPTY_API UINT64 winpty_history_first_line(winpty_history_t *history);
+WINPTY_API size_t winpty_history_line_count(winpty_history_t *history);
+
+/* Returns the UTF-8 text of a line, without trailing blanks or a NUL
+ * terminator, and stores its size in *size. */
+WINPTY_API const char *
+winpty_history_line_text(winpty_history_t *history, size_t line,
+                         size_t *size);
+
+/* A line's attributes, as runs covering its text: run `run` applies the
+ * console attributes *attributes (FOREGROUND_xxx, BACKGROUND_xxx,
+ * COMMON_LVB_xxx) to the next *size bytes of text. */
+WINPTY_API size_t
+winpty_history_run_count(winpty_history_t *history, size_t line);
+WINPTY_API void
+winpty_history_run(winpty_history_t *history, size_t line, size_t run,
+                   size_t *size, WORD *attributes);
+
+WINPTY_API void winpty_history_free(winpty_history_t *history);
+
+/* A copy of the console window as it is now, which may be ahead of the
+ * output read from CONOUT so far: e.g. to redraw a client's view from
+ * scratch, or to check a screen in a test.  Returns NULL on error.  Lines
+ * have the same form as the history's.  When the child is hosted in a
+ * pseudoconsole (WINPTY_FLAG_CONPTY), the agent has no window to read, and
+ * the copy is empty.  Free it with winpty_screen_free. */
+typedef struct winpty_screen_s winpty_screen_t;
+
+WINPTY_API winpty_screen_t *
+winpty_get_screen(winpty_t *wp, winpty_error_ptr_t *err /*OPTIONAL*/);
+
+WINPTY_API void
+winpty_screen_size(winpty_screen_t *screen, int *cols, int *rows);
+
+/* Stores the cursor position, relative to the top-left cell of the window,
+ * in *x and *y, and returns whether the cursor is visible.  The position
+ * may be outside the window. */
+WINPTY_API BOOL
+winpty_screen_cursor(winpty_screen_t *screen, int *x, int *y);
+
+/* The text and attribute runs of window row `row`, as with
+ * winpty_history_line_text and winpty_history_run. */
+WINPTY_API const char *
+winpty_screen_line_text(winpty_screen_t *screen, int row, size_t *size);
+WINPTY_API size_t winpty_screen_run_count(winpty_screen_t *screen, int row);
+WINPTY_API void
+winpty_screen_run(winpty_screen_t *screen, int row, size_t run,
+                  size_t *size, WORD *attributes);
+
+WINPTY_API void winpty_screen_free(winpty_screen_t *screen);
+
+
+
+/*****************************************************************************
+ * winpty agent RPC calls: asynchronous variants
+ *
+ * Each *_async call writes its request to the agent and returns without
+ * waiting for the reply.  On success, it returns a nonzero request ID; on
+ * failure, it returns 0 and sets *err.  Several requests may be outstanding
+ * at once.  The agent answers them in the order they were issued.
+ *
+ * When a reply may be available, the manual-reset event returned by
+ * winpty_async_event is signaled.  The client then calls winpty_poll_result,
+ * which decodes the available replies.  For each completed request that was
+ * issued with a callback, winpty_poll_result invokes the callback (on the
+ * calling thread, without holding any winpty_t lock) and frees the result
+ * afterward.  Otherwise, the result is returned to the caller, who must free
+ * it with winpty_async_result_free.
+ *
+ * winpty_poll_result returns at most one result per call, and the event
+ * remains signaled while more are ready.  Unlike the blocking calls, the
+ * asynchronous calls do not apply the agent timeout to replies.  The client
+ * can wait on winpty_agent_process to detect a dead agent.
+ *
+ * If the connection to the agent is lost, every outstanding request
+ * completes with an error.
+ *
+ * The asynchronous and blocking calls may be mixed.  A blocking call first
+ * waits for the replies to the asynchronous requests issued before it. */
+
+typedef struct winpty_async_result_s winpty_async_result_t;
+
+typedef void (*winpty_async_callback_t)(winpty_async_result_t *result,
+                                        void *user_data);
+
+WINPTY_API UINT64
+winpty_spawn_async(winpty_t *wp,
+                   const winpty_spawn_config_t *cfg,
+                   BOOL want_process_handle,
+                   BOOL want_thread_handle,
+                   winpty_async_callback_t callback /*OPTIONAL*/,
+                   void *user_data /*OPTIONAL*/,
+                   winpty_error_ptr_t *err /*OPTIONAL*/);
+
+WINPTY_API UINT64
+winpty_set_size_async(winpty_t *wp, int cols, int rows,
+                      winpty_async_callback_t callback /*OPTIONAL*/,
+                      void *user_data /*OPTIONAL*/,
+                      winpty_error_ptr_t *err /*OPTIONAL*/);
+
+WINPTY_API UINT64
+winpty_get_console_process_list_async(
+    winpty_t *wp,
+    winpty_async_callback_t callback /*OPTIONAL*/,
+    void *user_data /*OPTIONAL*/,
+    winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* Requests the console process list once it differs from the list with the
+ * given generation.  Pass 0 to get the current list immediately.  The result
+ * carries the list and its generation, which the client passes to the next
+ * wait.  Unlike other requests, a wait can complete after requests issued
+ * after it. */
+WINPTY_API UINT64
+winpty_wait_process_list_change_async(
+    winpty_t *wp,
+    UINT64 known_generation,
+    winpty_async_callback_t callback /*OPTIONAL*/,
+    void *user_data /*OPTIONAL*/,
+    winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* The event is owned by the winpty_t object.  Do not close it. */
+WINPTY_API HANDLE winpty_async_event(winpty_t *wp);
+
+/* Processes the replies that have arrived without blocking.  Returns a
+ * completed result that has no callback, or NULL if there is none.  On
+ * failure, returns NULL and sets *err. */
+WINPTY_API winpty_async_result_t *
+winpty_poll_result(winpty_t *wp, winpty_error_ptr_t *err /*OPTIONAL*/);
+
+/* The ID returned by the *_async call that issued the request. */
+WINPTY_API UINT64 winpty_async_result_id(winpty_async_result_t *result);
+
+/* NULL if the request succeeded.  The error object is owned by the result
+ * and must not be freed separately. */
+WINPTY_API winpty_error_ptr_t
+winpty_async_result_error(winpty_async_result_t *result);
+
+/* For a spawn request, transfers ownership of the process or thread handle
+ * to the caller.  Returns NULL if the handle was not requested, the spawn
+ * failed, or the handle was already taken. */
+WINPTY_API HANDLE winpty_async_result_take_process(winpty_async_result_t *result);
+WINPTY_API HANDLE winpty_async_result_take_thread(winpty_async_result_t *result);
+
+/* For a spawn request that failed with
+ * WINPTY_ERROR_SPAWN_CREATE_PROCESS_FAILED, the agent's GetLastError(). */
+WINPTY_API DWORD
+winpty_async_result_create_process_error(winpty_async_result_t *result);
+
+/* For a process list request, copies the list into processList if it has
+ * room for the entire list.  Returns the number of processes. */
+WINPTY_API int
+winpty_async_result_process_list(winpty_async_result_t *result,
+                                 int *processList, int processCount);
+
+/* For a process list wait, the generation of the list in the result. */
+WINPTY_API UINT64
+winpty_async_result_process_list_generation(winpty_async_result_t *result);
+
+/* Frees the result, closing any handles that were not taken. */
+WINPTY_API void winpty_async_result_free(winpty_async_result_t *result);
+
 /* Frees the winpty_t object and the OS resources contained in it.  This
  * call breaks the connection with the agent, which should then close its
  * console, terminating the processes attached to it.
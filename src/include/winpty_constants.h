@@ -76,11 +76,131 @@
  * See https://github.com/rprichard/winpty/issues/58. */
 #define WINPTY_FLAG_ALLOW_CURPROC_DESKTOP_CREATION 0x8ull
 
+/* Scrape the console when it reports a change (via WinEvent console hooks)
+ * rather than polling it every 25 milliseconds.  The agent still polls at a
+ * low frequency as a safety net.  If the hook cannot be installed, the agent
+ * falls back to ordinary polling. */
+#define WINPTY_FLAG_EVENT_DRIVEN_SCRAPE 0x10ull
+
+/* Wrap the output of each console scrape in DEC synchronized-update
+ * sequences (CSI ?2026h ... CSI ?2026l), so that terminals supporting them
+ * repaint once per scrape.  Terminals that don't support them ignore the
+ * sequences.  Ignored with WINPTY_FLAG_PLAIN_OUTPUT. */
+#define WINPTY_FLAG_SYNCHRONIZED_OUTPUT 0x20ull
+
+/* Deliver CONOUT through a ring buffer in shared memory rather than a named
+ * pipe, which avoids a system call per write for a client on the same
+ * machine.  Read it with winpty_conout_shm.  If the agent can't create the
+ * shared memory section, it falls back to a named pipe, and
+ * winpty_conout_shm fails. */
+#define WINPTY_FLAG_SHM_OUTPUT 0x40ull
+
+/* Send console output as a binary stream of cell-grid records (see
+ * WINPTY_CELL_RECORD_xxx) rather than VT escape sequences.  This is for
+ * clients that render the grid themselves.  WINPTY_FLAG_PLAIN_OUTPUT,
+ * WINPTY_FLAG_COLOR_ESCAPES and WINPTY_FLAG_SYNCHRONIZED_OUTPUT are ignored
+ * with this flag. */
+#define WINPTY_FLAG_CELL_OUTPUT 0x80ull
+
+/* The terminal supports REP (CSI n b) and ECH (CSI n X).  Runs of a repeated
+ * character, like box-drawing borders and separators, are sent as the
+ * character and a REP, and interior runs of blanks with a colored background
+ * as ECH and a cursor movement, instead of cell by cell.  Ignored with
+ * WINPTY_FLAG_PLAIN_OUTPUT and WINPTY_FLAG_CELL_OUTPUT. */
+#define WINPTY_FLAG_REPEAT_ESCAPES 0x100ull
+
+/* Where Windows provides a pseudoconsole (CreatePseudoConsole, Windows 10
+ * version 1809 and later), host the child in one and forward its VT output
+ * to CONOUT, instead of scraping the console.  Elsewhere, and with
+ * WINPTY_FLAG_CONERR, the flag is ignored.  The output comes from the OS, so
+ * WINPTY_FLAG_PLAIN_OUTPUT, WINPTY_FLAG_COLOR_ESCAPES,
+ * WINPTY_FLAG_SYNCHRONIZED_OUTPUT, WINPTY_FLAG_CELL_OUTPUT,
+ * WINPTY_FLAG_REPEAT_ESCAPES and the scraping options have no effect, and
+ * terminal input is passed through unchanged.  winpty_get_console_process_list
+ * does not include the processes in the pseudoconsole, and a reattached
+ * client receives no repaint. */
+#define WINPTY_FLAG_CONPTY 0x200ull
+
+/* Compress CONOUT and CONERR, for clients that relay them over a slow link.
+ * The stream is a sequence of frames, each ending where the agent finished
+ * writing a scrape's output, so a frame can be decoded as soon as it
+ * arrives.  Decode it with winpty_decoder_t.  winpty_output_compressed
+ * reports whether the agent compresses its output. */
+#define WINPTY_FLAG_COMPRESS_OUTPUT 0x400ull
+
+/* While the console is idle, let the agent's poll timer slip by up to half
+ * the poll interval, aligned so that the wakeups of many agents coincide.
+ * This saves power on hosts running many consoles.  The first output after
+ * an idle period can appear correspondingly later.  Activity restores the
+ * precise interval. */
+#define WINPTY_FLAG_LOW_POWER_IDLE 0x800ull
+
+/* Send the VT output of CONOUT and CONERR as UTF-16LE text rather than
+ * UTF-8, for clients that work in UTF-16.  Ignored with
+ * WINPTY_FLAG_CELL_OUTPUT and WINPTY_FLAG_CONPTY. */
+#define WINPTY_FLAG_UTF16_OUTPUT 0x1000ull
+
+/* Send the VT output of CONOUT and CONERR as a sequence of frames, each a
+ * little-endian uint32 byte count followed by that many bytes of output, so
+ * the client can hand each frame on without scanning it.  A frame holds one
+ * scrape's output, or one update sent between scrapes, and never splits a
+ * character or escape sequence.  Ignored with WINPTY_FLAG_CELL_OUTPUT and
+ * WINPTY_FLAG_CONPTY.  With WINPTY_FLAG_COMPRESS_OUTPUT, the frames are
+ * what is compressed. */
+#define WINPTY_FLAG_FRAMED_OUTPUT 0x2000ull
+
+/* With WINPTY_FLAG_CELL_OUTPUT, acknowledge input in the output stream (see
+ * WINPTY_CELL_RECORD_INPUT_ACK), so a client can echo keystrokes
+ * speculatively and reconcile when the frame that reflects them arrives.
+ * Ignored without WINPTY_FLAG_CELL_OUTPUT. */
+#define WINPTY_FLAG_INPUT_ACKS 0x4000ull
+
+/* For latency-sensitive sessions: while input is arriving, raise the system
+ * timer resolution to 1 ms and poll the console every millisecond, on top of
+ * any event-driven scrapes, so keystrokes echo with as little delay as
+ * possible.  A couple of seconds after the last input, the agent restores
+ * the timer resolution and its regular schedule, so an idle session costs
+ * no more power than usual.  Not applied while the session is paused or has
+ * WINPTY_PRIORITY_BACKGROUND. */
+#define WINPTY_FLAG_LOW_LATENCY 0x8000ull
+
+/* Stamp each scrape's output with its frame sequence number (from 1), the
+ * time the console was read, and the CONIN bytes (counted as
+ * WINPTY_STAT_CONIN_BYTES counts them) written to the console before then,
+ * so a client can tell the agent's share of the output latency from the
+ * network's.  The time is QueryPerformanceCounter converted to
+ * microseconds, comparable to the client's own QPC on the same machine.
+ * The VT output carries a private "ESC ] 7701 ; seq ; us ; bytes BEL" at the
+ * end of the frame, which clients should strip; the cell output carries a
+ * WINPTY_CELL_RECORD_FRAME_STAMP record.  Ignored with
+ * WINPTY_FLAG_PLAIN_OUTPUT and WINPTY_FLAG_CONPTY. */
+#define WINPTY_FLAG_FRAME_STAMPS 0x10000ull
+
+/* With WINPTY_FLAG_CELL_OUTPUT, summarize each frame's changes in a
+ * WINPTY_CELL_RECORD_DAMAGE record, so a renderer can redraw just the
+ * damaged rows without diffing its grid.  Ignored without
+ * WINPTY_FLAG_CELL_OUTPUT. */
+#define WINPTY_FLAG_DAMAGE_RECORDS 0x20000ull
+
 #define WINPTY_FLAG_MASK (0ull \
     | WINPTY_FLAG_CONERR \
     | WINPTY_FLAG_PLAIN_OUTPUT \
     | WINPTY_FLAG_COLOR_ESCAPES \
     | WINPTY_FLAG_ALLOW_CURPROC_DESKTOP_CREATION \
+    | WINPTY_FLAG_EVENT_DRIVEN_SCRAPE \
+    | WINPTY_FLAG_SYNCHRONIZED_OUTPUT \
+    | WINPTY_FLAG_SHM_OUTPUT \
+    | WINPTY_FLAG_CELL_OUTPUT \
+    | WINPTY_FLAG_REPEAT_ESCAPES \
+    | WINPTY_FLAG_CONPTY \
+    | WINPTY_FLAG_COMPRESS_OUTPUT \
+    | WINPTY_FLAG_LOW_POWER_IDLE \
+    | WINPTY_FLAG_UTF16_OUTPUT \
+    | WINPTY_FLAG_FRAMED_OUTPUT \
+    | WINPTY_FLAG_INPUT_ACKS \
+    | WINPTY_FLAG_LOW_LATENCY \
+    | WINPTY_FLAG_FRAME_STAMPS \
+    | WINPTY_FLAG_DAMAGE_RECORDS \
 )
 
 /* QuickEdit mode is initially disabled, and the agent does not send mouse
@@ -101,6 +221,70 @@
 
 
 
+/*****************************************************************************
+ * The WINPTY_FLAG_CELL_OUTPUT stream. */
+
+/* The stream is a sequence of records, each a little-endian header
+ * { uint16 type; uint16 reserved; uint32 payloadSize; } followed by the
+ * payload.  Skip records of unknown types.  All integers are little-endian.
+ *
+ * Line numbers work the way winpty's VT output does: they count terminal
+ * lines from the last RESET, and a line below the bottom row of the grid
+ * scrolls the grid up, as writing there would in a terminal.  Cells carry
+ * the console's UTF-16 code unit and attributes (FOREGROUND_xxx,
+ * BACKGROUND_xxx, COMMON_LVB_xxx), so a full-width character occupies a
+ * leading and a trailing cell. */
+
+/* The first record: { uint32 version; }, currently 1. */
+#define WINPTY_CELL_RECORD_HELLO        0
+/* { int64 line; uint32 clear; }: Line numbers restart at `line`.  If clear
+ * is non-zero, blank the grid. */
+#define WINPTY_CELL_RECORD_RESET        1
+/* { int64 line; uint16 width; uint16 column; uint16 count; uint16 reserved;
+ *   { uint16 ch; uint16 attributes; } cells[count]; }: Overwrite cells
+ * [column, column+count) of a line that is `width` cells wide. */
+#define WINPTY_CELL_RECORD_LINE         2
+/* { int32 top; int32 bottom; int32 delta; }: Scroll grid rows [top, bottom]
+ * (0-based) so that row R shows what row R+delta showed, blanking the
+ * exposed rows. */
+#define WINPTY_CELL_RECORD_SCROLL       3
+/* { int64 line; int32 column; uint32 visible; } */
+#define WINPTY_CELL_RECORD_CURSOR       4
+/* { uint32 enabled; }: Whether the client should report mouse input. */
+#define WINPTY_CELL_RECORD_MOUSE_MODE   5
+/* No payload: the records since the previous END_FRAME form one console
+ * update, so the client can repaint now. */
+#define WINPTY_CELL_RECORD_END_FRAME    6
+/* { uint16 title[]; }: The console title, in UTF-16 without a NUL. */
+#define WINPTY_CELL_RECORD_TITLE        7
+/* { uint64 bytes; }: With WINPTY_FLAG_INPUT_ACKS, the number of CONIN bytes
+ * (counted as WINPTY_STAT_CONIN_BYTES counts them) written to the console
+ * before it was read for this frame.  It precedes the frame's END_FRAME, and
+ * is sent only when it changes, so a frame may hold nothing else.  The
+ * program may not have handled that input yet, so a speculative echo that
+ * the frame doesn't show should wait for a later frame before giving up. */
+#define WINPTY_CELL_RECORD_INPUT_ACK    8
+/* { uint64 sequence; uint64 captureUs; uint64 inputBytes; }: With
+ * WINPTY_FLAG_FRAME_STAMPS, when and from which input the frame was read
+ * (see the flag).  It precedes the frame's END_FRAME. */
+#define WINPTY_CELL_RECORD_FRAME_STAMP  9
+/* { uint32 flags; uint16 scrollCount; uint16 rectCount;
+ *   { int32 top; int32 bottom; int32 delta; } scrolls[scrollCount];
+ *   { int64 firstLine; int64 lastLine; uint16 column; uint16 endColumn;
+ *     uint32 reserved; } rects[rectCount]; }:
+ * With WINPTY_FLAG_DAMAGE_RECORDS, what the frame changed.  It precedes the
+ * frame's END_FRAME.  The scrolls are the frame's SCROLL records, in order.
+ * Each rect covers columns [column, endColumn) of lines [firstLine,
+ * lastLine] that its LINE records rewrote, already moved by any later
+ * scroll, so a renderer applies the scrolls and then redraws the rects.
+ * Lines map to grid rows as the LINE records' do.  If flags has
+ * WINPTY_CELL_DAMAGE_FULL, the frame reset the grid or changed too much to
+ * list, and the whole grid should be redrawn. */
+#define WINPTY_CELL_RECORD_DAMAGE       10
+#define WINPTY_CELL_DAMAGE_FULL         1u
+
+
+
 /*****************************************************************************
  * winpty agent RPC call: process creation. */
 
@@ -128,4 +312,286 @@
 
 
 
+/*****************************************************************************
+ * Startup phases reported by winpty_get_startup_stats. */
+
+/* Phases timed by libwinpty within winpty_open. */
+
+/* Creating (or reusing) the background desktop. */
+#define WINPTY_STARTUP_DESKTOP              0
+/* The CreateProcess call that starts the agent. */
+#define WINPTY_STARTUP_CREATE_PROCESS       1
+/* Waiting for the agent to connect to the control pipe. */
+#define WINPTY_STARTUP_CONNECT_PIPE         2
+/* Checking the PID of the control pipe's client. */
+#define WINPTY_STARTUP_VERIFY_PID           3
+/* Waiting for the agent's setup packet, which it sends once initialized. */
+#define WINPTY_STARTUP_AGENT_SETUP          4
+/* The whole of winpty_open. */
+#define WINPTY_STARTUP_TOTAL                5
+
+/* Phases timed by the agent and returned in its setup packet. */
+
+/* Opening the console buffers and probing the console implementation. */
+#define WINPTY_STARTUP_AGENT_OPEN_CONSOLE   6
+/* Connecting to the control pipe. */
+#define WINPTY_STARTUP_AGENT_CONNECT_PIPE   7
+/* Creating the CONIN/CONOUT/CONERR server pipes. */
+#define WINPTY_STARTUP_AGENT_CREATE_PIPES   8
+/* Selecting the small console font. */
+#define WINPTY_STARTUP_AGENT_SET_FONT       9
+/* Sizing the initial screen buffer and window. */
+#define WINPTY_STARTUP_AGENT_RESIZE_BUFFER  10
+/* The rest of the agent's initialization (scrapers, input, event hook). */
+#define WINPTY_STARTUP_AGENT_OTHER          11
+
+#define WINPTY_STARTUP_PHASE_COUNT          12
+
+
+
+/*****************************************************************************
+ * Spawn phases reported by winpty_get_spawn_stats. */
+
+/* Building and writing the StartProcess request. */
+#define WINPTY_SPAWN_ENCODE                 0
+/* From writing the request to reading the agent's reply.  This includes
+ * the agent's phases below. */
+#define WINPTY_SPAWN_ROUND_TRIP             1
+/* Duplicating the process and thread handles out of the agent. */
+#define WINPTY_SPAWN_TAKE_HANDLES           2
+/* The whole of winpty_spawn. */
+#define WINPTY_SPAWN_TOTAL                  3
+/* Phases timed by the agent: decoding the request, the CreateProcess call,
+ * and preparing the handles for the reply. */
+#define WINPTY_SPAWN_AGENT_DECODE           4
+#define WINPTY_SPAWN_AGENT_CREATE_PROCESS   5
+#define WINPTY_SPAWN_AGENT_HANDLES          6
+
+#define WINPTY_SPAWN_PHASE_COUNT            7
+
+
+
+/*****************************************************************************
+ * Agent counters reported by winpty_get_stats. */
+
+/* Console scrapes performed, and those that produced terminal output. */
+#define WINPTY_STAT_SCRAPES                 0
+#define WINPTY_STAT_SCRAPES_CHANGED         1
+/* Time spent scraping the console, in microseconds. */
+#define WINPTY_STAT_SCRAPE_TIME_US          2
+/* Console cells read with ReadConsoleOutputW. */
+#define WINPTY_STAT_CELLS_READ              3
+/* Lines sent to the terminal. */
+#define WINPTY_STAT_LINES_SENT              4
+/* Times the agent lost track of the console (e.g. the sync marker was not
+ * found) and redrew the whole window. */
+#define WINPTY_STAT_RESYNCS                 5
+/* Bytes read from the CONIN pipe and written to the CONOUT, CONERR, and
+ * control pipes. */
+#define WINPTY_STAT_CONIN_BYTES             6
+#define WINPTY_STAT_CONOUT_BYTES            7
+#define WINPTY_STAT_CONERR_BYTES            8
+#define WINPTY_STAT_CONTROL_BYTES           9
+/* INPUT_RECORD values written to the console input buffer. */
+#define WINPTY_STAT_INPUT_RECORDS           10
+/* How the agent freezes the console, chosen by timing the methods at
+ * startup: a WINPTY_FREEZE_METHOD_xxx value, and the measured cost of one
+ * freeze and unfreeze, in microseconds. */
+#define WINPTY_STAT_FREEZE_METHOD           11
+#define WINPTY_STAT_FREEZE_COST_US          12
+/* 1 if scrapes first read the console without freezing it, validating the
+ * result afterward, and 0 if every scrape freezes the console. */
+#define WINPTY_STAT_OPTIMISTIC_SCRAPE       13
+/* Unfrozen scrapes that found the console changed while they read it, and
+ * were redone with the console frozen. */
+#define WINPTY_STAT_OPTIMISTIC_RETRIES      14
+/* CPU cycles (see QueryThreadCycleTime) the agent spent on each activity:
+ * reading the console for scrapes, comparing what they read with the lines
+ * already sent and encoding the changes, turning terminal input into input
+ * records, and handling control packets.  The last is the cycles of the
+ * whole agent process, including the work not attributed to any of them.
+ * Before Vista, they are all 0. */
+#define WINPTY_STAT_CPU_CAPTURE_CYCLES      15
+#define WINPTY_STAT_CPU_ENCODE_CYCLES       16
+#define WINPTY_STAT_CPU_INPUT_CYCLES        17
+#define WINPTY_STAT_CPU_CONTROL_CYCLES      18
+#define WINPTY_STAT_CPU_TOTAL_CYCLES        19
+/* The agent's event loop iterations (summed over the main loop and the
+ * input thread's), and the waits that returned.  Each wakeup has one cause:
+ * I/O on the control, CONIN, CONOUT, or CONERR pipe, the poll timeout, or
+ * something else (a wakeup from another agent thread or a window message).
+ * A spurious wakeup found nothing to do before waiting again. */
+#define WINPTY_STAT_LOOP_ITERATIONS         20
+#define WINPTY_STAT_WAKEUPS                 21
+#define WINPTY_STAT_WAKEUPS_CONTROL         22
+#define WINPTY_STAT_WAKEUPS_CONIN           23
+#define WINPTY_STAT_WAKEUPS_CONOUT          24
+#define WINPTY_STAT_WAKEUPS_CONERR          25
+#define WINPTY_STAT_WAKEUPS_TIMEOUT         26
+#define WINPTY_STAT_WAKEUPS_OTHER           27
+#define WINPTY_STAT_WAKEUPS_SPURIOUS        28
+/* Wall-clock time the event loops spent waiting, and running between
+ * waits, in microseconds. */
+#define WINPTY_STAT_LOOP_BLOCKED_US         29
+#define WINPTY_STAT_LOOP_RUNNING_US         30
+
+#define WINPTY_STAT_COUNT                   31
+
+/* Values of WINPTY_STAT_FREEZE_METHOD: the console's Select All and Mark
+ * commands. */
+#define WINPTY_FREEZE_METHOD_SELECT_ALL     0
+#define WINPTY_FREEZE_METHOD_MARK           1
+
+
+
+/*****************************************************************************
+ * The columns of a winpty_get_cost_report row: the WINPTY_STAT_CPU_xxx
+ * counters, in the same order. */
+
+#define WINPTY_COST_CAPTURE                 0
+#define WINPTY_COST_ENCODE                  1
+#define WINPTY_COST_INPUT                   2
+#define WINPTY_COST_CONTROL                 3
+#define WINPTY_COST_TOTAL                   4
+
+#define WINPTY_COST_COUNT                   5
+
+
+
+/*****************************************************************************
+ * Agent latency histograms reported by winpty_get_histograms.  Each counts
+ * durations in microseconds. */
+
+/* Reading the console for one scrape, and encoding what it read into
+ * terminal output (all of its slices). */
+#define WINPTY_HISTOGRAM_SCRAPE_CAPTURE     0
+#define WINPTY_HISTOGRAM_SCRAPE_ENCODE      1
+/* Each span with the console frozen. */
+#define WINPTY_HISTOGRAM_FREEZE             2
+/* From reading CONIN bytes to writing their input records into the console
+ * input buffer.  Bytes held back (e.g. an incomplete escape sequence) count
+ * from when the first of them arrived. */
+#define WINPTY_HISTOGRAM_INPUT_LATENCY      3
+/* Handling one control packet (a libwinpty request). */
+#define WINPTY_HISTOGRAM_CONTROL_PACKET     4
+
+#define WINPTY_HISTOGRAM_COUNT              5
+
+/* The buckets of each histogram.  Buckets 0 to 15 count durations of 0 to
+ * 15 microseconds.  Above that, each power of two has 8 buckets of equal
+ * width, and the last bucket also counts everything longer than 2^32
+ * microseconds.  winpty_histogram_bucket_value gives a bucket's range. */
+#define WINPTY_HISTOGRAM_BUCKETS            240
+
+
+
+/*****************************************************************************
+ * The console API calls counted by winpty_get_console_api_stats.  Each kind
+ * groups the Win32 functions named beside it. */
+
+/* ReadConsoleOutputW, with the cells read. */
+#define WINPTY_CONSOLE_API_READ_OUTPUT      0
+/* WriteConsoleOutputW, with the cells written. */
+#define WINPTY_CONSOLE_API_WRITE_OUTPUT     1
+/* GetConsoleScreenBufferInfo.  Calls answered from the agent's cache while
+ * the console is frozen are not counted. */
+#define WINPTY_CONSOLE_API_BUFFER_INFO      2
+/* SetConsoleWindowInfo. */
+#define WINPTY_CONSOLE_API_SET_WINDOW       3
+/* SetConsoleScreenBufferSize, including the retries with wider sizes. */
+#define WINPTY_CONSOLE_API_SET_BUFFER_SIZE  4
+/* FillConsoleOutputCharacterW, FillConsoleOutputAttribute and
+ * ScrollConsoleScreenBufferW, with the cells cleared. */
+#define WINPTY_CONSOLE_API_FILL_OUTPUT      5
+/* SetConsoleCursorPosition and SetConsoleTextAttribute. */
+#define WINPTY_CONSOLE_API_SET_CURSOR       6
+/* WriteConsoleInputW, with the input records written. */
+#define WINPTY_CONSOLE_API_WRITE_INPUT      7
+/* Selecting the console font: one call counts all the font functions the
+ * agent needed. */
+#define WINPTY_CONSOLE_API_FONT             8
+/* GetConsoleTitleW and SetConsoleTitleW. */
+#define WINPTY_CONSOLE_API_TITLE            9
+/* The rest: GetConsoleMode, GetLargestConsoleWindowSize, and the messages
+ * sent to the console window to freeze it. */
+#define WINPTY_CONSOLE_API_OTHER            10
+
+#define WINPTY_CONSOLE_API_COUNT            11
+
+/* The columns of each kind's row: the calls, the cells or records they
+ * transferred, and the microseconds they took. */
+#define WINPTY_CONSOLE_API_CALLS            0
+#define WINPTY_CONSOLE_API_CELLS            1
+#define WINPTY_CONSOLE_API_US               2
+
+#define WINPTY_CONSOLE_API_COLUMNS          3
+
+
+
+/*****************************************************************************
+ * Formats of winpty_export_metrics. */
+
+/* The Prometheus text exposition format, for a /metrics endpoint. */
+#define WINPTY_METRICS_PROMETHEUS           0
+/* CSV with a header line and one row per session. */
+#define WINPTY_METRICS_CSV                  1
+/* The same rows without the header, for appending to a CSV file at each
+ * poll. */
+#define WINPTY_METRICS_CSV_ROWS             2
+
+
+
+/*****************************************************************************
+ * Session priorities set by winpty_set_priority. */
+
+/* The scrape policy the session was configured with.  This is the initial
+ * priority. */
+#define WINPTY_PRIORITY_NORMAL              0
+
+/* For a session nobody is looking at (e.g. a hidden tab).  The agent scrapes
+ * rarely, bounds its repaint rate, and runs at below-normal CPU priority.
+ * Lines scrolling into the history are still sent. */
+#define WINPTY_PRIORITY_BACKGROUND          1
+
+/* For the session the user is watching.  The agent polls at a short interval
+ * so output and echo appear with little delay. */
+#define WINPTY_PRIORITY_FOREGROUND          2
+
+
+
+/*****************************************************************************
+ * Agent scheduling classes set by winpty_config_set_agent_scheduling and
+ * winpty_set_agent_scheduling. */
+
+/* The agent's CPU priority follows the session priority alone. */
+#define WINPTY_SCHEDULING_DEFAULT           0
+
+/* For latency-sensitive sessions.  At the normal and foreground session
+ * priorities, the agent runs at above-normal CPU priority, so other busy
+ * processes on the machine don't delay its scrapes and input. */
+#define WINPTY_SCHEDULING_INTERACTIVE       1
+
+/* For batch sessions.  The agent runs in background processing mode, with
+ * low CPU, I/O and memory priority, whatever the session priority. */
+#define WINPTY_SCHEDULING_BATCH             2
+
+
+
+/*****************************************************************************
+ * Recording formats for winpty_config_set_recording. */
+
+/* asciicast v2, as played by asciinema: a header line
+ * {"version": 2, "width": W, "height": H}, then one JSON array per line,
+ * [seconds, "o", text] for output and [seconds, "r", "COLSxROWS"] for a
+ * resize. */
+#define WINPTY_RECORDING_ASCIICAST          0
+
+/* A compact binary log that can also hold cell output.  All integers are
+ * little-endian.  The file starts with the 8 bytes "WPTYREC\x01" and the
+ * uint32 columns and rows.  Each record is a uint64 time in microseconds, a
+ * uint32 type (0 for output, 1 for a resize), a uint32 payload size, and the
+ * payload: the output bytes, or the uint32 columns and rows. */
+#define WINPTY_RECORDING_BINARY             1
+
+
 #endif /* WINPTY_CONSTANTS_H */
@@ -24,6 +24,7 @@
 
 #include <string>
 
+#include "../shared/Mutex.h"
 #include "../shared/WinptyAssert.h"
 
 #include "LibWinptyException.h"
@@ -63,7 +64,16 @@ static bool pathExists(const std::wstring &path) {
     return GetFileAttributesW(path.c_str()) != 0xFFFFFFFF;
 }
 
+// The agent found next to the DLL.  Only a successful lookup is remembered,
+// so an agent installed after a failed winpty_open is still found.
+static Mutex g_agentProgramMutex;
+static std::wstring g_agentProgram;
+
 std::wstring findAgentProgram() {
+    LockGuard<Mutex> lock(g_agentProgramMutex);
+    if (!g_agentProgram.empty()) {
+        return g_agentProgram;
+    }
     std::wstring progDir = dirname(getModuleFileName(getCurrentModule()));
     std::wstring ret = progDir + (L"\\" AGENT_EXE);
     if (!pathExists(ret)) {
@@ -71,5 +81,6 @@ std::wstring findAgentProgram() {
             WINPTY_ERROR_AGENT_EXE_MISSING,
             (L"agent executable does not exist: '" + ret + L"'").c_str());
     }
+    g_agentProgram = ret;
     return ret;
 }
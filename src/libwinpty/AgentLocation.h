@@ -23,6 +23,8 @@
 
 #include <string>
 
+// Returns the winpty-agent.exe next to the DLL.  The path is looked up once per
+// process.
 std::wstring findAgentProgram();
 
 #endif // LIBWINPTY_AGENT_LOCATION_H
@@ -21,17 +21,26 @@
 #ifndef LIBWINPTY_WINPTY_INTERNAL_H
 #define LIBWINPTY_WINPTY_INTERNAL_H
 
+#include <stdint.h>
+
+#include <deque>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "../include/winpty.h"
 
 #include "../shared/Mutex.h"
 #include "../shared/OwnedHandle.h"
+#include "../shared/SharedMemoryRing.h"
+#include "../shared/StreamCompression.h"
 
 // The structures in this header are not intended to be accessed directly by
 // client programs.
 
+class AgentDesktop;
+
 struct winpty_error_s {
     winpty_result_t code;
     const wchar_t *msgStatic;
@@ -47,6 +56,43 @@ struct winpty_config_s {
     int rows = 25;
     int mouseMode = WINPTY_MOUSE_MODE_AUTO;
     DWORD timeoutMs = 30000;
+    int minPollIntervalMs = 25;
+    int maxPollIntervalMs = 25;
+    uint64_t historyLimitBytes = 0;
+    int maxFrameRate = 0;
+    int bufferLineCount = 3000;
+    int syncMarkerMargin = 200;
+    int maxConsoleWidth = 2500;
+    int outPipeBufferSize = 8192;
+    int inPipeBufferSize = 256;
+    int coalesceDelayUs = 0;
+    int coalesceBytes = 4096;
+    int schedulingClass = WINPTY_SCHEDULING_DEFAULT;
+    uint64_t affinityMask = 0;
+    uint64_t creditBytes = 0;
+    uint64_t creditFrames = 0;
+    int idleTrimMs = 0;
+    // Empty for the agent next to the DLL.
+    std::wstring agentPath;
+    // Empty unless the session is recorded.
+    std::wstring recordingPath;
+    int recordingFormat = WINPTY_RECORDING_ASCIICAST;
+};
+
+struct winpty_async_result_s {
+    uint64_t requestId = 0;
+    int type = -1; // AgentMsg::Type
+    bool wantProcess = false;
+    bool wantThread = false;
+    winpty_async_callback_t callback = nullptr;
+    void *userData = nullptr;
+    winpty_error_ptr_t error = nullptr;
+    OwnedHandle process;
+    OwnedHandle thread;
+    DWORD createProcessError = 0;
+    std::vector<int> processList;
+    uint64_t processListGeneration = 0;
+    ~winpty_async_result_s();
 };
 
 struct winpty_s {
@@ -59,6 +105,114 @@ struct winpty_s {
     std::wstring coninPipeName;
     std::wstring conoutPipeName;
     std::wstring conerrPipeName;
+    // A deque, so the names winpty_add_output_subscriber returned stay put.
+    std::deque<std::wstring> subscriberPipeNames;
+    std::unique_ptr<winpty_shm_t> conoutShm;
+    bool outputCompressed = false;
+    // The WINPTY_FLAG_xxx flags the agent was started with.
+    uint64_t agentFlags = 0;
+    std::shared_ptr<AgentDesktop> desktop;
+    // Durations of the startup phases, indexed by WINPTY_STARTUP_xxx.
+    int64_t startupTimesUs[WINPTY_STARTUP_PHASE_COUNT] = {};
+    // Durations of the last spawn's phases, indexed by WINPTY_SPAWN_xxx.
+    int64_t spawnTimesUs[WINPTY_SPAWN_PHASE_COUNT] = {};
+
+    // Control pipe reads are issued into these buffers and may remain
+    // outstanding between API calls.  readEvent is the event returned by
+    // winpty_async_event.
+    OwnedHandle readEvent;
+    OVERLAPPED readOver = {};
+    bool readPending = false;
+    std::vector<char> readChunk;
+    std::vector<char> readQueue;
+
+    // Requests are answered in order, except that a process list wait is
+    // answered when the list changes.
+    int64_t nextRequestId = 1;
+    std::deque<std::unique_ptr<winpty_async_result_t>> pendingRequests;
+    std::deque<std::unique_ptr<winpty_async_result_t>> completedResults;
+
+    // A synchronous call waits for its reply without the mutex, so calls from
+    // several threads are outstanding at once.  The thread in readerThread
+    // reads the control pipe for all of them, handing each waiter its reply;
+    // the others sleep on their events.  The read state above belongs to the
+    // reader while it waits for the pipe.
+    struct SyncWaiter {
+        int64_t requestId = 0;
+        bool done = false;
+        bool failed = false;
+        std::vector<char> payload;
+        OwnedHandle event;
+    };
+    DWORD readerThread = 0;
+    std::vector<SyncWaiter*> syncWaiters;
+
+    ~winpty_s();
+};
+
+struct winpty_pool_s {
+    Mutex mutex;
+    winpty_config_t cfg;
+    size_t size = 0;
+    bool shutdown = false;
+    OwnedHandle wakeEvent;
+    OwnedHandle thread;
+    std::deque<std::unique_ptr<winpty_t>> idle;
+};
+
+struct winpty_history_s {
+    struct Line {
+        std::string text;
+        std::vector<std::pair<uint32_t, WORD>> runs;
+    };
+    uint64_t firstLine = 0;
+    std::vector<Line> lines;
+};
+
+struct winpty_screen_s {
+    int cols = 0;
+    int rows = 0;
+    int cursorX = 0;
+    int cursorY = 0;
+    bool cursorVisible = false;
+    std::vector<winpty_history_s::Line> lines;
+};
+
+struct winpty_metrics_s {
+    std::string text;
+};
+
+struct winpty_shm_s {
+    std::unique_ptr<SharedMemoryRing> ring;
+};
+
+struct winpty_decoder_s {
+    StreamCompression::Decompressor decompressor;
+    std::string output;
+};
+
+struct winpty_output_reader_s {
+    // How the stream marks the ends of its frames.
+    enum class Framing { None, LengthPrefixed, CellRecords };
+
+    winpty_output_callback_t callback = nullptr;
+    void *userData = nullptr;
+    Framing framing = Framing::None;
+    DWORD bufferSize = 0;
+    int bufferCount = 0;
+    // CONOUT is either this pipe or the session's ring.
+    OwnedHandle pipe;
+    winpty_shm_t *shm = nullptr;
+    std::unique_ptr<StreamCompression::Decompressor> decompressor;
+    OwnedHandle stopEvent;
+    OwnedHandle thread;
+
+    // Used only by the reader thread.  pending holds the output not yet
+    // delivered; the bytes before frameEnd are whole frames, and scanPos is
+    // where the next frame header starts.
+    std::string pending;
+    size_t frameEnd = 0;
+    size_t scanPos = 0;
 };
 
 struct winpty_spawn_config_s {
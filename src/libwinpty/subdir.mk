@@ -30,6 +30,8 @@ LIBWINPTY_OBJECTS = \
 	build/libwinpty/shared/DebugClient.o \
 	build/libwinpty/shared/GenRandom.o \
 	build/libwinpty/shared/OwnedHandle.o \
+	build/libwinpty/shared/SharedMemoryRing.o \
+	build/libwinpty/shared/StreamCompression.o \
 	build/libwinpty/shared/StringUtil.o \
 	build/libwinpty/shared/WindowsSecurity.o \
 	build/libwinpty/shared/WindowsVersion.o \
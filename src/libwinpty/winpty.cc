@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
 #include <limits>
 #include <string>
 #include <vector>
@@ -31,13 +32,16 @@
 #include "../include/winpty.h"
 
 #include "../shared/AgentMsg.h"
+#include "../shared/AgentMsgCodec.h"
 #include "../shared/BackgroundDesktop.h"
 #include "../shared/Buffer.h"
 #include "../shared/DebugClient.h"
 #include "../shared/GenRandom.h"
+#include "../shared/LatencyHistogram.h"
 #include "../shared/OwnedHandle.h"
 #include "../shared/StringBuilder.h"
 #include "../shared/StringUtil.h"
+#include "../shared/TimeMeasurement.h"
 #include "../shared/WindowsSecurity.h"
 #include "../shared/WindowsVersion.h"
 #include "../shared/WinptyAssert.h"
@@ -187,6 +191,98 @@ winpty_config_set_agent_timeout(winpty_config_t *cfg, DWORD timeoutMs) {
     cfg->timeoutMs = timeoutMs;
 }
 
+WINPTY_API void
+winpty_config_set_poll_interval(winpty_config_t *cfg, int minMs, int maxMs) {
+    ASSERT(cfg != nullptr && minMs >= 1 && minMs <= maxMs);
+    cfg->minPollIntervalMs = minMs;
+    cfg->maxPollIntervalMs = maxMs;
+}
+
+WINPTY_API void
+winpty_config_set_history_limit(winpty_config_t *cfg, UINT64 limitBytes) {
+    ASSERT(cfg != nullptr);
+    cfg->historyLimitBytes = limitBytes;
+}
+
+WINPTY_API void
+winpty_config_set_max_frame_rate(winpty_config_t *cfg, int framesPerSecond) {
+    ASSERT(cfg != nullptr && framesPerSecond >= 0);
+    cfg->maxFrameRate = framesPerSecond;
+}
+
+WINPTY_API void
+winpty_config_set_agent_path(winpty_config_t *cfg, LPCWSTR path) {
+    ASSERT(cfg != nullptr);
+    cfg->agentPath = path != nullptr ? path : L"";
+}
+
+WINPTY_API void
+winpty_config_set_scrape_geometry(winpty_config_t *cfg, int bufferLines,
+                                  int syncMarkerMargin, int maxCols) {
+    ASSERT(cfg != nullptr &&
+        bufferLines <= 10000 &&
+        syncMarkerMargin >= 0 &&
+        bufferLines - syncMarkerMargin >= 100 &&
+        maxCols >= 1 && maxCols <= 2500);
+    cfg->bufferLineCount = bufferLines;
+    cfg->syncMarkerMargin = syncMarkerMargin;
+    cfg->maxConsoleWidth = maxCols;
+}
+
+WINPTY_API void
+winpty_config_set_pipe_buffers(winpty_config_t *cfg, int outputBytes,
+                               int inputBytes) {
+    ASSERT(cfg != nullptr &&
+        outputBytes >= 0 && outputBytes <= 1024 * 1024 &&
+        inputBytes >= 0 && inputBytes <= 1024 * 1024);
+    cfg->outPipeBufferSize = outputBytes;
+    cfg->inPipeBufferSize = inputBytes;
+}
+
+WINPTY_API void
+winpty_config_set_output_coalescing(winpty_config_t *cfg, int maxDelayUs,
+                                    int flushBytes) {
+    ASSERT(cfg != nullptr &&
+        maxDelayUs >= 0 && maxDelayUs <= 1000000 &&
+        flushBytes >= 1);
+    cfg->coalesceDelayUs = maxDelayUs;
+    cfg->coalesceBytes = flushBytes;
+}
+
+WINPTY_API void
+winpty_config_set_agent_scheduling(winpty_config_t *cfg, int schedulingClass,
+                                   UINT64 affinityMask) {
+    ASSERT(cfg != nullptr &&
+        schedulingClass >= WINPTY_SCHEDULING_DEFAULT &&
+        schedulingClass <= WINPTY_SCHEDULING_BATCH);
+    cfg->schedulingClass = schedulingClass;
+    cfg->affinityMask = affinityMask;
+}
+
+WINPTY_API void
+winpty_config_set_output_credits(winpty_config_t *cfg, UINT64 initialBytes,
+                                 UINT64 initialFrames) {
+    ASSERT(cfg != nullptr &&
+        initialBytes <= INT64_MAX && initialFrames <= INT64_MAX);
+    cfg->creditBytes = initialBytes;
+    cfg->creditFrames = initialFrames;
+}
+
+WINPTY_API void
+winpty_config_set_idle_trim(winpty_config_t *cfg, int idleMs) {
+    ASSERT(cfg != nullptr && idleMs >= 0);
+    cfg->idleTrimMs = idleMs;
+}
+
+WINPTY_API void
+winpty_config_set_recording(winpty_config_t *cfg, LPCWSTR path, int format) {
+    ASSERT(cfg != nullptr &&
+        format >= WINPTY_RECORDING_ASCIICAST &&
+        format <= WINPTY_RECORDING_BINARY);
+    cfg->recordingPath = path != nullptr ? path : L"";
+    cfg->recordingFormat = format;
+}
+
 
 
 /*****************************************************************************
@@ -229,29 +325,34 @@ public:
 
 } // anonymous namespace
 
+// Waits for an I/O event to be signaled, throwing an exception if the agent
+// dies or times out first.
+static void waitForIoEvent(winpty_t &wp, HANDLE event) {
+    const HANDLE waitHandles[2] = { event, wp.agentProcess.get() };
+    DWORD waitRet = WaitForMultipleObjects(
+        2, waitHandles, FALSE, wp.agentTimeoutMs);
+    if (waitRet != WAIT_OBJECT_0) {
+        if (waitRet == WAIT_OBJECT_0 + 1) {
+            throw LibWinptyException(WINPTY_ERROR_AGENT_DIED, L"agent died");
+        } else if (waitRet == WAIT_TIMEOUT) {
+            throw LibWinptyException(WINPTY_ERROR_AGENT_TIMEOUT,
+                                  L"agent timed out");
+        } else if (waitRet == WAIT_FAILED) {
+            throwWindowsError(L"WaitForMultipleObjects failed");
+        } else {
+            ASSERT(false &&
+                "unexpected WaitForMultipleObjects return value");
+        }
+    }
+}
+
 static void handlePendingIo(winpty_t &wp, OVERLAPPED &over, BOOL &success,
                             DWORD &lastError, DWORD &actual) {
     if (!success && lastError == ERROR_IO_PENDING) {
+        // If the wait fails, the PendingIo dtor cancels the I/O before the
+        // exception propagates.
         PendingIo io(wp.controlPipe.get(), over);
-        const HANDLE waitHandles[2] = { wp.ioEvent.get(),
-                                        wp.agentProcess.get() };
-        DWORD waitRet = WaitForMultipleObjects(
-            2, waitHandles, FALSE, wp.agentTimeoutMs);
-        if (waitRet != WAIT_OBJECT_0) {
-            // The I/O is still pending.  Cancel it, close the I/O event, and
-            // throw an exception.
-            if (waitRet == WAIT_OBJECT_0 + 1) {
-                throw LibWinptyException(WINPTY_ERROR_AGENT_DIED, L"agent died");
-            } else if (waitRet == WAIT_TIMEOUT) {
-                throw LibWinptyException(WINPTY_ERROR_AGENT_TIMEOUT,
-                                      L"agent timed out");
-            } else if (waitRet == WAIT_FAILED) {
-                throwWindowsError(L"WaitForMultipleObjects failed");
-            } else {
-                ASSERT(false &&
-                    "unexpected WaitForMultipleObjects return value");
-            }
-        }
+        waitForIoEvent(wp, wp.ioEvent.get());
         std::tie(success, lastError) = io.waitForCompletion(actual);
     }
 }
@@ -326,45 +427,95 @@ static void writePacket(winpty_t &wp, WriteBuffer &packet) {
     writeData(wp, buf.data(), buf.size());
 }
 
-static size_t readData(winpty_t &wp, void *data, size_t amount) {
-    DWORD actual = 0;
-    OVERLAPPED over = {};
-    over.hEvent = wp.ioEvent.get();
-    BOOL success = ReadFile(wp.controlPipe.get(), data, amount,
-                            &actual, &over);
-    DWORD lastError = GetLastError();
-    if (!success) {
-        handlePendingIo(wp, over, success, lastError, actual);
-        handleReadWriteErrors(wp, success, lastError, L"ReadFile failed");
+static inline WriteBuffer newRequestPacket(winpty_t &wp, AgentMsg::Type type,
+                                          int64_t &requestId) {
+    requestId = wp.nextRequestId++;
+    WriteBuffer packet = newPacket();
+    packet.putInt32(type);
+    packet.putInt64(requestId);
+    return packet;
+}
+
+const size_t kReadChunkSize = 4096;
+
+// Cancels an outstanding control pipe read.  The OVERLAPPED and the buffer
+// belong to the winpty_t, so this must happen before the pipe is closed or
+// the winpty_t is freed.
+static void cancelControlPipeRead(winpty_t &wp) WINPTY_NOEXCEPT {
+    if (wp.readPending) {
+        CancelIo(wp.controlPipe.get());
+        DWORD actual = 0;
+        GetOverlappedResult(wp.controlPipe.get(), &wp.readOver, &actual, TRUE);
+        wp.readPending = false;
     }
-    return actual;
 }
 
-static void readAll(winpty_t &wp, void *data, size_t amount) {
-    while (amount > 0) {
-        const size_t chunk = readData(wp, data, amount);
-        ASSERT(chunk <= amount && "readData result is larger than amount");
-        data = reinterpret_cast<char*>(data) + chunk;
-        amount -= chunk;
+// Makes progress on the control pipe read, issuing a new ReadFile if none is
+// outstanding.  If wait is true, blocks until the read completes, subject to
+// the agent timeout.  Returns true if the read completed and its data was
+// appended to the read queue.
+static bool pumpControlPipe(winpty_t &wp, bool wait) {
+    BOOL success = FALSE;
+    DWORD lastError = 0;
+    DWORD actual = 0;
+    if (!wp.readPending) {
+        wp.readChunk.resize(kReadChunkSize);
+        wp.readOver = OVERLAPPED();
+        wp.readOver.hEvent = wp.readEvent.get();
+        success = ReadFile(wp.controlPipe.get(), wp.readChunk.data(),
+                           wp.readChunk.size(), &actual, &wp.readOver);
+        lastError = GetLastError();
+        if (!success && lastError == ERROR_IO_PENDING) {
+            wp.readPending = true;
+        }
     }
+    if (wp.readPending) {
+        if (wait) {
+            waitForIoEvent(wp, wp.readEvent.get());
+        }
+        success = GetOverlappedResult(wp.controlPipe.get(), &wp.readOver,
+                                      &actual, FALSE);
+        lastError = GetLastError();
+        if (!success && lastError == ERROR_IO_INCOMPLETE) {
+            return false;
+        }
+        wp.readPending = false;
+    }
+    handleReadWriteErrors(wp, success, lastError, L"ReadFile failed");
+    ASSERT(actual <= wp.readChunk.size() &&
+        "ReadFile result is larger than the buffer");
+    wp.readQueue.insert(wp.readQueue.end(),
+                        wp.readChunk.begin(), wp.readChunk.begin() + actual);
+    return true;
 }
 
-static uint64_t readUInt64(winpty_t &wp) {
-    uint64_t ret = 0;
-    readAll(wp, &ret, sizeof(ret));
-    return ret;
+// If the read queue holds a complete packet, removes it and stores its
+// payload.
+static bool takeQueuedPacket(winpty_t &wp, std::vector<char> &payload) {
+    uint64_t packetSize = 0;
+    if (wp.readQueue.size() < sizeof(packetSize)) {
+        return false;
+    }
+    memcpy(&packetSize, wp.readQueue.data(), sizeof(packetSize));
+    if (packetSize < sizeof(packetSize) || packetSize > SIZE_MAX) {
+        throwWinptyException(L"Agent RPC error: invalid packet size");
+    }
+    if (wp.readQueue.size() < packetSize) {
+        return false;
+    }
+    const auto begin = wp.readQueue.begin();
+    payload.assign(begin + sizeof(packetSize), begin + packetSize);
+    wp.readQueue.erase(begin, begin + packetSize);
+    return true;
 }
 
 // Returns a reply packet's payload.
 static ReadBuffer readPacket(winpty_t &wp) {
-    const uint64_t packetSize = readUInt64(wp);
-    if (packetSize < sizeof(packetSize) || packetSize > SIZE_MAX) {
-        throwWinptyException(L"Agent RPC error: invalid packet size");
+    std::vector<char> payload;
+    while (!takeQueuedPacket(wp, payload)) {
+        pumpControlPipe(wp, true);
     }
-    const size_t payloadSize = packetSize - sizeof(packetSize);
-    std::vector<char> bytes(payloadSize);
-    readAll(wp, bytes.data(), bytes.size());
-    return ReadBuffer(std::move(bytes));
+    return ReadBuffer(std::move(payload));
 }
 
 static OwnedHandle createControlPipe(const std::wstring &name) {
@@ -470,12 +621,14 @@ static bool shouldSpecifyHideFlag() {
 }
 
 static OwnedHandle startAgentProcess(
+        const winpty_config_t *cfg,
         const std::wstring &desktop,
         const std::wstring &controlPipeName,
         const std::wstring &params,
         DWORD creationFlags,
         DWORD &agentPid) {
-    const std::wstring exePath = findAgentProgram();
+    const std::wstring exePath =
+        cfg->agentPath.empty() ? findAgentProgram() : cfg->agentPath;
     const std::wstring cmdline =
         (WStringBuilder(256)
             << L"\"" << exePath << L"\" "
@@ -494,6 +647,15 @@ static OwnedHandle startAgentProcess(
         sui.dwFlags |= STARTF_USESHOWWINDOW;
         sui.wShowWindow = SW_HIDE;
     }
+    // Start the agent at its scheduling class's priority, so its own startup
+    // already runs that way.  The agent enters background mode and sets its
+    // affinity itself, because background mode applies only to the calling
+    // process.
+    if (cfg->schedulingClass == WINPTY_SCHEDULING_INTERACTIVE) {
+        creationFlags |= ABOVE_NORMAL_PRIORITY_CLASS;
+    } else if (cfg->schedulingClass == WINPTY_SCHEDULING_BATCH) {
+        creationFlags |= BELOW_NORMAL_PRIORITY_CLASS;
+    }
     PROCESS_INFORMATION pi = {};
     const BOOL success =
         CreateProcessW(exePath.c_str(),
@@ -540,37 +702,59 @@ static void verifyPipeClientPid(HANDLE serverPipe, DWORD agentPid) {
     }
 }
 
+// Creates a session's control pipe and starts its agent.  The agent connects
+// to the pipe on its own; the caller must still wait for the connection.
 static std::unique_ptr<winpty_t>
-createAgentSession(const winpty_config_t *cfg,
-                   const std::wstring &desktop,
-                   const std::wstring &params,
-                   DWORD creationFlags) {
+startAgentSession(const winpty_config_t *cfg,
+                  const std::wstring &desktop,
+                  const std::wstring &params,
+                  DWORD creationFlags,
+                  DWORD &agentPid) {
     std::unique_ptr<winpty_t> wp(new winpty_t);
     wp->agentTimeoutMs = cfg->timeoutMs;
     wp->ioEvent = createEvent();
+    wp->readEvent = createEvent();
 
     // Create control server pipe.
     const auto pipeName =
-        L"\\\\.\\pipe\\winpty-control-" + GenRandom().uniqueName();
+        L"\\\\.\\pipe\\winpty-control-" + GenRandom::sharedUniqueName();
     wp->controlPipe = createControlPipe(pipeName);
 
-    DWORD agentPid = 0;
+    TimeMeasurement timer;
     wp->agentProcess = startAgentProcess(
-        desktop, pipeName, params, creationFlags, agentPid);
+        cfg, desktop, pipeName, params, creationFlags, agentPid);
+    wp->startupTimesUs[WINPTY_STARTUP_CREATE_PROCESS] = timer.elapsedUs();
+    return wp;
+}
+
+static std::unique_ptr<winpty_t>
+createAgentSession(const winpty_config_t *cfg,
+                   const std::wstring &desktop,
+                   const std::wstring &params,
+                   DWORD creationFlags) {
+    DWORD agentPid = 0;
+    auto wp = startAgentSession(cfg, desktop, params, creationFlags, agentPid);
+    TimeMeasurement timer;
     connectControlPipe(*wp.get());
+    wp->startupTimesUs[WINPTY_STARTUP_CONNECT_PIPE] = timer.lapUs();
     verifyPipeClientPid(wp->controlPipe.get(), agentPid);
+    wp->startupTimesUs[WINPTY_STARTUP_VERIFY_PID] = timer.lapUs();
 
     return std::move(wp);
 }
 
-namespace {
-
 class AgentDesktop {
 public:
     virtual std::wstring name() = 0;
+    // Whether a new agent can still be placed on the desktop.
+    virtual bool alive() { return true; }
+    // Called once the first agent has connected from the desktop.
+    virtual void agentStarted() {}
     virtual ~AgentDesktop() {}
 };
 
+namespace {
+
 class AgentDesktopDirect : public AgentDesktop {
 public:
     AgentDesktopDirect(BackgroundDesktop &&desktop) :
@@ -578,6 +762,12 @@ public:
     {
     }
     std::wstring name() override { return m_desktop.desktopName(); }
+    void agentStarted() override {
+        // Our handles keep the desktop alive, so put this process back on
+        // its own window station now rather than when the desktop is
+        // released.
+        m_desktop.restoreOriginalStation();
+    }
 private:
     BackgroundDesktop m_desktop;
 };
@@ -591,23 +781,36 @@ public:
     {
     }
     std::wstring name() override { return m_desktopName; }
+    bool alive() override {
+        // The desktop agent's connection keeps the desktop open.
+        return WaitForSingleObject(m_wp->agentProcess.get(), 0) ==
+            WAIT_TIMEOUT;
+    }
 private:
     std::unique_ptr<winpty_t> m_wp;
     std::wstring m_desktopName;
 };
 
-} // anonymous namespace
+// Sessions share one background desktop per creation mode, rather than
+// each creating a window station and desktop.  Creating them is slow, and
+// every desktop draws on the session's desktop heap.  Each winpty_t holds a
+// reference, so the desktop is destroyed with the last session using it.
+// The console windows also consume the desktop's own heap, so cap the
+// number of sessions that share one desktop.
+const long kMaxSessionsPerDesktop = 64;
+
+struct DesktopCache {
+    Mutex mutex;
+    std::weak_ptr<AgentDesktop> direct;
+    std::weak_ptr<AgentDesktop> indirect;
+};
 
-std::unique_ptr<AgentDesktop>
-setupBackgroundDesktop(const winpty_config_t *cfg) {
-    bool useDesktopAgent =
-        !(cfg->flags & WINPTY_FLAG_ALLOW_CURPROC_DESKTOP_CREATION);
-    const bool useDesktop = shouldCreateBackgroundDesktop(useDesktopAgent);
+DesktopCache g_desktopCache;
 
-    if (!useDesktop) {
-        return std::unique_ptr<AgentDesktop>();
-    }
+} // anonymous namespace
 
+static std::shared_ptr<AgentDesktop>
+createBackgroundDesktop(const winpty_config_t *cfg, bool useDesktopAgent) {
     if (useDesktopAgent) {
         auto wp = createAgentSession(
             cfg, std::wstring(), L"--create-desktop", DETACHED_PROCESS);
@@ -618,24 +821,241 @@ setupBackgroundDesktop(const winpty_config_t *cfg) {
         packet.assertEof();
 
         if (desktopName.empty()) {
-            return std::unique_ptr<AgentDesktop>();
+            return std::shared_ptr<AgentDesktop>();
         } else {
-            return std::unique_ptr<AgentDesktop>(
+            return std::shared_ptr<AgentDesktop>(
                 new AgentDesktopIndirect(std::move(wp),
                                          std::move(desktopName)));
         }
     } else {
         try {
             BackgroundDesktop desktop;
-            return std::unique_ptr<AgentDesktop>(new AgentDesktopDirect(
+            return std::shared_ptr<AgentDesktop>(new AgentDesktopDirect(
                 std::move(desktop)));
         } catch (const WinptyException &e) {
             trace("Error: failed to create background desktop, "
                   "using original desktop instead: %s",
                   utf8FromWide(e.what()).c_str());
-            return std::unique_ptr<AgentDesktop>();
+            return std::shared_ptr<AgentDesktop>();
+        }
+    }
+}
+
+// Whether another session may use the desktop.  The caller's own reference
+// is included in the count.
+static bool desktopHasRoom(const std::shared_ptr<AgentDesktop> &desktop) {
+    return desktop && desktop->alive() &&
+        desktop.use_count() <= kMaxSessionsPerDesktop;
+}
+
+static std::shared_ptr<AgentDesktop>
+setupBackgroundDesktop(const winpty_config_t *cfg) {
+    bool useDesktopAgent =
+        !(cfg->flags & WINPTY_FLAG_ALLOW_CURPROC_DESKTOP_CREATION);
+    const bool useDesktop = shouldCreateBackgroundDesktop(useDesktopAgent);
+
+    if (!useDesktop) {
+        return std::shared_ptr<AgentDesktop>();
+    }
+
+    LockGuard<Mutex> lock(g_desktopCache.mutex);
+    auto &slot = useDesktopAgent
+        ? g_desktopCache.indirect
+        : g_desktopCache.direct;
+    auto cached = slot.lock();
+    if (desktopHasRoom(cached)) {
+        trace("Reusing background desktop: %s",
+              utf8FromWide(cached->name()).c_str());
+        return cached;
+    }
+    auto ret = createBackgroundDesktop(cfg, useDesktopAgent);
+    slot = ret;
+    return ret;
+}
+
+// A BackgroundDesktop created in this process switches the whole process's
+// window station until the agent has connected, so such opens must not
+// overlap (e.g. a pool's refill thread racing a winpty_open call).
+static Mutex g_curprocDesktopMutex;
+
+static std::unique_ptr<LockGuard<Mutex>>
+lockCurprocDesktop(const winpty_config_t *cfg) {
+    std::unique_ptr<LockGuard<Mutex>> ret;
+    if ((cfg->flags & WINPTY_FLAG_ALLOW_CURPROC_DESKTOP_CREATION) ||
+            hasDebugFlag("force_desktop_curproc")) {
+        ret.reset(new LockGuard<Mutex>(g_curprocDesktopMutex));
+    }
+    return ret;
+}
+
+// The flags the agent is started with.  Only ask for a pseudoconsole where
+// the agent can create one.
+static uint64_t agentFlagsForConfig(const winpty_config_t *cfg) {
+    uint64_t agentFlags = cfg->flags;
+    if ((agentFlags & WINPTY_FLAG_CONPTY) &&
+            ((agentFlags & WINPTY_FLAG_CONERR) || !hasPseudoConsole())) {
+        agentFlags &= ~WINPTY_FLAG_CONPTY;
+    }
+    return agentFlags;
+}
+
+// The agent's command-line arguments, after the control pipe name.
+static std::wstring agentParams(const winpty_config_t *cfg) {
+    const uint64_t agentFlags = agentFlagsForConfig(cfg);
+    if (agentFlags != cfg->flags) {
+        trace("Pseudoconsole unavailable -- scraping the console instead");
+    }
+    return (WStringBuilder(128)
+            << agentFlags << L' '
+            << cfg->mouseMode << L' '
+            << cfg->cols << L' '
+            << cfg->rows << L' '
+            << cfg->minPollIntervalMs << L' '
+            << cfg->maxPollIntervalMs << L' '
+            << cfg->historyLimitBytes << L' '
+            << cfg->maxFrameRate << L' '
+            << cfg->bufferLineCount << L' '
+            << cfg->syncMarkerMargin << L' '
+            << cfg->maxConsoleWidth << L' '
+            << cfg->outPipeBufferSize << L' '
+            << cfg->inPipeBufferSize << L' '
+            << cfg->coalesceDelayUs << L' '
+            << cfg->coalesceBytes << L' '
+            << cfg->schedulingClass << L' '
+            << cfg->affinityMask << L' '
+            << cfg->creditBytes << L' '
+            << cfg->creditFrames << L' '
+            << cfg->idleTrimMs).str_moved();
+}
+
+// Finishes opening a session whose agent has connected: reads the agent's
+// setup packet.  totalTimer started when the open began.
+static void finishAgentOpen(const winpty_config_t *cfg, winpty_t &wp,
+                            TimeMeasurement &totalTimer) {
+    // If we ran the agent process on a background desktop, then when we
+    // spawn a child process from the agent, it will need to be explicitly
+    // placed back onto the original desktop.
+    if (wp.desktop) {
+        wp.spawnDesktopName = getCurrentDesktopName();
+    }
+
+    // Get the CONIN/CONOUT pipe names and the agent's startup timings.
+    TimeMeasurement setupTimer;
+    auto packet = readPacket(wp);
+    wp.startupTimesUs[WINPTY_STARTUP_AGENT_SETUP] = setupTimer.elapsedUs();
+    wp.coninPipeName = packet.getWString();
+    wp.conoutPipeName = packet.getWString();
+    if (cfg->flags & WINPTY_FLAG_CONERR) {
+        wp.conerrPipeName = packet.getWString();
+    }
+    const int32_t phaseCount = packet.getInt32();
+    for (int32_t i = 0; i < phaseCount; ++i) {
+        const int64_t us = packet.getInt64();
+        if (i >= WINPTY_STARTUP_AGENT_OPEN_CONSOLE &&
+                i < WINPTY_STARTUP_PHASE_COUNT) {
+            wp.startupTimesUs[i] = us;
+        }
+    }
+    wp.outputCompressed = packet.getInt32() != 0;
+    wp.agentFlags = agentFlagsForConfig(cfg);
+    packet.assertEof();
+    wp.startupTimesUs[WINPTY_STARTUP_TOTAL] = totalTimer.elapsedUs();
+
+    trace("winpty_open startup (us): desktop=%lld process=%lld "
+          "connect=%lld verify=%lld agent=%lld total=%lld",
+          static_cast<long long>(wp.startupTimesUs[WINPTY_STARTUP_DESKTOP]),
+          static_cast<long long>(
+              wp.startupTimesUs[WINPTY_STARTUP_CREATE_PROCESS]),
+          static_cast<long long>(
+              wp.startupTimesUs[WINPTY_STARTUP_CONNECT_PIPE]),
+          static_cast<long long>(
+              wp.startupTimesUs[WINPTY_STARTUP_VERIFY_PID]),
+          static_cast<long long>(
+              wp.startupTimesUs[WINPTY_STARTUP_AGENT_SETUP]),
+          static_cast<long long>(wp.startupTimesUs[WINPTY_STARTUP_TOTAL]));
+}
+
+namespace {
+
+// The spawn of a winpty_open_and_spawn call.  openAgent sends it before
+// reading the setup packet and records its requestId.
+struct EarlySpawn {
+    const winpty_spawn_config_t *cfg = nullptr;
+    bool wantProcess = false;
+    bool wantThread = false;
+    int64_t requestId = 0;
+};
+
+} // anonymous namespace
+
+static WriteBuffer newSpawnPacket(winpty_t &wp,
+                                  const winpty_spawn_config_t &cfg,
+                                  bool wantProcess, bool wantThread,
+                                  int64_t &requestId);
+static void finishStartRecording(winpty_t &wp, int64_t requestId);
+
+static std::unique_ptr<winpty_t> openAgent(const winpty_config_t *cfg,
+                                           EarlySpawn *spawn = nullptr) {
+    dumpWindowsVersion();
+    dumpVersionToTrace();
+
+    const auto curprocDesktopLock = lockCurprocDesktop(cfg);
+
+    TimeMeasurement totalTimer;
+
+    // Setup a background desktop for the agent.
+    auto desktop = setupBackgroundDesktop(cfg);
+    const auto desktopName = desktop ? desktop->name() : std::wstring();
+    const int64_t desktopUs = totalTimer.elapsedUs();
+
+    // Start the primary agent session.
+    auto wp = createAgentSession(cfg, desktopName, agentParams(cfg),
+                                 CREATE_NEW_CONSOLE);
+    wp->startupTimesUs[WINPTY_STARTUP_DESKTOP] = desktopUs;
+
+    // Restore the original window station.  This must wait until we know
+    // the agent is running -- if we close these handles too soon, then the
+    // desktop and windowstation will be destroyed before the agent can
+    // connect with them.
+    //
+    // The session keeps a reference to the cached desktop (and to the
+    // separate desktop-creating agent, if one was used), so later sessions
+    // can reuse it.
+    if (desktop) {
+        desktop->agentStarted();
+    }
+    wp->desktop = std::move(desktop);
+
+    // Like the spawn below, the recording request is queued behind the setup
+    // packet.  It goes first so the recording includes the child's first
+    // output.
+    int64_t recordingRequestId = -1;
+    if (!cfg->recordingPath.empty()) {
+        auto packet = newRequestPacket(*wp, AgentMsg::StartRecording,
+                                       recordingRequestId);
+        packet.putWString(cfg->recordingPath);
+        packet.putInt32(cfg->recordingFormat);
+        writePacket(*wp, packet);
+    }
+
+    if (spawn != nullptr) {
+        // Queue the spawn behind the setup packet.  The agent reads it as
+        // soon as it has sent the packet, so its CreateProcess overlaps the
+        // rest of the open, and there's no separate round trip.
+        if (wp->desktop) {
+            wp->spawnDesktopName = getCurrentDesktopName();
         }
+        auto packet = newSpawnPacket(*wp, *spawn->cfg, spawn->wantProcess,
+                                     spawn->wantThread, spawn->requestId);
+        writePacket(*wp, packet);
+    }
+
+    finishAgentOpen(cfg, *wp.get(), totalTimer);
+
+    if (recordingRequestId != -1) {
+        finishStartRecording(*wp, recordingRequestId);
     }
+    return wp;
 }
 
 WINPTY_API winpty_t *
@@ -643,51 +1063,184 @@ winpty_open(const winpty_config_t *cfg,
             winpty_error_ptr_t *err /*OPTIONAL*/) {
     API_TRY {
         ASSERT(cfg != nullptr);
-        dumpWindowsVersion();
-        dumpVersionToTrace();
-
-        // Setup a background desktop for the agent.
-        auto desktop = setupBackgroundDesktop(cfg);
-        const auto desktopName = desktop ? desktop->name() : std::wstring();
-
-        // Start the primary agent session.
-        const auto params =
-            (WStringBuilder(128)
-                << cfg->flags << L' '
-                << cfg->mouseMode << L' '
-                << cfg->cols << L' '
-                << cfg->rows).str_moved();
-        auto wp = createAgentSession(cfg, desktopName, params,
-                                     CREATE_NEW_CONSOLE);
-
-        // Close handles to the background desktop and restore the original
-        // window station.  This must wait until we know the agent is running
-        // -- if we close these handles too soon, then the desktop and
-        // windowstation will be destroyed before the agent can connect with
-        // them.
-        //
-        // If we used a separate agent process to create the desktop, we
-        // disconnect from that process here, allowing it to exit.
-        desktop.reset();
-
-        // If we ran the agent process on a background desktop, then when we
-        // spawn a child process from the agent, it will need to be explicitly
-        // placed back onto the original desktop.
-        if (!desktopName.empty()) {
-            wp->spawnDesktopName = getCurrentDesktopName();
+        return openAgent(cfg).release();
+    } API_CATCH(nullptr)
+}
+
+namespace {
+
+// A session of a winpty_open_many call, between starting its agent and
+// reading its setup packet.
+struct StartingSession {
+    std::unique_ptr<winpty_t> wp;
+    DWORD agentPid = 0;
+    OVERLAPPED over = {};
+    std::unique_ptr<PendingIo> connect;
+};
+
+} // anonymous namespace
+
+// Issues an overlapped ConnectNamedPipe on the session's control pipe.
+// Returns true if the agent has already connected.
+static bool beginControlPipeConnect(StartingSession &session) {
+    winpty_t &wp = *session.wp.get();
+    session.over = OVERLAPPED();
+    session.over.hEvent = wp.ioEvent.get();
+    const BOOL success = ConnectNamedPipe(wp.controlPipe.get(), &session.over);
+    const DWORD lastError = GetLastError();
+    if (!success && lastError == ERROR_IO_PENDING) {
+        session.connect.reset(
+            new PendingIo(wp.controlPipe.get(), session.over));
+        return false;
+    }
+    if (!success && lastError != ERROR_PIPE_CONNECTED) {
+        throwWindowsError(L"ConnectNamedPipe failed", lastError);
+    }
+    return true;
+}
+
+// Waits until every session's agent has connected to its control pipe,
+// waiting on the pending connects together rather than one at a time.  The
+// deadline is shared, so the whole batch gets the agent timeout once.
+static void connectControlPipes(std::vector<StartingSession> &sessions,
+                                DWORD timeoutMs) {
+    TimeMeasurement timer;
+    const DWORD startTick = GetTickCount();
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        if (beginControlPipeConnect(sessions[i])) {
+            sessions[i].wp->startupTimesUs[WINPTY_STARTUP_CONNECT_PIPE] =
+                timer.elapsedUs();
+        } else {
+            pending.push_back(i);
         }
+    }
 
-        // Get the CONIN/CONOUT pipe names.
-        auto packet = readPacket(*wp.get());
-        wp->coninPipeName = packet.getWString();
-        wp->conoutPipeName = packet.getWString();
-        if (cfg->flags & WINPTY_FLAG_CONERR) {
-            wp->conerrPipeName = packet.getWString();
+    // Each pending session contributes its I/O event and its agent process,
+    // so a dead agent fails the batch instead of waiting for the timeout.
+    const size_t kSessionsPerWait = MAXIMUM_WAIT_OBJECTS / 2;
+    std::vector<HANDLE> handles;
+    while (!pending.empty()) {
+        const size_t count = std::min(pending.size(), kSessionsPerWait);
+        handles.clear();
+        for (size_t i = 0; i < count; ++i) {
+            winpty_t &wp = *sessions[pending[i]].wp.get();
+            handles.push_back(wp.ioEvent.get());
+            handles.push_back(wp.agentProcess.get());
         }
-        packet.assertEof();
+        DWORD waitMs = INFINITE;
+        if (timeoutMs != INFINITE) {
+            const DWORD elapsedMs = GetTickCount() - startTick;
+            waitMs = elapsedMs < timeoutMs ? timeoutMs - elapsedMs : 0;
+        }
+        const DWORD waitRet = WaitForMultipleObjects(
+            handles.size(), handles.data(), FALSE, waitMs);
+        if (waitRet == WAIT_TIMEOUT) {
+            throw LibWinptyException(WINPTY_ERROR_AGENT_TIMEOUT,
+                                     L"agent timed out");
+        } else if (waitRet == WAIT_FAILED) {
+            throwWindowsError(L"WaitForMultipleObjects failed");
+        }
+        const size_t index = waitRet - WAIT_OBJECT_0;
+        ASSERT(index < handles.size() &&
+            "unexpected WaitForMultipleObjects return value");
+        if (index % 2 == 1) {
+            throw LibWinptyException(WINPTY_ERROR_AGENT_DIED, L"agent died");
+        }
+        StartingSession &session = sessions[pending[index / 2]];
+        BOOL success = FALSE;
+        DWORD lastError = 0;
+        std::tie(success, lastError) = session.connect->waitForCompletion();
+        session.connect.reset();
+        if (!success && lastError != ERROR_PIPE_CONNECTED) {
+            throwWindowsError(L"ConnectNamedPipe failed", lastError);
+        }
+        session.wp->startupTimesUs[WINPTY_STARTUP_CONNECT_PIPE] =
+            timer.elapsedUs();
+        pending.erase(pending.begin() + index / 2);
+    }
+}
 
-        return wp.release();
-    } API_CATCH(nullptr)
+// Connects a batch of started agents, then reads their setup packets.  The
+// agents initialize concurrently, so the packets arrive at about the same
+// time.
+static void finishStartingSessions(const winpty_config_t *cfg,
+                                   std::vector<StartingSession> &sessions,
+                                   std::vector<std::unique_ptr<winpty_t>> &out,
+                                   TimeMeasurement &totalTimer) {
+    connectControlPipes(sessions, cfg->timeoutMs);
+    for (auto &session : sessions) {
+        TimeMeasurement timer;
+        verifyPipeClientPid(session.wp->controlPipe.get(), session.agentPid);
+        session.wp->startupTimesUs[WINPTY_STARTUP_VERIFY_PID] =
+            timer.elapsedUs();
+    }
+    // The batch shares one desktop; see openAgent.
+    if (sessions[0].wp->desktop) {
+        sessions[0].wp->desktop->agentStarted();
+    }
+    for (auto &session : sessions) {
+        finishAgentOpen(cfg, *session.wp.get(), totalTimer);
+        out.push_back(std::move(session.wp));
+    }
+    sessions.clear();
+}
+
+static std::vector<std::unique_ptr<winpty_t>>
+openAgents(const winpty_config_t *cfg, int count) {
+    dumpWindowsVersion();
+    dumpVersionToTrace();
+
+    const auto curprocDesktopLock = lockCurprocDesktop(cfg);
+
+    TimeMeasurement totalTimer;
+    const auto params = agentParams(cfg);
+    std::vector<std::unique_ptr<winpty_t>> ret;
+    std::vector<StartingSession> batch;
+    std::shared_ptr<AgentDesktop> batchDesktop;
+
+    // Start the agents without waiting for them, in batches that share a
+    // desktop.  A full desktop ends the batch, because creating the next
+    // desktop may switch this process's window station, which must wait
+    // until the batch's agents have connected.
+    for (int i = 0; i < count; ++i) {
+        if (!batch.empty() && batchDesktop && !desktopHasRoom(batchDesktop)) {
+            finishStartingSessions(cfg, batch, ret, totalTimer);
+        }
+        TimeMeasurement desktopTimer;
+        if (batch.empty()) {
+            batchDesktop = setupBackgroundDesktop(cfg);
+        }
+        const int64_t desktopUs = desktopTimer.elapsedUs();
+        const auto desktopName =
+            batchDesktop ? batchDesktop->name() : std::wstring();
+        batch.emplace_back();
+        StartingSession &session = batch.back();
+        session.wp = startAgentSession(cfg, desktopName, params,
+                                       CREATE_NEW_CONSOLE, session.agentPid);
+        session.wp->startupTimesUs[WINPTY_STARTUP_DESKTOP] = desktopUs;
+        session.wp->desktop = batchDesktop;
+    }
+    if (!batch.empty()) {
+        finishStartingSessions(cfg, batch, ret, totalTimer);
+    }
+    trace("winpty_open_many: opened %d sessions in %lld us", count,
+          static_cast<long long>(totalTimer.elapsedUs()));
+    return ret;
+}
+
+WINPTY_API BOOL
+winpty_open_many(const winpty_config_t *cfg, int count, winpty_t **out,
+                 winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(cfg != nullptr && count > 0 && out != nullptr);
+        auto sessions = openAgents(cfg, count);
+        ASSERT(sessions.size() == static_cast<size_t>(count));
+        for (int i = 0; i < count; ++i) {
+            out[i] = sessions[i].release();
+        }
+        return TRUE;
+    } API_CATCH(FALSE)
 }
 
 WINPTY_API HANDLE winpty_agent_process(winpty_t *wp) {
@@ -695,6 +1248,148 @@ WINPTY_API HANDLE winpty_agent_process(winpty_t *wp) {
     return wp->agentProcess.get();
 }
 
+WINPTY_API int
+winpty_get_startup_stats(winpty_t *wp, UINT64 *phaseTimes, int phaseCount,
+                         winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        ASSERT(phaseCount >= 0);
+        ASSERT(phaseTimes != nullptr || phaseCount == 0);
+        const int count = std::min(phaseCount, WINPTY_STARTUP_PHASE_COUNT);
+        for (int i = 0; i < count; ++i) {
+            phaseTimes[i] = static_cast<UINT64>(
+                std::max<int64_t>(wp->startupTimesUs[i], 0));
+        }
+        return WINPTY_STARTUP_PHASE_COUNT;
+    } API_CATCH(0)
+}
+
+WINPTY_API int
+winpty_get_spawn_stats(winpty_t *wp, UINT64 *phaseTimes, int phaseCount,
+                       winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        ASSERT(phaseCount >= 0);
+        ASSERT(phaseTimes != nullptr || phaseCount == 0);
+        LockGuard<Mutex> lock(wp->mutex);
+        const int count = std::min(phaseCount, WINPTY_SPAWN_PHASE_COUNT);
+        for (int i = 0; i < count; ++i) {
+            phaseTimes[i] = static_cast<UINT64>(
+                std::max<int64_t>(wp->spawnTimesUs[i], 0));
+        }
+        return WINPTY_SPAWN_PHASE_COUNT;
+    } API_CATCH(0)
+}
+
+
+
+/*****************************************************************************
+ * Pool of pre-started agents. */
+
+// How long the refill thread waits before retrying after a failed start.
+const DWORD kPoolRetryDelayMs = 1000;
+
+static DWORD WINAPI poolThreadProc(LPVOID param) {
+    winpty_pool_t &pool = *static_cast<winpty_pool_t*>(param);
+    DWORD waitMs = INFINITE;
+    while (true) {
+        bool needAgent = false;
+        {
+            LockGuard<Mutex> lock(pool.mutex);
+            if (pool.shutdown) {
+                break;
+            }
+            needAgent = waitMs == INFINITE && pool.idle.size() < pool.size;
+            if (!needAgent) {
+                // Reset under the lock.  winpty_open_from_pool and
+                // winpty_pool_free signal the event after they change the
+                // pool, so their signal can't be lost.
+                ResetEvent(pool.wakeEvent.get());
+            }
+        }
+        if (!needAgent) {
+            WaitForSingleObject(pool.wakeEvent.get(), waitMs);
+            waitMs = INFINITE;
+            continue;
+        }
+        try {
+            auto wp = openAgent(&pool.cfg);
+            LockGuard<Mutex> lock(pool.mutex);
+            pool.idle.push_back(std::move(wp));
+        } catch (...) {
+            winpty_error_ptr_t *err = nullptr;
+            translateException(err);
+            trace("winpty pool: agent start failed, retrying in %u ms",
+                  static_cast<unsigned int>(kPoolRetryDelayMs));
+            waitMs = kPoolRetryDelayMs;
+        }
+    }
+    return 0;
+}
+
+WINPTY_API winpty_pool_t *
+winpty_pool_new(const winpty_config_t *cfg, int size,
+                winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(cfg != nullptr && size > 0);
+        std::unique_ptr<winpty_pool_t> pool(new winpty_pool_t);
+        pool->cfg = *cfg;
+        // Pooled sessions aren't recorded; see winpty_config_set_recording.
+        pool->cfg.recordingPath.clear();
+        pool->size = size;
+        pool->wakeEvent = createEvent();
+        HANDLE thread = CreateThread(nullptr, 0, poolThreadProc,
+                                     pool.get(), 0, nullptr);
+        if (thread == nullptr) {
+            throwWindowsError(L"CreateThread failed");
+        }
+        pool->thread = OwnedHandle(thread);
+        return pool.release();
+    } API_CATCH(nullptr)
+}
+
+WINPTY_API winpty_t *
+winpty_open_from_pool(winpty_pool_t *pool,
+                      winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(pool != nullptr);
+        std::unique_ptr<winpty_t> wp;
+        {
+            LockGuard<Mutex> lock(pool->mutex);
+            while (!pool->idle.empty() && wp == nullptr) {
+                wp = std::move(pool->idle.front());
+                pool->idle.pop_front();
+                // Skip agents that died while they were idle.
+                if (WaitForSingleObject(wp->agentProcess.get(), 0) !=
+                        WAIT_TIMEOUT) {
+                    trace("winpty pool: discarding a dead idle agent");
+                    wp.reset();
+                }
+            }
+        }
+        SetEvent(pool->wakeEvent.get());
+        if (wp == nullptr) {
+            // The pool is empty, so start an agent here rather than wait
+            // for the refill thread.
+            wp = openAgent(&pool->cfg);
+        }
+        return wp.release();
+    } API_CATCH(nullptr)
+}
+
+WINPTY_API void winpty_pool_free(winpty_pool_t *pool) {
+    if (pool == nullptr) {
+        return;
+    }
+    {
+        LockGuard<Mutex> lock(pool->mutex);
+        pool->shutdown = true;
+    }
+    SetEvent(pool->wakeEvent.get());
+    WaitForSingleObject(pool->thread.get(), INFINITE);
+    delete pool;
+}
+
 
 
 /*****************************************************************************
@@ -727,15 +1422,398 @@ WINPTY_API LPCWSTR winpty_conerr_name(winpty_t *wp) {
     }
 }
 
+static bool conoutIsShm(const winpty_t &wp) {
+    const std::wstring prefix = SharedMemoryRing::namePrefix();
+    return wp.conoutPipeName.compare(0, prefix.size(), prefix) == 0;
+}
 
+// Call with the session's mutex held.
+static winpty_shm_t *attachConoutShm(winpty_t &wp) {
+    if (!wp.conoutShm) {
+        if (!conoutIsShm(wp)) {
+            throwWinptyException(L"CONOUT is not a shared memory ring");
+        }
+        auto ring = SharedMemoryRing::open(wp.conoutPipeName);
+        if (!ring) {
+            throwWindowsError(L"Opening the CONOUT ring failed");
+        }
+        ring->attach();
+        std::unique_ptr<winpty_shm_t> shm(new winpty_shm_t);
+        shm->ring = std::move(ring);
+        wp.conoutShm = std::move(shm);
+    }
+    return wp.conoutShm.get();
+}
+
+WINPTY_API winpty_shm_t *
+winpty_conout_shm(winpty_t *wp, winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        LockGuard<Mutex> lock(wp->mutex);
+        return attachConoutShm(*wp);
+    } API_CATCH(nullptr)
+}
+
+WINPTY_API size_t winpty_shm_peek(winpty_shm_t *shm, const char **data) {
+    ASSERT(shm != nullptr && data != nullptr);
+    return shm->ring->peek(data);
+}
+
+WINPTY_API void winpty_shm_consume(winpty_shm_t *shm, size_t size) {
+    ASSERT(shm != nullptr);
+    shm->ring->consume(size);
+}
+
+WINPTY_API BOOL winpty_shm_wait(winpty_shm_t *shm, DWORD timeoutMs) {
+    ASSERT(shm != nullptr);
+    if (!shm->ring->armDataWait()) {
+        return TRUE;
+    }
+    return WaitForSingleObject(shm->ring->dataEvent(), timeoutMs) ==
+        WAIT_OBJECT_0;
+}
+
+WINPTY_API BOOL winpty_shm_eof(winpty_shm_t *shm) {
+    ASSERT(shm != nullptr);
+    return shm->ring->isEof();
+}
+
+WINPTY_API BOOL winpty_output_compressed(winpty_t *wp) {
+    ASSERT(wp != nullptr);
+    return wp->outputCompressed;
+}
+
+WINPTY_API winpty_decoder_t *
+winpty_decoder_new(winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        return new winpty_decoder_t;
+    } API_CATCH(nullptr)
+}
+
+WINPTY_API BOOL
+winpty_decoder_feed(winpty_decoder_t *dec, const void *data, size_t size,
+                    const char **output, size_t *outputSize,
+                    winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(dec != nullptr);
+        ASSERT(data != nullptr || size == 0);
+        ASSERT(output != nullptr && outputSize != nullptr);
+        dec->output.clear();
+        if (!dec->decompressor.decompress(
+                static_cast<const char*>(data), size, dec->output)) {
+            throwWinptyException(L"corrupt compressed output stream");
+        }
+        *output = dec->output.data();
+        *outputSize = dec->output.size();
+        return TRUE;
+    } API_CATCH(FALSE)
+}
+
+WINPTY_API void winpty_decoder_free(winpty_decoder_t *dec) {
+    delete dec;
+}
+
+namespace {
+
+const DWORD kDefaultReaderBufferSize = 64 * 1024;
+const int kDefaultReaderBufferCount = 4;
+const int kMaxReaderBufferCount = MAXIMUM_WAIT_OBJECTS - 1;
+
+// One of the overlapped reads queued on the CONOUT pipe.
+struct ReaderSlot {
+    OVERLAPPED over = {};
+    OwnedHandle event;
+    std::vector<char> buffer;
+    bool issued = false;
+    // The error ReadFile failed with immediately, if any.
+    DWORD error = ERROR_SUCCESS;
+};
+
+typedef winpty_output_reader_t::Framing ReaderFraming;
+
+uint32_t readLE32(const char *p) {
+    const auto *u = reinterpret_cast<const unsigned char*>(p);
+    return u[0] | (u[1] << 8) | (u[2] << 16) |
+        (static_cast<uint32_t>(u[3]) << 24);
+}
+
+} // anonymous namespace
+
+// Advances the reader's frame scan over the pending output.
+static void scanOutputFrames(winpty_output_reader_t &reader) {
+    const std::string &pending = reader.pending;
+    switch (reader.framing) {
+    case ReaderFraming::None:
+        reader.frameEnd = reader.scanPos = pending.size();
+        break;
+    case ReaderFraming::LengthPrefixed:
+        while (pending.size() - reader.scanPos >= 4) {
+            const size_t frameSize =
+                4 + readLE32(&pending[reader.scanPos]);
+            if (pending.size() - reader.scanPos < frameSize) {
+                break;
+            }
+            reader.scanPos += frameSize;
+            reader.frameEnd = reader.scanPos;
+        }
+        break;
+    case ReaderFraming::CellRecords:
+        while (pending.size() - reader.scanPos >= 8) {
+            const char *header = &pending[reader.scanPos];
+            const size_t recordSize = 8 + readLE32(header + 4);
+            if (pending.size() - reader.scanPos < recordSize) {
+                break;
+            }
+            reader.scanPos += recordSize;
+            const unsigned type =
+                static_cast<unsigned char>(header[0]) |
+                (static_cast<unsigned char>(header[1]) << 8);
+            if (type == WINPTY_CELL_RECORD_END_FRAME) {
+                reader.frameEnd = reader.scanPos;
+            }
+        }
+        break;
+    }
+}
+
+// Hands the whole frames of newly read output to the callback.  Returns
+// false if the stream is corrupt.
+static bool deliverOutput(winpty_output_reader_t &reader,
+                          const char *data, size_t size) {
+    if (reader.decompressor) {
+        if (!reader.decompressor->decompress(data, size, reader.pending)) {
+            trace("winpty_output_reader: corrupt compressed output");
+            return false;
+        }
+    } else {
+        reader.pending.append(data, size);
+    }
+    scanOutputFrames(reader);
+    if (reader.frameEnd > 0) {
+        reader.callback(reader.pending.data(), reader.frameEnd,
+                        reader.userData);
+        reader.pending.erase(0, reader.frameEnd);
+        reader.scanPos -= reader.frameEnd;
+        reader.frameEnd = 0;
+    }
+    return true;
+}
+
+static void issueReaderRead(winpty_output_reader_t &reader,
+                            ReaderSlot &slot) {
+    slot.over = OVERLAPPED();
+    slot.over.hEvent = slot.event.get();
+    slot.error = ERROR_SUCCESS;
+    slot.issued = true;
+    // A read that completes at once still signals its event, so it's
+    // collected like any other.
+    if (!ReadFile(reader.pipe.get(), slot.buffer.data(), reader.bufferSize,
+                  nullptr, &slot.over) &&
+            GetLastError() != ERROR_IO_PENDING) {
+        slot.error = GetLastError();
+        slot.issued = false;
+    }
+}
+
+// The reads complete in the order they were issued, so the reader waits
+// for the oldest, then takes every later one that is already done, and
+// delivers them as one chunk.
+static void runPipeReader(winpty_output_reader_t &reader) {
+    std::vector<ReaderSlot> slots(reader.bufferCount);
+    for (auto &slot : slots) {
+        slot.event = createEvent();
+        slot.buffer.resize(reader.bufferSize);
+        issueReaderRead(reader, slot);
+    }
+    std::vector<char> chunk;
+    size_t head = 0;
+    bool done = false;
+    while (!done) {
+        ReaderSlot *slot = &slots[head];
+        if (slot->issued) {
+            const HANDLE waitHandles[2] = {
+                slot->event.get(), reader.stopEvent.get()
+            };
+            if (WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE) !=
+                    WAIT_OBJECT_0) {
+                break;
+            }
+        }
+        chunk.clear();
+        do {
+            DWORD actual = 0;
+            if (!slot->issued) {
+                done = true;
+            } else if (!GetOverlappedResult(reader.pipe.get(), &slot->over,
+                                            &actual, FALSE)) {
+                slot->issued = false;
+                done = true;
+            } else {
+                chunk.insert(chunk.end(), slot->buffer.data(),
+                             slot->buffer.data() + actual);
+                issueReaderRead(reader, *slot);
+            }
+            head = (head + 1) % slots.size();
+            slot = &slots[head];
+        } while (!done && slot->issued && HasOverlappedIoCompleted(
+                    &slot->over));
+        if (!deliverOutput(reader, chunk.data(), chunk.size())) {
+            break;
+        }
+    }
+    CancelIo(reader.pipe.get());
+    for (auto &slot : slots) {
+        if (slot.issued) {
+            DWORD actual = 0;
+            GetOverlappedResult(reader.pipe.get(), &slot.over, &actual,
+                                TRUE);
+        }
+    }
+}
+
+static void runShmReader(winpty_output_reader_t &reader) {
+    SharedMemoryRing &ring = *reader.shm->ring;
+    while (true) {
+        const char *data = nullptr;
+        const size_t size = ring.peek(&data);
+        if (size > 0) {
+            const bool ok = deliverOutput(reader, data, size);
+            ring.consume(size);
+            if (!ok) {
+                break;
+            }
+            continue;
+        }
+        if (ring.isEof()) {
+            break;
+        }
+        if (ring.armDataWait()) {
+            const HANDLE waitHandles[2] = {
+                ring.dataEvent(), reader.stopEvent.get()
+            };
+            if (WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE) !=
+                    WAIT_OBJECT_0) {
+                break;
+            }
+        }
+    }
+}
+
+static DWORD WINAPI outputReaderThreadProc(LPVOID param) {
+    auto &reader = *static_cast<winpty_output_reader_t*>(param);
+    if (reader.shm != nullptr) {
+        runShmReader(reader);
+    } else {
+        runPipeReader(reader);
+    }
+    // A partial frame left at the end of the stream is dropped.
+    reader.callback(nullptr, 0, reader.userData);
+    return 0;
+}
+
+WINPTY_API winpty_output_reader_t *
+winpty_output_reader_new(winpty_t *wp,
+                         winpty_output_callback_t callback,
+                         void *user_data /*OPTIONAL*/,
+                         DWORD bufferSize, int bufferCount,
+                         winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr && callback != nullptr);
+        ASSERT(bufferCount >= 0);
+        std::unique_ptr<winpty_output_reader_t> reader(
+            new winpty_output_reader_t);
+        reader->callback = callback;
+        reader->userData = user_data;
+        reader->bufferSize =
+            bufferSize != 0 ? bufferSize : kDefaultReaderBufferSize;
+        reader->bufferCount = std::min(
+            bufferCount != 0 ? bufferCount : kDefaultReaderBufferCount,
+            kMaxReaderBufferCount);
+        const uint64_t flags = wp->agentFlags;
+        if (flags & WINPTY_FLAG_CONPTY) {
+            // The pseudoconsole's output is forwarded as it comes.
+        } else if (flags & WINPTY_FLAG_CELL_OUTPUT) {
+            reader->framing = ReaderFraming::CellRecords;
+        } else if (flags & WINPTY_FLAG_FRAMED_OUTPUT) {
+            reader->framing = ReaderFraming::LengthPrefixed;
+        }
+        if (wp->outputCompressed) {
+            reader->decompressor.reset(new StreamCompression::Decompressor);
+        }
+        {
+            LockGuard<Mutex> lock(wp->mutex);
+            if (conoutIsShm(*wp)) {
+                reader->shm = attachConoutShm(*wp);
+            }
+        }
+        if (reader->shm == nullptr) {
+            HANDLE pipe = CreateFileW(wp->conoutPipeName.c_str(),
+                                      GENERIC_READ, 0, nullptr,
+                                      OPEN_EXISTING, FILE_FLAG_OVERLAPPED,
+                                      nullptr);
+            if (pipe == INVALID_HANDLE_VALUE) {
+                throwWindowsError(L"Opening the CONOUT pipe failed");
+            }
+            reader->pipe = OwnedHandle(pipe);
+        }
+        reader->stopEvent = createEvent();
+        HANDLE thread = CreateThread(nullptr, 0, outputReaderThreadProc,
+                                     reader.get(), 0, nullptr);
+        if (thread == nullptr) {
+            throwWindowsError(L"CreateThread failed");
+        }
+        reader->thread = OwnedHandle(thread);
+        return reader.release();
+    } API_CATCH(nullptr)
+}
+
+WINPTY_API void winpty_output_reader_free(winpty_output_reader_t *reader) {
+    if (reader == nullptr) {
+        return;
+    }
+    SetEvent(reader->stopEvent.get());
+    WaitForSingleObject(reader->thread.get(), INFINITE);
+    delete reader;
+}
+
+
+
+/*****************************************************************************
+ * winpty agent RPC calls. */
+
+winpty_s::~winpty_s() {
+    cancelControlPipeRead(*this);
+}
+
+winpty_async_result_s::~winpty_async_result_s() {
+    winpty_error_free(error);
+}
+
+// Returns a new error object, as if the exception had escaped an API call.
+static winpty_error_ptr_t newError(winpty_result_t code, const wchar_t *msg) {
+    winpty_error_ptr_t ret = nullptr;
+    winpty_error_ptr_t *err = &ret;
+    try {
+        throw LibWinptyException(code, msg);
+    } catch (...) {
+        translateException(err);
+    }
+    return ret;
+}
+
+static void queueCompletedResult(winpty_t &wp,
+                                 std::unique_ptr<winpty_async_result_t> &&result) {
+    wp.completedResults.push_back(std::move(result));
+    SetEvent(wp.readEvent.get());
+}
 
-/*****************************************************************************
- * winpty agent RPC calls. */
-
 namespace {
 
 // Close the control pipe if something goes wrong with the pipe communication,
-// which could leave the control pipe in an inconsistent state.
+// which could leave the control pipe in an inconsistent state.  Outstanding
+// requests will never be answered, so fail them.  While another thread is
+// reading the pipe, leave that to the reader: this thread's failure was a
+// write to a broken pipe, which the reader sees too.
 class RpcOperation {
 public:
     RpcOperation(winpty_t &wp) : m_wp(wp) {
@@ -744,9 +1822,32 @@ public:
         }
     }
     ~RpcOperation() {
-        if (!m_success) {
+        if (!m_success && (m_wp.readerThread == 0 ||
+                           m_wp.readerThread == GetCurrentThreadId())) {
             trace("~RpcOperation: Closing control pipe");
+            cancelControlPipeRead(m_wp);
             m_wp.controlPipe.dispose(true);
+            m_wp.readQueue.clear();
+            for (auto *waiter : m_wp.syncWaiters) {
+                waiter->done = true;
+                waiter->failed = true;
+                if (waiter->event.get() != nullptr) {
+                    SetEvent(waiter->event.get());
+                }
+            }
+            try {
+                while (!m_wp.pendingRequests.empty()) {
+                    auto result = std::move(m_wp.pendingRequests.front());
+                    m_wp.pendingRequests.pop_front();
+                    result->error = newError(WINPTY_ERROR_LOST_CONNECTION,
+                        L"Agent shutdown due to RPC failure");
+                    queueCompletedResult(m_wp, std::move(result));
+                }
+            } catch (...) {
+                // Out of memory.  Drop the remaining requests rather than
+                // throwing from a dtor.
+                m_wp.pendingRequests.clear();
+            }
         }
     }
     void success() { m_success = true; }
@@ -757,6 +1858,187 @@ private:
 
 } // anonymous namespace
 
+static void decodeProcessListReply(ReadBuffer &reply, std::vector<int> &list) {
+    const auto count = reply.getInt32();
+    if (count < 0) {
+        throwWinptyException(L"Agent RPC error: invalid process count");
+    }
+    list.resize(count);
+    for (auto i = 0; i < count; i++) {
+        list[i] = reply.getInt32();
+    }
+    reply.assertEof();
+}
+
+static bool decodeSpawnReply(winpty_t &wp, ReadBuffer &reply,
+                             OwnedHandle &localProcess,
+                             OwnedHandle &localThread,
+                             DWORD &createProcessError);
+
+// Decodes the reply to an outstanding asynchronous request.  Most replies
+// complete the oldest request, but a process list wait is answered only when
+// the list changes.
+static void completeAsyncRequest(winpty_t &wp, int64_t replyId,
+                                 ReadBuffer &reply) {
+    auto it = wp.pendingRequests.begin();
+    while (it != wp.pendingRequests.end() &&
+            (*it)->requestId != static_cast<uint64_t>(replyId)) {
+        ++it;
+    }
+    if (it == wp.pendingRequests.end()) {
+        throwWinptyException(L"Agent RPC error: unexpected reply ID");
+    }
+    auto result = std::move(*it);
+    wp.pendingRequests.erase(it);
+    switch (result->type) {
+    case AgentMsg::StartProcess:
+        if (!decodeSpawnReply(wp, reply, result->process, result->thread,
+                              result->createProcessError)) {
+            result->error = newError(WINPTY_ERROR_SPAWN_CREATE_PROCESS_FAILED,
+                                     L"CreateProcess failed");
+        }
+        break;
+    case AgentMsg::SetSize:
+        reply.assertEof();
+        break;
+    case AgentMsg::GetConsoleProcessList:
+        decodeProcessListReply(reply, result->processList);
+        break;
+    case AgentMsg::WaitProcessListChange:
+        result->processListGeneration = reply.getInt64();
+        decodeProcessListReply(reply, result->processList);
+        break;
+    default:
+        ASSERT(false && "unexpected asynchronous request type");
+    }
+    queueCompletedResult(wp, std::move(result));
+}
+
+namespace {
+
+// Registers a synchronous call's wait for the duration of readReply.
+class SyncWaitRegistration {
+public:
+    SyncWaitRegistration(winpty_t &wp, winpty_t::SyncWaiter &waiter) :
+            m_wp(wp), m_waiter(waiter) {
+        m_wp.syncWaiters.push_back(&m_waiter);
+    }
+    ~SyncWaitRegistration() {
+        auto &waiters = m_wp.syncWaiters;
+        waiters.erase(std::find(waiters.begin(), waiters.end(), &m_waiter));
+    }
+private:
+    winpty_t &m_wp;
+    winpty_t::SyncWaiter &m_waiter;
+};
+
+// Makes this thread the control pipe reader.  On release, wakes another
+// waiter to take over, and signals the async event if the reader left
+// packets or results for winpty_poll_result.
+class ReaderRole {
+public:
+    ReaderRole(winpty_t &wp) : m_wp(wp) {
+        ASSERT(m_wp.readerThread == 0);
+        m_wp.readerThread = GetCurrentThreadId();
+    }
+    ~ReaderRole() {
+        m_wp.readerThread = 0;
+        for (auto *waiter : m_wp.syncWaiters) {
+            if (!waiter->done && waiter->event.get() != nullptr) {
+                SetEvent(waiter->event.get());
+                break;
+            }
+        }
+        if (!m_wp.readQueue.empty() || !m_wp.completedResults.empty()) {
+            SetEvent(m_wp.readEvent.get());
+        }
+    }
+private:
+    winpty_t &m_wp;
+};
+
+} // anonymous namespace
+
+// Hands a reply to the synchronous or asynchronous request it answers.
+static void dispatchReply(winpty_t &wp, std::vector<char> &&payload) {
+    const int64_t replyId =
+        ReadBuffer(payload.data(), payload.size()).getInt64();
+    for (auto *waiter : wp.syncWaiters) {
+        if (waiter->requestId == replyId && !waiter->done) {
+            waiter->payload = std::move(payload);
+            waiter->done = true;
+            if (waiter->event.get() != nullptr) {
+                SetEvent(waiter->event.get());
+            }
+            return;
+        }
+    }
+    ReadBuffer reply(std::move(payload));
+    reply.getInt64();
+    completeAsyncRequest(wp, replyId, reply);
+}
+
+// Waits for the reply to requestId.  The caller holds wp.mutex, which is
+// released while the thread sleeps.  If no other thread is reading the
+// control pipe, this one reads it until its reply arrives, decoding the
+// replies to asynchronous requests for winpty_poll_result and passing those
+// of other synchronous calls to their threads.
+static ReadBuffer readReply(winpty_t &wp, int64_t requestId) {
+    winpty_t::SyncWaiter waiter;
+    waiter.requestId = requestId;
+    SyncWaitRegistration registration(wp, waiter);
+    while (!waiter.done) {
+        if (wp.readerThread == 0) {
+            ReaderRole role(wp);
+            std::vector<char> payload;
+            while (!waiter.done) {
+                if (takeQueuedPacket(wp, payload)) {
+                    dispatchReply(wp, std::move(payload));
+                    continue;
+                }
+                if (pumpControlPipe(wp, false)) {
+                    continue;
+                }
+                // The async event doubles as the read's completion event.
+                // Clear a stale signal, then check the read once more in
+                // case it completed in between.
+                ResetEvent(wp.readEvent.get());
+                if (pumpControlPipe(wp, false)) {
+                    continue;
+                }
+                UnlockGuard<Mutex> unlock(wp.mutex);
+                waitForIoEvent(wp, wp.readEvent.get());
+            }
+            break;
+        }
+        if (waiter.event.get() == nullptr) {
+            waiter.event = createEvent();
+        }
+        ResetEvent(waiter.event.get());
+        UnlockGuard<Mutex> unlock(wp.mutex);
+        waitForIoEvent(wp, waiter.event.get());
+    }
+    if (waiter.failed) {
+        throw LibWinptyException(WINPTY_ERROR_LOST_CONNECTION,
+            L"Agent shutdown due to RPC failure");
+    }
+    ReadBuffer reply(std::move(waiter.payload));
+    reply.getInt64();
+    return reply;
+}
+
+// Writes an asynchronous request and records it as outstanding.  A control
+// pipe read is left outstanding so that readEvent is signaled when the reply
+// arrives.
+static void startAsyncRequest(winpty_t &wp, WriteBuffer &packet,
+                              std::unique_ptr<winpty_async_result_t> &&result) {
+    wp.pendingRequests.push_back(std::move(result));
+    writePacket(wp, packet);
+    if (wp.readerThread == 0) {
+        pumpControlPipe(wp, false);
+    }
+}
+
 
 
 /*****************************************************************************
@@ -841,6 +2123,115 @@ static inline OwnedHandle stealHandle(HANDLE process, HANDLE handle) {
     return OwnedHandle(result);
 }
 
+static WriteBuffer newSpawnPacket(winpty_t &wp,
+                                  const winpty_spawn_config_t &cfg,
+                                  bool wantProcess, bool wantThread,
+                                  int64_t &requestId) {
+    TimeMeasurement timer;
+    auto packet = newRequestPacket(wp, AgentMsg::StartProcess, requestId);
+    // Size the packet up front, so a large environment block is copied into
+    // it once.
+    const size_t kPieceOverhead = 16;
+    packet.reserve(packet.buf().size() + 8 * kPieceOverhead +
+        sizeof(wchar_t) * (cfg.appname.size() + cfg.cmdline.size() +
+                           cfg.cwd.size() + cfg.env.size() +
+                           wp.spawnDesktopName.size()));
+    packet.putInt64(cfg.winptyFlags);
+    packet.putInt32(wantProcess);
+    packet.putInt32(wantThread);
+    packet.putWString(cfg.appname);
+    packet.putWString(cfg.cmdline);
+    packet.putWString(cfg.cwd);
+    packet.putWString(cfg.env);
+    packet.putWString(wp.spawnDesktopName);
+    std::fill(wp.spawnTimesUs, wp.spawnTimesUs + WINPTY_SPAWN_PHASE_COUNT, 0);
+    wp.spawnTimesUs[WINPTY_SPAWN_ENCODE] = timer.elapsedUs();
+    return packet;
+}
+
+// Returns false if the agent's CreateProcess call failed.  Throws an
+// exception if the reply is malformed.
+static bool decodeSpawnReply(winpty_t &wp, ReadBuffer &reply,
+                             OwnedHandle &localProcess,
+                             OwnedHandle &localThread,
+                             DWORD &createProcessError) {
+    const auto result = static_cast<StartProcessResult>(reply.getInt32());
+    const auto getAgentTimes = [&]() {
+        for (int i = WINPTY_SPAWN_AGENT_DECODE;
+                i <= WINPTY_SPAWN_AGENT_HANDLES; ++i) {
+            wp.spawnTimesUs[i] = reply.getInt64();
+        }
+        reply.assertEof();
+    };
+    if (result == StartProcessResult::CreateProcessFailed) {
+        createProcessError = reply.getInt32();
+        getAgentTimes();
+        return false;
+    } else if (result != StartProcessResult::ProcessCreated) {
+        throwWinptyException(
+            L"Agent RPC error: invalid StartProcessResult");
+    }
+    const HANDLE remoteProcess = handleFromInt64(reply.getInt64());
+    const HANDLE remoteThread = handleFromInt64(reply.getInt64());
+    getAgentTimes();
+    TimeMeasurement timer;
+    if (remoteProcess != nullptr) {
+        localProcess = stealHandle(wp.agentProcess.get(), remoteProcess);
+    }
+    if (remoteThread != nullptr) {
+        localThread = stealHandle(wp.agentProcess.get(), remoteThread);
+    }
+    wp.spawnTimesUs[WINPTY_SPAWN_TAKE_HANDLES] = timer.elapsedUs();
+    return true;
+}
+
+// Reads the reply to the recording request openAgent sent with requestId.
+// Throws if the agent couldn't create the file.
+static void finishStartRecording(winpty_t &wp, int64_t requestId) {
+    LockGuard<Mutex> lock(wp.mutex);
+    RpcOperation rpc(wp);
+    auto reply = readReply(wp, requestId);
+    const bool started = reply.getInt32() != 0;
+    reply.assertEof();
+    rpc.success();
+    if (!started) {
+        throwWinptyException(L"The agent could not create the recording file");
+    }
+}
+
+// Reads the reply to the spawn request sent with requestId and hands out the
+// handles.  Throws if the agent's CreateProcess failed.
+static void finishSpawn(winpty_t &wp, RpcOperation &rpc, int64_t requestId,
+                        TimeMeasurement &roundTripTimer,
+                        TimeMeasurement &totalTimer,
+                        HANDLE *process_handle,
+                        HANDLE *thread_handle,
+                        DWORD *create_process_error) {
+    auto reply = readReply(wp, requestId);
+    const int64_t roundTripUs = roundTripTimer.elapsedUs();
+    OwnedHandle localProcess;
+    OwnedHandle localThread;
+    DWORD lastError = 0;
+    const bool created = decodeSpawnReply(
+        wp, reply, localProcess, localThread, lastError);
+    rpc.success();
+    wp.spawnTimesUs[WINPTY_SPAWN_ROUND_TRIP] = roundTripUs;
+    wp.spawnTimesUs[WINPTY_SPAWN_TOTAL] = totalTimer.elapsedUs();
+    if (!created) {
+        if (create_process_error != nullptr) {
+            *create_process_error = lastError;
+        }
+        throw LibWinptyException(WINPTY_ERROR_SPAWN_CREATE_PROCESS_FAILED,
+            L"CreateProcess failed");
+    }
+    if (process_handle != nullptr) {
+        *process_handle = localProcess.release();
+    }
+    if (thread_handle != nullptr) {
+        *thread_handle = localThread.release();
+    }
+}
+
 WINPTY_API BOOL
 winpty_spawn(winpty_t *wp,
              const winpty_spawn_config_t *cfg,
@@ -857,61 +2248,52 @@ winpty_spawn(winpty_t *wp,
 
         LockGuard<Mutex> lock(wp->mutex);
         RpcOperation rpc(*wp);
+        TimeMeasurement totalTimer;
 
         // Send spawn request.
-        auto packet = newPacket();
-        packet.putInt32(AgentMsg::StartProcess);
-        packet.putInt64(cfg->winptyFlags);
-        packet.putInt32(process_handle != nullptr);
-        packet.putInt32(thread_handle != nullptr);
-        packet.putWString(cfg->appname);
-        packet.putWString(cfg->cmdline);
-        packet.putWString(cfg->cwd);
-        packet.putWString(cfg->env);
-        packet.putWString(wp->spawnDesktopName);
+        int64_t requestId = 0;
+        auto packet = newSpawnPacket(*wp, *cfg,
+                                     process_handle != nullptr,
+                                     thread_handle != nullptr,
+                                     requestId);
+        TimeMeasurement roundTripTimer;
         writePacket(*wp, packet);
-
-        // Receive reply.
-        auto reply = readPacket(*wp);
-        const auto result = static_cast<StartProcessResult>(reply.getInt32());
-        if (result == StartProcessResult::CreateProcessFailed) {
-            const DWORD lastError = reply.getInt32();
-            reply.assertEof();
-            if (create_process_error != nullptr) {
-                *create_process_error = lastError;
-            }
-            rpc.success();
-            throw LibWinptyException(WINPTY_ERROR_SPAWN_CREATE_PROCESS_FAILED,
-                L"CreateProcess failed");
-        } else if (result == StartProcessResult::ProcessCreated) {
-            const HANDLE remoteProcess = handleFromInt64(reply.getInt64());
-            const HANDLE remoteThread = handleFromInt64(reply.getInt64());
-            reply.assertEof();
-            OwnedHandle localProcess;
-            OwnedHandle localThread;
-            if (remoteProcess != nullptr) {
-                localProcess =
-                    stealHandle(wp->agentProcess.get(), remoteProcess);
-            }
-            if (remoteThread != nullptr) {
-                localThread =
-                    stealHandle(wp->agentProcess.get(), remoteThread);
-            }
-            if (process_handle != nullptr) {
-                *process_handle = localProcess.release();
-            }
-            if (thread_handle != nullptr) {
-                *thread_handle = localThread.release();
-            }
-            rpc.success();
-        } else {
-            throwWinptyException(
-                L"Agent RPC error: invalid StartProcessResult");
-        }
+        finishSpawn(*wp, rpc, requestId, roundTripTimer, totalTimer,
+                    process_handle, thread_handle, create_process_error);
         return TRUE;
     } API_CATCH(FALSE)
 }
 
+WINPTY_API winpty_t *
+winpty_open_and_spawn(const winpty_config_t *cfg,
+                      const winpty_spawn_config_t *spawn_cfg,
+                      HANDLE *process_handle /*OPTIONAL*/,
+                      HANDLE *thread_handle /*OPTIONAL*/,
+                      DWORD *create_process_error /*OPTIONAL*/,
+                      winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(cfg != nullptr && spawn_cfg != nullptr);
+
+        if (process_handle != nullptr) { *process_handle = nullptr; }
+        if (thread_handle != nullptr) { *thread_handle = nullptr; }
+        if (create_process_error != nullptr) { *create_process_error = 0; }
+
+        TimeMeasurement totalTimer;
+        EarlySpawn spawn;
+        spawn.cfg = spawn_cfg;
+        spawn.wantProcess = process_handle != nullptr;
+        spawn.wantThread = thread_handle != nullptr;
+        auto wp = openAgent(cfg, &spawn);
+
+        // The spawn's round trip began during the open.
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        finishSpawn(*wp, rpc, spawn.requestId, totalTimer, totalTimer,
+                    process_handle, thread_handle, create_process_error);
+        return wp.release();
+    } API_CATCH(nullptr)
+}
+
 
 
 /*****************************************************************************
@@ -924,42 +2306,1065 @@ winpty_set_size(winpty_t *wp, int cols, int rows,
         ASSERT(wp != nullptr && cols > 0 && rows > 0);
         LockGuard<Mutex> lock(wp->mutex);
         RpcOperation rpc(*wp);
-        auto packet = newPacket();
-        packet.putInt32(AgentMsg::SetSize);
-        packet.putInt32(cols);
-        packet.putInt32(rows);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(*wp, AgentMsg::SetSize, requestId);
+        SetSizeMsg msg;
+        msg.cols = cols;
+        msg.rows = rows;
+        putAgentMsg(packet, msg);
         writePacket(*wp, packet);
-        readPacket(*wp).assertEof();
+        readReply(*wp, requestId).assertEof();
         rpc.success();
         return TRUE;
     } API_CATCH(FALSE)
 }
 
-WINPTY_API int
-winpty_get_console_process_list(winpty_t *wp, int *processList, const int processCount,
-                                winpty_error_ptr_t *err /*OPTIONAL*/) {
+WINPTY_API BOOL
+winpty_set_priority(winpty_t *wp, int level,
+                    winpty_error_ptr_t *err /*OPTIONAL*/) {
     API_TRY {
-        ASSERT(wp != nullptr);
-        ASSERT(processList != nullptr);
+        ASSERT(wp != nullptr &&
+               level >= WINPTY_PRIORITY_NORMAL &&
+               level <= WINPTY_PRIORITY_FOREGROUND);
         LockGuard<Mutex> lock(wp->mutex);
         RpcOperation rpc(*wp);
-        auto packet = newPacket();
-        packet.putInt32(AgentMsg::GetConsoleProcessList);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(*wp, AgentMsg::SetPriority, requestId);
+        SetPriorityMsg msg;
+        msg.level = level;
+        putAgentMsg(packet, msg);
         writePacket(*wp, packet);
-        auto reply = readPacket(*wp);
-
-        auto actualProcessCount = reply.getInt32();
+        readReply(*wp, requestId).assertEof();
+        rpc.success();
+        return TRUE;
+    } API_CATCH(FALSE)
+}
 
-        if (actualProcessCount <= processCount) {
-            for (auto i = 0; i < actualProcessCount; i++) {
-                processList[i] = reply.getInt32();
-            }
-        }
+WINPTY_API BOOL
+winpty_grant_output_credits(winpty_t *wp, UINT64 bytes, UINT64 frames,
+                            winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr && bytes <= INT64_MAX && frames <= INT64_MAX);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(*wp, AgentMsg::GrantOutputCredits,
+                                       requestId);
+        GrantOutputCreditsMsg msg;
+        msg.bytes = bytes;
+        msg.frames = frames;
+        putAgentMsg(packet, msg);
+        writePacket(*wp, packet);
+        readReply(*wp, requestId).assertEof();
+        rpc.success();
+        return TRUE;
+    } API_CATCH(FALSE)
+}
 
-        reply.assertEof();
+WINPTY_API BOOL
+winpty_set_agent_scheduling(winpty_t *wp, int schedulingClass,
+                            UINT64 affinityMask,
+                            winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr &&
+               schedulingClass >= WINPTY_SCHEDULING_DEFAULT &&
+               schedulingClass <= WINPTY_SCHEDULING_BATCH);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(*wp, AgentMsg::SetScheduling,
+                                       requestId);
+        SetSchedulingMsg msg;
+        msg.schedulingClass = schedulingClass;
+        msg.affinityMask = affinityMask;
+        putAgentMsg(packet, msg);
+        writePacket(*wp, packet);
+        readReply(*wp, requestId).assertEof();
         rpc.success();
-        return actualProcessCount;
-    } API_CATCH(0)
+        return TRUE;
+    } API_CATCH(FALSE)
+}
+
+static void setPaused(winpty_t &wp, PauseMode mode) {
+    LockGuard<Mutex> lock(wp.mutex);
+    RpcOperation rpc(wp);
+    int64_t requestId = 0;
+    auto packet = newRequestPacket(wp, AgentMsg::SetPaused, requestId);
+    SetPausedMsg msg;
+    msg.mode = static_cast<int32_t>(mode);
+    putAgentMsg(packet, msg);
+    writePacket(wp, packet);
+    readReply(wp, requestId).assertEof();
+    rpc.success();
+}
+
+WINPTY_API BOOL
+winpty_pause(winpty_t *wp, BOOL keepHistory,
+             winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        setPaused(*wp, keepHistory ? PauseMode::TrackHistory
+                                   : PauseMode::Stopped);
+        return TRUE;
+    } API_CATCH(FALSE)
+}
+
+WINPTY_API BOOL
+winpty_resume(winpty_t *wp, winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        setPaused(*wp, PauseMode::Running);
+        return TRUE;
+    } API_CATCH(FALSE)
+}
+
+WINPTY_API BOOL
+winpty_reattach(winpty_t *wp, winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(*wp, AgentMsg::Reattach, requestId);
+        writePacket(*wp, packet);
+        auto reply = readReply(*wp, requestId);
+        auto coninPipeName = reply.getWString();
+        auto conoutPipeName = reply.getWString();
+        std::wstring conerrPipeName;
+        if (!wp->conerrPipeName.empty()) {
+            conerrPipeName = reply.getWString();
+        }
+        reply.assertEof();
+        wp->coninPipeName = std::move(coninPipeName);
+        wp->conoutPipeName = std::move(conoutPipeName);
+        wp->conerrPipeName = std::move(conerrPipeName);
+        // The old ring is gone; winpty_conout_shm attaches to the new one.
+        wp->conoutShm.reset();
+        rpc.success();
+        return TRUE;
+    } API_CATCH(FALSE)
+}
+
+WINPTY_API LPCWSTR
+winpty_add_output_subscriber(winpty_t *wp,
+                             winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(
+            *wp, AgentMsg::AddOutputSubscriber, requestId);
+        writePacket(*wp, packet);
+        auto reply = readReply(*wp, requestId);
+        auto pipeName = reply.getWString();
+        reply.assertEof();
+        rpc.success();
+        if (pipeName.empty()) {
+            throwWinptyException(
+                L"Output subscribers are unavailable with a pseudoconsole");
+        }
+        wp->subscriberPipeNames.push_back(std::move(pipeName));
+        return wp->subscriberPipeNames.back().c_str();
+    } API_CATCH(nullptr)
+}
+
+WINPTY_API int
+winpty_get_console_process_list(winpty_t *wp, int *processList, const int processCount,
+                                winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        ASSERT(processList != nullptr);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(
+            *wp, AgentMsg::GetConsoleProcessList, requestId);
+        writePacket(*wp, packet);
+        auto reply = readReply(*wp, requestId);
+
+        std::vector<int> list;
+        decodeProcessListReply(reply, list);
+        rpc.success();
+
+        const auto actualProcessCount = static_cast<int>(list.size());
+        if (actualProcessCount <= processCount) {
+            std::copy(list.begin(), list.end(), processList);
+        }
+        return actualProcessCount;
+    } API_CATCH(0)
+}
+
+WINPTY_API int
+winpty_get_stats(winpty_t *wp, UINT64 *stats, int statCount,
+                 winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        ASSERT(statCount >= 0);
+        ASSERT(stats != nullptr || statCount == 0);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(*wp, AgentMsg::GetStats, requestId);
+        writePacket(*wp, packet);
+        auto reply = readReply(*wp, requestId);
+
+        const int32_t agentCount = reply.getInt32();
+        if (agentCount < 0) {
+            throwWinptyException(L"Agent RPC error: invalid stats count");
+        }
+        for (int32_t i = 0; i < agentCount; ++i) {
+            const auto value = static_cast<UINT64>(reply.getInt64());
+            if (i < statCount && i < WINPTY_STAT_COUNT) {
+                stats[i] = value;
+            }
+        }
+        reply.assertEof();
+        rpc.success();
+
+        // Counters the agent didn't report read as zero.
+        for (int i = agentCount; i < std::min(statCount, WINPTY_STAT_COUNT);
+                ++i) {
+            stats[i] = 0;
+        }
+        return WINPTY_STAT_COUNT;
+    } API_CATCH(0)
+}
+
+// Each session's counters are read with its own RPC, so a failure leaves
+// the error from winpty_get_stats in *err.
+WINPTY_API int
+winpty_get_cost_report(winpty_t *const *sessions, int sessionCount,
+                       UINT64 *report, int reportSize,
+                       winpty_error_ptr_t *err /*OPTIONAL*/) {
+    ASSERT(sessionCount >= 0);
+    ASSERT(sessions != nullptr || sessionCount == 0);
+    ASSERT(report != nullptr &&
+           reportSize >= (sessionCount + 1) * WINPTY_COST_COUNT);
+    static_assert(WINPTY_STAT_CPU_TOTAL_CYCLES -
+                  WINPTY_STAT_CPU_CAPTURE_CYCLES + 1 == WINPTY_COST_COUNT,
+                  "The cost columns must match the CPU counters");
+    if (err != nullptr) {
+        *err = nullptr;
+    }
+    UINT64 *totals = &report[sessionCount * WINPTY_COST_COUNT];
+    std::fill(totals, totals + WINPTY_COST_COUNT, 0);
+    int costliest = -1;
+    for (int i = 0; i < sessionCount; ++i) {
+        UINT64 stats[WINPTY_STAT_COUNT] = {};
+        if (winpty_get_stats(sessions[i], stats, WINPTY_STAT_COUNT,
+                             err) == 0) {
+            return -1;
+        }
+        UINT64 *row = &report[i * WINPTY_COST_COUNT];
+        for (int j = 0; j < WINPTY_COST_COUNT; ++j) {
+            row[j] = stats[WINPTY_STAT_CPU_CAPTURE_CYCLES + j];
+            totals[j] += row[j];
+        }
+        if (costliest == -1 ||
+                row[WINPTY_COST_TOTAL] >
+                    report[costliest * WINPTY_COST_COUNT + WINPTY_COST_TOTAL]) {
+            costliest = i;
+        }
+    }
+    return costliest;
+}
+
+WINPTY_API int
+winpty_get_histograms(winpty_t *wp, UINT64 *counts, int countSize,
+                      winpty_error_ptr_t *err /*OPTIONAL*/) {
+    const int kTotal = WINPTY_HISTOGRAM_COUNT * WINPTY_HISTOGRAM_BUCKETS;
+    API_TRY {
+        ASSERT(wp != nullptr);
+        ASSERT(countSize >= 0);
+        ASSERT(counts != nullptr || countSize == 0);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(
+            *wp, AgentMsg::GetHistograms, requestId);
+        writePacket(*wp, packet);
+        auto reply = readReply(*wp, requestId);
+
+        const int32_t histogramCount = reply.getInt32();
+        const int32_t bucketCount = reply.getInt32();
+        if (histogramCount < 0 || bucketCount != WINPTY_HISTOGRAM_BUCKETS) {
+            throwWinptyException(
+                L"Agent RPC error: invalid histogram layout");
+        }
+        for (int32_t i = 0; i < histogramCount * bucketCount; ++i) {
+            const auto value = static_cast<UINT64>(reply.getInt64());
+            if (i < countSize && i < kTotal) {
+                counts[i] = value;
+            }
+        }
+        reply.assertEof();
+        rpc.success();
+
+        // Histograms the agent didn't report read as empty.
+        for (int i = histogramCount * bucketCount;
+                i < std::min(countSize, kTotal); ++i) {
+            counts[i] = 0;
+        }
+        return kTotal;
+    } API_CATCH(0)
+}
+
+WINPTY_API int
+winpty_get_console_api_stats(winpty_t *wp, UINT64 *table, int tableSize,
+                             winpty_error_ptr_t *err /*OPTIONAL*/) {
+    const int kTotal = WINPTY_CONSOLE_API_COUNT * WINPTY_CONSOLE_API_COLUMNS;
+    API_TRY {
+        ASSERT(wp != nullptr);
+        ASSERT(tableSize >= 0);
+        ASSERT(table != nullptr || tableSize == 0);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(
+            *wp, AgentMsg::GetConsoleApiStats, requestId);
+        writePacket(*wp, packet);
+        auto reply = readReply(*wp, requestId);
+
+        const int32_t apiCount = reply.getInt32();
+        const int32_t columnCount = reply.getInt32();
+        if (apiCount < 0 || columnCount != WINPTY_CONSOLE_API_COLUMNS) {
+            throwWinptyException(
+                L"Agent RPC error: invalid console API stats layout");
+        }
+        for (int32_t i = 0; i < apiCount * columnCount; ++i) {
+            const auto value = static_cast<UINT64>(reply.getInt64());
+            if (i < tableSize && i < kTotal) {
+                table[i] = value;
+            }
+        }
+        reply.assertEof();
+        rpc.success();
+
+        // Kinds the agent didn't report read as zero.
+        for (int i = apiCount * columnCount;
+                i < std::min(tableSize, kTotal); ++i) {
+            table[i] = 0;
+        }
+        return kTotal;
+    } API_CATCH(0)
+}
+
+WINPTY_API UINT64
+winpty_histogram_bucket_value(int bucket) {
+    ASSERT(bucket >= 0 && bucket < WINPTY_HISTOGRAM_BUCKETS);
+    return LatencyHistogram::bucketLowerBound(bucket);
+}
+
+WINPTY_API UINT64
+winpty_histogram_percentile(const UINT64 *buckets, double percentile) {
+    ASSERT(buckets != nullptr);
+    UINT64 total = 0;
+    for (int i = 0; i < WINPTY_HISTOGRAM_BUCKETS; ++i) {
+        total += buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    // The rank of the sample at the percentile, counting from 1.
+    const double clamped = std::max(0.0, std::min(100.0, percentile));
+    auto rank = static_cast<UINT64>(
+        static_cast<double>(total) * clamped / 100.0 + 0.999999);
+    rank = std::max<UINT64>(1, std::min(rank, total));
+    UINT64 seen = 0;
+    for (int i = 0; i < WINPTY_HISTOGRAM_BUCKETS - 1; ++i) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            return LatencyHistogram::bucketLowerBound(i + 1) - 1;
+        }
+    }
+    return LatencyHistogram::bucketLowerBound(WINPTY_HISTOGRAM_BUCKETS - 1);
+}
+
+namespace {
+
+struct StatMetric {
+    const char *name;
+    bool counter;
+};
+
+// Indexed by WINPTY_STAT_xxx.  Counters get a _total suffix in the
+// Prometheus format.
+const StatMetric kStatMetrics[] = {
+    { "scrapes", true },
+    { "scrapes_changed", true },
+    { "scrape_time_microseconds", true },
+    { "cells_read", true },
+    { "lines_sent", true },
+    { "resyncs", true },
+    { "conin_bytes", true },
+    { "conout_bytes", true },
+    { "conerr_bytes", true },
+    { "control_bytes", true },
+    { "input_records", true },
+    { "freeze_method", false },
+    { "freeze_cost_microseconds", false },
+    { "optimistic_scrape", false },
+    { "optimistic_retries", true },
+    { "cpu_capture_cycles", true },
+    { "cpu_encode_cycles", true },
+    { "cpu_input_cycles", true },
+    { "cpu_control_cycles", true },
+    { "cpu_cycles", true },
+    { "loop_iterations", true },
+    { "wakeups", true },
+    { "wakeups_control", true },
+    { "wakeups_conin", true },
+    { "wakeups_conout", true },
+    { "wakeups_conerr", true },
+    { "wakeups_timeout", true },
+    { "wakeups_other", true },
+    { "wakeups_spurious", true },
+    { "loop_blocked_microseconds", true },
+    { "loop_running_microseconds", true },
+};
+static_assert(sizeof(kStatMetrics) / sizeof(kStatMetrics[0]) ==
+              WINPTY_STAT_COUNT, "Every stat needs a metric name");
+
+// Indexed by WINPTY_HISTOGRAM_xxx.
+const char *const kHistogramMetrics[] = {
+    "scrape_capture",
+    "scrape_encode",
+    "freeze",
+    "input_latency",
+    "control_packet",
+};
+static_assert(sizeof(kHistogramMetrics) / sizeof(kHistogramMetrics[0]) ==
+              WINPTY_HISTOGRAM_COUNT, "Every histogram needs a metric name");
+
+// Indexed by WINPTY_CONSOLE_API_xxx.
+const char *const kConsoleApiNames[] = {
+    "read_output",
+    "write_output",
+    "buffer_info",
+    "set_window",
+    "set_buffer_size",
+    "fill_output",
+    "set_cursor",
+    "write_input",
+    "font",
+    "title",
+    "other",
+};
+static_assert(sizeof(kConsoleApiNames) / sizeof(kConsoleApiNames[0]) ==
+              WINPTY_CONSOLE_API_COUNT, "Every console API needs a name");
+
+// Indexed by WINPTY_CONSOLE_API_CALLS, _CELLS and _US.
+const char *const kConsoleApiColumns[] = { "calls", "cells", "microseconds" };
+
+// The first bucket of each power of two, from 2^4 up: Prometheus buckets
+// are cumulative, and 240 of them per session would swamp the scrape.
+const int kFirstPowerBucket = 16;
+const int kBucketsPerPower = 8;
+
+struct SessionMetrics {
+    std::string label;
+    bool up = false;
+    UINT64 stats[WINPTY_STAT_COUNT] = {};
+    UINT64 histograms[WINPTY_HISTOGRAM_COUNT * WINPTY_HISTOGRAM_BUCKETS] = {};
+    UINT64 consoleApis[
+        WINPTY_CONSOLE_API_COUNT * WINPTY_CONSOLE_API_COLUMNS] = {};
+};
+
+// Milliseconds since 1970.
+UINT64 unixTimeMs() {
+    FILETIME fileTime;
+    GetSystemTimeAsFileTime(&fileTime);
+    const UINT64 ticks =
+        (static_cast<UINT64>(fileTime.dwHighDateTime) << 32) |
+        fileTime.dwLowDateTime;
+    return (ticks - 116444736000000000ull) / 10000;
+}
+
+// Escapes a Prometheus label value.
+std::string prometheusLabel(const std::string &value) {
+    std::string ret;
+    for (char ch : value) {
+        if (ch == '\\' || ch == '"') {
+            ret.push_back('\\');
+            ret.push_back(ch);
+        } else if (ch == '\n') {
+            ret.append("\\n");
+        } else {
+            ret.push_back(ch);
+        }
+    }
+    return ret;
+}
+
+std::string csvField(const std::string &value) {
+    if (value.find_first_of(",\"\r\n") == std::string::npos) {
+        return value;
+    }
+    std::string ret = "\"";
+    for (char ch : value) {
+        if (ch == '"') {
+            ret.push_back('"');
+        }
+        ret.push_back(ch);
+    }
+    ret.push_back('"');
+    return ret;
+}
+
+void formatPrometheus(const std::vector<SessionMetrics> &sessions,
+                      StringBuilder &out) {
+    const auto family = [&](const std::string &name, const char *type) {
+        out << "# TYPE " << name << ' ' << type << '\n';
+    };
+    const auto sample = [&](const std::string &name,
+                            const SessionMetrics &session,
+                            const std::string &extraLabels, UINT64 value) {
+        out << name << "{session=\"" << prometheusLabel(session.label)
+            << '"' << extraLabels << "} " << value << '\n';
+    };
+
+    family("winpty_session_up", "gauge");
+    for (const auto &session : sessions) {
+        sample("winpty_session_up", session, "", session.up ? 1 : 0);
+    }
+    for (int stat = 0; stat < WINPTY_STAT_COUNT; ++stat) {
+        const StatMetric &metric = kStatMetrics[stat];
+        const std::string name = std::string("winpty_") + metric.name +
+            (metric.counter ? "_total" : "");
+        family(name, metric.counter ? "counter" : "gauge");
+        for (const auto &session : sessions) {
+            if (session.up) {
+                sample(name, session, "", session.stats[stat]);
+            }
+        }
+    }
+    for (int h = 0; h < WINPTY_HISTOGRAM_COUNT; ++h) {
+        const std::string name = std::string("winpty_") +
+            kHistogramMetrics[h] + "_microseconds";
+        family(name, "histogram");
+        for (const auto &session : sessions) {
+            if (!session.up) {
+                continue;
+            }
+            const UINT64 *buckets =
+                &session.histograms[h * WINPTY_HISTOGRAM_BUCKETS];
+            UINT64 cumulative = 0;
+            UINT64 sum = 0;
+            for (int b = 0; b < WINPTY_HISTOGRAM_BUCKETS; ++b) {
+                const bool boundary = b >= kFirstPowerBucket &&
+                    (b - kFirstPowerBucket) % kBucketsPerPower == 0;
+                if (boundary) {
+                    // Durations are whole microseconds, so every bucket so
+                    // far is at most one less than this bucket's start.
+                    sample(name + "_bucket", session,
+                           (StringBuilder(32) << ",le=\""
+                                << (LatencyHistogram::bucketLowerBound(b) - 1)
+                                << '"').str_moved(),
+                           cumulative);
+                }
+                cumulative += buckets[b];
+                sum += buckets[b] * LatencyHistogram::bucketLowerBound(b);
+            }
+            sample(name + "_bucket", session, ",le=\"+Inf\"", cumulative);
+            sample(name + "_sum", session, "", sum);
+            sample(name + "_count", session, "", cumulative);
+        }
+    }
+    for (int column = 0; column < WINPTY_CONSOLE_API_COLUMNS; ++column) {
+        const std::string name = std::string("winpty_console_api_") +
+            kConsoleApiColumns[column] + "_total";
+        family(name, "counter");
+        for (const auto &session : sessions) {
+            if (!session.up) {
+                continue;
+            }
+            for (int api = 0; api < WINPTY_CONSOLE_API_COUNT; ++api) {
+                sample(name, session,
+                       std::string(",api=\"") + kConsoleApiNames[api] + '"',
+                       session.consoleApis[
+                           api * WINPTY_CONSOLE_API_COLUMNS + column]);
+            }
+        }
+    }
+}
+
+void formatCsv(const std::vector<SessionMetrics> &sessions, bool header,
+               StringBuilder &out) {
+    if (header) {
+        out << "time_ms,session,up";
+        for (const auto &metric : kStatMetrics) {
+            out << ',' << metric.name;
+        }
+        for (const char *histogram : kHistogramMetrics) {
+            out << ',' << histogram << "_p50_us"
+                << ',' << histogram << "_p99_us";
+        }
+        for (const char *api : kConsoleApiNames) {
+            for (const char *column : kConsoleApiColumns) {
+                out << ",console_api_" << api << '_' << column;
+            }
+        }
+        out << '\n';
+    }
+    const int fieldCount = WINPTY_STAT_COUNT + WINPTY_HISTOGRAM_COUNT * 2 +
+        WINPTY_CONSOLE_API_COUNT * WINPTY_CONSOLE_API_COLUMNS;
+    const UINT64 now = unixTimeMs();
+    for (const auto &session : sessions) {
+        out << now << ',' << csvField(session.label) << ','
+            << (session.up ? 1 : 0);
+        if (!session.up) {
+            out << std::string(fieldCount, ',') << '\n';
+            continue;
+        }
+        for (UINT64 value : session.stats) {
+            out << ',' << value;
+        }
+        for (int h = 0; h < WINPTY_HISTOGRAM_COUNT; ++h) {
+            const UINT64 *buckets =
+                &session.histograms[h * WINPTY_HISTOGRAM_BUCKETS];
+            out << ',' << winpty_histogram_percentile(buckets, 50.0)
+                << ',' << winpty_histogram_percentile(buckets, 99.0);
+        }
+        for (UINT64 value : session.consoleApis) {
+            out << ',' << value;
+        }
+        out << '\n';
+    }
+}
+
+} // anonymous namespace
+
+WINPTY_API winpty_metrics_t *
+winpty_export_metrics(winpty_t *const *sessions,
+                      const LPCWSTR *labels /*OPTIONAL*/,
+                      int sessionCount, int format,
+                      winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(sessionCount >= 0);
+        ASSERT(sessions != nullptr || sessionCount == 0);
+        ASSERT(format == WINPTY_METRICS_PROMETHEUS ||
+               format == WINPTY_METRICS_CSV ||
+               format == WINPTY_METRICS_CSV_ROWS);
+        std::vector<SessionMetrics> polled(sessionCount);
+        for (int i = 0; i < sessionCount; ++i) {
+            SessionMetrics &session = polled[i];
+            session.label = labels != nullptr
+                ? utf8FromWide(labels[i])
+                : (StringBuilder(16) << i).str_moved();
+            winpty_t *const wp = sessions[i];
+            // Each call frees its own error, so a dead agent only marks the
+            // session down.
+            session.up =
+                winpty_get_stats(wp, session.stats, WINPTY_STAT_COUNT,
+                                 nullptr) != 0 &&
+                winpty_get_histograms(
+                    wp, session.histograms,
+                    WINPTY_HISTOGRAM_COUNT * WINPTY_HISTOGRAM_BUCKETS,
+                    nullptr) != 0 &&
+                winpty_get_console_api_stats(
+                    wp, session.consoleApis,
+                    WINPTY_CONSOLE_API_COUNT * WINPTY_CONSOLE_API_COLUMNS,
+                    nullptr) != 0;
+        }
+        std::unique_ptr<winpty_metrics_t> metrics(new winpty_metrics_t);
+        StringBuilder out(4096);
+        if (format == WINPTY_METRICS_PROMETHEUS) {
+            formatPrometheus(polled, out);
+        } else {
+            formatCsv(polled, format == WINPTY_METRICS_CSV, out);
+        }
+        metrics->text = out.str_moved();
+        return metrics.release();
+    } API_CATCH(nullptr)
+}
+
+WINPTY_API const char *
+winpty_metrics_text(winpty_metrics_t *metrics, size_t *size) {
+    ASSERT(metrics != nullptr && size != nullptr);
+    *size = metrics->text.size();
+    return metrics->text.data();
+}
+
+WINPTY_API void winpty_metrics_free(winpty_metrics_t *metrics) {
+    delete metrics;
+}
+
+// Reads the lines of a GetHistory or GetScreen reply: each is its UTF-8
+// text, then its (byte count, attributes) runs.
+static void readTextLines(ReadBuffer &reply, int32_t lineCount,
+                          std::vector<winpty_history_s::Line> &lines) {
+    lines.resize(lineCount);
+    for (auto &line : lines) {
+        const int32_t textSize = reply.getInt32();
+        if (textSize < 0) {
+            throwWinptyException(L"Agent RPC error: invalid text line");
+        }
+        line.text.resize(textSize);
+        if (textSize > 0) {
+            reply.getRawData(&line.text[0], textSize);
+        }
+        const int32_t runCount = reply.getInt32();
+        if (runCount < 0) {
+            throwWinptyException(L"Agent RPC error: invalid text line");
+        }
+        line.runs.resize(runCount);
+        for (auto &run : line.runs) {
+            run.first = static_cast<uint32_t>(reply.getInt32());
+            run.second = static_cast<WORD>(reply.getInt32());
+        }
+    }
+}
+
+WINPTY_API winpty_history_t *
+winpty_get_history(winpty_t *wp, UINT64 maxLines,
+                   winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        std::unique_ptr<winpty_history_t> history(new winpty_history_t);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(*wp, AgentMsg::GetHistory, requestId);
+        packet.putInt64(static_cast<int64_t>(
+            std::min<UINT64>(maxLines, INT64_MAX)));
+        writePacket(*wp, packet);
+        auto reply = readReply(*wp, requestId);
+
+        history->firstLine = static_cast<uint64_t>(reply.getInt64());
+        const int32_t lineCount = reply.getInt32();
+        if (lineCount < 0) {
+            throwWinptyException(L"Agent RPC error: invalid history size");
+        }
+        readTextLines(reply, lineCount, history->lines);
+        reply.assertEof();
+        rpc.success();
+        return history.release();
+    } API_CATCH(nullptr)
+}
+
+WINPTY_API UINT64 winpty_history_first_line(winpty_history_t *history) {
+    ASSERT(history != nullptr);
+    return history->firstLine;
+}
+
+WINPTY_API size_t winpty_history_line_count(winpty_history_t *history) {
+    ASSERT(history != nullptr);
+    return history->lines.size();
+}
+
+WINPTY_API const char *
+winpty_history_line_text(winpty_history_t *history, size_t line,
+                         size_t *size) {
+    ASSERT(history != nullptr && line < history->lines.size());
+    ASSERT(size != nullptr);
+    const auto &text = history->lines[line].text;
+    *size = text.size();
+    return text.data();
+}
+
+WINPTY_API size_t
+winpty_history_run_count(winpty_history_t *history, size_t line) {
+    ASSERT(history != nullptr && line < history->lines.size());
+    return history->lines[line].runs.size();
+}
+
+WINPTY_API void
+winpty_history_run(winpty_history_t *history, size_t line, size_t run,
+                   size_t *size, WORD *attributes) {
+    ASSERT(history != nullptr && line < history->lines.size());
+    const auto &runs = history->lines[line].runs;
+    ASSERT(run < runs.size() && size != nullptr && attributes != nullptr);
+    *size = runs[run].first;
+    *attributes = runs[run].second;
+}
+
+WINPTY_API void winpty_history_free(winpty_history_t *history) {
+    delete history;
+}
+
+WINPTY_API winpty_screen_t *
+winpty_get_screen(winpty_t *wp, winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        std::unique_ptr<winpty_screen_t> screen(new winpty_screen_t);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(*wp, AgentMsg::GetScreen, requestId);
+        writePacket(*wp, packet);
+        auto reply = readReply(*wp, requestId);
+
+        screen->cols = reply.getInt32();
+        screen->rows = reply.getInt32();
+        screen->cursorX = reply.getInt32();
+        screen->cursorY = reply.getInt32();
+        screen->cursorVisible = reply.getInt32() != 0;
+        const int32_t lineCount = reply.getInt32();
+        if (screen->cols < 0 || screen->rows < 0 ||
+                lineCount != screen->rows) {
+            throwWinptyException(L"Agent RPC error: invalid screen size");
+        }
+        readTextLines(reply, lineCount, screen->lines);
+        reply.assertEof();
+        rpc.success();
+        return screen.release();
+    } API_CATCH(nullptr)
+}
+
+WINPTY_API void
+winpty_screen_size(winpty_screen_t *screen, int *cols, int *rows) {
+    ASSERT(screen != nullptr && cols != nullptr && rows != nullptr);
+    *cols = screen->cols;
+    *rows = screen->rows;
+}
+
+WINPTY_API BOOL
+winpty_screen_cursor(winpty_screen_t *screen, int *x, int *y) {
+    ASSERT(screen != nullptr && x != nullptr && y != nullptr);
+    *x = screen->cursorX;
+    *y = screen->cursorY;
+    return screen->cursorVisible;
+}
+
+WINPTY_API const char *
+winpty_screen_line_text(winpty_screen_t *screen, int row, size_t *size) {
+    ASSERT(screen != nullptr && row >= 0 && row < screen->rows);
+    ASSERT(size != nullptr);
+    const auto &text = screen->lines[row].text;
+    *size = text.size();
+    return text.data();
+}
+
+WINPTY_API size_t winpty_screen_run_count(winpty_screen_t *screen, int row) {
+    ASSERT(screen != nullptr && row >= 0 && row < screen->rows);
+    return screen->lines[row].runs.size();
+}
+
+WINPTY_API void
+winpty_screen_run(winpty_screen_t *screen, int row, size_t run,
+                  size_t *size, WORD *attributes) {
+    ASSERT(screen != nullptr && row >= 0 && row < screen->rows);
+    const auto &runs = screen->lines[row].runs;
+    ASSERT(run < runs.size() && size != nullptr && attributes != nullptr);
+    *size = runs[run].first;
+    *attributes = runs[run].second;
+}
+
+WINPTY_API void winpty_screen_free(winpty_screen_t *screen) {
+    delete screen;
+}
+
+
+
+/*****************************************************************************
+ * winpty agent RPC calls: asynchronous variants */
+
+static std::unique_ptr<winpty_async_result_t>
+newAsyncResult(int64_t requestId, AgentMsg::Type type,
+               winpty_async_callback_t callback, void *userData) {
+    std::unique_ptr<winpty_async_result_t> ret(new winpty_async_result_t);
+    ret->requestId = requestId;
+    ret->type = type;
+    ret->callback = callback;
+    ret->userData = userData;
+    return ret;
+}
+
+WINPTY_API UINT64
+winpty_spawn_async(winpty_t *wp,
+                   const winpty_spawn_config_t *cfg,
+                   BOOL want_process_handle,
+                   BOOL want_thread_handle,
+                   winpty_async_callback_t callback /*OPTIONAL*/,
+                   void *user_data /*OPTIONAL*/,
+                   winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr && cfg != nullptr);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newSpawnPacket(*wp, *cfg,
+                                     want_process_handle != FALSE,
+                                     want_thread_handle != FALSE,
+                                     requestId);
+        auto result = newAsyncResult(
+            requestId, AgentMsg::StartProcess, callback, user_data);
+        result->wantProcess = want_process_handle != FALSE;
+        result->wantThread = want_thread_handle != FALSE;
+        startAsyncRequest(*wp, packet, std::move(result));
+        rpc.success();
+        return requestId;
+    } API_CATCH(0)
+}
+
+WINPTY_API UINT64
+winpty_set_size_async(winpty_t *wp, int cols, int rows,
+                      winpty_async_callback_t callback /*OPTIONAL*/,
+                      void *user_data /*OPTIONAL*/,
+                      winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr && cols > 0 && rows > 0);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(*wp, AgentMsg::SetSize, requestId);
+        SetSizeMsg msg;
+        msg.cols = cols;
+        msg.rows = rows;
+        putAgentMsg(packet, msg);
+        startAsyncRequest(*wp, packet, newAsyncResult(
+            requestId, AgentMsg::SetSize, callback, user_data));
+        rpc.success();
+        return requestId;
+    } API_CATCH(0)
+}
+
+WINPTY_API UINT64
+winpty_get_console_process_list_async(
+        winpty_t *wp,
+        winpty_async_callback_t callback /*OPTIONAL*/,
+        void *user_data /*OPTIONAL*/,
+        winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(
+            *wp, AgentMsg::GetConsoleProcessList, requestId);
+        startAsyncRequest(*wp, packet, newAsyncResult(
+            requestId, AgentMsg::GetConsoleProcessList, callback, user_data));
+        rpc.success();
+        return requestId;
+    } API_CATCH(0)
+}
+
+WINPTY_API UINT64
+winpty_wait_process_list_change_async(
+        winpty_t *wp,
+        UINT64 known_generation,
+        winpty_async_callback_t callback /*OPTIONAL*/,
+        void *user_data /*OPTIONAL*/,
+        winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        LockGuard<Mutex> lock(wp->mutex);
+        RpcOperation rpc(*wp);
+        int64_t requestId = 0;
+        auto packet = newRequestPacket(
+            *wp, AgentMsg::WaitProcessListChange, requestId);
+        packet.putInt64(known_generation);
+        startAsyncRequest(*wp, packet, newAsyncResult(
+            requestId, AgentMsg::WaitProcessListChange, callback, user_data));
+        rpc.success();
+        return requestId;
+    } API_CATCH(0)
+}
+
+WINPTY_API HANDLE winpty_async_event(winpty_t *wp) {
+    ASSERT(wp != nullptr);
+    return wp->readEvent.get();
+}
+
+WINPTY_API winpty_async_result_t *
+winpty_poll_result(winpty_t *wp, winpty_error_ptr_t *err /*OPTIONAL*/) {
+    API_TRY {
+        ASSERT(wp != nullptr);
+        std::vector<std::unique_ptr<winpty_async_result_t>> callbacks;
+        std::unique_ptr<winpty_async_result_t> ret;
+        {
+            LockGuard<Mutex> lock(wp->mutex);
+            // Reset the event before checking the read, so a completion that
+            // races with this call still leaves the event signaled.  While a
+            // synchronous call is reading the pipe, it owns the read and
+            // decodes the replies, and signals the event once it's done.
+            if (wp->readerThread == 0) {
+                ResetEvent(wp->readEvent.get());
+            }
+            if (wp->controlPipe.get() != nullptr && wp->readerThread == 0) {
+                RpcOperation rpc(*wp);
+                std::vector<char> payload;
+                do {
+                    while (takeQueuedPacket(*wp, payload)) {
+                        ReadBuffer reply(std::move(payload));
+                        const int64_t replyId = reply.getInt64();
+                        completeAsyncRequest(*wp, replyId, reply);
+                    }
+                } while (!wp->pendingRequests.empty() &&
+                         pumpControlPipe(*wp, false));
+                rpc.success();
+            }
+            while (!wp->completedResults.empty() && ret == nullptr) {
+                auto result = std::move(wp->completedResults.front());
+                wp->completedResults.pop_front();
+                if (result->callback != nullptr) {
+                    callbacks.push_back(std::move(result));
+                } else {
+                    ret = std::move(result);
+                }
+            }
+            if (!wp->completedResults.empty()) {
+                SetEvent(wp->readEvent.get());
+            }
+        }
+        // Run the callbacks without the lock, so that they can issue more
+        // winpty calls.
+        for (auto &result : callbacks) {
+            result->callback(result.get(), result->userData);
+        }
+        return ret.release();
+    } API_CATCH(nullptr)
+}
+
+WINPTY_API UINT64 winpty_async_result_id(winpty_async_result_t *result) {
+    ASSERT(result != nullptr);
+    return result->requestId;
+}
+
+WINPTY_API winpty_error_ptr_t
+winpty_async_result_error(winpty_async_result_t *result) {
+    ASSERT(result != nullptr);
+    return result->error;
+}
+
+WINPTY_API HANDLE winpty_async_result_take_process(winpty_async_result_t *result) {
+    ASSERT(result != nullptr);
+    return result->process.release();
+}
+
+WINPTY_API HANDLE winpty_async_result_take_thread(winpty_async_result_t *result) {
+    ASSERT(result != nullptr);
+    return result->thread.release();
+}
+
+WINPTY_API DWORD
+winpty_async_result_create_process_error(winpty_async_result_t *result) {
+    ASSERT(result != nullptr);
+    return result->createProcessError;
+}
+
+WINPTY_API int
+winpty_async_result_process_list(winpty_async_result_t *result,
+                                 int *processList, int processCount) {
+    ASSERT(result != nullptr);
+    const auto count = static_cast<int>(result->processList.size());
+    if (count <= processCount) {
+        ASSERT(processList != nullptr || count == 0);
+        std::copy(result->processList.begin(), result->processList.end(),
+                  processList);
+    }
+    return count;
+}
+
+WINPTY_API UINT64
+winpty_async_result_process_list_generation(winpty_async_result_t *result) {
+    ASSERT(result != nullptr);
+    return result->processListGeneration;
+}
+
+WINPTY_API void winpty_async_result_free(winpty_async_result_t *result) {
+    delete result;
 }
 
 WINPTY_API void winpty_free(winpty_t *wp) {
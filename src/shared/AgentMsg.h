@@ -21,15 +21,94 @@
 #ifndef WINPTY_SHARED_AGENT_MSG_H
 #define WINPTY_SHARED_AGENT_MSG_H
 
+#include <stdint.h>
+
+// Each request packet is laid out as [uint64 size][int32 type][int64 id]
+// followed by the type-specific payload.  The agent answers each request
+// with [uint64 size][int64 id][reply payload], in request order, except that
+// a WaitProcessListChange reply waits until the process list changes.
+//
+// The payloads of the requests with a xxxMsg struct below are encoded from
+// it by AgentMsgCodec.h; the rest are encoded by hand.
 struct AgentMsg
 {
     enum Type {
         StartProcess,
         SetSize,
         GetConsoleProcessList,
+        GetStats,
+        GetHistory,
+        Reattach,
+        WaitProcessListChange,
+        SetPriority,
+        SetPaused,
+        GetScreen,
+        GetHistograms,
+        SetScheduling,
+        GrantOutputCredits,
+        AddOutputSubscriber,
+        StartRecording,
+        GetConsoleApiStats,
     };
 };
 
+// The SetPaused payload.
+enum class PauseMode {
+    Running,
+    // Scrape at a low cadence and send only the lines scrolling into the
+    // history.
+    TrackHistory,
+    // Don't scrape at all.
+    Stopped,
+};
+
+// Each message lists its fields, in wire order, for the codec.  Fields are
+// only ever added at the end, with a default for when an older peer omits
+// them.
+struct SetSizeMsg {
+    static const AgentMsg::Type kType = AgentMsg::SetSize;
+    int32_t cols = 0;
+    int32_t rows = 0;
+    template <typename Self, typename Visitor>
+    static void fields(Self &self, Visitor &v) { v(self.cols); v(self.rows); }
+};
+
+struct SetPriorityMsg {
+    static const AgentMsg::Type kType = AgentMsg::SetPriority;
+    int32_t level = 0;
+    template <typename Self, typename Visitor>
+    static void fields(Self &self, Visitor &v) { v(self.level); }
+};
+
+struct SetPausedMsg {
+    static const AgentMsg::Type kType = AgentMsg::SetPaused;
+    int32_t mode = 0;   // A PauseMode
+    template <typename Self, typename Visitor>
+    static void fields(Self &self, Visitor &v) { v(self.mode); }
+};
+
+struct SetSchedulingMsg {
+    static const AgentMsg::Type kType = AgentMsg::SetScheduling;
+    int32_t schedulingClass = 0;
+    uint64_t affinityMask = 0;
+    template <typename Self, typename Visitor>
+    static void fields(Self &self, Visitor &v) {
+        v(self.schedulingClass);
+        v(self.affinityMask);
+    }
+};
+
+struct GrantOutputCreditsMsg {
+    static const AgentMsg::Type kType = AgentMsg::GrantOutputCredits;
+    uint64_t bytes = 0;
+    uint64_t frames = 0;
+    template <typename Self, typename Visitor>
+    static void fields(Self &self, Visitor &v) {
+        v(self.bytes);
+        v(self.frames);
+    }
+};
+
 enum class StartProcessResult {
     CreateProcessFailed,
     ProcessCreated,
@@ -0,0 +1,138 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_SHARED_AGENT_MSG_CODEC_H
+#define WINPTY_SHARED_AGENT_MSG_CODEC_H
+
+// Encodes and decodes the xxxMsg structs of AgentMsg.h from their field
+// lists.  A message is written as its field count, then each field as a
+// varint or a UTF-8 string.  The count lets the two ends differ in version:
+// the decoder leaves the fields an older sender omitted at their defaults,
+// and skips the ones a newer sender added.  Decoding doesn't allocate;
+// strings point into the packet.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "AgentMsg.h"
+#include "Buffer.h"
+
+struct Utf8View {
+    const char *data = nullptr;
+    size_t size = 0;
+};
+
+namespace agent_msg_codec {
+
+class FieldCounter {
+public:
+    template <typename T> void operator()(const T &) { ++count; }
+    int64_t count = 0;
+};
+
+class FieldEncoder {
+public:
+    explicit FieldEncoder(WriteBuffer &buf) : m_buf(buf) {}
+    void operator()(int32_t v) { m_buf.putVarInt(v); }
+    void operator()(int64_t v) { m_buf.putVarInt(v); }
+    void operator()(uint64_t v) {
+        m_buf.putVarInt(static_cast<int64_t>(v));
+    }
+    void operator()(bool v) { m_buf.putVarInt(v ? 1 : 0); }
+    void operator()(const Utf8View &v) { m_buf.putUtf8String(v.data, v.size); }
+private:
+    WriteBuffer &m_buf;
+};
+
+class FieldDecoder {
+public:
+    FieldDecoder(ReadBuffer &buf, int64_t count) :
+        m_buf(buf), m_remaining(count) {}
+    void operator()(int32_t &v) {
+        if (take()) {
+            const int64_t i = m_buf.getVarInt();
+            if (i < INT32_MIN || i > INT32_MAX) {
+                throw ReadBuffer::DecodeError();
+            }
+            v = static_cast<int32_t>(i);
+        }
+    }
+    void operator()(int64_t &v) {
+        if (take()) {
+            v = m_buf.getVarInt();
+        }
+    }
+    void operator()(uint64_t &v) {
+        if (take()) {
+            v = static_cast<uint64_t>(m_buf.getVarInt());
+        }
+    }
+    void operator()(bool &v) {
+        if (take()) {
+            v = m_buf.getVarInt() != 0;
+        }
+    }
+    void operator()(Utf8View &v) {
+        if (take()) {
+            m_buf.getUtf8String(v.data, v.size);
+        }
+    }
+    void skipRest() {
+        for (; m_remaining > 0; --m_remaining) {
+            m_buf.skipValue();
+        }
+    }
+private:
+    bool take() {
+        if (m_remaining == 0) {
+            return false;
+        }
+        --m_remaining;
+        return true;
+    }
+    ReadBuffer &m_buf;
+    int64_t m_remaining;
+};
+
+} // namespace agent_msg_codec
+
+template <typename Msg>
+void putAgentMsg(WriteBuffer &buf, const Msg &msg) {
+    agent_msg_codec::FieldCounter counter;
+    Msg::fields(msg, counter);
+    buf.putVarInt(counter.count);
+    agent_msg_codec::FieldEncoder encoder(buf);
+    Msg::fields(msg, encoder);
+}
+
+// Decodes the rest of the packet as msg.
+template <typename Msg>
+void getAgentMsg(ReadBuffer &buf, Msg &msg) {
+    const int64_t count = buf.getVarInt();
+    if (count < 0) {
+        throw ReadBuffer::DecodeError();
+    }
+    agent_msg_codec::FieldDecoder decoder(buf, count);
+    Msg::fields(msg, decoder);
+    decoder.skipRest();
+    buf.assertEof();
+}
+
+#endif // WINPTY_SHARED_AGENT_MSG_CODEC_H
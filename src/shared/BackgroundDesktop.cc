@@ -87,11 +87,17 @@ BackgroundDesktop::BackgroundDesktop() {
     }
 }
 
-void BackgroundDesktop::dispose() WINPTY_NOEXCEPT {
+// Switch the process back to its original window station, but keep the new
+// window station and desktop open.
+void BackgroundDesktop::restoreOriginalStation() WINPTY_NOEXCEPT {
     if (m_originalStation != nullptr) {
         SetProcessWindowStation(m_originalStation);
         m_originalStation = nullptr;
     }
+}
+
+void BackgroundDesktop::dispose() WINPTY_NOEXCEPT {
+    restoreOriginalStation();
     if (m_newDesktop != nullptr) {
         CloseDesktop(m_newDesktop);
         m_newDesktop = nullptr;
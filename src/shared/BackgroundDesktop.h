@@ -32,6 +32,7 @@ public:
     BackgroundDesktop();
     ~BackgroundDesktop() { dispose(); }
     void dispose() WINPTY_NOEXCEPT;
+    void restoreOriginalStation() WINPTY_NOEXCEPT;
     const std::wstring &desktopName() const { return m_newDesktopName; }
 
     BackgroundDesktop(const BackgroundDesktop &other) = delete;
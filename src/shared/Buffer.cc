@@ -35,7 +35,10 @@
         }                                                       \
     } while (false)
 
-enum class Piece : uint8_t { Int32, Int64, WString };
+enum class Piece : uint8_t { Int32, Int64, WString, VarInt, Utf8String };
+
+// LEB128 needs at most 10 bytes for 64 bits.
+static const int kMaxVarIntBytes = 10;
 
 void WriteBuffer::putRawData(const void *data, size_t len) {
     const auto p = reinterpret_cast<const char*>(data);
@@ -65,10 +68,36 @@ void WriteBuffer::putWString(const wchar_t *str, size_t len) {
     putRawData(str, sizeof(wchar_t) * len);
 }
 
+static void putRawVarInt(WriteBuffer &buf, uint64_t u) {
+    uint8_t enc[kMaxVarIntBytes];
+    size_t len = 0;
+    do {
+        enc[len] = static_cast<uint8_t>(u & 0x7F);
+        u >>= 7;
+        if (u != 0) {
+            enc[len] |= 0x80;
+        }
+        ++len;
+    } while (u != 0);
+    buf.putRawData(enc, len);
+}
+
+void WriteBuffer::putVarInt(int64_t i) {
+    putRawValue(Piece::VarInt);
+    const uint64_t u = static_cast<uint64_t>(i);
+    putRawVarInt(*this, (u << 1) ^ (i < 0 ? ~static_cast<uint64_t>(0) : 0));
+}
+
+void WriteBuffer::putUtf8String(const char *str, size_t len) {
+    putRawValue(Piece::Utf8String);
+    putRawVarInt(*this, len);
+    putRawData(str, len);
+}
+
 void ReadBuffer::getRawData(void *data, size_t len) {
-    ASSERT(m_off <= m_buf.size());
-    READ_BUFFER_CHECK(len <= m_buf.size() - m_off);
-    const char *const inp = &m_buf[m_off];
+    ASSERT(m_off <= m_size);
+    READ_BUFFER_CHECK(len <= m_size - m_off);
+    const char *const inp = m_data + m_off;
     std::copy(inp, inp + len, reinterpret_cast<char*>(data));
     m_off += len;
 }
@@ -88,7 +117,7 @@ std::wstring ReadBuffer::getWString() {
     const uint64_t charLen = getRawValue<uint64_t>();
     READ_BUFFER_CHECK(charLen <= SIZE_MAX / sizeof(wchar_t));
     // To be strictly conforming, we can't use the convenient wstring
-    // constructor, because the string in m_buf mightn't be aligned.
+    // constructor, because the string in the buffer mightn't be aligned.
     std::wstring ret;
     if (charLen > 0) {
         const size_t byteLen = charLen * sizeof(wchar_t);
@@ -98,6 +127,67 @@ std::wstring ReadBuffer::getWString() {
     return ret;
 }
 
+void ReadBuffer::getWStringWithNul(std::vector<wchar_t> &out) {
+    READ_BUFFER_CHECK(getRawValue<Piece>() == Piece::WString);
+    const uint64_t charLen = getRawValue<uint64_t>();
+    READ_BUFFER_CHECK(charLen < SIZE_MAX / sizeof(wchar_t));
+    out.resize(charLen + 1);
+    if (charLen > 0) {
+        getRawData(out.data(), charLen * sizeof(wchar_t));
+    }
+    out[charLen] = L'\0';
+}
+
+uint64_t ReadBuffer::getRawVarInt() {
+    uint64_t ret = 0;
+    for (int i = 0; i < kMaxVarIntBytes; ++i) {
+        const uint8_t byte = getRawValue<uint8_t>();
+        ret |= static_cast<uint64_t>(byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            return ret;
+        }
+    }
+    READ_BUFFER_CHECK(false && "varint too long");
+    return 0;
+}
+
+int64_t ReadBuffer::getVarInt() {
+    READ_BUFFER_CHECK(getRawValue<Piece>() == Piece::VarInt);
+    const uint64_t u = getRawVarInt();
+    return static_cast<int64_t>((u >> 1) ^ (~(u & 1) + 1));
+}
+
+void ReadBuffer::getUtf8String(const char *&str, size_t &len) {
+    READ_BUFFER_CHECK(getRawValue<Piece>() == Piece::Utf8String);
+    const uint64_t byteLen = getRawVarInt();
+    ASSERT(m_off <= m_size);
+    READ_BUFFER_CHECK(byteLen <= m_size - m_off);
+    str = m_data + m_off;
+    len = static_cast<size_t>(byteLen);
+    m_off += len;
+}
+
+void ReadBuffer::skipValue() {
+    uint64_t len = 0;
+    switch (getRawValue<Piece>()) {
+    case Piece::Int32:      len = sizeof(int32_t); break;
+    case Piece::Int64:      len = sizeof(int64_t); break;
+    case Piece::VarInt:     getRawVarInt(); return;
+    case Piece::Utf8String: len = getRawVarInt(); break;
+    case Piece::WString: {
+        const uint64_t charLen = getRawValue<uint64_t>();
+        READ_BUFFER_CHECK(charLen <= SIZE_MAX / sizeof(wchar_t));
+        len = charLen * sizeof(wchar_t);
+        break;
+    }
+    default:
+        READ_BUFFER_CHECK(false && "unknown value type");
+    }
+    ASSERT(m_off <= m_size);
+    READ_BUFFER_CHECK(len <= m_size - m_off);
+    m_off += static_cast<size_t>(len);
+}
+
 void ReadBuffer::assertEof() {
-    READ_BUFFER_CHECK(m_off == m_buf.size());
+    READ_BUFFER_CHECK(m_off == m_size);
 }
@@ -52,8 +52,17 @@ public:
     void putWString(const wchar_t *str, size_t len);
     void putWString(const wchar_t *str)         { putWString(str, wcslen(str)); }
     void putWString(const std::wstring &str)    { putWString(str.data(), str.size()); }
+    // A zigzag-encoded LEB128 integer: small values of either sign take one
+    // or two bytes after the tag.
+    void putVarInt(int64_t i);
+    void putUtf8String(const char *str, size_t len);
     std::vector<char> &buf()                    { return m_buf; }
 
+    // Empties the buffer but keeps its storage, so a buffer reused for every
+    // packet stops allocating once it's big enough.
+    void clear()                                { m_buf.clear(); }
+    void reserve(size_t size)                   { m_buf.reserve(size); }
+
     // MSVC 2013 does not generate these automatically, so help it out.
     WriteBuffer(WriteBuffer &&other) : m_buf(std::move(other.m_buf)) {}
     WriteBuffer &operator=(WriteBuffer &&other) {
@@ -72,10 +81,19 @@ public:
 
 private:
     std::vector<char> m_buf;
+    const char *m_data = nullptr;
+    size_t m_size = 0;
     size_t m_off = 0;
 
+    uint64_t getRawVarInt();
+
 public:
-    explicit ReadBuffer(std::vector<char> &&buf) : m_buf(std::move(buf)) {}
+    explicit ReadBuffer(std::vector<char> &&buf) :
+        m_buf(std::move(buf)), m_data(m_buf.data()), m_size(m_buf.size()) {}
+
+    // A non-owning view.  The caller keeps the bytes alive and unchanged
+    // until it's done decoding.
+    ReadBuffer(const char *data, size_t size) : m_data(data), m_size(size) {}
 
     template <typename T> T getRawValue() {
         T ret = {};
@@ -87,13 +105,26 @@ public:
     int32_t getInt32();
     int64_t getInt64();
     std::wstring getWString();
+    // Decodes a string into out, followed by a NUL terminator, without an
+    // intermediate std::wstring.
+    void getWStringWithNul(std::vector<wchar_t> &out);
+    int64_t getVarInt();
+    // Points str into the buffer, without copying.  The string isn't NUL
+    // terminated.
+    void getUtf8String(const char *&str, size_t &len);
+    // Skips one value of any type, e.g. a field added by a newer sender.
+    void skipValue();
+    bool atEof() const { return m_off == m_size; }
     void assertEof();
 
     // MSVC 2013 does not generate these automatically, so help it out.
     ReadBuffer(ReadBuffer &&other) :
-        m_buf(std::move(other.m_buf)), m_off(other.m_off) {}
+        m_buf(std::move(other.m_buf)),
+        m_data(other.m_data), m_size(other.m_size), m_off(other.m_off) {}
     ReadBuffer &operator=(ReadBuffer &&other) {
         m_buf = std::move(other.m_buf);
+        m_data = other.m_data;
+        m_size = other.m_size;
         m_off = other.m_off;
         return *this;
     }
@@ -28,6 +28,7 @@
 #include <algorithm>
 #include <string>
 
+#include "LockFreeQueue.h"
 #include "winpty_snprintf.h"
 
 const wchar_t *const kPipeName = L"\\\\.\\pipe\\DebugServer";
@@ -50,7 +51,84 @@ private:
 
 } // anonymous namespace
 
-static void sendToDebugServer(const char *message)
+/*****************************************************************************
+ * Trace ring buffer
+ *
+ * trace() formats each message into a slot of a fixed-size ring, and a
+ * background thread sends the queued messages to the debugserver in batches
+ * over one connection, which it keeps open while messages are flowing.  The
+ * calling thread never waits on the pipe.  When the ring is full, messages
+ * are dropped and counted.
+ *
+ * The ring is a bounded multi-producer queue in the style of Dmitry
+ * Vyukov's: each slot carries a sequence number telling producers and the
+ * consumer whose turn it is.  With the trace_dump flag, the ring lives in a
+ * file mapping (%TEMP%\winpty-trace-<pid>.bin), so the most recent messages
+ * survive a crash.  The file is a TraceRingHeader followed by the slots;
+ * a slot's text is whichever message last occupied it.
+ *
+ * When the server acknowledges the first batch with "OKP", it is the
+ * pipelining debugserver: later batches are written without waiting, and
+ * the flusher collects the acknowledgements as they accumulate.  Other
+ * servers (e.g. misc/DebugServer.py) get one round trip per batch.
+ *
+ * The trace_sync flag restores the old behavior of sending each message
+ * synchronously, over a connection kept open between messages. */
+
+namespace {
+
+const LONG kTraceRingSlotCount = 1024;  // Must be a power of two.
+const int kTraceRingSlotSize = 1024;    // trace()'s formatted message limit
+const DWORD kTraceFlushIntervalMs = 50;
+const DWORD kTraceBatchSize = 4096;     // DebugServer's message size limit
+const DWORD kTraceConnectTimeoutMs = 1000;
+// Batches written before the flusher waits for the server to catch up.
+const DWORD kTraceMaxUnackedBatches = 32;
+
+struct TraceRingHeader {
+    char magic[8];
+    LONG slotCount;
+    LONG slotSize;
+    volatile LONG enqueuePos;
+    volatile LONG dropped;
+};
+
+struct TraceRingSlot {
+    volatile LONG seq;
+    char text[kTraceRingSlotSize];
+};
+
+struct TraceRing {
+    TraceRingHeader header;
+    TraceRingSlot slots[kTraceRingSlotCount];
+};
+
+enum TraceRingState : LONG {
+    kTraceRingUninit, kTraceRingStarting, kTraceRingReady, kTraceRingOff
+};
+
+volatile LONG g_traceRingState = kTraceRingUninit;
+TraceRing *g_traceRing = nullptr;
+// Producers wake the flusher only when it's about to sleep on an empty ring.
+// Never freed, because trace() can run during static destruction.
+QueueWaker *g_traceWaker = nullptr;
+
+// The consumer state is only touched with g_traceFlushLock held.
+CRITICAL_SECTION g_traceFlushLock;
+LONG g_traceDequeuePos = 0;
+LONG g_traceDroppedReported = 0;
+HANDLE g_tracePipe = INVALID_HANDLE_VALUE;
+bool g_tracePipelined = false;
+DWORD g_traceUnacked = 0;
+
+// The trace_sync connection, guarded by a spin lock, because trace() may run
+// before any static initialization does.
+volatile LONG g_syncPipeLock = 0;
+HANDLE g_syncPipe = INVALID_HANDLE_VALUE;
+
+} // anonymous namespace
+
+static HANDLE connectToDebugServer(DWORD busyTimeoutMs)
 {
     HANDLE tracePipe = INVALID_HANDLE_VALUE;
 
@@ -68,17 +146,338 @@ static void sendToDebugServer(const char *message)
             NULL);
     } while (tracePipe == INVALID_HANDLE_VALUE &&
              GetLastError() == ERROR_PIPE_BUSY &&
-             WaitNamedPipeW(kPipeName, NMPWAIT_WAIT_FOREVER));
+             WaitNamedPipeW(kPipeName, busyTimeoutMs));
 
     if (tracePipe != INVALID_HANDLE_VALUE) {
         DWORD newMode = PIPE_READMODE_MESSAGE;
         SetNamedPipeHandleState(tracePipe, &newMode, NULL, NULL);
+    }
+    return tracePipe;
+}
+
+// Sends a message and waits for the acknowledgement.  Returns false if the
+// connection failed; otherwise, sets pipelined if the server accepts
+// messages without waiting.
+static bool transactMessage(HANDLE tracePipe, const char *message, DWORD size,
+                            bool *pipelined=nullptr)
+{
+    char response[16];
+    DWORD actual = 0;
+    if (!TransactNamedPipe(tracePipe,
+            const_cast<char*>(message), size,
+            response, sizeof(response), &actual, NULL)) {
+        return false;
+    }
+    if (pipelined != nullptr) {
+        *pipelined = (actual == 3 && memcmp(response, "OKP", 3) == 0);
+    }
+    return true;
+}
+
+static void closePipe(HANDLE &pipe)
+{
+    if (pipe != INVALID_HANDLE_VALUE) {
+        CloseHandle(pipe);
+        pipe = INVALID_HANDLE_VALUE;
+    }
+}
+
+static void sendToDebugServer(const char *message)
+{
+    while (InterlockedExchange(&g_syncPipeLock, 1) != 0) {
+        Sleep(0);
+    }
+    // A server that disconnects after each message breaks the connection,
+    // so reconnect once.
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (g_syncPipe == INVALID_HANDLE_VALUE) {
+            g_syncPipe = connectToDebugServer(NMPWAIT_WAIT_FOREVER);
+            if (g_syncPipe == INVALID_HANDLE_VALUE) {
+                break;
+            }
+        }
+        if (transactMessage(g_syncPipe, message, strlen(message))) {
+            break;
+        }
+        closePipe(g_syncPipe);
+    }
+    InterlockedExchange(&g_syncPipeLock, 0);
+}
+
+static void closeTraceConnection()
+{
+    closePipe(g_tracePipe);
+    g_tracePipelined = false;
+    g_traceUnacked = 0;
+}
+
+// Reads the acknowledgements that have arrived, and waits for more while
+// more than maxUnacked batches are outstanding.
+static bool collectTraceAcks(DWORD maxUnacked)
+{
+    while (g_traceUnacked > 0) {
+        DWORD available = 0;
+        if (!PeekNamedPipe(g_tracePipe, NULL, 0, NULL, &available, NULL)) {
+            return false;
+        }
+        if (available == 0 && g_traceUnacked <= maxUnacked) {
+            break;
+        }
         char response[16];
         DWORD actual = 0;
-        TransactNamedPipe(tracePipe,
-            const_cast<char*>(message), strlen(message),
-            response, sizeof(response), &actual, NULL);
-        CloseHandle(tracePipe);
+        if (!ReadFile(g_tracePipe, response, sizeof(response), &actual,
+                      NULL)) {
+            return false;
+        }
+        --g_traceUnacked;
+    }
+    return true;
+}
+
+// Sends a batch of newline-separated messages over the persistent
+// connection, reconnecting once if the server dropped it.  If there is no
+// server, the batch is discarded, as with the synchronous path.
+static void sendTraceBatch(const std::string &batch)
+{
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (g_tracePipe == INVALID_HANDLE_VALUE) {
+            g_tracePipe = connectToDebugServer(kTraceConnectTimeoutMs);
+            if (g_tracePipe == INVALID_HANDLE_VALUE) {
+                return;
+            }
+        }
+        if (!g_tracePipelined) {
+            if (transactMessage(g_tracePipe, batch.data(), batch.size(),
+                                &g_tracePipelined)) {
+                return;
+            }
+        } else {
+            DWORD actual = 0;
+            if (WriteFile(g_tracePipe, batch.data(), batch.size(), &actual,
+                          NULL) && actual == batch.size()) {
+                ++g_traceUnacked;
+                if (collectTraceAcks(kTraceMaxUnackedBatches)) {
+                    return;
+                }
+            }
+        }
+        closeTraceConnection();
+    }
+}
+
+// Sends every queued message.  Returns false if the ring was empty.
+static bool drainTraceRing()
+{
+    TraceRing &ring = *g_traceRing;
+    std::string batch;
+    bool sentAny = false;
+    const auto appendLine = [&](const char *text) {
+        const size_t len = strlen(text);
+        if (!batch.empty() && batch.size() + 1 + len > kTraceBatchSize) {
+            sendTraceBatch(batch);
+            batch.clear();
+        }
+        if (!batch.empty()) {
+            batch.push_back('\n');
+        }
+        batch.append(text, len);
+        sentAny = true;
+    };
+    while (true) {
+        TraceRingSlot &slot =
+            ring.slots[g_traceDequeuePos & (kTraceRingSlotCount - 1)];
+        const LONG seq = slot.seq;
+        MemoryBarrier();
+        if (seq != static_cast<LONG>(g_traceDequeuePos + 1)) {
+            break;
+        }
+        appendLine(slot.text);
+        MemoryBarrier();
+        slot.seq =
+            static_cast<LONG>(g_traceDequeuePos + kTraceRingSlotCount);
+        ++g_traceDequeuePos;
+    }
+    const LONG dropped = ring.header.dropped;
+    if (dropped != g_traceDroppedReported) {
+        char text[64];
+        winpty_snprintf(text, "[trace: %ld messages dropped]",
+                        static_cast<long>(dropped - g_traceDroppedReported));
+        appendLine(text);
+        g_traceDroppedReported = dropped;
+    }
+    if (!batch.empty()) {
+        sendTraceBatch(batch);
+    }
+    return sentAny;
+}
+
+// Checked with the flush lock held, so a concurrent traceFlush can't move
+// the dequeue position under the check.
+static bool traceRingEmpty()
+{
+    EnterCriticalSection(&g_traceFlushLock);
+    const TraceRingSlot &slot =
+        g_traceRing->slots[g_traceDequeuePos & (kTraceRingSlotCount - 1)];
+    const bool empty = slot.seq != static_cast<LONG>(g_traceDequeuePos + 1);
+    LeaveCriticalSection(&g_traceFlushLock);
+    return empty;
+}
+
+static DWORD WINAPI traceFlusherThread(LPVOID)
+{
+    while (true) {
+        // While connected, wake periodically so an idle connection gets
+        // closed.
+        g_traceWaker->wait(g_tracePipe != INVALID_HANDLE_VALUE
+                               ? kTraceFlushIntervalMs : INFINITE,
+                           traceRingEmpty);
+        EnterCriticalSection(&g_traceFlushLock);
+        if (!drainTraceRing()) {
+            // Let other processes use the (possibly single-instance)
+            // server while this one is quiet.
+            closeTraceConnection();
+        }
+        LeaveCriticalSection(&g_traceFlushLock);
+    }
+    return 0;
+}
+
+static void flushTraceRingAtExit()
+{
+    // At process exit, the flusher thread may have been terminated while
+    // holding the lock.
+    if (TryEnterCriticalSection(&g_traceFlushLock)) {
+        drainTraceRing();
+        closeTraceConnection();
+        LeaveCriticalSection(&g_traceFlushLock);
+    }
+}
+
+static TraceRing *mapTraceDumpFile()
+{
+    wchar_t dir[MAX_PATH];
+    const DWORD dirLen = GetTempPathW(MAX_PATH, dir);
+    if (dirLen == 0 || dirLen >= MAX_PATH) {
+        return nullptr;
+    }
+    char name[64];
+    winpty_snprintf(name, "winpty-trace-%u.bin",
+                    static_cast<unsigned>(GetCurrentProcessId()));
+    std::wstring path(dir, dirLen);
+    path.append(name, name + strlen(name));
+    const HANDLE file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE,
+                                    FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                                    FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return nullptr;
+    }
+    const HANDLE mapping = CreateFileMappingW(
+        file, NULL, PAGE_READWRITE, 0, sizeof(TraceRing), NULL);
+    CloseHandle(file);
+    if (mapping == NULL) {
+        return nullptr;
+    }
+    void *view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0,
+                               sizeof(TraceRing));
+    CloseHandle(mapping);
+    if (view != nullptr) {
+        memset(view, 0, sizeof(TraceRing));
+    }
+    return static_cast<TraceRing*>(view);
+}
+
+static bool startTraceRing()
+{
+    if (hasDebugFlag("trace_sync")) {
+        return false;
+    }
+    TraceRing *ring = nullptr;
+    if (hasDebugFlag("trace_dump")) {
+        ring = mapTraceDumpFile();
+    }
+    if (ring == nullptr) {
+        ring = static_cast<TraceRing*>(
+            VirtualAlloc(NULL, sizeof(TraceRing), MEM_COMMIT | MEM_RESERVE,
+                         PAGE_READWRITE));
+        if (ring == nullptr) {
+            return false;
+        }
+    }
+    memcpy(ring->header.magic, "WPTRING1", 8);
+    ring->header.slotCount = kTraceRingSlotCount;
+    ring->header.slotSize = kTraceRingSlotSize;
+    for (LONG i = 0; i < kTraceRingSlotCount; ++i) {
+        ring->slots[i].seq = i;
+    }
+    g_traceWaker = new QueueWaker;
+    if (!g_traceWaker->valid()) {
+        return false;
+    }
+    InitializeCriticalSection(&g_traceFlushLock);
+    g_traceRing = ring;
+    HANDLE thread = CreateThread(NULL, 0, traceFlusherThread, NULL, 0, NULL);
+    if (thread == NULL) {
+        return false;
+    }
+    CloseHandle(thread);
+    atexit(flushTraceRingAtExit);
+    return true;
+}
+
+// Queues the message for the flusher thread.  Returns false if the ring is
+// unavailable, in which case the caller sends the message itself.
+static bool enqueueTraceMessage(const char *message)
+{
+    LONG state = g_traceRingState;
+    if (state == kTraceRingUninit) {
+        state = InterlockedCompareExchange(
+            &g_traceRingState, kTraceRingStarting, kTraceRingUninit);
+        if (state == kTraceRingUninit) {
+            state = startTraceRing() ? kTraceRingReady : kTraceRingOff;
+            InterlockedExchange(&g_traceRingState, state);
+        }
+    }
+    if (state != kTraceRingReady) {
+        return false;
+    }
+
+    TraceRing &ring = *g_traceRing;
+    LONG pos = ring.header.enqueuePos;
+    TraceRingSlot *slot = nullptr;
+    while (true) {
+        slot = &ring.slots[pos & (kTraceRingSlotCount - 1)];
+        const LONG seq = slot->seq;
+        MemoryBarrier();
+        const LONG diff = static_cast<LONG>(
+            static_cast<unsigned long>(seq) - static_cast<unsigned long>(pos));
+        if (diff == 0) {
+            const LONG prev = InterlockedCompareExchange(
+                &ring.header.enqueuePos, pos + 1, pos);
+            if (prev == pos) {
+                break;
+            }
+            pos = prev;
+        } else if (diff < 0) {
+            InterlockedIncrement(&ring.header.dropped);
+            return true;
+        } else {
+            pos = ring.header.enqueuePos;
+        }
+    }
+    strncpy(slot->text, message, kTraceRingSlotSize - 1);
+    slot->text[kTraceRingSlotSize - 1] = '\0';
+    MemoryBarrier();
+    slot->seq = pos + 1;
+    g_traceWaker->notify();
+    return true;
+}
+
+void traceFlush()
+{
+    if (g_traceRingState == kTraceRingReady) {
+        EnterCriticalSection(&g_traceFlushLock);
+        drainTraceRing();
+        LeaveCriticalSection(&g_traceFlushLock);
     }
 }
 
@@ -135,10 +534,33 @@ bool isTracingEnabled()
     }
 }
 
+bool isTraceCategoryEnabled(TraceCategory::Value category)
+{
+    if (!isTracingEnabled()) {
+        return false;
+    }
+    switch (category) {
+    case TraceCategory::Scrape: {
+        static const bool enabled = !hasDebugFlag("trace_no_scrape");
+        return enabled;
+    }
+    case TraceCategory::Input: {
+        static const bool enabled = hasDebugFlag("input");
+        return enabled;
+    }
+    case TraceCategory::Pipe: {
+        static const bool enabled = !hasDebugFlag("trace_no_pipe");
+        return enabled;
+    }
+    }
+    return true;
+}
+
 bool hasDebugFlag(const char *flag)
 {
     if (strchr(flag, ',') != NULL) {
         trace("INTERNAL ERROR: hasDebugFlag flag has comma: '%s'", flag);
+        traceFlush();
         abort();
     }
     const char *const configCStr = getDebugConfig();
@@ -183,5 +605,7 @@ void trace(const char *format, ...)
              message);
     fullMessage[sizeof(fullMessage) - 1] = '\0';
 
-    sendToDebugServer(fullMessage);
+    if (!enqueueTraceMessage(fullMessage)) {
+        sendToDebugServer(fullMessage);
+    }
 }
@@ -26,6 +26,9 @@
 bool isTracingEnabled();
 bool hasDebugFlag(const char *flag);
 void trace(const char *format, ...) WINPTY_SNPRINTF_FORMAT(1, 2);
+// Sends any queued trace messages before returning.  Call it before
+// terminating the process abnormally.
+void traceFlush();
 
 // This macro calls trace without evaluating the arguments.
 #define TRACE(format, ...)                          \
@@ -35,4 +38,45 @@ void trace(const char *format, ...) WINPTY_SNPRINTF_FORMAT(1, 2);
         }                                           \
     } while (false)
 
+// The categories of the traces on hot paths.  A build can compile a
+// category's trace sites out entirely by leaving its bit out of
+// WINPTY_TRACE_CATEGORIES (e.g. -DWINPTY_TRACE_CATEGORIES=0).  At run time,
+// the compiled-in categories also need tracing enabled, and each has a
+// WINPTY_DEBUG flag: Input traces need "input", while Scrape and Pipe traces
+// are on unless "trace_no_scrape" or "trace_no_pipe" is given.
+// (The libwinpty and unix-adapter builds include this header too, so it
+// sticks to C++03.)
+struct TraceCategory {
+    enum Value {
+        Scrape = 1,
+        Input = 2,
+        Pipe = 4
+    };
+};
+
+#ifndef WINPTY_TRACE_CATEGORIES
+#define WINPTY_TRACE_CATEGORIES 0x7u
+#endif
+
+inline bool isTraceCategoryCompiled(TraceCategory::Value category) {
+    return (WINPTY_TRACE_CATEGORIES & static_cast<unsigned>(category)) != 0;
+}
+
+bool isTraceCategoryEnabled(TraceCategory::Value category);
+
+// Whether to trace in the category.  For a compiled-out category, this is
+// a constant false, so the code it guards is dropped.
+inline bool isTraceCategoryOn(TraceCategory::Value category) {
+    return isTraceCategoryCompiled(category) &&
+        isTraceCategoryEnabled(category);
+}
+
+// TRACE for a category, e.g. TRACE_CAT(Scrape, "...", ...).
+#define TRACE_CAT(category, format, ...)                            \
+    do {                                                            \
+        if (isTraceCategoryOn(TraceCategory::category)) {           \
+            trace((format), ## __VA_ARGS__);                        \
+        }                                                           \
+    } while (false)
+
 #endif // DEBUGCLIENT_H
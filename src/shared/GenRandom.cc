@@ -23,11 +23,21 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "DebugClient.h"
+#include "Mutex.h"
 #include "StringBuilder.h"
 
 static volatile LONG g_pipeCounter;
 
+// The pool refills this many bytes at a time.
+static const size_t kPoolBytes = 512;
+
+static Mutex g_sharedMutex;
+// Never freed, so it's usable from static destructors.
+static GenRandom *g_shared = nullptr;
+
 GenRandom::GenRandom() : m_advapi32(L"advapi32.dll") {
     // First try to use the pseudo-documented RtlGenRandom function from
     // advapi32.dll.  Creating a CryptoAPI context is slow, and RtlGenRandom
@@ -47,10 +57,23 @@ GenRandom::GenRandom() : m_advapi32(L"advapi32.dll") {
         return;
     }
 
-    // Fall back to the crypto API.
+    // Fall back to the crypto API.  It's bound here rather than imported,
+    // because it's almost never reached, and every import is resolved when
+    // the process starts.
+    const auto pCryptAcquireContextW =
+        reinterpret_cast<CryptAcquireContextW_t*>(
+            m_advapi32.proc("CryptAcquireContextW"));
+    m_cryptGenRandom = reinterpret_cast<CryptGenRandom_t*>(
+        m_advapi32.proc("CryptGenRandom"));
+    m_cryptReleaseContext = reinterpret_cast<CryptReleaseContext_t*>(
+        m_advapi32.proc("CryptReleaseContext"));
+    if (pCryptAcquireContextW == nullptr || m_cryptGenRandom == nullptr ||
+            m_cryptReleaseContext == nullptr) {
+        return;
+    }
     m_cryptProvIsValid =
-        CryptAcquireContext(&m_cryptProv, nullptr, nullptr,
-                            PROV_RSA_FULL, CRYPT_VERIFYCONTEXT) != 0;
+        pCryptAcquireContextW(&m_cryptProv, nullptr, nullptr,
+                              PROV_RSA_FULL, CRYPT_VERIFYCONTEXT) != 0;
     if (!m_cryptProvIsValid) {
         trace("GenRandom: CryptAcquireContext failed: %u",
             static_cast<unsigned>(GetLastError()));
@@ -59,7 +82,7 @@ GenRandom::GenRandom() : m_advapi32(L"advapi32.dll") {
 
 GenRandom::~GenRandom() {
     if (m_cryptProvIsValid) {
-        CryptReleaseContext(m_cryptProv, 0);
+        m_cryptReleaseContext(m_cryptProv, 0);
     }
 }
 
@@ -75,8 +98,8 @@ bool GenRandom::fillBuffer(void *buffer, size_t size) {
         }
     } else if (m_cryptProvIsValid) {
         success =
-            CryptGenRandom(m_cryptProv, size,
-                           reinterpret_cast<BYTE*>(buffer)) != 0;
+            m_cryptGenRandom(m_cryptProv, size,
+                             reinterpret_cast<BYTE*>(buffer)) != 0;
         if (!success) {
             trace("GenRandom: CryptGenRandom failed, size=%d, lasterror=%u",
                 static_cast<int>(size),
@@ -96,17 +119,39 @@ std::string GenRandom::randomBytes(size_t numBytes) {
     return ret;
 }
 
-std::wstring GenRandom::randomHexString(size_t numBytes) {
-    const std::string bytes = randomBytes(numBytes);
-    std::wstring ret(bytes.size() * 2, L'\0');
-    for (size_t i = 0; i < bytes.size(); ++i) {
+static std::wstring hexString(const uint8_t *bytes, size_t numBytes) {
+    std::wstring ret(numBytes * 2, L'\0');
+    for (size_t i = 0; i < numBytes; ++i) {
         static const wchar_t hex[] = L"0123456789abcdef";
-        ret[i * 2]     = hex[static_cast<uint8_t>(bytes[i]) >> 4];
-        ret[i * 2 + 1] = hex[static_cast<uint8_t>(bytes[i]) & 0xF];
+        ret[i * 2]     = hex[bytes[i] >> 4];
+        ret[i * 2 + 1] = hex[bytes[i] & 0xF];
     }
     return ret;
 }
 
+std::wstring GenRandom::randomHexString(size_t numBytes) {
+    const std::string bytes = randomBytes(numBytes);
+    return hexString(reinterpret_cast<const uint8_t*>(bytes.data()),
+                     bytes.size());
+}
+
+// Copies the next `size` bytes of the pool, refilling it first if it runs
+// short.  Each byte is handed out once.
+bool GenRandom::takePooledBytes(void *buffer, size_t size) {
+    if (m_pool.size() - m_poolPos < size) {
+        m_pool.assign(std::max(kPoolBytes, size), '\0');
+        m_poolPos = 0;
+        if (!fillBuffer(&m_pool[0], m_pool.size())) {
+            m_pool.clear();
+            return false;
+        }
+    }
+    memcpy(buffer, &m_pool[m_poolPos], size);
+    memset(&m_pool[m_poolPos], 0, size);
+    m_poolPos += size;
+    return true;
+}
+
 // Returns a 64-bit value representing the number of 100-nanosecond intervals
 // since January 1, 1601.
 static uint64_t systemTimeAsUInt64() {
@@ -119,6 +164,18 @@ static uint64_t systemTimeAsUInt64() {
 // Generates a unique and hard-to-guess case-insensitive string suitable for
 // use in a pipe filename or a Windows object name.
 std::wstring GenRandom::uniqueName() {
+    return uniqueNameImpl(false);
+}
+
+std::wstring GenRandom::sharedUniqueName() {
+    LockGuard<Mutex> lock(g_sharedMutex);
+    if (g_shared == nullptr) {
+        g_shared = new GenRandom;
+    }
+    return g_shared->uniqueNameImpl(true);
+}
+
+std::wstring GenRandom::uniqueNameImpl(bool pooled) {
     // First include enough information to avoid collisions assuming
     // cooperative software.  This code assumes that a process won't die and
     // be replaced with a recycled PID within a single GetSystemTimeAsFileTime
@@ -130,9 +187,10 @@ std::wstring GenRandom::uniqueName() {
     // It isn't clear to me how the crypto APIs would fail.  It *probably*
     // doesn't matter that much anyway?  In principle, a predictable pipe name
     // is subject to a local denial-of-service attack.
-    auto random = randomHexString(16);
-    if (!random.empty()) {
-        sb << L'-' << random;
+    uint8_t random[16];
+    if (pooled ? takePooledBytes(random, sizeof(random))
+               : fillBuffer(random, sizeof(random))) {
+        sb << L'-' << hexString(random, sizeof(random));
     }
     return sb.str_moved();
 }
@@ -32,11 +32,23 @@
 
 class GenRandom {
     typedef BOOLEAN WINAPI RtlGenRandom_t(PVOID, ULONG);
+    typedef BOOL WINAPI CryptAcquireContextW_t(
+        HCRYPTPROV*, LPCWSTR, LPCWSTR, DWORD, DWORD);
+    typedef BOOL WINAPI CryptGenRandom_t(HCRYPTPROV, DWORD, BYTE*);
+    typedef BOOL WINAPI CryptReleaseContext_t(HCRYPTPROV, DWORD);
 
     OsModule m_advapi32;
     RtlGenRandom_t *m_rtlGenRandom = nullptr;
+    CryptGenRandom_t *m_cryptGenRandom = nullptr;
+    CryptReleaseContext_t *m_cryptReleaseContext = nullptr;
     bool m_cryptProvIsValid = false;
     HCRYPTPROV m_cryptProv = 0;
+    // Random bytes generated ahead of need, for sharedUniqueName.
+    std::string m_pool;
+    size_t m_poolPos = 0;
+
+    bool takePooledBytes(void *buffer, size_t size);
+    std::wstring uniqueNameImpl(bool pooled);
 
 public:
     GenRandom();
@@ -46,6 +58,11 @@ public:
     std::wstring randomHexString(size_t numBytes);
     std::wstring uniqueName();
 
+    // Like uniqueName, but uses a process-wide generator, which avoids the
+    // setup cost of a new one and draws its random bytes from a buffer that's
+    // refilled in bulk.  It's thread-safe.
+    static std::wstring sharedUniqueName();
+
     // Return true if the crypto context was successfully initialized.
     bool valid() const {
         return m_rtlGenRandom != nullptr || m_cryptProvIsValid;
@@ -0,0 +1,102 @@
+// Copyright (c) 2015 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_SHARED_LATENCY_HISTOGRAM_H
+#define WINPTY_SHARED_LATENCY_HISTOGRAM_H
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "../include/winpty_constants.h"
+
+// A fixed-size histogram of durations in microseconds, bucketed as
+// winpty_constants.h describes for WINPTY_HISTOGRAM_BUCKETS.  Recording is
+// an interlocked increment, without locks or allocation, so one thread can
+// record while another reads.  A bucket's count wraps after 2^32 samples.
+class LatencyHistogram {
+public:
+    enum { kBuckets = WINPTY_HISTOGRAM_BUCKETS };
+
+    static int bucketIndex(uint64_t us) {
+        if (us < kLinearBuckets) {
+            return static_cast<int>(us);
+        }
+        // For values with their top bit at 2^e, the bucket is picked by e
+        // and the kSubBucketBits bits below the top bit.
+        int e = kSubBucketBits + 1;
+        for (uint64_t v = us >> (kSubBucketBits + 2); v != 0; v >>= 1) {
+            ++e;
+        }
+        if (e >= kMaxExponent) {
+            return kBuckets - 1;
+        }
+        const int sub = static_cast<int>(
+            (us >> (e - kSubBucketBits)) & (kSubBuckets - 1));
+        return kLinearBuckets + (e - kSubBucketBits - 1) * kSubBuckets + sub;
+    }
+
+    // The smallest duration counted in the bucket.
+    static uint64_t bucketLowerBound(int bucket) {
+        if (bucket < kLinearBuckets) {
+            return static_cast<uint64_t>(bucket);
+        }
+        const int octave = (bucket - kLinearBuckets) / kSubBuckets;
+        const int sub = (bucket - kLinearBuckets) % kSubBuckets;
+        return static_cast<uint64_t>(kSubBuckets + sub) << (octave + 1);
+    }
+
+    void record(uint64_t us) {
+        InterlockedIncrement(&m_counts[bucketIndex(us)]);
+    }
+
+    uint32_t count(int bucket) const {
+        return static_cast<uint32_t>(InterlockedCompareExchange(
+            const_cast<volatile LONG*>(&m_counts[bucket]), 0, 0));
+    }
+
+    // Adds the other histogram's counts, e.g. to keep them after the thread
+    // recording into it goes away.
+    void add(const LatencyHistogram &other) {
+        for (int i = 0; i < kBuckets; ++i) {
+            InterlockedExchangeAdd(&m_counts[i],
+                                   static_cast<LONG>(other.count(i)));
+        }
+    }
+
+private:
+    // Durations below 16us get a bucket each.  Above that, each power of two
+    // is split into 8 buckets, so a bucket's width is at most 1/8 of its
+    // values, up to 2^32us (about 71 minutes).  The last bucket also counts
+    // everything longer.
+    enum {
+        kLinearBuckets = 16,
+        kSubBucketBits = 3,
+        kSubBuckets = 1 << kSubBucketBits,
+        kMaxExponent = 32,
+    };
+    static_assert(kLinearBuckets +
+                      (kMaxExponent - kSubBucketBits - 1) * kSubBuckets ==
+                  kBuckets,
+                  "WINPTY_HISTOGRAM_BUCKETS doesn't match the bucket layout");
+
+    volatile LONG m_counts[kBuckets] = {};
+};
+
+#endif // WINPTY_SHARED_LATENCY_HISTOGRAM_H
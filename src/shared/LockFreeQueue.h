@@ -0,0 +1,216 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_SHARED_LOCK_FREE_QUEUE_H
+#define WINPTY_SHARED_LOCK_FREE_QUEUE_H
+
+#include <windows.h>
+
+#include <utility>
+
+// Lets a queue's consumer sleep when the queue is empty, without producers
+// signalling an event on every push.  The consumer announces that it's about
+// to sleep, then checks the queue once more; a producer signals only when it
+// sees the announcement after publishing an item.  Both sides issue a full
+// barrier between their store and their load, so one of them always sees
+// the other's.
+//
+// An item can still cause one spurious wakeup, which is harmless.
+//
+// This doesn't assert or trace, so the trace code can use it.
+class QueueWaker {
+public:
+    QueueWaker() : m_event(CreateEventW(nullptr, FALSE, FALSE, nullptr)) {}
+    ~QueueWaker() {
+        if (m_event != nullptr) {
+            CloseHandle(m_event);
+        }
+    }
+    bool valid() const { return m_event != nullptr; }
+    HANDLE event() const { return m_event; }
+
+    // Called by the consumer.  isEmpty must check the queue after the
+    // announcement.
+    template <typename IsEmpty>
+    void wait(DWORD timeoutMs, const IsEmpty &isEmpty) {
+        InterlockedExchange(&m_waiting, 1);
+        if (isEmpty()) {
+            WaitForSingleObject(m_event, timeoutMs);
+        }
+        InterlockedExchange(&m_waiting, 0);
+    }
+
+    // Called by a producer after it publishes an item.
+    void notify() {
+        MemoryBarrier();
+        if (m_waiting != 0 && InterlockedExchange(&m_waiting, 0) != 0) {
+            SetEvent(m_event);
+        }
+    }
+
+    QueueWaker(const QueueWaker &other) = delete;
+    QueueWaker &operator=(const QueueWaker &other) = delete;
+
+private:
+    HANDLE m_event;
+    volatile LONG m_waiting = 0;
+};
+
+// A bounded single-producer, single-consumer ring.  Each side owns one
+// index, so neither push nor pop uses an interlocked operation.  The indices
+// run freely and wrap; kCapacity must be a power of two.
+template <typename T, LONG kCapacity>
+class SpscRing {
+    static_assert((kCapacity & (kCapacity - 1)) == 0,
+                  "kCapacity must be a power of two");
+public:
+    // Each returns false if the ring is full.
+    bool push(const T &value) {
+        T copy(value);
+        return push(std::move(copy));
+    }
+    bool push(T &&value) {
+        const LONG tail = m_tail;
+        if (static_cast<LONG>(tail - m_head) == kCapacity) {
+            return false;
+        }
+        m_slots[tail & (kCapacity - 1)] = std::move(value);
+        // Publish the slot before the index.
+        MemoryBarrier();
+        m_tail = tail + 1;
+        m_waker.notify();
+        return true;
+    }
+    // Returns false if the ring is empty.
+    bool pop(T &out) {
+        const LONG head = m_head;
+        if (head == m_tail) {
+            return false;
+        }
+        MemoryBarrier();
+        out = std::move(m_slots[head & (kCapacity - 1)]);
+        // Finish with the slot before handing it back.
+        MemoryBarrier();
+        m_head = head + 1;
+        return true;
+    }
+    bool empty() const { return m_head == m_tail; }
+    // Blocks the consumer until an item may be available.
+    void waitForItem(DWORD timeoutMs=INFINITE) {
+        m_waker.wait(timeoutMs, [this]() { return empty(); });
+    }
+    HANDLE event() const { return m_waker.event(); }
+
+private:
+    // The indices sit on separate cache lines from each other and the slots,
+    // so the two sides don't invalidate each other's lines on every item.
+    volatile LONG m_head = 0;
+    char m_headPad[64 - sizeof(LONG)];
+    volatile LONG m_tail = 0;
+    char m_tailPad[64 - sizeof(LONG)];
+    T m_slots[kCapacity];
+    QueueWaker m_waker;
+};
+
+// A bounded multi-producer, single-consumer queue.  Each slot carries a
+// sequence number saying whose turn it is: a producer claims a slot with
+// one compare-exchange on the enqueue index, fills it, then hands it to the
+// consumer by bumping the slot's sequence.  This is the same scheme as the
+// trace ring in DebugClient.cc, which can't use this class because its
+// layout is fixed by the trace dump file.
+template <typename T, LONG kCapacity>
+class MpscQueue {
+    static_assert((kCapacity & (kCapacity - 1)) == 0,
+                  "kCapacity must be a power of two");
+public:
+    MpscQueue() {
+        for (LONG i = 0; i < kCapacity; ++i) {
+            m_slots[i].seq = i;
+        }
+    }
+    // Returns false if the queue is full.  Safe to call from any thread.
+    bool push(T value) {
+        LONG pos = m_enqueuePos;
+        Slot *slot = nullptr;
+        while (true) {
+            slot = &m_slots[pos & (kCapacity - 1)];
+            const LONG seq = slot->seq;
+            MemoryBarrier();
+            const LONG diff = static_cast<LONG>(
+                static_cast<unsigned long>(seq) -
+                static_cast<unsigned long>(pos));
+            if (diff == 0) {
+                const LONG prev = InterlockedCompareExchange(
+                    &m_enqueuePos, pos + 1, pos);
+                if (prev == pos) {
+                    break;
+                }
+                pos = prev;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = m_enqueuePos;
+            }
+        }
+        slot->value = std::move(value);
+        MemoryBarrier();
+        slot->seq = pos + 1;
+        m_waker.notify();
+        return true;
+    }
+    // Returns false if the queue is empty.  Only the consumer may call it.
+    bool pop(T &out) {
+        Slot &slot = m_slots[m_dequeuePos & (kCapacity - 1)];
+        const LONG seq = slot.seq;
+        MemoryBarrier();
+        if (seq != static_cast<LONG>(m_dequeuePos + 1)) {
+            return false;
+        }
+        out = std::move(slot.value);
+        MemoryBarrier();
+        slot.seq = static_cast<LONG>(m_dequeuePos + kCapacity);
+        ++m_dequeuePos;
+        return true;
+    }
+    // Only the consumer may call these.
+    bool empty() const {
+        return m_slots[m_dequeuePos & (kCapacity - 1)].seq !=
+            static_cast<LONG>(m_dequeuePos + 1);
+    }
+    void waitForItem(DWORD timeoutMs=INFINITE) {
+        m_waker.wait(timeoutMs, [this]() { return empty(); });
+    }
+    HANDLE event() const { return m_waker.event(); }
+
+private:
+    struct Slot {
+        volatile LONG seq;
+        T value;
+    };
+
+    volatile LONG m_enqueuePos = 0;
+    char m_enqueuePad[64 - sizeof(LONG)];
+    LONG m_dequeuePos = 0;
+    char m_dequeuePad[64 - sizeof(LONG)];
+    Slot m_slots[kCapacity];
+    QueueWaker m_waker;
+};
+
+#endif // WINPTY_SHARED_LOCK_FREE_QUEUE_H
@@ -51,4 +51,16 @@ public:
     LockGuard &operator=(const LockGuard &other) = delete;
 };
 
+// Releases a lock the caller holds for the guard's lifetime.
+template <typename T>
+class UnlockGuard {
+    T &m_lock;
+public:
+    UnlockGuard(T &lock) : m_lock(lock)  { m_lock.unlock();  }
+    ~UnlockGuard()                       { m_lock.lock();    }
+
+    UnlockGuard(const UnlockGuard &other) = delete;
+    UnlockGuard &operator=(const UnlockGuard &other) = delete;
+};
+
 #endif // WINPTY_SHARED_MUTEX_H
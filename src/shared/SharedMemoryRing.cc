@@ -0,0 +1,266 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "SharedMemoryRing.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "DebugClient.h"
+#include "StringUtil.h"
+#include "WinptyAssert.h"
+
+namespace {
+
+const uint32_t kMagic = 0x52535057; // "WPSR"
+const uint32_t kVersion = 1;
+const uint32_t kMaxCapacity = 64 * 1024 * 1024;
+const size_t kHeaderSize = 256;
+
+} // anonymous namespace
+
+// The positions are free-running 32-bit counters, so (write - read) is the
+// number of bytes in the ring even after they wrap.  Each side's fields are
+// on their own cache line.
+struct SharedMemoryRing::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    volatile LONG producerClosed;
+    volatile LONG consumerAttached;
+    char pad0[64 - 5 * 4];
+
+    // Written by the producer.
+    volatile LONG writePos;
+    volatile LONG consumerWaiting;
+    char pad1[64 - 2 * 4];
+
+    // Written by the consumer.
+    volatile LONG readPos;
+    volatile LONG producerWaiting;
+    char pad2[64 - 2 * 4];
+};
+
+static inline uint32_t loadPos(volatile LONG &pos) {
+    // An interlocked no-op is a full barrier, so the bytes behind the
+    // position are visible once it is.
+    return static_cast<uint32_t>(InterlockedCompareExchange(&pos, 0, 0));
+}
+
+static inline void storePos(volatile LONG &pos, uint32_t val) {
+    InterlockedExchange(&pos, static_cast<LONG>(val));
+}
+
+static std::wstring dataEventName(const std::wstring &name) {
+    return name + L"-data";
+}
+
+static std::wstring spaceEventName(const std::wstring &name) {
+    return name + L"-space";
+}
+
+std::unique_ptr<SharedMemoryRing> SharedMemoryRing::create(
+        const std::wstring &name, uint32_t capacity) {
+    static_assert(sizeof(Header) <= kHeaderSize,
+                  "SharedMemoryRing header is too large");
+    uint32_t roundedCapacity = 4096;
+    while (roundedCapacity < capacity && roundedCapacity < kMaxCapacity) {
+        roundedCapacity *= 2;
+    }
+    std::unique_ptr<SharedMemoryRing> ret(new SharedMemoryRing);
+    ret->m_name = name;
+    ret->m_capacity = roundedCapacity;
+    ret->m_section = OwnedHandle(CreateFileMappingW(
+        INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0,
+        static_cast<DWORD>(kHeaderSize + roundedCapacity), name.c_str()));
+    if (ret->m_section.get() == nullptr ||
+            GetLastError() == ERROR_ALREADY_EXISTS) {
+        trace("SharedMemoryRing: CreateFileMappingW failed: %u",
+            static_cast<unsigned>(GetLastError()));
+        return nullptr;
+    }
+    // Both events are manual-reset, so a waiter can't consume a signal meant
+    // for another wait on the same event.
+    ret->m_dataEvent = OwnedHandle(CreateEventW(
+        nullptr, TRUE, FALSE, dataEventName(name).c_str()));
+    ret->m_spaceEvent = OwnedHandle(CreateEventW(
+        nullptr, TRUE, FALSE, spaceEventName(name).c_str()));
+    if (ret->m_dataEvent.get() == nullptr ||
+            ret->m_spaceEvent.get() == nullptr) {
+        trace("SharedMemoryRing: CreateEventW failed: %u",
+            static_cast<unsigned>(GetLastError()));
+        return nullptr;
+    }
+    if (!ret->mapView(false)) {
+        return nullptr;
+    }
+    Header &header = *ret->m_header;
+    header.magic = kMagic;
+    header.version = kVersion;
+    header.capacity = roundedCapacity;
+    return ret;
+}
+
+std::unique_ptr<SharedMemoryRing> SharedMemoryRing::open(
+        const std::wstring &name) {
+    std::unique_ptr<SharedMemoryRing> ret(new SharedMemoryRing);
+    ret->m_name = name;
+    ret->m_section = OwnedHandle(OpenFileMappingW(
+        FILE_MAP_READ | FILE_MAP_WRITE, FALSE, name.c_str()));
+    ret->m_dataEvent = OwnedHandle(OpenEventW(
+        SYNCHRONIZE | EVENT_MODIFY_STATE, FALSE, dataEventName(name).c_str()));
+    ret->m_spaceEvent = OwnedHandle(OpenEventW(
+        SYNCHRONIZE | EVENT_MODIFY_STATE, FALSE, spaceEventName(name).c_str()));
+    if (ret->m_section.get() == nullptr ||
+            ret->m_dataEvent.get() == nullptr ||
+            ret->m_spaceEvent.get() == nullptr) {
+        trace("SharedMemoryRing: opening %s failed: %u",
+            utf8FromWide(name).c_str(),
+            static_cast<unsigned>(GetLastError()));
+        return nullptr;
+    }
+    if (!ret->mapView(true)) {
+        return nullptr;
+    }
+    return ret;
+}
+
+bool SharedMemoryRing::mapView(bool validate) {
+    void *view = MapViewOfFile(m_section.get(),
+                               FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+    if (view == nullptr) {
+        trace("SharedMemoryRing: MapViewOfFile failed: %u",
+            static_cast<unsigned>(GetLastError()));
+        return false;
+    }
+    m_header = static_cast<Header*>(view);
+    m_data = static_cast<char*>(view) + kHeaderSize;
+    if (validate) {
+        MEMORY_BASIC_INFORMATION mbi = {};
+        VirtualQuery(view, &mbi, sizeof(mbi));
+        const uint32_t capacity = m_header->capacity;
+        if (m_header->magic != kMagic || m_header->version != kVersion ||
+                capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+                capacity > kMaxCapacity ||
+                mbi.RegionSize < kHeaderSize + capacity) {
+            trace("SharedMemoryRing: %s has an unrecognized layout",
+                utf8FromWide(m_name).c_str());
+            return false;
+        }
+        m_capacity = capacity;
+    }
+    return true;
+}
+
+SharedMemoryRing::~SharedMemoryRing() {
+    if (m_header != nullptr) {
+        UnmapViewOfFile(m_header);
+    }
+}
+
+size_t SharedMemoryRing::write(const void *data, size_t size) {
+    Header &header = *m_header;
+    const uint32_t writePos = static_cast<uint32_t>(header.writePos);
+    const uint32_t used = writePos - loadPos(header.readPos);
+    const size_t amount = std::min<size_t>(size, m_capacity - used);
+    if (amount == 0) {
+        return 0;
+    }
+    const uint32_t offset = writePos & (m_capacity - 1);
+    const size_t first = std::min<size_t>(amount, m_capacity - offset);
+    memcpy(m_data + offset, data, first);
+    memcpy(m_data, static_cast<const char*>(data) + first, amount - first);
+    storePos(header.writePos, writePos + static_cast<uint32_t>(amount));
+    if (InterlockedExchange(&header.consumerWaiting, 0) != 0) {
+        SetEvent(m_dataEvent.get());
+    }
+    return amount;
+}
+
+bool SharedMemoryRing::armSpaceWait() {
+    Header &header = *m_header;
+    ResetEvent(m_spaceEvent.get());
+    InterlockedExchange(&header.producerWaiting, 1);
+    const uint32_t used =
+        static_cast<uint32_t>(header.writePos) - loadPos(header.readPos);
+    if (used < m_capacity) {
+        InterlockedExchange(&header.producerWaiting, 0);
+        return false;
+    }
+    return true;
+}
+
+void SharedMemoryRing::close() {
+    InterlockedExchange(&m_header->producerClosed, 1);
+    InterlockedExchange(&m_header->consumerWaiting, 0);
+    SetEvent(m_dataEvent.get());
+}
+
+bool SharedMemoryRing::consumerAttached() const {
+    return InterlockedCompareExchange(
+        &m_header->consumerAttached, 0, 0) != 0;
+}
+
+void SharedMemoryRing::attach() {
+    InterlockedExchange(&m_header->consumerAttached, 1);
+}
+
+size_t SharedMemoryRing::peek(const char **data) {
+    Header &header = *m_header;
+    const uint32_t readPos = static_cast<uint32_t>(header.readPos);
+    const uint32_t used = loadPos(header.writePos) - readPos;
+    const uint32_t offset = readPos & (m_capacity - 1);
+    *data = m_data + offset;
+    return std::min<size_t>(used, m_capacity - offset);
+}
+
+void SharedMemoryRing::consume(size_t size) {
+    Header &header = *m_header;
+    const uint32_t readPos = static_cast<uint32_t>(header.readPos);
+    ASSERT(size <= loadPos(header.writePos) - readPos);
+    storePos(header.readPos, readPos + static_cast<uint32_t>(size));
+    if (InterlockedExchange(&header.producerWaiting, 0) != 0) {
+        SetEvent(m_spaceEvent.get());
+    }
+}
+
+bool SharedMemoryRing::isEof() {
+    Header &header = *m_header;
+    // Check the flag first: the producer sets it after its last write.
+    const bool closed =
+        InterlockedCompareExchange(&header.producerClosed, 0, 0) != 0;
+    return closed &&
+        loadPos(header.writePos) == static_cast<uint32_t>(header.readPos);
+}
+
+bool SharedMemoryRing::armDataWait() {
+    Header &header = *m_header;
+    ResetEvent(m_dataEvent.get());
+    InterlockedExchange(&header.consumerWaiting, 1);
+    const bool ready =
+        loadPos(header.writePos) != static_cast<uint32_t>(header.readPos) ||
+        InterlockedCompareExchange(&header.producerClosed, 0, 0) != 0;
+    if (ready) {
+        InterlockedExchange(&header.consumerWaiting, 0);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,97 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_SHARED_MEMORY_RING_H
+#define WINPTY_SHARED_MEMORY_RING_H
+
+#include <windows.h>
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+#include "OwnedHandle.h"
+
+// A single-producer, single-consumer byte ring in a named shared memory
+// section, used by WINPTY_FLAG_SHM_OUTPUT to stream CONOUT from the agent to
+// a same-machine client.  In steady state, neither side makes a system call:
+// each side signals the other's event only after the other announced that it
+// is about to wait.
+//
+// The two sides must agree on the layout, so the agent and libwinpty must be
+// built from the same source.  open() checks a version number.
+class SharedMemoryRing {
+public:
+    static const wchar_t *namePrefix() { return L"Local\\winpty-shm-"; }
+
+    // Returns nullptr on failure.  The capacity is rounded up to a power of
+    // two.
+    static std::unique_ptr<SharedMemoryRing> create(
+        const std::wstring &name, uint32_t capacity);
+    static std::unique_ptr<SharedMemoryRing> open(const std::wstring &name);
+    ~SharedMemoryRing();
+
+    const std::wstring &name() const { return m_name; }
+    uint32_t capacity() const { return m_capacity; }
+
+    // Producer side.  write returns the number of bytes that fit.
+    size_t write(const void *data, size_t size);
+    // Call after write returns short: returns false if space appeared in
+    // the meantime, and otherwise the space event is signaled once the
+    // consumer frees some.
+    bool armSpaceWait();
+    HANDLE spaceEvent() { return m_spaceEvent.get(); }
+    // Marks the end of the stream.  The consumer still reads the bytes
+    // already written.
+    void close();
+    bool consumerAttached() const;
+
+    // Consumer side.
+    void attach();
+    // Returns the number of contiguous bytes readable at *data.
+    size_t peek(const char **data);
+    void consume(size_t size);
+    // Returns true once the producer has closed the ring and every byte has
+    // been consumed.
+    bool isEof();
+    // Like armSpaceWait, for the data event.
+    bool armDataWait();
+    HANDLE dataEvent() { return m_dataEvent.get(); }
+
+    SharedMemoryRing(const SharedMemoryRing &other) = delete;
+    SharedMemoryRing &operator=(const SharedMemoryRing &other) = delete;
+
+private:
+    struct Header;
+
+    SharedMemoryRing() {}
+    bool mapView(bool validate);
+
+    std::wstring m_name;
+    OwnedHandle m_section;
+    OwnedHandle m_dataEvent;
+    OwnedHandle m_spaceEvent;
+    Header *m_header = nullptr;
+    char *m_data = nullptr;
+    uint32_t m_capacity = 0;
+};
+
+#endif // WINPTY_SHARED_MEMORY_RING_H
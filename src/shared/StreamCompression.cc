@@ -0,0 +1,277 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "StreamCompression.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace StreamCompression {
+
+namespace {
+
+enum FrameKind : uint8_t { kStoredFrame = 0, kCompressedFrame = 1 };
+
+const size_t kHeaderSize = 9;
+const size_t kMinMatch = 4;
+const size_t kMaxOffset = 0xFFFF;
+const int kHashBits = 13;
+
+uint32_t read32(const char *p) {
+    uint32_t ret;
+    memcpy(&ret, p, sizeof(ret));
+    return ret;
+}
+
+uint32_t hash32(uint32_t value) {
+    return (value * 2654435761u) >> (32 - kHashBits);
+}
+
+void putUint32(char *out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out[i] = static_cast<char>((value >> (i * 8)) & 0xFF);
+    }
+}
+
+uint32_t getUint32(const char *in) {
+    uint32_t ret = 0;
+    for (int i = 0; i < 4; ++i) {
+        ret |= static_cast<uint32_t>(static_cast<uint8_t>(in[i])) << (i * 8);
+    }
+    return ret;
+}
+
+void putLength(std::string &out, size_t length) {
+    while (length >= 255) {
+        out.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+bool getLength(const char *in, size_t size, size_t &pos, size_t &length) {
+    while (true) {
+        if (pos >= size) {
+            return false;
+        }
+        const uint8_t byte = static_cast<uint8_t>(in[pos++]);
+        length += byte;
+        if (byte != 255) {
+            return true;
+        }
+    }
+}
+
+void putToken(std::string &out, const char *literals, size_t literalCount,
+              size_t matchExtra) {
+    out.push_back(static_cast<char>(
+        (std::min<size_t>(literalCount, 15) << 4) |
+        std::min<size_t>(matchExtra, 15)));
+    if (literalCount >= 15) {
+        putLength(out, literalCount - 15);
+    }
+    out.append(literals, literalCount);
+}
+
+// The decoders keep at least kWindowSize bytes of history, trimming in
+// batches so the copy is amortized.
+void trimWindow(std::string &window) {
+    if (window.size() > kWindowSize * 2) {
+        window.erase(0, window.size() - kWindowSize);
+    }
+}
+
+} // anonymous namespace
+
+Compressor::Compressor() : m_table(1u << kHashBits, 0)
+{
+}
+
+void Compressor::compress(const char *data, size_t size, std::string &out)
+{
+    while (size > 0) {
+        const size_t chunk = std::min(size, kMaxFrameSize);
+        compressFrame(data, chunk, out);
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+void Compressor::slideWindow()
+{
+    if (m_window.size() <= kWindowSize * 2) {
+        return;
+    }
+    const size_t shift = m_window.size() - kWindowSize;
+    m_window.erase(0, shift);
+    for (uint32_t &entry : m_table) {
+        entry = entry > shift ? static_cast<uint32_t>(entry - shift) : 0;
+    }
+}
+
+void Compressor::compressFrame(const char *data, size_t size,
+                               std::string &out)
+{
+    slideWindow();
+    const size_t start = m_window.size();
+    m_window.append(data, size);
+    const char *const window = m_window.data();
+    const size_t end = m_window.size();
+
+    const size_t headerPos = out.size();
+    out.append(kHeaderSize, '\0');
+
+    // Greedy parsing with a single-entry hash table, as in LZ4.
+    size_t anchor = start;
+    size_t pos = start;
+    while (pos + kMinMatch <= end) {
+        const uint32_t sequence = read32(window + pos);
+        uint32_t &entry = m_table[hash32(sequence)];
+        const size_t candidate = entry;
+        entry = static_cast<uint32_t>(pos + 1);
+        if (candidate == 0 || pos - (candidate - 1) > kMaxOffset ||
+                read32(window + candidate - 1) != sequence) {
+            ++pos;
+            continue;
+        }
+        const size_t matchPos = candidate - 1;
+        size_t length = kMinMatch;
+        while (pos + length < end &&
+                window[matchPos + length] == window[pos + length]) {
+            ++length;
+        }
+        const size_t offset = pos - matchPos;
+        putToken(out, window + anchor, pos - anchor, length - kMinMatch);
+        out.push_back(static_cast<char>(offset & 0xFF));
+        out.push_back(static_cast<char>(offset >> 8));
+        if (length - kMinMatch >= 15) {
+            putLength(out, length - kMinMatch - 15);
+        }
+        pos += length;
+        anchor = pos;
+    }
+    putToken(out, window + anchor, end - anchor, 0);
+
+    size_t payloadSize = out.size() - headerPos - kHeaderSize;
+    uint8_t kind = kCompressedFrame;
+    if (payloadSize >= size) {
+        // Incompressible; the window still includes the bytes.
+        out.resize(headerPos + kHeaderSize);
+        out.append(data, size);
+        payloadSize = size;
+        kind = kStoredFrame;
+    }
+    out[headerPos] = static_cast<char>(kind);
+    putUint32(&out[headerPos + 1], static_cast<uint32_t>(size));
+    putUint32(&out[headerPos + 5], static_cast<uint32_t>(payloadSize));
+}
+
+bool Decompressor::decompress(const char *data, size_t size,
+                              std::string &out)
+{
+    if (m_failed) {
+        return false;
+    }
+    m_pending.append(data, size);
+    size_t pos = 0;
+    while (m_pending.size() - pos >= kHeaderSize) {
+        const char *header = m_pending.data() + pos;
+        const uint8_t kind = static_cast<uint8_t>(header[0]);
+        const size_t rawSize = getUint32(header + 1);
+        const size_t payloadSize = getUint32(header + 5);
+        if ((kind != kStoredFrame && kind != kCompressedFrame) ||
+                rawSize > kMaxFrameSize ||
+                (kind == kStoredFrame && payloadSize != rawSize) ||
+                (kind == kCompressedFrame && payloadSize >= rawSize)) {
+            m_failed = true;
+            return false;
+        }
+        if (m_pending.size() - pos - kHeaderSize < payloadSize) {
+            break;
+        }
+        const size_t base = m_window.size();
+        if (!decodeFrame(header + kHeaderSize, payloadSize, rawSize,
+                         kind == kStoredFrame)) {
+            m_failed = true;
+            return false;
+        }
+        out.append(m_window, base, std::string::npos);
+        trimWindow(m_window);
+        pos += kHeaderSize + payloadSize;
+    }
+    m_pending.erase(0, pos);
+    return true;
+}
+
+bool Decompressor::decodeFrame(const char *frame, size_t frameSize,
+                               size_t rawSize, bool stored)
+{
+    if (stored) {
+        m_window.append(frame, frameSize);
+        return true;
+    }
+    const size_t base = m_window.size();
+    m_window.reserve(base + rawSize);
+    size_t pos = 0;
+    while (true) {
+        if (pos >= frameSize) {
+            return false;
+        }
+        const uint8_t token = static_cast<uint8_t>(frame[pos++]);
+        size_t literalCount = token >> 4;
+        if (literalCount == 15 &&
+                !getLength(frame, frameSize, pos, literalCount)) {
+            return false;
+        }
+        if (frameSize - pos < literalCount ||
+                m_window.size() - base + literalCount > rawSize) {
+            return false;
+        }
+        m_window.append(frame + pos, literalCount);
+        pos += literalCount;
+        if (m_window.size() - base == rawSize) {
+            return pos == frameSize;
+        }
+        if (frameSize - pos < 2) {
+            return false;
+        }
+        const size_t offset =
+            static_cast<uint8_t>(frame[pos]) |
+            (static_cast<size_t>(static_cast<uint8_t>(frame[pos + 1])) << 8);
+        pos += 2;
+        size_t length = token & 15;
+        if (length == 15 && !getLength(frame, frameSize, pos, length)) {
+            return false;
+        }
+        length += kMinMatch;
+        if (offset == 0 || offset > m_window.size() ||
+                m_window.size() - base + length > rawSize) {
+            return false;
+        }
+        // The match may overlap the bytes it produces.
+        const size_t from = m_window.size() - offset;
+        for (size_t i = 0; i < length; ++i) {
+            m_window.push_back(m_window[from + i]);
+        }
+    }
+}
+
+} // namespace StreamCompression
@@ -0,0 +1,84 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef WINPTY_STREAM_COMPRESSION_H
+#define WINPTY_STREAM_COMPRESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+// A small LZ77 codec for WINPTY_FLAG_COMPRESS_OUTPUT.  The compressor turns
+// each flush of terminal output into one self-delimiting frame, and matches
+// may refer back into the previous kWindowSize bytes of the stream, so the
+// repeated escapes and repainted lines of later frames compress well.  The
+// decompressor accepts the stream in arbitrary pieces.
+//
+// A frame is a one-byte kind, the uncompressed size, and the payload size
+// (both 32-bit little-endian), followed by the payload.  A stored frame's
+// payload is the raw bytes.  A compressed frame's payload is a sequence of
+// LZ4-style tokens: the high nibble counts literals and the low nibble the
+// match length minus kMinMatch, with 15 meaning that 255-terminated
+// extension bytes follow.  Each token's literals come next, then a 16-bit
+// match offset.  The last token has literals only.
+//
+// Both sides must be built from the same source.
+namespace StreamCompression {
+
+const size_t kWindowSize = 64 * 1024;
+const size_t kMaxFrameSize = 1024 * 1024;
+
+class Compressor {
+public:
+    Compressor();
+    // Appends a frame holding size bytes of data to out.  Large inputs are
+    // split into several frames.
+    void compress(const char *data, size_t size, std::string &out);
+
+private:
+    void compressFrame(const char *data, size_t size, std::string &out);
+    void slideWindow();
+
+    std::string m_window;
+    // Hash of four bytes -> 1 + their position in m_window, or 0.
+    std::vector<uint32_t> m_table;
+};
+
+class Decompressor {
+public:
+    // Appends the bytes decoded from the input to out.  A partial frame is
+    // kept until the rest arrives.  Returns false if the stream is corrupt;
+    // the decompressor is then unusable.
+    bool decompress(const char *data, size_t size, std::string &out);
+
+private:
+    bool decodeFrame(const char *frame, size_t frameSize, size_t rawSize,
+                     bool stored);
+
+    bool m_failed = false;
+    std::string m_pending;
+    std::string m_window;
+};
+
+} // namespace StreamCompression
+
+#endif // WINPTY_STREAM_COMPRESSION_H
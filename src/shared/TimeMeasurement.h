@@ -41,6 +41,19 @@ public:
         return static_cast<double>(elapsedTicks) / m_freq;
     }
 
+    int64_t elapsedUs() {
+        return static_cast<int64_t>(elapsed() * 1000000.0);
+    }
+
+    // Returns the elapsed time in microseconds and restarts the measurement.
+    int64_t lapUs() {
+        const uint64_t now = value();
+        const uint64_t elapsedTicks = now - m_start;
+        m_start = now;
+        return static_cast<int64_t>(
+            static_cast<double>(elapsedTicks) / m_freq * 1000000.0);
+    }
+
 private:
     uint64_t getFrequency() {
         LARGE_INTEGER freq;
@@ -23,6 +23,7 @@
 #include <array>
 
 #include "DebugClient.h"
+#include "Mutex.h"
 #include "OsModule.h"
 #include "OwnedHandle.h"
 #include "StringBuilder.h"
@@ -68,36 +69,35 @@ Sid allocatedSid(PSID v) {
     return Sid(v, std::unique_ptr<Impl>(new Impl { v }));
 }
 
-} // anonymous namespace
-
-// Returns a handle to the thread's effective security token.  If the thread
-// is impersonating another user, its token is returned, and otherwise, the
-// process' security token is opened.  The handle is opened with TOKEN_QUERY.
-static OwnedHandle openSecurityTokenForQuery() {
-    HANDLE token = nullptr;
-    // It is unclear to me whether OpenAsSelf matters for winpty, or what the
-    // most appropriate value is.
-    if (!OpenThreadToken(GetCurrentThread(), TOKEN_QUERY,
-                         /*OpenAsSelf=*/FALSE, &token)) {
-        if (GetLastError() != ERROR_NO_TOKEN) {
-            throwWindowsError(L"OpenThreadToken failed");
-        }
-        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
-            throwWindowsError(L"OpenProcessToken failed");
-        }
-    }
-    ASSERT(token != nullptr &&
-        "OpenThreadToken/OpenProcessToken token is NULL");
-    return OwnedHandle(token);
+// Returns another reference to a cached item.  The item lives until the last
+// reference is gone.
+template <typename T>
+SecurityItem<T> sharedItem(const std::shared_ptr<SecurityItem<T>> &item) {
+    struct Impl : SecurityItem<T>::Impl {
+        std::shared_ptr<SecurityItem<T>> m_item;
+        Impl(const std::shared_ptr<SecurityItem<T>> &item) : m_item(item) {}
+    };
+    return SecurityItem<T>(item->get(),
+                           std::unique_ptr<Impl>(new Impl(item)));
 }
 
-// Returns the TokenOwner of the thread's effective security token.
-Sid getOwnerSid() {
+// The process token's owner, and the most recent owner-full-control
+// descriptor with the owner SID it grants, are computed once and shared.
+// Every agent pipe and every libwinpty control pipe uses such a descriptor,
+// and building one takes several SID and ACL allocations.
+Mutex g_securityCacheMutex;
+std::shared_ptr<Sid> g_processOwnerSid;
+std::shared_ptr<SecurityDescriptor> g_ownerFullControlSd;
+PSID g_ownerFullControlSdOwner = nullptr;
+
+} // anonymous namespace
+
+// Returns the TokenOwner of a token opened with TOKEN_QUERY.
+static Sid tokenOwnerSid(const OwnedHandle &token) {
     struct Impl : Sid::Impl {
         std::unique_ptr<char[]> buffer;
     };
 
-    OwnedHandle token = openSecurityTokenForQuery();
     DWORD actual = 0;
     BOOL success;
     success = GetTokenInformation(token.get(), TokenOwner,
@@ -125,6 +125,33 @@ Sid getOwnerSid() {
     return Sid(tmp.Owner, std::move(impl));
 }
 
+// Returns the TokenOwner of the thread's effective security token.  If the
+// thread is impersonating another user, its token is queried, and otherwise,
+// the process' security token, whose owner is looked up only once.
+Sid getOwnerSid() {
+    HANDLE token = nullptr;
+    // It is unclear to me whether OpenAsSelf matters for winpty, or what the
+    // most appropriate value is.
+    if (OpenThreadToken(GetCurrentThread(), TOKEN_QUERY,
+                        /*OpenAsSelf=*/FALSE, &token)) {
+        ASSERT(token != nullptr && "OpenThreadToken token is NULL");
+        return tokenOwnerSid(OwnedHandle(token));
+    }
+    if (GetLastError() != ERROR_NO_TOKEN) {
+        throwWindowsError(L"OpenThreadToken failed");
+    }
+    LockGuard<Mutex> lock(g_securityCacheMutex);
+    if (!g_processOwnerSid) {
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
+            throwWindowsError(L"OpenProcessToken failed");
+        }
+        ASSERT(token != nullptr && "OpenProcessToken token is NULL");
+        g_processOwnerSid = std::make_shared<Sid>(
+            tokenOwnerSid(OwnedHandle(token)));
+    }
+    return sharedItem(g_processOwnerSid);
+}
+
 Sid wellKnownSid(
         const wchar_t *debuggingName,
         SID_IDENTIFIER_AUTHORITY authority,
@@ -209,10 +236,7 @@ static SecurityDescriptor finishSecurityDescriptor(
     return std::move(sd);
 }
 
-// Create a security descriptor that grants full control to the local system
-// account, built-in administrators, and the owner.
-SecurityDescriptor
-createPipeSecurityDescriptorOwnerFullControl() {
+static SecurityDescriptor buildSecurityDescriptorOwnerFullControl(Sid owner) {
 
     struct Impl : SecurityDescriptor::Impl {
         Sid localSystem;
@@ -226,7 +250,7 @@ createPipeSecurityDescriptorOwnerFullControl() {
     std::unique_ptr<Impl> impl(new Impl);
     impl->localSystem = localSystemSid();
     impl->builtinAdmins = builtinAdminsSid();
-    impl->owner = getOwnerSid();
+    impl->owner = std::move(owner);
 
     for (auto &ea : impl->daclEntries) {
         ea.grfAccessPermissions = GENERIC_ALL;
@@ -250,6 +274,25 @@ createPipeSecurityDescriptorOwnerFullControl() {
     return SecurityDescriptor(retValue, std::move(impl));
 }
 
+// Create a security descriptor that grants full control to the local system
+// account, built-in administrators, and the owner.  The descriptor is reused
+// for as long as the owner stays the same.
+SecurityDescriptor
+createPipeSecurityDescriptorOwnerFullControl() {
+    Sid owner = getOwnerSid();
+    LockGuard<Mutex> lock(g_securityCacheMutex);
+    if (!g_ownerFullControlSd ||
+            !EqualSid(g_ownerFullControlSdOwner, owner.get())) {
+        // The descriptor's Impl holds the owner SID, so the key stays valid
+        // as long as the descriptor is cached.
+        const PSID ownerKey = owner.get();
+        g_ownerFullControlSd = std::make_shared<SecurityDescriptor>(
+            buildSecurityDescriptorOwnerFullControl(std::move(owner)));
+        g_ownerFullControlSdOwner = ownerKey;
+    }
+    return sharedItem(g_ownerFullControlSd);
+}
+
 SecurityDescriptor
 createPipeSecurityDescriptorOwnerFullControlEveryoneWrite() {
 
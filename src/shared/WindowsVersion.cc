@@ -62,9 +62,19 @@ OSVERSIONINFOEX getWindowsVersionInfo() {
 #endif
 }
 
+// The version can't change while the process runs, so it's read once.
+// Racing first calls store the same values.
 Version getWindowsVersion() {
-    const auto info = getWindowsVersionInfo();
-    return Version(info.dwMajorVersion, info.dwMinorVersion);
+    static volatile LONG s_known = 0;
+    static DWORD s_major = 0;
+    static DWORD s_minor = 0;
+    if (InterlockedCompareExchange(&s_known, 0, 0) == 0) {
+        const auto info = getWindowsVersionInfo();
+        s_major = info.dwMajorVersion;
+        s_minor = info.dwMinorVersion;
+        InterlockedExchange(&s_known, 1);
+    }
+    return Version(s_major, s_minor);
 }
 
 struct ModuleNotFound : WinptyException {
@@ -175,6 +185,22 @@ bool isAtLeastWindows8() {
     return getWindowsVersion() >= Version(6, 2);
 }
 
+// Returns true if the OS provides the pseudoconsole API (Windows 10 version
+// 1809 or newer).  GetVersionEx can't tell, because it reports 6.2 on
+// unmanifested Windows 10 executables, so look for the API itself.
+bool hasPseudoConsole() {
+    // 0 when unknown, then 1 (absent) or 2 (present).
+    static volatile LONG s_state = 0;
+    LONG state = InterlockedCompareExchange(&s_state, 0, 0);
+    if (state == 0) {
+        OsModule kernel32(L"kernel32.dll");
+        state = GetProcAddress(kernel32.handle(), "CreatePseudoConsole")
+            != nullptr ? 2 : 1;
+        InterlockedExchange(&s_state, state);
+    }
+    return state == 2;
+}
+
 #define WINPTY_IA32     1
 #define WINPTY_X64      2
 
@@ -24,6 +24,7 @@
 bool isAtLeastWindowsVista();
 bool isAtLeastWindows7();
 bool isAtLeastWindows8();
+bool hasPseudoConsole();
 void dumpWindowsVersion();
 
 #endif // WINPTY_SHARED_WINDOWS_VERSION_H
@@ -28,11 +28,15 @@
 void assertTrace(const char *file, int line, const char *cond) {
     trace("Assertion failed: %s, file %s, line %d",
           cond, file, line);
+    traceFlush();
 }
 
 #ifdef WINPTY_AGENT_ASSERT
 
 void agentShutdown() {
+    // Closing the console window ends the process without running atexit
+    // handlers, so send the queued trace messages first.
+    traceFlush();
     HWND hwnd = GetConsoleWindow();
     if (hwnd != NULL) {
         PostMessage(hwnd, WM_CLOSE, 0, 0);
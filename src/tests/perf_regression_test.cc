@@ -0,0 +1,327 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+// Replays scripted console sessions through the agent's Scraper, Terminal, and
+// ConsoleInput in-process, and compares their costs against a baseline file.
+// Only deterministic costs are compared -- bytes of terminal output, console
+// reads, and heap allocations -- never elapsed time, so a change to the
+// encoders or the line diffing that costs more fails the test outright.
+//
+// Usage: perf_regression_test [--baseline FILE] [--update-baseline]
+//                             [--replay FRAMEFILE]...
+//
+// A frame file recorded with WINPTY_DEBUG=record_frames replays as its own
+// session.  --update-baseline rewrites the baseline with the measured costs,
+// for checking in along with a change that is expected to move them.
+
+#include <windows.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../agent/ConsoleFrameFile.h"
+#include "../agent/ConsoleInput.h"
+#include "../agent/DsrSender.h"
+#include "../agent/MemoryConsoleBuffer.h"
+#include "../agent/NamedPipe.h"
+#include "../agent/Scraper.h"
+#include "../agent/Terminal.h"
+#include "../agent/Win32Console.h"
+#include "../bench/BenchUtil.h"
+#include "../bench/ScraperBench.h"
+#include "../include/winpty_constants.h"
+
+static const char kDefaultBaseline[] =
+    "src/tests/perf_regression_baseline.txt";
+
+// Every session replays this many frames.  The first few warm up the
+// scraper's buffers and aren't counted in the per-frame allocations.
+static const int kFrameCount = 200;
+static const int kWarmupFrames = 10;
+
+// A cost may exceed its baseline by this fraction, plus this much, before the
+// test fails.  The costs are deterministic for a given build, so these only
+// absorb differences between compilers and C++ runtimes.
+static const double kRelativeSlack = 0.05;
+static const double kAbsoluteSlack = 0.5;
+
+typedef std::map<std::string, double> Costs;
+
+class CountingConsoleBuffer : public MemoryConsoleBuffer {
+public:
+    virtual bool read(const SmallRect &rect, CHAR_INFO *data) override {
+        ++m_reads;
+        return MemoryConsoleBuffer::read(rect, data);
+    }
+    uint64_t reads() const { return m_reads; }
+private:
+    uint64_t m_reads = 0;
+};
+
+class NullDsrSender : public DsrSender {
+public:
+    void sendDsr() override {}
+};
+
+static std::vector<ConsoleFrame> loadFrames(const std::string &path) {
+    std::vector<ConsoleFrame> frames;
+    ConsoleFrameReader reader;
+    if (!reader.open(path.c_str())) {
+        benchFail("%s: %s", path.c_str(), reader.error().c_str());
+    }
+    ConsoleFrame frame;
+    while (reader.next(frame)) {
+        frames.push_back(std::move(frame));
+    }
+    if (!reader.error().empty()) {
+        benchFail("%s: %s", path.c_str(), reader.error().c_str());
+    }
+    if (frames.empty()) {
+        benchFail("%s: no frames", path.c_str());
+    }
+    return frames;
+}
+
+// Plays a synthetic workload (see writeSyntheticFrame), or the recorded
+// frames, one scrape per frame.
+static void measureScraper(const std::string &session,
+                           const std::string &workload,
+                           const std::vector<ConsoleFrame> &recorded,
+                           Costs &costs) {
+    Coord size(80, 25);
+    if (!recorded.empty()) {
+        const SmallRect window = recorded[0].info.srWindow;
+        size = Coord(window.width(), window.height());
+    }
+    Win32Console console(nullptr);
+    CountingConsoleBuffer buffer;
+    OfflineEventLoop loop;
+    NamedPipe &pipe = loop.pipe();
+    Scraper scraper(console, buffer,
+                    std::unique_ptr<Terminal>(new Terminal(pipe, false, true)),
+                    size);
+    pipe.discardOutput();
+
+    const uint64_t readsBefore = buffer.reads();
+    const uint64_t cellsBefore = scraper.cellsRead();
+    const uint64_t linesBefore = scraper.terminal().sendLineCount();
+    const uint64_t resyncsBefore = scraper.resyncCount();
+    int64_t bytes = 0;
+    int64_t idleBytes = 0;
+    LONG allocations = 0;
+    int64_t logLine = 0;
+    size_t nextRecorded = 0;
+    int frames = 0;
+    ConsoleScreenBufferInfo info;
+    while (recorded.empty() ? frames < kFrameCount
+                            : nextRecorded < recorded.size()) {
+        if (recorded.empty()) {
+            writeSyntheticFrame(buffer, workload, frames, logLine);
+        } else {
+            const uint32_t scrape = recorded[nextRecorded].scrape;
+            while (nextRecorded < recorded.size() &&
+                    recorded[nextRecorded].scrape == scrape) {
+                buffer.applyFrame(recorded[nextRecorded++]);
+            }
+        }
+        const LONG allocationsBefore = benchAllocationCount();
+        scraper.scrapeBuffer(buffer, info);
+        if (frames >= kWarmupFrames) {
+            allocations += benchAllocationCount() - allocationsBefore;
+        }
+        bytes += pipe.bytesToSend();
+        if (frames > 0 && workload == "idle") {
+            idleBytes += pipe.bytesToSend();
+        }
+        pipe.discardOutput();
+        ++frames;
+    }
+
+    const double n = frames;
+    const double counted = std::max(1, frames - kWarmupFrames);
+    costs[session + " bytes_per_frame"] = bytes / n;
+    costs[session + " reads_per_frame"] = (buffer.reads() - readsBefore) / n;
+    costs[session + " cells_read_per_frame"] =
+        (scraper.cellsRead() - cellsBefore) / n;
+    costs[session + " lines_sent"] = static_cast<double>(
+        scraper.terminal().sendLineCount() - linesBefore);
+    costs[session + " allocations_per_frame"] = allocations / counted;
+    costs[session + " resyncs"] = static_cast<double>(
+        scraper.resyncCount() - resyncsBefore);
+    if (idleBytes != 0) {
+        // Redrawing an unchanged console is a regression whatever the
+        // baseline says.
+        benchFail("%s: %lld bytes sent for unchanged frames",
+                  session.c_str(), static_cast<long long>(idleBytes));
+    }
+}
+
+static std::string makeInput(const std::string &workload) {
+    std::string ret;
+    for (int i = 0; i < 256; ++i) {
+        if (workload == "keys") {
+            static const char *const kKeys[] = {
+                "\x1b[A", "\x1b[B", "\x1b[1;5C", "\x1bOP",
+                "\x1b[3~", "\x1b[15;2~", "\x7f", "\r",
+            };
+            ret += kKeys[i % (sizeof(kKeys) / sizeof(kKeys[0]))];
+        } else if (workload == "typing") {
+            ret += "ls -la --color=auto\r";
+        } else if (workload == "paste") {
+            ret += "\x1b[200~    printf(\"pasted line\\n\");\r\x1b[201~";
+        }
+    }
+    return ret;
+}
+
+// Decodes the scripted input twice, and counts the second pass, once the
+// record caches are warm.
+static void measureInput(const std::string &workload, Costs &costs) {
+    const std::string input = makeInput(workload);
+    Win32Console console(nullptr);
+    NullDsrSender dsrSender;
+    ConsoleInput consoleInput(GetStdHandle(STD_INPUT_HANDLE),
+                              WINPTY_MOUSE_MODE_NONE, dsrSender, console);
+    consoleInput.setDiscardRecords(true);
+    consoleInput.writeInput(input.data(), input.size());
+    const uint64_t recordsBefore = consoleInput.recordsWritten();
+    const LONG allocationsBefore = benchAllocationCount();
+    consoleInput.writeInput(input.data(), input.size());
+    const double kb = input.size() / 1024.0;
+    costs["input-" + workload + " allocations_per_kb"] =
+        (benchAllocationCount() - allocationsBefore) / kb;
+    costs["input-" + workload + " records_per_kb"] =
+        (consoleInput.recordsWritten() - recordsBefore) / kb;
+}
+
+static bool loadBaseline(const std::string &path, Costs &baseline) {
+    FILE *fp = fopen(path.c_str(), "r");
+    if (fp == nullptr) {
+        return false;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), fp) != nullptr) {
+        char session[200];
+        char metric[200];
+        double value = 0.0;
+        if (line[0] != '#' && sscanf(line, "%199s %199s %lf",
+                                     session, metric, &value) == 3) {
+            baseline[std::string(session) + " " + metric] = value;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+static void writeBaseline(const std::string &path, const Costs &costs) {
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp == nullptr) {
+        benchFail("cannot write %s", path.c_str());
+    }
+    fprintf(fp, "# Generated by perf_regression_test --update-baseline.\n"
+                "# session metric value\n");
+    for (const auto &cost : costs) {
+        fprintf(fp, "%s %.3f\n", cost.first.c_str(), cost.second);
+    }
+    fclose(fp);
+}
+
+int main(int argc, char *argv[]) {
+    std::string baselinePath = kDefaultBaseline;
+    bool update = false;
+    std::vector<std::string> replays;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--baseline" && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (arg == "--update-baseline") {
+            update = true;
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replays.push_back(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--baseline FILE] [--update-baseline] "
+                            "[--replay FRAMEFILE]...\n", argv[0]);
+            return 2;
+        }
+    }
+
+    Costs costs;
+    const std::vector<ConsoleFrame> none;
+    for (const auto &workload : scraperWorkloads(false)) {
+        measureScraper("scraper-" + workload, workload, none, costs);
+    }
+    for (const auto &path : replays) {
+        const size_t slash = path.find_last_of("/\\");
+        const std::string name =
+            slash == std::string::npos ? path : path.substr(slash + 1);
+        measureScraper("replay-" + name, "replay", loadFrames(path), costs);
+    }
+    for (const char *workload : { "keys", "typing", "paste" }) {
+        measureInput(workload, costs);
+    }
+
+    if (update) {
+        writeBaseline(baselinePath, costs);
+        printf("Wrote %d costs to %s\n", static_cast<int>(costs.size()),
+               baselinePath.c_str());
+        return 0;
+    }
+
+    Costs baseline;
+    if (!loadBaseline(baselinePath, baseline)) {
+        benchFail("cannot read %s (create it with --update-baseline)",
+                  baselinePath.c_str());
+    }
+    int failures = 0;
+    for (const auto &cost : costs) {
+        const auto it = baseline.find(cost.first);
+        if (it == baseline.end()) {
+            printf("NEW   %s %.3f (not in the baseline)\n",
+                   cost.first.c_str(), cost.second);
+            continue;
+        }
+        const double limit =
+            it->second * (1.0 + kRelativeSlack) + kAbsoluteSlack;
+        if (cost.second > limit) {
+            printf("FAIL  %s %.3f (baseline %.3f)\n",
+                   cost.first.c_str(), cost.second, it->second);
+            ++failures;
+        } else if (cost.second < it->second * (1.0 - kRelativeSlack) -
+                                 kAbsoluteSlack) {
+            printf("BETTER %s %.3f (baseline %.3f; consider updating it)\n",
+                   cost.first.c_str(), cost.second, it->second);
+        }
+    }
+    if (failures > 0) {
+        printf("%d cost(s) regressed\n", failures);
+        return 1;
+    }
+    printf("All %d costs are within the baseline\n",
+           static_cast<int>(costs.size()));
+    return 0;
+}
@@ -26,3 +26,19 @@ TEST_PROGRAMS = \
         build/trivial_test.exe
 
 -include $(TEST_PROGRAMS:.exe=.d)
+
+# The perf regression test links the agent's scraper and input decoding
+# directly, using the objects built for winpty-bench.
+PERF_TEST_OBJECTS = \
+	$(filter build/bench/agent/% build/bench/shared/%,$(BENCH_OBJECTS)) \
+	build/bench/bench/BenchUtil.o \
+	build/bench/bench/ScraperBench.o \
+	build/bench/tests/perf_regression_test.o
+
+build/perf_regression_test.exe : $(PERF_TEST_OBJECTS) build/winpty.dll
+	$(info Linking $@)
+	@$(MINGW_CXX) $(MINGW_LDFLAGS) -o $@ $^
+
+TEST_PROGRAMS += build/perf_regression_test.exe
+
+-include build/bench/tests/perf_regression_test.d
@@ -22,93 +22,126 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <stdio.h>
-#include <sys/select.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <vector>
 
 #include "../shared/DebugClient.h"
-#include "Util.h"
-#include "WakeupFd.h"
+
+namespace {
+
+// The tty read buffer starts at the smaller size and grows toward the
+// larger one as pastes arrive.
+const size_t kMinBufferSize = 4096;
+const size_t kMaxBufferSize = 256 * 1024;
+
+} // anonymous namespace
 
 InputHandler::InputHandler(
         HANDLE conin, int inputfd, WakeupFd &completionWakeup) :
-    m_conin(conin),
     m_inputfd(inputfd),
-    m_completionWakeup(completionWakeup),
-    m_threadHasBeenJoined(false),
-    m_shouldShutdown(0),
-    m_threadCompleted(0)
+    m_write(conin, completionWakeup),
+    m_buffer(kMinBufferSize),
+    m_complete(false)
 {
-    pthread_create(&m_thread, NULL, InputHandler::threadProcS, this);
 }
 
-void InputHandler::shutdown() {
-    startShutdown();
-    if (!m_threadHasBeenJoined) {
-        int ret = pthread_join(m_thread, NULL);
-        assert(ret == 0 && "pthread_join failed");
-        m_threadHasBeenJoined = true;
+// Sizes the buffer for the input the tty holds (FIONREAD), between 4 KiB and
+// 256 KiB.  It's only called with no write pending, and it only grows, so
+// ordinary typing never reallocates.
+void InputHandler::growBuffer() {
+    int avail = 0;
+    if (ioctl(m_inputfd, FIONREAD, &avail) != 0 || avail <= 0) {
+        return;
+    }
+    const size_t wanted = std::min<size_t>(avail, kMaxBufferSize);
+    if (wanted > m_buffer.size()) {
+        m_buffer.resize(wanted);
+    }
+}
+
+void InputHandler::prepareSelect(
+        fd_set &readfds, fd_set &writefds, int &maxFd) {
+    if (!m_complete && !m_write.isPending()) {
+        // Until CONIN takes the last chunk, leave the input in the tty.
+        FD_SET(m_inputfd, &readfds);
+        maxFd = std::max(maxFd, m_inputfd);
     }
 }
 
-void InputHandler::threadProc() {
-    std::vector<char> buffer(4096);
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    while (true) {
-        // Handle shutdown.
-        m_wakeup.reset();
-        if (m_shouldShutdown) {
-            trace("InputHandler: shutting down");
+void InputHandler::service(const fd_set &readfds) {
+    bool readable = FD_ISSET(m_inputfd, &readfds);
+    while (!m_complete) {
+        DWORD written = 0;
+        const OverlappedIo::Status status = m_write.poll(&written);
+        if (status == OverlappedIo::Pending) {
+            break;
+        } else if (status == OverlappedIo::Failed) {
+            if (m_write.lastError() == ERROR_BROKEN_PIPE) {
+                trace("InputHandler: pipe closed");
+            } else {
+                trace("InputHandler: write failed: lastError=0x%x",
+                    static_cast<unsigned int>(m_write.lastError()));
+            }
+            m_complete = true;
             break;
         }
 
-        // Block until data arrives.
-        {
-            const int max_fd = std::max(m_inputfd, m_wakeup.fd());
-            FD_SET(m_inputfd, &readfds);
-            FD_SET(m_wakeup.fd(), &readfds);
-            selectWrapper("InputHandler", max_fd + 1, &readfds);
-            if (!FD_ISSET(m_inputfd, &readfds)) {
+        if (!readable) {
+            break;
+        }
+        // Drain everything the tty holds, up to the buffer's limit, into one
+        // CONIN write, so a paste wakes the agent a few times rather than
+        // once per 4 KiB.
+        growBuffer();
+        size_t filled = 0;
+        bool failed = false;
+        while (filled < m_buffer.size()) {
+            const size_t requested = m_buffer.size() - filled;
+            const int numRead = read(m_inputfd, &m_buffer[filled],
+                                     requested);
+            if (numRead == -1 && errno == EINTR) {
+                // Apparently, this read is interrupted on Cygwin 1.7 by a
+                // SIGWINCH signal even though I set the SA_RESTART flag on
+                // the handler.
                 continue;
             }
+            if (numRead == -1 && errno == EAGAIN) {
+                readable = false;
+                break;
+            }
+            if (numRead <= 0) {
+                // tty is closed, or the read failed for some unexpected
+                // reason.  Any input read before it is still written; the
+                // next read fails again.
+                if (filled == 0) {
+                    trace("InputHandler: tty read failed: numRead=%d",
+                          numRead);
+                    failed = true;
+                }
+                break;
+            }
+            filled += numRead;
+            if (static_cast<size_t>(numRead) < requested) {
+                // A short read probably emptied the tty, so skip the read
+                // that would fail with EAGAIN.
+                readable = false;
+                break;
+            }
         }
-
-        const int numRead = read(m_inputfd, &buffer[0], buffer.size());
-        if (numRead == -1 && errno == EINTR) {
-            // Apparently, this read is interrupted on Cygwin 1.7 by a SIGWINCH
-            // signal even though I set the SA_RESTART flag on the handler.
-            continue;
-        }
-
-        // tty is closed, or the read failed for some unexpected reason.
-        if (numRead <= 0) {
-            trace("InputHandler: tty read failed: numRead=%d", numRead);
+        if (failed) {
+            m_complete = true;
             break;
         }
-
-        DWORD written = 0;
-        BOOL ret = WriteFile(m_conin,
-                             &buffer[0], numRead,
-                             &written, NULL);
-        if (!ret || written != static_cast<DWORD>(numRead)) {
-            if (!ret && GetLastError() == ERROR_BROKEN_PIPE) {
-                trace("InputHandler: pipe closed: written=%u",
-                    static_cast<unsigned int>(written));
-            } else {
-                trace("InputHandler: write failed: "
-                    "ret=%d lastError=0x%x numRead=%d written=%u",
-                    ret,
-                    static_cast<unsigned int>(GetLastError()),
-                    numRead,
-                    static_cast<unsigned int>(written));
-            }
+        if (filled == 0) {
             break;
         }
+        if (!m_write.startWrite(&m_buffer[0], filled)) {
+            trace("InputHandler: write failed: lastError=0x%x",
+                static_cast<unsigned int>(m_write.lastError()));
+            m_complete = true;
+        }
     }
-    m_threadCompleted = 1;
-    m_completionWakeup.set();
 }
@@ -22,35 +22,29 @@
 #define UNIX_ADAPTER_INPUT_HANDLER_H
 
 #include <windows.h>
-#include <pthread.h>
-#include <signal.h>
+#include <sys/select.h>
 
+#include <vector>
+
+#include "OverlappedIo.h"
 #include "WakeupFd.h"
 
-// Connect a Cygwin blocking fd to winpty CONIN.
+// Connect a Cygwin non-blocking fd to winpty CONIN.  The main loop calls
+// service whenever select returns.
 class InputHandler {
 public:
     InputHandler(HANDLE conin, int inputfd, WakeupFd &completionWakeup);
-    ~InputHandler() { shutdown(); }
-    bool isComplete() { return m_threadCompleted; }
-    void startShutdown() { m_shouldShutdown = 1; m_wakeup.set(); }
-    void shutdown();
+    bool isComplete() { return m_complete; }
+    void prepareSelect(fd_set &readfds, fd_set &writefds, int &maxFd);
+    void service(const fd_set &readfds);
 
 private:
-    static void *threadProcS(void *pvthis) {
-        reinterpret_cast<InputHandler*>(pvthis)->threadProc();
-        return NULL;
-    }
-    void threadProc();
+    void growBuffer();
 
-    HANDLE m_conin;
     int m_inputfd;
-    pthread_t m_thread;
-    WakeupFd &m_completionWakeup;
-    WakeupFd m_wakeup;
-    bool m_threadHasBeenJoined;
-    volatile sig_atomic_t m_shouldShutdown;
-    volatile sig_atomic_t m_threadCompleted;
+    OverlappedIo m_write;
+    std::vector<char> m_buffer;
+    bool m_complete;
 };
 
 #endif // UNIX_ADAPTER_INPUT_HANDLER_H
@@ -22,59 +22,216 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <sys/select.h>
+#include <fcntl.h>
+#include <io.h>
 #include <unistd.h>
 
 #include <algorithm>
 #include <vector>
 
 #include "../shared/DebugClient.h"
-#include "Util.h"
-#include "WakeupFd.h"
+
+namespace {
+
+// The read buffer starts small, for interactive output, and doubles whenever
+// a read fills it, so that bulk output costs fewer ReadFile and write calls.
+const size_t kInitialBufferSize = 4096;
+const size_t kMaxBufferSize = 256 * 1024;
+
+// Output captured to a file or pipe isn't interactive, so start reading in
+// large chunks.
+const size_t kInitialDirectBufferSize = 64 * 1024;
+
+// Returns the Win32 handle behind fd if writing it with WriteFile is
+// equivalent to write(), or NULL.  A tty needs Cygwin's pty layer, and
+// Cygwin emulates O_APPEND.  A pipe qualifies only in PIPE_NOWAIT mode (as
+// Cygwin sets for O_NONBLOCK), because a blocking WriteFile would stall the
+// main loop.  *chunk receives the largest write to issue.
+static HANDLE directOutputHandle(int fd, DWORD *chunk) {
+    if (isatty(fd)) {
+        return NULL;
+    }
+    const int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || (flags & O_APPEND)) {
+        return NULL;
+    }
+    const HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
+    if (handle == NULL || handle == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    switch (GetFileType(handle)) {
+        case FILE_TYPE_DISK:
+            *chunk = kMaxBufferSize;
+            return handle;
+        case FILE_TYPE_PIPE: {
+            // A non-blocking write larger than the pipe's buffer never
+            // succeeds, so keep each write within it.
+            DWORD state = 0;
+            DWORD outBufferSize = 0;
+            if (!GetNamedPipeHandleState(handle, &state, NULL, NULL, NULL,
+                                         NULL, 0) ||
+                    !(state & PIPE_NOWAIT) ||
+                    !GetNamedPipeInfo(handle, NULL, &outBufferSize, NULL,
+                                      NULL)) {
+                return NULL;
+            }
+            *chunk = std::max<DWORD>(
+                1, std::min<DWORD>(outBufferSize, kMaxBufferSize));
+            return handle;
+        }
+        default:
+            return NULL;
+    }
+}
+
+} // anonymous namespace
 
 OutputHandler::OutputHandler(
         HANDLE conout, int outputfd, WakeupFd &completionWakeup) :
     m_conout(conout),
     m_outputfd(outputfd),
-    m_completionWakeup(completionWakeup),
-    m_threadHasBeenJoined(false),
-    m_threadCompleted(0)
+    m_directHandle(NULL),
+    m_directChunk(0),
+    m_read(conout, completionWakeup),
+    m_dataStart(0),
+    m_dataEnd(0),
+    m_complete(false)
 {
-    pthread_create(&m_thread, NULL, OutputHandler::threadProcS, this);
+    m_directHandle = directOutputHandle(outputfd, &m_directChunk);
+    m_buffer.resize(m_directHandle != NULL
+                        ? kInitialDirectBufferSize : kInitialBufferSize);
+    if (m_directHandle != NULL) {
+        trace("OutputHandler: fd %d is written directly, chunk=%u",
+            outputfd, static_cast<unsigned int>(m_directChunk));
+    }
 }
 
-void OutputHandler::shutdown() {
-    if (!m_threadHasBeenJoined) {
-        int ret = pthread_join(m_thread, NULL);
-        assert(ret == 0 && "pthread_join failed");
-        m_threadHasBeenJoined = true;
+void OutputHandler::prepareSelect(
+        fd_set &readfds, fd_set &writefds, int &maxFd) {
+    if (!m_complete && m_dataStart < m_dataEnd) {
+        // A pending read sets the wakeup fd instead.
+        FD_SET(m_outputfd, &writefds);
+        maxFd = std::max(maxFd, m_outputfd);
     }
 }
 
-void OutputHandler::threadProc() {
-    std::vector<char> buffer(4096);
-    while (true) {
-        DWORD numRead = 0;
-        BOOL ret = ReadFile(m_conout,
-                            &buffer[0], buffer.size(),
-                            &numRead, NULL);
-        if (!ret || numRead == 0) {
-            if (!ret && GetLastError() == ERROR_BROKEN_PIPE) {
-                trace("OutputHandler: pipe closed: numRead=%u",
-                    static_cast<unsigned int>(numRead));
-            } else {
-                trace("OutputHandler: read failed: "
-                    "ret=%d lastError=0x%x numRead=%u",
-                    ret,
-                    static_cast<unsigned int>(GetLastError()),
-                    static_cast<unsigned int>(numRead));
+// Alternately read CONOUT and write what was read to the fd, until one of
+// them would block.
+void OutputHandler::service() {
+    while (!m_complete) {
+        if (m_dataStart < m_dataEnd && m_directHandle != NULL) {
+            if (!writeDirect()) {
+                break;
             }
+            continue;
+        }
+        if (m_dataStart < m_dataEnd) {
+            const ssize_t ret = write(m_outputfd,
+                                      &m_buffer[m_dataStart],
+                                      m_dataEnd - m_dataStart);
+            if (ret == -1 && errno == EINTR) {
+                continue;
+            }
+            if (ret == -1 && errno == EAGAIN) {
+                // While the tty is backed up, keep draining the agent's
+                // pipe into the rest of the buffer, so the next write
+                // carries more.
+                readAvailable();
+                break;
+            }
+            if (ret <= 0) {
+                trace("OutputHandler: write failed: fd=%d errno=%d ret=%d",
+                    m_outputfd, errno, static_cast<int>(ret));
+                m_complete = true;
+                break;
+            }
+            m_dataStart += ret;
+            continue;
+        }
+        if (!readPipe()) {
             break;
         }
-        if (!writeAll(m_outputfd, &buffer[0], numRead)) {
+    }
+}
+
+// Writes the next chunk to the direct handle.  Returns false if the handle
+// is full or failed.
+bool OutputHandler::writeDirect() {
+    const DWORD size = static_cast<DWORD>(
+        std::min<size_t>(m_dataEnd - m_dataStart, m_directChunk));
+    DWORD written = 0;
+    if (!WriteFile(m_directHandle, &m_buffer[m_dataStart], size, &written,
+                   NULL)) {
+        trace("OutputHandler: WriteFile failed: fd=%d lastError=0x%x",
+            m_outputfd, static_cast<unsigned int>(GetLastError()));
+        m_complete = true;
+        return false;
+    }
+    if (written == 0) {
+        // A PIPE_NOWAIT pipe is full.  select reports when it has room.
+        readAvailable();
+        return false;
+    }
+    m_dataStart += written;
+    return true;
+}
+
+// Returns true once there's data to write, and false if the read is still
+// pending or the pipe is done.
+bool OutputHandler::readPipe() {
+    if (!m_read.isPending()) {
+        if (m_dataEnd == m_buffer.size() && m_buffer.size() < kMaxBufferSize) {
+            m_buffer.resize(m_buffer.size() * 2);
+        }
+        m_dataStart = 0;
+        m_dataEnd = 0;
+        if (!m_read.startRead(&m_buffer[0], m_buffer.size())) {
+            trace("OutputHandler: read failed: lastError=0x%x",
+                static_cast<unsigned int>(m_read.lastError()));
+            m_complete = true;
+            return false;
+        }
+    }
+    DWORD numRead = 0;
+    const OverlappedIo::Status status = m_read.poll(&numRead);
+    if (status == OverlappedIo::Pending) {
+        return false;
+    }
+    if (status != OverlappedIo::Done || numRead == 0) {
+        if (m_read.lastError() == ERROR_BROKEN_PIPE) {
+            trace("OutputHandler: pipe closed");
+        } else {
+            trace("OutputHandler: read failed: lastError=0x%x numRead=%u",
+                static_cast<unsigned int>(m_read.lastError()),
+                static_cast<unsigned int>(numRead));
+        }
+        m_complete = true;
+        return false;
+    }
+    m_dataEnd = numRead;
+    readAvailable();
+    return true;
+}
+
+// Append whatever else is already in the pipe, so a burst of output goes to
+// the fd in one write.
+void OutputHandler::readAvailable() {
+    while (m_dataEnd < m_buffer.size()) {
+        DWORD available = 0;
+        if (!PeekNamedPipe(m_conout, NULL, 0, NULL, &available, NULL) ||
+                available == 0) {
+            break;
+        }
+        const DWORD toRead = std::min<DWORD>(
+            available, static_cast<DWORD>(m_buffer.size() - m_dataEnd));
+        DWORD numRead = 0;
+        // The data is there, so waiting for the read doesn't block.  A
+        // failure is seen again by the next regular read.
+        if (!m_read.startRead(&m_buffer[m_dataEnd], toRead) ||
+                m_read.poll(&numRead, true) != OverlappedIo::Done ||
+                numRead == 0) {
             break;
         }
+        m_dataEnd += numRead;
     }
-    m_threadCompleted = 1;
-    m_completionWakeup.set();
 }
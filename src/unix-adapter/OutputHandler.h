@@ -22,32 +22,42 @@
 #define UNIX_ADAPTER_OUTPUT_HANDLER_H
 
 #include <windows.h>
-#include <pthread.h>
-#include <signal.h>
+#include <sys/select.h>
 
+#include <vector>
+
+#include "OverlappedIo.h"
 #include "WakeupFd.h"
 
-// Connect winpty CONOUT/CONERR to a Cygwin blocking fd.
+// Connect winpty CONOUT/CONERR to a Cygwin non-blocking fd.  The main loop
+// calls service whenever select returns.
+//
+// When the fd isn't a tty, but a disk file or a non-blocking Win32 pipe
+// (e.g. a CI harness capturing the output), the handler writes the fd's
+// Win32 handle directly from its read buffer, skipping Cygwin's write path.
 class OutputHandler {
 public:
     OutputHandler(HANDLE conout, int outputfd, WakeupFd &completionWakeup);
-    ~OutputHandler() { shutdown(); }
-    bool isComplete() { return m_threadCompleted; }
-    void shutdown();
+    bool isComplete() { return m_complete; }
+    void prepareSelect(fd_set &readfds, fd_set &writefds, int &maxFd);
+    void service();
 
 private:
-    static void *threadProcS(void *pvthis) {
-        reinterpret_cast<OutputHandler*>(pvthis)->threadProc();
-        return NULL;
-    }
-    void threadProc();
+    bool readPipe();
+    void readAvailable();
+    bool writeDirect();
 
     HANDLE m_conout;
     int m_outputfd;
-    pthread_t m_thread;
-    WakeupFd &m_completionWakeup;
-    bool m_threadHasBeenJoined;
-    volatile sig_atomic_t m_threadCompleted;
+    // The fd's Win32 handle when writing it directly, or NULL.
+    HANDLE m_directHandle;
+    // The largest direct write, to stay under a non-blocking pipe's buffer.
+    DWORD m_directChunk;
+    OverlappedIo m_read;
+    std::vector<char> m_buffer;
+    size_t m_dataStart;
+    size_t m_dataEnd;
+    bool m_complete;
 };
 
 #endif // UNIX_ADAPTER_OUTPUT_HANDLER_H
@@ -0,0 +1,112 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "OverlappedIo.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "../shared/DebugClient.h"
+
+OverlappedIo::OverlappedIo(HANDLE pipe, WakeupFd &completionWakeup) :
+    m_pipe(pipe),
+    m_completionWakeup(completionWakeup),
+    m_event(CreateEventW(NULL, TRUE, FALSE, NULL)),
+    m_wait(NULL),
+    m_pending(false),
+    m_lastError(0)
+{
+    assert(m_event != NULL && "CreateEventW failed");
+    memset(&m_over, 0, sizeof(m_over));
+}
+
+OverlappedIo::~OverlappedIo() {
+    if (m_pending) {
+        CancelIo(m_pipe);
+        DWORD actual = 0;
+        GetOverlappedResult(m_pipe, &m_over, &actual, TRUE);
+    }
+    unregisterWait();
+    CloseHandle(m_event);
+}
+
+bool OverlappedIo::startRead(void *buffer, DWORD size) {
+    assert(!m_pending);
+    ResetEvent(m_event);
+    memset(&m_over, 0, sizeof(m_over));
+    m_over.hEvent = m_event;
+    return startIo(ReadFile(m_pipe, buffer, size, NULL, &m_over));
+}
+
+bool OverlappedIo::startWrite(const void *buffer, DWORD size) {
+    assert(!m_pending);
+    ResetEvent(m_event);
+    memset(&m_over, 0, sizeof(m_over));
+    m_over.hEvent = m_event;
+    return startIo(WriteFile(m_pipe, buffer, size, NULL, &m_over));
+}
+
+bool OverlappedIo::startIo(BOOL ret) {
+    if (!ret && GetLastError() != ERROR_IO_PENDING) {
+        m_lastError = GetLastError();
+        return false;
+    }
+    // Even an I/O that completed synchronously is retired by poll.
+    m_pending = true;
+    return true;
+}
+
+OverlappedIo::Status OverlappedIo::poll(DWORD *actual, bool wait) {
+    *actual = 0;
+    if (!m_pending) {
+        return Idle;
+    }
+    if (GetOverlappedResult(m_pipe, &m_over, actual, wait)) {
+        m_pending = false;
+        unregisterWait();
+        return Done;
+    }
+    const DWORD err = GetLastError();
+    if (err == ERROR_IO_INCOMPLETE) {
+        if (m_wait == NULL) {
+            const BOOL success = RegisterWaitForSingleObject(
+                &m_wait, m_event, completionCallback, &m_completionWakeup,
+                INFINITE, WT_EXECUTEONLYONCE | WT_EXECUTEINWAITTHREAD);
+            assert(success && "RegisterWaitForSingleObject failed");
+        }
+        return Pending;
+    }
+    m_pending = false;
+    m_lastError = err;
+    unregisterWait();
+    return Failed;
+}
+
+void OverlappedIo::unregisterWait() {
+    if (m_wait != NULL) {
+        // Waits for a running callback to finish.
+        UnregisterWaitEx(m_wait, INVALID_HANDLE_VALUE);
+        m_wait = NULL;
+    }
+}
+
+VOID CALLBACK OverlappedIo::completionCallback(PVOID param, BOOLEAN timedOut) {
+    static_cast<WakeupFd*>(param)->set();
+}
@@ -0,0 +1,66 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#ifndef UNIX_ADAPTER_OVERLAPPED_IO_H
+#define UNIX_ADAPTER_OVERLAPPED_IO_H
+
+#include <windows.h>
+
+#include "WakeupFd.h"
+
+// One overlapped ReadFile or WriteFile at a time on a winpty pipe, which
+// must be opened with FILE_FLAG_OVERLAPPED.  While the I/O is pending, a
+// thread pool wait sets the WakeupFd when it finishes, so that the main
+// loop's select returns.  An I/O that finishes right away never involves
+// another thread.
+class OverlappedIo {
+public:
+    enum Status { Idle, Pending, Done, Failed };
+
+    OverlappedIo(HANDLE pipe, WakeupFd &completionWakeup);
+    ~OverlappedIo();
+    bool isPending() { return m_pending; }
+    // These return false if the I/O failed immediately.
+    bool startRead(void *buffer, DWORD size);
+    bool startWrite(const void *buffer, DWORD size);
+    // Checks the I/O started last.  On Done, *actual is the byte count.
+    Status poll(DWORD *actual, bool wait=false);
+    DWORD lastError() { return m_lastError; }
+
+private:
+    // Do not allow copying the OverlappedIo object.
+    OverlappedIo(const OverlappedIo &other);
+    OverlappedIo &operator=(const OverlappedIo &other);
+
+    bool startIo(BOOL ret);
+    void unregisterWait();
+    static VOID CALLBACK completionCallback(PVOID param, BOOLEAN timedOut);
+
+private:
+    HANDLE m_pipe;
+    WakeupFd &m_completionWakeup;
+    HANDLE m_event;
+    OVERLAPPED m_over;
+    HANDLE m_wait;
+    bool m_pending;
+    DWORD m_lastError;
+};
+
+#endif // UNIX_ADAPTER_OVERLAPPED_IO_H
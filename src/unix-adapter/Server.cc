@@ -0,0 +1,414 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+#include "Server.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <winpty.h>
+#include "../shared/DebugClient.h"
+#include "Util.h"
+
+namespace {
+
+// The number of idle agents the server keeps started.
+const int kServerPoolSize = 2;
+
+// An environment block is limited to 32767 characters, so no legitimate
+// message comes close to this.
+const uint32_t kMaxMessageSize = 1024 * 1024;
+
+enum MessageType {
+    kSpawnRequest = 1,
+    kSpawnReply,
+    kResizeRequest,
+    kCloseRequest,
+    kExitReply
+};
+
+// Each message is a 32-bit length, then the body: a 32-bit type followed by
+// the fields.  Both ends run on the same machine, so the fields use native
+// byte order, and wchar_t is UTF-16 on both.
+class MessageWriter {
+public:
+    explicit MessageWriter(uint32_t type) : m_buf(sizeof(uint32_t), '\0') {
+        putInt(type);
+    }
+    void putInt(uint32_t val) {
+        m_buf.append(reinterpret_cast<const char*>(&val), sizeof(val));
+    }
+    void putWStr(const std::wstring &str) {
+        putInt(str.size());
+        m_buf.append(reinterpret_cast<const char*>(str.data()),
+                     str.size() * sizeof(wchar_t));
+    }
+    bool send(int fd) {
+        const uint32_t len = m_buf.size() - sizeof(uint32_t);
+        memcpy(&m_buf[0], &len, sizeof(len));
+        return writeAll(fd, m_buf.data(), m_buf.size());
+    }
+
+private:
+    std::string m_buf;
+};
+
+class MessageReader {
+public:
+    MessageReader() : m_pos(0) {}
+    // Reads the next message and its type.  Returns false on EOF, an error,
+    // or a malformed message.
+    bool receive(int fd, uint32_t &type) {
+        uint32_t len = 0;
+        if (!readAll(fd, &len, sizeof(len)) || len > kMaxMessageSize) {
+            return false;
+        }
+        m_buf.resize(len);
+        m_pos = 0;
+        if (len > 0 && !readAll(fd, &m_buf[0], len)) {
+            return false;
+        }
+        return getInt(type);
+    }
+    bool getInt(uint32_t &val) {
+        if (m_buf.size() - m_pos < sizeof(val)) {
+            return false;
+        }
+        memcpy(&val, &m_buf[m_pos], sizeof(val));
+        m_pos += sizeof(val);
+        return true;
+    }
+    bool getWStr(std::wstring &str) {
+        uint32_t len = 0;
+        if (!getInt(len) || (m_buf.size() - m_pos) / sizeof(wchar_t) < len) {
+            return false;
+        }
+        str.resize(len);
+        if (len > 0) {
+            memcpy(&str[0], &m_buf[m_pos], len * sizeof(wchar_t));
+        }
+        m_pos += len * sizeof(wchar_t);
+        return true;
+    }
+
+private:
+    std::string m_buf;
+    size_t m_pos;
+};
+
+// WINPTY_SERVER_SOCKET overrides the default per-user socket path.
+std::string serverSocketPath() {
+    const char *path = getenv("WINPTY_SERVER_SOCKET");
+    if (path != NULL && path[0] != '\0') {
+        return path;
+    }
+    char buf[64];
+    sprintf(buf, "/tmp/winpty-server-%u.sock",
+            static_cast<unsigned int>(getuid()));
+    return buf;
+}
+
+bool makeSocketAddress(const std::string &path, sockaddr_un &addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+int connectToServer(const std::string &path) {
+    sockaddr_un addr;
+    if (!makeSocketAddress(path, addr)) {
+        return -1;
+    }
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+std::wstring errorText(winpty_error_ptr_t err) {
+    const wchar_t *msg = winpty_error_msg(err);
+    return msg != NULL ? msg : L"";
+}
+
+struct Connection {
+    winpty_pool_t *pool;
+    int fd;
+};
+
+// Starts the requested child in a pooled agent, then serves the session's
+// requests until the client closes it.
+void serveConnection(winpty_pool_t *pool, int fd) {
+    MessageReader request;
+    uint32_t type = 0;
+    uint32_t cols = 0;
+    uint32_t rows = 0;
+    std::wstring cmdline;
+    std::wstring cwd;
+    std::wstring env;
+    if (!request.receive(fd, type) || type != kSpawnRequest ||
+            !request.getInt(cols) || !request.getInt(rows) ||
+            !request.getWStr(cmdline) || !request.getWStr(cwd) ||
+            !request.getWStr(env)) {
+        trace("server: malformed spawn request");
+        return;
+    }
+
+    MessageWriter reply(kSpawnReply);
+    winpty_error_ptr_t err = NULL;
+    winpty_t *wp = winpty_open_from_pool(pool, &err);
+    if (wp == NULL) {
+        reply.putInt(ServerSession::kSpawnOpenFailed);
+        reply.putInt(0);
+        reply.putWStr(errorText(err));
+        winpty_error_free(err);
+        reply.send(fd);
+        return;
+    }
+    winpty_error_free(err);
+    winpty_set_size(wp, cols, rows, NULL);
+
+    winpty_spawn_config_t *spawnCfg = winpty_spawn_config_new(
+            WINPTY_SPAWN_FLAG_AUTO_SHUTDOWN,
+            NULL, cmdline.c_str(), cwd.empty() ? NULL : cwd.c_str(),
+            env.empty() ? NULL : env.c_str(), NULL);
+    assert(spawnCfg != NULL);
+    HANDLE childHandle = NULL;
+    DWORD lastError = 0;
+    err = NULL;
+    const BOOL spawnRet = winpty_spawn(wp, spawnCfg, &childHandle, NULL,
+                                       &lastError, &err);
+    winpty_spawn_config_free(spawnCfg);
+    if (!spawnRet) {
+        reply.putInt(
+            winpty_error_code(err) == WINPTY_ERROR_SPAWN_CREATE_PROCESS_FAILED
+                ? ServerSession::kSpawnCreateProcessFailed
+                : ServerSession::kSpawnFailed);
+        reply.putInt(lastError);
+        reply.putWStr(errorText(err));
+        winpty_error_free(err);
+        reply.send(fd);
+        winpty_free(wp);
+        return;
+    }
+    winpty_error_free(err);
+    reply.putInt(ServerSession::kSpawnOk);
+    reply.putInt(0);
+    reply.putWStr(std::wstring());
+    reply.putWStr(winpty_conin_name(wp));
+    reply.putWStr(winpty_conout_name(wp));
+    bool clientAlive = reply.send(fd);
+
+    // A broken connection also ends the session, so a client that dies
+    // doesn't leak its agent.
+    MessageReader msg;
+    while (clientAlive && msg.receive(fd, type) && type != kCloseRequest) {
+        if (type == kResizeRequest && msg.getInt(cols) && msg.getInt(rows)) {
+            winpty_set_size(wp, cols, rows, NULL);
+        }
+    }
+    winpty_free(wp);
+
+    DWORD exitCode = 0;
+    if (!GetExitCodeProcess(childHandle, &exitCode)) {
+        exitCode = 1;
+    }
+    CloseHandle(childHandle);
+    MessageWriter exitReply(kExitReply);
+    exitReply.putInt(exitCode);
+    exitReply.send(fd);
+}
+
+void *connectionThread(void *arg) {
+    Connection *conn = static_cast<Connection*>(arg);
+    serveConnection(conn->pool, conn->fd);
+    ::close(conn->fd);
+    delete conn;
+    return NULL;
+}
+
+} // anonymous namespace
+
+ServerSession::ServerSession(int fd) :
+    m_fd(fd), m_closed(false), m_exitCode(1) {}
+
+ServerSession::~ServerSession() {
+    ::close(m_fd);
+}
+
+ServerSession *ServerSession::connect() {
+    const int fd = connectToServer(serverSocketPath());
+    if (fd == -1) {
+        return NULL;
+    }
+    trace("connected to winpty server");
+    return new ServerSession(fd);
+}
+
+ServerSession::SpawnResult ServerSession::spawn(int cols, int rows,
+                                                const std::wstring &cmdline,
+                                                const std::wstring &cwd,
+                                                const std::wstring &env) {
+    SpawnResult ret;
+    ret.status = kSpawnServerLost;
+    ret.lastError = 0;
+    MessageWriter request(kSpawnRequest);
+    request.putInt(cols);
+    request.putInt(rows);
+    request.putWStr(cmdline);
+    request.putWStr(cwd);
+    request.putWStr(env);
+    MessageReader reply;
+    uint32_t type = 0;
+    uint32_t status = 0;
+    uint32_t lastError = 0;
+    if (!request.send(m_fd) ||
+            !reply.receive(m_fd, type) || type != kSpawnReply ||
+            !reply.getInt(status) || !reply.getInt(lastError) ||
+            !reply.getWStr(ret.message)) {
+        return ret;
+    }
+    if (status == kSpawnOk &&
+            (!reply.getWStr(m_coninName) || !reply.getWStr(m_conoutName))) {
+        return ret;
+    }
+    ret.status = static_cast<SpawnStatus>(status);
+    ret.lastError = lastError;
+    return ret;
+}
+
+void ServerSession::setSize(int cols, int rows) {
+    MessageWriter request(kResizeRequest);
+    request.putInt(cols);
+    request.putInt(rows);
+    request.send(m_fd);
+}
+
+void ServerSession::close() {
+    if (m_closed) {
+        return;
+    }
+    m_closed = true;
+    MessageWriter request(kCloseRequest);
+    MessageReader reply;
+    uint32_t type = 0;
+    uint32_t exitCode = 0;
+    if (request.send(m_fd) &&
+            reply.receive(m_fd, type) && type == kExitReply &&
+            reply.getInt(exitCode)) {
+        m_exitCode = exitCode;
+    }
+}
+
+int runServer(const char *program) {
+    const std::string path = serverSocketPath();
+    sockaddr_un addr;
+    if (!makeSocketAddress(path, addr)) {
+        fprintf(stderr, "%s: error: socket path is too long: %s\n",
+            program, path.c_str());
+        return 1;
+    }
+
+    // Don't steal the socket from a running server, but do replace the
+    // socket file a dead one left behind.
+    const int probe = connectToServer(path);
+    if (probe != -1) {
+        ::close(probe);
+        fprintf(stderr, "%s: error: a server is already listening on %s\n",
+            program, path.c_str());
+        return 1;
+    }
+    unlink(path.c_str());
+
+    const int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd == -1) {
+        perror("socket failed");
+        return 1;
+    }
+    // Only this user may connect and run programs under the server.
+    const mode_t oldMask = umask(077);
+    const int bindRet =
+        bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    umask(oldMask);
+    if (bindRet != 0 || listen(listenFd, 16) != 0) {
+        fprintf(stderr, "%s: error: cannot listen on %s: %s\n",
+            program, path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    winpty_config_t *cfg = winpty_config_new(
+        WINPTY_FLAG_ALLOW_CURPROC_DESKTOP_CREATION, NULL);
+    assert(cfg != NULL);
+    winpty_error_ptr_t err = NULL;
+    winpty_pool_t *pool = winpty_pool_new(cfg, kServerPoolSize, &err);
+    winpty_config_free(cfg);
+    if (pool == NULL) {
+        fprintf(stderr, "%s: error: cannot start the agent pool (code %u)\n",
+            program, static_cast<unsigned int>(winpty_error_code(err)));
+        winpty_error_free(err);
+        return 1;
+    }
+    winpty_error_free(err);
+
+    // A client that disappears mid-reply shouldn't kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "%s: listening on %s\n", program, path.c_str());
+
+    while (true) {
+        const int fd = accept(listenFd, NULL, NULL);
+        if (fd == -1) {
+            if (errno != EINTR) {
+                trace("server: accept failed: errno=%d", errno);
+            }
+            continue;
+        }
+        Connection *conn = new Connection;
+        conn->pool = pool;
+        conn->fd = fd;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connectionThread, conn) != 0) {
+            trace("server: pthread_create failed");
+            ::close(fd);
+            delete conn;
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2016 Ryan Prichard
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to
+// deal in the Software without restriction, including without limitation the
+// rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+// sell copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+// FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+// IN THE SOFTWARE.
+
+// winpty --server keeps a pool of started agents.  Later winpty invocations
+// connect to it over a per-user Unix socket and run their child in one of
+// those agents, skipping agent startup.  The socket stays open for the
+// session: it carries resize requests, and closing the session frees the
+// agent and returns the child's exit code.
+
+#ifndef UNIX_ADAPTER_SERVER_H
+#define UNIX_ADAPTER_SERVER_H
+
+#include <windows.h>
+
+#include <string>
+
+// The agent connection the I/O loop drives.
+class SessionControl {
+public:
+    virtual ~SessionControl() {}
+    virtual void setSize(int cols, int rows) = 0;
+    // Frees the agent, which closes the CONIN and CONOUT pipes.
+    virtual void close() = 0;
+};
+
+class ServerSession : public SessionControl {
+public:
+    enum SpawnStatus {
+        // The server went away without replying.  Run the child locally.
+        kSpawnServerLost,
+        kSpawnOk,
+        kSpawnOpenFailed,
+        kSpawnCreateProcessFailed,
+        kSpawnFailed
+    };
+
+    struct SpawnResult {
+        SpawnStatus status;
+        DWORD lastError;
+        std::wstring message;
+    };
+
+    // Returns NULL if no server accepts the connection.
+    static ServerSession *connect();
+    virtual ~ServerSession();
+
+    // env is an environment block, with its embedded NULs.
+    SpawnResult spawn(int cols, int rows,
+                      const std::wstring &cmdline,
+                      const std::wstring &cwd,
+                      const std::wstring &env);
+    const std::wstring &coninName() const { return m_coninName; }
+    const std::wstring &conoutName() const { return m_conoutName; }
+
+    virtual void setSize(int cols, int rows);
+    virtual void close();
+    // Valid after close.  Like GetExitCodeProcess, this is STILL_ACTIVE if
+    // the child outlived the agent.
+    DWORD exitCode() const { return m_exitCode; }
+
+private:
+    explicit ServerSession(int fd);
+    ServerSession(const ServerSession &other);
+    ServerSession &operator=(const ServerSession &other);
+
+    int m_fd;
+    bool m_closed;
+    DWORD m_exitCode;
+    std::wstring m_coninName;
+    std::wstring m_conoutName;
+};
+
+// Runs the server until it is killed.  Returns an exit code if it can't
+// start.
+int runServer(const char *program);
+
+#endif // UNIX_ADAPTER_SERVER_H
@@ -55,15 +55,41 @@ bool writeAll(int fd, const void *buffer, size_t size) {
     return true;
 }
 
+// Read exactly size bytes from a blocking fd.
+bool readAll(int fd, void *buffer, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        int ret = read(fd,
+                       reinterpret_cast<char*>(buffer) + done,
+                       size - done);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return false;
+        }
+        done += ret;
+    }
+    return true;
+}
+
 bool writeStr(int fd, const char *str) {
     return writeAll(fd, str, strlen(str));
 }
 
-void selectWrapper(const char *diagName, int nfds, fd_set *readfds) {
-    int ret = select(nfds, readfds, NULL, NULL, NULL);
+void selectWrapper(const char *diagName, int nfds, fd_set *readfds,
+                   fd_set *writefds, int timeoutMs) {
+    timeval timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    int ret = select(nfds, readfds, writefds, NULL,
+                     timeoutMs < 0 ? NULL : &timeout);
     if (ret < 0) {
         if (errno == EINTR) {
             FD_ZERO(readfds);
+            if (writefds != NULL) {
+                FD_ZERO(writefds);
+            }
             return;
         }
 #ifdef WINPTY_TARGET_MSYS1
@@ -76,6 +102,9 @@ void selectWrapper(const char *diagName, int nfds, fd_set *readfds) {
             trace("%s select returned EAGAIN: interpreting like EINTR",
                 diagName);
             FD_ZERO(readfds);
+            if (writefds != NULL) {
+                FD_ZERO(writefds);
+            }
             return;
         }
 #endif
@@ -25,7 +25,11 @@
 #include <sys/select.h>
 
 bool writeAll(int fd, const void *buffer, size_t size);
+// Returns false on error or if EOF comes first.
+bool readAll(int fd, void *buffer, size_t size);
 bool writeStr(int fd, const char *str);
-void selectWrapper(const char *diagName, int nfds, fd_set *readfds);
+// A negative timeoutMs waits indefinitely.
+void selectWrapper(const char *diagName, int nfds, fd_set *readfds,
+                   fd_set *writefds=NULL, int timeoutMs=-1);
 
 #endif // UNIX_ADAPTER_UTIL_H
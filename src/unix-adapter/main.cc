@@ -25,6 +25,7 @@
 #include <assert.h>
 #include <cygwin/version.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,6 +36,7 @@
 #include <termios.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <map>
 #include <string>
 #include <utility>
@@ -46,6 +48,7 @@
 #include "../shared/WinptyVersion.h"
 #include "InputHandler.h"
 #include "OutputHandler.h"
+#include "Server.h"
 #include "Util.h"
 #include "WakeupFd.h"
 
@@ -151,6 +154,34 @@ static void restoreTerminalMode(const SavedTermiosMode &original)
     }
 }
 
+// The I/O handlers expect non-blocking fds.  The flag belongs to the open
+// file description, which the tty shares with other processes, so it is
+// restored on exit.
+struct SavedFdFlags {
+    int flags[3];
+};
+
+static SavedFdFlags setNonBlockingFds()
+{
+    SavedFdFlags ret;
+    for (int i = 0; i < 3; ++i) {
+        ret.flags[i] = fcntl(i, F_GETFL);
+        if (ret.flags[i] != -1) {
+            fcntl(i, F_SETFL, ret.flags[i] | O_NONBLOCK);
+        }
+    }
+    return ret;
+}
+
+static void restoreFdFlags(const SavedFdFlags &original)
+{
+    for (int i = 0; i < 3; ++i) {
+        if (original.flags[i] != -1) {
+            fcntl(i, F_SETFL, original.flags[i]);
+        }
+    }
+}
+
 static void debugShowKey(bool allowNonTtys)
 {
     printf("\nPress any keys -- Ctrl-D exits\n\n");
@@ -459,10 +490,13 @@ void setupWin32Environment()
 static void usage(const char *program, int exitCode)
 {
     printf("Usage: %s [options] [--] program [args]\n", program);
+    printf("       %s --server\n", program);
     printf("\n");
     printf("Options:\n");
     printf("  -h, --help  Show this help message\n");
     printf("  --mouse     Enable terminal mouse input\n");
+    printf("  --no-server Start an agent here even if a server is running\n");
+    printf("  --server    Keep agents started for later winpty invocations\n");
     printf("  --showkey   Dump STDIN escape sequences\n");
     printf("  --version   Show the winpty version number\n");
     exit(exitCode);
@@ -471,6 +505,8 @@ static void usage(const char *program, int exitCode)
 struct Arguments {
     std::vector<std::string> childArgv;
     bool mouseInput;
+    bool server;
+    bool noServer;
     bool testAllowNonTtys;
     bool testConerr;
     bool testPlainOutput;
@@ -480,6 +516,8 @@ struct Arguments {
 static void parseArguments(int argc, char *argv[], Arguments &out)
 {
     out.mouseInput = false;
+    out.server = false;
+    out.noServer = false;
     out.testAllowNonTtys = false;
     out.testConerr = false;
     out.testPlainOutput = false;
@@ -494,6 +532,10 @@ static void parseArguments(int argc, char *argv[], Arguments &out)
                 usage(program, 0);
             } else if (arg == "--mouse") {
                 out.mouseInput = true;
+            } else if (arg == "--server") {
+                out.server = true;
+            } else if (arg == "--no-server") {
+                out.noServer = true;
             } else if (arg == "--showkey") {
                 doShowKeys = true;
             } else if (arg == "--version") {
@@ -526,6 +568,12 @@ static void parseArguments(int argc, char *argv[], Arguments &out)
         debugShowKey(out.testAllowNonTtys);
         exit(0);
     }
+    if (out.server) {
+        if (out.childArgv.size() != 0) {
+            usage(program, 1);
+        }
+        return;
+    }
     if (out.childArgv.size() == 0) {
         usage(program, 1);
     }
@@ -578,6 +626,221 @@ static std::string formatErrorMessage(DWORD err)
     return ret;
 }
 
+// Resizing a terminal window generates a flood of SIGWINCH signals, and each
+// winpty_set_size is a round trip to the agent, which resizes the console.
+// Send the latest size once the size has been steady for a moment, but at
+// least this often while it keeps changing.
+const int kResizeQuietMs = 30;
+const int kResizeMaxDelayMs = 150;
+
+class ResizeDebouncer {
+public:
+    explicit ResizeDebouncer(const winsize &sz) :
+        m_applied(sz), m_latest(sz), m_pending(false),
+        m_firstChangeTick(0), m_lastChangeTick(0) {}
+
+    void noteSize(const winsize &sz) {
+        if (memcmp(&sz, &m_latest, sizeof(sz)) == 0) {
+            return;
+        }
+        const DWORD now = GetTickCount();
+        m_latest = sz;
+        if (!m_pending) {
+            m_pending = true;
+            m_firstChangeTick = now;
+        }
+        m_lastChangeTick = now;
+    }
+
+    // Returns how long the caller may wait before calling flush again, or
+    // -1 if no resize is pending.
+    int timeoutMs() {
+        if (!m_pending) {
+            return -1;
+        }
+        const DWORD now = GetTickCount();
+        const int quiet = kResizeQuietMs -
+            static_cast<int>(now - m_lastChangeTick);
+        const int overdue = kResizeMaxDelayMs -
+            static_cast<int>(now - m_firstChangeTick);
+        return std::max(0, std::min(quiet, overdue));
+    }
+
+    void flush(SessionControl &session) {
+        if (!m_pending || timeoutMs() > 0) {
+            return;
+        }
+        m_pending = false;
+        if (memcmp(&m_latest, &m_applied, sizeof(m_latest)) != 0) {
+            m_applied = m_latest;
+            session.setSize(m_applied.ws_col, m_applied.ws_row);
+        }
+    }
+
+private:
+    winsize m_applied;
+    winsize m_latest;
+    bool m_pending;
+    DWORD m_firstChangeTick;
+    DWORD m_lastChangeTick;
+};
+
+// Run the terminal I/O until the agent is gone and the output is drained.
+// A single thread moves all of the data.  The handlers do overlapped I/O on
+// the winpty pipes and non-blocking I/O on the fds, and a pipe I/O that
+// pends sets the main wakeup fd when it finishes.
+static void runIoLoop(SessionControl &session, HANDLE conin, HANDLE conout,
+                      HANDLE conerr, const winsize &sz)
+{
+    ResizeDebouncer resize(sz);
+    InputHandler inputHandler(conin, STDIN_FILENO, mainWakeup());
+    OutputHandler outputHandler(conout, STDOUT_FILENO, mainWakeup());
+    OutputHandler *errorHandler = NULL;
+    if (conerr != NULL) {
+        errorHandler = new OutputHandler(conerr, STDERR_FILENO, mainWakeup());
+    }
+
+    fd_set readfds;
+    fd_set writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    bool agentFreed = false;
+    while (true) {
+        if (!agentFreed) {
+            inputHandler.service(readfds);
+        }
+        outputHandler.service();
+        if (errorHandler != NULL) {
+            errorHandler->service();
+        }
+
+        const bool outputComplete = outputHandler.isComplete() &&
+            (errorHandler == NULL || errorHandler->isComplete());
+        if (agentFreed && outputComplete) {
+            break;
+        }
+
+        // Check for an I/O handler shutting down (possibly indicating that the
+        // child process has exited).  Kill the agent connection.  This will
+        // kill the agent, closing the CONIN and CONOUT pipes on the agent
+        // pipe, and the output handlers finish once they see that.
+        if (!agentFreed &&
+                (inputHandler.isComplete() || outputHandler.isComplete() ||
+                    (errorHandler != NULL && errorHandler->isComplete()))) {
+            session.close();
+            agentFreed = true;
+            continue;
+        }
+
+        FD_ZERO(&readfds);
+        FD_ZERO(&writefds);
+        int maxFd = mainWakeup().fd();
+        FD_SET(mainWakeup().fd(), &readfds);
+        if (!agentFreed) {
+            inputHandler.prepareSelect(readfds, writefds, maxFd);
+        }
+        outputHandler.prepareSelect(readfds, writefds, maxFd);
+        if (errorHandler != NULL) {
+            errorHandler->prepareSelect(readfds, writefds, maxFd);
+        }
+        selectWrapper("main thread", maxFd + 1, &readfds, &writefds,
+                      agentFreed ? -1 : resize.timeoutMs());
+        mainWakeup().reset();
+
+        // Check for terminal resize.
+        if (!agentFreed) {
+            winsize sz2;
+            if (ioctl(STDIN_FILENO, TIOCGWINSZ, &sz2) == 0) {
+                resize.noteSize(sz2);
+            }
+            resize.flush(session);
+        }
+    }
+
+    delete errorHandler;
+}
+
+// A session whose agent this process started.
+class LocalSession : public SessionControl {
+public:
+    explicit LocalSession(winpty_t *wp) : m_wp(wp) {}
+    virtual void setSize(int cols, int rows) {
+        winpty_set_size(m_wp, cols, rows, NULL);
+    }
+    virtual void close() {
+        winpty_free(m_wp);
+        m_wp = NULL;
+    }
+
+private:
+    winpty_t *m_wp;
+};
+
+static std::wstring currentEnvironmentBlock()
+{
+    wchar_t *env = GetEnvironmentStringsW();
+    if (env == NULL) {
+        return std::wstring();
+    }
+    const wchar_t *end = env;
+    while (*end != L'\0') {
+        end += wcslen(end) + 1;
+    }
+    std::wstring ret(env, end - env + 1);
+    FreeEnvironmentStringsW(env);
+    return ret;
+}
+
+// Ask a winpty --server to start the child in one of its agents.  The
+// server's agents don't share this process's environment or directory, so
+// the request carries both.  Returns NULL, so that the caller starts an agent
+// itself, if no server takes the request.  Exits if the server couldn't
+// start the child.
+static ServerSession *handOffToServer(const char *program,
+                                      const std::string &cmdLine,
+                                      const wchar_t *cmdLineW,
+                                      const winsize &sz)
+{
+    ServerSession *server = ServerSession::connect();
+    if (server == NULL) {
+        return NULL;
+    }
+    char cwd[PATH_MAX];
+    std::wstring cwdW;
+    if (getcwd(cwd, sizeof(cwd)) != NULL) {
+        wchar_t *tmp = heapMbsToWcs(convertPosixPathToWin(cwd).c_str());
+        cwdW = tmp;
+        delete [] tmp;
+    }
+    const ServerSession::SpawnResult result = server->spawn(
+        sz.ws_col, sz.ws_row, cmdLineW, cwdW, currentEnvironmentBlock());
+    switch (result.status) {
+        case ServerSession::kSpawnOk:
+            return server;
+        case ServerSession::kSpawnServerLost:
+            trace("winpty server went away; starting an agent locally");
+            delete server;
+            return NULL;
+        case ServerSession::kSpawnOpenFailed:
+            fprintf(stderr, "Error creating winpty: %s\n",
+                wcsToMbs(result.message.c_str()).c_str());
+            break;
+        case ServerSession::kSpawnCreateProcessFailed:
+            fprintf(stderr, "%s: error: cannot start '%s': %s\n",
+                program,
+                cmdLine.c_str(),
+                formatErrorMessage(result.lastError).c_str());
+            break;
+        default:
+            fprintf(stderr, "%s: error: cannot start '%s': internal error: %s\n",
+                program,
+                cmdLine.c_str(),
+                wcsToMbs(result.message.c_str()).c_str());
+            break;
+    }
+    exit(1);
+}
+
 int main(int argc, char *argv[])
 {
     setlocale(LC_ALL, "");
@@ -589,53 +852,50 @@ int main(int argc, char *argv[])
 
     setupWin32Environment();
 
+    if (args.server) {
+        return runServer(argv[0]);
+    }
+
     winsize sz = { 0 };
     sz.ws_col = 80;
     sz.ws_row = 25;
     ioctl(STDIN_FILENO, TIOCGWINSZ, &sz);
 
-    DWORD agentFlags = WINPTY_FLAG_ALLOW_CURPROC_DESKTOP_CREATION;
-    if (args.testConerr)        { agentFlags |= WINPTY_FLAG_CONERR; }
-    if (args.testPlainOutput)   { agentFlags |= WINPTY_FLAG_PLAIN_OUTPUT; }
-    if (args.testColorEscapes)  { agentFlags |= WINPTY_FLAG_COLOR_ESCAPES; }
-    winpty_config_t *agentCfg = winpty_config_new(agentFlags, NULL);
-    assert(agentCfg != NULL);
-    winpty_config_set_initial_size(agentCfg, sz.ws_col, sz.ws_row);
-    if (args.mouseInput) {
-        winpty_config_set_mouse_mode(agentCfg, WINPTY_MOUSE_MODE_FORCE);
-    }
-
-    winpty_error_ptr_t openErr = NULL;
-    winpty_t *wp = winpty_open(agentCfg, &openErr);
-    if (wp == NULL) {
-        fprintf(stderr, "Error creating winpty: %s\n",
-            wcsToMbs(winpty_error_msg(openErr)).c_str());
-        exit(1);
-    }
-    winpty_config_free(agentCfg);
-    winpty_error_free(openErr);
-
-    HANDLE conin = CreateFileW(winpty_conin_name(wp), GENERIC_WRITE, 0, NULL,
-                               OPEN_EXISTING, 0, NULL);
-    HANDLE conout = CreateFileW(winpty_conout_name(wp), GENERIC_READ, 0, NULL,
-                                OPEN_EXISTING, 0, NULL);
-    assert(conin != INVALID_HANDLE_VALUE);
-    assert(conout != INVALID_HANDLE_VALUE);
-    HANDLE conerr = NULL;
-    if (args.testConerr) {
-        conerr = CreateFileW(winpty_conerr_name(wp), GENERIC_READ, 0, NULL,
-                             OPEN_EXISTING, 0, NULL);
-        assert(conerr != INVALID_HANDLE_VALUE);
+    args.childArgv[0] = findProgram(argv[0], args.childArgv[0]);
+    const std::string cmdLine = argvToCommandLine(args.childArgv);
+    wchar_t *cmdLineW = heapMbsToWcs(cmdLine.c_str());
+
+    // The server's agents use the default configuration, so only a default
+    // invocation can use them.
+    ServerSession *server = NULL;
+    if (!args.noServer && !args.mouseInput && !args.testConerr &&
+            !args.testPlainOutput && !args.testColorEscapes) {
+        server = handOffToServer(argv[0], cmdLine, cmdLineW, sz);
     }
 
+    winpty_t *wp = NULL;
     HANDLE childHandle = NULL;
+    std::wstring coninName;
+    std::wstring conoutName;
+    std::wstring conerrName;
 
-    {
-        // Start the child process under the console.
-        args.childArgv[0] = findProgram(argv[0], args.childArgv[0]);
-        std::string cmdLine = argvToCommandLine(args.childArgv);
-        wchar_t *cmdLineW = heapMbsToWcs(cmdLine.c_str());
+    if (server != NULL) {
+        coninName = server->coninName();
+        conoutName = server->conoutName();
+    } else {
+        DWORD agentFlags = WINPTY_FLAG_ALLOW_CURPROC_DESKTOP_CREATION;
+        if (args.testConerr)        { agentFlags |= WINPTY_FLAG_CONERR; }
+        if (args.testPlainOutput)   { agentFlags |= WINPTY_FLAG_PLAIN_OUTPUT; }
+        if (args.testColorEscapes)  { agentFlags |= WINPTY_FLAG_COLOR_ESCAPES; }
+        winpty_config_t *agentCfg = winpty_config_new(agentFlags, NULL);
+        assert(agentCfg != NULL);
+        winpty_config_set_initial_size(agentCfg, sz.ws_col, sz.ws_row);
+        if (args.mouseInput) {
+            winpty_config_set_mouse_mode(agentCfg, WINPTY_MOUSE_MODE_FORCE);
+        }
 
+        // Start the child process under the console.  Sending the spawn
+        // with the open saves a round trip to the agent.
         winpty_spawn_config_t *spawnCfg = winpty_spawn_config_new(
                 WINPTY_SPAWN_FLAG_AUTO_SHUTDOWN,
                 NULL, cmdLineW, NULL, NULL, NULL);
@@ -643,11 +903,12 @@ int main(int argc, char *argv[])
 
         winpty_error_ptr_t spawnErr = NULL;
         DWORD lastError = 0;
-        BOOL spawnRet = winpty_spawn(wp, spawnCfg, &childHandle, NULL,
+        wp = winpty_open_and_spawn(agentCfg, spawnCfg, &childHandle, NULL,
             &lastError, &spawnErr);
+        winpty_config_free(agentCfg);
         winpty_spawn_config_free(spawnCfg);
 
-        if (!spawnRet) {
+        if (wp == NULL) {
             winpty_result_t spawnCode = winpty_error_code(spawnErr);
             if (spawnCode == WINPTY_ERROR_SPAWN_CREATE_PROCESS_FAILED) {
                 fprintf(stderr, "%s: error: cannot start '%s': %s\n",
@@ -655,75 +916,64 @@ int main(int argc, char *argv[])
                     cmdLine.c_str(),
                     formatErrorMessage(lastError).c_str());
             } else {
-                fprintf(stderr, "%s: error: cannot start '%s': internal error: %s\n",
-                    argv[0],
-                    cmdLine.c_str(),
+                fprintf(stderr, "Error creating winpty: %s\n",
                     wcsToMbs(winpty_error_msg(spawnErr)).c_str());
             }
             exit(1);
         }
+
+        coninName = winpty_conin_name(wp);
+        conoutName = winpty_conout_name(wp);
+        if (args.testConerr) {
+            conerrName = winpty_conerr_name(wp);
+        }
         winpty_error_free(spawnErr);
-        delete [] cmdLineW;
+    }
+    delete [] cmdLineW;
+
+    HANDLE conin = CreateFileW(coninName.c_str(), GENERIC_WRITE, 0, NULL,
+                               OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    HANDLE conout = CreateFileW(conoutName.c_str(), GENERIC_READ, 0, NULL,
+                                OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    assert(conin != INVALID_HANDLE_VALUE);
+    assert(conout != INVALID_HANDLE_VALUE);
+    HANDLE conerr = NULL;
+    if (!conerrName.empty()) {
+        conerr = CreateFileW(conerrName.c_str(), GENERIC_READ, 0, NULL,
+                             OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+        assert(conerr != INVALID_HANDLE_VALUE);
     }
 
     registerResizeSignalHandler();
     SavedTermiosMode mode =
         setRawTerminalMode(args.testAllowNonTtys, true, args.testConerr);
 
-    InputHandler inputHandler(conin, STDIN_FILENO, mainWakeup());
-    OutputHandler outputHandler(conout, STDOUT_FILENO, mainWakeup());
-    OutputHandler *errorHandler = NULL;
-    if (args.testConerr) {
-        errorHandler = new OutputHandler(conerr, STDERR_FILENO, mainWakeup());
-    }
+    const SavedFdFlags fdFlags = setNonBlockingFds();
 
-    while (true) {
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(mainWakeup().fd(), &readfds);
-        selectWrapper("main thread", mainWakeup().fd() + 1, &readfds);
-        mainWakeup().reset();
-
-        // Check for terminal resize.
-        {
-            winsize sz2;
-            ioctl(STDIN_FILENO, TIOCGWINSZ, &sz2);
-            if (memcmp(&sz, &sz2, sizeof(sz)) != 0) {
-                sz = sz2;
-                winpty_set_size(wp, sz.ws_col, sz.ws_row, NULL);
-            }
-        }
+    LocalSession localSession(wp);
+    SessionControl &session = server != NULL
+        ? static_cast<SessionControl&>(*server)
+        : static_cast<SessionControl&>(localSession);
+    runIoLoop(session, conin, conout, conerr, sz);
 
-        // Check for an I/O handler shutting down (possibly indicating that the
-        // child process has exited).
-        if (inputHandler.isComplete() || outputHandler.isComplete() ||
-                (errorHandler != NULL && errorHandler->isComplete())) {
-            break;
-        }
-    }
-
-    // Kill the agent connection.  This will kill the agent, closing the CONIN
-    // and CONOUT pipes on the agent pipe, prompting our I/O handler to shut
-    // down.
-    winpty_free(wp);
-
-    inputHandler.shutdown();
-    outputHandler.shutdown();
     CloseHandle(conin);
     CloseHandle(conout);
-
-    if (errorHandler != NULL) {
-        errorHandler->shutdown();
-        delete errorHandler;
+    if (conerr != NULL) {
         CloseHandle(conerr);
     }
 
+    restoreFdFlags(fdFlags);
     restoreTerminalMode(mode);
 
     DWORD exitCode = 0;
-    if (!GetExitCodeProcess(childHandle, &exitCode)) {
-        exitCode = 1;
+    if (server != NULL) {
+        exitCode = server->exitCode();
+        delete server;
+    } else {
+        if (!GetExitCodeProcess(childHandle, &exitCode)) {
+            exitCode = 1;
+        }
+        CloseHandle(childHandle);
     }
-    CloseHandle(childHandle);
     return exitCode;
 }
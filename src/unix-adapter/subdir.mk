@@ -25,6 +25,8 @@ $(eval $(call def_unix_target,unix-adapter,))
 UNIX_ADAPTER_OBJECTS = \
 	build/unix-adapter/unix-adapter/InputHandler.o \
 	build/unix-adapter/unix-adapter/OutputHandler.o \
+	build/unix-adapter/unix-adapter/OverlappedIo.o \
+	build/unix-adapter/unix-adapter/Server.o \
 	build/unix-adapter/unix-adapter/Util.o \
 	build/unix-adapter/unix-adapter/WakeupFd.o \
 	build/unix-adapter/unix-adapter/main.o \
@@ -37,7 +37,6 @@
             ],
             'libraries' : [
                 '-ladvapi32',
-                '-lshell32',
                 '-luser32',
             ],
             'msvs_settings': {
@@ -52,30 +51,57 @@
                 'agent/Agent.cc',
                 'agent/AgentCreateDesktop.h',
                 'agent/AgentCreateDesktop.cc',
+                'agent/ByteQueue.h',
+                'agent/CharInfoKernels.cc',
+                'agent/CharInfoKernels.h',
+                'agent/ConsoleApiStats.cc',
+                'agent/ConsoleApiStats.h',
+                'agent/ConsoleBuffer.h',
+                'agent/ConsoleEventHook.cc',
+                'agent/ConsoleEventHook.h',
                 'agent/ConsoleFont.cc',
                 'agent/ConsoleFont.h',
+                'agent/ConsoleFrameFile.cc',
+                'agent/ConsoleFrameFile.h',
+                'agent/ConsoleFrameRecorder.cc',
+                'agent/ConsoleFrameRecorder.h',
                 'agent/ConsoleInput.cc',
                 'agent/ConsoleInput.h',
                 'agent/ConsoleInputReencoding.cc',
                 'agent/ConsoleInputReencoding.h',
                 'agent/ConsoleLine.cc',
                 'agent/ConsoleLine.h',
+                'agent/ConsoleStateProbe.h',
                 'agent/Coord.h',
+                'agent/CpuCycles.cc',
+                'agent/CpuCycles.h',
                 'agent/DebugShowInput.h',
                 'agent/DebugShowInput.cc',
                 'agent/DefaultInputMap.h',
                 'agent/DefaultInputMap.cc',
+                'agent/DefaultInputMapImage.cc',
                 'agent/DsrSender.h',
+                'agent/EtwTrace.h',
+                'agent/EtwTrace.cc',
+                'agent/EscapeBuilder.h',
                 'agent/EventLoop.h',
                 'agent/EventLoop.cc',
                 'agent/InputMap.h',
                 'agent/InputMap.cc',
+                'agent/InputThread.h',
+                'agent/InputThread.cc',
                 'agent/LargeConsoleRead.h',
                 'agent/LargeConsoleRead.cc',
                 'agent/NamedPipe.h',
                 'agent/NamedPipe.cc',
+                'agent/PseudoConsole.h',
+                'agent/PseudoConsole.cc',
                 'agent/Scraper.h',
                 'agent/Scraper.cc',
+                'agent/ScrollbackHistory.h',
+                'agent/ScrollbackHistory.cc',
+                'agent/SessionRecorder.h',
+                'agent/SessionRecorder.cc',
                 'agent/SimplePool.h',
                 'agent/SmallRect.h',
                 'agent/Terminal.h',
@@ -85,8 +111,11 @@
                 'agent/Win32Console.h',
                 'agent/Win32ConsoleBuffer.cc',
                 'agent/Win32ConsoleBuffer.h',
+                'agent/WorkerThread.cc',
+                'agent/WorkerThread.h',
                 'agent/main.cc',
                 'shared/AgentMsg.h',
+                'shared/AgentMsgCodec.h',
                 'shared/BackgroundDesktop.h',
                 'shared/BackgroundDesktop.cc',
                 'shared/Buffer.h',
@@ -95,9 +124,15 @@
                 'shared/DebugClient.cc',
                 'shared/GenRandom.h',
                 'shared/GenRandom.cc',
+                'shared/LatencyHistogram.h',
+                'shared/LockFreeQueue.h',
                 'shared/OsModule.h',
                 'shared/OwnedHandle.h',
                 'shared/OwnedHandle.cc',
+                'shared/SharedMemoryRing.cc',
+                'shared/SharedMemoryRing.h',
+                'shared/StreamCompression.cc',
+                'shared/StreamCompression.h',
                 'shared/StringBuilder.h',
                 'shared/StringUtil.cc',
                 'shared/StringUtil.h',
@@ -141,6 +176,7 @@
                 'libwinpty/AgentLocation.h',
                 'libwinpty/winpty.cc',
                 'shared/AgentMsg.h',
+                'shared/AgentMsgCodec.h',
                 'shared/BackgroundDesktop.h',
                 'shared/BackgroundDesktop.cc',
                 'shared/Buffer.h',
@@ -149,9 +185,15 @@
                 'shared/DebugClient.cc',
                 'shared/GenRandom.h',
                 'shared/GenRandom.cc',
+                'shared/LatencyHistogram.h',
+                'shared/LockFreeQueue.h',
                 'shared/OsModule.h',
                 'shared/OwnedHandle.h',
                 'shared/OwnedHandle.cc',
+                'shared/SharedMemoryRing.cc',
+                'shared/SharedMemoryRing.h',
+                'shared/StreamCompression.cc',
+                'shared/StreamCompression.h',
                 'shared/StringBuilder.h',
                 'shared/StringUtil.cc',
                 'shared/StringUtil.h',
@@ -182,6 +224,7 @@
                 'debugserver/DebugServer.cc',
                 'shared/DebugClient.h',
                 'shared/DebugClient.cc',
+                'shared/LockFreeQueue.h',
                 'shared/OwnedHandle.h',
                 'shared/OwnedHandle.cc',
                 'shared/OsModule.h',